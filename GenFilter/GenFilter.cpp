@@ -40,6 +40,12 @@
 // 
 
 #include "GenFilter.h"
+#include "GenFilterPolicy.h"
+
+template <typename Dispatch>
+static
+NTSTATUS
+GenFilterDeviceAdd(_In_ PWDFDEVICE_INIT DeviceInit);
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -147,25 +153,105 @@ done:
 //
 //  NOTES:
 //
+//      Our devices use GENFILTER_DEVICE_DISPATCH.
 //
 ///////////////////////////////////////////////////////////////////////////////
 _Use_decl_annotations_
 NTSTATUS
 GenFilterEvtDeviceAdd(WDFDRIVER       Driver,
                       PWDFDEVICE_INIT DeviceInit)
+{
+    UNREFERENCED_PARAMETER(Driver);
+
+    return GenFilterDeviceAdd<GENFILTER_DEVICE_DISPATCH>(DeviceInit);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterForwardingEvtDeviceAdd
+//
+//    The EvtDeviceAdd for a class of device that wants the dispatcher with
+//    no policies at all, GENFILTER_FORWARDING_DISPATCH.
+//
+//  INPUTS:
+//
+//      DriverObject - Our WDFDRIVER object
+//
+//      DeviceInit   - The device initialization structure we'll
+//                     be using to create our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the driver could not
+//                      load.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Nothing in this driver adds its devices with this yet.  GenFilterSim
+//      does, to hold the dispatcher to what hand-written forwarding costs.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterForwardingEvtDeviceAdd(WDFDRIVER       Driver,
+                                PWDFDEVICE_INIT DeviceInit)
+{
+    UNREFERENCED_PARAMETER(Driver);
+
+    return GenFilterDeviceAdd<GENFILTER_FORWARDING_DISPATCH>(DeviceInit);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeviceAdd
+//
+//    Creates and sets up a filter device whose Queues use the dispatcher
+//    Dispatch.
+//
+//  INPUTS:
+//
+//      DeviceInit   - The device initialization structure we'll
+//                     be using to create our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the driver could not
+//                      load.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+template <typename Dispatch>
+static
+NTSTATUS
+GenFilterDeviceAdd(PWDFDEVICE_INIT DeviceInit)
 {
     NTSTATUS                  status;
     WDF_OBJECT_ATTRIBUTES     wdfObjectAttr;
     WDFDEVICE                 wdfDevice;
     PGENFILTER_DEVICE_CONTEXT devContext;
-    WDF_IO_QUEUE_CONFIG       ioQueueConfig;
 
 #if DBG
     DbgPrint("GenFilterEvtDeviceAdd: Adding device...\n");
 #endif
 
-    UNREFERENCED_PARAMETER(Driver);
-
     //
     // Indicate that we're creating a FILTER Device, as opposed to a FUNCTION Device.
     //
@@ -176,12 +262,24 @@ GenFilterEvtDeviceAdd(WDFDRIVER       Driver,
     //
     WdfFdoInitSetFilter(DeviceInit);
 
+    //
+    // Give our Requests whatever context our dispatcher's policies need,
+    // and see IRPs before the Framework does if they can be bypassed
+    //
+    status = Dispatch::InitializeDeviceInit(DeviceInit);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
     //
     // Setup our device attributes specifying our per-Device context
     //
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&wdfObjectAttr,
                                             GENFILTER_DEVICE_CONTEXT);
 
+    wdfObjectAttr.EvtCleanupCallback = GenFilterEvtDeviceCleanup;
+
     status = WdfDeviceCreate(&DeviceInit,
                              &wdfObjectAttr,
                              &wdfDevice);
@@ -201,60 +299,301 @@ GenFilterEvtDeviceAdd(WDFDRIVER       Driver,
     devContext->WdfDevice = wdfDevice;
 
     //
-    // Create our default Queue -- This is how we receive Requests.
+    // Set up what our dispatcher's policies need, and create the Queues it
+    // receives Requests from
+    //
+    status = Dispatch::Initialize(wdfDevice);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterEvtDeviceCleanup
+//
+//    This routine is called by the Framework when our device is being
+//    deleted.
+//
+//  INPUTS:
+//
+//      Object   - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL
+//
+//  NOTES:
+//
+//      The Framework deletes the objects we created for the device itself;
+//      this is where we get rid of anything it doesn't know about.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterEvtDeviceCleanup(WDFOBJECT Object)
+{
+    PGENFILTER_DEVICE_CONTEXT devContext;
+
+    devContext = GenFilterGetDeviceContext((WDFDEVICE)Object);
+
+    GenFilterDeferStop(devContext);
+}
+
+//
+// GenFilterGetRequestOffset
+//
+// The device offset of a read or write Request
+//
+FORCEINLINE
+LONGLONG
+GenFilterGetRequestOffset(_In_ WDFREQUEST Request)
+{
+    WDF_REQUEST_PARAMETERS params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    if (params.Type == WdfRequestTypeWrite) {
+        return params.Parameters.Write.DeviceOffset;
+    }
+
+    return params.Parameters.Read.DeviceOffset;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GENFILTER_DISPATCH::InitializeDeviceInit
+//
+//    Sets up the parts of the device initialization structure that this
+//    dispatcher's policies need, before the device is created.
+//
+//  INPUTS:
+//
+//      DeviceInit  - The device initialization structure for our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the device could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      A dispatcher with no policies never looks at a Request's context,
+//      and has nothing for pass-through mode to bypass, so it asks for
+//      neither.
+//
+///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
+_Use_decl_annotations_
+NTSTATUS
+GENFILTER_DISPATCH<Policies>::InitializeDeviceInit(PWDFDEVICE_INIT DeviceInit)
+{
+    WDF_OBJECT_ATTRIBUTES requestAttr;
+
+    if (!Policies::Enabled) {
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Every Request the Framework creates for us gets our per-Request context
     //
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig,
-                                           WdfIoQueueDispatchParallel);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttr,
+                                            GENFILTER_REQUEST_CONTEXT);
+
+    WdfDeviceInitSetRequestAttributes(DeviceInit,
+                                      &requestAttr);
 
     //
-    // Specify callbacks for those Requests that we want this driver to "see."
+    // Look at reads, writes and device controls before the Framework does,
+    // so that in pass-through mode we can send them straight down
     //
-    // Note that because this driver is a FILTER, if we do not specify a
-    // callback for a particular Request type the Framework will automatically
-    // forward all Requests that it receives of that type to our Local I/O
-    // Target.  So, for example, if you're not interested in inspecting
-    // READ Requests, you can just not specify an EvtIoRead callback and the
-    // Framework will "do the right thing" and send it along.
+    return GenFilterPassThroughInitialize(DeviceInit);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GENFILTER_DISPATCH::Initialize
+//
+//    Initializes the parts of the filter that belong to this dispatcher's
+//    policies, and creates our Queues with this dispatcher's callbacks.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the device could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Must be called last in EvtDeviceAdd: once our Queues exist, we can
+//      be given Requests.
+//
+//      A module whose policy is off is never initialized, and its part of
+//      the device context stays zeroed.  Our private IOCTLs for it report
+//      it as off, or fail with STATUS_INVALID_DEVICE_STATE.
+//
+///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
+_Use_decl_annotations_
+NTSTATUS
+GENFILTER_DISPATCH<Policies>::Initialize(WDFDEVICE Device)
+{
+    NTSTATUS                  status;
+    PGENFILTER_DEVICE_CONTEXT devContext = GenFilterGetDeviceContext(Device);
+
+    static const GENFILTER_QUEUE_CALLBACKS callbacks = {
+        EvtRead,
+        EvtWrite,
+        EvtDeviceControl,
+        Policies::Routing::Enabled,
+        Forward,
+        SendWithCallback,
+        Completing
+    };
+
+    devContext->Dispatch = &callbacks;
+
+    //
+    // Our per-processor counters, latency histograms and the sketches we
+    // attribute I/O to its requesters with
     //
-    ioQueueConfig.EvtIoRead          = GenFilterEvtRead;
-    ioQueueConfig.EvtIoWrite         = GenFilterEvtWrite;
-    ioQueueConfig.EvtIoDeviceControl = GenFilterEvtDeviceControl;
+    status = Policies::Statistics::Initialize(Device,
+                                              devContext);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
 
     //
-    // Create the queue...
+    // ...and our binary trace log, and the record of every Request we're
+    // given
     //
-    status = WdfIoQueueCreate(devContext->WdfDevice,
-                              &ioQueueConfig,
-                              WDF_NO_OBJECT_ATTRIBUTES,
-                              WDF_NO_HANDLE);
+    status = Policies::Logging::Initialize(Device,
+                                           devContext);
 
     if (!NT_SUCCESS(status)) {
-#if DBG
-        DbgPrint("WdfIoQueueCreate failed - 0x%x\n",
-                 status);
-#endif
         goto done;
     }
 
-    status = STATUS_SUCCESS;
+    //
+    // ...and our caches, read-ahead, coalescing, write gathering, worker
+    // threads, I/O limits, retries and splitting
+    //
+    status = Policies::Routing::Initialize(Device,
+                                           devContext);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // ...and the signatures we look for in the data we see, and the
+    // checksums of the sectors we read
+    //
+    status = Policies::Inspection::Initialize(Device,
+                                              devContext);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // Are we starting out in pass-through mode?
+    //
+    if (Policies::Enabled) {
+
+        GenFilterPassThroughConfigure(Device,
+                                      &devContext->PassThrough);
+    }
+
+    //
+    // Create our Queues -- This is how we receive Requests.  Reads, writes,
+    // and device controls each get a Queue of their own, so that each can
+    // have its own limit on how many Requests we send down at once.
+    //
+    status = GenFilterQueuesInitialize(Device,
+                                       &callbacks);
 
 done:
 
     return status;
 }
 
+//
+// GENFILTER_DISPATCH::Completing
+//
+// Called just before we complete a Request that we were given, wherever
+// that happens: times it, records it if it's being captured, and gives
+// back our copy of its data
+//
+template <typename Policies>
+_Use_decl_annotations_
+VOID
+GENFILTER_DISPATCH<Policies>::Completing(PGENFILTER_DEVICE_CONTEXT DevContext,
+                                         WDFREQUEST                Request,
+                                         NTSTATUS                  Status)
+{
+    Policies::Statistics::Completing(DevContext,
+                                     Request,
+                                     Status);
+
+    Policies::Logging::Completing(DevContext,
+                                  Request,
+                                  Status);
+
+    Policies::Inspection::Completing(DevContext,
+                                     Request,
+                                     Status);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterEvtDeviceControl
+//  GENFILTER_DISPATCH::EvtDeviceControl
 //
 //    This routine is called by the Framework when there is a
 //    device control Request for us to process.
 //
 //  INPUTS:
 //
-//      Queue    - Handle to our default queue
+//      Queue    - Handle to our device control Queue
 //
-//      Request  - Handle to a device control Request
+//      Request  - Handle to the device control Request
 //
 //      OutputBufferLength - The length of the output buffer
 //
@@ -278,63 +617,133 @@ done:
 //
 //
 ///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterEvtDeviceControl(WDFQUEUE   Queue,
-                          WDFREQUEST Request,
-                          size_t     OutputBufferLength,
-                          size_t     InputBufferLength,
-                          ULONG      IoControlCode)
+GENFILTER_DISPATCH<Policies>::EvtDeviceControl(WDFQUEUE   Queue,
+                                               WDFREQUEST Request,
+                                               size_t     OutputBufferLength,
+                                               size_t     InputBufferLength,
+                                               ULONG      IoControlCode)
 {
     PGENFILTER_DEVICE_CONTEXT devContext;
+    PCGENFILTER_ROUTE         route;
+    NTSTATUS                  status;
+    ULONG_PTR                 information;
 
     devContext = GenFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    //
+    // Find out what we've been asked to do with this particular IOCTL.  Codes
+    // we don't have a route for get the default route: send-and-forget.
+    //
+    route = Policies::Routing::Lookup(IoControlCode);
+
+    //
+    // Requests to our own private control interface are handled (and
+    // completed) right here.  They're never sent to the device below us, and
+    // we don't count or trace them as I/O passing through the filter.
+    //
+    if (route->Action == GenFilterRouteCompleteLocally) {
 
-#if DBG
-    DbgPrint("GenFilterEvtDeviceControl -- Request 0x%p\n",
-             Request);
-#endif
+        status = route->Handler(Request,
+                                devContext,
+                                &information);
+
+        WdfRequestCompleteWithInformation(Request,
+                                          status,
+                                          information);
+        return;
+    }
 
     //
-    // We're searching for one specific IOCTL function code that we're interested in
+    // A Request over our I/O limits waits, or fails, before we do anything
+    // else with it.  If it waits, it's presented to us again afterwards.
     //
-    if (IoControlCode == IOCTL_YOU_ARE_INTERESTED_IN) {
+    if (Policies::Routing::Limit(Request,
+                                 devContext,
+                                 0)) {
+        return;
+    }
 
-#if DBG
-        DbgPrint("GenFilterEvtDeviceControl -- The IOCTL we're looking for was found!  Request 0x%p\n",
-                 Request);
-#endif
-        //
-        // Do something useful.
-        //
+    Policies::Statistics::DeviceControl(devContext,
+                                        Request,
+                                        route);
 
-        //
-        // We want to see the results for this particular Request... so send it
-        // and request a callback for when the Request has been completed.
-        GenFilterSendWithCallback(Request,
-                                    devContext);
+    Policies::Logging::DeviceControl(devContext,
+                                     Request,
+                                     route,
+                                     IoControlCode);
 
+    //
+    // Empty our caches, flush gathered writes, or answer the Request from
+    // the query cache or a copy already in flight, as its route says
+    //
+    if (Policies::Routing::DeviceControl(Request,
+                                         devContext,
+                                         route,
+                                         IoControlCode,
+                                         InputBufferLength,
+                                         OutputBufferLength)) {
         return;
     }
 
-    GenFilterSendAndForget(Request,
-                           devContext);
-}
+    switch (route->Action) {
+
+        case GenFilterRouteForwardWithCompletion:
+
+            Policies::Logging::Trace(devContext,
+                                     GenFilterTraceIoctlOfInterest,
+                                     Request,
+                                     STATUS_SUCCESS,
+                                     IoControlCode);
+
+            //
+            // Do something useful.
+            //
+
+            //
+            // We want to see the results for this particular Request... so send it
+            // and request a callback for when the Request has been completed.
+            //
+            SendWithCallback(Request,
+                             devContext);
+            break;
+
+        case GenFilterRouteFail:
+
+            Completing(devContext,
+                       Request,
+                       route->FailStatus);
+
+            WdfRequestComplete(Request,
+                               route->FailStatus);
+            break;
+
+        case GenFilterRouteForward:
+        default:
 
+            //
+            // Requests that others can be parked behind, and Requests whose
+            // result we're going to cache, get our completion callback
+            // here, whatever their route says
+            //
+            Forward(Request,
+                    devContext);
+            break;
+    }
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterEvtRead
+//  GENFILTER_DISPATCH::EvtRead
 //
 //    This routine is called by the Framework when there is a
 //    read Request for us to process
 //
 //  INPUTS:
 //
-//      Queue    - Handle to our default queue
+//      Queue    - Handle to our read Queue
 //
 //      Request  - Handle to read Request
 //
@@ -356,41 +765,83 @@ GenFilterEvtDeviceControl(WDFQUEUE   Queue,
 //
 //
 ///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterEvtRead(WDFQUEUE   Queue,
-                 WDFREQUEST Request,
-                 size_t     Length)
+GENFILTER_DISPATCH<Policies>::EvtRead(WDFQUEUE   Queue,
+                                      WDFREQUEST Request,
+                                      size_t     Length)
 {
     PGENFILTER_DEVICE_CONTEXT devContext;
-
-    UNREFERENCED_PARAMETER(Length);
+    LONGLONG                  offset;
 
     devContext = GenFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
-#if DBG
-    DbgPrint("GenFilterEvtRead -- Request 0x%p\n",
-             Request);
-#endif
+    //
+    // A Request over our I/O limits waits, or fails, before we do anything
+    // else with it
+    //
+    if (Policies::Routing::Limit(Request,
+                                 devContext,
+                                 Length)) {
+        return;
+    }
+
+    Policies::Statistics::Read(devContext,
+                               Request,
+                               Length);
+
+    Policies::Logging::Read(devContext,
+                            Request,
+                            Length);
 
-    GenFilterSendAndForget(Request,
-                           devContext);
+    offset = Policies::NeedsOffset ? GenFilterGetRequestOffset(Request) : 0;
+
+    //
+    // Satisfy the read from our cache if we can
+    //
+    if (Policies::Routing::Read(Request,
+                                devContext,
+                                offset,
+                                Length)) {
+        return;
+    }
+
+    Policies::Inspection::Read(Request,
+                               devContext,
+                               offset);
+
+    //
+    // If our read Queue is scheduled, the scheduler decides when this goes
+    //
+    if (Policies::Routing::Schedule(Request,
+                                    devContext,
+                                    offset)) {
+        return;
+    }
+
+    //
+    // Cacheable reads that missed are sent with a completion callback, so
+    // we can add their data to the cache.  Everything else is just sent.
+    //
+    Forward(Request,
+            devContext);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterEvtWrite
+//  GENFILTER_DISPATCH::EvtWrite
 //
 //    This routine is called by the Framework when there is a
-//    read Request for us to process.
+//    write Request for us to process.
 //
 //  INPUTS:
 //
-//      Queue    - Handle to our default queue
+//      Queue    - Handle to our write Queue
 //
-//      Request  - Handle to a read Request
+//      Request  - Handle to a write Request
 //
-//      Length   - The length of the read operation
+//      Length   - The length of the write operation
 //
 //  OUTPUTS:
 //
@@ -407,31 +858,137 @@ GenFilterEvtRead(WDFQUEUE   Queue,
 //  NOTES:
 //
 //
-///////////////////////////////////////////// //////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterEvtWrite(WDFQUEUE   Queue,
-                  WDFREQUEST Request,
-                  size_t     Length)
+GENFILTER_DISPATCH<Policies>::EvtWrite(WDFQUEUE   Queue,
+                                       WDFREQUEST Request,
+                                       size_t     Length)
 {
     PGENFILTER_DEVICE_CONTEXT devContext;
-
-    UNREFERENCED_PARAMETER(Length);
+    LONGLONG                  offset;
 
     devContext = GenFilterGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
-#if DBG
-    DbgPrint("GenFilterEvtWrite -- Request 0x%p\n",
-             Request);
-#endif
+    if (Policies::Routing::Limit(Request,
+                                 devContext,
+                                 Length)) {
+        return;
+    }
+
+    //
+    // A write we inspect is sent from our copy of its data.  If every copy
+    // is in use, it waits for one, and is presented to us again with it.
+    //
+    if (Policies::Inspection::Reserve(Request,
+                                      devContext,
+                                      Length)) {
+        return;
+    }
+
+    Policies::Statistics::Write(devContext,
+                                Request,
+                                Length);
+
+    Policies::Logging::Write(devContext,
+                             Request,
+                             Length);
 
-    GenFilterSendAndForget(Request,
-                           devContext);
+    offset = Policies::NeedsOffset ? GenFilterGetRequestOffset(Request) : 0;
+
+    //
+    // Don't let data we're blocking anywhere near the device
+    //
+    if (Policies::Inspection::Write(Request,
+                                    devContext,
+                                    offset,
+                                    Length)) {
+        return;
+    }
+
+    //
+    // Forget what we've cached for the range, and gather or schedule the
+    // write
+    //
+    if (Policies::Routing::Write(Request,
+                                 devContext,
+                                 offset,
+                                 Length)) {
+        return;
+    }
+
+    Forward(Request,
+            devContext);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterSendAndForget
+//  GENFILTER_DISPATCH::Forward
+//
+//      Sends a Request that we don't need to see again to our Local I/O
+//      Target.  Normally that's send-and-forget, but if any of our policies
+//      wants to see it complete (it's being timed or captured, it's a read
+//      whose data we cache, inspect or checksum, or its Queue limits how
+//      many Requests are in flight, for example) it's sent with our
+//      completion callback instead.
+//
+//      As with the routines it calls, the caller must not handle the Request
+//      after calling this routine.
+//
+//  INPUTS:
+//
+//      Request     - Handle to a WDFREQUEST to send to our local I/O Target
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      With no policies, this is just GENFILTER_DISPATCH::SendAndForget.
+//
+///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
+_Use_decl_annotations_
+VOID
+GENFILTER_DISPATCH<Policies>::Forward(WDFREQUEST                Request,
+                                      PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+
+    reqContext = Policies::NeedsRequestContext ? GenFilterGetRequestContext(Request) :
+                                                 nullptr;
+
+    if (Policies::Statistics::WantsCompletion(reqContext) ||
+        Policies::Logging::WantsCompletion(reqContext) ||
+        Policies::Inspection::WantsCompletion(reqContext) ||
+        Policies::Routing::WantsCompletion(Request,
+                                           DevContext,
+                                           reqContext)) {
+
+        SendWithCallback(Request,
+                         DevContext);
+        return;
+    }
+
+    SendAndForget(Request,
+                  DevContext);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GENFILTER_DISPATCH::SendAndForget
 //
 //      Sends a Request to our Local I/O Target and does no further processing
 //      for that Request (that is, no completion callback is provided).
@@ -462,15 +1019,27 @@ GenFilterEvtWrite(WDFQUEUE   Queue,
 //  NOTES:
 //
 ///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterSendAndForget(WDFREQUEST                Request,
-                       PGENFILTER_DEVICE_CONTEXT DevContext)
+GENFILTER_DISPATCH<Policies>::SendAndForget(WDFREQUEST                Request,
+                                            PGENFILTER_DEVICE_CONTEXT DevContext)
 {
     NTSTATUS status;
 
     WDF_REQUEST_SEND_OPTIONS sendOpts;
 
+    //
+    // Large reads and writes may go down in chunks, in which case we're
+    // done with them here, and see them again (as though the device had
+    // completed them) when the last chunk has.
+    //
+    if (Policies::Routing::Split(Request,
+                                 DevContext,
+                                 CompletionCallback)) {
+        return;
+    }
+
     //
     // We want to send this Request and not deal with it again.  Note two
     // important things about send-and-forget:
@@ -498,11 +1067,19 @@ GenFilterSendAndForget(WDFREQUEST                Request,
         // I/O Target for processing by the driver for that Target.
         //
         status = WdfRequestGetStatus(Request);
-#if DBG
-        DbgPrint("WdfRequestSend 0x%p failed - 0x%x\n",
-                 Request,
-                 status);
-#endif
+
+        Policies::Logging::Trace(DevContext,
+                                 GenFilterTraceSendFailed,
+                                 Request,
+                                 status,
+                                 0);
+
+        Policies::Statistics::Failed(DevContext);
+
+        Completing(DevContext,
+                   Request,
+                   status);
+
         WdfRequestComplete(Request,
                            status);
     }
@@ -510,7 +1087,7 @@ GenFilterSendAndForget(WDFREQUEST                Request,
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterCompletionCallback
+//  GENFILTER_DISPATCH::CompletionCallback
 //
 //    This routine is called by the Framework when a Request
 //    has been completed by the I/O Target to which we sent it.
@@ -530,8 +1107,8 @@ GenFilterSendAndForget(WDFREQUEST                Request,
 //                 request
 //
 //      Context  - The context supplied to
-//                 WdfRequestSetCompletionRoutine (NULL in
-//                 our case)
+//                 WdfRequestSetCompletionRoutine (a pointer
+//                 to our WDFDEVICE context)
 //
 //  OUTPUTS:
 //
@@ -548,26 +1125,83 @@ GenFilterSendAndForget(WDFREQUEST                Request,
 //  NOTES:
 //
 ///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterCompletionCallback(WDFREQUEST                     Request,
-                            WDFIOTARGET                    Target,
-                            PWDF_REQUEST_COMPLETION_PARAMS Params,
-                            WDFCONTEXT                     Context)
+GENFILTER_DISPATCH<Policies>::CompletionCallback(WDFREQUEST                     Request,
+                                                 WDFIOTARGET                    Target,
+                                                 PWDF_REQUEST_COMPLETION_PARAMS Params,
+                                                 WDFCONTEXT                     Context)
 {
     NTSTATUS status;
     auto*    devContext = (PGENFILTER_DEVICE_CONTEXT)Context;
 
     UNREFERENCED_PARAMETER(Target);
-    UNREFERENCED_PARAMETER(devContext);
-
-    DbgPrint("GenFilterCompletionCallback: Request=%p, Status=0x%x; Information=0x%Ix\n",
-             Request,
-             Params->IoStatus.Status,
-             Params->IoStatus.Information);
 
     status = Params->IoStatus.Status;
 
+    Policies::Logging::Trace(devContext,
+                             GenFilterTraceCompletion,
+                             Request,
+                             status,
+                             Params->IoStatus.Information);
+
+    //
+    // If it failed in a way that might not happen again, we may send it
+    // down again instead of completing it
+    //
+    if (Policies::Routing::Retry(Request,
+                                 devContext,
+                                 status,
+                                 CompletionCallback)) {
+        return;
+    }
+
+    //
+    // A write longer than our copy of its data goes on with the next part
+    //
+    if (Policies::Inspection::Next(Request,
+                                   devContext,
+                                   status,
+                                   Params)) {
+        return;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        Policies::Statistics::Failed(devContext);
+    }
+
+    //
+    // Look at (and perhaps refuse) what was read
+    //
+    status = Policies::Inspection::Completed(Request,
+                                             devContext,
+                                             status,
+                                             Params);
+
+    //
+    // Hand data we want to look at to our worker threads.  If they're going
+    // to complete the Request, we're done with it.  Otherwise, feed the
+    // read cache.
+    //
+    if (Policies::Routing::Completed(Request,
+                                     devContext,
+                                     Params)) {
+        return;
+    }
+
+    Policies::Routing::ResultReady(Request,
+                                   devContext,
+                                   status,
+                                   Params->IoStatus.Information);
+
+    Completing(devContext,
+               Request,
+               status);
+
+    Policies::Routing::InFlightDone(Request,
+                                    devContext);
+
     //
     // Potentially do something interesting here
     //
@@ -578,7 +1212,7 @@ GenFilterCompletionCallback(WDFREQUEST                     Request,
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-//  GenFilterSendWithCallback
+//  GENFILTER_DISPATCH::SendWithCallback
 //
 //      Sends a Request to our local I/O Target with a completion routine
 //      callback so that the results of the operation can be examined.
@@ -609,46 +1243,128 @@ GenFilterCompletionCallback(WDFREQUEST                     Request,
 //  NOTES:
 //
 ///////////////////////////////////////////////////////////////////////////////
+template <typename Policies>
 _Use_decl_annotations_
 VOID
-GenFilterSendWithCallback(WDFREQUEST                Request,
-                          PGENFILTER_DEVICE_CONTEXT DevContext)
+GENFILTER_DISPATCH<Policies>::SendWithCallback(WDFREQUEST                Request,
+                                               PGENFILTER_DEVICE_CONTEXT DevContext)
 {
     NTSTATUS status;
 
-    DbgPrint("Sending %p with completion\n",
-             Request);
+    Policies::Logging::Trace(DevContext,
+                             GenFilterTraceSendWithCallback,
+                             Request,
+                             STATUS_SUCCESS,
+                             0);
 
-    //
-    // Setup the request for the next driver
-    //
-    WdfRequestFormatRequestUsingCurrentType(Request);
+    if (Policies::Routing::Split(Request,
+                                 DevContext,
+                                 CompletionCallback)) {
+        return;
+    }
 
     //
-    // Set the completion routine...
+    // Setup the request for the next driver (with our copy of its data, if
+    // it's a write we've inspected)
     //
-    WdfRequestSetCompletionRoutine(Request,
-                                   GenFilterCompletionCallback,
-                                   DevContext);
-    //
-    // And send it!
-    // 
-    if (!WdfRequestSend(Request,
-                        WdfDeviceGetIoTarget(DevContext->WdfDevice),
-                        WDF_NO_SEND_OPTIONS)) {
+    status = Policies::Inspection::Format(Request,
+                                          DevContext);
+
+    if (NT_SUCCESS(status)) {
 
         //
-        // Oops! Something bad happened, complete the request
+        // Set the completion routine...
         //
-        status = WdfRequestGetStatus(Request);
+        WdfRequestSetCompletionRoutine(Request,
+                                       CompletionCallback,
+                                       DevContext);
+        //
+        // And send it!
+        // 
+        if (WdfRequestSend(Request,
+                           WdfDeviceGetIoTarget(DevContext->WdfDevice),
+                           WDF_NO_SEND_OPTIONS)) {
+            return;
+        }
 
-        DbgPrint("WdfRequestSend failed = 0x%x\n",
-                 status);
-        WdfRequestComplete(Request,
-                           status);
+        status = WdfRequestGetStatus(Request);
     }
 
+    //
+    // Oops! Something bad happened, complete the request
+    //
+    Policies::Logging::Trace(DevContext,
+                             GenFilterTraceSendFailed,
+                             Request,
+                             status,
+                             0);
+
+    Policies::Statistics::Failed(DevContext);
+
+    Policies::Routing::ResultReady(Request,
+                                   DevContext,
+                                   status,
+                                   0);
+
+    Completing(DevContext,
+               Request,
+               status);
+
+    Policies::Routing::InFlightDone(Request,
+                                    DevContext);
+
+    WdfRequestComplete(Request,
+                       status);
+
     //
     // When we return the Request is always "gone"
     //
 }
+
+//
+// GenFilterForward
+//
+// For the rest of the filter: forwards a Request with its device's
+// dispatcher (see GENFILTER_DISPATCH::Forward)
+//
+_Use_decl_annotations_
+VOID
+GenFilterForward(WDFREQUEST                Request,
+                 PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    DevContext->Dispatch->Forward(Request,
+                                  DevContext);
+}
+
+//
+// GenFilterSendWithCallback
+//
+// For the rest of the filter: sends a Request with its device's
+// dispatcher's completion callback (see GENFILTER_DISPATCH::SendWithCallback)
+//
+_Use_decl_annotations_
+VOID
+GenFilterSendWithCallback(WDFREQUEST                Request,
+                          PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    DevContext->Dispatch->SendWithCallback(Request,
+                                           DevContext);
+}
+
+//
+// GenFilterCompleting
+//
+// For the rest of the filter: called just before completing a Request we
+// were given, so that its device's dispatcher's policies can time and
+// record it (see GENFILTER_DISPATCH::Completing)
+//
+_Use_decl_annotations_
+VOID
+GenFilterCompleting(PGENFILTER_DEVICE_CONTEXT DevContext,
+                    WDFREQUEST                Request,
+                    NTSTATUS                  Status)
+{
+    DevContext->Dispatch->Completing(DevContext,
+                                     Request,
+                                     Status);
+}
@@ -50,6 +50,29 @@
 #include <wdm.h>
 #include <wdf.h>
 
+#include "GenFilterAttribution.h"
+#include "GenFilterCache.h"
+#include "GenFilterCoalesce.h"
+#include "GenFilterConfig.h"
+#include "GenFilterDefer.h"
+#include "GenFilterInspect.h"
+#include "GenFilterIntegrity.h"
+#include "GenFilterCapture.h"
+#include "GenFilterIoctl.h"
+#include "GenFilterLatency.h"
+#include "GenFilterLimit.h"
+#include "GenFilterPassThrough.h"
+#include "GenFilterPool.h"
+#include "GenFilterQueryCache.h"
+#include "GenFilterQueue.h"
+#include "GenFilterReadAhead.h"
+#include "GenFilterRetry.h"
+#include "GenFilterRoute.h"
+#include "GenFilterSplit.h"
+#include "GenFilterStats.h"
+#include "GenFilterTrace.h"
+#include "GenFilterWriteGather.h"
+
 //
 // Warnings that are active for "Microsoft All Rules" that we routinely want to disable
 //
@@ -61,8 +84,8 @@
 
 
 //
-// Dummy IOCTL to illustrate how we can check for a particular IOCTL Control Code in our
-// EvtIoDeviceControl Event Processing Callback.
+// Dummy IOCTL to illustrate how we can route a particular IOCTL Control Code
+// differently from the rest.  See the routing table in GenFilterRoute.cpp.
 //
 constexpr auto IOCTL_YOU_ARE_INTERESTED_IN = (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN, 2048, METHOD_BUFFERED, FILE_ANY_ACCESS);
 
@@ -72,6 +95,114 @@ constexpr auto IOCTL_YOU_ARE_INTERESTED_IN = (ULONG)CTL_CODE(FILE_DEVICE_UNKNOWN
 typedef struct _GENFILTER_DEVICE_CONTEXT {  // NOLINT(cppcoreguidelines-pro-type-member-init)
     WDFDEVICE       WdfDevice;
 
+    //
+    // The dispatcher our Queues were created with, whose routines the rest
+    // of the filter sends and completes Requests with
+    //
+    PCGENFILTER_QUEUE_CALLBACKS Dispatch;
+
+    //
+    // Per-processor counters of the I/O passing through us
+    //
+    GENFILTER_STATS Stats;
+
+    //
+    // Binary trace log of the Requests we see (replaces DbgPrint on the
+    // I/O path)
+    //
+    GENFILTER_TRACE Trace;
+
+    //
+    // Sector read cache, and the last media change count we saw returned
+    // from a CHECK_VERIFY IOCTL
+    //
+    GENFILTER_CACHE Cache;
+    volatile LONG   CacheMediaChangeCount;
+
+    //
+    // Sequential stream detection and read-ahead into the cache
+    //
+    GENFILTER_READAHEAD ReadAhead;
+
+    //
+    // Identical device control Requests parked behind one in flight
+    //
+    GENFILTER_COALESCE Coalesce;
+
+    //
+    // Cached results of idempotent query IOCTLs
+    //
+    GENFILTER_QUERY_CACHE QueryCache;
+
+    //
+    // Per-processor histograms of how long Requests take
+    //
+    GENFILTER_LATENCY Latency;
+
+    //
+    // Who's sending us the most I/O
+    //
+    GENFILTER_ATTRIBUTION Attribution;
+
+    //
+    // Set while we're handing Requests straight to the device below us
+    //
+    GENFILTER_PASS_THROUGH PassThrough;
+
+    //
+    // Small adjacent writes being gathered into one
+    //
+    GENFILTER_WRITE_GATHER WriteGather;
+
+    //
+    // Worker threads that do what our completion callback would rather not
+    //
+    GENFILTER_DEFER Defer;
+
+    //
+    // The settings that can be changed without restarting the device
+    //
+    GENFILTER_CONFIG Config;
+
+    //
+    // Token buckets for the I/O limits in the configuration, and the
+    // Requests that are waiting to be within them
+    //
+    GENFILTER_LIMIT Limit;
+
+    //
+    // Requests that failed with a status worth retrying, waiting to be
+    // sent down again
+    //
+    GENFILTER_RETRY Retry;
+
+    //
+    // Requests and MDLs that large reads and writes are sent down in
+    //
+    GENFILTER_SPLIT Split;
+
+    //
+    // Byte signatures we look for in the data we see
+    //
+    GENFILTER_INSPECT Inspect;
+
+    //
+    // Checksums of the sectors we've read, to catch reads that return
+    // different data for the same sector
+    //
+    GENFILTER_INTEGRITY Integrity;
+
+    //
+    // A record of every Request we're given, for offline replay
+    //
+    GENFILTER_CAPTURE Capture;
+
+    //
+    // Free lists for the preallocated elements the modules above use,
+    // indexed by GENFILTER_POOL_ID
+    //
+    GENFILTER_SLAB Pools[GenFilterPoolCount];
+
     //
     // Other interesting stuff would go here
     //
@@ -85,6 +216,148 @@ typedef struct _GENFILTER_DEVICE_CONTEXT {  // NOLINT(cppcoreguidelines-pro-type
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(GENFILTER_DEVICE_CONTEXT,
                                    GenFilterGetDeviceContext)
 
+//
+// Our per Request context
+//
+typedef struct _GENFILTER_REQUEST_CONTEXT {  // NOLINT(cppcoreguidelines-pro-type-member-init)
+
+    //
+    // Set for a cacheable read that missed in the cache.  When it completes,
+    // its data is added to the cache (see GenFilterCacheRequestCompleted).
+    // CacheInvalidate is set for a write, whose range is invalidated again
+    // when it completes.
+    //
+    BOOLEAN                CacheFill;
+    BOOLEAN                CacheInvalidate;
+    GENFILTER_CACHE_TICKET CacheTicket;
+    LONGLONG               CacheOffset;
+    ULONG                  CacheLength;
+
+    //
+    // Set if this Request is the leader of a coalescing slot (see
+    // GenFilterCoalesceRequest)
+    //
+    PGENFILTER_COALESCE_SLOT CoalesceSlot;
+
+    //
+    // Set if this Request reserved a query cache entry for its result (see
+    // GenFilterQueryCacheRequest), along with the cache's epoch at the time
+    //
+    PGENFILTER_QUERY_CACHE_ENTRY QueryCacheEntry;
+    LONG                         QueryCacheEpoch;
+
+    //
+    // When we first saw this Request (0 if it isn't being timed), and the
+    // latency histogram it's counted in
+    //
+    LONGLONG LatencyStart;
+    ULONG    LatencyClass;
+
+    //
+    // Where this Request is held while it waits for its Queue's scheduler
+    // to pick it, and whether it's counted as one of its Queue's in-flight
+    // Requests (see GenFilterQueueSubmit)
+    //
+    GENFILTER_SCHED_ENTRY SchedEntry;
+    BOOLEAN               SchedInFlight;
+
+    //
+    // Set for a read whose data we scan for signatures when it completes
+    // (see GenFilterInspectReadCompleted)
+    //
+    BOOLEAN InspectRead;
+
+    //
+    // For a write we send from our copy of its data (see
+    // GenFilterInspectWriteRequest): the copy, where on the device the
+    // part of the write that's in it goes and how long it is, how much of
+    // the write comes after that part, how much of it the device has
+    // written so far, and whether we found something we block in a part
+    // we hadn't sent yet.  Queue is where it goes back to if it has to
+    // wait for a copy (see GenFilterInspectReserve).
+    //
+    PGENFILTER_INSPECT_COPY InspectCopy;
+    LONGLONG                InspectOffset;
+    ULONG                   InspectLength;
+    size_t                  InspectRemaining;
+    ULONG_PTR               InspectWritten;
+    BOOLEAN                 InspectBlocked;
+    WDFQUEUE                InspectQueue;
+
+    //
+    // Set for a read whose sectors we checksum when it completes, along
+    // with the integrity table's Sequence when it was sent (see
+    // GenFilterIntegrityCheck).  IntegrityInvalidate is set for a write,
+    // whose range is forgotten again when it completes.
+    //
+    BOOLEAN  IntegrityCheck;
+    BOOLEAN  IntegrityInvalidate;
+    LONG     IntegrityEpoch;
+    LONGLONG IntegrityOffset;
+    ULONG    IntegrityLength;
+
+    //
+    // When we were given this Request, if it's being captured (0 if it
+    // isn't), and how its route said to handle it (see
+    // GenFilterCaptureStart)
+    //
+    LONGLONG CaptureStart;
+    UCHAR    CaptureFlags;
+
+    //
+    // While the I/O limits are holding this Request back: when it may go,
+    // in interrupt time, and the Queue it goes back to then.  Released is
+    // set when it does, so that it isn't held again (see
+    // GenFilterLimitRequest).
+    //
+    LONGLONG LimitRelease;
+    WDFQUEUE LimitQueue;
+    BOOLEAN  LimitReleased;
+
+    //
+    // How many times we've sent this Request down again after it failed
+    // with a status we retry, the completion callback we send it with,
+    // and, while it waits to go again, when that is (in interrupt time)
+    // and its place on the device's list.  Final is set once it isn't
+    // going again (see GenFilterRetryRequest).
+    //
+    ULONG                              RetryCount;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE RetryCompletion;
+    LONGLONG                           RetryDue;
+    LIST_ENTRY                         RetryEntry;
+    BOOLEAN                            RetryWaiting;
+    BOOLEAN                            RetryFinal;
+
+    //
+    // While this Request is being sent down in chunks (see
+    // GenFilterSplitRequest): its MDL, where on the device it starts, how
+    // long it and each chunk are, how many chunks may be in flight at once,
+    // where the next chunk starts, how many chunks are in flight, how much
+    // of it has been transferred so far and with what status, which way it
+    // goes, the stack location flags to send the chunks with, and the
+    // completion callback to give it to when they're done.  Resume is set
+    // when a chunk failed, so that a retry sends the rest of the Request
+    // from that chunk on (see GenFilterSplitRetry).
+    //
+    PMDL                               SplitMdl;
+    LONGLONG                           SplitOffset;
+    ULONG                              SplitLength;
+    ULONG                              SplitChunkBytes;
+    ULONG                              SplitDepth;
+    ULONG                              SplitNext;
+    ULONG                              SplitOutstanding;
+    ULONG                              SplitTransferred;
+    NTSTATUS                           SplitStatus;
+    BOOLEAN                            SplitWrite;
+    UCHAR                              SplitFlags;
+    BOOLEAN                            SplitResume;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE SplitCompletion;
+
+} GENFILTER_REQUEST_CONTEXT, *PGENFILTER_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(GENFILTER_REQUEST_CONTEXT,
+                                   GenFilterGetRequestContext)
+
 
 //
 // Foreward and roll-type declarations
@@ -92,14 +365,57 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(GENFILTER_DEVICE_CONTEXT,
 extern "C" DRIVER_INITIALIZE DriverEntry;
 
 EVT_WDF_DRIVER_DEVICE_ADD GenFilterEvtDeviceAdd;
-EVT_WDF_IO_QUEUE_IO_READ GenFilterEvtRead;
-EVT_WDF_IO_QUEUE_IO_WRITE GenFilterEvtWrite;
-EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL GenFilterEvtDeviceControl;
-
-EVT_WDF_REQUEST_COMPLETION_ROUTINE GenFilterCompletionCallback;
+EVT_WDF_DRIVER_DEVICE_ADD GenFilterForwardingEvtDeviceAdd;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP GenFilterEvtDeviceCleanup;
 
+//
+// Our Queue callbacks, completion callback and send routines belong to our
+// dispatcher (see GenFilterPolicy.h).  The rest of the filter sends
+// Requests with these, which use whichever dispatcher the Request's device
+// was created with, and calls GenFilterCompleting just before it completes
+// a Request itself.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
-GenFilterSendAndForget(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+GenFilterForward(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
 GenFilterSendWithCallback(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCompleting(_In_ PGENFILTER_DEVICE_CONTEXT DevContext, _In_ WDFREQUEST Request, _In_ NTSTATUS Status);
+
+GENFILTER_ROUTE_HANDLER GenFilterStatsQuery;
+GENFILTER_ROUTE_HANDLER GenFilterTraceQuery;
+GENFILTER_ROUTE_HANDLER GenFilterLatencyQuery;
+GENFILTER_ROUTE_HANDLER GenFilterLatencySetSampling;
+GENFILTER_ROUTE_HANDLER GenFilterPassThroughSet;
+GENFILTER_ROUTE_HANDLER GenFilterPoolQuery;
+GENFILTER_ROUTE_HANDLER GenFilterDeferQuery;
+GENFILTER_ROUTE_HANDLER GenFilterCaptureQuery;
+GENFILTER_ROUTE_HANDLER GenFilterConfigSet;
+GENFILTER_ROUTE_HANDLER GenFilterAttributionQuery;
+GENFILTER_ROUTE_HANDLER GenFilterAttributionReset;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterCacheReadRequest(_In_ WDFREQUEST Request,
+                          _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                          _In_ LONGLONG Offset,
+                          _In_ size_t Length);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCacheRequestCompleted(_In_ WDFREQUEST Request,
+                               _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                               _In_ PWDF_REQUEST_COMPLETION_PARAMS Params);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterMediaChanged(_In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterCacheVerifyPending(_In_ PGENFILTER_DEVICE_CONTEXT DevContext);
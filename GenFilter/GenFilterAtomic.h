@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterAtomic.h
+//
+//    ABSTRACT:
+//
+//      The atomic operations the lock-free cores (GenFilterStats.h and
+//      GenFilterRing.h) are written in.  Built by the WDK, or by MSVC in user
+//      mode, they're the Interlocked and ReadXxx/WriteXxx routines; built by
+//      GCC or Clang (GenFilterSim), they're the compilers' __atomic builtins
+//      with the same ordering.  So the cores run, and are stress tested, off
+//      Windows too.  Like the cores, this file includes nothing: include it
+//      after <wdm.h> in the driver, or after <windows.h> in user mode.
+//
+//      The names say the ordering: NoFence operations are atomic but order
+//      nothing else, Acquire and Release are one-way, and the rest are full
+//      barriers, as the Interlocked routines are.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#if defined(_MSC_VER)
+
+FORCEINLINE LONG64 GenFilterAtomicReadNoFence64(volatile const LONG64* Target) { return ReadNoFence64(Target); }
+FORCEINLINE LONG64 GenFilterAtomicReadAcquire64(volatile const LONG64* Target) { return ReadAcquire64(Target); }
+FORCEINLINE LONG   GenFilterAtomicReadNoFence(volatile const LONG* Target) { return ReadNoFence(Target); }
+
+FORCEINLINE VOID GenFilterAtomicWriteRelease64(volatile LONG64* Target, LONG64 Value) { WriteRelease64(Target, Value); }
+
+FORCEINLINE LONG64 GenFilterAtomicAddNoFence64(volatile LONG64* Target, LONG64 Value) { return InterlockedAddNoFence64(Target, Value); }
+FORCEINLINE LONG64 GenFilterAtomicIncrement64(volatile LONG64* Target) { return InterlockedIncrement64(Target); }
+
+FORCEINLINE
+LONG64
+GenFilterAtomicCompareExchange64(volatile LONG64* Target,
+                                 LONG64           Exchange,
+                                 LONG64           Comparand)
+{
+    return InterlockedCompareExchange64(Target,
+                                        Exchange,
+                                        Comparand);
+}
+
+FORCEINLINE
+LONG
+GenFilterAtomicCompareExchange(volatile LONG* Target,
+                               LONG           Exchange,
+                               LONG           Comparand)
+{
+    return InterlockedCompareExchange(Target,
+                                      Exchange,
+                                      Comparand);
+}
+
+#elif defined(__GNUC__)
+
+FORCEINLINE LONG64 GenFilterAtomicReadNoFence64(volatile const LONG64* Target) { return __atomic_load_n(Target, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 GenFilterAtomicReadAcquire64(volatile const LONG64* Target) { return __atomic_load_n(Target, __ATOMIC_ACQUIRE); }
+FORCEINLINE LONG   GenFilterAtomicReadNoFence(volatile const LONG* Target) { return __atomic_load_n(Target, __ATOMIC_RELAXED); }
+
+FORCEINLINE VOID GenFilterAtomicWriteRelease64(volatile LONG64* Target, LONG64 Value) { __atomic_store_n(Target, Value, __ATOMIC_RELEASE); }
+
+//
+// Like InterlockedAddNoFence64 and InterlockedIncrement64, these return
+// the new value
+//
+FORCEINLINE LONG64 GenFilterAtomicAddNoFence64(volatile LONG64* Target, LONG64 Value) { return __atomic_add_fetch(Target, Value, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 GenFilterAtomicIncrement64(volatile LONG64* Target) { return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST); }
+
+//
+// Like InterlockedCompareExchange, these return what Target held, whether
+// or not it was exchanged
+//
+FORCEINLINE
+LONG64
+GenFilterAtomicCompareExchange64(volatile LONG64* Target,
+                                 LONG64           Exchange,
+                                 LONG64           Comparand)
+{
+    __atomic_compare_exchange_n(Target,
+                                &Comparand,
+                                Exchange,
+                                false,
+                                __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE
+LONG
+GenFilterAtomicCompareExchange(volatile LONG* Target,
+                               LONG           Exchange,
+                               LONG           Comparand)
+{
+    __atomic_compare_exchange_n(Target,
+                                &Comparand,
+                                Exchange,
+                                false,
+                                __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+#else
+#error GenFilterAtomic.h needs MSVC, GCC or Clang
+#endif
@@ -0,0 +1,307 @@
+///
+/// @file GenFilterAttribution.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+#include <ntddk.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterAttributionInitialize
+//
+//    Reads the "Attribution" value from the device's hardware key, and if
+//    attribution is on, allocates a sketch for each processor.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the sketches could
+//                      not be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Each processor's sketch is about 32KB, however many requesters
+//      there turn out to be.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterAttributionInitialize(WDFDEVICE                 Device,
+                               PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS               status;
+    WDF_OBJECT_ATTRIBUTES  objectAttr;
+    WDFMEMORY              memory;
+    PVOID                  buffer;
+    ULONG                  cpuCount;
+    size_t                 cpusLength;
+    PGENFILTER_ATTRIBUTION attribution;
+    WDFKEY                 key  = nullptr;
+    ULONG                  mode = GenFilterAttributionOff;
+
+    DECLARE_CONST_UNICODE_STRING(attributionValueName, L"Attribution");
+
+    attribution = &DevContext->Attribution;
+
+    RtlZeroMemory(attribution,
+                  sizeof(GENFILTER_ATTRIBUTION));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (!NT_SUCCESS(status)) {
+        key    = nullptr;
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                          &attributionValueName,
+                                          &mode)) ||
+        mode == GenFilterAttributionOff ||
+        mode >= GenFilterAttributionModeCount) {
+
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    cpuCount   = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    cpusLength = cpuCount * sizeof(GENFILTER_SKETCH_CPU);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'hFnG',
+                             cpusLength + SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for attribution failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    GenFilterSketchInitialize(&attribution->Sketch,
+                              (PGENFILTER_SKETCH_CPU)ALIGN_UP_BY(buffer,
+                                                                 SYSTEM_CACHE_ALIGNMENT_SIZE),
+                              cpuCount);
+
+    attribution->Mode = (GENFILTER_ATTRIBUTION_MODE)mode;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (key != nullptr) {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+//
+// GenFilterAttributionRequester
+//
+// Who sent a Request.  The process is the one whose thread sent the IRP,
+// which isn't necessarily the one we're running in: a Request can reach
+// us from a file system's worker thread, or from a completion routine.
+// I/O that no process sent (paging I/O, for example) is counted against
+// process 0, or against no file object.
+//
+_Use_decl_annotations_
+ULONGLONG
+GenFilterAttributionRequester(PGENFILTER_ATTRIBUTION Attribution,
+                              WDFREQUEST             Request)
+{
+    if (Attribution->Mode == GenFilterAttributionFileObject) {
+        return (ULONGLONG)(ULONG_PTR)WdfRequestGetFileObject(Request);
+    }
+
+    return IoGetRequestorProcessId(WdfRequestWdmGetIrp(Request));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterAttributionQuery
+//
+//    Handles IOCTL_GENFILTER_GET_HEAVY_HITTERS by returning the requesters
+//    that have sent us the most I/O.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_GET_HEAVY_HITTERS Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - sizeof(GENFILTER_HEAVY_HITTERS) on success
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer
+//      cannot hold a GENFILTER_HEAVY_HITTERS.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      With attribution off we return no hitters, and Mode says why.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterAttributionQuery(WDFREQUEST                Request,
+                          PGENFILTER_DEVICE_CONTEXT DevContext,
+                          PULONG_PTR                Information)
+{
+    NTSTATUS                 status;
+    PGENFILTER_HEAVY_HITTERS output;
+    PGENFILTER_ATTRIBUTION   attribution = &DevContext->Attribution;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(GENFILTER_HEAVY_HITTERS),
+                                            (PVOID*)&output,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    RtlZeroMemory(output,
+                  sizeof(GENFILTER_HEAVY_HITTERS));
+
+    output->Size = sizeof(GENFILTER_HEAVY_HITTERS);
+    output->Mode = attribution->Mode;
+
+    if (attribution->Mode != GenFilterAttributionOff) {
+
+        GenFilterSketchQuery(&attribution->Sketch,
+                             output);
+    }
+
+    *Information = sizeof(GENFILTER_HEAVY_HITTERS);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterAttributionReset
+//
+//    Handles IOCTL_GENFILTER_RESET_HEAVY_HITTERS by starting the counts
+//    again from zero.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_RESET_HEAVY_HITTERS Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Always 0
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      This is a separate IOCTL from the query so that it can require
+//      FILE_WRITE_ACCESS: anybody who can read from the device can see the
+//      counts, but throwing them away changes what everybody else sees.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterAttributionReset(WDFREQUEST                Request,
+                          PGENFILTER_DEVICE_CONTEXT DevContext,
+                          PULONG_PTR                Information)
+{
+    PGENFILTER_ATTRIBUTION attribution = &DevContext->Attribution;
+
+    UNREFERENCED_PARAMETER(Request);
+
+    *Information = 0;
+
+    if (attribution->Mode != GenFilterAttributionOff) {
+        GenFilterSketchReset(&attribution->Sketch);
+    }
+
+    return STATUS_SUCCESS;
+}
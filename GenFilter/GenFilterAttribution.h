@@ -0,0 +1,103 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterAttribution.h
+//
+//    ABSTRACT:
+//
+//      Per-requester I/O attribution.  Counts every Request, and the bytes it
+//      moves, against the process that sent it or the file object it was sent
+//      on, in a fixed-size sketch (see GenFilterSketch.h), so that when the
+//      device is saturated we can tell who is responsible.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterIoctl.h"
+#include "GenFilterSketch.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// The per-device attribution that lives in our device context.  Nothing is
+// allocated, or counted, unless the "Attribution" value in the device's
+// hardware key turns it on.
+//
+typedef struct _GENFILTER_ATTRIBUTION {
+    GENFILTER_ATTRIBUTION_MODE Mode;
+    GENFILTER_SKETCH           Sketch;
+} GENFILTER_ATTRIBUTION, *PGENFILTER_ATTRIBUTION;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterAttributionInitialize(_In_ WDFDEVICE Device,
+                               _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONGLONG
+GenFilterAttributionRequester(_In_ PGENFILTER_ATTRIBUTION Attribution,
+                              _In_ WDFREQUEST Request);
+
+//
+// GenFilterAttributionAdd
+//
+// Counts a Request that moves Length bytes (0 for a device control)
+// against whoever sent it
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FORCEINLINE
+VOID
+GenFilterAttributionAdd(_In_ PGENFILTER_ATTRIBUTION Attribution,
+                        _In_ WDFREQUEST Request,
+                        _In_ size_t Length)
+{
+    if (Attribution->Mode == GenFilterAttributionOff) {
+        return;
+    }
+
+    GenFilterSketchAdd(&Attribution->Sketch,
+                       KeGetCurrentProcessorNumberEx(nullptr),
+                       GenFilterAttributionRequester(Attribution,
+                                                     Request),
+                       Length < MAXULONG ? (ULONG)Length : MAXULONG);
+}
@@ -0,0 +1,333 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterBucket.h
+//
+//    ABSTRACT:
+//
+//      Lock-free token buckets for the filter's I/O limits.  Each bucket is a
+//      single 64-bit time that's moved on with a compare-exchange, so
+//      Requests on every processor can take from the same bucket without a
+//      lock, and nothing ever has to refill it.  Like GenFilterSketch.h, this
+//      file doesn't use WDF, and the caller supplies the time, so GenFilterCtl
+//      can check and measure the same code under contention.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include "GenFilterIoctl.h"
+#include "GenFilterSketch.h"
+
+//
+// A bucket is kept the way the "generic cell rate algorithm" keeps one:
+// rather than a count of tokens and when it was last topped up, it's the
+// time at which it will be full again.  Taking a Request's cost from it
+// moves that time on by the cost (in ticks, at the bucket's rate).  A time
+// in the past is a full bucket, and counts as now.  The time may run
+// ahead of now by the burst tolerance; taking more than that means
+// waiting until it no longer does.
+//
+// Each bucket is a pair: one for Requests and one for bytes, in the same
+// cache line, since every Request takes from both.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_BUCKET {
+    volatile LONG64 Requests;
+    volatile LONG64 Bytes;
+} GENFILTER_BUCKET, *PGENFILTER_BUCKET;
+
+//
+// Requesters' buckets are found by hashing the requester into a fixed
+// table, so it takes the same memory however many there are.  Requesters
+// that share a bucket share its limits; with this many buckets that's
+// rare unless there are hundreds of busy requesters.  MUST be a power of
+// two.
+//
+constexpr ULONG GENFILTER_BUCKET_REQUESTERS = 1024;
+
+static_assert((GENFILTER_BUCKET_REQUESTERS & (GENFILTER_BUCKET_REQUESTERS - 1)) == 0,
+              "GENFILTER_BUCKET_REQUESTERS must be a power of two");
+
+//
+// A GENFILTER_RATE_LIMIT in ticks.  0 is no limit.
+//
+typedef struct _GENFILTER_BUCKET_RATE {
+    LONG64 TicksPerRequest;
+    LONG64 BytesPerSecond;
+} GENFILTER_BUCKET_RATE, *PGENFILTER_BUCKET_RATE;
+
+//
+// GENFILTER_LIMITS, in ticks.  A Request that fails its limits is one
+// that would have to wait longer than MaxDelay, so GenFilterLimitFail is
+// just a MaxDelay of 0.
+//
+typedef struct _GENFILTER_BUCKET_LIMITS {
+    LONG64                TicksPerSecond;
+    GENFILTER_BUCKET_RATE Device;
+    GENFILTER_BUCKET_RATE Requester;
+    LONG64                Tolerance;        // The burst
+    LONG64                MaxDelay;
+    BOOLEAN               Limited;          // Any rate is set
+} GENFILTER_BUCKET_LIMITS, *PGENFILTER_BUCKET_LIMITS;
+
+typedef const GENFILTER_BUCKET_LIMITS* PCGENFILTER_BUCKET_LIMITS;
+
+//
+// GenFilterBucketRateInitialize
+//
+inline
+void
+GenFilterBucketRateInitialize(PGENFILTER_BUCKET_RATE      Rate,
+                              const GENFILTER_RATE_LIMIT* Limit,
+                              LONG64                      TicksPerSecond)
+{
+    Rate->TicksPerRequest = 0;
+    Rate->BytesPerSecond  = Limit->BytesPerSecond;
+
+    if (Limit->RequestsPerSecond != 0) {
+
+        Rate->TicksPerRequest = TicksPerSecond / Limit->RequestsPerSecond;
+
+        if (Rate->TicksPerRequest == 0) {
+            Rate->TicksPerRequest = 1;
+        }
+    }
+}
+
+//
+// GenFilterBucketLimitsInitialize
+//
+// Converts Limits to ticks of a clock that runs at TicksPerSecond.  The
+// caller has checked them (see GENFILTER_LIMITS).
+//
+inline
+void
+GenFilterBucketLimitsInitialize(PGENFILTER_BUCKET_LIMITS Buckets,
+                                const GENFILTER_LIMITS*  Limits,
+                                LONG64                   TicksPerSecond)
+{
+    Buckets->TicksPerSecond = TicksPerSecond;
+
+    GenFilterBucketRateInitialize(&Buckets->Device,
+                                  &Limits->Device,
+                                  TicksPerSecond);
+
+    GenFilterBucketRateInitialize(&Buckets->Requester,
+                                  &Limits->Requester,
+                                  TicksPerSecond);
+
+    Buckets->Tolerance = TicksPerSecond * Limits->BurstMs / 1000;
+    Buckets->MaxDelay  = Limits->Action == GenFilterLimitFail ?
+                             0 : TicksPerSecond * Limits->MaxDelayMs / 1000;
+
+    Buckets->Limited = Buckets->Device.TicksPerRequest != 0 ||
+                       Buckets->Device.BytesPerSecond != 0 ||
+                       Buckets->Requester.TicksPerRequest != 0 ||
+                       Buckets->Requester.BytesPerSecond != 0;
+}
+
+//
+// GenFilterBucketByteCost
+//
+// How long BytesPerSecond takes to move Bytes, in ticks.  Split so that
+// it can't overflow, however fast the clock runs.
+//
+inline
+LONG64
+GenFilterBucketByteCost(ULONG  Bytes,
+                        LONG64 BytesPerSecond,
+                        LONG64 TicksPerSecond)
+{
+    return (Bytes / BytesPerSecond) * TicksPerSecond +
+           (Bytes % BytesPerSecond) * TicksPerSecond / BytesPerSecond;
+}
+
+//
+// GenFilterBucketTake
+//
+// Takes Cost ticks from a bucket if the caller would have to wait no more
+// than MaxDelay ticks to be within its rate, and returns how long that is
+// in Delay.  Otherwise takes nothing and returns false.
+//
+inline
+bool
+GenFilterBucketTake(volatile LONG64* Bucket,
+                    LONG64           Now,
+                    LONG64           Cost,
+                    LONG64           Tolerance,
+                    LONG64           MaxDelay,
+                    PLONG64          Delay)
+{
+    LONG64 full;
+    LONG64 wait;
+
+    full = *Bucket;
+
+    for (;;) {
+
+        LONG64 start = full > Now ? full : Now;
+        LONG64 seen;
+
+        wait = start - Now - Tolerance;
+
+        if (wait > MaxDelay) {
+            return false;
+        }
+
+        seen = InterlockedCompareExchange64(Bucket,
+                                            start + Cost,
+                                            full);
+
+        if (seen == full) {
+            break;
+        }
+
+        full = seen;
+    }
+
+    *Delay = wait > 0 ? wait : 0;
+
+    return true;
+}
+
+//
+// GenFilterBucketGive
+//
+// Puts back what GenFilterBucketTake took, for a Request that another of
+// its buckets refused
+//
+inline
+void
+GenFilterBucketGive(volatile LONG64* Bucket,
+                    LONG64           Cost)
+{
+    InterlockedAdd64(Bucket,
+                     -Cost);
+}
+
+//
+// GenFilterBucketFind
+//
+// The bucket in a table of GENFILTER_BUCKET_REQUESTERS that a requester
+// takes from
+//
+inline
+PGENFILTER_BUCKET
+GenFilterBucketFind(PGENFILTER_BUCKET Buckets,
+                    ULONGLONG         Requester)
+{
+    return &Buckets[GenFilterSketchHash(Requester) & (GENFILTER_BUCKET_REQUESTERS - 1)];
+}
+
+//
+// GenFilterBucketAdmit
+//
+// Takes a Request of Bytes bytes from the device's buckets and its
+// requester's, as far as Limits limits them.  Returns true with the time
+// the Request must wait (often 0) in Delay, or false, having taken
+// nothing, if that would be longer than Limits->MaxDelay.
+//
+// Each bucket is taken from on its own, so a Request that one bucket
+// refuses is given back to those that had already let it through.  Until
+// it is, a Request on another processor may see them slightly fuller than
+// they really are.
+//
+inline
+bool
+GenFilterBucketAdmit(PCGENFILTER_BUCKET_LIMITS Limits,
+                     PGENFILTER_BUCKET         Device,
+                     PGENFILTER_BUCKET         Requester,
+                     LONG64                    Now,
+                     ULONG                     Bytes,
+                     PLONG64                   Delay)
+{
+    struct {
+        volatile LONG64* Bucket;
+        LONG64           Cost;
+    } taken[4];
+
+    const GENFILTER_BUCKET_RATE* rates[2]   = { &Limits->Device, &Limits->Requester };
+    PGENFILTER_BUCKET            buckets[2] = { Device, Requester };
+    ULONG                        count      = 0;
+    LONG64                       wait;
+
+    *Delay = 0;
+
+    for (ULONG index = 0; index < 2; index++) {
+
+        if (rates[index]->TicksPerRequest != 0) {
+            taken[count].Bucket = &buckets[index]->Requests;
+            taken[count].Cost   = rates[index]->TicksPerRequest;
+            count++;
+        }
+
+        if (rates[index]->BytesPerSecond != 0 && Bytes != 0) {
+            taken[count].Bucket = &buckets[index]->Bytes;
+            taken[count].Cost   = GenFilterBucketByteCost(Bytes,
+                                                          rates[index]->BytesPerSecond,
+                                                          Limits->TicksPerSecond);
+            count++;
+        }
+    }
+
+    for (ULONG index = 0; index < count; index++) {
+
+        if (!GenFilterBucketTake(taken[index].Bucket,
+                                 Now,
+                                 taken[index].Cost,
+                                 Limits->Tolerance,
+                                 Limits->MaxDelay,
+                                 &wait)) {
+
+            while (index-- != 0) {
+                GenFilterBucketGive(taken[index].Bucket,
+                                    taken[index].Cost);
+            }
+
+            *Delay = 0;
+            return false;
+        }
+
+        if (wait > *Delay) {
+            *Delay = wait;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,1049 @@
+///
+/// @file GenFilterCache.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+#include <ntddcdrm.h>
+#include <ntdddisk.h>
+#include <ntddstor.h>
+
+static
+ULONG
+GenFilterCacheBucketOf(_In_ PGENFILTER_CACHE Cache,
+                       _In_ LONGLONG         Sector);
+
+static
+VOID
+GenFilterCacheUnlink(_In_ PGENFILTER_CACHE Cache,
+                     _In_ ULONG            EntryIndex);
+
+static
+ULONG
+GenFilterCacheClaimEntry(_In_ PGENFILTER_CACHE Cache);
+
+static
+VOID
+GenFilterCacheNoteGeometry(_In_ PGENFILTER_CACHE Cache,
+                           _In_ ULONG            IoControlCode,
+                           _In_ const VOID*      Buffer,
+                           _In_ size_t           Length);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheInitialize
+//
+//    Allocates the cache arena, its entry descriptors, and its hash buckets.
+//    All of the cache's memory is allocated here, up front; nothing is ever
+//    allocated on the I/O path.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//  OUTPUTS:
+//
+//      Cache   - The cache to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the cache could
+//                      not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterCacheInitialize(WDFDEVICE        Device,
+                         PGENFILTER_CACHE Cache)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    size_t                entriesLength;
+    size_t                bucketsLength;
+
+    RtlZeroMemory(Cache,
+                  sizeof(GENFILTER_CACHE));
+
+    //
+    // Two entries per bucket, on average, when the cache is full
+    //
+    Cache->BucketCount = GENFILTER_CACHE_BLOCK_COUNT / 2;
+
+    entriesLength = GENFILTER_CACHE_BLOCK_COUNT * sizeof(GENFILTER_CACHE_ENTRY);
+    bucketsLength = Cache->BucketCount * sizeof(GENFILTER_CACHE_BUCKET);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'cFnG',
+                             (size_t)GENFILTER_CACHE_BLOCK_COUNT * GENFILTER_CACHE_BLOCK_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for cache data failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    Cache->Data = (PUCHAR)buffer;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'cFnG',
+                             entriesLength + bucketsLength,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for cache entries failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // All entries start out Free and unlinked, and all buckets empty
+    //
+    RtlZeroMemory(buffer,
+                  entriesLength + bucketsLength);
+
+    Cache->Entries = (PGENFILTER_CACHE_ENTRY)buffer;
+    Cache->Buckets = (PGENFILTER_CACHE_BUCKET)((PUCHAR)buffer + entriesLength);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheRead
+//
+//    Attempts to satisfy a read entirely from the cache.
+//
+//  INPUTS:
+//
+//      Cache   - The cache
+//
+//      Offset  - Byte offset of the read.  Must be block aligned.
+//
+//      Length  - Length of the read.  Must be a multiple of the block size.
+//
+//  OUTPUTS:
+//
+//      Buffer  - Receives the data
+//
+//  RETURNS:
+//
+//      TRUE if every sector was found in the cache and copied to Buffer,
+//      FALSE otherwise (in which case Buffer may have been partially
+//      written).
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Each sector is copied while holding its bucket's lock shared.  That
+//      keeps the entry from being recycled under us (recycling an entry
+//      requires the lock exclusive) while letting any number of readers
+//      share the bucket.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterCacheRead(PGENFILTER_CACHE Cache,
+                   LONGLONG         Offset,
+                   PUCHAR           Buffer,
+                   size_t           Length)
+{
+    LONGLONG sector;
+    ULONG    sectorCount;
+    ULONG    generation;
+
+    sector      = Offset / GENFILTER_CACHE_BLOCK_SIZE;
+    sectorCount = (ULONG)(Length / GENFILTER_CACHE_BLOCK_SIZE);
+    generation  = (ULONG)ReadAcquire(&Cache->Generation);
+
+    for (ULONG index = 0; index < sectorCount; index++, sector++) {
+
+        PGENFILTER_CACHE_BUCKET bucket;
+        KIRQL                   oldIrql;
+        BOOLEAN                 found = FALSE;
+
+        bucket  = &Cache->Buckets[GenFilterCacheBucketOf(Cache, sector)];
+        oldIrql = ExAcquireSpinLockShared(&bucket->Lock);
+
+        for (ULONG entryIndex = bucket->Head;
+             entryIndex != 0;
+             entryIndex = Cache->Entries[entryIndex - 1].Next) {
+
+            PGENFILTER_CACHE_ENTRY entry = &Cache->Entries[entryIndex - 1];
+
+            if (entry->Sector == sector &&
+                entry->Generation == generation &&
+                ReadNoFence(&entry->State) == GENFILTER_CACHE_ENTRY_VALID) {
+
+                RtlCopyMemory(Buffer + ((size_t)index * GENFILTER_CACHE_BLOCK_SIZE),
+                              Cache->Data + ((size_t)(entryIndex - 1) * GENFILTER_CACHE_BLOCK_SIZE),
+                              GENFILTER_CACHE_BLOCK_SIZE);
+
+                //
+                // Don't dirty the cache line if the bit is already set
+                //
+                if (ReadNoFence(&entry->Referenced) == 0) {
+                    WriteNoFence(&entry->Referenced, 1);
+                }
+
+                found = TRUE;
+                break;
+            }
+        }
+
+        ExReleaseSpinLockShared(&bucket->Lock,
+                                oldIrql);
+
+        if (!found) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheFill
+//
+//    Adds the data from a completed read to the cache.
+//
+//  INPUTS:
+//
+//      Cache     - The cache
+//
+//      Ticket    - What GenFilterCacheGetTicket returned when the read was
+//                  sent.  Blocks invalidated since may be stale, and
+//                  aren't cached.
+//
+//      Offset    - Byte offset of the data.  Must be block aligned.
+//
+//      Buffer    - The data that was read
+//
+//      Length    - Length of the data.  Any partial block at the end is
+//                  ignored.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Caching is best effort: if we can't find an entry to recycle we
+//      just stop.
+//
+//      Entries are linked with the ticket's generation, not the current
+//      one, so anything read before the cache was last emptied is never
+//      found.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCacheFill(PGENFILTER_CACHE         Cache,
+                   PCGENFILTER_CACHE_TICKET Ticket,
+                   LONGLONG                 Offset,
+                   const UCHAR*             Buffer,
+                   size_t                   Length)
+{
+    LONGLONG sector;
+    ULONG    sectorCount;
+
+    sector      = Offset / GENFILTER_CACHE_BLOCK_SIZE;
+    sectorCount = (ULONG)(Length / GENFILTER_CACHE_BLOCK_SIZE);
+
+    for (ULONG index = 0; index < sectorCount; index++, sector++) {
+
+        PGENFILTER_CACHE_BUCKET bucket;
+        PGENFILTER_CACHE_ENTRY  entry;
+        ULONG                   entryIndex;
+        KIRQL                   oldIrql;
+        BOOLEAN                 linked = FALSE;
+
+        if (ReadAcquire(&Cache->Generation) != Ticket->Generation) {
+            break;
+        }
+
+        bucket = &Cache->Buckets[GenFilterCacheBucketOf(Cache, sector)];
+
+        //
+        // Don't bother copying a block we already know we can't keep
+        //
+        if ((LONG)(ReadNoFence(&bucket->Invalidated) - Ticket->Sequence) > 0) {
+            continue;
+        }
+
+        entryIndex = GenFilterCacheClaimEntry(Cache);
+
+        if (entryIndex == 0) {
+            break;
+        }
+
+        //
+        // The entry is ours (Busy) and unlinked, so nobody else can see it
+        // while we fill it in
+        //
+        entry = &Cache->Entries[entryIndex - 1];
+
+        entry->Sector     = sector;
+        entry->Referenced = 0;
+
+        RtlCopyMemory(Cache->Data + ((size_t)(entryIndex - 1) * GENFILTER_CACHE_BLOCK_SIZE),
+                      Buffer + ((size_t)index * GENFILTER_CACHE_BLOCK_SIZE),
+                      GENFILTER_CACHE_BLOCK_SIZE);
+
+        oldIrql = ExAcquireSpinLockExclusive(&bucket->Lock);
+
+        //
+        // Check again now that we hold the bucket lock.  Anybody who
+        // invalidates this block takes a sequence number *before* taking
+        // this lock, so either they'll find (and remove) our entry, or
+        // we'll see their sequence number here and not link it at all.
+        //
+        if ((LONG)(bucket->Invalidated - Ticket->Sequence) <= 0) {
+
+            BOOLEAN duplicate = FALSE;
+
+            for (ULONG chainIndex = bucket->Head;
+                 chainIndex != 0;
+                 chainIndex = Cache->Entries[chainIndex - 1].Next) {
+
+                if (Cache->Entries[chainIndex - 1].Sector == sector &&
+                    Cache->Entries[chainIndex - 1].Generation == (ULONG)Ticket->Generation) {
+
+                    duplicate = TRUE;
+                    break;
+                }
+            }
+
+            if (!duplicate) {
+
+                entry->Generation = (ULONG)Ticket->Generation;
+                entry->Next       = bucket->Head;
+                bucket->Head      = entryIndex;
+
+                WriteRelease(&entry->State,
+                             GENFILTER_CACHE_ENTRY_VALID);
+                linked = TRUE;
+            }
+        }
+
+        ExReleaseSpinLockExclusive(&bucket->Lock,
+                                   oldIrql);
+
+        if (!linked) {
+            WriteRelease(&entry->State,
+                         GENFILTER_CACHE_ENTRY_FREE);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheInvalidateRange
+//
+//    Removes any cached copies of the blocks in a byte range, and keeps
+//    reads that are already in progress from adding them back.  Called
+//    before we forward a write, and again when it completes.
+//
+//  INPUTS:
+//
+//      Cache   - The cache
+//
+//      Offset  - Byte offset of the range
+//
+//      Length  - Length of the range in bytes
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Ranges bigger than the whole cache just invalidate everything.
+//
+//      Invalidating again when the write completes catches a read that
+//      was sent after the write reached us but was serviced before it
+//      reached the device (because the write was held by the scheduler,
+//      say).  Its ticket is newer than our first invalidation, but not
+//      our second.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCacheInvalidateRange(PGENFILTER_CACHE Cache,
+                              LONGLONG         Offset,
+                              size_t           Length)
+{
+    LONGLONG firstSector;
+    LONGLONG lastSector;
+    LONG     sequence;
+
+    if (Length == 0) {
+        return;
+    }
+
+    if (Offset < 0 ||
+        Length / GENFILTER_CACHE_BLOCK_SIZE >= GENFILTER_CACHE_BLOCK_COUNT) {
+
+        GenFilterCacheInvalidate(Cache);
+        return;
+    }
+
+    //
+    // This MUST come before we look at the buckets.  See GenFilterCacheFill.
+    //
+    sequence = InterlockedIncrement(&Cache->Sequence);
+
+    firstSector = Offset / GENFILTER_CACHE_BLOCK_SIZE;
+    lastSector  = (Offset + (LONGLONG)Length - 1) / GENFILTER_CACHE_BLOCK_SIZE;
+
+    for (LONGLONG sector = firstSector; sector <= lastSector; sector++) {
+
+        PGENFILTER_CACHE_BUCKET bucket;
+        KIRQL                   oldIrql;
+        ULONG*                  link;
+
+        bucket  = &Cache->Buckets[GenFilterCacheBucketOf(Cache, sector)];
+        oldIrql = ExAcquireSpinLockExclusive(&bucket->Lock);
+
+        //
+        // Somebody who took their sequence number after us may have been
+        // here first
+        //
+        if ((LONG)(sequence - bucket->Invalidated) > 0) {
+            bucket->Invalidated = sequence;
+        }
+
+        link = &bucket->Head;
+
+        while (*link != 0) {
+
+            PGENFILTER_CACHE_ENTRY entry = &Cache->Entries[*link - 1];
+
+            if (entry->Sector != sector) {
+                link = &entry->Next;
+                continue;
+            }
+
+            *link = entry->Next;
+
+            //
+            // If somebody is busy recycling this entry it's theirs, and
+            // they'll cope with finding it already unlinked.
+            //
+            InterlockedCompareExchange(&entry->State,
+                                       GENFILTER_CACHE_ENTRY_FREE,
+                                       GENFILTER_CACHE_ENTRY_VALID);
+        }
+
+        ExReleaseSpinLockExclusive(&bucket->Lock,
+                                   oldIrql);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheSetSectorSize
+//
+//    Called with the sector size from each geometry or capacity query we
+//    see complete.  Reads are only cached once we know it.
+//
+//  INPUTS:
+//
+//      Cache       - The cache
+//
+//      SectorSize  - The device's sector size, in bytes
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Sector sizes that aren't a power of two (raw sectors, say), or that
+//      are bigger than the largest read we cache, turn caching off.  If
+//      the size changes, what we cached is for other media and is thrown
+//      away.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCacheSetSectorSize(PGENFILTER_CACHE Cache,
+                            ULONG            SectorSize)
+{
+    if ((SectorSize & (SectorSize - 1)) != 0 ||
+        SectorSize > GENFILTER_CACHE_MAX_READ) {
+        SectorSize = 0;
+    }
+
+    if (ReadNoFence(&Cache->SectorSize) == (LONG)SectorSize) {
+        return;
+    }
+
+    if (InterlockedExchange(&Cache->SectorSize,
+                            (LONG)SectorSize) != (LONG)SectorSize) {
+        GenFilterCacheInvalidate(Cache);
+    }
+}
+
+//
+// GenFilterCacheBucketOf
+//
+// Fibonacci hashing, so that runs of consecutive sectors spread out over
+// the buckets instead of piling into neighbouring ones.
+//
+static
+ULONG
+GenFilterCacheBucketOf(PGENFILTER_CACHE Cache,
+                       LONGLONG         Sector)
+{
+    return (ULONG)(((ULONGLONG)Sector * 0x9e3779b97f4a7c15ULL) >> 32) &
+           (Cache->BucketCount - 1);
+}
+
+//
+// GenFilterCacheUnlink
+//
+// Removes an entry we've claimed (Busy) from whatever bucket chain it's on.
+// It may already have been unlinked by GenFilterCacheInvalidateRange.
+//
+static
+VOID
+GenFilterCacheUnlink(PGENFILTER_CACHE Cache,
+                     ULONG            EntryIndex)
+{
+    PGENFILTER_CACHE_BUCKET bucket;
+    KIRQL                   oldIrql;
+    ULONG*                  link;
+
+    bucket  = &Cache->Buckets[GenFilterCacheBucketOf(Cache,
+                                                     Cache->Entries[EntryIndex - 1].Sector)];
+    oldIrql = ExAcquireSpinLockExclusive(&bucket->Lock);
+
+    for (link = &bucket->Head; *link != 0; link = &Cache->Entries[*link - 1].Next) {
+
+        if (*link == EntryIndex) {
+            *link = Cache->Entries[EntryIndex - 1].Next;
+            break;
+        }
+    }
+
+    ExReleaseSpinLockExclusive(&bucket->Lock,
+                               oldIrql);
+}
+
+//
+// GenFilterCacheClaimEntry
+//
+// Runs the CLOCK hand around the arena looking for an entry to (re)use:
+// a Free entry, a Valid entry from an old generation, or a Valid entry
+// that hasn't been referenced since the hand last passed it.  The entry
+// is returned Busy and unlinked.  Returns entry index + 1, or 0 if nothing
+// could be claimed in two trips around the arena.
+//
+static
+ULONG
+GenFilterCacheClaimEntry(PGENFILTER_CACHE Cache)
+{
+    ULONG generation;
+
+    generation = (ULONG)ReadNoFence(&Cache->Generation);
+
+    for (ULONG attempt = 0; attempt < 2 * GENFILTER_CACHE_BLOCK_COUNT; attempt++) {
+
+        PGENFILTER_CACHE_ENTRY entry;
+        ULONG                  entryIndex;
+        LONG                   state;
+
+        entryIndex = (ULONG)InterlockedIncrement(&Cache->ClockHand) &
+                     (GENFILTER_CACHE_BLOCK_COUNT - 1);
+        entry      = &Cache->Entries[entryIndex];
+        state      = ReadNoFence(&entry->State);
+
+        if (state == GENFILTER_CACHE_ENTRY_BUSY) {
+            continue;
+        }
+
+        if (state == GENFILTER_CACHE_ENTRY_VALID &&
+            entry->Generation == generation &&
+            InterlockedExchange(&entry->Referenced, 0) != 0) {
+
+            //
+            // Second chance
+            //
+            continue;
+        }
+
+        if (InterlockedCompareExchange(&entry->State,
+                                       GENFILTER_CACHE_ENTRY_BUSY,
+                                       state) != state) {
+            continue;
+        }
+
+        if (state == GENFILTER_CACHE_ENTRY_VALID) {
+            GenFilterCacheUnlink(Cache,
+                                 entryIndex + 1);
+        }
+
+        return entryIndex + 1;
+    }
+
+    return 0;
+}
+
+//
+// GenFilterCacheNoteGeometry
+//
+// Passes the sector size from a completed geometry or capacity query on to
+// GenFilterCacheSetSectorSize.  Anything else is ignored.
+//
+static
+VOID
+GenFilterCacheNoteGeometry(PGENFILTER_CACHE Cache,
+                           ULONG            IoControlCode,
+                           const VOID*      Buffer,
+                           size_t           Length)
+{
+    switch (IoControlCode) {
+
+        case IOCTL_CDROM_GET_DRIVE_GEOMETRY:
+        case IOCTL_CDROM_GET_DRIVE_GEOMETRY_EX:
+        case IOCTL_DISK_GET_DRIVE_GEOMETRY:
+
+            //
+            // A DISK_GEOMETRY_EX starts with a DISK_GEOMETRY
+            //
+            if (Length >= sizeof(DISK_GEOMETRY)) {
+                GenFilterCacheSetSectorSize(Cache,
+                                            ((const DISK_GEOMETRY*)Buffer)->BytesPerSector);
+            }
+
+            break;
+
+        case IOCTL_STORAGE_READ_CAPACITY:
+
+            if (Length >= RTL_SIZEOF_THROUGH_FIELD(STORAGE_READ_CAPACITY, BlockLength)) {
+                GenFilterCacheSetSectorSize(Cache,
+                                            ((const STORAGE_READ_CAPACITY*)Buffer)->BlockLength);
+            }
+
+            break;
+
+        default:
+            break;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheReadRequest
+//
+//    Called for each read Request.  If the read can be satisfied from the
+//    cache we complete it here.  Otherwise, if it's the kind of read we
+//    cache, we set up the Request's context so that its data is added to
+//    the cache when it completes.
+//
+//  INPUTS:
+//
+//      Request     - The read Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Offset      - The device offset of the read
+//
+//      Length      - The length of the read
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the Request was completed from the cache (the caller must
+//      not touch it again), FALSE if it still needs to be sent.  In the
+//      latter case, CacheFill in the Request's context says whether it
+//      must be sent with our completion callback.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      While the class driver has DO_VERIFY_VOLUME set, or for a read
+//      that's part of the file system's verification of the media
+//      (SL_OVERRIDE_VERIFY_VOLUME), the media may not be what we cached.
+//      The cache is emptied and the read goes to the device.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterCacheReadRequest(WDFREQUEST                Request,
+                          PGENFILTER_DEVICE_CONTEXT DevContext,
+                          LONGLONG                  Offset,
+                          size_t                    Length)
+{
+    NTSTATUS                   status;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PVOID                      buffer;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    reqContext->CacheFill = FALSE;
+
+    if (!GenFilterCacheIsCacheable(&DevContext->Cache,
+                                   Offset,
+                                   Length)) {
+        return FALSE;
+    }
+
+    if (GenFilterCacheVerifyPending(DevContext) ||
+        (IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request))->Flags &
+            SL_OVERRIDE_VERIFY_VOLUME) != 0) {
+
+        GenFilterMediaChanged(DevContext);
+        return FALSE;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            Length,
+                                            &buffer,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    if (GenFilterCacheRead(&DevContext->Cache,
+                           Offset,
+                           (PUCHAR)buffer,
+                           Length)) {
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatCacheHits);
+
+        GenFilterTrace(&DevContext->Trace,
+                       GenFilterTraceCacheHit,
+                       Request,
+                       STATUS_SUCCESS,
+                       (ULONGLONG)Offset);
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            STATUS_SUCCESS);
+
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          Length);
+        return TRUE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatCacheMisses);
+
+    //
+    // Remember where this read was from, and take a ticket, so we can
+    // cache its data when it completes
+    //
+    reqContext->CacheFill   = TRUE;
+    reqContext->CacheOffset = Offset;
+    reqContext->CacheLength = (ULONG)Length;
+
+    GenFilterCacheGetTicket(&DevContext->Cache,
+                            &reqContext->CacheTicket);
+
+    return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCacheRequestCompleted
+//
+//    Called from our completion callback for every Request we sent with
+//    one.  Adds the data from reads that missed in the cache, invalidates
+//    what writes changed, learns the sector size from geometry queries,
+//    and invalidates the cache if the status or IOCTL tells us the media
+//    may have changed.
+//
+//  INPUTS:
+//
+//      Request     - The completed Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Params      - The completion parameters for the Request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      We never see a media change directly.  What we do see is the class
+//      driver failing Requests with STATUS_VERIFY_REQUIRED (and friends)
+//      after one, and the media change count it returns from the various
+//      CHECK_VERIFY IOCTLs (which the routing table sends with our
+//      completion callback for exactly this reason), and DO_VERIFY_VOLUME
+//      on the class driver's device.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCacheRequestCompleted(WDFREQUEST                     Request,
+                               PGENFILTER_DEVICE_CONTEXT      DevContext,
+                               PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    NTSTATUS                   status;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDF_REQUEST_PARAMETERS     params;
+    PVOID                      buffer;
+    size_t                     length;
+
+    status     = Params->IoStatus.Status;
+    reqContext = GenFilterGetRequestContext(Request);
+
+    //
+    // Whether or not it worked, a write may have changed what's on the
+    // media (see GenFilterCacheInvalidateRange)
+    //
+    if (reqContext->CacheInvalidate) {
+
+        GenFilterCacheInvalidateRange(&DevContext->Cache,
+                                      reqContext->CacheOffset,
+                                      reqContext->CacheLength);
+    }
+
+    if (status == STATUS_VERIFY_REQUIRED ||
+        status == STATUS_MEDIA_CHANGED ||
+        status == STATUS_NO_MEDIA_IN_DEVICE ||
+        status == STATUS_DEVICE_NOT_READY) {
+
+        GenFilterMediaChanged(DevContext);
+        return;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    if (reqContext->CacheFill) {
+
+        if (GenFilterCacheVerifyPending(DevContext)) {
+
+            GenFilterMediaChanged(DevContext);
+            return;
+        }
+
+        length = Params->IoStatus.Information;
+
+        if (length > reqContext->CacheLength) {
+            length = reqContext->CacheLength;
+        }
+
+        if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                      length,
+                                                      &buffer,
+                                                      nullptr))) {
+
+            GenFilterCacheFill(&DevContext->Cache,
+                               &reqContext->CacheTicket,
+                               reqContext->CacheOffset,
+                               (const UCHAR*)buffer,
+                               length);
+        }
+        return;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    if (params.Type != WdfRequestTypeDeviceControl) {
+        return;
+    }
+
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                  0,
+                                                  &buffer,
+                                                  &length))) {
+
+        GenFilterCacheNoteGeometry(&DevContext->Cache,
+                                   params.Parameters.DeviceIoControl.IoControlCode,
+                                   buffer,
+                                   (Params->IoStatus.Information < length) ?
+                                       Params->IoStatus.Information : length);
+    }
+
+    if ((params.Parameters.DeviceIoControl.IoControlCode == IOCTL_STORAGE_CHECK_VERIFY ||
+         params.Parameters.DeviceIoControl.IoControlCode == IOCTL_STORAGE_CHECK_VERIFY2 ||
+         params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CDROM_CHECK_VERIFY ||
+         params.Parameters.DeviceIoControl.IoControlCode == IOCTL_DISK_CHECK_VERIFY) &&
+        Params->IoStatus.Information >= sizeof(ULONG) &&
+        NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                  sizeof(ULONG),
+                                                  &buffer,
+                                                  nullptr))) {
+
+        LONG mediaChangeCount = (LONG)*(PULONG)buffer;
+
+        //
+        // The first count we see just primes the comparison
+        //
+        if (InterlockedExchange(&DevContext->CacheMediaChangeCount,
+                                mediaChangeCount) != mediaChangeCount) {
+
+            GenFilterMediaChanged(DevContext);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterMediaChanged
+//
+//    Called whenever we see something that means the media may have
+//    changed.  Everything we've cached about the media is discarded,
+//    including its sector size: nothing is cached again until the next
+//    geometry query (which the file system sends when it mounts the new
+//    media) tells us what it is.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterMediaChanged(PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    InterlockedExchange(&DevContext->Cache.SectorSize,
+                        0);
+
+    GenFilterCacheInvalidate(&DevContext->Cache);
+    GenFilterQueryCacheInvalidate(&DevContext->QueryCache);
+    GenFilterIntegrityInvalidate(&DevContext->Integrity);
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatCacheInvalidations);
+}
+
+//
+// GenFilterCacheVerifyPending
+//
+// TRUE if the class driver has been told the media may have changed, and
+// nobody has verified it yet
+//
+_Use_decl_annotations_
+BOOLEAN
+GenFilterCacheVerifyPending(PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    return (WdfDeviceWdmGetAttachedDevice(DevContext->WdfDevice)->Flags &
+            DO_VERIFY_VOLUME) != 0;
+}
@@ -0,0 +1,240 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterCache.h
+//
+//    ABSTRACT:
+//
+//      Sector read cache.  A fixed, preallocated arena of block-sized slots,
+//      found through a hash table with a reader/writer spin lock per bucket and
+//      recycled with the CLOCK (second chance) algorithm.  Invalidating the
+//      whole cache (on a media change) is O(1): we just bump its generation.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+//
+// The unit the cache stores data in.  Reads are only cached once we know
+// the device's sector size (see GenFilterCacheSetSectorSize), and then only
+// if they're in whole, aligned, units of this or the sector size, whichever
+// is larger.
+//
+constexpr ULONG GENFILTER_CACHE_BLOCK_SIZE = 2048;
+
+//
+// Number of blocks in the cache arena.  MUST be a power of two.
+//
+constexpr ULONG GENFILTER_CACHE_BLOCK_COUNT = 2048;
+
+//
+// Reads larger than this are passed straight through without looking in
+// (or filling) the cache.
+//
+constexpr ULONG GENFILTER_CACHE_MAX_READ = 64 * 1024;
+
+static_assert((GENFILTER_CACHE_BLOCK_COUNT & (GENFILTER_CACHE_BLOCK_COUNT - 1)) == 0,
+              "GENFILTER_CACHE_BLOCK_COUNT must be a power of two");
+
+//
+// Entry states.  Only the thread that moves an entry to Busy may change its
+// contents or move it out of Busy.
+//
+constexpr LONG GENFILTER_CACHE_ENTRY_FREE  = 0;
+constexpr LONG GENFILTER_CACHE_ENTRY_VALID = 1;
+constexpr LONG GENFILTER_CACHE_ENTRY_BUSY  = 2;
+
+//
+// Describes one block-sized slot of the arena.  Sector is the number of the
+// block it holds (its offset / GENFILTER_CACHE_BLOCK_SIZE).  Chains are
+// linked by entry index + 1 (0 terminates a chain).
+//
+typedef struct _GENFILTER_CACHE_ENTRY {
+    LONGLONG      Sector;
+    ULONG         Generation;
+    ULONG         Next;
+    volatile LONG State;
+    volatile LONG Referenced;           // CLOCK "second chance" bit
+} GENFILTER_CACHE_ENTRY, *PGENFILTER_CACHE_ENTRY;
+
+//
+// Invalidated: The cache's Sequence when a range invalidation last touched
+//              this bucket.  Set with the bucket's lock held exclusive.
+//
+typedef struct _GENFILTER_CACHE_BUCKET {
+    EX_SPIN_LOCK Lock;
+    ULONG        Head;
+    LONG         Invalidated;
+} GENFILTER_CACHE_BUCKET, *PGENFILTER_CACHE_BUCKET;
+
+//
+// The per-device sector cache that lives in our device context
+//
+// Generation: Entries are only valid if they carry the current generation,
+//             so bumping it empties the cache at once.
+//
+// Sequence:   Bumped by every invalidation.  A read takes a ticket (the
+//             sequence and generation) when it's sent, and a block it
+//             returns is only added to the cache if no invalidation that
+//             started after that has touched the block's bucket.  So a
+//             write only keeps reads of its own buckets out of the cache.
+//
+// SectorSize: The device's sector size, from the last geometry or capacity
+//             query we saw complete, or 0 if we don't know it (or can't
+//             cache with it).
+//
+typedef struct _GENFILTER_CACHE {
+    PGENFILTER_CACHE_ENTRY  Entries;
+    PGENFILTER_CACHE_BUCKET Buckets;
+    PUCHAR                  Data;
+    ULONG                   BucketCount;
+    volatile LONG           Generation;
+    volatile LONG           Sequence;
+    volatile LONG           SectorSize;
+    volatile LONG           ClockHand;
+} GENFILTER_CACHE, *PGENFILTER_CACHE;
+
+//
+// What a read records when it's sent, so that its data can be cached when
+// it completes (see GenFilterCacheFill)
+//
+typedef struct _GENFILTER_CACHE_TICKET {
+    LONG Sequence;
+    LONG Generation;
+} GENFILTER_CACHE_TICKET, *PGENFILTER_CACHE_TICKET;
+
+typedef const GENFILTER_CACHE_TICKET* PCGENFILTER_CACHE_TICKET;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterCacheInitialize(_In_ WDFDEVICE Device, _Out_ PGENFILTER_CACHE Cache);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterCacheRead(_In_ PGENFILTER_CACHE Cache,
+                   _In_ LONGLONG Offset,
+                   _Out_writes_bytes_(Length) PUCHAR Buffer,
+                   _In_ size_t Length);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCacheFill(_In_ PGENFILTER_CACHE Cache,
+                   _In_ PCGENFILTER_CACHE_TICKET Ticket,
+                   _In_ LONGLONG Offset,
+                   _In_reads_bytes_(Length) const UCHAR* Buffer,
+                   _In_ size_t Length);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCacheInvalidateRange(_In_ PGENFILTER_CACHE Cache,
+                              _In_ LONGLONG Offset,
+                              _In_ size_t Length);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCacheSetSectorSize(_In_ PGENFILTER_CACHE Cache,
+                            _In_ ULONG SectorSize);
+
+//
+// GenFilterCacheIsCacheable
+//
+// TRUE if a read of Length bytes at Offset is something we cache
+//
+FORCEINLINE
+BOOLEAN
+GenFilterCacheIsCacheable(_In_ PGENFILTER_CACHE Cache,
+                          _In_ LONGLONG         Offset,
+                          _In_ size_t           Length)
+{
+    ULONG unit;
+
+    unit = (ULONG)ReadNoFence(&Cache->SectorSize);
+
+    if (unit == 0) {
+        return FALSE;
+    }
+
+    if (unit < GENFILTER_CACHE_BLOCK_SIZE) {
+        unit = GENFILTER_CACHE_BLOCK_SIZE;
+    }
+
+    return (Length != 0 &&
+            Length <= GENFILTER_CACHE_MAX_READ &&
+            Offset >= 0 &&
+            (Offset % unit) == 0 &&
+            (Length % unit) == 0);
+}
+
+//
+// GenFilterCacheGetTicket
+//
+// Called as a read we may cache is sent
+//
+FORCEINLINE
+VOID
+GenFilterCacheGetTicket(_In_ PGENFILTER_CACHE         Cache,
+                        _Out_ PGENFILTER_CACHE_TICKET Ticket)
+{
+    Ticket->Sequence   = ReadAcquire(&Cache->Sequence);
+    Ticket->Generation = ReadAcquire(&Cache->Generation);
+}
+
+FORCEINLINE
+LONG
+GenFilterCacheGetSequence(_In_ PGENFILTER_CACHE Cache)
+{
+    return ReadAcquire(&Cache->Sequence);
+}
+
+//
+// GenFilterCacheInvalidate
+//
+// Empties the cache.  A read that's currently in progress holds a ticket
+// from the old generation, so it can't put (possibly stale) data back.
+//
+FORCEINLINE
+VOID
+GenFilterCacheInvalidate(_In_ PGENFILTER_CACHE Cache)
+{
+    InterlockedIncrement(&Cache->Sequence);
+    InterlockedIncrement(&Cache->Generation);
+}
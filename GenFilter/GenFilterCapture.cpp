@@ -0,0 +1,530 @@
+///
+/// @file GenFilterCapture.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+//
+// A capture record's Flags are the route's flags, unchanged
+//
+static_assert(GENFILTER_CAPTURE_FLAG_INVALIDATE_CACHE == GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE &&
+              GENFILTER_CAPTURE_FLAG_COALESCE == GENFILTER_ROUTE_FLAG_COALESCE &&
+              GENFILTER_CAPTURE_FLAG_CACHE_RESULT == GENFILTER_ROUTE_FLAG_CACHE_RESULT &&
+              GENFILTER_CAPTURE_FLAG_FLUSH_WRITES == GENFILTER_ROUTE_FLAG_FLUSH_WRITES,
+              "GENFILTER_CAPTURE_FLAG_xxx must match GENFILTER_ROUTE_FLAG_xxx");
+
+static
+ULONG
+GenFilterCaptureDrain(_In_ PGENFILTER_CAPTURE Capture,
+                      _Out_writes_bytes_(BufferLength) PGENFILTER_CAPTURE_HEADER Buffer,
+                      _In_ size_t BufferLength);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCaptureInitialize
+//
+//    Reads the "Capture" value from the device's hardware key, and if
+//    capture is on, allocates a capture ring for each possible processor and
+//    the lock that serializes draining them.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the capture could
+//                      not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The rings are laid out just as the trace log's are (see
+//      GenFilterTraceInitialize).
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterCaptureInitialize(WDFDEVICE                 Device,
+                           PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS                  status;
+    WDF_OBJECT_ATTRIBUTES     objectAttr;
+    WDFMEMORY                 memory;
+    PVOID                     buffer;
+    size_t                    ringsLength;
+    size_t                    recordsLength;
+    ULONG                     ringCount;
+    PGENFILTER_CAPTURE_RECORD records;
+    LARGE_INTEGER             frequency;
+    PGENFILTER_CAPTURE        capture;
+    WDFKEY                    key     = nullptr;
+    ULONG                     enabled = 0;
+
+    DECLARE_CONST_UNICODE_STRING(captureValueName, L"Capture");
+
+    capture = &DevContext->Capture;
+
+    RtlZeroMemory(capture,
+                  sizeof(GENFILTER_CAPTURE));
+
+    KeQueryPerformanceCounter(&frequency);
+
+    capture->Frequency = (ULONGLONG)frequency.QuadPart;
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (!NT_SUCCESS(status)) {
+        key    = nullptr;
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                          &captureValueName,
+                                          &enabled)) ||
+        enabled != 1) {
+
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    ringCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    ringsLength   = ringCount * sizeof(GENFILTER_CAPTURE_RING);
+    recordsLength = (size_t)ringCount * GENFILTER_CAPTURE_RECORDS_PER_RING *
+                    sizeof(GENFILTER_CAPTURE_RECORD);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &capture->DrainLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for capture failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'pFnG',
+                             ringsLength + recordsLength +
+                             SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for capture failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  ringsLength + recordsLength + SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    capture->Rings = (PGENFILTER_CAPTURE_RING)ALIGN_UP_BY(buffer,
+                                                          SYSTEM_CACHE_ALIGNMENT_SIZE);
+    records = (PGENFILTER_CAPTURE_RECORD)((PUCHAR)capture->Rings + ringsLength);
+
+    for (ULONG ring = 0; ring < ringCount; ring++) {
+
+        capture->Rings[ring].Records = &records[ring * GENFILTER_CAPTURE_RECORDS_PER_RING];
+    }
+
+    capture->RingCount = ringCount;
+    capture->Enabled   = TRUE;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (key != nullptr) {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+//
+// GenFilterCaptureStart
+//
+_Use_decl_annotations_
+VOID
+GenFilterCaptureStart(PGENFILTER_DEVICE_CONTEXT DevContext,
+                      WDFREQUEST                Request,
+                      ULONG                     Flags)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->CaptureStart = 0;
+
+    if (!DevContext->Capture.Enabled) {
+        return;
+    }
+
+    reqContext->CaptureFlags = (UCHAR)Flags;
+    reqContext->CaptureStart = KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCaptureStop
+//
+//    Records a Request that's about to be completed in the calling
+//    processor's capture ring.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Request     - The Request that's about to be completed
+//
+//      Status      - The status it's being completed with
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Slots are claimed and published exactly as GenFilterTrace does.
+//      Requests that weren't started while capture was on aren't recorded,
+//      and nor is anything twice: the Request's start time is cleared once
+//      it has been.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCaptureStop(PGENFILTER_DEVICE_CONTEXT DevContext,
+                     WDFREQUEST                Request,
+                     NTSTATUS                  Status)
+{
+    PGENFILTER_CAPTURE         capture = &DevContext->Capture;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDF_REQUEST_PARAMETERS     params;
+    PGENFILTER_CAPTURE_RING    ring;
+    PGENFILTER_CAPTURE_RECORD  record;
+    ULONG                      cpu;
+    ULONG                      index;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (reqContext->CaptureStart == 0) {
+        return;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    if (cpu >= capture->RingCount) {
+        cpu %= capture->RingCount;
+    }
+
+    ring   = &capture->Rings[cpu];
+    index  = (ULONG)InterlockedIncrementNoFence(&ring->Head) - 1;
+    record = &ring->Records[index & (GENFILTER_CAPTURE_RECORDS_PER_RING - 1)];
+
+    record->Flags          = reqContext->CaptureFlags;
+    record->Processor      = (USHORT)cpu;
+    record->Status         = Status;
+    record->IoControlCode  = 0;
+    record->Offset         = 0;
+    record->Length         = 0;
+    record->InputLength    = 0;
+    record->IssueTime      = (ULONGLONG)reqContext->CaptureStart;
+    record->CompletionTime = (ULONGLONG)KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    switch (params.Type) {
+
+        case WdfRequestTypeRead:
+            record->Type   = GenFilterCaptureRead;
+            record->Offset = (ULONGLONG)params.Parameters.Read.DeviceOffset;
+            record->Length = (ULONG)params.Parameters.Read.Length;
+            break;
+
+        case WdfRequestTypeWrite:
+            record->Type   = GenFilterCaptureWrite;
+            record->Offset = (ULONGLONG)params.Parameters.Write.DeviceOffset;
+            record->Length = (ULONG)params.Parameters.Write.Length;
+            break;
+
+        default:
+            record->Type          = GenFilterCaptureDeviceControl;
+            record->IoControlCode = params.Parameters.DeviceIoControl.IoControlCode;
+            record->Length        = (ULONG)params.Parameters.DeviceIoControl.OutputBufferLength;
+            record->InputLength   = (ULONG)params.Parameters.DeviceIoControl.InputBufferLength;
+            break;
+    }
+
+    WriteRelease((volatile LONG*)&record->Sequence,
+                 (LONG)(index + 1));
+
+    reqContext->CaptureStart = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCaptureQuery
+//
+//    Handles IOCTL_GENFILTER_DRAIN_CAPTURE by draining as much of the
+//    capture as fits into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_DRAIN_CAPTURE Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      hold a GENFILTER_CAPTURE_HEADER.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller completes the Request.  If capture is off, the header
+//      says so and no records follow it.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterCaptureQuery(WDFREQUEST                Request,
+                      PGENFILTER_DEVICE_CONTEXT DevContext,
+                      PULONG_PTR                Information)
+{
+    NTSTATUS                  status;
+    PGENFILTER_CAPTURE_HEADER header;
+    size_t                    bufferLength;
+    ULONG                     count;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(GENFILTER_CAPTURE_HEADER),
+                                            (PVOID*)&header,
+                                            &bufferLength);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    count = GenFilterCaptureDrain(&DevContext->Capture,
+                                  header,
+                                  bufferLength);
+
+    *Information = sizeof(GENFILTER_CAPTURE_HEADER) +
+                   ((ULONG_PTR)count * sizeof(GENFILTER_CAPTURE_RECORD));
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCaptureDrain
+//
+//    Moves as many records as will fit from the capture rings into the
+//    caller's buffer.
+//
+//  INPUTS:
+//
+//      Capture      - The capture to drain
+//
+//      BufferLength - Size in bytes of Buffer.  Must be at least
+//                     sizeof(GENFILTER_CAPTURE_HEADER).
+//
+//  OUTPUTS:
+//
+//      Buffer       - Receives a GENFILTER_CAPTURE_HEADER followed by the
+//                     drained records
+//
+//  RETURNS:
+//
+//      The number of records drained.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      This is GenFilterTraceDrain for capture records: records a writer
+//      may have overwritten while we copied them are thrown away and
+//      counted as lost, and records come out grouped by ring, not in time
+//      order.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+ULONG
+GenFilterCaptureDrain(PGENFILTER_CAPTURE        Capture,
+                      PGENFILTER_CAPTURE_HEADER Buffer,
+                      size_t                    BufferLength)
+{
+    PGENFILTER_CAPTURE_RECORD out;
+    ULONG                     capacity;
+    ULONG                     count;
+    ULONGLONG                 lost;
+
+    out      = (PGENFILTER_CAPTURE_RECORD)(Buffer + 1);
+    capacity = (ULONG)((BufferLength - sizeof(GENFILTER_CAPTURE_HEADER)) /
+                       sizeof(GENFILTER_CAPTURE_RECORD));
+    count    = 0;
+    lost     = 0;
+
+    if (Capture->Enabled) {
+        WdfSpinLockAcquire(Capture->DrainLock);
+    }
+
+    for (ULONG ringIndex = 0;
+         ringIndex < Capture->RingCount && count < capacity;
+         ringIndex++) {
+
+        PGENFILTER_CAPTURE_RING ring = &Capture->Rings[ringIndex];
+        ULONG                   head;
+        ULONG                   index;
+        ULONG                   firstOut;
+        ULONG                   overwritten;
+
+        head = (ULONG)ReadAcquire(&ring->Head);
+
+        if (head - ring->Tail > GENFILTER_CAPTURE_RECORDS_PER_RING) {
+
+            lost += head - ring->Tail - GENFILTER_CAPTURE_RECORDS_PER_RING;
+            ring->Tail = head - GENFILTER_CAPTURE_RECORDS_PER_RING;
+        }
+
+        firstOut = count;
+
+        for (index = ring->Tail; index != head && count < capacity; index++) {
+
+            PGENFILTER_CAPTURE_RECORD record;
+
+            record = &ring->Records[index & (GENFILTER_CAPTURE_RECORDS_PER_RING - 1)];
+
+            if ((ULONG)ReadAcquire((volatile LONG*)&record->Sequence) != index + 1) {
+                break;
+            }
+
+            out[count] = *record;
+            count++;
+        }
+
+        KeMemoryBarrier();
+
+        head = (ULONG)ReadAcquire(&ring->Head);
+
+        overwritten = 0;
+
+        if ((LONG)(head - GENFILTER_CAPTURE_RECORDS_PER_RING - ring->Tail) > 0) {
+
+            overwritten = head - GENFILTER_CAPTURE_RECORDS_PER_RING - ring->Tail;
+
+            if (overwritten > count - firstOut) {
+                overwritten = count - firstOut;
+            }
+        }
+
+        if (overwritten != 0) {
+
+            RtlMoveMemory(&out[firstOut],
+                          &out[firstOut + overwritten],
+                          (count - firstOut - overwritten) *
+                          sizeof(GENFILTER_CAPTURE_RECORD));
+
+            count -= overwritten;
+            lost  += overwritten;
+        }
+
+        ring->Tail = index;
+    }
+
+    if (Capture->Enabled) {
+        WdfSpinLockRelease(Capture->DrainLock);
+    }
+
+    Buffer->Size        = sizeof(GENFILTER_CAPTURE_HEADER);
+    Buffer->RecordSize  = sizeof(GENFILTER_CAPTURE_RECORD);
+    Buffer->RecordCount = count;
+    Buffer->Enabled     = Capture->Enabled ? 1 : 0;
+    Buffer->Frequency   = Capture->Frequency;
+    Buffer->LostRecords = lost;
+
+    return count;
+}
@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterCapture.h
+//
+//    ABSTRACT:
+//
+//      I/O capture.  Records every Request the filter is given -- what it was,
+//      when it arrived, and when and how it completed -- in per-processor rings
+//      that are drained through IOCTL_GENFILTER_DRAIN_CAPTURE, so real traffic
+//      can be replayed offline (see "GenFilterCtl replay", and
+//      GenFilterSimBench's --mode replay).
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterIoctl.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Records in each processor's ring.  MUST be a power of two.
+//
+constexpr ULONG GENFILTER_CAPTURE_RECORDS_PER_RING = 4096;
+
+static_assert((GENFILTER_CAPTURE_RECORDS_PER_RING &
+               (GENFILTER_CAPTURE_RECORDS_PER_RING - 1)) == 0,
+              "GENFILTER_CAPTURE_RECORDS_PER_RING must be a power of two");
+
+//
+// The state of one processor's ring, exactly as for the trace log (see
+// GENFILTER_TRACE_RING)
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_CAPTURE_RING {
+    volatile LONG             Head;     // Records ever claimed
+    ULONG                     Tail;     // Next record to drain
+    PGENFILTER_CAPTURE_RECORD Records;
+} GENFILTER_CAPTURE_RING, *PGENFILTER_CAPTURE_RING;
+
+//
+// The per-device capture that lives in our device context.  Nothing is
+// allocated, and nothing recorded, unless the "Capture" value in the
+// device's hardware key is 1.
+//
+typedef struct _GENFILTER_CAPTURE {
+    BOOLEAN                 Enabled;
+    ULONG                   RingCount;
+    PGENFILTER_CAPTURE_RING Rings;
+    WDFSPINLOCK             DrainLock;
+    ULONGLONG               Frequency;
+} GENFILTER_CAPTURE, *PGENFILTER_CAPTURE;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterCaptureInitialize(_In_ WDFDEVICE Device,
+                           _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Called when we're given a Request.  Flags are the GENFILTER_ROUTE_FLAG_xxx
+// a device control was routed by (0 for reads and writes).
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCaptureStart(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ WDFREQUEST Request,
+                      _In_ ULONG Flags);
+
+//
+// Called just before we complete a Request, wherever that happens (from
+// the logging policy's Completing hook, which every completion path
+// reaches through GenFilterCompleting)
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCaptureStop(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                     _In_ WDFREQUEST Request,
+                     _In_ NTSTATUS Status);
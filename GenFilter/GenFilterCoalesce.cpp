@@ -0,0 +1,440 @@
+///
+/// @file GenFilterCoalesce.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCoalesceInitialize
+//
+//    Creates the lock and the manual Queues used to park duplicate
+//    Requests.
+//
+//  INPUTS:
+//
+//      Device   - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//  OUTPUTS:
+//
+//      Coalesce - The coalescing state to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why coalescing could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Parking Requests in manual Queues means the Framework takes care of
+//      cancelling them for us.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterCoalesceInitialize(WDFDEVICE           Device,
+                            PGENFILTER_COALESCE Coalesce)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_IO_QUEUE_CONFIG   ioQueueConfig;
+
+    RtlZeroMemory(Coalesce,
+                  sizeof(GENFILTER_COALESCE));
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &Coalesce->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for coalescing failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < GENFILTER_COALESCE_SLOTS; index++) {
+
+        WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig,
+                                 WdfIoQueueDispatchManual);
+
+        status = WdfIoQueueCreate(Device,
+                                  &ioQueueConfig,
+                                  WDF_NO_OBJECT_ATTRIBUTES,
+                                  &Coalesce->Slots[index].Parked);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfIoQueueCreate for coalescing failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCoalesceRequest
+//
+//    Called for device control Requests whose route says they may be
+//    coalesced.  If an identical Request is already in flight, this one is
+//    parked behind it.  Otherwise this one becomes the leader for any
+//    identical Requests that arrive while it's in flight.
+//
+//  INPUTS:
+//
+//      Request            - The device control Request
+//
+//      DevContext         - Pointer to our WDFDEVICE context
+//
+//      IoControlCode      - The operation being performed
+//
+//      InputBufferLength  - The length of the input buffer
+//
+//      OutputBufferLength - The length of the output buffer
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the Request was parked (the caller must not touch it
+//      again).  FALSE if the caller must send it.  In that case, if
+//      CoalesceSlot in the Request's context is set, the Request is a
+//      leader and MUST be sent with our completion callback.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      "Identical" means same control code, same buffer lengths, same
+//      input bytes, same stack location flags, and same requestor mode (see
+//      GENFILTER_COALESCE_SLOT).  Only METHOD_BUFFERED codes are coalesced,
+//      so the result can be copied from one system buffer to another.
+//
+//      At most GENFILTER_COALESCE_MAX_PARKED Requests are parked behind a
+//      leader.  Past that, an identical Request is sent down on its own,
+//      neither parked nor leading.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterCoalesceRequest(WDFREQUEST                Request,
+                         PGENFILTER_DEVICE_CONTEXT DevContext,
+                         ULONG                     IoControlCode,
+                         size_t                    InputBufferLength,
+                         size_t                    OutputBufferLength)
+{
+    NTSTATUS                   status;
+    PGENFILTER_COALESCE        coalesce;
+    PGENFILTER_COALESCE_SLOT   freeSlot = nullptr;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PVOID                      input    = nullptr;
+    BOOLEAN                    parked   = FALSE;
+    UCHAR                      stackFlags;
+    KPROCESSOR_MODE            requestorMode;
+
+    coalesce   = &DevContext->Coalesce;
+    reqContext = GenFilterGetRequestContext(Request);
+    reqContext->CoalesceSlot = nullptr;
+
+    if (METHOD_FROM_CTL_CODE(IoControlCode) != METHOD_BUFFERED ||
+        InputBufferLength > GENFILTER_COALESCE_MAX_INPUT ||
+        OutputBufferLength > MAXULONG) {
+        return FALSE;
+    }
+
+    if (InputBufferLength != 0) {
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+                                               InputBufferLength,
+                                               &input,
+                                               nullptr);
+
+        if (!NT_SUCCESS(status)) {
+            return FALSE;
+        }
+    }
+
+    stackFlags    = IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request))->Flags;
+    requestorMode = WdfRequestGetRequestorMode(Request);
+
+    WdfSpinLockAcquire(coalesce->Lock);
+
+    for (ULONG index = 0; index < GENFILTER_COALESCE_SLOTS; index++) {
+
+        PGENFILTER_COALESCE_SLOT slot = &coalesce->Slots[index];
+
+        if (slot->State == GENFILTER_COALESCE_FREE) {
+
+            if (freeSlot == nullptr) {
+                freeSlot = slot;
+            }
+            continue;
+        }
+
+        if (slot->State != GENFILTER_COALESCE_IN_FLIGHT ||
+            slot->IoControlCode != IoControlCode ||
+            slot->InputLength != InputBufferLength ||
+            slot->OutputLength != OutputBufferLength ||
+            slot->StackFlags != stackFlags ||
+            slot->RequestorMode != requestorMode ||
+            (InputBufferLength != 0 &&
+             RtlCompareMemory(slot->Input,
+                              input,
+                              InputBufferLength) != InputBufferLength)) {
+            continue;
+        }
+
+        //
+        // Found one, but it already has as many parked behind it as we'll
+        // complete in one go, so send this one down on its own
+        //
+        if (slot->ParkedCount >= GENFILTER_COALESCE_MAX_PARKED) {
+            goto done;
+        }
+
+        //
+        // Park this Request behind it.  This has to happen under
+        // the lock, so the leader can't start draining the Queue until
+        // we're in it.  A parked Request is completed by its leader, not by
+        // our completion callback, so first give up any query cache entry
+        // it reserved: once it's parked, it may be completed (and gone)
+        // before we get the chance.
+        //
+        GenFilterQueryCacheRelease(Request,
+                                   DevContext);
+
+        status = WdfRequestForwardToIoQueue(Request,
+                                            slot->Parked);
+
+        if (NT_SUCCESS(status)) {
+            slot->ParkedCount++;
+            parked = TRUE;
+        }
+
+        goto done;
+    }
+
+    //
+    // Nothing identical in flight, so this one leads
+    //
+    if (freeSlot != nullptr) {
+
+        freeSlot->State         = GENFILTER_COALESCE_IN_FLIGHT;
+        freeSlot->IoControlCode = IoControlCode;
+        freeSlot->InputLength   = (ULONG)InputBufferLength;
+        freeSlot->OutputLength  = (ULONG)OutputBufferLength;
+        freeSlot->StackFlags    = stackFlags;
+        freeSlot->RequestorMode = requestorMode;
+        freeSlot->ParkedCount   = 0;
+
+        if (InputBufferLength != 0) {
+            RtlCopyMemory(freeSlot->Input,
+                          input,
+                          InputBufferLength);
+        }
+
+        reqContext->CoalesceSlot = freeSlot;
+    }
+
+done:
+
+    WdfSpinLockRelease(coalesce->Lock);
+
+    if (parked) {
+
+        GenFilterTrace(&DevContext->Trace,
+                       GenFilterTraceCoalesced,
+                       Request,
+                       STATUS_SUCCESS,
+                       IoControlCode);
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatCoalesced);
+    }
+
+    return parked;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterCoalesceLeaderDone
+//
+//    Called just before we complete any Request we sent with our completion
+//    callback (or failed to send).  If the Request was a coalescing leader,
+//    every Request parked behind it is completed with its result.
+//
+//  INPUTS:
+//
+//      Request     - The Request that's about to be completed
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Status      - The status it's being completed with
+//
+//      Information - The number of output bytes it's returning
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Request must not have been completed yet: we copy the result out of
+//      its output buffer.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterCoalesceLeaderDone(WDFREQUEST                Request,
+                            PGENFILTER_DEVICE_CONTEXT DevContext,
+                            NTSTATUS                  Status,
+                            ULONG_PTR                 Information)
+{
+    NTSTATUS                   status;
+    PGENFILTER_COALESCE        coalesce;
+    PGENFILTER_COALESCE_SLOT   slot;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PVOID                      result = nullptr;
+    WDFREQUEST                 parkedRequest;
+
+    coalesce   = &DevContext->Coalesce;
+    reqContext = GenFilterGetRequestContext(Request);
+    slot       = reqContext->CoalesceSlot;
+
+    if (slot == nullptr) {
+        return;
+    }
+
+    reqContext->CoalesceSlot = nullptr;
+
+    //
+    // Stop anybody else parking behind us
+    //
+    WdfSpinLockAcquire(coalesce->Lock);
+
+    slot->State = GENFILTER_COALESCE_DRAINING;
+
+    WdfSpinLockRelease(coalesce->Lock);
+
+    if (Information > slot->OutputLength) {
+        Information = slot->OutputLength;
+    }
+
+    if (Information != 0 &&
+        !NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                   Information,
+                                                   &result,
+                                                   nullptr))) {
+        Information = 0;
+    }
+
+    while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(slot->Parked,
+                                                    &parkedRequest))) {
+
+        PVOID     buffer;
+        NTSTATUS  parkedStatus      = Status;
+        ULONG_PTR parkedInformation = Information;
+
+        if (Information != 0) {
+
+            status = WdfRequestRetrieveOutputBuffer(parkedRequest,
+                                                    Information,
+                                                    &buffer,
+                                                    nullptr);
+
+            if (NT_SUCCESS(status)) {
+
+                RtlCopyMemory(buffer,
+                              result,
+                              Information);
+            } else {
+
+                parkedStatus      = status;
+                parkedInformation = 0;
+            }
+        }
+
+        GenFilterTrace(&DevContext->Trace,
+                       GenFilterTraceCompletion,
+                       parkedRequest,
+                       parkedStatus,
+                       parkedInformation);
+
+        GenFilterCompleting(DevContext,
+                            parkedRequest,
+                            parkedStatus);
+
+        WdfRequestCompleteWithInformation(parkedRequest,
+                                          parkedStatus,
+                                          parkedInformation);
+    }
+
+    WdfSpinLockAcquire(coalesce->Lock);
+
+    slot->State = GENFILTER_COALESCE_FREE;
+
+    WdfSpinLockRelease(coalesce->Lock);
+}
@@ -0,0 +1,135 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterCoalesce.h
+//
+//    ABSTRACT:
+//
+//      Single-flight coalescing of identical in-flight device control Requests.
+//      While one copy of an idempotent query IOCTL is outstanding, identical
+//      copies are parked and completed with its result.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Number of distinct Requests that can be in flight, with duplicates parked
+// behind them, at any one time.  Beyond this, Requests just aren't coalesced.
+//
+constexpr ULONG GENFILTER_COALESCE_SLOTS = 8;
+
+//
+// Most Requests parked behind any one leader.  The leader's completion
+// completes every one of them, at DISPATCH_LEVEL, so this bounds how long
+// that takes.  Beyond this, identical Requests are sent down on their own.
+//
+constexpr ULONG GENFILTER_COALESCE_MAX_PARKED = 32;
+
+//
+// Largest input buffer we'll compare.  Requests with more input than this
+// aren't coalesced.
+//
+constexpr ULONG GENFILTER_COALESCE_MAX_INPUT = 64;
+
+//
+// Slot states
+//
+// Free     - Available to a new leader
+// InFlight - Leader sent; identical Requests are parked behind it
+// Draining - Leader completed; parked Requests are being completed.  No new
+//            Requests are parked, and the slot can't be reused yet.
+//
+constexpr LONG GENFILTER_COALESCE_FREE      = 0;
+constexpr LONG GENFILTER_COALESCE_IN_FLIGHT = 1;
+constexpr LONG GENFILTER_COALESCE_DRAINING  = 2;
+
+//
+// One in-flight Request (the "leader") and the identical Requests parked
+// behind it.  Everything but Parked is protected by GENFILTER_COALESCE.Lock.
+//
+// StackFlags and RequestorMode are part of what makes Requests identical:
+// a Request with SL_OVERRIDE_VERIFY_VOLUME (a file system checking the
+// media while it verifies the volume) can get a different answer from the
+// class driver than one without, and a kernel-mode caller's result is not
+// a user-mode caller's.
+//
+typedef struct _GENFILTER_COALESCE_SLOT {
+    LONG            State;
+    ULONG           IoControlCode;
+    ULONG           InputLength;
+    ULONG           OutputLength;
+    UCHAR           StackFlags;
+    KPROCESSOR_MODE RequestorMode;
+    ULONG           ParkedCount;
+    WDFQUEUE        Parked;             // Manual queue
+    UCHAR           Input[GENFILTER_COALESCE_MAX_INPUT];
+} GENFILTER_COALESCE_SLOT, *PGENFILTER_COALESCE_SLOT;
+
+//
+// The per-device coalescing state that lives in our device context
+//
+typedef struct _GENFILTER_COALESCE {
+    WDFSPINLOCK             Lock;
+    GENFILTER_COALESCE_SLOT Slots[GENFILTER_COALESCE_SLOTS];
+} GENFILTER_COALESCE, *PGENFILTER_COALESCE;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterCoalesceInitialize(_In_ WDFDEVICE Device, _Out_ PGENFILTER_COALESCE Coalesce);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterCoalesceRequest(_In_ WDFREQUEST Request,
+                         _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                         _In_ ULONG IoControlCode,
+                         _In_ size_t InputBufferLength,
+                         _In_ size_t OutputBufferLength);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterCoalesceLeaderDone(_In_ WDFREQUEST Request,
+                            _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                            _In_ NTSTATUS Status,
+                            _In_ ULONG_PTR Information);
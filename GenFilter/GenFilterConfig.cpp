@@ -0,0 +1,904 @@
+///
+/// @file GenFilterConfig.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+NTSTATUS
+GenFilterConfigCreateSnapshot(_In_ WDFDEVICE Device,
+                              _Out_ PGENFILTER_CONFIG_SNAPSHOT* Snapshot);
+
+static
+VOID
+GenFilterConfigReadRegistry(_In_ WDFDEVICE Device,
+                            _Inout_ PGENFILTER_CONFIG_SNAPSHOT Snapshot);
+
+static
+VOID
+GenFilterConfigReadInspect(_In_ WDFDEVICE Device,
+                           _In_ WDFKEY Key,
+                           _Inout_ PGENFILTER_CONFIG_SNAPSHOT Snapshot);
+
+static
+VOID
+GenFilterConfigReadLimits(_In_ WDFKEY Key,
+                          _Inout_ PGENFILTER_CONFIG_SNAPSHOT Snapshot);
+
+static
+BOOLEAN
+GenFilterConfigLimitsValid(_In_ const GENFILTER_LIMITS* Limits);
+
+static
+VOID
+GenFilterConfigSetLimits(_Inout_ PGENFILTER_CONFIG_SNAPSHOT Snapshot,
+                         _In_ const GENFILTER_LIMITS* Limits);
+
+static
+VOID
+GenFilterConfigReadSplit(_In_ WDFKEY Key,
+                         _Inout_ PGENFILTER_CONFIG_SNAPSHOT Snapshot);
+
+static
+BOOLEAN
+GenFilterConfigSplitValid(_In_ const GENFILTER_SPLIT_SETTINGS* Split);
+
+static
+BOOLEAN
+GenFilterConfigParseSignature(_In_ PCUNICODE_STRING String,
+                              _Out_writes_(GENFILTER_MATCH_MAX_LENGTH) PUCHAR Bytes,
+                              _Out_ PULONG Length);
+
+EVT_WDF_WORKITEM GenFilterConfigEvtReclaim;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterConfigInitialize
+//
+//    Creates the device's first configuration snapshot from its hardware
+//    key, and everything we need to replace it later.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the configuration
+//                      could not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The readers' counters are laid out like the statistics are: one
+//      cache line per processor, so that readers on different processors
+//      never write to the same line.
+//
+//      Both the routing and inspection policies need the configuration, and
+//      each calls us.  The second call finds it already set up.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterConfigInitialize(WDFDEVICE                 Device,
+                          PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS                   status;
+    WDF_OBJECT_ATTRIBUTES      objectAttr;
+    WDF_WORKITEM_CONFIG        workItemConfig;
+    WDFMEMORY                  memory;
+    PVOID                      buffer;
+    ULONG                      cpuCount;
+    size_t                     cpusLength;
+    PGENFILTER_CONFIG_SNAPSHOT snapshot;
+    PGENFILTER_CONFIG          config;
+
+    config = &DevContext->Config;
+
+    if (config->Lock != nullptr) {
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    RtlZeroMemory(config,
+                  sizeof(GENFILTER_CONFIG));
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &config->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for configuration failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    status = WdfWaitLockCreate(&objectAttr,
+                               &config->ReclaimLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfWaitLockCreate for configuration failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    WDF_WORKITEM_CONFIG_INIT(&workItemConfig,
+                             GenFilterConfigEvtReclaim);
+
+    status = WdfWorkItemCreate(&workItemConfig,
+                               &objectAttr,
+                               &config->Reclaim);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfWorkItemCreate for configuration failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    cpuCount   = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    cpusLength = cpuCount * sizeof(GENFILTER_RCU_CPU);
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'gFnG',
+                             cpusLength + SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for configuration readers failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    status = GenFilterConfigCreateSnapshot(Device,
+                                           &snapshot);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    GenFilterConfigReadRegistry(Device,
+                                snapshot);
+
+    snapshot->Generation = 1;
+    config->Generation   = 1;
+
+    GenFilterRcuInitialize(&config->Rcu,
+                           snapshot,
+                           (PGENFILTER_RCU_CPU)ALIGN_UP_BY(buffer,
+                                                           SYSTEM_CACHE_ALIGNMENT_SIZE),
+                           cpuCount);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterConfigSet
+//
+//    Handles IOCTL_GENFILTER_SET_CONFIG by publishing a new configuration
+//    snapshot built from the caller's GENFILTER_CONFIGURATION, and from the
+//    current snapshot for the settings its Fields leave alone.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_SET_CONFIG Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - sizeof(ULONG) if the new generation was returned,
+//                    otherwise 0
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the input buffer cannot
+//      hold a GENFILTER_CONFIGURATION, STATUS_INVALID_PARAMETER if what
+//      it holds isn't valid, STATUS_INVALID_DEVICE_STATE if our dispatcher
+//      neither routes nor inspects (so has no configuration), or an error
+//      indicating why the snapshot could not be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Publishing is a pointer exchange under our lock, so every Request
+//      that starts after we return sees the new snapshot.  The one it
+//      replaces goes on the retired list, and our work item frees it once
+//      every Request that might still be looking at it is done.  Nothing
+//      here waits for that.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterConfigSet(WDFREQUEST                Request,
+                   PGENFILTER_DEVICE_CONTEXT DevContext,
+                   PULONG_PTR                Information)
+{
+    NTSTATUS                   status;
+    PGENFILTER_CONFIGURATION   input;
+    PGENFILTER_CONFIG_SNAPSHOT snapshot = nullptr;
+    PGENFILTER_CONFIG_SNAPSHOT old;
+    PGENFILTER_CONFIG          config;
+    PULONG                     output;
+    ULONG                      generation;
+    BOOLEAN                    inspect;
+    BOOLEAN                    limits;
+    BOOLEAN                    split;
+
+    *Information = 0;
+
+    config = &DevContext->Config;
+
+    if (config->Lock == nullptr) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(GENFILTER_CONFIGURATION),
+                                           (PVOID*)&input,
+                                           nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    inspect = (input->Fields & GENFILTER_CONFIG_FIELD_INSPECT) != 0;
+    limits  = (input->Fields & GENFILTER_CONFIG_FIELD_LIMITS) != 0;
+    split   = (input->Fields & GENFILTER_CONFIG_FIELD_SPLIT) != 0;
+
+    if (input->Size != sizeof(GENFILTER_CONFIGURATION) ||
+        input->Fields == 0 ||
+        (input->Fields & ~GENFILTER_CONFIG_FIELD_ALL) != 0 ||
+        (inspect &&
+         (input->InspectAction >= GenFilterInspectActionCount ||
+          input->SignatureCount > GENFILTER_CONFIG_MAX_SIGNATURES)) ||
+        (limits &&
+         !GenFilterConfigLimitsValid(&input->Limits)) ||
+        (split &&
+         !GenFilterConfigSplitValid(&input->Split))) {
+
+        status = STATUS_INVALID_PARAMETER;
+        goto done;
+    }
+
+    status = GenFilterConfigCreateSnapshot(DevContext->WdfDevice,
+                                           &snapshot);
+
+    if (!NT_SUCCESS(status)) {
+        snapshot = nullptr;
+        goto done;
+    }
+
+    for (ULONG index = 0; inspect && index < input->SignatureCount; index++) {
+
+        if (input->Signatures[index].Length == 0 ||
+            input->Signatures[index].Length > GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH ||
+            !GenFilterMatchAddPattern(&snapshot->Match,
+                                      input->Signatures[index].Bytes,
+                                      input->Signatures[index].Length)) {
+
+            status = STATUS_INVALID_PARAMETER;
+            goto done;
+        }
+    }
+
+    //
+    // Just as with the registry, nothing to look for means nothing to do
+    //
+    if (snapshot->Match.PatternCount != 0) {
+        snapshot->InspectAction = (GENFILTER_INSPECT_ACTION)input->InspectAction;
+    }
+
+    if (limits) {
+
+        GenFilterConfigSetLimits(snapshot,
+                                 &input->Limits);
+    }
+
+    if (split) {
+        snapshot->Split = input->Split;
+    }
+
+    WdfSpinLockAcquire(config->Lock);
+
+    //
+    // Only publishers change the current snapshot, and they hold our lock,
+    // so it's safe to copy what we're keeping from it
+    //
+    old = (PGENFILTER_CONFIG_SNAPSHOT)config->Rcu.Current;
+
+    if (!inspect) {
+        snapshot->InspectAction = old->InspectAction;
+        snapshot->Match         = old->Match;
+    }
+
+    if (!limits) {
+        snapshot->Limits  = old->Limits;
+        snapshot->Buckets = old->Buckets;
+    }
+
+    if (!split) {
+        snapshot->Split = old->Split;
+    }
+
+    generation           = ++config->Generation;
+    snapshot->Generation = generation;
+
+    old = (PGENFILTER_CONFIG_SNAPSHOT)GenFilterRcuPublish(&config->Rcu,
+                                                          snapshot);
+
+    old->NextRetired = config->Retired;
+    config->Retired  = old;
+
+    InterlockedExchange(&DevContext->Limit.Limited,
+                        snapshot->Buckets.Limited);
+
+    InterlockedExchange(&DevContext->Split.Splitting,
+                        snapshot->Split.ChunkKB != 0);
+
+    WdfSpinLockRelease(config->Lock);
+
+    snapshot = nullptr;
+
+    WdfWorkItemEnqueue(config->Reclaim);
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatConfigPublished);
+
+    //
+    // METHOD_BUFFERED, so we're done with the input before we write this
+    //
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                  sizeof(ULONG),
+                                                  (PVOID*)&output,
+                                                  nullptr))) {
+        *output      = generation;
+        *Information = sizeof(ULONG);
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (snapshot != nullptr) {
+        WdfObjectDelete(snapshot->Memory);
+    }
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterConfigEvtReclaim
+//
+//    Our work item.  Frees the snapshots that have been replaced, once
+//    every reader that might still be looking at them is done.
+//
+//  INPUTS:
+//
+//      WorkItem    - Our reclaim work item
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Readers hold a snapshot for at most one scan of one buffer, so we
+//      rarely have to wait at all, and when we do it's by sleeping, not
+//      spinning.  Snapshots that are retired while we're waiting are left
+//      for the next time around the loop.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterConfigEvtReclaim(WDFWORKITEM WorkItem)
+{
+    PGENFILTER_DEVICE_CONTEXT  devContext;
+    PGENFILTER_CONFIG          config;
+    PGENFILTER_CONFIG_SNAPSHOT retired;
+    LARGE_INTEGER              interval;
+
+    devContext = GenFilterGetDeviceContext((WDFDEVICE)WdfWorkItemGetParentObject(WorkItem));
+    config     = &devContext->Config;
+
+    //
+    // A millisecond, relative
+    //
+    interval.QuadPart = -10000;
+
+    WdfWaitLockAcquire(config->ReclaimLock,
+                       nullptr);
+
+    for (;;) {
+
+        WdfSpinLockAcquire(config->Lock);
+
+        retired         = config->Retired;
+        config->Retired = nullptr;
+
+        WdfSpinLockRelease(config->Lock);
+
+        if (retired == nullptr) {
+            break;
+        }
+
+        GenFilterRcuSynchronize(&config->Rcu,
+                                [&interval]() {
+                                    KeDelayExecutionThread(KernelMode,
+                                                           FALSE,
+                                                           &interval);
+                                });
+
+        while (retired != nullptr) {
+
+            PGENFILTER_CONFIG_SNAPSHOT next = retired->NextRetired;
+
+            WdfObjectDelete(retired->Memory);
+
+            GenFilterStatsIncrement(&devContext->Stats,
+                                    GenFilterStatConfigReclaimed);
+
+            retired = next;
+        }
+    }
+
+    WdfWaitLockRelease(config->ReclaimLock);
+}
+
+//
+// GenFilterConfigCreateSnapshot
+//
+// Allocates an empty snapshot: inspection off, no signatures, and nothing
+// limited
+//
+static
+NTSTATUS
+GenFilterConfigCreateSnapshot(WDFDEVICE                   Device,
+                              PGENFILTER_CONFIG_SNAPSHOT* Snapshot)
+{
+    NTSTATUS                   status;
+    WDF_OBJECT_ATTRIBUTES      objectAttr;
+    WDFMEMORY                  memory;
+    PGENFILTER_CONFIG_SNAPSHOT snapshot;
+    GENFILTER_LIMITS           limits;
+
+    *Snapshot = nullptr;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'gFnG',
+                             sizeof(GENFILTER_CONFIG_SNAPSHOT),
+                             &memory,
+                             (PVOID*)&snapshot);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for configuration snapshot failed - 0x%x\n",
+                 status);
+#endif
+        return status;
+    }
+
+    RtlZeroMemory(snapshot,
+                  sizeof(GENFILTER_CONFIG_SNAPSHOT));
+
+    snapshot->Memory        = memory;
+    snapshot->InspectAction = GenFilterInspectOff;
+
+    GenFilterMatchInitialize(&snapshot->Match);
+
+    RtlZeroMemory(&limits,
+                  sizeof(GENFILTER_LIMITS));
+
+    limits.BurstMs    = GENFILTER_LIMIT_DEFAULT_BURST_MS;
+    limits.Action     = GenFilterLimitDelay;
+    limits.MaxDelayMs = GENFILTER_LIMIT_DEFAULT_MAX_DELAY_MS;
+
+    GenFilterConfigSetLimits(snapshot,
+                             &limits);
+
+    snapshot->Split.ChunkKB = 0;
+    snapshot->Split.Depth   = GENFILTER_SPLIT_DEFAULT_DEPTH;
+
+    *Snapshot = snapshot;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// GenFilterConfigReadRegistry
+//
+// Fills in a snapshot from the device's hardware key
+//
+static
+VOID
+GenFilterConfigReadRegistry(WDFDEVICE                  Device,
+                            PGENFILTER_CONFIG_SNAPSHOT Snapshot)
+{
+    WDFKEY key;
+
+    if (!NT_SUCCESS(WdfDeviceOpenRegistryKey(Device,
+                                             PLUGPLAY_REGKEY_DEVICE,
+                                             KEY_READ,
+                                             WDF_NO_OBJECT_ATTRIBUTES,
+                                             &key))) {
+        return;
+    }
+
+    GenFilterConfigReadInspect(Device,
+                               key,
+                               Snapshot);
+
+    GenFilterConfigReadLimits(key,
+                              Snapshot);
+
+    GenFilterConfigReadSplit(key,
+                             Snapshot);
+
+    WdfRegistryClose(key);
+}
+
+//
+// GenFilterConfigReadInspect
+//
+// Inspection stays off unless "InspectAction" asks for it and at least one
+// of the "InspectSignatures" is valid.  Invalid signatures are ignored.
+//
+static
+VOID
+GenFilterConfigReadInspect(WDFDEVICE                  Device,
+                           WDFKEY                     Key,
+                           PGENFILTER_CONFIG_SNAPSHOT Snapshot)
+{
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_OBJECT_ATTRIBUTES stringAttr;
+    WDFCOLLECTION         signatures = nullptr;
+    ULONG                 action     = GenFilterInspectOff;
+
+    DECLARE_CONST_UNICODE_STRING(actionValueName, L"InspectAction");
+    DECLARE_CONST_UNICODE_STRING(signaturesValueName, L"InspectSignatures");
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(Key,
+                                          &actionValueName,
+                                          &action)) ||
+        action == GenFilterInspectOff ||
+        action >= GenFilterInspectActionCount) {
+        goto done;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    if (!NT_SUCCESS(WdfCollectionCreate(&objectAttr,
+                                        &signatures))) {
+#if DBG
+        DbgPrint("WdfCollectionCreate for inspection failed\n");
+#endif
+        signatures = nullptr;
+        goto done;
+    }
+
+    //
+    // The strings go when the collection does
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&stringAttr);
+    stringAttr.ParentObject = signatures;
+
+    if (!NT_SUCCESS(WdfRegistryQueryMultiString(Key,
+                                                &signaturesValueName,
+                                                &stringAttr,
+                                                signatures))) {
+#if DBG
+        DbgPrint("InspectAction is set, but there are no InspectSignatures\n");
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < WdfCollectionGetCount(signatures); index++) {
+
+        UNICODE_STRING string;
+        UCHAR          bytes[GENFILTER_MATCH_MAX_LENGTH];
+        ULONG          length;
+
+        WdfStringGetUnicodeString((WDFSTRING)WdfCollectionGetItem(signatures,
+                                                                  index),
+                                  &string);
+
+        if (!GenFilterConfigParseSignature(&string,
+                                           bytes,
+                                           &length) ||
+            !GenFilterMatchAddPattern(&Snapshot->Match,
+                                      bytes,
+                                      length)) {
+#if DBG
+            DbgPrint("Ignoring inspection signature %wZ\n",
+                     &string);
+#endif
+        }
+    }
+
+    //
+    // Only if we have something to look for do we start looking
+    //
+    if (Snapshot->Match.PatternCount != 0) {
+        Snapshot->InspectAction = (GENFILTER_INSPECT_ACTION)action;
+    }
+
+done:
+
+    if (signatures != nullptr) {
+        WdfObjectDelete(signatures);
+    }
+}
+
+//
+// GenFilterConfigReadLimits
+//
+// The I/O limits.  Each value that's missing keeps its default (see
+// GenFilterConfigCreateSnapshot); if they don't make sense together,
+// nothing is limited.
+//
+static
+VOID
+GenFilterConfigReadLimits(WDFKEY                     Key,
+                          PGENFILTER_CONFIG_SNAPSHOT Snapshot)
+{
+    GENFILTER_LIMITS limits = Snapshot->Limits;
+
+    const struct {
+        PCWSTR Name;
+        PULONG Value;
+    } values[] = {
+        { L"LimitDeviceRequestsPerSecond",    &limits.Device.RequestsPerSecond },
+        { L"LimitDeviceBytesPerSecond",       &limits.Device.BytesPerSecond },
+        { L"LimitRequesterRequestsPerSecond", &limits.Requester.RequestsPerSecond },
+        { L"LimitRequesterBytesPerSecond",    &limits.Requester.BytesPerSecond },
+        { L"LimitBurstMs",                    &limits.BurstMs },
+        { L"LimitAction",                     &limits.Action },
+        { L"LimitMaxDelayMs",                 &limits.MaxDelayMs },
+    };
+
+    for (const auto& value : values) {
+
+        UNICODE_STRING valueName;
+        ULONG          data;
+
+        RtlInitUnicodeString(&valueName,
+                             value.Name);
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(Key,
+                                             &valueName,
+                                             &data))) {
+            *value.Value = data;
+        }
+    }
+
+    if (!GenFilterConfigLimitsValid(&limits)) {
+#if DBG
+        DbgPrint("Ignoring the I/O limits in the registry\n");
+#endif
+        return;
+    }
+
+    GenFilterConfigSetLimits(Snapshot,
+                             &limits);
+}
+
+//
+// GenFilterConfigLimitsValid
+//
+static
+BOOLEAN
+GenFilterConfigLimitsValid(const GENFILTER_LIMITS* Limits)
+{
+    return Limits->BurstMs <= GENFILTER_LIMITS_MAX_MS &&
+           Limits->Action < GenFilterLimitActionCount &&
+           Limits->MaxDelayMs <= GENFILTER_LIMITS_MAX_MS;
+}
+
+//
+// GenFilterConfigSetLimits
+//
+// Sets a snapshot's limits, and works out what they are in interrupt time
+//
+static
+VOID
+GenFilterConfigSetLimits(PGENFILTER_CONFIG_SNAPSHOT Snapshot,
+                         const GENFILTER_LIMITS*    Limits)
+{
+    Snapshot->Limits = *Limits;
+
+    GenFilterBucketLimitsInitialize(&Snapshot->Buckets,
+                                    Limits,
+                                    GENFILTER_LIMIT_TICKS_PER_SECOND);
+}
+
+//
+// GenFilterConfigReadSplit
+//
+// How large transfers are split.  A value that's missing keeps its default
+// (splitting is off); if they don't make sense together, it stays off.
+//
+static
+VOID
+GenFilterConfigReadSplit(WDFKEY                     Key,
+                         PGENFILTER_CONFIG_SNAPSHOT Snapshot)
+{
+    GENFILTER_SPLIT_SETTINGS split = Snapshot->Split;
+
+    DECLARE_CONST_UNICODE_STRING(chunkValueName, L"SplitChunkKB");
+    DECLARE_CONST_UNICODE_STRING(depthValueName, L"SplitDepth");
+
+    (VOID)WdfRegistryQueryULong(Key,
+                                &chunkValueName,
+                                &split.ChunkKB);
+
+    (VOID)WdfRegistryQueryULong(Key,
+                                &depthValueName,
+                                &split.Depth);
+
+    if (!GenFilterConfigSplitValid(&split)) {
+#if DBG
+        DbgPrint("Ignoring the split settings in the registry\n");
+#endif
+        return;
+    }
+
+    Snapshot->Split = split;
+}
+
+//
+// GenFilterConfigSplitValid
+//
+// Chunks are whole 2KB sectors, so that each one starts on a sector too
+//
+static
+BOOLEAN
+GenFilterConfigSplitValid(const GENFILTER_SPLIT_SETTINGS* Split)
+{
+    return Split->ChunkKB <= GENFILTER_SPLIT_MAX_CHUNK_KB &&
+           (Split->ChunkKB % 2) == 0 &&
+           Split->Depth >= 1 &&
+           Split->Depth <= GENFILTER_SPLIT_MAX_DEPTH;
+}
+
+
+//
+// GenFilterConfigParseSignature
+//
+// Turns a string of hex digit pairs, optionally with spaces between the
+// pairs, into bytes.  Returns FALSE if it isn't one, or it's too long.
+//
+static
+BOOLEAN
+GenFilterConfigParseSignature(PCUNICODE_STRING String,
+                              PUCHAR           Bytes,
+                              PULONG           Length)
+{
+    ULONG count  = 0;
+    ULONG digits = 0;
+    UCHAR value  = 0;
+
+    *Length = 0;
+
+    for (ULONG index = 0; index < String->Length / sizeof(WCHAR); index++) {
+
+        WCHAR character = String->Buffer[index];
+        UCHAR nibble;
+
+        if (character == L' ' && digits == 0) {
+            continue;
+        }
+
+        if (character >= L'0' && character <= L'9') {
+            nibble = (UCHAR)(character - L'0');
+        } else if (character >= L'a' && character <= L'f') {
+            nibble = (UCHAR)(character - L'a' + 10);
+        } else if (character >= L'A' && character <= L'F') {
+            nibble = (UCHAR)(character - L'A' + 10);
+        } else {
+            return FALSE;
+        }
+
+        value = (UCHAR)((value << 4) | nibble);
+
+        if (++digits == 2) {
+
+            if (count == GENFILTER_MATCH_MAX_LENGTH) {
+                return FALSE;
+            }
+
+            Bytes[count++] = value;
+
+            digits = 0;
+            value  = 0;
+        }
+    }
+
+    if (digits != 0 || count == 0) {
+        return FALSE;
+    }
+
+    *Length = count;
+
+    return TRUE;
+}
@@ -0,0 +1,140 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterConfig.h
+//
+//    ABSTRACT:
+//
+//      The filter's configuration that can be changed while it's running,
+//      without restarting the device.  Requests see it through an immutable
+//      snapshot, read under RCU (see GenFilterRcu.h), so looking at it costs
+//      them no lock.  IOCTL_GENFILTER_SET_CONFIG publishes a new snapshot, and
+//      a work item frees the old one once nothing can still be looking at it.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterBucket.h"
+#include "GenFilterIoctl.h"
+#include "GenFilterMatch.h"
+#include "GenFilterRcu.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+static_assert(GENFILTER_CONFIG_MAX_SIGNATURES == GENFILTER_MATCH_MAX_PATTERNS &&
+              GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH == GENFILTER_MATCH_MAX_LENGTH,
+              "GENFILTER_CONFIGURATION must hold what GENFILTER_MATCH does");
+
+//
+// One version of the configuration.  Nothing in it changes once it's been
+// published; a change is a new snapshot.
+//
+typedef struct _GENFILTER_CONFIG_SNAPSHOT {
+    WDFMEMORY                           Memory;     // That we live in
+    struct _GENFILTER_CONFIG_SNAPSHOT*  NextRetired;
+    ULONG                               Generation;
+    GENFILTER_INSPECT_ACTION            InspectAction;
+    GENFILTER_MATCH                     Match;      // The signatures
+    GENFILTER_LIMITS                    Limits;     // The I/O limits
+    GENFILTER_BUCKET_LIMITS             Buckets;    // ...in interrupt time
+    GENFILTER_SPLIT_SETTINGS            Split;      // Splitting large transfers
+} GENFILTER_CONFIG_SNAPSHOT, *PGENFILTER_CONFIG_SNAPSHOT;
+
+typedef const GENFILTER_CONFIG_SNAPSHOT* PCGENFILTER_CONFIG_SNAPSHOT;
+
+//
+// The per-device configuration that lives in our device context
+//
+typedef struct _GENFILTER_CONFIG {
+    GENFILTER_RCU              Rcu;         // Current is the snapshot
+
+    //
+    // Serializes publishing, and protects the list of snapshots that have
+    // been replaced but not yet freed
+    //
+    WDFSPINLOCK                Lock;
+    PGENFILTER_CONFIG_SNAPSHOT Retired;
+    ULONG                      Generation;  // Of the newest snapshot
+
+    //
+    // Frees retired snapshots.  Only one instance at a time may wait for
+    // readers (see GenFilterRcuSynchronize), which ReclaimLock sees to.
+    //
+    WDFWORKITEM                Reclaim;
+    WDFWAITLOCK                ReclaimLock;
+} GENFILTER_CONFIG, *PGENFILTER_CONFIG;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterConfigInitialize(_In_ WDFDEVICE Device,
+                          _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// GenFilterConfigAcquire
+//
+// Returns the current snapshot, which the caller may use until it calls
+// GenFilterConfigRelease with the Phase we return.  Never waits, and never
+// returns nullptr.  Keep the time between the two short: a snapshot that's
+// been replaced can't be freed while anyone is still between them.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FORCEINLINE
+PCGENFILTER_CONFIG_SNAPSHOT
+GenFilterConfigAcquire(_In_ PGENFILTER_CONFIG Config,
+                       _Out_ PULONG Phase)
+{
+    return (PCGENFILTER_CONFIG_SNAPSHOT)GenFilterRcuReadLock(&Config->Rcu,
+                                                             KeGetCurrentProcessorNumberEx(nullptr),
+                                                             Phase);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+FORCEINLINE
+VOID
+GenFilterConfigRelease(_In_ PGENFILTER_CONFIG Config,
+                       _In_ ULONG Phase)
+{
+    GenFilterRcuReadUnlock(&Config->Rcu,
+                           KeGetCurrentProcessorNumberEx(nullptr),
+                           Phase);
+}
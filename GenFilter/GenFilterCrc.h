@@ -0,0 +1,278 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterCrc.h
+//
+//    ABSTRACT:
+//
+//      CRC32C (Castagnoli) checksums.  Uses the SSE4.2 CRC32 instruction when
+//      the processor has it, and slice-by-8 tables when it doesn't.  Like
+//      GenFilterMatch.h, it depends on nothing in WDF, so GenFilterCtl can
+//      benchmark the same code the driver runs.  Include it after <wdm.h> in
+//      the driver, or after <windows.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#define GENFILTER_CRC_SSE42 1
+#endif
+
+//
+// As with the matcher (see GENFILTER_MATCH_TARGET), only the kernel that
+// uses the CRC32 instruction is built for it by GCC and Clang
+//
+#if defined(__GNUC__)
+#define GENFILTER_CRC_TARGET(_isa) __attribute__((target(_isa)))
+#else
+#define GENFILTER_CRC_TARGET(_isa)
+#endif
+
+//
+// The CRC32C polynomial, bit reversed
+//
+constexpr ULONG GENFILTER_CRC32C_POLYNOMIAL = 0x82F63B78;
+
+//
+// The ways we know how to compute a CRC32C.  GenFilterCrcBestKernel says
+// which of them this processor can run.
+//
+typedef enum _GENFILTER_CRC_KERNEL {
+    GenFilterCrcTable = 0,
+    GenFilterCrcSse42,
+
+    GenFilterCrcKernelCount             // Must be last
+} GENFILTER_CRC_KERNEL;
+
+//
+// Slice-by-8 lookup tables, built by the compiler.  Entries[0] is the
+// usual byte-at-a-time table; Entries[n] advances a byte's contribution
+// past n more bytes of zeros, so eight bytes can be folded in at once.
+//
+typedef struct _GENFILTER_CRC_TABLES {
+    ULONG Entries[8][256];
+
+    constexpr _GENFILTER_CRC_TABLES() : Entries{}
+    {
+        for (ULONG index = 0; index < 256; index++) {
+
+            ULONG crc = index;
+
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (((crc & 1) != 0) ? GENFILTER_CRC32C_POLYNOMIAL : 0);
+            }
+
+            Entries[0][index] = crc;
+        }
+
+        for (ULONG slice = 1; slice < 8; slice++) {
+
+            for (ULONG index = 0; index < 256; index++) {
+
+                ULONG previous = Entries[slice - 1][index];
+
+                Entries[slice][index] = (previous >> 8) ^ Entries[0][previous & 0xFF];
+            }
+        }
+    }
+} GENFILTER_CRC_TABLES;
+
+//
+// GenFilterCrcGetTables
+//
+inline
+const GENFILTER_CRC_TABLES*
+GenFilterCrcGetTables()
+{
+    static constexpr GENFILTER_CRC_TABLES tables;
+
+    return &tables;
+}
+
+//
+// GenFilterCrcBestKernel
+//
+// The fastest kernel this processor supports
+//
+inline
+GENFILTER_CRC_KERNEL
+GenFilterCrcBestKernel()
+{
+#ifdef GENFILTER_CRC_SSE42
+    int info[4];
+
+    __cpuid(info,
+            1);
+
+    if ((info[2] & (1 << 20)) != 0) {
+        return GenFilterCrcSse42;
+    }
+#endif
+
+    return GenFilterCrcTable;
+}
+
+//
+// GenFilterCrcUpdateTable
+//
+// Folds Length bytes into a running (not yet inverted) CRC, eight at a time
+//
+inline
+ULONG
+GenFilterCrcUpdateTable(ULONG        Crc,
+                        const UCHAR* Buffer,
+                        size_t       Length)
+{
+    const GENFILTER_CRC_TABLES* tables = GenFilterCrcGetTables();
+
+    while (Length >= 8) {
+
+        ULONG low  = Crc ^ ((ULONG)Buffer[0] |
+                            (ULONG)Buffer[1] << 8 |
+                            (ULONG)Buffer[2] << 16 |
+                            (ULONG)Buffer[3] << 24);
+        ULONG high = (ULONG)Buffer[4] |
+                     (ULONG)Buffer[5] << 8 |
+                     (ULONG)Buffer[6] << 16 |
+                     (ULONG)Buffer[7] << 24;
+
+        Crc = tables->Entries[7][low & 0xFF] ^
+              tables->Entries[6][(low >> 8) & 0xFF] ^
+              tables->Entries[5][(low >> 16) & 0xFF] ^
+              tables->Entries[4][(low >> 24) & 0xFF] ^
+              tables->Entries[3][high & 0xFF] ^
+              tables->Entries[2][(high >> 8) & 0xFF] ^
+              tables->Entries[1][(high >> 16) & 0xFF] ^
+              tables->Entries[0][(high >> 24) & 0xFF];
+
+        Buffer += 8;
+        Length -= 8;
+    }
+
+    while (Length-- != 0) {
+        Crc = (Crc >> 8) ^ tables->Entries[0][(Crc ^ *Buffer++) & 0xFF];
+    }
+
+    return Crc;
+}
+
+#ifdef GENFILTER_CRC_SSE42
+
+//
+// GenFilterCrcUpdateSse42
+//
+// GenFilterCrcUpdateTable, using the CRC32 instruction a register at a
+// time.  The instruction only uses general purpose registers, so unlike
+// the AVX2 matcher, the kernel doesn't need to save any extended state
+// around it.
+//
+inline
+GENFILTER_CRC_TARGET("sse4.2")
+ULONG
+GenFilterCrcUpdateSse42(ULONG        Crc,
+                        const UCHAR* Buffer,
+                        size_t       Length)
+{
+#if defined(_M_X64)
+    ULONGLONG crc = Crc;
+
+    while (Length >= 8) {
+
+        crc = _mm_crc32_u64(crc,
+                            *(const ULONGLONG UNALIGNED*)Buffer);
+
+        Buffer += 8;
+        Length -= 8;
+    }
+
+    Crc = (ULONG)crc;
+#else
+    while (Length >= 4) {
+
+        Crc = _mm_crc32_u32(Crc,
+                            *(const ULONG UNALIGNED*)Buffer);
+
+        Buffer += 4;
+        Length -= 4;
+    }
+#endif
+
+    while (Length-- != 0) {
+        Crc = _mm_crc32_u8(Crc,
+                           *Buffer++);
+    }
+
+    return Crc;
+}
+
+#endif // GENFILTER_CRC_SSE42
+
+//
+// GenFilterCrc32c
+//
+// The CRC32C of Length bytes, using Kernel (which must be one the
+// processor supports)
+//
+inline
+ULONG
+GenFilterCrc32c(GENFILTER_CRC_KERNEL Kernel,
+                const UCHAR*         Buffer,
+                size_t               Length)
+{
+    ULONG crc = 0xFFFFFFFF;
+
+#ifdef GENFILTER_CRC_SSE42
+    if (Kernel == GenFilterCrcSse42) {
+
+        crc = GenFilterCrcUpdateSse42(crc,
+                                      Buffer,
+                                      Length);
+        return ~crc;
+    }
+#else
+    UNREFERENCED_PARAMETER(Kernel);
+#endif
+
+    crc = GenFilterCrcUpdateTable(crc,
+                                  Buffer,
+                                  Length);
+    return ~crc;
+}
@@ -0,0 +1,666 @@
+///
+/// @file GenFilterDefer.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static_assert((GENFILTER_DEFER_ITEMS & (GENFILTER_DEFER_ITEMS - 1)) == 0,
+              "GENFILTER_DEFER_ITEMS must be a power of two");
+
+KSTART_ROUTINE GenFilterDeferWorker;
+
+static
+VOID
+GenFilterDeferProcess(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ PGENFILTER_DEFER_ITEM     Item);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeferInitialize
+//
+//    Reads the deferral policy and worker count from the device's hardware
+//    key and, if deferral is on, creates the work items and starts the
+//    worker threads.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why deferral could not
+//                      be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      A missing (or unreadable, or unknown) "DeferPolicy" value means
+//      deferral is off, in which case nothing is allocated and no threads
+//      are started.
+//
+//      Threads we've started are stopped by GenFilterDeferStop when the
+//      device is cleaned up, even if we fail part way through.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterDeferInitialize(WDFDEVICE                 Device,
+                         PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    OBJECT_ATTRIBUTES     threadAttr;
+    PGENFILTER_DEFER      defer;
+    WDFKEY                key;
+    PVOID                 buffer;
+    HANDLE                threadHandle;
+    PKTHREAD              thread;
+    ULONG                 policy  = GenFilterDeferOff;
+    ULONG                 workers = GENFILTER_DEFER_DEFAULT_WORKERS;
+
+    DECLARE_CONST_UNICODE_STRING(policyValueName, L"DeferPolicy");
+    DECLARE_CONST_UNICODE_STRING(workersValueName, L"DeferWorkers");
+
+    defer = &DevContext->Defer;
+
+    RtlZeroMemory(defer,
+                  sizeof(GENFILTER_DEFER));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &policyValueName,
+                                              &policy))) {
+            policy = GenFilterDeferOff;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &workersValueName,
+                                              &workers))) {
+            workers = GENFILTER_DEFER_DEFAULT_WORKERS;
+        }
+
+        WdfRegistryClose(key);
+    }
+
+    if (policy == GenFilterDeferOff || policy >= GenFilterDeferPolicyCount) {
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (workers == 0) {
+        workers = 1;
+    }
+
+    if (workers > GENFILTER_DEFER_MAX_WORKERS) {
+        workers = GENFILTER_DEFER_MAX_WORKERS;
+    }
+
+    GenFilterRingInitialize(&defer->Ring,
+                            defer->Cells,
+                            GENFILTER_DEFER_ITEMS);
+
+    KeInitializeSemaphore(&defer->Work,
+                          0,
+                          MAXLONG);
+
+    //
+    // Items only need a buffer of their own if the Request has been
+    // completed by the time a worker looks at the data
+    //
+    if (policy == GenFilterDeferCompleteBefore) {
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+        objectAttr.ParentObject = Device;
+
+        for (ULONG index = 0; index < GENFILTER_DEFER_ITEMS; index++) {
+
+            status = WdfMemoryCreate(&objectAttr,
+                                     NonPagedPoolNx,
+                                     'dFnG',
+                                     GENFILTER_DEFER_MAX_DATA,
+                                     &defer->Items[index].Memory,
+                                     &buffer);
+
+            if (!NT_SUCCESS(status)) {
+#if DBG
+                DbgPrint("WdfMemoryCreate for deferral failed - 0x%x\n",
+                         status);
+#endif
+                goto done;
+            }
+
+            defer->Items[index].Buffer = (PUCHAR)buffer;
+        }
+    }
+
+    status = GenFilterPoolCreate(Device,
+                                 &DevContext->Pools[GenFilterPoolDefer],
+                                 defer->Items,
+                                 sizeof(GENFILTER_DEFER_ITEM),
+                                 GENFILTER_DEFER_ITEMS);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    InitializeObjectAttributes(&threadAttr,
+                               nullptr,
+                               OBJ_KERNEL_HANDLE,
+                               nullptr,
+                               nullptr);
+
+    for (ULONG index = 0; index < workers; index++) {
+
+        status = PsCreateSystemThread(&threadHandle,
+                                      THREAD_ALL_ACCESS,
+                                      &threadAttr,
+                                      nullptr,
+                                      nullptr,
+                                      GenFilterDeferWorker,
+                                      DevContext);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("PsCreateSystemThread for deferral failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        //
+        // We wait for the thread to exit when we stop it, which needs the
+        // thread object rather than the handle
+        //
+        status = ObReferenceObjectByHandle(threadHandle,
+                                           THREAD_ALL_ACCESS,
+                                           *PsThreadType,
+                                           KernelMode,
+                                           (PVOID*)&thread,
+                                           nullptr);
+
+        //
+        // Can't fail for a handle we've just been given
+        //
+        NT_ASSERT(NT_SUCCESS(status));
+
+        ZwClose(threadHandle);
+
+        defer->Workers[index] = thread;
+        defer->WorkerCount    = index + 1;
+    }
+
+    //
+    // Only now that the workers are running do we turn deferral on
+    //
+    defer->Policy = (GENFILTER_DEFER_POLICY)policy;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeferStop
+//
+//    Tells the worker threads to exit once the queue is empty, and waits
+//    for them to do so.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Called when our device is cleaned up, by which time every Request
+//      has been completed, so nothing more can be queued.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterDeferStop(PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_DEFER defer = &DevContext->Defer;
+
+    if (defer->WorkerCount == 0) {
+        return;
+    }
+
+    defer->Policy = GenFilterDeferOff;
+
+    InterlockedExchange(&defer->Stopping,
+                        TRUE);
+
+    //
+    // One wake-up for each worker that finds the queue empty
+    //
+    KeReleaseSemaphore(&defer->Work,
+                       IO_NO_INCREMENT,
+                       (LONG)defer->WorkerCount,
+                       FALSE);
+
+    for (ULONG index = 0; index < defer->WorkerCount; index++) {
+
+        KeWaitForSingleObject(defer->Workers[index],
+                              Executive,
+                              KernelMode,
+                              FALSE,
+                              nullptr);
+
+        ObDereferenceObject(defer->Workers[index]);
+
+        defer->Workers[index] = nullptr;
+    }
+
+    defer->WorkerCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeferRequest
+//
+//    Called from our completion callback for every Request we see complete.
+//    If the Request has work we defer, queues it to the workers.
+//
+//  INPUTS:
+//
+//      Request     - The completed Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Params      - The Request's completion parameters
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if a worker will complete the Request (GenFilterDeferCompleteAfter).
+//      The caller must not touch it again.
+//
+//      FALSE if the caller should complete the Request as usual.  Any work
+//      that was queued no longer needs the Request; any that wasn't is
+//      still the caller's to do.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Filling the read cache is the only work we defer so far.  It's
+//      the cheapest example of the kind of thing that belongs here: a copy
+//      (and, later, whatever we want to learn from the data) that the
+//      Request's owner shouldn't have to wait for.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterDeferRequest(WDFREQUEST                     Request,
+                      PGENFILTER_DEVICE_CONTEXT      DevContext,
+                      PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    PGENFILTER_DEFER           defer = &DevContext->Defer;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_DEFER_ITEM      item;
+    GENFILTER_DEFER_POLICY     policy;
+    PVOID                      buffer;
+    size_t                     length;
+    KIRQL                      oldIrql;
+    bool                       queued;
+
+    policy = defer->Policy;
+
+    if (policy == GenFilterDeferOff) {
+        return FALSE;
+    }
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    //
+    // If a verify is pending, GenFilterCacheRequestCompleted has to empty
+    // the cache instead
+    //
+    if (!NT_SUCCESS(Params->IoStatus.Status) ||
+        !reqContext->CacheFill ||
+        GenFilterCacheVerifyPending(DevContext)) {
+        return FALSE;
+    }
+
+    length = Params->IoStatus.Information;
+
+    if (length > reqContext->CacheLength) {
+        length = reqContext->CacheLength;
+    }
+
+    if (length == 0 ||
+        !NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                   length,
+                                                   &buffer,
+                                                   nullptr))) {
+        return FALSE;
+    }
+
+    item = (PGENFILTER_DEFER_ITEM)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolDefer]);
+
+    if (item == nullptr) {
+        InterlockedIncrement64(&defer->Exhausted);
+        return FALSE;
+    }
+
+    item->Status      = Params->IoStatus.Status;
+    item->Length      = length;
+    item->Offset      = reqContext->CacheOffset;
+    item->CacheFill   = TRUE;
+    item->CacheTicket = reqContext->CacheTicket;
+
+    if (policy == GenFilterDeferCompleteBefore) {
+
+        RtlCopyMemory(item->Buffer,
+                      buffer,
+                      length);
+
+        item->Data    = item->Buffer;
+        item->Request = nullptr;
+
+    } else {
+
+        item->Data    = (const UCHAR*)buffer;
+        item->Request = Request;
+    }
+
+    //
+    // The worker fills the cache now, not the caller.  With
+    // GenFilterDeferCompleteAfter, the Request may be completed as soon as
+    // the item is pushed, so this is our last chance to say so.
+    //
+    reqContext->CacheFill = FALSE;
+
+    //
+    // A worker that's woken for an item pushed after this one can't pop it
+    // until this push has stored its item, so don't let anything run on
+    // this processor in between
+    //
+    KeRaiseIrql(DISPATCH_LEVEL,
+                &oldIrql);
+
+    queued = GenFilterRingPush(&defer->Ring,
+                               item);
+
+    KeLowerIrql(oldIrql);
+
+    if (!queued) {
+
+        //
+        // No worker ever saw the item, so the Request is still ours
+        //
+        reqContext->CacheFill = TRUE;
+
+        GenFilterPoolFree(&DevContext->Pools[GenFilterPoolDefer],
+                          item);
+        return FALSE;
+    }
+
+    KeReleaseSemaphore(&defer->Work,
+                       IO_NO_INCREMENT,
+                       1,
+                       FALSE);
+
+    return (policy == GenFilterDeferCompleteAfter) ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeferQuery
+//
+//    Handles IOCTL_GENFILTER_GET_DEFER by copying a snapshot of the
+//    deferral queue's counters into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_GET_DEFER Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      hold a GENFILTER_DEFER_INFO.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller completes the Request.  With deferral off, everything
+//      but Size is zero.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterDeferQuery(WDFREQUEST                Request,
+                    PGENFILTER_DEVICE_CONTEXT DevContext,
+                    PULONG_PTR                Information)
+{
+    NTSTATUS              status;
+    PGENFILTER_DEFER      defer = &DevContext->Defer;
+    PGENFILTER_DEFER_INFO info;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(GENFILTER_DEFER_INFO),
+                                            (PVOID*)&info,
+                                            nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    RtlZeroMemory(info,
+                  sizeof(GENFILTER_DEFER_INFO));
+
+    info->Size = sizeof(GENFILTER_DEFER_INFO);
+
+    if (defer->WorkerCount != 0) {
+
+        info->Policy      = defer->Policy;
+        info->WorkerCount = defer->WorkerCount;
+        info->Capacity    = GENFILTER_DEFER_ITEMS;
+        info->Depth       = GenFilterRingDepth(&defer->Ring);
+        info->HighWater   = (ULONG)defer->Ring.HighWater;
+        info->Queued      = (ULONGLONG)defer->Ring.Tail;
+        info->Processed   = (ULONGLONG)defer->Processed;
+        info->Dropped     = (ULONGLONG)(defer->Ring.Dropped + defer->Exhausted);
+    }
+
+    *Information = sizeof(GENFILTER_DEFER_INFO);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterDeferWorker
+//
+//    The body of each worker thread.  Waits for work, does it, and goes
+//    back for more until we're stopped.
+//
+//  INPUTS:
+//
+//      Context     - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      Never.  The thread terminates itself.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Each wake-up is for exactly one item, but not necessarily one we
+//      can pop yet: an item that was pushed earlier may still be being
+//      stored, in which case we spin briefly.  GenFilterDeferRequest pushes
+//      at DISPATCH_LEVEL, so that never takes more than a few instructions.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterDeferWorker(PVOID Context)
+{
+    auto*                 devContext = (PGENFILTER_DEVICE_CONTEXT)Context;
+    PGENFILTER_DEFER      defer      = &devContext->Defer;
+    PGENFILTER_DEFER_ITEM item;
+
+    for (;;) {
+
+        KeWaitForSingleObject(&defer->Work,
+                              Executive,
+                              KernelMode,
+                              FALSE,
+                              nullptr);
+
+        for (;;) {
+
+            item = (PGENFILTER_DEFER_ITEM)GenFilterRingPop(&defer->Ring);
+
+            if (item != nullptr) {
+                break;
+            }
+
+            if (defer->Stopping) {
+                goto done;
+            }
+
+            YieldProcessor();
+        }
+
+        GenFilterDeferProcess(devContext,
+                              item);
+    }
+
+done:
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+//
+// GenFilterDeferProcess
+//
+// Does the work for one item, completes its Request if we're the ones to
+// do that, and frees the item
+//
+static
+VOID
+GenFilterDeferProcess(PGENFILTER_DEVICE_CONTEXT DevContext,
+                      PGENFILTER_DEFER_ITEM     Item)
+{
+    if (Item->CacheFill) {
+
+        GenFilterCacheFill(&DevContext->Cache,
+                           &Item->CacheTicket,
+                           Item->Offset,
+                           Item->Data,
+                           Item->Length);
+    }
+
+    if (Item->Request != nullptr) {
+
+        GenFilterCompleting(DevContext,
+                            Item->Request,
+                            Item->Status);
+
+        GenFilterQueueRequestDone(Item->Request,
+                                  DevContext);
+
+        WdfRequestComplete(Item->Request,
+                           Item->Status);
+    }
+
+    InterlockedIncrement64(&DevContext->Defer.Processed);
+
+    GenFilterPoolFree(&DevContext->Pools[GenFilterPoolDefer],
+                      Item);
+}
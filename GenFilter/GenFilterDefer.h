@@ -0,0 +1,142 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterDefer.h
+//
+//    ABSTRACT:
+//
+//      Deferred processing of completed Requests.  Work that's too heavy for
+//      our completion callback (which may run at DISPATCH_LEVEL, on whatever
+//      processor the device's DPC ran on) is queued to a small pool of system
+//      threads that do it at PASSIVE_LEVEL.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterCache.h"
+#include "GenFilterIoctl.h"
+#include "GenFilterRing.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Work items in the pool, and the capacity of the queue that feeds the
+// workers (a power of two).  A completed Request that finds both full is
+// processed inline, just as if deferral were off.
+//
+constexpr ULONG GENFILTER_DEFER_ITEMS = 16;
+
+//
+// The most data a work item carries.  This is the largest read we cache,
+// since filling the cache is what we defer.
+//
+constexpr ULONG GENFILTER_DEFER_MAX_DATA = GENFILTER_CACHE_MAX_READ;
+
+//
+// How many worker threads we start, unless the "DeferWorkers" value in the
+// device's hardware key says otherwise
+//
+constexpr ULONG GENFILTER_DEFER_DEFAULT_WORKERS = 2;
+constexpr ULONG GENFILTER_DEFER_MAX_WORKERS     = 8;
+
+//
+// One piece of deferred work.  With GenFilterDeferCompleteAfter, Request is
+// the completed Request, which the worker completes once it's done with
+// Data (the Request's own buffer).  With GenFilterDeferCompleteBefore,
+// Request is nullptr and Data is a copy in Buffer, because the Request was
+// completed before the worker got to it.  Free items are kept in
+// DevContext->Pools[GenFilterPoolDefer].
+//
+typedef struct _GENFILTER_DEFER_ITEM {
+    WDFREQUEST             Request;
+    NTSTATUS               Status;
+    const UCHAR*           Data;
+    size_t                 Length;
+    LONGLONG               Offset;
+    BOOLEAN                CacheFill;         // Add Data to the read cache
+    GENFILTER_CACHE_TICKET CacheTicket;
+    WDFMEMORY              Memory;
+    PUCHAR                 Buffer;            // GenFilterDeferCompleteBefore only
+} GENFILTER_DEFER_ITEM, *PGENFILTER_DEFER_ITEM;
+
+//
+// The per-device deferral state that lives in our device context
+//
+// Each item pushed to Ring is matched by one release of Work, so a worker
+// that's woken always has an item to pop (once its push is finished).
+//
+typedef struct _GENFILTER_DEFER {
+    GENFILTER_DEFER_POLICY Policy;          // GenFilterDeferOff: nothing is deferred
+    ULONG                  WorkerCount;
+    volatile LONG          Stopping;
+    volatile LONG64        Exhausted;       // No free item to defer with
+    volatile LONG64        Processed;
+    KSEMAPHORE             Work;
+    PKTHREAD               Workers[GENFILTER_DEFER_MAX_WORKERS];
+    GENFILTER_RING         Ring;
+    GENFILTER_RING_CELL    Cells[GENFILTER_DEFER_ITEMS];
+    GENFILTER_DEFER_ITEM   Items[GENFILTER_DEFER_ITEMS];
+} GENFILTER_DEFER, *PGENFILTER_DEFER;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterDeferInitialize(_In_ WDFDEVICE Device,
+                         _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Stops the workers, once they've emptied the queue.  Safe to call however
+// far GenFilterDeferInitialize got.
+//
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GenFilterDeferStop(_In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Called from our completion callback.  Returns TRUE if a worker will
+// complete the Request, in which case the caller must not touch it again.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterDeferRequest(_In_ WDFREQUEST Request,
+                      _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ PWDF_REQUEST_COMPLETION_PARAMS Params);
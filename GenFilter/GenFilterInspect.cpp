@@ -0,0 +1,1007 @@
+///
+/// @file GenFilterInspect.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+BOOLEAN
+GenFilterInspectSnapshot(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                         _In_ PCGENFILTER_CONFIG_SNAPSHOT Snapshot,
+                         _In_ WDFREQUEST Request,
+                         _In_ LONGLONG Offset,
+                         _In_reads_bytes_(Length) const UCHAR* Buffer,
+                         _In_ size_t Length);
+
+static
+VOID
+GenFilterInspectRelease(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                        _In_ PGENFILTER_INSPECT_COPY Copy);
+
+//
+// GenFilterInspectInitialize
+//
+// Picks the fastest matching kernel this processor has, and creates the
+// pool of buffers we copy inspected writes into, and the Queue writes wait
+// in for one.  What we look for is read from the registry with the rest of
+// the configuration (see GenFilterConfigInitialize), whether or not we
+// inspect, so until this is called nothing is scanned.
+//
+_Use_decl_annotations_
+NTSTATUS
+GenFilterInspectInitialize(WDFDEVICE                 Device,
+                           PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_IO_QUEUE_CONFIG   ioQueueConfig;
+    PGENFILTER_INSPECT    inspect;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    PVOID                 mdls;
+    size_t                mdlSize;
+
+    inspect = &DevContext->Inspect;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &inspect->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for inspection failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // Writes wait for a copy in a manual Queue, so that if one is cancelled
+    // the Framework takes it out and completes it for us
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig,
+                             WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device,
+                              &ioQueueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &inspect->Waiting);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate for inspection failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    mdlSize = MmSizeOfMdl((PVOID)(PAGE_SIZE - 1),
+                          GENFILTER_INSPECT_COPY_LENGTH);
+
+    mdlSize = ALIGN_UP_BY(mdlSize,
+                          MEMORY_ALLOCATION_ALIGNMENT);
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'mFnG',
+                             mdlSize * GENFILTER_INSPECT_COPIES,
+                             &memory,
+                             &mdls);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for inspection failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < GENFILTER_INSPECT_COPIES; index++) {
+
+        PGENFILTER_INSPECT_COPY copy = &inspect->Copies[index];
+
+        status = WdfMemoryCreate(&objectAttr,
+                                 NonPagedPoolNx,
+                                 'nFnG',
+                                 GENFILTER_INSPECT_COPY_LENGTH,
+                                 &copy->Memory,
+                                 &buffer);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfMemoryCreate for inspection failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        copy->Buffer = (PUCHAR)buffer;
+        copy->Mdl    = (PMDL)((PUCHAR)mdls + index * mdlSize);
+
+        MmInitializeMdl(copy->Mdl,
+                        buffer,
+                        GENFILTER_INSPECT_COPY_LENGTH);
+
+        MmBuildMdlForNonPagedPool(copy->Mdl);
+    }
+
+    status = GenFilterPoolCreate(Device,
+                                 &DevContext->Pools[GenFilterPoolInspect],
+                                 inspect->Copies,
+                                 sizeof(GENFILTER_INSPECT_COPY),
+                                 GENFILTER_INSPECT_COPIES);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // A write that finds no copy on the shared list waits for one, so none
+    // may sit unused in a processor's cache
+    //
+    DevContext->Pools[GenFilterPoolInspect].CacheLimit = 0;
+
+    inspect->Kernel  = GenFilterMatchBestKernel();
+    inspect->Enabled = TRUE;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterInspectSnapshot
+//
+//    Looks for a configuration's signatures in a buffer, and counts and
+//    traces a match.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Snapshot    - The configuration we've acquired
+//
+//      Request     - The Request the data belongs to (for the trace log)
+//
+//      Offset      - Where on the device the data is from, or going to
+//
+//      Buffer      - The data
+//
+//      Length      - The length of the data
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if a signature was found and the configuration blocks Requests
+//      that carry one, otherwise FALSE.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The SIMD kernels use registers that, in the kernel, we have to save
+//      before we use: the YMM registers for AVX2, and on x86 the XMM
+//      registers too.  If they can't be saved we scan with the scalar
+//      kernel, which doesn't need them.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+BOOLEAN
+GenFilterInspectSnapshot(PGENFILTER_DEVICE_CONTEXT   DevContext,
+                         PCGENFILTER_CONFIG_SNAPSHOT Snapshot,
+                         WDFREQUEST                  Request,
+                         LONGLONG                    Offset,
+                         const UCHAR*                Buffer,
+                         size_t                      Length)
+{
+    GENFILTER_MATCH_KERNEL kernel = DevContext->Inspect.Kernel;
+    size_t                 found;
+#ifdef GENFILTER_MATCH_SIMD
+    XSTATE_SAVE            xstate;
+    ULONG64                xstateMask = 0;
+#endif
+
+    if (Snapshot->InspectAction == GenFilterInspectOff || Length == 0) {
+        return FALSE;
+    }
+
+#ifdef GENFILTER_MATCH_SIMD
+#ifdef _M_IX86
+    if (kernel != GenFilterMatchScalar) {
+        xstateMask |= XSTATE_MASK_LEGACY;
+    }
+#endif
+
+    if (kernel == GenFilterMatchAvx2) {
+        xstateMask |= XSTATE_MASK_AVX;
+    }
+
+    if (xstateMask != 0 &&
+        !NT_SUCCESS(KeSaveExtendedProcessorState(xstateMask,
+                                                 &xstate))) {
+        kernel     = GenFilterMatchScalar;
+        xstateMask = 0;
+    }
+#endif
+
+    found = GenFilterMatchFind(&Snapshot->Match,
+                               kernel,
+                               Buffer,
+                               Length,
+                               nullptr);
+
+#ifdef GENFILTER_MATCH_SIMD
+    if (xstateMask != 0) {
+        KeRestoreExtendedProcessorState(&xstate);
+    }
+#endif
+
+    GenFilterStatsAdd(&DevContext->Stats,
+                      GenFilterStatInspectedBytes,
+                      (LONG64)Length);
+
+    if (found == GENFILTER_MATCH_NONE) {
+        return FALSE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatSignatureMatches);
+
+    GenFilterTrace(&DevContext->Trace,
+                   GenFilterTraceSignatureMatch,
+                   Request,
+                   STATUS_SUCCESS,
+                   (ULONGLONG)(Offset + (LONGLONG)found));
+
+    if (Snapshot->InspectAction != GenFilterInspectBlock) {
+        return FALSE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatSignatureBlocks);
+
+    return TRUE;
+}
+
+//
+// GenFilterInspectBuffer
+//
+// GenFilterInspectSnapshot with whatever configuration is current
+//
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectBuffer(PGENFILTER_DEVICE_CONTEXT DevContext,
+                       WDFREQUEST                Request,
+                       LONGLONG                  Offset,
+                       const UCHAR*              Buffer,
+                       size_t                    Length)
+{
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    ULONG                       phase;
+    BOOLEAN                     block;
+
+    if (!DevContext->Inspect.Enabled) {
+        return FALSE;
+    }
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    block = GenFilterInspectSnapshot(DevContext,
+                                     snapshot,
+                                     Request,
+                                     Offset,
+                                     Buffer,
+                                     Length);
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+
+    return block;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterInspectReserve
+//
+//    Takes a copy for a write we're going to inspect, before anything else
+//    is done with it.  If every copy is in use, the write waits for one.
+//
+//  INPUTS:
+//
+//      Request     - The write Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Length      - The length of the write
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the write is waiting for a copy, or couldn't be made to
+//      wait and was failed.  The caller must not touch it again.
+//
+//      FALSE if the caller should carry on with the write, which has a
+//      copy if we're inspecting.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A waiting write is handed the next copy that comes back (see
+//      GenFilterInspectRelease), and then back to the Queue it came from,
+//      so it's presented to us again, from the start.  It has its copy the
+//      second time, and isn't held back by the I/O limits again either.
+//
+//      This is done before the write is counted, traced or captured, so
+//      that none of that happens twice.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectReserve(WDFREQUEST                Request,
+                        PGENFILTER_DEVICE_CONTEXT DevContext,
+                        size_t                    Length)
+{
+    PGENFILTER_REQUEST_CONTEXT  reqContext;
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    PGENFILTER_INSPECT          inspect;
+    PGENFILTER_INSPECT_COPY     copy;
+    NTSTATUS                    status = STATUS_SUCCESS;
+    ULONG                       phase;
+    BOOLEAN                     inspecting;
+
+    inspect    = &DevContext->Inspect;
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (!inspect->Enabled ||
+        Length == 0 ||
+        reqContext->InspectCopy != nullptr) {
+        return FALSE;
+    }
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    inspecting = (snapshot->InspectAction != GenFilterInspectOff) ? TRUE : FALSE;
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+
+    if (!inspecting) {
+        return FALSE;
+    }
+
+    copy = (PGENFILTER_INSPECT_COPY)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolInspect]);
+
+    if (copy == nullptr) {
+
+        //
+        // Look again under the lock, so that a copy can't come back between
+        // our finding none and the write starting to wait
+        //
+        WdfSpinLockAcquire(inspect->Lock);
+
+        copy = (PGENFILTER_INSPECT_COPY)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolInspect]);
+
+        if (copy == nullptr) {
+
+            reqContext->InspectQueue = WdfRequestGetIoQueue(Request);
+
+            status = WdfRequestForwardToIoQueue(Request,
+                                                inspect->Waiting);
+        }
+
+        WdfSpinLockRelease(inspect->Lock);
+    }
+
+    if (copy != nullptr) {
+
+        reqContext->InspectCopy = copy;
+        return FALSE;
+    }
+
+    //
+    // If it can't wait, we can't be sure of what it would write
+    //
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            status);
+
+        WdfRequestComplete(Request,
+                           status);
+        return TRUE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatInspectWaits);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterInspectWriteRequest
+//
+//    Copies the data a write carries (or the first part of it, if it's
+//    longer than a copy), scans the copy, and fails the write if we're
+//    blocking what it contains.  Otherwise the write carries on, and is
+//    sent with the copy.
+//
+//  INPUTS:
+//
+//      Request     - The write Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Offset      - The device offset of the write
+//
+//      Length      - The length of the write
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the write was completed with STATUS_ACCESS_DENIED.  The
+//      caller must not touch it again.
+//
+//      FALSE if the caller should carry on with the write as usual.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller's buffer is still the caller's while we have the write,
+//      so if we scanned it where it is, and sent it on, another thread
+//      could change it in between.  What we scan, and what we send, is
+//      therefore our copy.  The write is gathered, scheduled, split and
+//      retried like any other (all of which send the copy, see
+//      GenFilterInspectFormatRequest), and the copy goes back to the pool
+//      when the write is completed.
+//
+//      A write longer than GENFILTER_INSPECT_COPY_LENGTH goes down a
+//      copy's worth at a time, each part copied and scanned as it goes
+//      (see GenFilterInspectWriteNext).  If we're blocking matches, the
+//      whole write is scanned where it is first, so that one that carries
+//      a signature is failed before any of it is written.  If the caller
+//      puts one there after that, the part it's in is failed with
+//      STATUS_ACCESS_DENIED, and the parts before it have been written.  A
+//      signature that straddles two parts is only found by the first scan.
+//
+//      A write that has no copy (inspection was off when it arrived, and
+//      has been turned on since) is scanned where it is.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectWriteRequest(WDFREQUEST                Request,
+                             PGENFILTER_DEVICE_CONTEXT DevContext,
+                             LONGLONG                  Offset,
+                             size_t                    Length)
+{
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    PGENFILTER_REQUEST_CONTEXT  reqContext;
+    PGENFILTER_INSPECT_COPY     copy;
+    ULONG                       phase;
+    PVOID                       buffer;
+    size_t                      length;
+    BOOLEAN                     block = FALSE;
+
+    if (!DevContext->Inspect.Enabled) {
+        return FALSE;
+    }
+
+    reqContext = GenFilterGetRequestContext(Request);
+    copy       = reqContext->InspectCopy;
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    if (snapshot->InspectAction == GenFilterInspectOff ||
+        Length == 0 ||
+        !NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request,
+                                                  Length,
+                                                  &buffer,
+                                                  nullptr))) {
+
+        //
+        // Inspection has been turned off since we took the copy
+        //
+        if (copy != nullptr) {
+
+            reqContext->InspectCopy = nullptr;
+
+            GenFilterInspectRelease(DevContext,
+                                    copy);
+        }
+
+        goto done;
+    }
+
+    if (copy == nullptr) {
+
+        block = GenFilterInspectSnapshot(DevContext,
+                                         snapshot,
+                                         Request,
+                                         Offset,
+                                         (const UCHAR*)buffer,
+                                         Length);
+        goto done;
+    }
+
+    length = (Length < GENFILTER_INSPECT_COPY_LENGTH) ? Length : GENFILTER_INSPECT_COPY_LENGTH;
+
+    if (length < Length &&
+        snapshot->InspectAction == GenFilterInspectBlock) {
+
+        block = GenFilterInspectSnapshot(DevContext,
+                                         snapshot,
+                                         Request,
+                                         Offset,
+                                         (const UCHAR*)buffer,
+                                         Length);
+        if (block) {
+            goto done;
+        }
+    }
+
+    RtlCopyMemory(copy->Buffer,
+                  buffer,
+                  length);
+
+    block = GenFilterInspectSnapshot(DevContext,
+                                     snapshot,
+                                     Request,
+                                     Offset,
+                                     copy->Buffer,
+                                     length);
+
+    reqContext->InspectOffset    = Offset;
+    reqContext->InspectLength    = (ULONG)length;
+    reqContext->InspectRemaining = Length - length;
+    reqContext->InspectWritten   = 0;
+
+done:
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+
+    if (!block) {
+        return FALSE;
+    }
+
+    GenFilterCompleting(DevContext,
+                        Request,
+                        STATUS_ACCESS_DENIED);
+
+    WdfRequestComplete(Request,
+                       STATUS_ACCESS_DENIED);
+    return TRUE;
+}
+
+//
+// GenFilterInspectFormatRequest
+//
+// Called wherever we send a Request we were given, in place of
+// WdfRequestFormatRequestUsingCurrentType
+//
+_Use_decl_annotations_
+NTSTATUS
+GenFilterInspectFormatRequest(WDFREQUEST                Request,
+                              PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDFMEMORY_OFFSET           memoryOffset;
+    LONGLONG                   offset;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (reqContext->InspectCopy == nullptr) {
+
+        WdfRequestFormatRequestUsingCurrentType(Request);
+        return STATUS_SUCCESS;
+    }
+
+    memoryOffset.BufferOffset = 0;
+    memoryOffset.BufferLength = reqContext->InspectLength;
+
+    offset = reqContext->InspectOffset;
+
+    return WdfIoTargetFormatRequestForWrite(WdfDeviceGetIoTarget(DevContext->WdfDevice),
+                                            Request,
+                                            reqContext->InspectCopy->Memory,
+                                            &memoryOffset,
+                                            &offset);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterInspectWriteNext
+//
+//    Called from our completion callback, once any retries are done.  If
+//    the part of a write that was in our copy was written, and there's
+//    more of the write, copies and scans the next part, and sends it.
+//
+//  INPUTS:
+//
+//      Request     - The completed Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Status      - The status the part completed with
+//
+//      Params      - The Request's completion parameters
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the next part has been sent (the caller must not touch the
+//      Request again), otherwise FALSE.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Each part is sent as the whole write was: with our completion
+//      callback, split if it's long enough, and retried if it fails, so
+//      each part is given as many retries as a write of its own would be.
+//      The write's place in its Queue's scheduler, and its limits, are
+//      only given up once the last part is done.
+//
+//      A part the device wrote less of than we sent, or that failed, is
+//      the last: the write is completed with its status, and what was
+//      written before it.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectWriteNext(WDFREQUEST                     Request,
+                          PGENFILTER_DEVICE_CONTEXT      DevContext,
+                          NTSTATUS                       Status,
+                          PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_INSPECT_COPY    copy;
+    PVOID                      buffer;
+    size_t                     length;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    copy       = reqContext->InspectCopy;
+
+    if (copy == nullptr ||
+        !NT_SUCCESS(Status)) {
+        return FALSE;
+    }
+
+    reqContext->InspectWritten += Params->IoStatus.Information;
+
+    if (reqContext->InspectRemaining == 0 ||
+        Params->IoStatus.Information < reqContext->InspectLength) {
+        return FALSE;
+    }
+
+    length = reqContext->InspectWritten + reqContext->InspectRemaining;
+
+    if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request,
+                                                  length,
+                                                  &buffer,
+                                                  nullptr))) {
+        return FALSE;
+    }
+
+    reqContext->InspectOffset   += reqContext->InspectLength;
+    reqContext->InspectLength    = (ULONG)((reqContext->InspectRemaining < GENFILTER_INSPECT_COPY_LENGTH) ?
+                                           reqContext->InspectRemaining : GENFILTER_INSPECT_COPY_LENGTH);
+    reqContext->InspectRemaining -= reqContext->InspectLength;
+
+    RtlCopyMemory(copy->Buffer,
+                  (PUCHAR)buffer + reqContext->InspectWritten,
+                  reqContext->InspectLength);
+
+    if (GenFilterInspectBuffer(DevContext,
+                               Request,
+                               reqContext->InspectOffset,
+                               copy->Buffer,
+                               reqContext->InspectLength)) {
+
+        reqContext->InspectBlocked = TRUE;
+        return FALSE;
+    }
+
+    //
+    // This part gets retries of its own
+    //
+    reqContext->RetryCount = 0;
+
+    //
+    // If it can't be sent, it's completed with what was written before it
+    //
+    WdfRequestSetInformation(Request,
+                             reqContext->InspectWritten);
+
+    GenFilterSendWithCallback(Request,
+                              DevContext);
+    return TRUE;
+}
+
+//
+// GenFilterInspectWriteCompleted
+//
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectWriteCompleted(WDFREQUEST Request)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (reqContext->InspectCopy == nullptr) {
+        return FALSE;
+    }
+
+    WdfRequestSetInformation(Request,
+                             reqContext->InspectWritten);
+
+    return reqContext->InspectBlocked;
+}
+
+//
+// GenFilterInspectCompleting
+//
+_Use_decl_annotations_
+VOID
+GenFilterInspectCompleting(PGENFILTER_DEVICE_CONTEXT DevContext,
+                           WDFREQUEST                Request)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_INSPECT_COPY    copy;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    copy       = reqContext->InspectCopy;
+
+    if (copy == nullptr) {
+        return;
+    }
+
+    reqContext->InspectCopy = nullptr;
+
+    GenFilterInspectRelease(DevContext,
+                            copy);
+}
+
+//
+// GenFilterInspectRelease
+//
+// Hands a copy we're done with to the write that's waited longest for one,
+// and that write back to the Queue it came from.  If the Queue won't take
+// it (the device is going away, say), fails it.  If nothing's waiting,
+// returns the copy to the pool.
+//
+static
+VOID
+GenFilterInspectRelease(PGENFILTER_DEVICE_CONTEXT DevContext,
+                        PGENFILTER_INSPECT_COPY   Copy)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_INSPECT         inspect;
+    WDFREQUEST                 request;
+    NTSTATUS                   status;
+
+    inspect = &DevContext->Inspect;
+
+    WdfSpinLockAcquire(inspect->Lock);
+
+    status = WdfIoQueueRetrieveNextRequest(inspect->Waiting,
+                                           &request);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterPoolFree(&DevContext->Pools[GenFilterPoolInspect],
+                          Copy);
+    }
+
+    WdfSpinLockRelease(inspect->Lock);
+
+    if (!NT_SUCCESS(status)) {
+        return;
+    }
+
+    reqContext = GenFilterGetRequestContext(request);
+
+    reqContext->InspectCopy = Copy;
+
+    //
+    // It's been through our I/O limits already (see GenFilterLimitRequest)
+    //
+    reqContext->LimitReleased = TRUE;
+
+    status = WdfRequestForwardToIoQueue(request,
+                                        reqContext->InspectQueue);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterCompleting(DevContext,
+                            request,
+                            status);
+
+        WdfRequestComplete(request,
+                           status);
+    }
+}
+
+//
+// GenFilterInspectReadRequest
+//
+_Use_decl_annotations_
+VOID
+GenFilterInspectReadRequest(WDFREQUEST                Request,
+                            PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    ULONG                       phase;
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    GenFilterGetRequestContext(Request)->InspectRead =
+        (snapshot->InspectAction != GenFilterInspectOff) ? TRUE : FALSE;
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterInspectReadCompleted
+//
+//    Called from our completion callback.  Scans the data a successful
+//    read returned, and if we're blocking what it contains, wipes it, as
+//    best we can.
+//
+//  INPUTS:
+//
+//      Request     - The completed Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Params      - The Request's completion parameters
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the caller must complete the read with STATUS_ACCESS_DENIED,
+//      otherwise FALSE.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Unlike a write's, a read's data isn't copied: the device puts it
+//      straight into the caller's buffer, and we scan it there.  Blocking
+//      a read is therefore best effort.  The data is zeroed and the read
+//      is failed, so a caller that waits for the read never sees it, but
+//      one that looks at its buffer while the read is in flight (or maps
+//      the same pages elsewhere) can read it before we've wiped it.  It
+//      isn't added to the read cache either way (the cache only ever holds
+//      data that passed inspection).
+//
+//      The data is scanned with the configuration that's current when the
+//      read completes, which needn't be the one it was sent under.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterInspectReadCompleted(WDFREQUEST                     Request,
+                              PGENFILTER_DEVICE_CONTEXT      DevContext,
+                              PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDF_REQUEST_PARAMETERS     params;
+    PVOID                      buffer;
+    size_t                     length;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    length     = Params->IoStatus.Information;
+
+    if (!reqContext->InspectRead ||
+        !NT_SUCCESS(Params->IoStatus.Status) ||
+        length == 0) {
+        return FALSE;
+    }
+
+    if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                   length,
+                                                   &buffer,
+                                                   nullptr))) {
+        return FALSE;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    if (!GenFilterInspectBuffer(DevContext,
+                                Request,
+                                params.Parameters.Read.DeviceOffset,
+                                (const UCHAR*)buffer,
+                                length)) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(buffer,
+                  length);
+
+    reqContext->CacheFill = FALSE;
+
+    WdfRequestSetInformation(Request,
+                             0);
+
+    return TRUE;
+}
@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterInspect.h
+//
+//    ABSTRACT:
+//
+//      Content inspection.  Looks for a configured set of byte signatures in
+//      the data being written to, and read from, the device, and flags or fails
+//      the Requests that carry them.  The matching itself is GenFilterMatch.h.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterMatch.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// The per-device inspection state that lives in our device context.  What
+// we look for, and what we do when we find it, are part of the device's
+// configuration (see GenFilterConfig.h), since they can be changed while
+// we're running.  The action and signatures are read from the
+// "InspectAction" and "InspectSignatures" values in the device's hardware
+// key when it starts; the signatures are a REG_MULTI_SZ of hex strings,
+// for example "4D5A9000" (spaces between bytes are allowed).
+//
+// An inspected write is sent from our own copy of its data, so that what
+// reaches the device is what we scanned: the caller can't change it once
+// we've looked.  The copies are preallocated and kept in
+// DevContext->Pools[GenFilterPoolInspect], each with an MDL that describes
+// it (so that it can be split like any other write).  A write that finds
+// every copy in use waits in our Waiting Queue until one is free, and one
+// longer than a copy is sent a copy's worth at a time.
+//
+constexpr ULONG GENFILTER_INSPECT_COPIES      = 8;
+constexpr ULONG GENFILTER_INSPECT_COPY_LENGTH = 128 * 1024;
+
+typedef struct _GENFILTER_INSPECT_COPY {
+    WDFMEMORY Memory;
+    PUCHAR    Buffer;
+    PMDL      Mdl;
+} GENFILTER_INSPECT_COPY, *PGENFILTER_INSPECT_COPY;
+
+typedef struct _GENFILTER_INSPECT {
+    BOOLEAN                Enabled;     // Our dispatcher inspects
+    GENFILTER_MATCH_KERNEL Kernel;      // Chosen for this processor
+    GENFILTER_INSPECT_COPY Copies[GENFILTER_INSPECT_COPIES];
+
+    //
+    // Writes waiting for a copy, and the lock that keeps a copy from
+    // coming back while a write is on its way in
+    //
+    WDFQUEUE               Waiting;
+    WDFSPINLOCK            Lock;
+} GENFILTER_INSPECT, *PGENFILTER_INSPECT;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterInspectInitialize(_In_ WDFDEVICE Device,
+                           _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Scans Length bytes that are (or will be) at Offset on the device.
+// Returns TRUE if the Request they belong to should be failed.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectBuffer(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                       _In_ WDFREQUEST Request,
+                       _In_ LONGLONG Offset,
+                       _In_reads_bytes_(Length) const UCHAR* Buffer,
+                       _In_ size_t Length);
+
+//
+// Called for each write before anything else is done with it.  Returns
+// TRUE if it's waiting for a copy to be free (it's presented to our write
+// Queue callback again once it has one), or has been failed.  Either way,
+// the caller must not touch it again.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectReserve(_In_ WDFREQUEST Request,
+                        _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                        _In_ size_t Length);
+
+//
+// Returns TRUE if the write carried data we block, and was failed, in
+// which case the caller must not touch it again
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectWriteRequest(_In_ WDFREQUEST Request,
+                             _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                             _In_ LONGLONG Offset,
+                             _In_ size_t Length);
+
+//
+// Formats a Request to be sent to our Local I/O Target: a write we've
+// copied with the part of its data that's in our copy, anything else as
+// it is
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+GenFilterInspectFormatRequest(_In_ WDFREQUEST Request,
+                              _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Called from our completion callback.  Returns TRUE if the write is
+// longer than our copy, and its next part has been sent.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectWriteNext(_In_ WDFREQUEST Request,
+                          _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                          _In_ NTSTATUS Status,
+                          _In_ PWDF_REQUEST_COMPLETION_PARAMS Params);
+
+//
+// Returns TRUE if the completed write must be failed, because a part of it
+// we hadn't sent yet carried data we block.  Either way, the write's
+// Information is set to what the device wrote of it.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectWriteCompleted(_In_ WDFREQUEST Request);
+
+//
+// Called just before a Request we were given is completed.  Hands the
+// copy of its data, if it has one, to a write that's waiting for one, or
+// returns it to the pool.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterInspectCompleting(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                           _In_ WDFREQUEST Request);
+
+//
+// Called for each read we send to the device, so that it's sent with our
+// completion callback if its data needs scanning
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterInspectReadRequest(_In_ WDFREQUEST Request,
+                            _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Returns TRUE if the completed read must be failed.  Its data has been
+// wiped and kept out of the cache, but the caller could have seen it
+// before we did.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterInspectReadCompleted(_In_ WDFREQUEST Request,
+                              _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                              _In_ PWDF_REQUEST_COMPLETION_PARAMS Params);
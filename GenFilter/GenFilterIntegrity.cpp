@@ -0,0 +1,721 @@
+///
+/// @file GenFilterIntegrity.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+PGENFILTER_INTEGRITY_BUCKET
+GenFilterIntegrityBucketOf(_In_ PGENFILTER_INTEGRITY Integrity,
+                           _In_ LONGLONG Sector);
+
+static
+VOID
+GenFilterIntegrityBucketRefresh(_In_ PGENFILTER_INTEGRITY_BUCKET Bucket,
+                                _In_ LONG Flushed);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterIntegrityInitialize
+//
+//    Reads the integrity settings from the device's hardware key, and if
+//    checking is on, allocates the checksum table.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the table could
+//                      not be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Checking is off unless the "IntegrityCheck" value is 1.  The table
+//      holds GENFILTER_INTEGRITY_WAYS checksums for every 64 bytes of the
+//      "IntegrityTableKB" value, so the default 512KB remembers 57344
+//      sectors (112MB of 2048-byte sectors).
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterIntegrityInitialize(WDFDEVICE                 Device,
+                             PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    PGENFILTER_INTEGRITY  integrity;
+    WDFKEY                key         = nullptr;
+    ULONG                 enabled     = 0;
+    ULONG                 tableKb     = GENFILTER_INTEGRITY_DEFAULT_KB;
+    ULONG                 bucketCount;
+
+    DECLARE_CONST_UNICODE_STRING(checkValueName, L"IntegrityCheck");
+    DECLARE_CONST_UNICODE_STRING(tableValueName, L"IntegrityTableKB");
+
+    integrity = &DevContext->Integrity;
+
+    RtlZeroMemory(integrity,
+                  sizeof(GENFILTER_INTEGRITY));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (!NT_SUCCESS(status)) {
+        key    = nullptr;
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                          &checkValueName,
+                                          &enabled)) ||
+        enabled != 1) {
+
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &tableValueName,
+                                &tableKb);
+
+    if (tableKb < GENFILTER_INTEGRITY_MIN_KB) {
+        tableKb = GENFILTER_INTEGRITY_MIN_KB;
+    }
+
+    if (tableKb > GENFILTER_INTEGRITY_MAX_KB) {
+        tableKb = GENFILTER_INTEGRITY_MAX_KB;
+    }
+
+    //
+    // The largest power of two number of buckets that fits
+    //
+    bucketCount = tableKb * 1024 / sizeof(GENFILTER_INTEGRITY_BUCKET);
+
+    while ((bucketCount & (bucketCount - 1)) != 0) {
+        bucketCount &= bucketCount - 1;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'iFnG',
+                             (size_t)bucketCount * sizeof(GENFILTER_INTEGRITY_BUCKET),
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for integrity table failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // Every bucket starts out empty, and invalidated at sequence 0
+    //
+    RtlZeroMemory(buffer,
+                  (size_t)bucketCount * sizeof(GENFILTER_INTEGRITY_BUCKET));
+
+    integrity->Buckets    = (PGENFILTER_INTEGRITY_BUCKET)buffer;
+    integrity->BucketMask = bucketCount - 1;
+    integrity->Kernel     = GenFilterCrcBestKernel();
+    integrity->Enabled    = TRUE;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (key != nullptr) {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterIntegrityCheck
+//
+//    Checksums each whole sector of data read from the device, and
+//    compares it with the checksum that sector had the last time we read
+//    it.  Sectors we haven't seen before are remembered.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Request     - The read the data came from (for the trace log)
+//
+//      Epoch       - The integrity table's Sequence when the read was sent
+//
+//      Offset      - Byte offset on the device the data was read from.
+//                    Must be sector aligned.
+//
+//      Buffer      - The data
+//
+//      Length      - Length of the data.  A partial sector at the end is
+//                    ignored.
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A mismatch is only counted and traced.  We can't tell which of the
+//      two reads returned the right data, so we keep the first checksum:
+//      a drive that keeps returning bad data for a sector keeps being
+//      caught, and one that reads it correctly again matches again.
+//
+//      A sector whose bucket a write invalidated while the data was in
+//      flight may be from before the write, so it's neither compared nor
+//      kept, and is counted as skipped.  A write to some other bucket
+//      doesn't matter.  As in GenFilterCacheFill, the bucket is checked
+//      again under its lock so that we can't race with
+//      GenFilterIntegrityInvalidateRange.  After a media change, none of
+//      the data is checked.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityCheck(PGENFILTER_DEVICE_CONTEXT DevContext,
+                        WDFREQUEST                Request,
+                        LONG                      Epoch,
+                        LONGLONG                  Offset,
+                        const UCHAR*              Buffer,
+                        size_t                    Length)
+{
+    PGENFILTER_INTEGRITY integrity = &DevContext->Integrity;
+    LONGLONG             sector;
+    size_t               sectorCount;
+    ULONG                checked    = 0;
+    ULONG                mismatches = 0;
+    ULONG                skipped    = 0;
+
+    if (!integrity->Enabled ||
+        Offset < 0 ||
+        (Offset % GENFILTER_CACHE_BLOCK_SIZE) != 0) {
+        return;
+    }
+
+    sector      = Offset / GENFILTER_CACHE_BLOCK_SIZE;
+    sectorCount = Length / GENFILTER_CACHE_BLOCK_SIZE;
+
+    for (size_t index = 0; index < sectorCount; index++, sector++) {
+
+        PGENFILTER_INTEGRITY_BUCKET bucket;
+        KIRQL                       oldIrql;
+        ULONG                       crc;
+        ULONG                       key;
+        LONG                        flushed;
+        ULONG                       way;
+
+        if (sector >= MAXULONG) {
+            break;
+        }
+
+        //
+        // The media changed while we were reading it
+        //
+        if ((LONG)(ReadAcquire(&integrity->Flushed) - Epoch) > 0) {
+            skipped += (ULONG)(sectorCount - index);
+            break;
+        }
+
+        key    = (ULONG)sector + 1;
+        bucket = GenFilterIntegrityBucketOf(integrity,
+                                            sector);
+
+        //
+        // Don't bother with the checksum if a write got here first
+        //
+        if ((LONG)(ReadNoFence(&bucket->Invalidated) - Epoch) > 0) {
+            skipped++;
+            continue;
+        }
+
+        crc = GenFilterCrc32c(integrity->Kernel,
+                              Buffer + index * GENFILTER_CACHE_BLOCK_SIZE,
+                              GENFILTER_CACHE_BLOCK_SIZE);
+
+        oldIrql = ExAcquireSpinLockExclusive(&bucket->Lock);
+        flushed = ReadAcquire(&integrity->Flushed);
+
+        if ((LONG)(flushed - Epoch) > 0) {
+
+            ExReleaseSpinLockExclusive(&bucket->Lock,
+                                       oldIrql);
+
+            skipped += (ULONG)(sectorCount - index);
+            break;
+        }
+
+        GenFilterIntegrityBucketRefresh(bucket,
+                                        flushed);
+
+        if ((LONG)(bucket->Invalidated - Epoch) > 0) {
+
+            ExReleaseSpinLockExclusive(&bucket->Lock,
+                                       oldIrql);
+            skipped++;
+            continue;
+        }
+
+        for (way = 0; way < GENFILTER_INTEGRITY_WAYS; way++) {
+
+            if (bucket->Sectors[way] == key) {
+                break;
+            }
+        }
+
+        if (way < GENFILTER_INTEGRITY_WAYS) {
+
+            if (bucket->Crcs[way] != crc) {
+                mismatches++;
+
+                GenFilterTrace(&DevContext->Trace,
+                               GenFilterTraceIntegrityMismatch,
+                               Request,
+                               STATUS_CRC_ERROR,
+                               (ULONGLONG)sector * GENFILTER_CACHE_BLOCK_SIZE);
+            }
+
+        } else {
+
+            for (way = 0; way < GENFILTER_INTEGRITY_WAYS; way++) {
+
+                if (bucket->Sectors[way] == 0) {
+                    break;
+                }
+            }
+
+            //
+            // The bucket is full.  Evict whichever sector is in the way
+            // this one picks.
+            //
+            if (way == GENFILTER_INTEGRITY_WAYS) {
+
+                way = key % GENFILTER_INTEGRITY_WAYS;
+
+                GenFilterStatsIncrement(&DevContext->Stats,
+                                        GenFilterStatIntegrityEvictions);
+            }
+
+            bucket->Sectors[way] = key;
+            bucket->Crcs[way]    = crc;
+        }
+
+        ExReleaseSpinLockExclusive(&bucket->Lock,
+                                   oldIrql);
+
+        checked++;
+    }
+
+    GenFilterStatsAdd(&DevContext->Stats,
+                      GenFilterStatIntegritySectors,
+                      (LONG64)checked);
+
+    if (mismatches != 0) {
+        GenFilterStatsAdd(&DevContext->Stats,
+                          GenFilterStatIntegrityMismatches,
+                          (LONG64)mismatches);
+    }
+
+    if (skipped != 0) {
+        GenFilterStatsAdd(&DevContext->Stats,
+                          GenFilterStatIntegritySkips,
+                          (LONG64)skipped);
+    }
+}
+
+//
+// GenFilterIntegrityReadRequest
+//
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityReadRequest(WDFREQUEST                Request,
+                              PGENFILTER_DEVICE_CONTEXT DevContext,
+                              LONGLONG                  Offset)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->IntegrityCheck = FALSE;
+
+    if (!DevContext->Integrity.Enabled ||
+        Offset < 0 ||
+        (Offset % GENFILTER_CACHE_BLOCK_SIZE) != 0) {
+        return;
+    }
+
+    reqContext->IntegrityCheck = TRUE;
+    reqContext->IntegrityEpoch = GenFilterIntegrityGetSequence(&DevContext->Integrity);
+}
+
+//
+// GenFilterIntegrityWriteRequest
+//
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityWriteRequest(WDFREQUEST                Request,
+                               PGENFILTER_DEVICE_CONTEXT DevContext,
+                               LONGLONG                  Offset,
+                               size_t                    Length)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->IntegrityInvalidate = FALSE;
+
+    if (!DevContext->Integrity.Enabled ||
+        Length == 0) {
+        return;
+    }
+
+    GenFilterIntegrityInvalidateRange(&DevContext->Integrity,
+                                      Offset,
+                                      Length);
+
+    reqContext->IntegrityInvalidate = TRUE;
+    reqContext->IntegrityOffset     = Offset;
+    reqContext->IntegrityLength     = (ULONG)Length;
+}
+
+//
+// GenFilterIntegrityCompleting
+//
+// Whether or not it worked, a write may have changed what's on the media.
+// Invalidating again catches a read that was sent after the write reached
+// us, but was serviced before the write reached the device.
+//
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityCompleting(PGENFILTER_DEVICE_CONTEXT DevContext,
+                             WDFREQUEST                Request)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext = GenFilterGetRequestContext(Request);
+
+    if (!reqContext->IntegrityInvalidate) {
+        return;
+    }
+
+    reqContext->IntegrityInvalidate = FALSE;
+
+    GenFilterIntegrityInvalidateRange(&DevContext->Integrity,
+                                      reqContext->IntegrityOffset,
+                                      reqContext->IntegrityLength);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterIntegrityReadCompleted
+//
+//    Called from our completion callback.  Checks the data a successful
+//    read returned.
+//
+//  INPUTS:
+//
+//      Request     - The completed Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Status      - The status the Request will be completed with
+//
+//      Params      - The Request's completion parameters
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Status is passed separately because we may be failing a read the
+//      device completed successfully (see GenFilterInspectReadCompleted),
+//      in which case there's nothing to check.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityReadCompleted(WDFREQUEST                     Request,
+                                PGENFILTER_DEVICE_CONTEXT      DevContext,
+                                NTSTATUS                       Status,
+                                PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDF_REQUEST_PARAMETERS     params;
+    PVOID                      buffer;
+    size_t                     length;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    length     = Params->IoStatus.Information;
+
+    if (!reqContext->IntegrityCheck ||
+        !NT_SUCCESS(Status) ||
+        length < GENFILTER_CACHE_BLOCK_SIZE) {
+        return;
+    }
+
+    if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                   length,
+                                                   &buffer,
+                                                   nullptr))) {
+        return;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    GenFilterIntegrityCheck(DevContext,
+                            Request,
+                            reqContext->IntegrityEpoch,
+                            params.Parameters.Read.DeviceOffset,
+                            (const UCHAR*)buffer,
+                            length);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterIntegrityInvalidateRange
+//
+//    Forgets the checksums of the sectors a write covers, wholly or
+//    partly.
+//
+//  INPUTS:
+//
+//      Integrity   - The integrity state
+//
+//      Offset      - Byte offset of the write
+//
+//      Length      - Length of the write
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Ranges with more sectors than the table holds just empty the table.
+//
+//      Each bucket the range touches is marked with a new Sequence, so
+//      that reads in flight skip its sectors (see GenFilterIntegrityCheck).
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityInvalidateRange(PGENFILTER_INTEGRITY Integrity,
+                                  LONGLONG             Offset,
+                                  size_t               Length)
+{
+    LONGLONG firstSector;
+    LONGLONG lastSector;
+    LONG     sequence;
+    LONG     flushed;
+
+    if (!Integrity->Enabled ||
+        Length == 0) {
+        return;
+    }
+
+    if (Offset < 0 ||
+        Length / GENFILTER_CACHE_BLOCK_SIZE >=
+            (size_t)(Integrity->BucketMask + 1) * GENFILTER_INTEGRITY_WAYS) {
+
+        GenFilterIntegrityInvalidate(Integrity);
+        return;
+    }
+
+    //
+    // This MUST come before we look at the buckets.  See
+    // GenFilterIntegrityCheck.
+    //
+    sequence = InterlockedIncrement(&Integrity->Sequence);
+
+    firstSector = Offset / GENFILTER_CACHE_BLOCK_SIZE;
+    lastSector  = (Offset + (LONGLONG)Length - 1) / GENFILTER_CACHE_BLOCK_SIZE;
+
+    if (lastSector >= MAXULONG) {
+        lastSector = MAXULONG - 1;
+    }
+
+    for (LONGLONG sector = firstSector; sector <= lastSector; sector++) {
+
+        PGENFILTER_INTEGRITY_BUCKET bucket;
+        KIRQL                       oldIrql;
+        ULONG                       key = (ULONG)sector + 1;
+
+        bucket  = GenFilterIntegrityBucketOf(Integrity,
+                                             sector);
+        oldIrql = ExAcquireSpinLockExclusive(&bucket->Lock);
+        flushed = ReadAcquire(&Integrity->Flushed);
+
+        GenFilterIntegrityBucketRefresh(bucket,
+                                        flushed);
+
+        //
+        // Somebody who took their sequence number after us may have been
+        // here first
+        //
+        if ((LONG)(sequence - bucket->Invalidated) > 0) {
+            bucket->Invalidated = sequence;
+        }
+
+        for (ULONG way = 0; way < GENFILTER_INTEGRITY_WAYS; way++) {
+
+            if (bucket->Sectors[way] == key) {
+                bucket->Sectors[way] = 0;
+                break;
+            }
+        }
+
+        ExReleaseSpinLockExclusive(&bucket->Lock,
+                                   oldIrql);
+    }
+}
+
+//
+// GenFilterIntegrityInvalidate
+//
+// Empties the table, lazily: each bucket is emptied the next time it's used.
+// Flushed only ever moves forward, whichever of two media changes gets
+// here first.
+//
+_Use_decl_annotations_
+VOID
+GenFilterIntegrityInvalidate(PGENFILTER_INTEGRITY Integrity)
+{
+    LONG sequence;
+    LONG flushed;
+
+    sequence = InterlockedIncrement(&Integrity->Sequence);
+
+    do {
+
+        flushed = ReadAcquire(&Integrity->Flushed);
+
+        if ((LONG)(flushed - sequence) >= 0) {
+            break;
+        }
+
+    } while (InterlockedCompareExchange(&Integrity->Flushed,
+                                        sequence,
+                                        flushed) != flushed);
+}
+
+//
+// GenFilterIntegrityBucketRefresh
+//
+// Empties a bucket last used before the table was emptied.  Called with the
+// bucket's lock held.
+//
+static
+VOID
+GenFilterIntegrityBucketRefresh(PGENFILTER_INTEGRITY_BUCKET Bucket,
+                                LONG                        Flushed)
+{
+    if ((LONG)(Bucket->Invalidated - Flushed) >= 0) {
+        return;
+    }
+
+    RtlZeroMemory(Bucket->Sectors,
+                  sizeof(Bucket->Sectors));
+
+    Bucket->Invalidated = Flushed;
+}
+
+//
+// GenFilterIntegrityBucketOf
+//
+// Fibonacci hashing, as in GenFilterCacheBucketOf
+//
+static
+PGENFILTER_INTEGRITY_BUCKET
+GenFilterIntegrityBucketOf(PGENFILTER_INTEGRITY Integrity,
+                           LONGLONG             Sector)
+{
+    ULONG index;
+
+    index = (ULONG)(((ULONGLONG)Sector * 0x9e3779b97f4a7c15ULL) >> 32) &
+            Integrity->BucketMask;
+
+    return &Integrity->Buckets[index];
+}
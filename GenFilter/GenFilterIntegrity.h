@@ -0,0 +1,190 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterIntegrity.h
+//
+//    ABSTRACT:
+//
+//      Sector integrity tracking.  Remembers the CRC32C of each sector we've
+//      read, and counts and traces reads that return different data for a
+//      sector than it returned before.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterCrc.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Checksums per bucket.  With its lock and invalidation sequence, a bucket
+// is one 64 byte cache line.
+//
+constexpr ULONG GENFILTER_INTEGRITY_WAYS = 7;
+
+//
+// Size of the checksum table, in KB, set by the "IntegrityTableKB" value
+// in the device's hardware key (and rounded down to a power of two)
+//
+constexpr ULONG GENFILTER_INTEGRITY_DEFAULT_KB = 512;
+constexpr ULONG GENFILTER_INTEGRITY_MIN_KB     = 4;
+constexpr ULONG GENFILTER_INTEGRITY_MAX_KB     = 64 * 1024;
+
+//
+// One set of the table.  A sector (LBA) hashes to one bucket, and its
+// checksum goes in whichever of the bucket's ways is free, or in the way
+// the LBA picks if none is.  Sectors are stored as LBA + 1 so that 0
+// means the way is free; sectors whose LBA doesn't fit aren't tracked.
+//
+// Invalidated: The table's Sequence when a write last touched the bucket,
+//              or when it was emptied because the table was.  A bucket
+//              invalidated before the table's Flushed is empty.
+//
+typedef struct _GENFILTER_INTEGRITY_BUCKET {
+    EX_SPIN_LOCK Lock;
+    LONG         Invalidated;
+    ULONG        Sectors[GENFILTER_INTEGRITY_WAYS];
+    ULONG        Crcs[GENFILTER_INTEGRITY_WAYS];
+} GENFILTER_INTEGRITY_BUCKET, *PGENFILTER_INTEGRITY_BUCKET;
+
+static_assert(sizeof(GENFILTER_INTEGRITY_BUCKET) == 64,
+              "GENFILTER_INTEGRITY_BUCKET should be one cache line");
+
+//
+// The per-device integrity state that lives in our device context
+//
+// Sequence: Bumped by every invalidation.  A read takes the sequence when
+//           it's sent, and a sector whose bucket was invalidated after
+//           that isn't checked, because the read may have returned what
+//           was there before the write.
+//
+// Flushed:  The Sequence when the whole table was last emptied, when the
+//           media changed.  Buckets are emptied lazily, the next time
+//           they're used.
+//
+typedef struct _GENFILTER_INTEGRITY {
+    BOOLEAN                     Enabled;
+    GENFILTER_CRC_KERNEL        Kernel;     // Chosen for this processor
+    PGENFILTER_INTEGRITY_BUCKET Buckets;
+    ULONG                       BucketMask;
+    volatile LONG               Sequence;
+    volatile LONG               Flushed;
+} GENFILTER_INTEGRITY, *PGENFILTER_INTEGRITY;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterIntegrityInitialize(_In_ WDFDEVICE Device,
+                             _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Checksums the whole sectors in Length bytes read from Offset, and
+// compares them with what those sectors returned before.  Epoch is the
+// integrity table's Sequence from when the read was sent.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityCheck(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                        _In_ WDFREQUEST Request,
+                        _In_ LONG Epoch,
+                        _In_ LONGLONG Offset,
+                        _In_reads_bytes_(Length) const UCHAR* Buffer,
+                        _In_ size_t Length);
+
+//
+// Called for each read we send to the device, so that it's sent with our
+// completion callback if its data needs checking
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityReadRequest(_In_ WDFREQUEST Request,
+                              _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                              _In_ LONGLONG Offset);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityReadCompleted(_In_ WDFREQUEST Request,
+                                _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                                _In_ NTSTATUS Status,
+                                _In_ PWDF_REQUEST_COMPLETION_PARAMS Params);
+
+//
+// Called for each write we're given, before it's sent, to forget the
+// checksums of the sectors it covers.  They're forgotten again when it
+// completes.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityWriteRequest(_In_ WDFREQUEST Request,
+                               _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                               _In_ LONGLONG Offset,
+                               _In_ size_t Length);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityCompleting(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                             _In_ WDFREQUEST Request);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityInvalidateRange(_In_ PGENFILTER_INTEGRITY Integrity,
+                                  _In_ LONGLONG Offset,
+                                  _In_ size_t Length);
+
+//
+// Forgets every checksum
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterIntegrityInvalidate(_In_ PGENFILTER_INTEGRITY Integrity);
+
+//
+// GenFilterIntegrityGetSequence
+//
+// The ticket a read takes when it's sent (see GenFilterIntegrityCheck)
+//
+FORCEINLINE
+LONG
+GenFilterIntegrityGetSequence(_In_ PGENFILTER_INTEGRITY Integrity)
+{
+    return ReadAcquire(&Integrity->Sequence);
+}
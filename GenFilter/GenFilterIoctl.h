@@ -0,0 +1,600 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterIoctl.h
+//
+//    ABSTRACT:
+//
+//      Private control interface of the filter.  These IOCTLs are sent to
+//      the filtered device (the filter sees them first and completes them
+//      itself) and are shared between the driver and user-mode tools.
+//
+//      This file deliberately includes nothing.  Include it after <wdm.h>
+//      in the driver, or after <windows.h> and <winioctl.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+//
+// Returns a GENFILTER_STATISTICS structure in the output buffer.
+//
+#define IOCTL_GENFILTER_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2049, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Drains the binary trace log.  Returns a GENFILTER_TRACE_HEADER followed by
+// GENFILTER_TRACE_HEADER.RecordCount GENFILTER_TRACE_RECORDs.  Records that
+// are returned are removed from the log; keep issuing the IOCTL until it
+// returns no records to empty the log completely.
+//
+#define IOCTL_GENFILTER_DRAIN_TRACE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2050, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+//
+// Returns the filter's latency histograms: a GENFILTER_LATENCY_HEADER
+// followed by GENFILTER_LATENCY_HEADER.ClassCount GENFILTER_LATENCY_CLASSes.
+//
+#define IOCTL_GENFILTER_GET_LATENCY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2051, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+//
+// Switches pass-through mode on (input ULONG != 0) or off (0).  In
+// pass-through mode the filter hands Requests straight to the device
+// without looking at them.  If there's an output buffer, it receives the
+// previous mode as a ULONG.
+//
+#define IOCTL_GENFILTER_SET_PASS_THROUGH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2052, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+// Returns a GENFILTER_POOLS structure in the output buffer.
+//
+#define IOCTL_GENFILTER_GET_POOLS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2053, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Returns a GENFILTER_DEFER_INFO structure in the output buffer.
+//
+#define IOCTL_GENFILTER_GET_DEFER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2054, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Drains the I/O capture.  Returns a GENFILTER_CAPTURE_HEADER followed by
+// GENFILTER_CAPTURE_HEADER.RecordCount GENFILTER_CAPTURE_RECORDs, which
+// are removed from the capture, just as IOCTL_GENFILTER_DRAIN_TRACE does
+// with the trace log.
+//
+#define IOCTL_GENFILTER_DRAIN_CAPTURE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2055, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+//
+// Replaces any of the filter's inspection settings, its I/O limits, and
+// how it splits large transfers with those in the GENFILTER_CONFIGURATION
+// in the input buffer, without restarting the device.  Requests already
+// in progress finish with the settings they started with.  If there's an
+// output buffer, it receives the new configuration's generation number as
+// a ULONG.
+//
+#define IOCTL_GENFILTER_SET_CONFIG \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2056, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+// Returns a GENFILTER_HEAVY_HITTERS structure in the output buffer: the
+// requesters that have sent the filter the most I/O.
+//
+#define IOCTL_GENFILTER_GET_HEAVY_HITTERS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2057, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+//
+// Starts the heavy hitter counts again from zero.  No buffers.
+//
+#define IOCTL_GENFILTER_RESET_HEAVY_HITTERS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2058, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+// Replaces the latency sampling intervals with those in the
+// GENFILTER_LATENCY_SAMPLING in the input buffer, without restarting the
+// device.  If there's an output buffer, it receives the intervals that
+// were replaced, in another GENFILTER_LATENCY_SAMPLING.
+//
+#define IOCTL_GENFILTER_SET_LATENCY_SAMPLING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 2059, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+//
+// TRUE for exactly our private IOCTLs, which the filter always handles, even
+// in pass-through mode.  Any new one MUST be added here.  Every other code,
+// including any other FILE_DEVICE_UNKNOWN code (vendors use them too),
+// belongs to the drivers below us.
+//
+inline
+bool
+GenFilterIsPrivateIoctl(ULONG IoControlCode)
+{
+    switch (IoControlCode) {
+
+        case IOCTL_GENFILTER_GET_STATISTICS:
+        case IOCTL_GENFILTER_DRAIN_TRACE:
+        case IOCTL_GENFILTER_GET_LATENCY:
+        case IOCTL_GENFILTER_SET_PASS_THROUGH:
+        case IOCTL_GENFILTER_GET_POOLS:
+        case IOCTL_GENFILTER_GET_DEFER:
+        case IOCTL_GENFILTER_DRAIN_CAPTURE:
+        case IOCTL_GENFILTER_SET_CONFIG:
+        case IOCTL_GENFILTER_GET_HEAVY_HITTERS:
+        case IOCTL_GENFILTER_RESET_HEAVY_HITTERS:
+        case IOCTL_GENFILTER_SET_LATENCY_SAMPLING:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+//
+// Counters kept by the filter.  New counters are only ever added at the end,
+// so a tool built against an older copy of this file keeps working (it just
+// doesn't see the new counters).
+//
+typedef enum _GENFILTER_STAT_COUNTER {
+    GenFilterStatReadRequests = 0,
+    GenFilterStatWriteRequests,
+    GenFilterStatDeviceControlRequests,
+    GenFilterStatBytesRead,
+    GenFilterStatBytesWritten,
+    GenFilterStatFailures,
+    GenFilterStatCacheHits,             // Reads completed from the cache
+    GenFilterStatCacheMisses,           // Cacheable reads sent to the device
+    GenFilterStatCacheInvalidations,    // Media changes seen
+    GenFilterStatReadAheads,            // Read-aheads sent
+    GenFilterStatReadAheadBytes,        // Bytes read ahead into the cache
+    GenFilterStatCoalesced,             // IOCTLs that shared another's result
+    GenFilterStatQueryCacheHits,        // Query IOCTLs completed from cache
+    GenFilterStatQueryCacheMisses,      // Cacheable query IOCTLs sent down
+    GenFilterStatSampledCompletions,    // Requests timed for the histograms
+    GenFilterStatSampledFailures,       // ...of which completed with an error
+    GenFilterStatScheduled,             // Reads and writes held for the scheduler
+    GenFilterStatGatheredWrites,        // Gathered writes sent
+    GenFilterStatGatheredRequests,      // ...and the original writes they carried
+    GenFilterStatInspectedBytes,        // Bytes scanned for signatures
+    GenFilterStatSignatureMatches,      // Buffers a signature was found in
+    GenFilterStatSignatureBlocks,       // ...of which were failed because of it
+    GenFilterStatIntegritySectors,      // Sectors read and checksummed
+    GenFilterStatIntegrityMismatches,   // ...that returned different data than before
+    GenFilterStatIntegrityEvictions,    // Checksums dropped to make room
+    GenFilterStatConfigPublished,       // Configurations set by IOCTL
+    GenFilterStatConfigReclaimed,       // ...replaced ones freed
+    GenFilterStatLimitDelayed,          // Requests held back by the I/O limits
+    GenFilterStatLimitFailed,           // ...and failed by them
+    GenFilterStatRetryAttempts,         // Failed Requests sent down again
+    GenFilterStatRetrySucceeded,        // Requests that succeeded on a retry
+    GenFilterStatRetryExhausted,        // ...that were still failing after the last
+    GenFilterStatSplitRequests,         // Reads and writes sent down in chunks
+    GenFilterStatSplitChunks,           // ...and the chunks sent
+    GenFilterStatInspectWaits,          // Writes that waited for a copy to inspect
+    GenFilterStatIntegritySkips,        // Sectors read while being written, not checked
+
+    GenFilterStatCounterCount           // Must be last
+} GENFILTER_STAT_COUNTER;
+
+//
+// Merged (all processors) snapshot returned by IOCTL_GENFILTER_GET_STATISTICS
+//
+// Because the individual per-processor counters are read without any lock,
+// the snapshot is not an atomic "picture" of the filter: each counter is
+// exact, but two counters may have been sampled a few requests apart.
+//
+typedef struct _GENFILTER_STATISTICS {
+    ULONG     Size;                 // Bytes returned
+    ULONG     CounterCount;         // Valid entries in Counters
+    ULONG     ProcessorCount;       // Per-processor slots that were merged
+    ULONG     Reserved;
+    ULONGLONG Counters[GenFilterStatCounterCount];
+} GENFILTER_STATISTICS, *PGENFILTER_STATISTICS;
+
+//
+// The filter's preallocated element pools.  As with the counters, new pools
+// are only ever added at the end.
+//
+typedef enum _GENFILTER_POOL_ID {
+    GenFilterPoolReadAhead = 0,         // Read-ahead Requests and buffers
+    GenFilterPoolWriteGather,           // Gathered write Requests and buffers
+    GenFilterPoolDefer,                 // Deferred work items
+    GenFilterPoolSplit,                 // Chunk Requests and partial MDLs
+    GenFilterPoolInspect,               // Copies of inspected writes
+
+    GenFilterPoolCount                  // Must be last
+} GENFILTER_POOL_ID;
+
+typedef struct _GENFILTER_POOL_INFO {
+    ULONG     ElementSize;          // Bytes per element (descriptor)
+    ULONG     ElementCount;         // 0 if the pool isn't in use
+    ULONG     InUse;
+    ULONG     HighWater;            // Most elements ever out of the shared
+                                    //   free list at once
+    ULONGLONG Allocations;
+    ULONGLONG Exhausted;            // Allocations that found nothing free
+} GENFILTER_POOL_INFO, *PGENFILTER_POOL_INFO;
+
+//
+// Returned by IOCTL_GENFILTER_GET_POOLS.  As with GENFILTER_STATISTICS, the
+// counters are read without a lock, so the snapshot isn't atomic.
+//
+typedef struct _GENFILTER_POOLS {
+    ULONG               Size;           // Bytes returned
+    ULONG               PoolCount;      // Valid entries in Pools
+    ULONG               ProcessorCount; // Per-processor caches per pool
+    ULONG               Reserved;
+    GENFILTER_POOL_INFO Pools[GenFilterPoolCount];
+} GENFILTER_POOLS, *PGENFILTER_POOLS;
+
+//
+// What the filter does with completed Requests whose data it wants to look
+// at, set by the "DeferPolicy" value in the device's hardware key
+//
+typedef enum _GENFILTER_DEFER_POLICY {
+    GenFilterDeferOff = 0,              // Look at it in the completion callback
+    GenFilterDeferCompleteAfter,        // A worker looks at it, then completes it
+    GenFilterDeferCompleteBefore,       // Complete it; a worker looks at a copy
+
+    GenFilterDeferPolicyCount           // Must be last
+} GENFILTER_DEFER_POLICY;
+
+//
+// Returned by IOCTL_GENFILTER_GET_DEFER.  Read without a lock, so Queued,
+// Processed, and Depth may be a few items apart.
+//
+typedef struct _GENFILTER_DEFER_INFO {
+    ULONG     Size;                 // Bytes returned
+    ULONG     Policy;               // GENFILTER_DEFER_POLICY
+    ULONG     WorkerCount;
+    ULONG     Capacity;             // Items the queue holds
+    ULONG     Depth;                // Items waiting now
+    ULONG     HighWater;            // Most items ever waiting at once
+    ULONGLONG Queued;
+    ULONGLONG Processed;
+    ULONGLONG Dropped;              // Processed inline: no free item, or
+                                    //   the queue was full
+} GENFILTER_DEFER_INFO, *PGENFILTER_DEFER_INFO;
+
+//
+// What the filter does with a Request whose data contains one of its
+// signatures
+//
+typedef enum _GENFILTER_INSPECT_ACTION {
+    GenFilterInspectOff = 0,            // Nothing is scanned
+    GenFilterInspectFlag,               // Count and trace the match
+    GenFilterInspectBlock,              // ...and fail the Request
+
+    GenFilterInspectActionCount         // Must be last
+} GENFILTER_INSPECT_ACTION;
+
+//
+// What the filter does with a Request that's over one of its I/O limits
+//
+typedef enum _GENFILTER_LIMIT_ACTION {
+    GenFilterLimitDelay = 0,            // Hold it until it's within them
+    GenFilterLimitFail,                 // Fail it with STATUS_DEVICE_BUSY
+
+    GenFilterLimitActionCount           // Must be last
+} GENFILTER_LIMIT_ACTION;
+
+//
+// A pair of token bucket rates.  0 is no limit.
+//
+typedef struct _GENFILTER_RATE_LIMIT {
+    ULONG RequestsPerSecond;
+    ULONG BytesPerSecond;
+} GENFILTER_RATE_LIMIT, *PGENFILTER_RATE_LIMIT;
+
+//
+// The filter's I/O limits: one set for the whole device, and one set that
+// each requester gets to itself (requesters are told apart as the
+// "Attribution" value says, and by process if it's off).  A device or
+// requester that's been idle may send BurstMs worth of I/O at once before
+// its rates apply.  A delayed Request that would have to wait longer than
+// MaxDelayMs is failed instead.
+//
+#define GENFILTER_LIMITS_MAX_MS 60000
+
+typedef struct _GENFILTER_LIMITS {
+    GENFILTER_RATE_LIMIT Device;
+    GENFILTER_RATE_LIMIT Requester;
+    ULONG                BurstMs;       // Up to GENFILTER_LIMITS_MAX_MS
+    ULONG                Action;        // GENFILTER_LIMIT_ACTION
+    ULONG                MaxDelayMs;    // Up to GENFILTER_LIMITS_MAX_MS
+    ULONG                Reserved;
+} GENFILTER_LIMITS, *PGENFILTER_LIMITS;
+
+//
+// Splitting large transfers: a read or write longer than ChunkKB is sent
+// down as chunks of ChunkKB, at most Depth of them at a time, so that
+// smaller Requests don't wait behind all of it.  A ChunkKB of 0 turns
+// splitting off.
+//
+#define GENFILTER_SPLIT_MAX_CHUNK_KB    1024
+#define GENFILTER_SPLIT_MAX_DEPTH       8
+
+typedef struct _GENFILTER_SPLIT_SETTINGS {
+    ULONG ChunkKB;                  // Even (whole 2KB sectors), up to GENFILTER_SPLIT_MAX_CHUNK_KB
+    ULONG Depth;                    // 1 to GENFILTER_SPLIT_MAX_DEPTH
+} GENFILTER_SPLIT_SETTINGS, *PGENFILTER_SPLIT_SETTINGS;
+
+//
+// Input to IOCTL_GENFILTER_SET_CONFIG.  Fields says which settings to
+// replace; the others are left as they are.  Signatures past
+// SignatureCount are ignored.  An action other than GenFilterInspectOff
+// with no signatures turns inspection off.
+//
+#define GENFILTER_CONFIG_FIELD_INSPECT  0x00000001  // InspectAction and Signatures
+#define GENFILTER_CONFIG_FIELD_LIMITS   0x00000002  // Limits
+#define GENFILTER_CONFIG_FIELD_SPLIT    0x00000004  // Split
+#define GENFILTER_CONFIG_FIELD_ALL      0x00000007
+
+#define GENFILTER_CONFIG_MAX_SIGNATURES         16
+#define GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH   32
+
+typedef struct _GENFILTER_CONFIG_SIGNATURE {
+    ULONG Length;                   // 1 to GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH
+    UCHAR Bytes[GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH];
+} GENFILTER_CONFIG_SIGNATURE, *PGENFILTER_CONFIG_SIGNATURE;
+
+typedef struct _GENFILTER_CONFIGURATION {
+    ULONG                      Size;            // sizeof(GENFILTER_CONFIGURATION)
+    ULONG                      InspectAction;   // GENFILTER_INSPECT_ACTION
+    ULONG                      SignatureCount;
+    ULONG                      Fields;          // GENFILTER_CONFIG_FIELD_XXX
+    GENFILTER_CONFIG_SIGNATURE Signatures[GENFILTER_CONFIG_MAX_SIGNATURES];
+    GENFILTER_LIMITS           Limits;
+    GENFILTER_SPLIT_SETTINGS   Split;
+} GENFILTER_CONFIGURATION, *PGENFILTER_CONFIGURATION;
+
+//
+// Who the filter attributes each Request to, set by the "Attribution"
+// value in the device's hardware key
+//
+typedef enum _GENFILTER_ATTRIBUTION_MODE {
+    GenFilterAttributionOff = 0,
+    GenFilterAttributionProcess,        // The process that sent it
+    GenFilterAttributionFileObject,     // The file object it was sent on
+
+    GenFilterAttributionModeCount       // Must be last
+} GENFILTER_ATTRIBUTION_MODE;
+
+//
+// Requesters are ranked by the bytes they've moved plus this much per
+// Request, so that one flooding the device with small device controls is
+// found as well as one reading a lot (the cost is a CD sector)
+//
+#define GENFILTER_ATTRIBUTION_REQUEST_COST  2048
+
+#define GENFILTER_HEAVY_HITTERS_MAX         16
+
+//
+// Counts are estimates that may be too high, never too low: another
+// requester's I/O can be counted with this one's, by at most a fraction of
+// a percent of all the I/O counted.
+//
+typedef struct _GENFILTER_HEAVY_HITTER {
+    ULONGLONG Requester;            // Process ID, or file object handle
+    ULONGLONG Requests;
+    ULONGLONG Bytes;                // Read and written
+} GENFILTER_HEAVY_HITTER, *PGENFILTER_HEAVY_HITTER;
+
+//
+// Returned by IOCTL_GENFILTER_GET_HEAVY_HITTERS, heaviest first.  Read
+// without a lock, like GENFILTER_STATISTICS.
+//
+typedef struct _GENFILTER_HEAVY_HITTERS {
+    ULONG                  Size;            // Bytes returned
+    ULONG                  Mode;            // GENFILTER_ATTRIBUTION_MODE
+    ULONG                  HitterCount;     // Valid entries in Hitters
+    ULONG                  ProcessorCount;  // Per-processor sketches merged
+    ULONGLONG              TotalRequests;   // Everything counted (exact)
+    ULONGLONG              TotalBytes;
+    GENFILTER_HEAVY_HITTER Hitters[GENFILTER_HEAVY_HITTERS_MAX];
+} GENFILTER_HEAVY_HITTERS, *PGENFILTER_HEAVY_HITTERS;
+
+//
+// Events recorded in the binary trace log
+//
+typedef enum _GENFILTER_TRACE_EVENT {
+    GenFilterTraceRead = 1,             // Argument: Length
+    GenFilterTraceWrite,                // Argument: Length
+    GenFilterTraceDeviceControl,        // Argument: IoControlCode
+    GenFilterTraceIoctlOfInterest,      // Argument: IoControlCode (routed
+                                        //   with completion callback)
+    GenFilterTraceSendWithCallback,     // Argument: 0
+    GenFilterTraceSendFailed,           // Argument: 0
+    GenFilterTraceCompletion,           // Argument: IoStatus.Information
+    GenFilterTraceCacheHit,             // Argument: DeviceOffset
+    GenFilterTraceReadAhead,            // Argument: DeviceOffset
+    GenFilterTraceCoalesced,            // Argument: IoControlCode (parked
+                                        //   behind an identical Request)
+    GenFilterTraceQueryCacheHit,        // Argument: IoControlCode
+    GenFilterTraceWriteGather,          // Argument: DeviceOffset
+    GenFilterTraceSignatureMatch,       // Argument: DeviceOffset of the match
+    GenFilterTraceIntegrityMismatch,    // Argument: DeviceOffset of the sector
+
+    GenFilterTraceEventCount            // Must be last
+} GENFILTER_TRACE_EVENT;
+
+//
+// One trace record.  Timestamps are raw KeQueryPerformanceCounter values;
+// divide by GENFILTER_TRACE_HEADER.Frequency to get seconds.
+//
+typedef struct _GENFILTER_TRACE_RECORD {
+    ULONG     Sequence;             // Per-processor record number (+1)
+    USHORT    EventId;              // GENFILTER_TRACE_EVENT
+    USHORT    Processor;            // Trace ring that recorded the event
+    LONG      Status;               // NTSTATUS, where one applies
+    ULONG     Reserved;
+    ULONGLONG Timestamp;
+    ULONGLONG Request;              // WDFREQUEST handle value
+    ULONGLONG Argument;             // Depends on EventId
+} GENFILTER_TRACE_RECORD, *PGENFILTER_TRACE_RECORD;
+
+typedef struct _GENFILTER_TRACE_HEADER {
+    ULONG     Size;                 // sizeof(GENFILTER_TRACE_HEADER)
+    ULONG     RecordSize;           // sizeof(GENFILTER_TRACE_RECORD)
+    ULONG     RecordCount;          // Records following this header
+    ULONG     Reserved;
+    ULONGLONG Frequency;            // Timestamp ticks per second
+    ULONGLONG LostRecords;          // Overwritten before they were drained
+} GENFILTER_TRACE_HEADER, *PGENFILTER_TRACE_HEADER;
+
+//
+// I/O capture
+//
+// With capture on, the filter records one GENFILTER_CAPTURE_RECORD for
+// every read, write, and device control it's given, when it completes it.
+// Times are KeQueryPerformanceCounter ticks; divide by
+// GENFILTER_CAPTURE_HEADER.Frequency to get seconds.
+//
+typedef enum _GENFILTER_CAPTURE_TYPE {
+    GenFilterCaptureRead = 1,
+    GenFilterCaptureWrite,
+    GenFilterCaptureDeviceControl,
+} GENFILTER_CAPTURE_TYPE;
+
+//
+// What the routing table said to do with a device control (the same
+// values as the GENFILTER_ROUTE_FLAG_xxx it was routed by)
+//
+#define GENFILTER_CAPTURE_FLAG_INVALIDATE_CACHE 0x01
+#define GENFILTER_CAPTURE_FLAG_COALESCE         0x02
+#define GENFILTER_CAPTURE_FLAG_CACHE_RESULT     0x04
+#define GENFILTER_CAPTURE_FLAG_FLUSH_WRITES     0x08
+
+typedef struct _GENFILTER_CAPTURE_RECORD {
+    ULONG     Sequence;             // Per-processor record number (+1)
+    UCHAR     Type;                 // GENFILTER_CAPTURE_TYPE
+    UCHAR     Flags;                // GENFILTER_CAPTURE_FLAG_xxx
+    USHORT    Processor;            // Capture ring that recorded it
+    LONG      Status;               // NTSTATUS it was completed with
+    ULONG     IoControlCode;        // Device controls only
+    ULONGLONG Offset;               // Reads and writes only
+    ULONG     Length;               // Transfer length, or IOCTL output length
+    ULONG     InputLength;          // IOCTL input length
+    ULONGLONG IssueTime;            // When the filter was given it
+    ULONGLONG CompletionTime;       // When the filter completed it
+} GENFILTER_CAPTURE_RECORD, *PGENFILTER_CAPTURE_RECORD;
+
+typedef struct _GENFILTER_CAPTURE_HEADER {
+    ULONG     Size;                 // sizeof(GENFILTER_CAPTURE_HEADER)
+    ULONG     RecordSize;           // sizeof(GENFILTER_CAPTURE_RECORD)
+    ULONG     RecordCount;          // Records following this header
+    ULONG     Enabled;              // Non-zero if capture is on
+    ULONGLONG Frequency;            // Timestamp ticks per second
+    ULONGLONG LostRecords;          // Overwritten before they were drained
+} GENFILTER_CAPTURE_HEADER, *PGENFILTER_CAPTURE_HEADER;
+
+//
+// Latency histograms
+//
+// Latencies are measured in KeQueryPerformanceCounter ticks, from when the
+// filter first sees a Request to when it's completed, and kept in
+// log-bucketed ("HDR") histograms: values below 2^SubBucketBits each get a
+// bucket, and every power of two above that is split into 2^SubBucketBits
+// equal buckets.  So a bucket's width is never more than 1/8 of its value.
+// Values above MAXULONG ticks are counted in the last bucket.
+//
+// Only one Request in SampleInterval of each type is timed, so multiply a
+// class's counts by its SampleInterval to estimate the real totals.
+//
+#define GENFILTER_LATENCY_SUB_BUCKET_BITS   3
+#define GENFILTER_LATENCY_SUB_BUCKETS       (1UL << GENFILTER_LATENCY_SUB_BUCKET_BITS)
+#define GENFILTER_LATENCY_BUCKETS           ((32 - GENFILTER_LATENCY_SUB_BUCKET_BITS + 1) * \
+                                             GENFILTER_LATENCY_SUB_BUCKETS)
+
+//
+// The first few histogram classes are fixed.  DeviceControl is for IOCTLs
+// that aren't in the routing table; every route in the table gets a class
+// of its own after it, identified by GENFILTER_LATENCY_CLASS.IoControlCode.
+//
+typedef enum _GENFILTER_LATENCY_CLASS_ID {
+    GenFilterLatencyRead = 0,
+    GenFilterLatencyWrite,
+    GenFilterLatencyDeviceControl,
+
+    GenFilterLatencyFixedClassCount     // Must be last
+} GENFILTER_LATENCY_CLASS_ID;
+
+typedef struct _GENFILTER_LATENCY_CLASS {
+    ULONG     IoControlCode;        // 0 for the fixed classes
+    ULONG     SampleInterval;       // 1 in N timed; 0 if not timed at all
+    ULONGLONG Count;                // Sum of Buckets
+    ULONGLONG Buckets[GENFILTER_LATENCY_BUCKETS];
+} GENFILTER_LATENCY_CLASS, *PGENFILTER_LATENCY_CLASS;
+
+typedef struct _GENFILTER_LATENCY_HEADER {
+    ULONG     Size;                 // sizeof(GENFILTER_LATENCY_HEADER)
+    ULONG     ClassSize;            // sizeof(GENFILTER_LATENCY_CLASS)
+    ULONG     ClassCount;           // Classes following this header
+    ULONG     ProcessorCount;       // Per-processor slots that were merged
+    ULONGLONG Frequency;            // Ticks per second
+} GENFILTER_LATENCY_HEADER, *PGENFILTER_LATENCY_HEADER;
+
+//
+// One Request in SampleInterval[n] of each fixed class is timed: 1 times
+// every one, and 0 none.  Routed IOCTLs use the DeviceControl interval.
+// The histograms aren't reset when the intervals change, so read them
+// before and after a change, rather than across it.
+//
+typedef struct _GENFILTER_LATENCY_SAMPLING {
+    ULONG SampleInterval[GenFilterLatencyFixedClassCount];
+} GENFILTER_LATENCY_SAMPLING, *PGENFILTER_LATENCY_SAMPLING;
+
+//
+// GenFilterLatencyBucketLowest
+//
+// The smallest latency (in ticks) that's counted in Bucket
+//
+inline
+ULONGLONG
+GenFilterLatencyBucketLowest(ULONG Bucket)
+{
+    if (Bucket < GENFILTER_LATENCY_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    return (ULONGLONG)(GENFILTER_LATENCY_SUB_BUCKETS +
+                       (Bucket % GENFILTER_LATENCY_SUB_BUCKETS)) <<
+           ((Bucket / GENFILTER_LATENCY_SUB_BUCKETS) - 1);
+}
@@ -0,0 +1,574 @@
+///
+/// @file GenFilterLatency.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLatencyInitialize
+//
+//    Allocates a block of histograms for every possible processor: one for
+//    reads, one for writes, one for IOCTLs with no route, and one for
+//    each route in the IOCTL routing table.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE.  The histograms are parented to it.
+//
+//  OUTPUTS:
+//
+//      Latency - The histograms to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the memory could
+//                      not be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Timing a Request means we have to see it complete, so a Request
+//      we'd otherwise send-and-forget is sent with our completion callback
+//      if it's picked to be timed.  To keep that cheap we only time one
+//      Request in N of each type.  N comes from the "LatencySampleRead",
+//      "LatencySampleWrite" and "LatencySampleDeviceControl" DWORD values
+//      in the device's hardware key (GENFILTER_LATENCY_DEFAULT_SAMPLE_INTERVAL
+//      if absent).  1 times every Request; 0 turns timing off for that type.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterLatencyInitialize(WDFDEVICE          Device,
+                           PGENFILTER_LATENCY Latency)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    WDFKEY                key;
+    size_t                bucketsLength;
+    size_t                samplersLength;
+    size_t                length;
+    LARGE_INTEGER         frequency;
+
+    DECLARE_CONST_UNICODE_STRING(readValueName,   L"LatencySampleRead");
+    DECLARE_CONST_UNICODE_STRING(writeValueName,  L"LatencySampleWrite");
+    DECLARE_CONST_UNICODE_STRING(ioctlValueName,  L"LatencySampleDeviceControl");
+
+    PCUNICODE_STRING valueNames[GenFilterLatencyFixedClassCount] = {
+        &readValueName,
+        &writeValueName,
+        &ioctlValueName,
+    };
+
+    RtlZeroMemory(Latency,
+                  sizeof(GENFILTER_LATENCY));
+
+    for (ULONG fixedClass = 0;
+         fixedClass < GenFilterLatencyFixedClassCount;
+         fixedClass++) {
+
+        Latency->SampleInterval[fixedClass] = GENFILTER_LATENCY_DEFAULT_SAMPLE_INTERVAL;
+    }
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        for (ULONG fixedClass = 0;
+             fixedClass < GenFilterLatencyFixedClassCount;
+             fixedClass++) {
+
+            ULONG interval;
+
+            if (NT_SUCCESS(WdfRegistryQueryULong(key,
+                                                 valueNames[fixedClass],
+                                                 &interval))) {
+
+                Latency->SampleInterval[fixedClass] = interval;
+            }
+        }
+
+        WdfRegistryClose(key);
+    }
+
+    Latency->ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Latency->ClassCount     = GenFilterLatencyFixedClassCount + GenFilterRouteGetCount();
+
+    //
+    // Round each processor's block up to whole cache lines
+    //
+    Latency->CpuStride = ALIGN_UP_BY((size_t)Latency->ClassCount *
+                                     GENFILTER_LATENCY_BUCKETS * sizeof(LONG),
+                                     SYSTEM_CACHE_ALIGNMENT_SIZE) / sizeof(LONG);
+
+    //
+    // The samplers follow the histograms in the same allocation.  Both the
+    // histogram blocks and GENFILTER_LATENCY_SAMPLER are whole cache lines,
+    // so the samplers stay aligned.
+    //
+    bucketsLength  = Latency->ProcessorCount * Latency->CpuStride * sizeof(LONG);
+    samplersLength = Latency->ProcessorCount * sizeof(GENFILTER_LATENCY_SAMPLER);
+
+    length = bucketsLength + samplersLength + SYSTEM_CACHE_ALIGNMENT_SIZE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'lFnG',
+                             length,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for latency histograms failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  length);
+
+    Latency->Buckets  = (volatile LONG*)ALIGN_UP_BY(buffer,
+                                                    SYSTEM_CACHE_ALIGNMENT_SIZE);
+    Latency->Samplers = (PGENFILTER_LATENCY_SAMPLER)((PUCHAR)Latency->Buckets +
+                                                     bucketsLength);
+
+    //
+    // Start every countdown at 1 so the first Request of each type is timed
+    //
+    for (ULONG cpu = 0; cpu < Latency->ProcessorCount; cpu++) {
+
+        for (ULONG fixedClass = 0;
+             fixedClass < GenFilterLatencyFixedClassCount;
+             fixedClass++) {
+
+            Latency->Samplers[cpu].Countdown[fixedClass] = 1;
+        }
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Latency->Frequency = (ULONGLONG)frequency.QuadPart;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+//
+// GenFilterLatencyIoctlClass
+//
+// The histogram class for an IOCTL with this route
+//
+_Use_decl_annotations_
+ULONG
+GenFilterLatencyIoctlClass(PCGENFILTER_ROUTE Route)
+{
+    ULONG index = GenFilterRouteGetIndex(Route);
+
+    if (index >= GenFilterRouteGetCount()) {
+        return GenFilterLatencyDeviceControl;
+    }
+
+    return GenFilterLatencyFixedClassCount + index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLatencyStart
+//
+//    Decides whether to time a Request and, if so, notes the time we first
+//    saw it.  Called on entry to our EvtIo callbacks.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Request     - The Request
+//
+//      Class       - The histogram to count it in when it completes
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The decision is made here, for every Request, before we know how
+//      it'll be handled.  So the sample includes cache hits, coalesced
+//      IOCTLs and failures in proportion to how often they really happen.
+//
+//      LatencyStart stays zero for a Request that isn't sampled.  That's how
+//      GenFilterForward knows it can send-and-forget it.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterLatencyStart(PGENFILTER_DEVICE_CONTEXT DevContext,
+                      WDFREQUEST                Request,
+                      ULONG                     Class)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    ULONG                      fixedClass;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->LatencyClass = Class;
+    reqContext->LatencyStart = 0;
+
+    fixedClass = (Class < GenFilterLatencyFixedClassCount) ?
+                     Class : (ULONG)GenFilterLatencyDeviceControl;
+
+    if (GenFilterLatencySample(&DevContext->Latency,
+                               fixedClass)) {
+        reqContext->LatencyStart = KeQueryPerformanceCounter(nullptr).QuadPart;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLatencyStop
+//
+//    Counts the time since GenFilterLatencyStart in the Request's histogram.
+//    Called by the statistics policy just before we complete a Request,
+//    wherever that happens (see GenFilterCompleting).
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Request     - The Request that's about to be completed
+//
+//      Status      - The status it's being completed with
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Requests that were never started (or weren't picked to be sampled)
+//      aren't counted.  Failed samples are timed like any other, but also
+//      counted in GenFilterStatSampledFailures so the histogram can be read
+//      in context.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterLatencyStop(PGENFILTER_DEVICE_CONTEXT DevContext,
+                     WDFREQUEST                Request,
+                     NTSTATUS                  Status)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    LONGLONG                   now;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (reqContext->LatencyStart == 0) {
+        return;
+    }
+
+    now = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    GenFilterLatencyRecord(&DevContext->Latency,
+                           reqContext->LatencyClass,
+                           (ULONGLONG)(now - reqContext->LatencyStart));
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatSampledCompletions);
+
+    if (!NT_SUCCESS(Status)) {
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatSampledFailures);
+    }
+
+    reqContext->LatencyStart = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLatencyQuery
+//
+//    Handles IOCTL_GENFILTER_GET_LATENCY by merging the per-processor
+//    histograms into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_GET_LATENCY Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      hold a GENFILTER_LATENCY_HEADER.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      As many classes as fit are returned.  Like the statistics, the
+//      histograms are read without any lock, so a snapshot may be a few
+//      Requests out of step between buckets.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterLatencyQuery(WDFREQUEST                Request,
+                      PGENFILTER_DEVICE_CONTEXT DevContext,
+                      PULONG_PTR                Information)
+{
+    NTSTATUS                  status;
+    PGENFILTER_LATENCY        latency;
+    PGENFILTER_LATENCY_HEADER header;
+    PGENFILTER_LATENCY_CLASS  classes;
+    size_t                    bufferLength;
+    ULONG                     classCount;
+
+    *Information = 0;
+    latency      = &DevContext->Latency;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(GENFILTER_LATENCY_HEADER),
+                                            (PVOID*)&header,
+                                            &bufferLength);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    classCount = (ULONG)((bufferLength - sizeof(GENFILTER_LATENCY_HEADER)) /
+                         sizeof(GENFILTER_LATENCY_CLASS));
+
+    if (classCount > latency->ClassCount) {
+        classCount = latency->ClassCount;
+    }
+
+    classes = (PGENFILTER_LATENCY_CLASS)(header + 1);
+
+    RtlZeroMemory(classes,
+                  classCount * sizeof(GENFILTER_LATENCY_CLASS));
+
+    for (ULONG classIndex = 0; classIndex < classCount; classIndex++) {
+
+        PGENFILTER_LATENCY_CLASS latencyClass = &classes[classIndex];
+
+        if (classIndex >= GenFilterLatencyFixedClassCount) {
+            latencyClass->IoControlCode =
+                GenFilterRouteGetByIndex(classIndex - GenFilterLatencyFixedClassCount)->IoControlCode;
+            latencyClass->SampleInterval =
+                latency->SampleInterval[GenFilterLatencyDeviceControl];
+        } else {
+            latencyClass->SampleInterval = latency->SampleInterval[classIndex];
+        }
+
+        for (ULONG cpu = 0; cpu < latency->ProcessorCount; cpu++) {
+
+            const volatile LONG* buckets;
+
+            buckets = &latency->Buckets[(cpu * latency->CpuStride) +
+                                        ((size_t)classIndex * GENFILTER_LATENCY_BUCKETS)];
+
+            for (ULONG bucket = 0; bucket < GENFILTER_LATENCY_BUCKETS; bucket++) {
+
+                ULONG count = (ULONG)ReadNoFence(&buckets[bucket]);
+
+                latencyClass->Buckets[bucket] += count;
+                latencyClass->Count           += count;
+            }
+        }
+    }
+
+    header->Size           = sizeof(GENFILTER_LATENCY_HEADER);
+    header->ClassSize      = sizeof(GENFILTER_LATENCY_CLASS);
+    header->ClassCount     = classCount;
+    header->ProcessorCount = latency->ProcessorCount;
+    header->Frequency      = latency->Frequency;
+
+    *Information = sizeof(GENFILTER_LATENCY_HEADER) +
+                   ((ULONG_PTR)classCount * sizeof(GENFILTER_LATENCY_CLASS));
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLatencySetSampling
+//
+//    Handles IOCTL_GENFILTER_SET_LATENCY_SAMPLING by replacing the sampling
+//    interval of each fixed class.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_SET_LATENCY_SAMPLING Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - sizeof(GENFILTER_LATENCY_SAMPLING) if the previous
+//                    intervals were returned, otherwise 0
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the input buffer cannot
+//      hold a GENFILTER_LATENCY_SAMPLING, or STATUS_INVALID_DEVICE_STATE if
+//      the statistics policy is compiled out, and so nothing is timed.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Each processor's countdowns start again at 1, as they do when the
+//      device starts, so that a long interval being replaced by a short one
+//      takes effect straight away.  Those are plain stores racing the
+//      processors' own, which (as in GenFilterLatencySample) at worst means
+//      one Request more or less is timed.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterLatencySetSampling(WDFREQUEST                Request,
+                            PGENFILTER_DEVICE_CONTEXT DevContext,
+                            PULONG_PTR                Information)
+{
+    NTSTATUS                    status;
+    PGENFILTER_LATENCY          latency;
+    PGENFILTER_LATENCY_SAMPLING input;
+    PGENFILTER_LATENCY_SAMPLING output;
+    GENFILTER_LATENCY_SAMPLING  previous;
+    GENFILTER_LATENCY_SAMPLING  sampling;
+
+    *Information = 0;
+    latency      = &DevContext->Latency;
+
+    if (latency->Samplers == nullptr) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(GENFILTER_LATENCY_SAMPLING),
+                                           (PVOID*)&input,
+                                           nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // METHOD_BUFFERED: the input and output share a buffer, so capture the
+    // input before we write anything
+    //
+    sampling = *input;
+
+    for (ULONG fixedClass = 0;
+         fixedClass < GenFilterLatencyFixedClassCount;
+         fixedClass++) {
+
+        previous.SampleInterval[fixedClass] =
+            (ULONG)InterlockedExchange((volatile LONG*)&latency->SampleInterval[fixedClass],
+                                       (LONG)sampling.SampleInterval[fixedClass]);
+
+        for (ULONG cpu = 0; cpu < latency->ProcessorCount; cpu++) {
+            latency->Samplers[cpu].Countdown[fixedClass] = 1;
+        }
+    }
+
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                  sizeof(GENFILTER_LATENCY_SAMPLING),
+                                                  (PVOID*)&output,
+                                                  nullptr))) {
+        *output      = previous;
+        *Information = sizeof(GENFILTER_LATENCY_SAMPLING);
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
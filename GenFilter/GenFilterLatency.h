@@ -0,0 +1,211 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterLatency.h
+//
+//    ABSTRACT:
+//
+//      Per-processor latency histograms.  Every Request we forward is timed from
+//      when we first see it to when it's completed, and the time is counted in a
+//      log-bucketed histogram for its type (read, write, or IOCTL route).
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterIoctl.h"
+#include "GenFilterRoute.h"
+
+//
+// By default we time one Request in this many of each type
+//
+#define GENFILTER_LATENCY_DEFAULT_SAMPLE_INTERVAL   16
+
+//
+// One processor's sampling countdowns, one per fixed class.  Cache aligned
+// for the same reason the statistics are.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_LATENCY_SAMPLER {
+    LONG Countdown[GenFilterLatencyFixedClassCount];
+} GENFILTER_LATENCY_SAMPLER, *PGENFILTER_LATENCY_SAMPLER;
+
+//
+// The per-device histograms that live in our device context
+//
+// Buckets holds ProcessorCount blocks (each starting on a cache line) of
+// ClassCount histograms of GENFILTER_LATENCY_BUCKETS counters.  Each
+// processor only ever updates its own block.
+//
+// SampleInterval is indexed by fixed class; routed IOCTLs use the
+// DeviceControl interval.  Zero means that type isn't timed at all.  It's
+// read from the registry at start up, and can be replaced at any time by
+// IOCTL_GENFILTER_SET_LATENCY_SAMPLING.
+//
+typedef struct _GENFILTER_LATENCY {
+    ULONG                      SampleInterval[GenFilterLatencyFixedClassCount];
+    ULONG                      ProcessorCount;
+    ULONG                      ClassCount;
+    size_t                     CpuStride;   // Counters per processor block
+    volatile LONG*             Buckets;
+    PGENFILTER_LATENCY_SAMPLER Samplers;    // ProcessorCount of them
+    ULONGLONG                  Frequency;
+} GENFILTER_LATENCY, *PGENFILTER_LATENCY;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterLatencyInitialize(_In_ WDFDEVICE Device, _Out_ PGENFILTER_LATENCY Latency);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+GenFilterLatencyIoctlClass(_In_ PCGENFILTER_ROUTE Route);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterLatencyStart(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ WDFREQUEST Request,
+                      _In_ ULONG Class);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterLatencyStop(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                     _In_ WDFREQUEST Request,
+                     _In_ NTSTATUS Status);
+
+//
+// GenFilterLatencyBucketOf
+//
+// The histogram bucket a latency of Ticks is counted in.  The inverse of
+// GenFilterLatencyBucketLowest.
+//
+FORCEINLINE
+ULONG
+GenFilterLatencyBucketOf(_In_ ULONG Ticks)
+{
+    ULONG highBit;
+
+    if (Ticks < GENFILTER_LATENCY_SUB_BUCKETS) {
+        return Ticks;
+    }
+
+    BitScanReverse(&highBit,
+                   Ticks);
+
+    return ((highBit - GENFILTER_LATENCY_SUB_BUCKET_BITS + 1) *
+            GENFILTER_LATENCY_SUB_BUCKETS) +
+           ((Ticks >> (highBit - GENFILTER_LATENCY_SUB_BUCKET_BITS)) -
+            GENFILTER_LATENCY_SUB_BUCKETS);
+}
+
+//
+// GenFilterLatencySample
+//
+// Decides whether to time a Request of the given fixed class: returns TRUE
+// for one call in every SampleInterval.
+//
+// Each processor counts down its own copy of the counter, so this is a
+// plain decrement of a line the processor already owns -- no interlocked
+// operation and no division.  If we migrate between reading and writing the
+// countdown, or race another thread on the same processor at PASSIVE_LEVEL,
+// the worst that happens is one Request more or less gets sampled, which
+// doesn't matter for an estimate.
+//
+FORCEINLINE
+BOOLEAN
+GenFilterLatencySample(_In_ PGENFILTER_LATENCY Latency,
+                       _In_ ULONG              FixedClass)
+{
+    ULONG interval = Latency->SampleInterval[FixedClass];
+    ULONG cpu;
+    LONG* countdown;
+
+    if (interval <= 1) {
+        return (interval == 1);
+    }
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    if (cpu >= Latency->ProcessorCount) {
+        cpu %= Latency->ProcessorCount;
+    }
+
+    countdown = &Latency->Samplers[cpu].Countdown[FixedClass];
+
+    if (--(*countdown) > 0) {
+        return FALSE;
+    }
+
+    *countdown = (LONG)interval;
+
+    return TRUE;
+}
+
+//
+// GenFilterLatencyRecord
+//
+// Counts one latency in the calling processor's histogram for Class.
+//
+// This is a single interlocked increment of a counter that (almost always)
+// lives in a cache line owned by the current processor, so it's wait-free
+// and doesn't add contention to the very path it's measuring.  As with the
+// statistics, it's interlocked only because at PASSIVE_LEVEL we can migrate
+// between picking our block and updating it.
+//
+FORCEINLINE
+VOID
+GenFilterLatencyRecord(_In_ PGENFILTER_LATENCY Latency,
+                       _In_ ULONG              Class,
+                       _In_ ULONGLONG          Ticks)
+{
+    ULONG cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    if (cpu >= Latency->ProcessorCount) {
+        cpu %= Latency->ProcessorCount;
+    }
+
+    if (Ticks > MAXULONG) {
+        Ticks = MAXULONG;
+    }
+
+    InterlockedIncrementNoFence(&Latency->Buckets[(cpu * Latency->CpuStride) +
+                                                  ((size_t)Class * GENFILTER_LATENCY_BUCKETS) +
+                                                  GenFilterLatencyBucketOf((ULONG)Ticks)]);
+}
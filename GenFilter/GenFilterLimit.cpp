@@ -0,0 +1,486 @@
+///
+/// @file GenFilterLimit.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+VOID
+GenFilterLimitArm(_In_ PGENFILTER_LIMIT Limit,
+                  _In_ LONGLONG Release,
+                  _In_ LONGLONG Now);
+
+static
+VOID
+GenFilterLimitRelease(_In_ WDFREQUEST Request,
+                      _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+EVT_WDF_TIMER GenFilterLimitEvtTimer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLimitInitialize
+//
+//    Allocates the device's token buckets and creates the Queue that holds
+//    Requests back, and the timer that lets them go.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the limits could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The configuration MUST already be initialized: whether we start out
+//      limiting anything is up to its first snapshot.  Everything is
+//      allocated whether we do or not, since limits can be set later with
+//      IOCTL_GENFILTER_SET_CONFIG.  The buckets are about 64KB.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterLimitInitialize(WDFDEVICE                 Device,
+                         PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_IO_QUEUE_CONFIG   ioQueueConfig;
+    WDF_TIMER_CONFIG      timerConfig;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    PGENFILTER_BUCKET     buckets;
+    PGENFILTER_LIMIT      limit;
+    size_t                bucketsLength;
+
+    limit = &DevContext->Limit;
+
+    RtlZeroMemory(limit,
+                  sizeof(GENFILTER_LIMIT));
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &limit->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for limits failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // We do our own locking, so the timer doesn't need the Framework's
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig,
+                          GenFilterLimitEvtTimer);
+
+    timerConfig.AutomaticSerialization = FALSE;
+
+    status = WdfTimerCreate(&timerConfig,
+                            &objectAttr,
+                            &limit->Timer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfTimerCreate for limits failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // Held Requests wait in a manual Queue, so that if one is cancelled the
+    // Framework takes it out and completes it for us
+    //
+    WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig,
+                             WdfIoQueueDispatchManual);
+
+    status = WdfIoQueueCreate(Device,
+                              &ioQueueConfig,
+                              WDF_NO_OBJECT_ATTRIBUTES,
+                              &limit->Held);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfIoQueueCreate for limits failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // The device's buckets, then the requesters', each in a cache line of
+    // its own
+    //
+    bucketsLength = (1 + GENFILTER_BUCKET_REQUESTERS) * sizeof(GENFILTER_BUCKET);
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'bFnG',
+                             bucketsLength + SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for limits failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    buckets = (PGENFILTER_BUCKET)ALIGN_UP_BY(buffer,
+                                             SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    RtlZeroMemory(buckets,
+                  bucketsLength);
+
+    limit->Device     = &buckets[0];
+    limit->Requesters = &buckets[1];
+
+    //
+    // Nothing publishes a snapshot until we've been added
+    //
+    limit->Limited = ((PCGENFILTER_CONFIG_SNAPSHOT)DevContext->Config.Rcu.Current)->Buckets.Limited;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterLimitRequest
+//
+//    Takes a Request we've just been given from the device's token buckets
+//    and its requester's.  If it's over the limits, either holds it until
+//    it's within them or fails it, as the configuration says.
+//
+//  INPUTS:
+//
+//      Request     - The read, write or device control Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Length      - The bytes it reads or writes (0 for a device control)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if we took the Request (the caller must not touch it again), or
+//      FALSE if it's within the limits and the caller should carry on.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A held Request is handed back to the Queue it came from when it's
+//      due, and so is presented to us again, from the start.  We let it
+//      straight through the second time.
+//
+//      Taking from a bucket is a compare-exchange (see GenFilterBucket.h),
+//      so Requests on different processors never wait for each other here.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterLimitRequest(WDFREQUEST                Request,
+                      PGENFILTER_DEVICE_CONTEXT DevContext,
+                      size_t                    Length)
+{
+    PGENFILTER_REQUEST_CONTEXT  reqContext;
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    PGENFILTER_LIMIT            limit;
+    NTSTATUS                    status;
+    ULONG                       phase;
+    BOOLEAN                     admitted = TRUE;
+    LONG64                      delay    = 0;
+    LONGLONG                    now;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (reqContext->LimitReleased) {
+        reqContext->LimitReleased = FALSE;
+        return FALSE;
+    }
+
+    limit = &DevContext->Limit;
+    now   = (LONGLONG)KeQueryInterruptTime();
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    if (snapshot->Buckets.Limited) {
+
+        admitted = GenFilterBucketAdmit(&snapshot->Buckets,
+                                        limit->Device,
+                                        GenFilterBucketFind(limit->Requesters,
+                                                            GenFilterAttributionRequester(&DevContext->Attribution,
+                                                                                          Request)),
+                                        now,
+                                        Length < MAXULONG ? (ULONG)Length : MAXULONG,
+                                        &delay) ? TRUE : FALSE;
+    }
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+
+    if (!admitted) {
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatLimitFailed);
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            STATUS_DEVICE_BUSY);
+
+        WdfRequestComplete(Request,
+                           STATUS_DEVICE_BUSY);
+        return TRUE;
+    }
+
+    if (delay == 0) {
+        return FALSE;
+    }
+
+    reqContext->LimitRelease = now + delay;
+    reqContext->LimitQueue   = WdfRequestGetIoQueue(Request);
+
+    status = WdfRequestForwardToIoQueue(Request,
+                                        limit->Held);
+
+    //
+    // If we can't hold it, we'd rather exceed the limits than lose it
+    //
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatLimitDelayed);
+
+    GenFilterLimitArm(limit,
+                      reqContext->LimitRelease,
+                      now);
+
+    return TRUE;
+}
+
+//
+// GenFilterLimitEvtTimer
+//
+// Hands back every held Request that's now due to the Queue it came from,
+// and sets the timer again for the next one
+//
+_Use_decl_annotations_
+VOID
+GenFilterLimitEvtTimer(WDFTIMER Timer)
+{
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    PGENFILTER_LIMIT          limit;
+    WDFREQUEST                previous = nullptr;
+    WDFREQUEST                found;
+    WDFREQUEST                request;
+    NTSTATUS                  status;
+    LONGLONG                  now;
+    LONGLONG                  next     = 0;
+
+    devContext = GenFilterGetDeviceContext(WdfTimerGetParentObject(Timer));
+    limit      = &devContext->Limit;
+
+    WdfSpinLockAcquire(limit->Lock);
+
+    limit->NextRelease = 0;
+
+    WdfSpinLockRelease(limit->Lock);
+
+    now = (LONGLONG)KeQueryInterruptTime();
+
+    //
+    // Released times aren't in Queue order (each requester has buckets of
+    // its own), so we look at every Request, once.  Finding one gives us a
+    // reference to it.  We hold on to the last one that isn't due yet, and
+    // look for the next after it, so taking a Request out doesn't send us
+    // back to the top.  Only if the one we're holding on to has gone
+    // (cancelled) do we start again.
+    //
+    for (;;) {
+
+        status = WdfIoQueueFindRequest(limit->Held,
+                                       previous,
+                                       nullptr,
+                                       nullptr,
+                                       &found);
+
+        if (status == STATUS_NOT_FOUND) {
+
+            WdfObjectDereference(previous);
+
+            previous = nullptr;
+            next     = 0;
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        if (GenFilterGetRequestContext(found)->LimitRelease > now) {
+
+            if (next == 0 ||
+                GenFilterGetRequestContext(found)->LimitRelease < next) {
+                next = GenFilterGetRequestContext(found)->LimitRelease;
+            }
+
+            if (previous != nullptr) {
+                WdfObjectDereference(previous);
+            }
+
+            previous = found;
+            continue;
+        }
+
+        status = WdfIoQueueRetrieveFoundRequest(limit->Held,
+                                                found,
+                                                &request);
+
+        WdfObjectDereference(found);
+
+        if (NT_SUCCESS(status)) {
+
+            GenFilterLimitRelease(request,
+                                  devContext);
+        }
+    }
+
+    if (previous != nullptr) {
+        WdfObjectDereference(previous);
+    }
+
+    if (next != 0) {
+
+        GenFilterLimitArm(limit,
+                          next,
+                          now);
+    }
+}
+
+//
+// GenFilterLimitArm
+//
+// Makes sure the timer fires no later than Release
+//
+static
+VOID
+GenFilterLimitArm(PGENFILTER_LIMIT Limit,
+                  LONGLONG         Release,
+                  LONGLONG         Now)
+{
+    WdfSpinLockAcquire(Limit->Lock);
+
+    if (Limit->NextRelease == 0 ||
+        Release < Limit->NextRelease) {
+
+        Limit->NextRelease = Release;
+
+        //
+        // Relative, in the same 100ns units as interrupt time
+        //
+        WdfTimerStart(Limit->Timer,
+                      -(Release > Now ? Release - Now : 1));
+    }
+
+    WdfSpinLockRelease(Limit->Lock);
+}
+
+//
+// GenFilterLimitRelease
+//
+// Hands a held Request back to the Queue it came from.  If the Queue won't
+// take it (the device is going away, say), fails it.
+//
+static
+VOID
+GenFilterLimitRelease(WDFREQUEST                Request,
+                      PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    NTSTATUS                   status;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->LimitReleased = TRUE;
+
+    status = WdfRequestForwardToIoQueue(Request,
+                                        reqContext->LimitQueue);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            status);
+
+        WdfRequestComplete(Request,
+                           status);
+    }
+}
@@ -0,0 +1,125 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterLimit.h
+//
+//    ABSTRACT:
+//
+//      Token bucket limits on the Requests and bytes per second the filter
+//      passes on, for the whole device and for each requester.  A Request
+//      that's over them is held in a manual Queue until it's within them,
+//      or failed, as the configuration says.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterBucket.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// The buckets run on interrupt time, which is cheap to read (it's in
+// shared memory, not a call into the HAL) but only moves on at each clock
+// tick.  That's fine for a rate, and bursts shorter than a tick are
+// simply rounded up to one.
+//
+#define GENFILTER_LIMIT_TICKS_PER_SECOND    10000000
+
+//
+// Defaults for the settings in the device's hardware key (see
+// GenFilterConfigInitialize).  By default nothing is limited.
+//
+#define GENFILTER_LIMIT_DEFAULT_BURST_MS        100
+#define GENFILTER_LIMIT_DEFAULT_MAX_DELAY_MS    2000
+
+//
+// The per-device limit state that lives in our device context.  The
+// limits themselves are part of the configuration (see
+// GENFILTER_CONFIG_SNAPSHOT); Limited says whether the current one has
+// any, so that when it doesn't, Requests don't have to look.
+//
+typedef struct _GENFILTER_LIMIT {
+    volatile LONG     Limited;
+
+    //
+    // The device's buckets, and GENFILTER_BUCKET_REQUESTERS buckets shared
+    // among the requesters
+    //
+    PGENFILTER_BUCKET Device;
+    PGENFILTER_BUCKET Requesters;
+
+    //
+    // Requests that are waiting to be within the limits, and the timer that
+    // lets them go.  NextRelease (protected by Lock) is when the timer will
+    // next fire, or 0 if it isn't set.
+    //
+    WDFQUEUE          Held;
+    WDFTIMER          Timer;
+    WDFSPINLOCK       Lock;
+    LONGLONG          NextRelease;
+} GENFILTER_LIMIT, *PGENFILTER_LIMIT;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterLimitInitialize(_In_ WDFDEVICE Device,
+                         _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterLimitRequest(_In_ WDFREQUEST Request,
+                      _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ size_t Length);
+
+//
+// GenFilterLimitIsOn
+//
+// Whether Requests need to be checked against the limits at all.  Read
+// without a lock: a Request that races with the configuration changing
+// may be checked, or not, either way.
+//
+FORCEINLINE
+BOOLEAN
+GenFilterLimitIsOn(_In_ PGENFILTER_LIMIT Limit)
+{
+    return Limit->Limited != 0;
+}
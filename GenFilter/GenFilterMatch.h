@@ -0,0 +1,435 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterMatch.h
+//
+//    ABSTRACT:
+//
+//      Multi-pattern byte signature matching.  Finds any of a small set of byte
+//      signatures in a buffer, using SSE2 or AVX2 when the processor has them
+//      and a scalar loop when it doesn't.  Like GenFilterSlab.h, it depends on
+//      nothing in WDF, so GenFilterCtl can benchmark the same code the driver
+//      runs.  Include it after <wdm.h> in the driver, or after <windows.h> in
+//      user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#define GENFILTER_MATCH_SIMD 1
+#endif
+
+//
+// A kernel that uses instructions the rest of the driver doesn't names
+// them, so that GCC and Clang (which, unlike MSVC, won't otherwise emit
+// them) build just that function for them.  Nothing else is built for
+// them, so nothing else runs them on a processor that doesn't have them.
+//
+#if defined(__GNUC__)
+#define GENFILTER_MATCH_TARGET(_isa) __attribute__((target(_isa)))
+#else
+#define GENFILTER_MATCH_TARGET(_isa)
+#endif
+
+//
+// Limits on the signatures one matcher holds
+//
+constexpr ULONG GENFILTER_MATCH_MAX_PATTERNS = 16;
+constexpr ULONG GENFILTER_MATCH_MAX_LENGTH   = 32;
+
+//
+// Returned by GenFilterMatchFind when nothing matched
+//
+constexpr size_t GENFILTER_MATCH_NONE = (size_t)-1;
+
+//
+// The ways we know how to scan a buffer.  GenFilterMatchBestKernel says
+// which of them this processor can run.
+//
+typedef enum _GENFILTER_MATCH_KERNEL {
+    GenFilterMatchScalar = 0,
+    GenFilterMatchSse2,
+    GenFilterMatchAvx2,
+
+    GenFilterMatchKernelCount           // Must be last
+} GENFILTER_MATCH_KERNEL;
+
+typedef struct _GENFILTER_MATCH_PATTERN {
+    ULONG Length;
+    UCHAR Bytes[GENFILTER_MATCH_MAX_LENGTH];
+} GENFILTER_MATCH_PATTERN, *PGENFILTER_MATCH_PATTERN;
+
+typedef struct _GENFILTER_MATCH {
+    ULONG                   PatternCount;
+    GENFILTER_MATCH_PATTERN Patterns[GENFILTER_MATCH_MAX_PATTERNS];
+} GENFILTER_MATCH, *PGENFILTER_MATCH;
+
+typedef const GENFILTER_MATCH* PCGENFILTER_MATCH;
+
+//
+// GenFilterMatchInitialize
+//
+inline
+void
+GenFilterMatchInitialize(PGENFILTER_MATCH Match)
+{
+    Match->PatternCount = 0;
+}
+
+//
+// GenFilterMatchAddPattern
+//
+// Returns false if the pattern is empty or too long, or the matcher is
+// full
+//
+inline
+bool
+GenFilterMatchAddPattern(PGENFILTER_MATCH Match,
+                         const UCHAR*     Bytes,
+                         ULONG            Length)
+{
+    PGENFILTER_MATCH_PATTERN pattern;
+
+    if (Length == 0 ||
+        Length > GENFILTER_MATCH_MAX_LENGTH ||
+        Match->PatternCount == GENFILTER_MATCH_MAX_PATTERNS) {
+        return false;
+    }
+
+    pattern = &Match->Patterns[Match->PatternCount++];
+
+    pattern->Length = Length;
+
+    for (ULONG index = 0; index < Length; index++) {
+        pattern->Bytes[index] = Bytes[index];
+    }
+
+    return true;
+}
+
+//
+// GenFilterMatchBestKernel
+//
+// The fastest kernel this processor (and, for AVX2, the OS) supports
+//
+inline
+GENFILTER_MATCH_TARGET("xsave")
+GENFILTER_MATCH_KERNEL
+GenFilterMatchBestKernel()
+{
+#ifdef GENFILTER_MATCH_SIMD
+    int info[4];
+
+    __cpuid(info,
+            0);
+
+    if (info[0] >= 7) {
+
+        __cpuid(info,
+                1);
+
+        //
+        // The processor has AVX, and the OS saves the YMM registers
+        // (XCR0 bits 1 and 2) on a context switch
+        //
+        if ((info[2] & (1 << 27)) != 0 &&
+            (info[2] & (1 << 28)) != 0 &&
+            (_xgetbv(0) & 6) == 6) {
+
+            __cpuidex(info,
+                      7,
+                      0);
+
+            if ((info[1] & (1 << 5)) != 0) {
+                return GenFilterMatchAvx2;
+            }
+        }
+    }
+
+    __cpuid(info,
+            1);
+
+    if ((info[3] & (1 << 26)) != 0) {
+        return GenFilterMatchSse2;
+    }
+#endif
+
+    return GenFilterMatchScalar;
+}
+
+//
+// GenFilterMatchVerify
+//
+// Whether the pattern's inner bytes (all but its first and last, which
+// the kernels have already compared) are at Candidate
+//
+inline
+bool
+GenFilterMatchVerify(const GENFILTER_MATCH_PATTERN* Pattern,
+                     const UCHAR*                   Candidate)
+{
+    for (ULONG index = 1; index + 1 < Pattern->Length; index++) {
+
+        if (Candidate[index] != Pattern->Bytes[index]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// GenFilterMatchFindScalar
+//
+// The first occurrence of Pattern at or after Start, or GENFILTER_MATCH_NONE
+//
+inline
+size_t
+GenFilterMatchFindScalar(const GENFILTER_MATCH_PATTERN* Pattern,
+                         const UCHAR*                   Buffer,
+                         size_t                         Length,
+                         size_t                         Start)
+{
+    UCHAR first = Pattern->Bytes[0];
+    UCHAR last  = Pattern->Bytes[Pattern->Length - 1];
+
+    if (Length < Pattern->Length) {
+        return GENFILTER_MATCH_NONE;
+    }
+
+    for (size_t offset = Start; offset <= Length - Pattern->Length; offset++) {
+
+        if (Buffer[offset] == first &&
+            Buffer[offset + Pattern->Length - 1] == last &&
+            GenFilterMatchVerify(Pattern,
+                                 &Buffer[offset])) {
+            return offset;
+        }
+    }
+
+    return GENFILTER_MATCH_NONE;
+}
+
+#ifdef GENFILTER_MATCH_SIMD
+
+//
+// GenFilterMatchFindSse2
+//
+// Compares 16 positions at a time: a position is a candidate if both the
+// pattern's first byte is there and its last byte is Length - 1 further
+// on.  Few positions in real data pass both, so few need the full compare.
+// What's left over at the end is done by the scalar loop.
+//
+inline
+size_t
+GenFilterMatchFindSse2(const GENFILTER_MATCH_PATTERN* Pattern,
+                       const UCHAR*                   Buffer,
+                       size_t                         Length)
+{
+    __m128i first = _mm_set1_epi8((char)Pattern->Bytes[0]);
+    __m128i last  = _mm_set1_epi8((char)Pattern->Bytes[Pattern->Length - 1]);
+    size_t  span  = Pattern->Length - 1;
+    size_t  offset;
+
+    for (offset = 0; offset + span + 16 <= Length; offset += 16) {
+
+        __m128i       head;
+        __m128i       tail;
+        unsigned long mask;
+
+        head = _mm_loadu_si128((const __m128i*)&Buffer[offset]);
+        tail = _mm_loadu_si128((const __m128i*)&Buffer[offset + span]);
+
+        mask = (unsigned long)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                              _mm_cmpeq_epi8(tail, last)));
+
+        while (mask != 0) {
+
+            unsigned long bit;
+
+            _BitScanForward(&bit,
+                            mask);
+
+            if (GenFilterMatchVerify(Pattern,
+                                     &Buffer[offset + bit])) {
+                return offset + bit;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return GenFilterMatchFindScalar(Pattern,
+                                    Buffer,
+                                    Length,
+                                    offset);
+}
+
+//
+// GenFilterMatchFindAvx2
+//
+// GenFilterMatchFindSse2, 32 positions at a time.  In the kernel, the
+// caller must have saved the YMM registers (KeSaveExtendedProcessorState).
+//
+inline
+GENFILTER_MATCH_TARGET("avx2")
+size_t
+GenFilterMatchFindAvx2(const GENFILTER_MATCH_PATTERN* Pattern,
+                       const UCHAR*                   Buffer,
+                       size_t                         Length)
+{
+    __m256i first  = _mm256_set1_epi8((char)Pattern->Bytes[0]);
+    __m256i last   = _mm256_set1_epi8((char)Pattern->Bytes[Pattern->Length - 1]);
+    size_t  span   = Pattern->Length - 1;
+    size_t  offset;
+    size_t  found  = GENFILTER_MATCH_NONE;
+
+    for (offset = 0; offset + span + 32 <= Length; offset += 32) {
+
+        __m256i       head;
+        __m256i       tail;
+        unsigned long mask;
+
+        head = _mm256_loadu_si256((const __m256i*)&Buffer[offset]);
+        tail = _mm256_loadu_si256((const __m256i*)&Buffer[offset + span]);
+
+        //
+        // movemask returns an int, and bit 31 may be set: don't let it
+        // sign extend where unsigned long is 64 bits
+        //
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                                   _mm256_cmpeq_epi8(tail, last)));
+
+        while (mask != 0) {
+
+            unsigned long bit;
+
+            _BitScanForward(&bit,
+                            mask);
+
+            if (GenFilterMatchVerify(Pattern,
+                                     &Buffer[offset + bit])) {
+                found = offset + bit;
+                goto done;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    found = GenFilterMatchFindScalar(Pattern,
+                                     Buffer,
+                                     Length,
+                                     offset);
+
+done:
+
+    //
+    // Don't leave the upper halves dirty for SSE code that runs next
+    //
+    _mm256_zeroupper();
+
+    return found;
+}
+
+#endif // GENFILTER_MATCH_SIMD
+
+//
+// GenFilterMatchFind
+//
+// Looks for each pattern in turn, in the order they were added, using
+// Kernel (which must be one the processor supports).  Returns the offset
+// of the first occurrence of the first pattern that occurs at all, and
+// (if PatternIndex isn't nullptr) that pattern's index in *PatternIndex;
+// or GENFILTER_MATCH_NONE.
+//
+// Each call looks at one buffer; a signature split across two buffers
+// isn't found.
+//
+inline
+size_t
+GenFilterMatchFind(PCGENFILTER_MATCH      Match,
+                   GENFILTER_MATCH_KERNEL Kernel,
+                   const UCHAR*           Buffer,
+                   size_t                 Length,
+                   ULONG*                 PatternIndex)
+{
+    for (ULONG index = 0; index < Match->PatternCount; index++) {
+
+        const GENFILTER_MATCH_PATTERN* pattern = &Match->Patterns[index];
+        size_t                         offset;
+
+        switch (Kernel) {
+
+#ifdef GENFILTER_MATCH_SIMD
+        case GenFilterMatchAvx2:
+            offset = GenFilterMatchFindAvx2(pattern,
+                                            Buffer,
+                                            Length);
+            break;
+
+        case GenFilterMatchSse2:
+            offset = GenFilterMatchFindSse2(pattern,
+                                            Buffer,
+                                            Length);
+            break;
+#endif
+
+        default:
+            offset = GenFilterMatchFindScalar(pattern,
+                                              Buffer,
+                                              Length,
+                                              0);
+            break;
+        }
+
+        if (offset != GENFILTER_MATCH_NONE) {
+
+            if (PatternIndex != nullptr) {
+                *PatternIndex = index;
+            }
+
+            return offset;
+        }
+    }
+
+    return GENFILTER_MATCH_NONE;
+}
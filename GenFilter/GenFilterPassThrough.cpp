@@ -0,0 +1,335 @@
+///
+/// @file GenFilterPassThrough.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+//
+// The major functions we'd otherwise inspect.  Everything else the
+// Framework already forwards without presenting it to our Queue.
+//
+static const UCHAR GenFilterPassThroughMajors[] = {
+    IRP_MJ_READ,
+    IRP_MJ_WRITE,
+    IRP_MJ_DEVICE_CONTROL,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterPassThroughInitialize
+//
+//    Registers our WDM preprocess callback for the Requests we inspect.
+//    Must be called before WdfDeviceCreate.
+//
+//  INPUTS:
+//
+//      DeviceInit  - The device initialization structure for our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the callback could
+//                      not be registered.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The callback is always registered, whether or not pass-through is
+//      on, so that it can be switched on and off at runtime.  While it's
+//      off the callback is a flag test and a call back into the Framework.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterPassThroughInitialize(PWDFDEVICE_INIT DeviceInit)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    for (UCHAR majorFunction : GenFilterPassThroughMajors) {
+
+        status = WdfDeviceInitAssignWdmIrpPreprocessCallback(DeviceInit,
+                                                             GenFilterEvtWdmIrpPreprocess,
+                                                             majorFunction,
+                                                             nullptr,
+                                                             0);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfDeviceInitAssignWdmIrpPreprocessCallback failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+    }
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterPassThroughConfigure
+//
+//    Sets the initial pass-through mode from the "PassThrough" DWORD value
+//    in the device's hardware key (0, inspect Requests, if it's absent).
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE
+//
+//  OUTPUTS:
+//
+//      PassThrough - The pass-through state to initialize
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The mode can be changed later with IOCTL_GENFILTER_SET_PASS_THROUGH.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterPassThroughConfigure(WDFDEVICE               Device,
+                              PGENFILTER_PASS_THROUGH PassThrough)
+{
+    NTSTATUS status;
+    WDFKEY   key;
+    ULONG    enabled = 0;
+
+    DECLARE_CONST_UNICODE_STRING(enabledValueName, L"PassThrough");
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &enabledValueName,
+                                              &enabled))) {
+            enabled = 0;
+        }
+
+        WdfRegistryClose(key);
+    }
+
+    PassThrough->Enabled   = (enabled != 0) ? 1 : 0;
+    PassThrough->Available = TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterEvtWdmIrpPreprocess
+//
+//    Called by the Framework for every read, write and device control IRP
+//    before it's turned into a WDFREQUEST.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE
+//
+//      Irp     - The IRP
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The status returned by the driver we passed the IRP to.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      In pass-through mode the IRP goes straight to the device below us
+//      using our own stack location, exactly as a WDM filter would send it:
+//      no WDFREQUEST, no Queue, no context, no completion routine.  Our
+//      private IOCTLs are the exception -- they're always handled, so that
+//      pass-through can be switched off again.
+//
+//      Switching modes while Requests are in flight is safe: anything that
+//      was already presented to our Queue finishes the normal way.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterEvtWdmIrpPreprocess(WDFDEVICE Device,
+                             PIRP      Irp)
+{
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    PIO_STACK_LOCATION        ioStack;
+
+    devContext = GenFilterGetDeviceContext(Device);
+
+    if (ReadNoFence(&devContext->PassThrough.Enabled) != 0) {
+
+        ioStack = IoGetCurrentIrpStackLocation(Irp);
+
+        if (ioStack->MajorFunction != IRP_MJ_DEVICE_CONTROL ||
+            !GenFilterIsPrivateIoctl(ioStack->Parameters.DeviceIoControl.IoControlCode)) {
+
+            IoSkipCurrentIrpStackLocation(Irp);
+
+            return IoCallDriver(WdfDeviceWdmGetAttachedDevice(Device),
+                                Irp);
+        }
+    }
+
+    //
+    // WdfDeviceWdmDispatchPreprocessedIrp works like IoCallDriver: it
+    // advances to the next stack location, so we give up ours first
+    //
+    IoSkipCurrentIrpStackLocation(Irp);
+
+    return WdfDeviceWdmDispatchPreprocessedIrp(Device,
+                                               Irp);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterPassThroughSet
+//
+//    Handles IOCTL_GENFILTER_SET_PASS_THROUGH by switching pass-through
+//    mode on or off.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_SET_PASS_THROUGH Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - sizeof(ULONG) if the previous mode was returned,
+//                    otherwise 0
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the input buffer cannot
+//      hold a ULONG, or STATUS_INVALID_DEVICE_STATE if our dispatcher has
+//      no policies, and so nothing to pass through.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      While we're passing Requests through we don't see writes, ejects or
+//      media change notifications, so anything we cached before may be
+//      stale.  Switching back to inspecting therefore discards everything
+//      we've cached about the media.
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterPassThroughSet(WDFREQUEST                Request,
+                        PGENFILTER_DEVICE_CONTEXT DevContext,
+                        PULONG_PTR                Information)
+{
+    NTSTATUS status;
+    PULONG   input;
+    PULONG   output;
+    LONG     enable;
+    LONG     previous;
+
+    *Information = 0;
+
+    if (!DevContext->PassThrough.Available) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+                                           sizeof(ULONG),
+                                           (PVOID*)&input,
+                                           nullptr);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // METHOD_BUFFERED: the input and output share a buffer, so capture the
+    // input before we write anything
+    //
+    enable = (*input != 0) ? 1 : 0;
+
+    previous = InterlockedExchange(&DevContext->PassThrough.Enabled,
+                                   enable);
+
+    if (previous != 0 && enable == 0) {
+        GenFilterMediaChanged(DevContext);
+    }
+
+    if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                  sizeof(ULONG),
+                                                  (PVOID*)&output,
+                                                  nullptr))) {
+        *output      = (ULONG)previous;
+        *Information = sizeof(ULONG);
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterPassThrough.h
+//
+//    ABSTRACT:
+//
+//      Pass-through mode.  While it's on, reads, writes and device controls
+//      are handed straight to the device below us from the WDM preprocess
+//      callback, without being presented to our Queue at all.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+//
+// Pass-through state that lives in our device context.  Available is set
+// (by GenFilterPassThroughConfigure) only if our preprocess callback was
+// registered.
+//
+typedef struct _GENFILTER_PASS_THROUGH {
+    volatile LONG Enabled;
+    BOOLEAN       Available;
+} GENFILTER_PASS_THROUGH, *PGENFILTER_PASS_THROUGH;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterPassThroughInitialize(_In_ PWDFDEVICE_INIT DeviceInit);
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GenFilterPassThroughConfigure(_In_ WDFDEVICE Device, _Out_ PGENFILTER_PASS_THROUGH PassThrough);
+
+EVT_WDFDEVICE_WDM_IRP_PREPROCESS GenFilterEvtWdmIrpPreprocess;
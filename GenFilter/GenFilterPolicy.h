@@ -0,0 +1,1123 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterPolicy.h
+//
+//    ABSTRACT:
+//
+//      Policies for the filter's dispatch core.  GENFILTER_DISPATCH (see
+//      GenFilter.cpp) is written once, over four policies -- logging,
+//      statistics, routing and inspection -- each of which comes in an "on"
+//      version that sets up and calls the modules that do the work and an
+//      "off" version whose hooks are empty, so a dispatcher built with it
+//      has none of that work compiled in, and none of those modules'
+//      memory, threads or timers allocated.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include "GenFilter.h"
+
+//
+// Which policies the driver's own dispatcher is built with.  Define any of
+// these to 0 (in the project's preprocessor definitions) to build a filter
+// without that policy.  With all four at 0, the dispatcher sends every
+// Request (apart from our private IOCTLs) straight down, and forgets it.
+//
+#ifndef GENFILTER_POLICY_LOGGING
+#define GENFILTER_POLICY_LOGGING        1
+#endif
+
+#ifndef GENFILTER_POLICY_STATISTICS
+#define GENFILTER_POLICY_STATISTICS     1
+#endif
+
+#ifndef GENFILTER_POLICY_ROUTING
+#define GENFILTER_POLICY_ROUTING        1
+#endif
+
+#ifndef GENFILTER_POLICY_INSPECTION
+#define GENFILTER_POLICY_INSPECTION     1
+#endif
+
+//
+// Logging: the trace log, and the capture of every Request for replay
+//
+// Each policy's Initialize sets up the modules it calls, and is only called
+// for a dispatcher built with it.  So a filter built without logging never
+// turns capture on, whatever the registry says, and has no trace log for
+// the other modules that write to it (GenFilterTrace drops what they send).
+//
+struct GENFILTER_LOGGING_ON {
+
+    static constexpr bool Enabled = true;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE                 Device,
+               _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        NTSTATUS status;
+
+        status = GenFilterTraceInitialize(Device,
+                                          &DevContext->Trace);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        return GenFilterCaptureInitialize(Device,
+                                          DevContext);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Trace(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ GENFILTER_TRACE_EVENT     Event,
+          _In_ WDFREQUEST                Request,
+          _In_ NTSTATUS                  Status,
+          _In_ ULONGLONG                 Argument)
+    {
+        GenFilterTrace(&DevContext->Trace,
+                       Event,
+                       Request,
+                       Status,
+                       Argument);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Read(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+         _In_ WDFREQUEST                Request,
+         _In_ size_t                    Length)
+    {
+        GenFilterCaptureStart(DevContext,
+                              Request,
+                              0);
+
+        Trace(DevContext,
+              GenFilterTraceRead,
+              Request,
+              STATUS_SUCCESS,
+              Length);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Write(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ WDFREQUEST                Request,
+          _In_ size_t                    Length)
+    {
+        GenFilterCaptureStart(DevContext,
+                              Request,
+                              0);
+
+        Trace(DevContext,
+              GenFilterTraceWrite,
+              Request,
+              STATUS_SUCCESS,
+              Length);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    DeviceControl(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                  _In_ WDFREQUEST                Request,
+                  _In_ PCGENFILTER_ROUTE         Route,
+                  _In_ ULONG                     IoControlCode)
+    {
+        GenFilterCaptureStart(DevContext,
+                              Request,
+                              Route->Flags);
+
+        Trace(DevContext,
+              GenFilterTraceDeviceControl,
+              Request,
+              STATUS_SUCCESS,
+              IoControlCode);
+    }
+
+    //
+    // Records a captured Request, just before it's completed
+    //
+    static
+    FORCEINLINE
+    VOID
+    Completing(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+               _In_ WDFREQUEST                Request,
+               _In_ NTSTATUS                  Status)
+    {
+        GenFilterCaptureStop(DevContext,
+                             Request,
+                             Status);
+    }
+
+    static
+    FORCEINLINE
+    BOOLEAN
+    WantsCompletion(_In_ PGENFILTER_REQUEST_CONTEXT ReqContext)
+    {
+        return ReqContext->CaptureStart != 0;
+    }
+};
+
+struct GENFILTER_LOGGING_OFF {
+
+    static constexpr bool Enabled = false;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE, _In_ PGENFILTER_DEVICE_CONTEXT)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    static FORCEINLINE VOID Trace(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ GENFILTER_TRACE_EVENT, _In_ WDFREQUEST, _In_ NTSTATUS, _In_ ULONGLONG) {}
+    static FORCEINLINE VOID Read(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ size_t) {}
+    static FORCEINLINE VOID Write(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ size_t) {}
+    static FORCEINLINE VOID DeviceControl(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ PCGENFILTER_ROUTE, _In_ ULONG) {}
+    static FORCEINLINE VOID Completing(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ NTSTATUS) {}
+    static FORCEINLINE BOOLEAN WantsCompletion(_In_opt_ PGENFILTER_REQUEST_CONTEXT) { return FALSE; }
+};
+
+//
+// Statistics: the counters, the latency histograms, and attributing I/O to
+// whoever sent it
+//
+struct GENFILTER_STATISTICS_ON {
+
+    static constexpr bool Enabled = true;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE                 Device,
+               _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        NTSTATUS status;
+
+        status = GenFilterStatsInitialize(Device,
+                                          &DevContext->Stats);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterLatencyInitialize(Device,
+                                            &DevContext->Latency);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        return GenFilterAttributionInitialize(Device,
+                                              DevContext);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Read(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+         _In_ WDFREQUEST                Request,
+         _In_ size_t                    Length)
+    {
+        GenFilterLatencyStart(DevContext,
+                              Request,
+                              GenFilterLatencyRead);
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatReadRequests);
+        GenFilterStatsAdd(&DevContext->Stats,
+                          GenFilterStatBytesRead,
+                          (LONG64)Length);
+
+        GenFilterAttributionAdd(&DevContext->Attribution,
+                                Request,
+                                Length);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Write(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ WDFREQUEST                Request,
+          _In_ size_t                    Length)
+    {
+        GenFilterLatencyStart(DevContext,
+                              Request,
+                              GenFilterLatencyWrite);
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatWriteRequests);
+        GenFilterStatsAdd(&DevContext->Stats,
+                          GenFilterStatBytesWritten,
+                          (LONG64)Length);
+
+        GenFilterAttributionAdd(&DevContext->Attribution,
+                                Request,
+                                Length);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    DeviceControl(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                  _In_ WDFREQUEST                Request,
+                  _In_ PCGENFILTER_ROUTE         Route)
+    {
+        GenFilterLatencyStart(DevContext,
+                              Request,
+                              GenFilterLatencyIoctlClass(Route));
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatDeviceControlRequests);
+
+        GenFilterAttributionAdd(&DevContext->Attribution,
+                                Request,
+                                0);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Failed(_In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatFailures);
+    }
+
+    static
+    FORCEINLINE
+    VOID
+    Completing(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+               _In_ WDFREQUEST                Request,
+               _In_ NTSTATUS                  Status)
+    {
+        GenFilterLatencyStop(DevContext,
+                             Request,
+                             Status);
+    }
+
+    static
+    FORCEINLINE
+    BOOLEAN
+    WantsCompletion(_In_ PGENFILTER_REQUEST_CONTEXT ReqContext)
+    {
+        return ReqContext->LatencyStart != 0;
+    }
+};
+
+struct GENFILTER_STATISTICS_OFF {
+
+    static constexpr bool Enabled = false;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE, _In_ PGENFILTER_DEVICE_CONTEXT)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    static FORCEINLINE VOID Read(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ size_t) {}
+    static FORCEINLINE VOID Write(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ size_t) {}
+    static FORCEINLINE VOID DeviceControl(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ PCGENFILTER_ROUTE) {}
+    static FORCEINLINE VOID Failed(_In_ PGENFILTER_DEVICE_CONTEXT) {}
+    static FORCEINLINE VOID Completing(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ NTSTATUS) {}
+    static FORCEINLINE BOOLEAN WantsCompletion(_In_opt_ PGENFILTER_REQUEST_CONTEXT) { return FALSE; }
+};
+
+//
+// Routing: everything that decides where a Request goes other than
+// straight down.  That's the IOCTL routing table, and everything that can
+// satisfy, hold back, merge, or retry a Request: the I/O limits, the read
+// and query caches, read-ahead, coalescing, write gathering, our Queues'
+// limits and schedulers, and retrying Requests that fail.
+//
+// Without routing, the only device controls we look up are our own.  We
+// also pass Limited = FALSE to GenFilterQueuesInitialize, since a limited
+// Queue needs to see every Request complete.
+//
+// The configuration is shared with inspection, and set up by whichever
+// of the two is initialized first.
+//
+struct GENFILTER_ROUTING_ON {
+
+    static constexpr bool Enabled = true;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE                 Device,
+               _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        NTSTATUS status;
+
+        status = GenFilterConfigInitialize(Device,
+                                           DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterCacheInitialize(Device,
+                                          &DevContext->Cache);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterReadAheadInitialize(Device,
+                                              DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterCoalesceInitialize(Device,
+                                             &DevContext->Coalesce);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterQueryCacheInitialize(Device,
+                                               &DevContext->QueryCache);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterWriteGatherInitialize(Device,
+                                                DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterDeferInitialize(Device,
+                                          DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterLimitInitialize(Device,
+                                          DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterRetryInitialize(Device,
+                                          DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        return GenFilterSplitInitialize(Device,
+                                        DevContext);
+    }
+
+    static
+    FORCEINLINE
+    PCGENFILTER_ROUTE
+    Lookup(_In_ ULONG IoControlCode)
+    {
+        return GenFilterRouteLookup(IoControlCode);
+    }
+
+    //
+    // Returns TRUE if the Request is over our I/O limits, and is being held
+    // back until it isn't, or has been failed
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Limit(_In_ WDFREQUEST                Request,
+          _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ size_t                    Length)
+    {
+        return GenFilterLimitIsOn(&DevContext->Limit) &&
+               GenFilterLimitRequest(Request,
+                                     DevContext,
+                                     Length);
+    }
+
+    //
+    // Returns TRUE if the Request has been dealt with (its result was
+    // cached, or it's parked behind an identical one)
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    DeviceControl(_In_ WDFREQUEST                Request,
+                  _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                  _In_ PCGENFILTER_ROUTE         Route,
+                  _In_ ULONG                     IoControlCode,
+                  _In_ size_t                    InputBufferLength,
+                  _In_ size_t                    OutputBufferLength)
+    {
+        //
+        // Anything that can change the media (or the data on it) behind the
+        // class driver's back empties our caches
+        //
+        if ((Route->Flags & GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE) != 0) {
+            GenFilterMediaChanged(DevContext);
+        }
+
+        //
+        // ...and must not overtake any writes we're gathering
+        //
+        if ((Route->Flags & GENFILTER_ROUTE_FLAG_FLUSH_WRITES) != 0) {
+            GenFilterWriteGatherFlush(DevContext);
+        }
+
+        //
+        // If we have a current result for this query, we're done
+        //
+        if ((Route->Flags & GENFILTER_ROUTE_FLAG_CACHE_RESULT) != 0 &&
+            GenFilterQueryCacheRequest(Request,
+                                       DevContext,
+                                       IoControlCode,
+                                       InputBufferLength,
+                                       OutputBufferLength)) {
+            return TRUE;
+        }
+
+        //
+        // If an identical (idempotent) Request is already in flight, wait
+        // for its result instead of sending another one down
+        //
+        return (Route->Flags & GENFILTER_ROUTE_FLAG_COALESCE) != 0 &&
+               GenFilterCoalesceRequest(Request,
+                                        DevContext,
+                                        IoControlCode,
+                                        InputBufferLength,
+                                        OutputBufferLength);
+    }
+
+    //
+    // Returns TRUE if the read was satisfied from the cache
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Read(_In_ WDFREQUEST                Request,
+         _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+         _In_ LONGLONG                  Offset,
+         _In_ size_t                    Length)
+    {
+        BOOLEAN cacheHit;
+
+        cacheHit = GenFilterCacheReadRequest(Request,
+                                             DevContext,
+                                             Offset,
+                                             Length);
+
+        //
+        // Let the sequential stream detector see every read we could cache,
+        // hit or miss.  It may start a read-ahead of the data after this
+        // one.
+        //
+        if (GenFilterCacheIsCacheable(&DevContext->Cache,
+                                      Offset,
+                                      Length)) {
+
+            GenFilterReadAheadNoteRead(DevContext,
+                                       Offset,
+                                       Length,
+                                       cacheHit);
+        }
+
+        return cacheHit;
+    }
+
+    //
+    // Returns TRUE if the write was gathered or is held by the scheduler
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Write(_In_ WDFREQUEST                Request,
+          _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ LONGLONG                  Offset,
+          _In_ size_t                    Length)
+    {
+        PGENFILTER_REQUEST_CONTEXT reqContext;
+
+        //
+        // Whatever we have cached for this range is about to be stale, and
+        // is invalidated again when the write completes
+        //
+        GenFilterCacheInvalidateRange(&DevContext->Cache,
+                                      Offset,
+                                      Length);
+
+        reqContext = GenFilterGetRequestContext(Request);
+
+        reqContext->CacheInvalidate = TRUE;
+        reqContext->CacheOffset     = Offset;
+        reqContext->CacheLength     = (ULONG)Length;
+
+        //
+        // Small writes that continue one another are sent down together
+        //
+        if (GenFilterWriteGatherRequest(Request,
+                                        DevContext,
+                                        Offset,
+                                        Length)) {
+            return TRUE;
+        }
+
+        return Schedule(Request,
+                        DevContext,
+                        Offset);
+    }
+
+    //
+    // Returns TRUE if the Request's Queue is scheduled, in which case the
+    // scheduler decides when it goes
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Schedule(_In_ WDFREQUEST                Request,
+             _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+             _In_ LONGLONG                  Offset)
+    {
+        return GenFilterQueueSubmit(Request,
+                                    DevContext,
+                                    Offset);
+    }
+
+    //
+    // Cacheable reads that missed, writes, Requests that others can be
+    // parked behind, Requests whose result we're going to cache, and
+    // Requests from a limited Queue all need our completion callback.  If
+    // we retry Requests that fail, so does everything else.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    WantsCompletion(_In_ WDFREQUEST                 Request,
+                    _In_ PGENFILTER_DEVICE_CONTEXT  DevContext,
+                    _In_ PGENFILTER_REQUEST_CONTEXT ReqContext)
+    {
+        return ReqContext->CacheFill ||
+               ReqContext->CacheInvalidate ||
+               ReqContext->CoalesceSlot != nullptr ||
+               ReqContext->QueryCacheEntry != nullptr ||
+               GenFilterQueueIsLimited(Request) ||
+               GenFilterRetryIsOn(&DevContext->Retry);
+    }
+
+    //
+    // Called just before a Request is sent down.  Returns TRUE if it's a
+    // read or write longer than the configured chunk size, and is being
+    // sent down in chunks instead (Completion gets it when they're done).
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Split(_In_ WDFREQUEST                         Request,
+          _In_ PGENFILTER_DEVICE_CONTEXT          DevContext,
+          _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion)
+    {
+        return GenFilterSplitIsOn(&DevContext->Split) &&
+               GenFilterSplitRequest(Request,
+                                     DevContext,
+                                     Completion);
+    }
+
+    //
+    // Called from our completion callback first.  Returns TRUE if the
+    // Request failed with a status we retry, and will be sent down again
+    // (with Completion) once it's waited long enough.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Retry(_In_ WDFREQUEST                         Request,
+          _In_ PGENFILTER_DEVICE_CONTEXT          DevContext,
+          _In_ NTSTATUS                           Status,
+          _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion)
+    {
+        return GenFilterRetryIsOn(&DevContext->Retry) &&
+               GenFilterRetryRequest(Request,
+                                     DevContext,
+                                     Status,
+                                     Completion);
+    }
+
+    //
+    // Called from our completion callback.  Returns TRUE if one of our
+    // worker threads will complete the Request; otherwise feeds the read
+    // cache.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Completed(_In_ WDFREQUEST                     Request,
+              _In_ PGENFILTER_DEVICE_CONTEXT      DevContext,
+              _In_ PWDF_REQUEST_COMPLETION_PARAMS Params)
+    {
+        if (GenFilterDeferRequest(Request,
+                                  DevContext,
+                                  Params)) {
+            return TRUE;
+        }
+
+        GenFilterCacheRequestCompleted(Request,
+                                       DevContext,
+                                       Params);
+        return FALSE;
+    }
+
+    //
+    // Remember the result of a cacheable query, and hand it to any
+    // identical Requests parked behind this one
+    //
+    static
+    FORCEINLINE
+    VOID
+    ResultReady(_In_ WDFREQUEST                Request,
+                _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                _In_ NTSTATUS                  Status,
+                _In_ ULONG_PTR                 Information)
+    {
+        GenFilterQueryCacheRequestDone(Request,
+                                       DevContext,
+                                       Status,
+                                       Information);
+
+        GenFilterCoalesceLeaderDone(Request,
+                                    DevContext,
+                                    Status,
+                                    Information);
+    }
+
+    //
+    // If our Queue was holding Requests back for this one, send the next
+    //
+    static
+    FORCEINLINE
+    VOID
+    InFlightDone(_In_ WDFREQUEST                Request,
+                 _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        GenFilterQueueRequestDone(Request,
+                                  DevContext);
+    }
+};
+
+struct GENFILTER_ROUTING_OFF {
+
+    static constexpr bool Enabled = false;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE, _In_ PGENFILTER_DEVICE_CONTEXT)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    static
+    FORCEINLINE
+    PCGENFILTER_ROUTE
+    Lookup(_In_ ULONG IoControlCode)
+    {
+        if (GenFilterIsPrivateIoctl(IoControlCode)) {
+            return GenFilterRouteLookup(IoControlCode);
+        }
+
+        return GenFilterRouteGetByIndex(GenFilterRouteGetCount());
+    }
+
+    static FORCEINLINE BOOLEAN Limit(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN DeviceControl(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ PCGENFILTER_ROUTE, _In_ ULONG, _In_ size_t, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN Read(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ LONGLONG, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN Write(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ LONGLONG, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN Schedule(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ LONGLONG) { return FALSE; }
+    static FORCEINLINE BOOLEAN WantsCompletion(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_opt_ PGENFILTER_REQUEST_CONTEXT) { return FALSE; }
+    static FORCEINLINE BOOLEAN Split(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE) { return FALSE; }
+    static FORCEINLINE BOOLEAN Retry(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ NTSTATUS, _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE) { return FALSE; }
+    static FORCEINLINE BOOLEAN Completed(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ PWDF_REQUEST_COMPLETION_PARAMS) { return FALSE; }
+    static FORCEINLINE VOID ResultReady(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ NTSTATUS, _In_ ULONG_PTR) {}
+    static FORCEINLINE VOID InFlightDone(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT) {}
+};
+
+//
+// Inspection: looking for signatures in the data we see, and checksumming
+// the sectors we read
+//
+// As with logging, Initialize is only called for a dispatcher that
+// inspects.  Read-ahead checksums what it reads whenever integrity checking
+// is on, and only our write path forgets those checksums again, so it
+// must never be turned on without the write path that goes with it.
+//
+struct GENFILTER_INSPECTION_ON {
+
+    static constexpr bool Enabled = true;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE                 Device,
+               _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        NTSTATUS status;
+
+        status = GenFilterConfigInitialize(Device,
+                                           DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        status = GenFilterInspectInitialize(Device,
+                                            DevContext);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        return GenFilterIntegrityInitialize(Device,
+                                            DevContext);
+    }
+
+    //
+    // What we read from the device has to be inspected.  (What we read from
+    // the cache was, on its way in.)
+    //
+    static
+    FORCEINLINE
+    VOID
+    Read(_In_ WDFREQUEST                Request,
+         _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+         _In_ LONGLONG                  Offset)
+    {
+        GenFilterInspectReadRequest(Request,
+                                    DevContext);
+
+        GenFilterIntegrityReadRequest(Request,
+                                      DevContext,
+                                      Offset);
+    }
+
+    //
+    // Takes a copy for a write we'll inspect.  Returns TRUE if it's waiting
+    // for one, or has been failed.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Reserve(_In_ WDFREQUEST                Request,
+            _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+            _In_ size_t                    Length)
+    {
+        return GenFilterInspectReserve(Request,
+                                       DevContext,
+                                       Length);
+    }
+
+    //
+    // Forgets the checksums of the sectors the write is about to change.
+    // Returns TRUE if the write carried data we block, in which case it's
+    // been completed.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Write(_In_ WDFREQUEST                Request,
+          _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+          _In_ LONGLONG                  Offset,
+          _In_ size_t                    Length)
+    {
+        GenFilterIntegrityWriteRequest(Request,
+                                       DevContext,
+                                       Offset,
+                                       Length);
+
+        return GenFilterInspectWriteRequest(Request,
+                                            DevContext,
+                                            Offset,
+                                            Length);
+    }
+
+    //
+    // Reads we scan or checksum, writes we send from our copy, and writes
+    // whose checksums we forget again, need our completion callback
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    WantsCompletion(_In_ PGENFILTER_REQUEST_CONTEXT ReqContext)
+    {
+        return ReqContext->InspectRead ||
+               ReqContext->IntegrityCheck ||
+               ReqContext->IntegrityInvalidate ||
+               ReqContext->InspectCopy != nullptr;
+    }
+
+    //
+    // Called where a Request is sent down, in place of
+    // WdfRequestFormatRequestUsingCurrentType
+    //
+    static
+    FORCEINLINE
+    NTSTATUS
+    Format(_In_ WDFREQUEST                Request,
+           _In_ PGENFILTER_DEVICE_CONTEXT DevContext)
+    {
+        return GenFilterInspectFormatRequest(Request,
+                                             DevContext);
+    }
+
+    //
+    // Called from our completion callback, after any retries.  Returns TRUE
+    // if the Request is a write longer than our copy, and the next part of
+    // it has been sent.
+    //
+    static
+    FORCEINLINE
+    BOOLEAN
+    Next(_In_ WDFREQUEST                     Request,
+         _In_ PGENFILTER_DEVICE_CONTEXT      DevContext,
+         _In_ NTSTATUS                       Status,
+         _In_ PWDF_REQUEST_COMPLETION_PARAMS Params)
+    {
+        return GenFilterInspectWriteNext(Request,
+                                         DevContext,
+                                         Status,
+                                         Params);
+    }
+
+    //
+    // Looks for signatures in what was read, and compares the sectors that
+    // were read with what they returned before.  Returns the status to
+    // complete the Request with: if we're failing the read because of a
+    // signature, its data has been wiped (and won't be cached).  A write
+    // is failed if a part of it we hadn't sent yet carried one.
+    //
+    static
+    FORCEINLINE
+    NTSTATUS
+    Completed(_In_ WDFREQUEST                     Request,
+              _In_ PGENFILTER_DEVICE_CONTEXT      DevContext,
+              _In_ NTSTATUS                       Status,
+              _In_ PWDF_REQUEST_COMPLETION_PARAMS Params)
+    {
+        if (GenFilterInspectReadCompleted(Request,
+                                          DevContext,
+                                          Params)) {
+            Status = STATUS_ACCESS_DENIED;
+        }
+
+        if (GenFilterInspectWriteCompleted(Request)) {
+            Status = STATUS_ACCESS_DENIED;
+        }
+
+        GenFilterIntegrityReadCompleted(Request,
+                                        DevContext,
+                                        Status,
+                                        Params);
+        return Status;
+    }
+
+    //
+    // Our copy of a write's data goes back, or to a write waiting for one,
+    // and the checksums of the sectors it wrote are forgotten again
+    //
+    static
+    FORCEINLINE
+    VOID
+    Completing(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+               _In_ WDFREQUEST                Request,
+               _In_ NTSTATUS                  Status)
+    {
+        UNREFERENCED_PARAMETER(Status);
+
+        GenFilterInspectCompleting(DevContext,
+                                   Request);
+
+        GenFilterIntegrityCompleting(DevContext,
+                                     Request);
+    }
+};
+
+struct GENFILTER_INSPECTION_OFF {
+
+    static constexpr bool Enabled = false;
+
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE, _In_ PGENFILTER_DEVICE_CONTEXT)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    static FORCEINLINE VOID Read(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ LONGLONG) {}
+    static FORCEINLINE BOOLEAN Reserve(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN Write(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ LONGLONG, _In_ size_t) { return FALSE; }
+    static FORCEINLINE BOOLEAN WantsCompletion(_In_opt_ PGENFILTER_REQUEST_CONTEXT) { return FALSE; }
+    static FORCEINLINE NTSTATUS Format(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT) { WdfRequestFormatRequestUsingCurrentType(Request); return STATUS_SUCCESS; }
+    static FORCEINLINE BOOLEAN Next(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ NTSTATUS, _In_ PWDF_REQUEST_COMPLETION_PARAMS) { return FALSE; }
+    static FORCEINLINE NTSTATUS Completed(_In_ WDFREQUEST, _In_ PGENFILTER_DEVICE_CONTEXT, _In_ NTSTATUS Status, _In_ PWDF_REQUEST_COMPLETION_PARAMS) { return Status; }
+    static FORCEINLINE VOID Completing(_In_ PGENFILTER_DEVICE_CONTEXT, _In_ WDFREQUEST, _In_ NTSTATUS) {}
+};
+
+//
+// A set of policies, one of each
+//
+// We only look at a Request's offset, or its context, if some policy
+// will: for a dispatcher with no policies those are calls into the
+// Framework that hand-written forwarding code wouldn't make.  Nor does
+// such a dispatcher give its Requests a context, or look at IRPs before
+// the Framework does to offer pass-through mode: it already passes
+// everything through.
+//
+template <typename LoggingPolicy,
+          typename StatisticsPolicy,
+          typename RoutingPolicy,
+          typename InspectionPolicy>
+struct GENFILTER_POLICIES {
+
+    typedef LoggingPolicy    Logging;
+    typedef StatisticsPolicy Statistics;
+    typedef RoutingPolicy    Routing;
+    typedef InspectionPolicy Inspection;
+
+    static constexpr bool Enabled             = Logging::Enabled || Statistics::Enabled ||
+                                                Routing::Enabled || Inspection::Enabled;
+    static constexpr bool NeedsOffset         = Routing::Enabled || Inspection::Enabled;
+    static constexpr bool NeedsRequestContext = Enabled;
+};
+
+//
+// The dispatch core: our Queues' callbacks, and the routines that send
+// Requests down.  The members are defined (and the dispatchers we use are
+// instantiated) in GenFilter.cpp.
+//
+// A device class that wants a different mix of policies gets a dispatcher
+// of its own by naming it here, instantiating it there, and calling its
+// InitializeDeviceInit and Initialize from the device's EvtDeviceAdd.
+//
+template <typename Policies>
+struct GENFILTER_DISPATCH {
+
+    static EVT_WDF_IO_QUEUE_IO_READ           EvtRead;
+    static EVT_WDF_IO_QUEUE_IO_WRITE          EvtWrite;
+    static EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtDeviceControl;
+    static EVT_WDF_REQUEST_COMPLETION_ROUTINE CompletionCallback;
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    static
+    NTSTATUS
+    InitializeDeviceInit(_In_ PWDFDEVICE_INIT DeviceInit);
+
+    _IRQL_requires_(PASSIVE_LEVEL)
+    static
+    NTSTATUS
+    Initialize(_In_ WDFDEVICE Device);
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    static
+    VOID
+    Completing(_In_ PGENFILTER_DEVICE_CONTEXT DevContext, _In_ WDFREQUEST Request, _In_ NTSTATUS Status);
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    static
+    VOID
+    Forward(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    static
+    VOID
+    SendAndForget(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+    _IRQL_requires_max_(DISPATCH_LEVEL)
+    static
+    VOID
+    SendWithCallback(_In_ WDFREQUEST Request, _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+};
+
+//
+// The dispatcher our devices use
+//
+typedef GENFILTER_DISPATCH<
+    GENFILTER_POLICIES<
+#if GENFILTER_POLICY_LOGGING
+        GENFILTER_LOGGING_ON,
+#else
+        GENFILTER_LOGGING_OFF,
+#endif
+#if GENFILTER_POLICY_STATISTICS
+        GENFILTER_STATISTICS_ON,
+#else
+        GENFILTER_STATISTICS_OFF,
+#endif
+#if GENFILTER_POLICY_ROUTING
+        GENFILTER_ROUTING_ON,
+#else
+        GENFILTER_ROUTING_OFF,
+#endif
+#if GENFILTER_POLICY_INSPECTION
+        GENFILTER_INSPECTION_ON
+#else
+        GENFILTER_INSPECTION_OFF
+#endif
+    >> GENFILTER_DEVICE_DISPATCH;
+
+//
+// The dispatcher with no policies at all, for a device class that wants
+// nothing from us but our private IOCTLs (see
+// GenFilterForwardingEvtDeviceAdd).  It should cost no more than
+// hand-written forwarding code, and GenFilterSimBench measures it against
+// exactly that.
+//
+typedef GENFILTER_DISPATCH<
+    GENFILTER_POLICIES<
+        GENFILTER_LOGGING_OFF,
+        GENFILTER_STATISTICS_OFF,
+        GENFILTER_ROUTING_OFF,
+        GENFILTER_INSPECTION_OFF
+    >> GENFILTER_FORWARDING_DISPATCH;
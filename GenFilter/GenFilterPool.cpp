@@ -0,0 +1,257 @@
+///
+/// @file GenFilterPool.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+#include "GenFilter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterPoolCreate
+//
+//    Makes a pool of the caller's preallocated elements, allocating the
+//    free list links and the per-processor caches that go with them.
+//
+//  INPUTS:
+//
+//      Device       - Our WDFDEVICE.  Everything we allocate is parented to
+//                     it.
+//
+//      Elements     - The elements.  Must live as long as the device does.
+//
+//      ElementSize  - Bytes per element
+//
+//      ElementCount - Number of elements
+//
+//  OUTPUTS:
+//
+//      Pool         - The pool to initialize.  Every element starts out
+//                     free.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the pool could not
+//                      be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      As with the statistics, there's a cache for every processor the
+//      system could ever have (not just those that are active now), so a
+//      processor's number is always a valid cache index.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterPoolCreate(WDFDEVICE       Device,
+                    PGENFILTER_SLAB Pool,
+                    PVOID           Elements,
+                    size_t          ElementSize,
+                    ULONG           ElementCount)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    PVOID                 next;
+    ULONG                 processorCount;
+    size_t                cpuLength;
+
+    RtlZeroMemory(Pool,
+                  sizeof(GENFILTER_SLAB));
+
+    processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    cpuLength      = processorCount * sizeof(GENFILTER_SLAB_CPU);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'pFnG',
+                             ElementCount * sizeof(ULONG),
+                             &memory,
+                             &next);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for pool links failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // Pool allocations are only guaranteed to be 16 byte aligned, so ask for
+    // an extra cache line and align the caches ourselves
+    //
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'pFnG',
+                             cpuLength + SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for pool caches failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  cpuLength + SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    GenFilterSlabInitialize(Pool,
+                            Elements,
+                            ElementSize,
+                            ElementCount,
+                            (volatile ULONG*)next,
+                            (PGENFILTER_SLAB_CPU)ALIGN_UP_BY(buffer,
+                                                             SYSTEM_CACHE_ALIGNMENT_SIZE),
+                            processorCount);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterPoolQuery
+//
+//    Handles IOCTL_GENFILTER_GET_POOLS by copying a snapshot of each pool's
+//    counters into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_GET_POOLS Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      even hold the fixed part of GENFILTER_POOLS.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller completes the Request.  A pool that was never created
+//      (write gathering is off, say) is returned with all zeroes.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterPoolQuery(WDFREQUEST                Request,
+                   PGENFILTER_DEVICE_CONTEXT DevContext,
+                   PULONG_PTR                Information)
+{
+    NTSTATUS         status;
+    PGENFILTER_POOLS pools;
+    size_t           poolsLength;
+    ULONG            poolCount;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(GENFILTER_POOLS, Pools),
+                                            (PVOID*)&pools,
+                                            &poolsLength);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    poolCount = (ULONG)((poolsLength - FIELD_OFFSET(GENFILTER_POOLS, Pools)) /
+                        sizeof(GENFILTER_POOL_INFO));
+
+    if (poolCount > GenFilterPoolCount) {
+        poolCount = GenFilterPoolCount;
+    }
+
+    RtlZeroMemory(pools,
+                  FIELD_OFFSET(GENFILTER_POOLS, Pools) +
+                  (poolCount * sizeof(GENFILTER_POOL_INFO)));
+
+    pools->Size      = FIELD_OFFSET(GENFILTER_POOLS, Pools) +
+                       (poolCount * sizeof(GENFILTER_POOL_INFO));
+    pools->PoolCount = poolCount;
+
+    for (ULONG index = 0; index < poolCount; index++) {
+
+        PGENFILTER_SLAB         pool = &DevContext->Pools[index];
+        GENFILTER_SLAB_COUNTERS counters;
+
+        if (pool->Cpus == nullptr) {
+            continue;
+        }
+
+        GenFilterSlabQuery(pool,
+                           &counters);
+
+        pools->ProcessorCount = pool->CpuCount;
+
+        pools->Pools[index].ElementSize  = (ULONG)pool->ElementSize;
+        pools->Pools[index].ElementCount = pool->ElementCount;
+        pools->Pools[index].InUse        = counters.InUse;
+        pools->Pools[index].HighWater    = counters.HighWater;
+        pools->Pools[index].Allocations  = counters.Allocations;
+        pools->Pools[index].Exhausted    = counters.Exhausted;
+    }
+
+    *Information = pools->Size;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterPool.h
+//
+//    ABSTRACT:
+//
+//      Per-device pools of preallocated, fixed-size elements, built on the
+//      portable core in GenFilterSlab.h.  Everything is allocated when the
+//      device is added, so that nothing on the I/O path ever needs to allocate
+//      memory (or can fail for lack of it).
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterSlab.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterPoolCreate(_In_ WDFDEVICE Device,
+                    _Out_ PGENFILTER_SLAB Pool,
+                    _In_ PVOID Elements,
+                    _In_ size_t ElementSize,
+                    _In_ ULONG ElementCount);
+
+//
+// GenFilterPoolAllocate
+//
+// Returns a free element, or nullptr if there are none.
+//
+// The calling processor's cache in the pool is only ours while nothing else
+// can run on this processor, so we go to DISPATCH_LEVEL (if we're not there
+// already) for the duration.  That's a handful of instructions, unless the
+// cache is empty and has to be refilled.
+//
+FORCEINLINE
+PVOID
+GenFilterPoolAllocate(_In_ PGENFILTER_SLAB Pool)
+{
+    KIRQL oldIrql;
+    PVOID element;
+    ULONG cpu;
+
+    KeRaiseIrql(DISPATCH_LEVEL,
+                &oldIrql);
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    NT_ASSERT(cpu < Pool->CpuCount);
+
+    element = GenFilterSlabAllocate(Pool,
+                                    cpu);
+
+    KeLowerIrql(oldIrql);
+
+    return element;
+}
+
+//
+// GenFilterPoolFree
+//
+// Returns an element to the pool.  It needn't be freed on the processor
+// that allocated it.
+//
+FORCEINLINE
+VOID
+GenFilterPoolFree(_In_ PGENFILTER_SLAB Pool,
+                  _In_ PVOID           Element)
+{
+    KIRQL oldIrql;
+    ULONG cpu;
+
+    KeRaiseIrql(DISPATCH_LEVEL,
+                &oldIrql);
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    NT_ASSERT(cpu < Pool->CpuCount);
+
+    GenFilterSlabFree(Pool,
+                      cpu,
+                      Element);
+
+    KeLowerIrql(oldIrql);
+}
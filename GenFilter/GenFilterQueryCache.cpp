@@ -0,0 +1,596 @@
+///
+/// @file GenFilterQueryCache.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+BOOLEAN
+GenFilterQueryCacheKeyMatches(_In_ PGENFILTER_QUERY_CACHE_ENTRY Entry,
+                              _In_ ULONG                        IoControlCode,
+                              _In_opt_ const VOID*              Input,
+                              _In_ size_t                       InputLength,
+                              _In_ size_t                       OutputLength,
+                              _In_ UCHAR                        StackFlags,
+                              _In_ KPROCESSOR_MODE              RequestorMode);
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueryCacheInitialize
+//
+//    Allocates the query result cache, and reads its TTL from the device's
+//    hardware key.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//  OUTPUTS:
+//
+//      QueryCache  - The cache to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the cache could
+//                      not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      A missing (or unreadable) registry value just means the default TTL.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterQueryCacheInitialize(WDFDEVICE              Device,
+                              PGENFILTER_QUERY_CACHE QueryCache)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    WDFKEY                key;
+    ULONG                 ttlMs = GENFILTER_QUERY_CACHE_DEFAULT_TTL_MS;
+
+    DECLARE_CONST_UNICODE_STRING(ttlValueName, L"QueryCacheTtlMs");
+
+    RtlZeroMemory(QueryCache,
+                  sizeof(GENFILTER_QUERY_CACHE));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &ttlValueName,
+                                              &ttlMs))) {
+            ttlMs = GENFILTER_QUERY_CACHE_DEFAULT_TTL_MS;
+        }
+
+        WdfRegistryClose(key);
+    }
+
+    //
+    // Milliseconds to 100ns interrupt time units
+    //
+    QueryCache->Ttl = (ULONGLONG)ttlMs * 10 * 1000;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'qFnG',
+                             GENFILTER_QUERY_CACHE_ENTRIES * sizeof(GENFILTER_QUERY_CACHE_ENTRY),
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for query cache failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  GENFILTER_QUERY_CACHE_ENTRIES * sizeof(GENFILTER_QUERY_CACHE_ENTRY));
+
+    QueryCache->Entries = (PGENFILTER_QUERY_CACHE_ENTRY)buffer;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueryCacheRequest
+//
+//    Called for device control Requests whose route says their result may
+//    be cached.  If we have a current result for an identical Request we
+//    complete this one with it.  Otherwise we reserve an entry for this
+//    Request's result.
+//
+//  INPUTS:
+//
+//      Request            - The device control Request
+//
+//      DevContext         - Pointer to our WDFDEVICE context
+//
+//      IoControlCode      - The operation being performed
+//
+//      InputBufferLength  - The length of the input buffer
+//
+//      OutputBufferLength - The length of the output buffer
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the Request was completed from the cache (the caller must
+//      not touch it again).  FALSE if the caller must send it.  In that
+//      case, if QueryCacheEntry in the Request's context is set, the
+//      Request MUST be sent with our completion callback, or the entry
+//      given up with GenFilterQueryCacheRelease.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      As with coalescing, only METHOD_BUFFERED codes are cached, and
+//      "identical" means same control code, buffer lengths, input bytes,
+//      stack location flags, and requestor mode.
+//
+//      Note that for METHOD_BUFFERED the input and output buffers are the
+//      same buffer, so we compare the input before copying any output.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterQueryCacheRequest(WDFREQUEST                Request,
+                           PGENFILTER_DEVICE_CONTEXT DevContext,
+                           ULONG                     IoControlCode,
+                           size_t                    InputBufferLength,
+                           size_t                    OutputBufferLength)
+{
+    NTSTATUS                     status;
+    PGENFILTER_QUERY_CACHE       queryCache;
+    PGENFILTER_QUERY_CACHE_ENTRY victim      = nullptr;
+    PGENFILTER_REQUEST_CONTEXT   reqContext;
+    PVOID                        input       = nullptr;
+    PVOID                        output      = nullptr;
+    ULONG_PTR                    information = 0;
+    BOOLEAN                      hit         = FALSE;
+    ULONGLONG                    now;
+    LONG                         epoch;
+    KIRQL                        oldIrql;
+    UCHAR                        stackFlags;
+    KPROCESSOR_MODE              requestorMode;
+
+    queryCache = &DevContext->QueryCache;
+    reqContext = GenFilterGetRequestContext(Request);
+    reqContext->QueryCacheEntry = nullptr;
+
+    if (queryCache->Ttl == 0 ||
+        METHOD_FROM_CTL_CODE(IoControlCode) != METHOD_BUFFERED ||
+        InputBufferLength > GENFILTER_QUERY_CACHE_MAX_INPUT ||
+        OutputBufferLength > GENFILTER_QUERY_CACHE_MAX_OUTPUT) {
+        return FALSE;
+    }
+
+    if (InputBufferLength != 0) {
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+                                               InputBufferLength,
+                                               &input,
+                                               nullptr);
+
+        if (!NT_SUCCESS(status)) {
+            return FALSE;
+        }
+    }
+
+    if (OutputBufferLength != 0) {
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+                                                OutputBufferLength,
+                                                &output,
+                                                nullptr);
+
+        if (!NT_SUCCESS(status)) {
+            return FALSE;
+        }
+    }
+
+    stackFlags    = IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request))->Flags;
+    requestorMode = WdfRequestGetRequestorMode(Request);
+
+    now   = KeQueryInterruptTime();
+    epoch = ReadAcquire(&queryCache->Epoch);
+
+    oldIrql = ExAcquireSpinLockShared(&queryCache->Lock);
+
+    for (ULONG index = 0; index < GENFILTER_QUERY_CACHE_ENTRIES; index++) {
+
+        PGENFILTER_QUERY_CACHE_ENTRY entry = &queryCache->Entries[index];
+
+        if (entry->State != GENFILTER_QUERY_CACHE_VALID ||
+            entry->Epoch != epoch ||
+            now >= entry->Expires ||
+            !GenFilterQueryCacheKeyMatches(entry,
+                                           IoControlCode,
+                                           input,
+                                           InputBufferLength,
+                                           OutputBufferLength,
+                                           stackFlags,
+                                           requestorMode)) {
+            continue;
+        }
+
+        information = entry->Information;
+
+        if (information != 0) {
+            RtlCopyMemory(output,
+                          entry->Output,
+                          information);
+        }
+
+        hit = TRUE;
+        break;
+    }
+
+    ExReleaseSpinLockShared(&queryCache->Lock,
+                            oldIrql);
+
+    if (hit) {
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatQueryCacheHits);
+
+        GenFilterTrace(&DevContext->Trace,
+                       GenFilterTraceQueryCacheHit,
+                       Request,
+                       STATUS_SUCCESS,
+                       IoControlCode);
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            STATUS_SUCCESS);
+
+        WdfRequestCompleteWithInformation(Request,
+                                          STATUS_SUCCESS,
+                                          information);
+        return TRUE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatQueryCacheMisses);
+
+    //
+    // Reserve an entry for this Request's result.  In order of preference:
+    // an expired result for this same Request, a free entry, any expired
+    // (or old epoch) result, and finally the result that expires soonest.
+    // If an identical Request already has an entry reserved we leave
+    // filling it to that Request.
+    //
+    oldIrql = ExAcquireSpinLockExclusive(&queryCache->Lock);
+
+    for (ULONG index = 0; index < GENFILTER_QUERY_CACHE_ENTRIES; index++) {
+
+        PGENFILTER_QUERY_CACHE_ENTRY entry = &queryCache->Entries[index];
+        BOOLEAN                      sameKey;
+
+        if (entry->State == GENFILTER_QUERY_CACHE_FREE) {
+
+            if (victim == nullptr || victim->State != GENFILTER_QUERY_CACHE_FREE) {
+                victim = entry;
+            }
+            continue;
+        }
+
+        sameKey = GenFilterQueryCacheKeyMatches(entry,
+                                                IoControlCode,
+                                                input,
+                                                InputBufferLength,
+                                                OutputBufferLength,
+                                                stackFlags,
+                                                requestorMode);
+
+        if (entry->State == GENFILTER_QUERY_CACHE_PENDING) {
+
+            if (sameKey) {
+                victim = nullptr;
+                goto done;
+            }
+            continue;
+        }
+
+        if (sameKey) {
+            victim = entry;
+            break;
+        }
+
+        if (victim != nullptr && victim->State == GENFILTER_QUERY_CACHE_FREE) {
+            continue;
+        }
+
+        if (entry->Epoch != epoch || now >= entry->Expires) {
+
+            if (victim == nullptr ||
+                (victim->Epoch == epoch && now < victim->Expires)) {
+                victim = entry;
+            }
+            continue;
+        }
+
+        if (victim == nullptr || entry->Expires < victim->Expires) {
+            victim = entry;
+        }
+    }
+
+    if (victim != nullptr) {
+
+        victim->State         = GENFILTER_QUERY_CACHE_PENDING;
+        victim->IoControlCode = IoControlCode;
+        victim->InputLength   = (ULONG)InputBufferLength;
+        victim->OutputLength  = (ULONG)OutputBufferLength;
+        victim->StackFlags    = stackFlags;
+        victim->RequestorMode = requestorMode;
+
+        if (InputBufferLength != 0) {
+            RtlCopyMemory(victim->Input,
+                          input,
+                          InputBufferLength);
+        }
+
+        reqContext->QueryCacheEntry = victim;
+        reqContext->QueryCacheEpoch = epoch;
+    }
+
+done:
+
+    ExReleaseSpinLockExclusive(&queryCache->Lock,
+                               oldIrql);
+
+    return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueryCacheRequestDone
+//
+//    Called just before we complete any Request we sent with our completion
+//    callback (or failed to send).  If the Request reserved a query cache
+//    entry, its result is stored there (or the entry is released).
+//
+//  INPUTS:
+//
+//      Request     - The Request that's about to be completed
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Status      - The status it's being completed with
+//
+//      Information - The number of output bytes it's returning
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Only successful results are cached.  Results that arrive after the
+//      media changed (that is, after the epoch moved) are discarded.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterQueryCacheRequestDone(WDFREQUEST                Request,
+                               PGENFILTER_DEVICE_CONTEXT DevContext,
+                               NTSTATUS                  Status,
+                               ULONG_PTR                 Information)
+{
+    PGENFILTER_QUERY_CACHE       queryCache;
+    PGENFILTER_QUERY_CACHE_ENTRY entry;
+    PGENFILTER_REQUEST_CONTEXT   reqContext;
+    PVOID                        output = nullptr;
+    BOOLEAN                      cacheable;
+    KIRQL                        oldIrql;
+
+    queryCache = &DevContext->QueryCache;
+    reqContext = GenFilterGetRequestContext(Request);
+    entry      = reqContext->QueryCacheEntry;
+
+    if (entry == nullptr) {
+        return;
+    }
+
+    reqContext->QueryCacheEntry = nullptr;
+
+    cacheable = (NT_SUCCESS(Status) &&
+                 Information <= entry->OutputLength);
+
+    if (cacheable && Information != 0) {
+
+        cacheable = NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+                                                              Information,
+                                                              &output,
+                                                              nullptr));
+    }
+
+    oldIrql = ExAcquireSpinLockExclusive(&queryCache->Lock);
+
+    if (cacheable &&
+        ReadNoFence(&queryCache->Epoch) == reqContext->QueryCacheEpoch) {
+
+        if (Information != 0) {
+            RtlCopyMemory(entry->Output,
+                          output,
+                          Information);
+        }
+
+        entry->Information = (ULONG)Information;
+        entry->Epoch       = reqContext->QueryCacheEpoch;
+        entry->Expires     = KeQueryInterruptTime() + queryCache->Ttl;
+        entry->State       = GENFILTER_QUERY_CACHE_VALID;
+
+    } else {
+
+        entry->State = GENFILTER_QUERY_CACHE_FREE;
+    }
+
+    ExReleaseSpinLockExclusive(&queryCache->Lock,
+                               oldIrql);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueryCacheRelease
+//
+//    Gives up the entry a Request reserved for its result, if it reserved
+//    one, without filling it.  For a Request that isn't going to be sent
+//    down after all.
+//
+//  INPUTS:
+//
+//      Request     - The Request that reserved the entry
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A Request that's parked behind an identical one (see
+//      GenFilterCoalesceRequest) is completed without passing through our
+//      completion callback, so GenFilterQueryCacheRequestDone never sees
+//      it.  Unless it calls this first, its entry stays Pending for good,
+//      and no identical Request's result is ever cached again.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterQueryCacheRelease(WDFREQUEST                Request,
+                           PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_QUERY_CACHE       queryCache;
+    PGENFILTER_QUERY_CACHE_ENTRY entry;
+    PGENFILTER_REQUEST_CONTEXT   reqContext;
+    KIRQL                        oldIrql;
+
+    queryCache = &DevContext->QueryCache;
+    reqContext = GenFilterGetRequestContext(Request);
+    entry      = reqContext->QueryCacheEntry;
+
+    if (entry == nullptr) {
+        return;
+    }
+
+    reqContext->QueryCacheEntry = nullptr;
+
+    oldIrql = ExAcquireSpinLockExclusive(&queryCache->Lock);
+
+    entry->State = GENFILTER_QUERY_CACHE_FREE;
+
+    ExReleaseSpinLockExclusive(&queryCache->Lock,
+                               oldIrql);
+}
+
+//
+// GenFilterQueryCacheKeyMatches
+//
+// TRUE if Entry holds (or is reserved for) the result of a Request with
+// this control code, these buffer lengths, this input, these stack
+// location flags, and this requestor mode
+//
+static
+BOOLEAN
+GenFilterQueryCacheKeyMatches(PGENFILTER_QUERY_CACHE_ENTRY Entry,
+                              ULONG                        IoControlCode,
+                              const VOID*                  Input,
+                              size_t                       InputLength,
+                              size_t                       OutputLength,
+                              UCHAR                        StackFlags,
+                              KPROCESSOR_MODE              RequestorMode)
+{
+    if (Entry->IoControlCode != IoControlCode ||
+        Entry->InputLength != InputLength ||
+        Entry->OutputLength != OutputLength ||
+        Entry->StackFlags != StackFlags ||
+        Entry->RequestorMode != RequestorMode) {
+        return FALSE;
+    }
+
+    return (InputLength == 0 ||
+            RtlCompareMemory(Entry->Input,
+                             Input,
+                             InputLength) == InputLength);
+}
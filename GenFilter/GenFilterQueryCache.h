@@ -0,0 +1,152 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterQueryCache.h
+//
+//    ABSTRACT:
+//
+//      Time-limited cache of the results of idempotent query IOCTLs (geometry,
+//      capacity, properties, TOC).  Results are reused until they expire or the
+//      media changes.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Number of results we keep, and the largest input and output buffers a
+// cacheable Request may have.  Together these bound the cache's memory.
+//
+constexpr ULONG GENFILTER_QUERY_CACHE_ENTRIES    = 16;
+constexpr ULONG GENFILTER_QUERY_CACHE_MAX_INPUT  = 64;
+constexpr ULONG GENFILTER_QUERY_CACHE_MAX_OUTPUT = 1024;
+
+//
+// How long a result stays valid, unless the "QueryCacheTtlMs" value in the
+// device's hardware key says otherwise.  Zero disables the cache.
+//
+constexpr ULONG GENFILTER_QUERY_CACHE_DEFAULT_TTL_MS = 5000;
+
+//
+// Entry states
+//
+// Free    - Unused
+// Pending - Reserved by a Request that's in flight; filled when it
+//           completes.  Never returned by a lookup, never recycled.
+// Valid   - Holds a result (which may nonetheless have expired, or be from
+//           an old epoch)
+//
+constexpr LONG GENFILTER_QUERY_CACHE_FREE    = 0;
+constexpr LONG GENFILTER_QUERY_CACHE_PENDING = 1;
+constexpr LONG GENFILTER_QUERY_CACHE_VALID   = 2;
+
+//
+// StackFlags and RequestorMode are part of the key, as they are for
+// coalescing (see GENFILTER_COALESCE_SLOT)
+//
+typedef struct _GENFILTER_QUERY_CACHE_ENTRY {
+    LONG            State;
+    LONG            Epoch;
+    ULONG           IoControlCode;
+    ULONG           InputLength;
+    ULONG           OutputLength;
+    ULONG           Information;
+    UCHAR           StackFlags;
+    KPROCESSOR_MODE RequestorMode;
+    ULONGLONG       Expires;            // Interrupt time, 100ns units
+    UCHAR           Input[GENFILTER_QUERY_CACHE_MAX_INPUT];
+    UCHAR           Output[GENFILTER_QUERY_CACHE_MAX_OUTPUT];
+} GENFILTER_QUERY_CACHE_ENTRY, *PGENFILTER_QUERY_CACHE_ENTRY;
+
+//
+// The per-device query result cache that lives in our device context
+//
+// Epoch: Results are only valid if they carry the current epoch, so bumping
+//        it (on a media change) discards every result at once, including
+//        those of Requests that are in flight.
+//
+typedef struct _GENFILTER_QUERY_CACHE {
+    EX_SPIN_LOCK                 Lock;
+    volatile LONG                Epoch;
+    ULONGLONG                    Ttl;   // 100ns units
+    PGENFILTER_QUERY_CACHE_ENTRY Entries;
+} GENFILTER_QUERY_CACHE, *PGENFILTER_QUERY_CACHE;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterQueryCacheInitialize(_In_ WDFDEVICE Device,
+                              _Out_ PGENFILTER_QUERY_CACHE QueryCache);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterQueryCacheRequest(_In_ WDFREQUEST Request,
+                           _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                           _In_ ULONG IoControlCode,
+                           _In_ size_t InputBufferLength,
+                           _In_ size_t OutputBufferLength);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterQueryCacheRequestDone(_In_ WDFREQUEST Request,
+                               _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                               _In_ NTSTATUS Status,
+                               _In_ ULONG_PTR Information);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterQueryCacheRelease(_In_ WDFREQUEST Request,
+                           _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// GenFilterQueryCacheInvalidate
+//
+// Discards every cached result, and keeps Requests in flight from adding
+// theirs
+//
+FORCEINLINE
+VOID
+GenFilterQueryCacheInvalidate(_In_ PGENFILTER_QUERY_CACHE QueryCache)
+{
+    InterlockedIncrement(&QueryCache->Epoch);
+}
@@ -0,0 +1,563 @@
+///
+/// @file GenFilterQueue.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+//
+// The Request type each Queue receives, and the registry value (in the
+// device's hardware key) that sets its limit.  Indexed by
+// GENFILTER_QUEUE_TYPE.
+//
+typedef struct _GENFILTER_QUEUE_INFO {
+    WDF_REQUEST_TYPE RequestType;
+    PCWSTR           MaxInFlightValueName;
+} GENFILTER_QUEUE_INFO;
+
+static const GENFILTER_QUEUE_INFO GenFilterQueueInfo[] = {
+    { WdfRequestTypeRead,          L"MaxInFlightRead" },
+    { WdfRequestTypeWrite,         L"MaxInFlightWrite" },
+    { WdfRequestTypeDeviceControl, L"MaxInFlightDeviceControl" },
+};
+
+static_assert(ARRAYSIZE(GenFilterQueueInfo) == GenFilterQueueTypeCount,
+              "GenFilterQueueInfo is out of date");
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueuesInitialize
+//
+//    Creates a Queue for each type of Request we process, and tells the
+//    Framework to dispatch Requests of that type to it.
+//
+//  INPUTS:
+//
+//      Device    - Our WDFDEVICE
+//
+//      Callbacks - The dispatcher the Queues present their Requests to
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the Queues could
+//                      not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Note that because this driver is a FILTER, any Request type we don't
+//      dispatch to one of our Queues is automatically forwarded by the
+//      Framework to our Local I/O Target.  So, for example, if you're not
+//      interested in inspecting READ Requests, you can just not create a
+//      Queue for them and the Framework will "do the right thing" and send
+//      them along.
+//
+//      Each Queue is parallel, but if the "MaxInFlightRead",
+//      "MaxInFlightWrite" or "MaxInFlightDeviceControl" DWORD value is set
+//      in the device's hardware key, the Framework presents us at most that
+//      many of the Queue's Requests at once.  The rest wait in the Queue
+//      until one of ours completes.  This keeps (for example) a burst of
+//      large reads from filling the device's queue ahead of a
+//      latency-sensitive IOCTL.  0, the default, means no limit.  Limits
+//      are only honored if Callbacks->Limited is set.
+//
+//      Read-aheads are our own Requests and aren't counted, but there are
+//      never more than GENFILTER_READAHEAD_SLOTS of them.
+//
+//      If the "SchedulerPolicy" DWORD value is set to a GENFILTER_SCHED_POLICY
+//      other than FIFO, limited read and write Queues are scheduled: the
+//      Framework presents up to "SchedulerWindow" more Requests than the
+//      limit, and we hold the extra ones and pick which to send next when
+//      one of ours completes (see GenFilterQueueSubmit).  With FIFO there's
+//      nothing to choose, so we leave the waiting to the Framework.
+//      "SchedulerDeadlineMs" is how long GenFilterSchedDeadline lets a
+//      Request wait before it goes next regardless of where it is.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterQueuesInitialize(WDFDEVICE                   Device,
+                          PCGENFILTER_QUEUE_CALLBACKS Callbacks)
+{
+    NTSTATUS              status;
+    WDFKEY                key = nullptr;
+    WDF_IO_QUEUE_CONFIG   ioQueueConfig;
+    WDF_OBJECT_ATTRIBUTES queueAttr;
+    WDF_OBJECT_ATTRIBUTES schedAttr;
+    WDFQUEUE              queue;
+    WDFMEMORY             memory;
+    PVOID                 storage;
+    ULONG                 policy     = GenFilterSchedFifo;
+    ULONG                 window     = GENFILTER_SCHED_DEFAULT_WINDOW;
+    ULONG                 deadlineMs = GENFILTER_SCHED_DEFAULT_DEADLINE_MS;
+    LARGE_INTEGER         frequency;
+
+    DECLARE_CONST_UNICODE_STRING(policyValueName,   L"SchedulerPolicy");
+    DECLARE_CONST_UNICODE_STRING(windowValueName,   L"SchedulerWindow");
+    DECLARE_CONST_UNICODE_STRING(deadlineValueName, L"SchedulerDeadlineMs");
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (!NT_SUCCESS(status)) {
+        key = nullptr;
+    }
+
+    if (key != nullptr) {
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &policyValueName,
+                                              &policy)) ||
+            policy >= GenFilterSchedPolicyCount) {
+            policy = GenFilterSchedFifo;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &windowValueName,
+                                              &window))) {
+            window = GENFILTER_SCHED_DEFAULT_WINDOW;
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &deadlineValueName,
+                                              &deadlineMs))) {
+            deadlineMs = GENFILTER_SCHED_DEFAULT_DEADLINE_MS;
+        }
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    for (ULONG type = 0; type < GenFilterQueueTypeCount; type++) {
+
+        PGENFILTER_QUEUE_CONTEXT queueContext;
+        UNICODE_STRING           valueName;
+        ULONG                    maxInFlight = 0;
+        BOOLEAN                  scheduled;
+
+        if (key != nullptr && Callbacks->Limited) {
+
+            RtlInitUnicodeString(&valueName,
+                                 GenFilterQueueInfo[type].MaxInFlightValueName);
+
+            if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                                  &valueName,
+                                                  &maxInFlight))) {
+                maxInFlight = 0;
+            }
+        }
+
+        scheduled = (maxInFlight != 0 &&
+                     policy != GenFilterSchedFifo &&
+                     window != 0 &&
+                     type != GenFilterQueueDeviceControl);
+
+        WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig,
+                                 WdfIoQueueDispatchParallel);
+
+        if (maxInFlight != 0) {
+            ioQueueConfig.Settings.Parallel.NumberOfPresentedRequests =
+                scheduled ? maxInFlight + window : maxInFlight;
+        }
+
+        switch (type) {
+        case GenFilterQueueRead:
+            ioQueueConfig.EvtIoRead = Callbacks->EvtRead;
+            break;
+        case GenFilterQueueWrite:
+            ioQueueConfig.EvtIoWrite = Callbacks->EvtWrite;
+            break;
+        default:
+            ioQueueConfig.EvtIoDeviceControl = Callbacks->EvtDeviceControl;
+            break;
+        }
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queueAttr,
+                                                GENFILTER_QUEUE_CONTEXT);
+
+        status = WdfIoQueueCreate(Device,
+                                  &ioQueueConfig,
+                                  &queueAttr,
+                                  &queue);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfIoQueueCreate failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        queueContext = GenFilterGetQueueContext(queue);
+        queueContext->Type        = (GENFILTER_QUEUE_TYPE)type;
+        queueContext->MaxInFlight = maxInFlight;
+
+        if (scheduled) {
+
+            WDF_OBJECT_ATTRIBUTES_INIT(&schedAttr);
+            schedAttr.ParentObject = queue;
+
+            status = WdfSpinLockCreate(&schedAttr,
+                                       &queueContext->SchedLock);
+
+            if (!NT_SUCCESS(status)) {
+#if DBG
+                DbgPrint("WdfSpinLockCreate for scheduler failed - 0x%x\n",
+                         status);
+#endif
+                goto done;
+            }
+
+            //
+            // Never more than window Requests are held at once, since the
+            // Framework presents no more than that beyond the limit
+            //
+            status = WdfMemoryCreate(&schedAttr,
+                                     NonPagedPoolNx,
+                                     'sFnG',
+                                     2 * (size_t)window * sizeof(PGENFILTER_SCHED_ENTRY),
+                                     &memory,
+                                     &storage);
+
+            if (!NT_SUCCESS(status)) {
+#if DBG
+                DbgPrint("WdfMemoryCreate for scheduler failed - 0x%x\n",
+                         status);
+#endif
+                goto done;
+            }
+
+            GenFilterSchedInitialize(&queueContext->Sched,
+                                     (GENFILTER_SCHED_POLICY)policy,
+                                     (PGENFILTER_SCHED_ENTRY*)storage,
+                                     window);
+
+            queueContext->DeadlineTicks = (frequency.QuadPart * deadlineMs) / 1000;
+            queueContext->Scheduled     = TRUE;
+        }
+
+        status = WdfDeviceConfigureRequestDispatching(Device,
+                                                      queue,
+                                                      GenFilterQueueInfo[type].RequestType);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfDeviceConfigureRequestDispatching failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (key != nullptr) {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueueSubmit
+//
+//    Sends a read or write Request that has to go to the device, or holds
+//    it if its Queue already has as many Requests in flight as it allows.
+//
+//  INPUTS:
+//
+//      Request     - The Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Offset      - The Request's DeviceOffset (what the elevator sorts on)
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if we took the Request (the caller must not touch it again), or
+//      FALSE if its Queue isn't scheduled and the caller should send it.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A held Request is cancelable.  If it's cancelled before we send it,
+//      GenFilterEvtHeldRequestCancel takes it out of the scheduler and
+//      completes it.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterQueueSubmit(WDFREQUEST                Request,
+                     PGENFILTER_DEVICE_CONTEXT DevContext,
+                     LONGLONG                  Offset)
+{
+    PGENFILTER_QUEUE_CONTEXT   queueContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    NTSTATUS                   status;
+
+    queueContext = GenFilterGetQueueContext(WdfRequestGetIoQueue(Request));
+
+    if (!queueContext->Scheduled) {
+        return FALSE;
+    }
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    WdfSpinLockAcquire(queueContext->SchedLock);
+
+    //
+    // Room at the device: send it now.  (The scheduler can't be full, given
+    // how many Requests the Framework gives us, but if it somehow were we'd
+    // rather exceed the limit than lose the Request.)
+    //
+    if (queueContext->InFlight < queueContext->MaxInFlight ||
+        GenFilterSchedIsFull(&queueContext->Sched)) {
+
+        queueContext->InFlight++;
+        reqContext->SchedInFlight = TRUE;
+
+        WdfSpinLockRelease(queueContext->SchedLock);
+
+        GenFilterSendWithCallback(Request,
+                                  DevContext);
+        return TRUE;
+    }
+
+    GenFilterSchedInsert(&queueContext->Sched,
+                         &reqContext->SchedEntry,
+                         (ULONGLONG)Offset,
+                         (ULONGLONG)(KeQueryPerformanceCounter(nullptr).QuadPart +
+                                     queueContext->DeadlineTicks));
+
+    status = WdfRequestMarkCancelableEx(Request,
+                                        GenFilterEvtHeldRequestCancel);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterSchedRemove(&queueContext->Sched,
+                             &reqContext->SchedEntry);
+    }
+
+    WdfSpinLockRelease(queueContext->SchedLock);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterCompleting(DevContext,
+                            Request,
+                            status);
+
+        WdfRequestComplete(Request,
+                           status);
+        return TRUE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatScheduled);
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterQueueRequestDone
+//
+//    Called for every Request we've sent with our completion callback, just
+//    before we complete it.  If it was one of its Queue's in-flight
+//    Requests, sends the held Request the scheduler picks in its place.
+//
+//  INPUTS:
+//
+//      Request     - The Request that's about to be completed
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      If the Request we pick has just been cancelled, its cancel routine
+//      completes it, and we pick another.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterQueueRequestDone(WDFREQUEST                Request,
+                          PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_QUEUE_CONTEXT   queueContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_SCHED_ENTRY     entry;
+    WDFREQUEST                 next = nullptr;
+    ULONGLONG                  now;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (!reqContext->SchedInFlight) {
+        return;
+    }
+
+    reqContext->SchedInFlight = FALSE;
+
+    queueContext = GenFilterGetQueueContext(WdfRequestGetIoQueue(Request));
+
+    now = (ULONGLONG)KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    WdfSpinLockAcquire(queueContext->SchedLock);
+
+    queueContext->InFlight--;
+
+    while (queueContext->InFlight < queueContext->MaxInFlight) {
+
+        entry = GenFilterSchedPop(&queueContext->Sched,
+                                  now);
+
+        if (entry == nullptr) {
+            break;
+        }
+
+        next = (WDFREQUEST)WdfObjectContextGetObject(CONTAINING_RECORD(entry,
+                                                                       GENFILTER_REQUEST_CONTEXT,
+                                                                       SchedEntry));
+
+        if (WdfRequestUnmarkCancelable(next) == STATUS_CANCELLED) {
+            next = nullptr;
+            continue;
+        }
+
+        queueContext->InFlight++;
+        GenFilterGetRequestContext(next)->SchedInFlight = TRUE;
+        break;
+    }
+
+    WdfSpinLockRelease(queueContext->SchedLock);
+
+    if (next != nullptr) {
+
+        GenFilterSendWithCallback(next,
+                                  DevContext);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterEvtHeldRequestCancel
+//
+//    Called by the Framework when a Request we're holding in a scheduler is
+//    cancelled.
+//
+//  INPUTS:
+//
+//      Request - The cancelled Request
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      We always complete the Request here.  If GenFilterQueueRequestDone
+//      popped it at the same moment, it found the Request couldn't be
+//      unmarked cancelable and left it to us.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterEvtHeldRequestCancel(WDFREQUEST Request)
+{
+    PGENFILTER_QUEUE_CONTEXT   queueContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDFQUEUE                   queue;
+
+    queue        = WdfRequestGetIoQueue(Request);
+    queueContext = GenFilterGetQueueContext(queue);
+    reqContext   = GenFilterGetRequestContext(Request);
+
+    WdfSpinLockAcquire(queueContext->SchedLock);
+
+    if (reqContext->SchedEntry.Queued) {
+
+        GenFilterSchedRemove(&queueContext->Sched,
+                             &reqContext->SchedEntry);
+    }
+
+    WdfSpinLockRelease(queueContext->SchedLock);
+
+    GenFilterCompleting(GenFilterGetDeviceContext(WdfIoQueueGetDevice(queue)),
+                        Request,
+                        STATUS_CANCELLED);
+
+    WdfRequestComplete(Request,
+                       STATUS_CANCELLED);
+}
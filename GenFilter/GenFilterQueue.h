@@ -0,0 +1,171 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterQueue.h
+//
+//    ABSTRACT:
+//
+//      Our I/O Queues.  Reads, writes and device controls each arrive on a
+//      Queue of their own, and each Queue can limit how many of its Requests
+//      are outstanding at the device below us at once.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterSched.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Defaults for the scheduler settings in the device's hardware key (see
+// GenFilterQueuesInitialize)
+//
+#define GENFILTER_SCHED_DEFAULT_WINDOW          32
+#define GENFILTER_SCHED_DEFAULT_DEADLINE_MS     500
+
+//
+// Our Queues, one per Request type
+//
+typedef enum _GENFILTER_QUEUE_TYPE {
+    GenFilterQueueRead = 0,
+    GenFilterQueueWrite,
+    GenFilterQueueDeviceControl,
+
+    GenFilterQueueTypeCount             // Must be last
+} GENFILTER_QUEUE_TYPE;
+
+//
+// Our per Queue context
+//
+typedef struct _GENFILTER_QUEUE_CONTEXT {
+    GENFILTER_QUEUE_TYPE Type;
+
+    //
+    // Most Requests from this Queue we'll have outstanding at once, or 0 for
+    // no limit
+    //
+    ULONG                MaxInFlight;
+
+    //
+    // Set if we hold Requests back ourselves, rather than leaving them in
+    // the Queue, so that Sched can choose which goes next.  Only read and
+    // write Queues with a limit are scheduled.  InFlight and Sched are
+    // protected by SchedLock.
+    //
+    BOOLEAN              Scheduled;
+    WDFSPINLOCK          SchedLock;
+    ULONG                InFlight;
+    LONGLONG             DeadlineTicks;
+    GENFILTER_SCHED      Sched;
+} GENFILTER_QUEUE_CONTEXT, *PGENFILTER_QUEUE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(GENFILTER_QUEUE_CONTEXT,
+                                   GenFilterGetQueueContext)
+
+//
+// How the rest of the filter sends a Request with its device's dispatcher,
+// and tells the dispatcher's policies it's about to complete one
+//
+typedef VOID
+GENFILTER_SEND(_In_ WDFREQUEST Request,
+               _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+typedef GENFILTER_SEND* PGENFILTER_SEND;
+
+typedef VOID
+GENFILTER_COMPLETING(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                     _In_ WDFREQUEST Request,
+                     _In_ NTSTATUS Status);
+
+typedef GENFILTER_COMPLETING* PGENFILTER_COMPLETING;
+
+//
+// The dispatcher our Queues present Requests to (see GenFilterPolicy.h).
+// Limited is FALSE for a dispatcher that may send-and-forget any Request,
+// in which case the Queues' limits in the registry are ignored.  The rest
+// of the filter finds the dispatcher's send routines, and its completing
+// hook, through the device context (see GenFilterForward).
+//
+typedef struct _GENFILTER_QUEUE_CALLBACKS {
+    PFN_WDF_IO_QUEUE_IO_READ           EvtRead;
+    PFN_WDF_IO_QUEUE_IO_WRITE          EvtWrite;
+    PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtDeviceControl;
+    BOOLEAN                            Limited;
+    PGENFILTER_SEND                    Forward;
+    PGENFILTER_SEND                    SendWithCallback;
+    PGENFILTER_COMPLETING              Completing;
+} GENFILTER_QUEUE_CALLBACKS;
+
+typedef const GENFILTER_QUEUE_CALLBACKS* PCGENFILTER_QUEUE_CALLBACKS;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterQueuesInitialize(_In_ WDFDEVICE Device,
+                          _In_ PCGENFILTER_QUEUE_CALLBACKS Callbacks);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterQueueSubmit(_In_ WDFREQUEST Request,
+                     _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                     _In_ LONGLONG Offset);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterQueueRequestDone(_In_ WDFREQUEST Request,
+                          _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+EVT_WDF_REQUEST_CANCEL GenFilterEvtHeldRequestCancel;
+
+//
+// GenFilterQueueIsLimited
+//
+// TRUE if the Queue a Request came from limits how many Requests it has
+// in flight.  The Framework can only enforce the limit if it sees the
+// Request complete, so such Requests must not be sent-and-forgotten.
+//
+FORCEINLINE
+BOOLEAN
+GenFilterQueueIsLimited(_In_ WDFREQUEST Request)
+{
+    return GenFilterGetQueueContext(WdfRequestGetIoQueue(Request))->MaxInFlight != 0;
+}
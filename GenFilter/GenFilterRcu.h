@@ -0,0 +1,226 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterRcu.h
+//
+//    ABSTRACT:
+//
+//      Read-copy-update for data that's read on every Request and changed
+//      rarely.  Readers take no lock and never wait; they bump a counter of
+//      their own processor's.  A writer publishes a new copy with one atomic
+//      exchange, then waits for every reader that might still be looking at the
+//      old copy to finish before freeing it.  Like GenFilterSlab.h, this file
+//      doesn't use WDF, so GenFilterCtl can stress test the same code.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+//
+// One processor's reader counts.  A reader counts itself into Locks on the
+// processor it starts on and into Unlocks on the processor it finishes on
+// (the same one, unless it was running at PASSIVE_LEVEL and migrated), in
+// whichever of the two phases was current when it started.  Only the sums
+// over all processors mean anything.  Cache aligned so that readers on
+// different processors never share a line.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_RCU_CPU {
+    volatile LONG Locks[2];
+    volatile LONG Unlocks[2];
+} GENFILTER_RCU_CPU, *PGENFILTER_RCU_CPU;
+
+//
+// The protected pointer and its readers
+//
+// A phase is idle once its Unlocks add up to its Locks.  Counts only ever
+// go up (wrapping), so we sum the Unlocks first: a reader that finishes
+// while we're summing can only make us see too few, never too many, and a
+// phase is only taken to be idle if every reader we counted in has also
+// been counted out.
+//
+typedef struct _GENFILTER_RCU {
+    void* volatile     Current;
+    volatile LONG      Phase;           // Low bit is the phase new readers use
+    ULONG              CpuCount;
+    PGENFILTER_RCU_CPU Cpus;
+} GENFILTER_RCU, *PGENFILTER_RCU;
+
+inline
+void
+GenFilterRcuInitialize(PGENFILTER_RCU     Rcu,
+                       void*              Initial,
+                       PGENFILTER_RCU_CPU Cpus,
+                       ULONG              CpuCount)
+{
+    Rcu->Current  = Initial;
+    Rcu->Phase    = 0;
+    Rcu->CpuCount = CpuCount;
+    Rcu->Cpus     = Cpus;
+
+    for (ULONG cpu = 0; cpu < CpuCount; cpu++) {
+        Cpus[cpu].Locks[0]   = 0;
+        Cpus[cpu].Locks[1]   = 0;
+        Cpus[cpu].Unlocks[0] = 0;
+        Cpus[cpu].Unlocks[1] = 0;
+    }
+}
+
+//
+// GenFilterRcuReadLock
+//
+// Starts a read on processor Cpu and returns the current pointer, which
+// stays valid until the matching GenFilterRcuReadUnlock.  *Phase must be
+// passed to it.
+//
+// The interlocked increment is a full barrier, so we're counted in before
+// we read the pointer: a writer that sees our phase idle either saw us
+// finish, or we haven't started yet and will read what it published.
+//
+inline
+void*
+GenFilterRcuReadLock(PGENFILTER_RCU Rcu,
+                     ULONG          Cpu,
+                     PULONG         Phase)
+{
+    ULONG phase = (ULONG)Rcu->Phase & 1;
+
+    if (Cpu >= Rcu->CpuCount) {
+        Cpu %= Rcu->CpuCount;
+    }
+
+    InterlockedIncrement(&Rcu->Cpus[Cpu].Locks[phase]);
+
+    *Phase = phase;
+
+    return Rcu->Current;
+}
+
+//
+// GenFilterRcuReadUnlock
+//
+// Ends a read.  Cpu is the processor we're on now.  The increment is a full
+// barrier, so everything we read through the pointer was read first.
+//
+inline
+void
+GenFilterRcuReadUnlock(PGENFILTER_RCU Rcu,
+                       ULONG          Cpu,
+                       ULONG          Phase)
+{
+    if (Cpu >= Rcu->CpuCount) {
+        Cpu %= Rcu->CpuCount;
+    }
+
+    InterlockedIncrement(&Rcu->Cpus[Cpu].Unlocks[Phase]);
+}
+
+//
+// GenFilterRcuPublish
+//
+// Makes New the pointer readers see, and returns the old one.  The old one
+// must not be freed until a GenFilterRcuSynchronize that started after we
+// returned has returned too.  Each old pointer is returned exactly once,
+// so publishers don't need to be serialized.
+//
+inline
+void*
+GenFilterRcuPublish(PGENFILTER_RCU Rcu,
+                    void*          New)
+{
+    return InterlockedExchangePointer((void* volatile*)&Rcu->Current,
+                                      New);
+}
+
+//
+// GenFilterRcuPhaseIdle
+//
+// TRUE if every reader that started in Phase has finished
+//
+inline
+bool
+GenFilterRcuPhaseIdle(PGENFILTER_RCU Rcu,
+                      ULONG          Phase)
+{
+    ULONG locks   = 0;
+    ULONG unlocks = 0;
+
+    for (ULONG cpu = 0; cpu < Rcu->CpuCount; cpu++) {
+        unlocks += (ULONG)Rcu->Cpus[cpu].Unlocks[Phase];
+    }
+
+    MemoryBarrier();
+
+    for (ULONG cpu = 0; cpu < Rcu->CpuCount; cpu++) {
+        locks += (ULONG)Rcu->Cpus[cpu].Locks[Phase];
+    }
+
+    return locks == unlocks;
+}
+
+//
+// GenFilterRcuSynchronize
+//
+// Waits until every reader that started before we were called has
+// finished, calling Wait() between looks.  Only one call may be in
+// progress at a time; the caller has to serialize them.
+//
+// We switch new readers to the other phase and wait for the old one to
+// empty, twice.  Once isn't enough: a reader can read the phase just
+// before we switch it and count itself in just after we've seen that
+// phase empty.  It will have read the newest pointer, so it doesn't hold
+// up this call, but it's still in the phase we'd wait on next time --
+// and by then it may be looking at the pointer that call is about to
+// free.  The second switch waits it out.
+//
+template <typename WAIT>
+inline
+void
+GenFilterRcuSynchronize(PGENFILTER_RCU Rcu,
+                        WAIT           Wait)
+{
+    for (ULONG pass = 0; pass < 2; pass++) {
+
+        ULONG phase = (ULONG)InterlockedIncrement(&Rcu->Phase) & 1;
+
+        while (!GenFilterRcuPhaseIdle(Rcu,
+                                      phase ^ 1)) {
+            Wait();
+        }
+    }
+}
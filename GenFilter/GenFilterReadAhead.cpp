@@ -0,0 +1,503 @@
+///
+/// @file GenFilterReadAhead.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+VOID
+GenFilterReadAheadSend(_In_ PGENFILTER_READAHEAD_SLOT Slot,
+                       _In_ ULONG                     Length);
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE GenFilterReadAheadCompletion;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterReadAheadInitialize
+//
+//    Creates the read-ahead stream table lock, and the pool of Requests
+//    and buffers we read ahead with.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why read-ahead could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Everything is allocated here so that reading ahead never needs to
+//      allocate anything (and so can never fail for lack of memory).
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterReadAheadInitialize(WDFDEVICE                 Device,
+                             PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    PGENFILTER_READAHEAD  readAhead;
+    PVOID                 buffer;
+
+    readAhead = &DevContext->ReadAhead;
+
+    RtlZeroMemory(readAhead,
+                  sizeof(GENFILTER_READAHEAD));
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &readAhead->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for read-ahead failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < GENFILTER_READAHEAD_SLOTS; index++) {
+
+        PGENFILTER_READAHEAD_SLOT slot = &readAhead->Slots[index];
+
+        status = WdfRequestCreate(&objectAttr,
+                                  WdfDeviceGetIoTarget(Device),
+                                  &slot->Request);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfRequestCreate for read-ahead failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        status = WdfMemoryCreate(&objectAttr,
+                                 NonPagedPoolNx,
+                                 'aFnG',
+                                 GENFILTER_READAHEAD_MAX_DEPTH,
+                                 &slot->Memory,
+                                 &buffer);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfMemoryCreate for read-ahead failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        slot->Buffer     = (PUCHAR)buffer;
+        slot->DevContext = DevContext;
+    }
+
+    status = GenFilterPoolCreate(Device,
+                                 &DevContext->Pools[GenFilterPoolReadAhead],
+                                 readAhead->Slots,
+                                 sizeof(GENFILTER_READAHEAD_SLOT),
+                                 GENFILTER_READAHEAD_SLOTS);
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterReadAheadNoteRead
+//
+//    Called for every cacheable read we see.  Matches the read against the
+//    streams we're tracking, adjusts that stream's read-ahead depth, and
+//    if the stream has consumed half of what we read ahead for it, reads
+//    ahead again.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Offset      - The device offset of the read
+//
+//      Length      - The length of the read
+//
+//      CacheHit    - TRUE if the read was satisfied from the cache
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      A read belongs to a stream if it starts exactly where the stream's
+//      last read ended.  Anything else starts a new stream, replacing the
+//      least recently used one.
+//
+//      If every pool slot is busy we simply don't read ahead this time.
+//      The stream's AheadOffset doesn't move, so the next read tries again.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterReadAheadNoteRead(PGENFILTER_DEVICE_CONTEXT DevContext,
+                           LONGLONG                  Offset,
+                           size_t                    Length,
+                           BOOLEAN                   CacheHit)
+{
+    PGENFILTER_READAHEAD        readAhead;
+    PGENFILTER_READAHEAD_STREAM stream = nullptr;
+    PGENFILTER_READAHEAD_SLOT   slot   = nullptr;
+    ULONG                       length = 0;
+
+    readAhead = &DevContext->ReadAhead;
+
+    WdfSpinLockAcquire(readAhead->Lock);
+
+    readAhead->Clock++;
+
+    for (ULONG index = 0; index < GENFILTER_READAHEAD_STREAMS; index++) {
+
+        if (readAhead->Streams[index].Sequential != 0 &&
+            readAhead->Streams[index].NextOffset == Offset) {
+
+            stream = &readAhead->Streams[index];
+            break;
+        }
+    }
+
+    if (stream == nullptr) {
+
+        //
+        // A new stream.  Recycle the least recently used slot.
+        //
+        stream = &readAhead->Streams[0];
+
+        for (ULONG index = 1; index < GENFILTER_READAHEAD_STREAMS; index++) {
+
+            if (readAhead->Clock - readAhead->Streams[index].LastUsed >
+                readAhead->Clock - stream->LastUsed) {
+
+                stream = &readAhead->Streams[index];
+            }
+        }
+
+        stream->NextOffset  = Offset + (LONGLONG)Length;
+        stream->AheadOffset = stream->NextOffset;
+        stream->Depth       = GENFILTER_READAHEAD_MIN_DEPTH;
+        stream->Sequential  = 1;
+        stream->LastUsed    = readAhead->Clock;
+
+        goto done;
+    }
+
+    stream->NextOffset = Offset + (LONGLONG)Length;
+    stream->LastUsed   = readAhead->Clock;
+
+    if (stream->Sequential < GENFILTER_READAHEAD_TRIGGER) {
+        stream->Sequential++;
+    }
+
+    //
+    // Was this read inside what we've already read ahead?  If so, whether
+    // it hit tells us whether we're reading ahead far enough.  A miss means
+    // the data was evicted before it was used, or the read-ahead hadn't
+    // completed yet; either way, reading further ahead won't help.
+    //
+    if (Offset < stream->AheadOffset) {
+
+        if (CacheHit) {
+            stream->Depth = min(stream->Depth * 2,
+                                GENFILTER_READAHEAD_MAX_DEPTH);
+        } else {
+            stream->Depth = max(stream->Depth / 2,
+                                GENFILTER_READAHEAD_MIN_DEPTH);
+        }
+    }
+
+    if (stream->Sequential < GENFILTER_READAHEAD_TRIGGER) {
+        goto done;
+    }
+
+    if (stream->AheadOffset < stream->NextOffset) {
+        stream->AheadOffset = stream->NextOffset;
+    }
+
+    //
+    // Wait until the stream has used up at least half of what we read
+    // ahead for it before reading ahead again
+    //
+    if (stream->AheadOffset - stream->NextOffset >= (LONGLONG)(stream->Depth / 2)) {
+        goto done;
+    }
+
+    slot = (PGENFILTER_READAHEAD_SLOT)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolReadAhead]);
+
+    if (slot == nullptr) {
+        goto done;
+    }
+
+    slot->Offset        = stream->AheadOffset;
+    length              = stream->Depth;
+    stream->AheadOffset += length;
+
+done:
+
+    WdfSpinLockRelease(readAhead->Lock);
+
+    if (slot != nullptr) {
+        GenFilterReadAheadSend(slot,
+                               length);
+    }
+}
+
+//
+// GenFilterReadAheadSend
+//
+// Sends the read-ahead for a slot we've claimed.  If it can't be sent the
+// slot is released again.
+//
+static
+VOID
+GenFilterReadAheadSend(PGENFILTER_READAHEAD_SLOT Slot,
+                       ULONG                     Length)
+{
+    NTSTATUS                  status;
+    WDF_REQUEST_REUSE_PARAMS  reuseParams;
+    WDFMEMORY_OFFSET          memoryOffset;
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    WDFIOTARGET               ioTarget;
+
+    devContext = Slot->DevContext;
+    ioTarget   = WdfDeviceGetIoTarget(devContext->WdfDevice);
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams,
+                                  WDF_REQUEST_REUSE_NO_FLAGS,
+                                  STATUS_SUCCESS);
+
+    status = WdfRequestReuse(Slot->Request,
+                             &reuseParams);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    memoryOffset.BufferOffset = 0;
+    memoryOffset.BufferLength = Length;
+
+    status = WdfIoTargetFormatRequestForRead(ioTarget,
+                                             Slot->Request,
+                                             Slot->Memory,
+                                             &memoryOffset,
+                                             &Slot->Offset);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // Whatever is invalidated while this is in flight won't be cached, or
+    // checksummed, from what we read
+    //
+    GenFilterCacheGetTicket(&devContext->Cache,
+                            &Slot->CacheTicket);
+
+    Slot->IntegrityEpoch = GenFilterIntegrityGetSequence(&devContext->Integrity);
+
+    WdfRequestSetCompletionRoutine(Slot->Request,
+                                   GenFilterReadAheadCompletion,
+                                   Slot);
+
+    GenFilterTrace(&devContext->Trace,
+                   GenFilterTraceReadAhead,
+                   Slot->Request,
+                   STATUS_SUCCESS,
+                   (ULONGLONG)Slot->Offset);
+
+    if (!WdfRequestSend(Slot->Request,
+                        ioTarget,
+                        WDF_NO_SEND_OPTIONS)) {
+
+        status = WdfRequestGetStatus(Slot->Request);
+
+        GenFilterTrace(&devContext->Trace,
+                       GenFilterTraceSendFailed,
+                       Slot->Request,
+                       status,
+                       0);
+        goto done;
+    }
+
+    GenFilterStatsIncrement(&devContext->Stats,
+                            GenFilterStatReadAheads);
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (!NT_SUCCESS(status)) {
+        GenFilterPoolFree(&devContext->Pools[GenFilterPoolReadAhead],
+                          Slot);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterReadAheadCompletion
+//
+//    This routine is called by the Framework when one of our read-ahead
+//    Requests has been completed by the I/O Target.  We add whatever was
+//    read to the cache and return the slot to the pool.
+//
+//  INPUTS:
+//
+//      Request  - The read-ahead Request
+//
+//      Target   - The I/O target we sent it to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The pool slot the Request belongs to
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The Request is ours (we created it), so it is not completed here.
+//      A read-ahead past the end of the media just fails, which is fine.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterReadAheadCompletion(WDFREQUEST                     Request,
+                             WDFIOTARGET                    Target,
+                             PWDF_REQUEST_COMPLETION_PARAMS Params,
+                             WDFCONTEXT                     Context)
+{
+    auto*                     slot = (PGENFILTER_READAHEAD_SLOT)Context;
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    NTSTATUS                  status;
+    size_t                    length;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    devContext = slot->DevContext;
+    status     = Params->IoStatus.Status;
+    length     = Params->IoStatus.Information;
+
+    GenFilterTrace(&devContext->Trace,
+                   GenFilterTraceCompletion,
+                   Request,
+                   status,
+                   length);
+
+    if (NT_SUCCESS(status)) {
+
+        if (length > GENFILTER_READAHEAD_MAX_DEPTH) {
+            length = GENFILTER_READAHEAD_MAX_DEPTH;
+        }
+
+        GenFilterIntegrityCheck(devContext,
+                                Request,
+                                slot->IntegrityEpoch,
+                                slot->Offset,
+                                slot->Buffer,
+                                length);
+
+        //
+        // The cache only holds data that passed inspection, and nothing
+        // while a verify is pending
+        //
+        if (GenFilterCacheVerifyPending(devContext)) {
+
+            GenFilterMediaChanged(devContext);
+
+        } else if (!GenFilterInspectBuffer(devContext,
+                                           Request,
+                                           slot->Offset,
+                                           slot->Buffer,
+                                           length)) {
+
+            GenFilterCacheFill(&devContext->Cache,
+                               &slot->CacheTicket,
+                               slot->Offset,
+                               slot->Buffer,
+                               length);
+        }
+
+        GenFilterStatsAdd(&devContext->Stats,
+                          GenFilterStatReadAheadBytes,
+                          (LONG64)length);
+    }
+
+    GenFilterPoolFree(&devContext->Pools[GenFilterPoolReadAhead],
+                      slot);
+}
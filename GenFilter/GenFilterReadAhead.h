@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterReadAhead.h
+//
+//    ABSTRACT:
+//
+//      Sequential read detection and asynchronous read-ahead.  When a stream of
+//      sequential reads is spotted, the filter reads ahead of it into the sector
+//      cache (see GenFilterCache.h) using a small pool of preallocated Requests,
+//      so the reads that follow complete from memory.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Number of sequential streams we track at once.  Interleaved streams
+// (two copies running from the same disc, say) each get their own slot;
+// the least recently used slot is recycled for a new stream.
+//
+constexpr ULONG GENFILTER_READAHEAD_STREAMS = 8;
+
+//
+// Read-ahead Requests (and buffers) in the pool.  This bounds both the
+// memory used for read-ahead and the number of read-aheads in flight.
+//
+constexpr ULONG GENFILTER_READAHEAD_SLOTS = 4;
+
+//
+// Read-ahead depth limits, in bytes.  A stream starts at the minimum; its
+// depth doubles each time a read is satisfied by data we read ahead, and
+// halves each time a read we had read ahead for misses anyway.
+//
+constexpr ULONG GENFILTER_READAHEAD_MIN_DEPTH = 32 * 1024;
+constexpr ULONG GENFILTER_READAHEAD_MAX_DEPTH = 128 * 1024;
+
+//
+// Sequential reads a stream must see before we start reading ahead for it
+//
+constexpr ULONG GENFILTER_READAHEAD_TRIGGER = 2;
+
+//
+// One tracked stream.  All fields are protected by GENFILTER_READAHEAD.Lock.
+//
+typedef struct _GENFILTER_READAHEAD_STREAM {
+    LONGLONG NextOffset;                // Where we expect its next read
+    LONGLONG AheadOffset;               // End of what we've read ahead
+    ULONG    Depth;                     // Bytes per read-ahead
+    ULONG    Sequential;                // Sequential reads seen
+    ULONG    LastUsed;                  // For LRU replacement
+} GENFILTER_READAHEAD_STREAM, *PGENFILTER_READAHEAD_STREAM;
+
+//
+// One preallocated read-ahead Request and its buffer.  Free slots are kept
+// in DevContext->Pools[GenFilterPoolReadAhead].
+//
+typedef struct _GENFILTER_READAHEAD_SLOT {
+    WDFREQUEST                Request;
+    WDFMEMORY                 Memory;
+    PUCHAR                    Buffer;
+    LONGLONG                  Offset;
+    GENFILTER_CACHE_TICKET    CacheTicket;
+    LONG                      IntegrityEpoch;
+    PGENFILTER_DEVICE_CONTEXT DevContext;
+} GENFILTER_READAHEAD_SLOT, *PGENFILTER_READAHEAD_SLOT;
+
+//
+// The per-device read-ahead state that lives in our device context
+//
+typedef struct _GENFILTER_READAHEAD {
+    WDFSPINLOCK                Lock;
+    ULONG                      Clock;
+    GENFILTER_READAHEAD_STREAM Streams[GENFILTER_READAHEAD_STREAMS];
+    GENFILTER_READAHEAD_SLOT   Slots[GENFILTER_READAHEAD_SLOTS];
+} GENFILTER_READAHEAD, *PGENFILTER_READAHEAD;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterReadAheadInitialize(_In_ WDFDEVICE Device,
+                             _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterReadAheadNoteRead(_In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                           _In_ LONGLONG Offset,
+                           _In_ size_t Length,
+                           _In_ BOOLEAN CacheHit);
@@ -0,0 +1,707 @@
+///
+/// @file GenFilterRetry.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+VOID
+GenFilterRetryReadStatuses(_In_ WDFDEVICE Device,
+                           _In_ WDFKEY Key,
+                           _Inout_ PGENFILTER_RETRY Retry);
+
+static
+BOOLEAN
+GenFilterRetryIsRetryable(_In_ PGENFILTER_RETRY Retry,
+                          _In_ WDFREQUEST Request,
+                          _In_ NTSTATUS Status);
+
+static
+VOID
+GenFilterRetrySend(_In_ WDFREQUEST Request,
+                   _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+static
+VOID
+GenFilterRetryFinish(_In_ WDFREQUEST Request,
+                     _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                     _In_ NTSTATUS Status);
+
+EVT_WDF_TIMER          GenFilterRetryEvtTimer;
+EVT_WDF_REQUEST_CANCEL GenFilterRetryEvtCancel;
+
+//
+// The statuses we retry if the "RetryStatuses" value doesn't say.  We
+// leave out STATUS_DEVICE_NOT_READY: from a CD-ROM it usually means there's
+// no disc, and that isn't going to change in a second or two.
+//
+static const NTSTATUS GenFilterRetryDefaultStatuses[] = {
+    STATUS_DEVICE_BUSY,
+    STATUS_BUS_RESET,
+    STATUS_IO_TIMEOUT,
+    STATUS_INSUFFICIENT_RESOURCES,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterRetryInitialize
+//
+//    Reads the retry settings from the device's hardware key and, if
+//    retrying is on, creates the lock and timer for the Requests waiting
+//    to go again.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why retrying could not
+//                      be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Retrying is off unless "RetryAttempts" is set: it's how many times a
+//      Request may be sent again (at most GENFILTER_RETRY_LIMIT_ATTEMPTS).
+//      "RetryBaseMs" and "RetryMaxMs" bound the backoff (see
+//      GenFilterRetryBackoff), and "RetryStatuses" lists the statuses to
+//      retry, one per string, written like 0x80000011.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterRetryInitialize(WDFDEVICE                 Device,
+                         PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_TIMER_CONFIG      timerConfig;
+    PGENFILTER_RETRY      retry;
+    WDFKEY                key      = nullptr;
+    ULONG                 attempts = 0;
+
+    DECLARE_CONST_UNICODE_STRING(attemptsValueName, L"RetryAttempts");
+    DECLARE_CONST_UNICODE_STRING(baseValueName, L"RetryBaseMs");
+    DECLARE_CONST_UNICODE_STRING(maxValueName, L"RetryMaxMs");
+
+    retry = &DevContext->Retry;
+
+    RtlZeroMemory(retry,
+                  sizeof(GENFILTER_RETRY));
+
+    InitializeListHead(&retry->Waiting);
+
+    retry->BaseMs      = GENFILTER_RETRY_DEFAULT_BASE_MS;
+    retry->MaxMs       = GENFILTER_RETRY_DEFAULT_MAX_MS;
+    retry->StatusCount = ARRAYSIZE(GenFilterRetryDefaultStatuses);
+
+    RtlCopyMemory(retry->Statuses,
+                  GenFilterRetryDefaultStatuses,
+                  sizeof(GenFilterRetryDefaultStatuses));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (!NT_SUCCESS(status)) {
+        key    = nullptr;
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                          &attemptsValueName,
+                                          &attempts)) ||
+        attempts == 0) {
+
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    if (attempts > GENFILTER_RETRY_LIMIT_ATTEMPTS) {
+        attempts = GENFILTER_RETRY_LIMIT_ATTEMPTS;
+    }
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &baseValueName,
+                                &retry->BaseMs);
+
+    (VOID)WdfRegistryQueryULong(key,
+                                &maxValueName,
+                                &retry->MaxMs);
+
+    if (retry->MaxMs > GENFILTER_RETRY_LIMIT_MS) {
+        retry->MaxMs = GENFILTER_RETRY_LIMIT_MS;
+    }
+
+    if (retry->BaseMs == 0) {
+        retry->BaseMs = 1;
+    }
+
+    if (retry->BaseMs > retry->MaxMs) {
+        retry->BaseMs = retry->MaxMs;
+    }
+
+    GenFilterRetryReadStatuses(Device,
+                               key,
+                               retry);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &retry->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for retries failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // We do our own locking, so the timer doesn't need the Framework's
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig,
+                          GenFilterRetryEvtTimer);
+
+    timerConfig.AutomaticSerialization = FALSE;
+
+    status = WdfTimerCreate(&timerConfig,
+                            &objectAttr,
+                            &retry->Timer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfTimerCreate for retries failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // Only now that everything's in place do we start retrying
+    //
+    retry->MaxAttempts = attempts;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (key != nullptr) {
+        WdfRegistryClose(key);
+    }
+
+    return status;
+}
+
+//
+// GenFilterRetryReadStatuses
+//
+// Replaces the default statuses with the ones in "RetryStatuses", if it
+// has any we can read.  Anything past GENFILTER_RETRY_MAX_STATUSES, and
+// success statuses, are ignored.
+//
+static
+VOID
+GenFilterRetryReadStatuses(WDFDEVICE        Device,
+                           WDFKEY           Key,
+                           PGENFILTER_RETRY Retry)
+{
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDF_OBJECT_ATTRIBUTES stringAttr;
+    WDFCOLLECTION         strings = nullptr;
+    NTSTATUS              statuses[GENFILTER_RETRY_MAX_STATUSES];
+    ULONG                 count   = 0;
+
+    DECLARE_CONST_UNICODE_STRING(statusesValueName, L"RetryStatuses");
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    if (!NT_SUCCESS(WdfCollectionCreate(&objectAttr,
+                                        &strings))) {
+#if DBG
+        DbgPrint("WdfCollectionCreate for retries failed\n");
+#endif
+        strings = nullptr;
+        goto done;
+    }
+
+    //
+    // The strings go when the collection does
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT(&stringAttr);
+    stringAttr.ParentObject = strings;
+
+    if (!NT_SUCCESS(WdfRegistryQueryMultiString(Key,
+                                                &statusesValueName,
+                                                &stringAttr,
+                                                strings))) {
+        goto done;
+    }
+
+    for (ULONG index = 0; index < WdfCollectionGetCount(strings); index++) {
+
+        UNICODE_STRING string;
+        ULONG          value;
+
+        WdfStringGetUnicodeString((WDFSTRING)WdfCollectionGetItem(strings,
+                                                                  index),
+                                  &string);
+
+        if (count == GENFILTER_RETRY_MAX_STATUSES ||
+            !NT_SUCCESS(RtlUnicodeStringToInteger(&string,
+                                                  0,
+                                                  &value)) ||
+            NT_SUCCESS((NTSTATUS)value)) {
+#if DBG
+            DbgPrint("Ignoring retry status %wZ\n",
+                     &string);
+#endif
+            continue;
+        }
+
+        statuses[count++] = (NTSTATUS)value;
+    }
+
+    if (count != 0) {
+
+        RtlCopyMemory(Retry->Statuses,
+                      statuses,
+                      count * sizeof(NTSTATUS));
+
+        Retry->StatusCount = count;
+    }
+
+done:
+
+    if (strings != nullptr) {
+        WdfObjectDelete(strings);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterRetryRequest
+//
+//    Called from our completion callback with the status a Request came
+//    back from the device with.  If it's one we retry, and the Request
+//    has attempts left, puts it on the list of Requests waiting to go
+//    again and makes sure the timer will send it when it's due.
+//
+//  INPUTS:
+//
+//      Request     - The Request that's been completed by the device below
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Status      - The status it was completed with
+//
+//      Completion  - Our completion callback, to send it again with
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the Request will be sent again (the caller must not touch it
+//      again), or FALSE if the caller should complete it.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Reads and writes are retried, and so are the device controls we know
+//      to be idempotent (those routed with GENFILTER_ROUTE_FLAG_COALESCE).
+//      Anything else might not be safe to do twice.
+//
+//      A Request that's cancelled while it waits, or that we can't send
+//      again, is handed back to Completion with the status it ended up
+//      with, so that everything our completion callback does for a Request
+//      is still done exactly once.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterRetryRequest(WDFREQUEST                         Request,
+                      PGENFILTER_DEVICE_CONTEXT          DevContext,
+                      NTSTATUS                           Status,
+                      PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_RETRY           retry;
+    PLIST_ENTRY                entry;
+    NTSTATUS                   status;
+    ULONGLONG                  random;
+    LONGLONG                   now;
+
+    reqContext = GenFilterGetRequestContext(Request);
+    retry      = &DevContext->Retry;
+
+    if (NT_SUCCESS(Status)) {
+
+        if (reqContext->RetryCount != 0) {
+
+            GenFilterStatsIncrement(&DevContext->Stats,
+                                    GenFilterStatRetrySucceeded);
+        }
+
+        return FALSE;
+    }
+
+    if (reqContext->RetryFinal ||
+        WdfRequestIsCanceled(Request) ||
+        !GenFilterRetryIsRetryable(retry,
+                                   Request,
+                                   Status)) {
+        return FALSE;
+    }
+
+    if (reqContext->RetryCount >= retry->MaxAttempts) {
+
+        GenFilterStatsIncrement(&DevContext->Stats,
+                                GenFilterStatRetryExhausted);
+        return FALSE;
+    }
+
+    reqContext->RetryCount++;
+    reqContext->RetryCompletion = Completion;
+
+    random = GenFilterSketchHash((ULONGLONG)InterlockedIncrement64(&retry->Sequence) ^
+                                 (ULONG_PTR)Request);
+
+    now = (LONGLONG)KeQueryInterruptTime();
+
+    reqContext->RetryDue = now + (LONGLONG)GenFilterRetryBackoff(retry,
+                                                                 reqContext->RetryCount,
+                                                                 random) * 10000;
+
+    WdfSpinLockAcquire(retry->Lock);
+
+    //
+    // Keep the list in the order the Requests are due.  The one we're
+    // adding is usually due last, so look from the end.
+    //
+    for (entry = retry->Waiting.Blink; entry != &retry->Waiting; entry = entry->Blink) {
+
+        if (CONTAINING_RECORD(entry,
+                              GENFILTER_REQUEST_CONTEXT,
+                              RetryEntry)->RetryDue <= reqContext->RetryDue) {
+            break;
+        }
+    }
+
+    InsertHeadList(entry,
+                   &reqContext->RetryEntry);
+
+    //
+    // Under the lock, so that if the Request is cancelled, our cancel
+    // routine finds it on the list.  If it's already been cancelled, it's
+    // not going again.
+    //
+    status = WdfRequestMarkCancelableEx(Request,
+                                        GenFilterRetryEvtCancel);
+
+    if (!NT_SUCCESS(status)) {
+
+        RemoveEntryList(&reqContext->RetryEntry);
+
+        WdfSpinLockRelease(retry->Lock);
+
+        reqContext->RetryFinal = TRUE;
+        return FALSE;
+    }
+
+    reqContext->RetryWaiting = TRUE;
+
+    //
+    // If it's the first one due, the timer needs to fire sooner (the time
+    // is relative, in the same 100ns units as interrupt time)
+    //
+    if (retry->Waiting.Flink == &reqContext->RetryEntry) {
+
+        WdfTimerStart(retry->Timer,
+                      -(reqContext->RetryDue > now ? reqContext->RetryDue - now : 1));
+    }
+
+    WdfSpinLockRelease(retry->Lock);
+
+    return TRUE;
+}
+
+//
+// GenFilterRetryIsRetryable
+//
+// Whether a Request that failed with Status can be sent again
+//
+static
+BOOLEAN
+GenFilterRetryIsRetryable(PGENFILTER_RETRY Retry,
+                          WDFREQUEST       Request,
+                          NTSTATUS         Status)
+{
+    WDF_REQUEST_PARAMETERS params;
+    ULONG                  index;
+
+    for (index = 0; index < Retry->StatusCount; index++) {
+
+        if (Retry->Statuses[index] == Status) {
+            break;
+        }
+    }
+
+    if (index == Retry->StatusCount) {
+        return FALSE;
+    }
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    switch (params.Type) {
+
+        case WdfRequestTypeRead:
+        case WdfRequestTypeWrite:
+            return TRUE;
+
+        case WdfRequestTypeDeviceControl:
+            return (GenFilterRouteLookup(params.Parameters.DeviceIoControl.IoControlCode)->Flags &
+                    GENFILTER_ROUTE_FLAG_COALESCE) != 0;
+
+        default:
+            return FALSE;
+    }
+}
+
+//
+// GenFilterRetryEvtTimer
+//
+// Sends every Request that's now due, and sets the timer again for the
+// next one
+//
+_Use_decl_annotations_
+VOID
+GenFilterRetryEvtTimer(WDFTIMER Timer)
+{
+    PGENFILTER_DEVICE_CONTEXT  devContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_RETRY           retry;
+    LIST_ENTRY                 due;
+    LONGLONG                   now;
+
+    devContext = GenFilterGetDeviceContext(WdfTimerGetParentObject(Timer));
+    retry      = &devContext->Retry;
+
+    InitializeListHead(&due);
+
+    now = (LONGLONG)KeQueryInterruptTime();
+
+    WdfSpinLockAcquire(retry->Lock);
+
+    while (!IsListEmpty(&retry->Waiting)) {
+
+        reqContext = CONTAINING_RECORD(retry->Waiting.Flink,
+                                       GENFILTER_REQUEST_CONTEXT,
+                                       RetryEntry);
+
+        if (reqContext->RetryDue > now) {
+
+            WdfTimerStart(retry->Timer,
+                          -(reqContext->RetryDue - now));
+            break;
+        }
+
+        RemoveEntryList(&reqContext->RetryEntry);
+
+        reqContext->RetryWaiting = FALSE;
+
+        //
+        // If it's been cancelled, our cancel routine will finish it off
+        // once we let go of the lock
+        //
+        if (WdfRequestUnmarkCancelable((WDFREQUEST)WdfObjectContextGetObject(reqContext)) != STATUS_CANCELLED) {
+
+            InsertTailList(&due,
+                           &reqContext->RetryEntry);
+        }
+    }
+
+    WdfSpinLockRelease(retry->Lock);
+
+    while (!IsListEmpty(&due)) {
+
+        reqContext = CONTAINING_RECORD(RemoveHeadList(&due),
+                                       GENFILTER_REQUEST_CONTEXT,
+                                       RetryEntry);
+
+        GenFilterRetrySend((WDFREQUEST)WdfObjectContextGetObject(reqContext),
+                           devContext);
+    }
+}
+
+//
+// GenFilterRetryEvtCancel
+//
+// A Request was cancelled while it waited to go again
+//
+_Use_decl_annotations_
+VOID
+GenFilterRetryEvtCancel(WDFREQUEST Request)
+{
+    PGENFILTER_DEVICE_CONTEXT  devContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_RETRY           retry;
+
+    devContext = GenFilterGetDeviceContext(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request)));
+    reqContext = GenFilterGetRequestContext(Request);
+    retry      = &devContext->Retry;
+
+    WdfSpinLockAcquire(retry->Lock);
+
+    if (reqContext->RetryWaiting) {
+
+        RemoveEntryList(&reqContext->RetryEntry);
+
+        reqContext->RetryWaiting = FALSE;
+    }
+
+    WdfSpinLockRelease(retry->Lock);
+
+    GenFilterRetryFinish(Request,
+                         devContext,
+                         STATUS_CANCELLED);
+}
+
+//
+// GenFilterRetrySend
+//
+// Sends a Request down again, with our completion callback (and, if it's a
+// write we've inspected, our copy of its data).  A Request that went down
+// in chunks goes again from the chunk that failed.
+//
+static
+VOID
+GenFilterRetrySend(WDFREQUEST                Request,
+                   PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS status;
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatRetryAttempts);
+
+    if (GenFilterSplitRetry(Request,
+                            DevContext)) {
+        return;
+    }
+
+    status = GenFilterInspectFormatRequest(Request,
+                                           DevContext);
+
+    if (!NT_SUCCESS(status)) {
+
+        GenFilterRetryFinish(Request,
+                             DevContext,
+                             status);
+        return;
+    }
+
+    WdfRequestSetCompletionRoutine(Request,
+                                   GenFilterGetRequestContext(Request)->RetryCompletion,
+                                   DevContext);
+
+    if (!WdfRequestSend(Request,
+                        WdfDeviceGetIoTarget(DevContext->WdfDevice),
+                        WDF_NO_SEND_OPTIONS)) {
+
+        GenFilterRetryFinish(Request,
+                             DevContext,
+                             WdfRequestGetStatus(Request));
+    }
+}
+
+//
+// GenFilterRetryFinish
+//
+// Hands a Request that isn't going again back to our completion callback,
+// as though the device had completed it with Status
+//
+static
+VOID
+GenFilterRetryFinish(WDFREQUEST                Request,
+                     PGENFILTER_DEVICE_CONTEXT DevContext,
+                     NTSTATUS                  Status)
+{
+    PGENFILTER_REQUEST_CONTEXT    reqContext;
+    WDF_REQUEST_COMPLETION_PARAMS params;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    reqContext->RetryFinal = TRUE;
+
+    WDF_REQUEST_COMPLETION_PARAMS_INIT(&params);
+
+    WdfRequestGetCompletionParams(Request,
+                                  &params);
+
+    params.IoStatus.Status      = Status;
+    params.IoStatus.Information = 0;
+
+    reqContext->RetryCompletion(Request,
+                                WdfDeviceGetIoTarget(DevContext->WdfDevice),
+                                &params,
+                                DevContext);
+}
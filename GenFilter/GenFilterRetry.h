@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterRetry.h
+//
+//    ABSTRACT:
+//
+//      Sends Requests that failed with a status we think of as transient
+//      down to the device again, after a jittered backoff that grows with
+//      each attempt.  The Requests wait on a list, and a timer sends them.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Limits on, and defaults for, the settings in the device's hardware key
+// (see GenFilterRetryInitialize)
+//
+#define GENFILTER_RETRY_MAX_STATUSES        16
+
+#define GENFILTER_RETRY_DEFAULT_BASE_MS     25
+#define GENFILTER_RETRY_DEFAULT_MAX_MS      1000
+#define GENFILTER_RETRY_LIMIT_ATTEMPTS      10
+#define GENFILTER_RETRY_LIMIT_MS            30000
+
+//
+// The per-device retry state that lives in our device context
+//
+typedef struct _GENFILTER_RETRY {
+
+    //
+    // How many times a Request may be sent again (0 if retrying is off),
+    // and the backoff before the first and longest retries
+    //
+    ULONG           MaxAttempts;
+    ULONG           BaseMs;
+    ULONG           MaxMs;
+
+    //
+    // The statuses worth retrying
+    //
+    ULONG           StatusCount;
+    NTSTATUS        Statuses[GENFILTER_RETRY_MAX_STATUSES];
+
+    //
+    // Requests waiting to go again, in the order they're due (protected by
+    // Lock), and the timer that sends them.  Sequence varies the jitter.
+    //
+    WDFSPINLOCK     Lock;
+    LIST_ENTRY      Waiting;
+    WDFTIMER        Timer;
+    volatile LONG64 Sequence;
+} GENFILTER_RETRY, *PGENFILTER_RETRY;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterRetryInitialize(_In_ WDFDEVICE Device,
+                         _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterRetryRequest(_In_ WDFREQUEST Request,
+                      _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ NTSTATUS Status,
+                      _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion);
+
+//
+// GenFilterRetryIsOn
+//
+// Whether failed Requests are ever sent again.  If they are, every Request
+// we send needs our completion callback.
+//
+FORCEINLINE
+BOOLEAN
+GenFilterRetryIsOn(_In_ PGENFILTER_RETRY Retry)
+{
+    return Retry->MaxAttempts != 0;
+}
+
+//
+// GenFilterRetryBackoff
+//
+// How long to wait, in milliseconds, before sending a Request for the
+// Attempt'th time (1 for the first retry).  The ceiling doubles with each
+// attempt up to MaxMs, and we wait somewhere between half of it and all of
+// it, so that Requests that failed together don't all go again together.
+//
+FORCEINLINE
+ULONG
+GenFilterRetryBackoff(_In_ PGENFILTER_RETRY Retry,
+                      _In_ ULONG Attempt,
+                      _In_ ULONGLONG Random)
+{
+    ULONGLONG ceiling;
+
+    ceiling = Retry->BaseMs;
+
+    while (--Attempt != 0 && ceiling < Retry->MaxMs) {
+        ceiling *= 2;
+    }
+
+    if (ceiling > Retry->MaxMs) {
+        ceiling = Retry->MaxMs;
+    }
+
+    return (ULONG)(ceiling - ceiling / 2 + Random % (ceiling / 2 + 1));
+}
@@ -0,0 +1,256 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterRing.h
+//
+//    ABSTRACT:
+//
+//      Bounded lock-free multi-producer, multi-consumer queue core.  Any number
+//      of threads (or processors, at any IRQL) can push and pop at once; when
+//      the queue is full a push fails, and is counted, rather than waiting.
+//      Like GenFilterSched.h, this file knows nothing about WDF, so that
+//      GenFilterCtl and GenFilterSim can stress test the same code the driver
+//      runs, and it includes nothing but GenFilterAtomic.h.  Include it after
+//      <wdm.h> in the driver, or after <windows.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include "GenFilterAtomic.h"
+
+//
+// One slot in the ring.  Sequence says whose turn it is: it equals the
+// slot's position when the slot is empty and waiting for that push, and
+// the position + 1 once that push has stored its Item and the slot is
+// waiting for the matching pop.  A pop hands the slot on to the push one
+// lap later by setting Sequence to position + capacity.
+//
+typedef struct _GENFILTER_RING_CELL {
+    volatile LONG64 Sequence;
+    void*           Item;
+} GENFILTER_RING_CELL, *PGENFILTER_RING_CELL;
+
+//
+// The ring
+//
+// Tail is the next position to push to and Head the next to pop from.
+// Each is claimed with a compare-exchange, after which the claimant has the
+// slot to itself, so neither side ever waits for the other.  They count up
+// forever, so Tail is also the number of Items ever pushed, Head the number
+// ever popped, and Tail - Head the depth.
+//
+// Tail and Head are written by every producer and every consumer
+// respectively, so each gets a cache line of its own.
+//
+typedef struct _GENFILTER_RING {
+    PGENFILTER_RING_CELL Cells;
+    ULONG                Mask;              // Capacity - 1
+    volatile LONG        HighWater;         // Deepest the ring has been
+    volatile LONG64      Dropped;           // Pushes that found it full
+
+    DECLSPEC_CACHEALIGN volatile LONG64 Tail;
+    DECLSPEC_CACHEALIGN volatile LONG64 Head;
+} GENFILTER_RING, *PGENFILTER_RING;
+
+//
+// GenFilterRingInitialize
+//
+// Capacity must be a power of two, and Cells must have room for that many
+// cells and live as long as the ring does.
+//
+inline
+void
+GenFilterRingInitialize(PGENFILTER_RING      Ring,
+                        PGENFILTER_RING_CELL Cells,
+                        ULONG                Capacity)
+{
+    Ring->Cells     = Cells;
+    Ring->Mask      = Capacity - 1;
+    Ring->HighWater = 0;
+    Ring->Dropped   = 0;
+    Ring->Tail      = 0;
+    Ring->Head      = 0;
+
+    for (ULONG index = 0; index < Capacity; index++) {
+        Cells[index].Sequence = index;
+        Cells[index].Item     = nullptr;
+    }
+}
+
+//
+// GenFilterRingPush
+//
+// Adds Item.  Returns false (and counts a drop) if the ring is full.
+//
+inline
+bool
+GenFilterRingPush(PGENFILTER_RING Ring,
+                  void*           Item)
+{
+    LONG64               position = GenFilterAtomicReadNoFence64(&Ring->Tail);
+    PGENFILTER_RING_CELL cell;
+    LONG                 depth;
+
+    for (;;) {
+
+        LONG64 difference;
+
+        cell       = &Ring->Cells[position & Ring->Mask];
+        difference = GenFilterAtomicReadAcquire64(&cell->Sequence) - position;
+
+        if (difference == 0) {
+
+            LONG64 seen = GenFilterAtomicCompareExchange64(&Ring->Tail,
+                                                           position + 1,
+                                                           position);
+            if (seen == position) {
+                break;
+            }
+
+            position = seen;
+
+        } else if (difference < 0) {
+
+            //
+            // The slot still holds the Item pushed one lap ago
+            //
+            GenFilterAtomicIncrement64(&Ring->Dropped);
+            return false;
+
+        } else {
+
+            //
+            // Another producer took this position; try the next one
+            //
+            position = GenFilterAtomicReadNoFence64(&Ring->Tail);
+        }
+    }
+
+    cell->Item = Item;
+
+    GenFilterAtomicWriteRelease64(&cell->Sequence,
+                                  position + 1);
+
+    //
+    // Only touch the shared high-water mark when it moves
+    //
+    depth = (LONG)(position + 1 - GenFilterAtomicReadNoFence64(&Ring->Head));
+
+    for (;;) {
+
+        LONG high = GenFilterAtomicReadNoFence(&Ring->HighWater);
+
+        if (depth <= high ||
+            GenFilterAtomicCompareExchange(&Ring->HighWater,
+                                           depth,
+                                           high) == high) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+//
+// GenFilterRingPop
+//
+// Removes and returns the oldest Item, or nullptr if there's nothing to
+// pop.  An Item whose push has claimed its position, but not yet stored
+// it, blocks the Items behind it until it's stored; so a pop can return
+// nullptr even though a later push has already completed.
+//
+inline
+void*
+GenFilterRingPop(PGENFILTER_RING Ring)
+{
+    LONG64               position = GenFilterAtomicReadNoFence64(&Ring->Head);
+    PGENFILTER_RING_CELL cell;
+    void*                item;
+
+    for (;;) {
+
+        LONG64 difference;
+
+        cell       = &Ring->Cells[position & Ring->Mask];
+        difference = GenFilterAtomicReadAcquire64(&cell->Sequence) - (position + 1);
+
+        if (difference == 0) {
+
+            LONG64 seen = GenFilterAtomicCompareExchange64(&Ring->Head,
+                                                           position + 1,
+                                                           position);
+            if (seen == position) {
+                break;
+            }
+
+            position = seen;
+
+        } else if (difference < 0) {
+
+            return nullptr;
+
+        } else {
+
+            position = GenFilterAtomicReadNoFence64(&Ring->Head);
+        }
+    }
+
+    item = cell->Item;
+
+    GenFilterAtomicWriteRelease64(&cell->Sequence,
+                                  position + Ring->Mask + 1);
+
+    return item;
+}
+
+//
+// GenFilterRingDepth
+//
+// A snapshot of how many Items are waiting
+//
+inline
+ULONG
+GenFilterRingDepth(const GENFILTER_RING* Ring)
+{
+    LONG64 head = GenFilterAtomicReadNoFence64(&Ring->Head);
+    LONG64 tail = GenFilterAtomicReadNoFence64(&Ring->Tail);
+
+    return (tail > head) ? (ULONG)(tail - head) : 0;
+}
@@ -0,0 +1,215 @@
+///
+/// @file GenFilterRoute.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+#include <ntddcdrm.h>
+#include <ntdddisk.h>
+#include <ntddscsi.h>
+#include <ntddstor.h>
+
+//
+// The IOCTL routing table
+//
+// Every device control code that needs anything other than plain
+// send-and-forget gets an entry here.  Codes that aren't in the table are
+// sent and forgotten.  Order doesn't matter, but each code may only appear
+// once (the build fails if a code is duplicated).
+//
+static constexpr GENFILTER_ROUTE GenFilterRoutes[] = {
+
+    //
+    // Our private control interface
+    //
+    { IOCTL_GENFILTER_GET_STATISTICS, GenFilterRouteCompleteLocally, GenFilterStatsQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_DRAIN_TRACE,    GenFilterRouteCompleteLocally, GenFilterTraceQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_GET_LATENCY,    GenFilterRouteCompleteLocally, GenFilterLatencyQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_SET_PASS_THROUGH, GenFilterRouteCompleteLocally, GenFilterPassThroughSet, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_GET_POOLS,      GenFilterRouteCompleteLocally, GenFilterPoolQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_GET_DEFER,      GenFilterRouteCompleteLocally, GenFilterDeferQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_DRAIN_CAPTURE,  GenFilterRouteCompleteLocally, GenFilterCaptureQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_SET_CONFIG,     GenFilterRouteCompleteLocally, GenFilterConfigSet, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_GET_HEAVY_HITTERS, GenFilterRouteCompleteLocally, GenFilterAttributionQuery, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_RESET_HEAVY_HITTERS, GenFilterRouteCompleteLocally, GenFilterAttributionReset, STATUS_SUCCESS, 0 },
+    { IOCTL_GENFILTER_SET_LATENCY_SAMPLING, GenFilterRouteCompleteLocally, GenFilterLatencySetSampling, STATUS_SUCCESS, 0 },
+
+    //
+    // We want to see the results for this one, so we send it with a
+    // completion callback
+    //
+    { IOCTL_YOU_ARE_INTERESTED_IN,    GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, 0 },
+
+    //
+    // The read cache watches the media change count these return.  They're
+    // also the codes that services poll most, so identical copies that are
+    // in flight at the same time share one trip to the device.
+    //
+    { IOCTL_STORAGE_CHECK_VERIFY,     GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE },
+    { IOCTL_STORAGE_CHECK_VERIFY2,    GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE },
+    { IOCTL_CDROM_CHECK_VERIFY,       GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE },
+    { IOCTL_DISK_CHECK_VERIFY,        GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE },
+
+    //
+    // Other idempotent media and drive queries that get polled.  Their
+    // results don't change until the media does, so we also cache them
+    // (for the TTL set in the device's hardware key).
+    //
+    { IOCTL_STORAGE_GET_MEDIA_TYPES_EX,  GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_STORAGE_GET_HOTPLUG_INFO,    GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_STORAGE_QUERY_PROPERTY,      GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_DISK_GET_LENGTH_INFO,        GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_READ_TOC,              GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_READ_TOC_EX,           GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_GET_LAST_SESSION,      GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_GET_CONFIGURATION,     GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+
+    //
+    // The read cache learns the sector size from these, so we always want
+    // to see them complete
+    //
+    { IOCTL_STORAGE_READ_CAPACITY,       GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_GET_DRIVE_GEOMETRY,    GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_CDROM_GET_DRIVE_GEOMETRY_EX, GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+    { IOCTL_DISK_GET_DRIVE_GEOMETRY,     GenFilterRouteForwardWithCompletion, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_COALESCE | GENFILTER_ROUTE_FLAG_CACHE_RESULT },
+
+    //
+    // ...and anything that can change the media, or write to it without
+    // going through us, empties it.  Writes we're gathering go down first.
+    //
+    { IOCTL_STORAGE_EJECT_MEDIA,      GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+    { IOCTL_STORAGE_LOAD_MEDIA,       GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+    { IOCTL_CDROM_EJECT_MEDIA,        GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+    { IOCTL_CDROM_LOAD_MEDIA,         GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+    { IOCTL_SCSI_PASS_THROUGH,        GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+    { IOCTL_SCSI_PASS_THROUGH_DIRECT, GenFilterRouteForward, nullptr, STATUS_SUCCESS, GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE | GENFILTER_ROUTE_FLAG_FLUSH_WRITES },
+};
+
+static constexpr GENFILTER_ROUTE_TABLE<GENFILTER_ROUTE, ARRAYSIZE(GenFilterRoutes)> GenFilterRouteTable(GenFilterRoutes);
+
+static_assert(GenFilterRouteTable.Verify(),
+              "Unable to build the IOCTL routing table (is a code listed twice?)");
+
+//
+// What we do with codes that aren't in the table
+//
+static constexpr GENFILTER_ROUTE GenFilterDefaultRoute = {
+    0, GenFilterRouteForward, nullptr, STATUS_SUCCESS, 0
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterRouteLookup
+//
+//    Finds the route for a device control code.
+//
+//  INPUTS:
+//
+//      IoControlCode - The code to look up
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      The code's entry in the routing table, or the default
+//      (send-and-forget) route if it doesn't have one.  Never nullptr.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      This is two hashes and three table reads regardless of how many
+//      routes there are.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+PCGENFILTER_ROUTE
+GenFilterRouteLookup(ULONG IoControlCode)
+{
+    PCGENFILTER_ROUTE route;
+
+    route = GenFilterRouteTable.Find(IoControlCode);
+
+    if (route == nullptr) {
+        route = &GenFilterDefaultRoute;
+    }
+
+    return route;
+}
+
+//
+// GenFilterRouteGetCount
+//
+ULONG
+GenFilterRouteGetCount()
+{
+    return ARRAYSIZE(GenFilterRoutes);
+}
+
+//
+// GenFilterRouteGetIndex
+//
+_Use_decl_annotations_
+ULONG
+GenFilterRouteGetIndex(PCGENFILTER_ROUTE Route)
+{
+    if (Route == &GenFilterDefaultRoute) {
+        return ARRAYSIZE(GenFilterRoutes);
+    }
+
+    return (ULONG)(Route - GenFilterRoutes);
+}
+
+//
+// GenFilterRouteGetByIndex
+//
+_Use_decl_annotations_
+PCGENFILTER_ROUTE
+GenFilterRouteGetByIndex(ULONG Index)
+{
+    if (Index >= ARRAYSIZE(GenFilterRoutes)) {
+        return &GenFilterDefaultRoute;
+    }
+
+    return &GenFilterRoutes[Index];
+}
@@ -0,0 +1,121 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterRoute.h
+//
+//    ABSTRACT:
+//
+//      Table-driven routing of device control Requests.  Each IOCTL code we
+//      care about gets a GENFILTER_ROUTE saying what to do with it.  At compile
+//      time the table is turned into a minimal-probe perfect hash, so looking
+//      a code up costs the same whether there are three routes or three
+//      hundred.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterRouteTable.h"
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// What we do with a device control Request whose code is in the table
+//
+typedef enum _GENFILTER_ROUTE_ACTION {
+    GenFilterRouteForward = 0,              // Send-and-forget (the default)
+    GenFilterRouteForwardWithCompletion,    // Send with our completion callback
+    GenFilterRouteCompleteLocally,          // Handler runs, we complete it
+    GenFilterRouteFail,                     // Complete with FailStatus
+} GENFILTER_ROUTE_ACTION;
+
+//
+// Things we do for a device control Request in addition to its Action
+//
+constexpr ULONG GENFILTER_ROUTE_FLAG_INVALIDATE_CACHE = 0x00000001;    // Empty the read cache
+constexpr ULONG GENFILTER_ROUTE_FLAG_COALESCE         = 0x00000002;    // Idempotent: share one
+                                                                        //   in-flight copy
+constexpr ULONG GENFILTER_ROUTE_FLAG_CACHE_RESULT     = 0x00000004;    // Idempotent until the media
+                                                                        //   changes: cache result
+constexpr ULONG GENFILTER_ROUTE_FLAG_FLUSH_WRITES     = 0x00000008;    // Send gathered writes first
+
+//
+// Handler for GenFilterRouteCompleteLocally.  Returns the completion status
+// and the number of output bytes; the caller completes the Request.
+//
+typedef NTSTATUS
+GENFILTER_ROUTE_HANDLER(_In_ WDFREQUEST Request,
+                        _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                        _Out_ PULONG_PTR Information);
+
+typedef GENFILTER_ROUTE_HANDLER* PGENFILTER_ROUTE_HANDLER;
+
+typedef struct _GENFILTER_ROUTE {
+    ULONG                    IoControlCode;
+    GENFILTER_ROUTE_ACTION   Action;
+    PGENFILTER_ROUTE_HANDLER Handler;       // GenFilterRouteCompleteLocally
+    NTSTATUS                 FailStatus;    // GenFilterRouteFail
+    ULONG                    Flags;         // GENFILTER_ROUTE_FLAG_xxx
+} GENFILTER_ROUTE, *PGENFILTER_ROUTE;
+
+typedef const GENFILTER_ROUTE* PCGENFILTER_ROUTE;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PCGENFILTER_ROUTE
+GenFilterRouteLookup(_In_ ULONG IoControlCode);
+
+//
+// Routes in the table are numbered 0 to GenFilterRouteGetCount() - 1, for
+// anything that wants to keep per-route data.  The default route (for codes
+// that aren't in the table) has no number: GenFilterRouteGetIndex returns
+// GenFilterRouteGetCount() for it.
+//
+ULONG
+GenFilterRouteGetCount();
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+GenFilterRouteGetIndex(_In_ PCGENFILTER_ROUTE Route);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PCGENFILTER_ROUTE
+GenFilterRouteGetByIndex(_In_ ULONG Index);
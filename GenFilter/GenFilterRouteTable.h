@@ -0,0 +1,252 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterRouteTable.h
+//
+//    ABSTRACT:
+//
+//      The perfect hash behind the IOCTL routing table (see GenFilterRoute.h).
+//      Like GenFilterSlab.h, this file deliberately includes nothing and
+//      knows nothing about WDF, so that GenFilterCtl can benchmark the same
+//      lookup the driver does.  Include it after <wdm.h> in the driver, or
+//      after <windows.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+//
+// Compile-time perfect hashing ("hash and displace")
+//
+// Every code is first hashed into a small number of buckets.  Then, biggest
+// bucket first, we search for a per-bucket displacement that sends each
+// code in that bucket to its own, still-empty, slot of a table twice the size
+// of the route array.  Looking a code up is then always exactly: hash to the
+// bucket, fetch its displacement, hash to the slot, compare one code.
+//
+// All of this runs in the compiler.  If it can't build the table (which in
+// practice only happens if the same code appears twice) Built is FALSE, and
+// the static_assert next to the table definition stops the build.
+//
+// Route is anything with an IoControlCode: GENFILTER_ROUTE in the driver.
+// (GenFilterCtl builds its tables at run time, with the same code.)
+//
+constexpr ULONG
+GenFilterRouteRoundUpPow2(ULONG Value)
+{
+    ULONG result = 1;
+
+    while (result < Value) {
+        result <<= 1;
+    }
+
+    return result;
+}
+
+constexpr ULONG
+GenFilterRouteMix(ULONG Value)
+{
+    Value ^= Value >> 16;
+    Value *= 0x85ebca6bU;
+    Value ^= Value >> 13;
+    Value *= 0xc2b2ae35U;
+    Value ^= Value >> 16;
+
+    return Value;
+}
+
+constexpr ULONG
+GenFilterRouteBucketHash(ULONG IoControlCode)
+{
+    return GenFilterRouteMix(IoControlCode ^ 0x5bd1e995U);
+}
+
+constexpr ULONG
+GenFilterRouteSlotHash(ULONG IoControlCode,
+                       ULONG Displacement)
+{
+    return GenFilterRouteMix(IoControlCode + (Displacement * 0x9e3779b9U) + 1);
+}
+
+template <typename Route, ULONG RouteCount>
+struct GENFILTER_ROUTE_TABLE {
+
+    static constexpr ULONG SlotCount   = GenFilterRouteRoundUpPow2(RouteCount * 2);
+    static constexpr ULONG BucketCount = GenFilterRouteRoundUpPow2((RouteCount + 1) / 2);
+    static constexpr ULONG MaxDisplacement = 0xffff;
+
+    const Route* Routes;
+    BOOLEAN      Built;
+    USHORT       Displacement[BucketCount];
+    USHORT       Slots[SlotCount];      // Route index + 1, or 0
+
+    constexpr
+    GENFILTER_ROUTE_TABLE(const Route (&RouteArray)[RouteCount])
+        : Routes(RouteArray),
+          Built(FALSE),
+          Displacement{},
+          Slots{}
+    {
+        ULONG bucketOf[RouteCount] = {};
+        ULONG bucketSize[BucketCount] = {};
+        ULONG largestBucket = 0;
+
+        for (ULONG route = 0; route < RouteCount; route++) {
+
+            bucketOf[route] = GenFilterRouteBucketHash(RouteArray[route].IoControlCode) &
+                              (BucketCount - 1);
+            bucketSize[bucketOf[route]]++;
+
+            if (bucketSize[bucketOf[route]] > largestBucket) {
+                largestBucket = bucketSize[bucketOf[route]];
+            }
+        }
+
+        //
+        // Place the biggest buckets first, while the table is emptiest
+        //
+        for (ULONG size = largestBucket; size > 0; size--) {
+
+            for (ULONG bucket = 0; bucket < BucketCount; bucket++) {
+
+                if (bucketSize[bucket] == size &&
+                    !PlaceBucket(RouteArray, bucketOf, bucket)) {
+                    return;
+                }
+            }
+        }
+
+        Built = TRUE;
+    }
+
+    //
+    // Returns the route for IoControlCode, or nullptr if there isn't one
+    //
+    constexpr
+    const Route*
+    Find(ULONG IoControlCode) const
+    {
+        const ULONG bucket = GenFilterRouteBucketHash(IoControlCode) &
+                             (BucketCount - 1);
+        const ULONG slot   = GenFilterRouteSlotHash(IoControlCode,
+                                                    Displacement[bucket]) &
+                             (SlotCount - 1);
+        const ULONG route  = Slots[slot];
+
+        if (route == 0 || Routes[route - 1].IoControlCode != IoControlCode) {
+            return nullptr;
+        }
+
+        return &Routes[route - 1];
+    }
+
+    //
+    // Compile-time self check: every route must find itself
+    //
+    constexpr
+    BOOLEAN
+    Verify() const
+    {
+        if (!Built) {
+            return FALSE;
+        }
+
+        for (ULONG route = 0; route < RouteCount; route++) {
+
+            if (Find(Routes[route].IoControlCode) != &Routes[route]) {
+                return FALSE;
+            }
+        }
+
+        return TRUE;
+    }
+
+private:
+
+    constexpr
+    BOOLEAN
+    PlaceBucket(const Route (&RouteArray)[RouteCount],
+                const ULONG (&BucketOf)[RouteCount],
+                ULONG Bucket)
+    {
+        for (ULONG displacement = 0;
+             displacement <= MaxDisplacement;
+             displacement++) {
+
+            BOOLEAN fits = TRUE;
+            BOOLEAN taken[SlotCount] = {};
+
+            for (ULONG route = 0; route < RouteCount && fits; route++) {
+
+                ULONG slot = 0;
+
+                if (BucketOf[route] == Bucket) {
+
+                    slot = GenFilterRouteSlotHash(RouteArray[route].IoControlCode,
+                                                  displacement) & (SlotCount - 1);
+
+                    if (Slots[slot] != 0 || taken[slot]) {
+                        fits = FALSE;
+                    } else {
+                        taken[slot] = TRUE;
+                    }
+                }
+            }
+
+            if (fits) {
+
+                Displacement[Bucket] = (USHORT)displacement;
+
+                for (ULONG route = 0; route < RouteCount; route++) {
+
+                    if (BucketOf[route] == Bucket) {
+
+                        Slots[GenFilterRouteSlotHash(RouteArray[route].IoControlCode,
+                                                     displacement) &
+                              (SlotCount - 1)] = (USHORT)(route + 1);
+                    }
+                }
+
+                return TRUE;
+            }
+        }
+
+        return FALSE;
+    }
+};
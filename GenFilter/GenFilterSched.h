@@ -0,0 +1,386 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterSched.h
+//
+//    ABSTRACT:
+//
+//      Request scheduler core: orders held Requests FIFO, by a C-SCAN
+//      elevator, or by the elevator with a deadline.  This file deliberately
+//      includes nothing and knows nothing about WDF, so that GenFilterCtl can
+//      replay workloads through the same code the driver runs.  Include it
+//      after <wdm.h> in the driver, or after <windows.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+//
+// How held Requests are ordered
+//
+typedef enum _GENFILTER_SCHED_POLICY {
+    GenFilterSchedFifo = 0,             // Arrival order
+    GenFilterSchedElevator,             // C-SCAN: ascending offset, then wrap
+    GenFilterSchedDeadline,             // Elevator, but a Request that's
+                                        //   waited past its deadline goes next
+
+    GenFilterSchedPolicyCount           // Must be last
+} GENFILTER_SCHED_POLICY;
+
+//
+// Once GenFilterSchedDeadline has sent an expired entry, it sends this many
+// more by the elevator before it looks at deadlines again.  Under overload
+// everything is past its deadline, and without this the deadline policy
+// would turn into FIFO just when the elevator matters most.
+//
+#define GENFILTER_SCHED_DEADLINE_BATCH  8
+
+//
+// One held Request.  Embedded in whatever the caller is holding (our
+// Request context, in the driver).
+//
+typedef struct _GENFILTER_SCHED_ENTRY {
+    ULONGLONG                      Offset;
+    ULONGLONG                      Deadline;
+    struct _GENFILTER_SCHED_ENTRY* Older;       // Arrival order links
+    struct _GENFILTER_SCHED_ENTRY* Newer;
+    ULONG                          Sweep;       // Heap we're in (0 or 1)
+    ULONG                          HeapIndex;   // Where we are in it
+    BOOLEAN                        Queued;
+} GENFILTER_SCHED_ENTRY, *PGENFILTER_SCHED_ENTRY;
+
+//
+// The scheduler
+//
+// Every entry is on the arrival-order list.  For the elevator policies each
+// entry is also in one of two min-heaps keyed by Offset: the current sweep
+// (offsets at or above Head, the offset of the last entry the elevator
+// picked) and the next sweep (offsets below it, which have to wait for the
+// elevator to wrap around).  Insert, pop and remove are all O(log n), and
+// the only memory used is the 2 * Capacity heap slots the caller supplies.
+//
+typedef struct _GENFILTER_SCHED {
+    GENFILTER_SCHED_POLICY  Policy;
+    ULONG                   Capacity;
+    ULONG                   Count;
+    ULONG                   CurrentSweep;
+    ULONG                   HeapCount[2];
+    PGENFILTER_SCHED_ENTRY* Heap[2];
+    ULONGLONG               Head;
+    ULONG                   BatchLeft;      // Elevator picks before the
+                                            //   next deadline check
+    PGENFILTER_SCHED_ENTRY  Oldest;
+    PGENFILTER_SCHED_ENTRY  Newest;
+} GENFILTER_SCHED, *PGENFILTER_SCHED;
+
+//
+// GenFilterSchedInitialize
+//
+// Storage must have room for 2 * Capacity entry pointers, and must live as
+// long as the scheduler does.
+//
+inline
+void
+GenFilterSchedInitialize(PGENFILTER_SCHED        Sched,
+                         GENFILTER_SCHED_POLICY  Policy,
+                         PGENFILTER_SCHED_ENTRY* Storage,
+                         ULONG                   Capacity)
+{
+    Sched->Policy       = Policy;
+    Sched->Capacity     = Capacity;
+    Sched->Count        = 0;
+    Sched->CurrentSweep = 0;
+    Sched->HeapCount[0] = 0;
+    Sched->HeapCount[1] = 0;
+    Sched->Heap[0]      = Storage;
+    Sched->Heap[1]      = Storage + Capacity;
+    Sched->Head         = 0;
+    Sched->BatchLeft    = 0;
+    Sched->Oldest       = nullptr;
+    Sched->Newest       = nullptr;
+}
+
+inline
+bool
+GenFilterSchedIsFull(const GENFILTER_SCHED* Sched)
+{
+    return Sched->Count >= Sched->Capacity;
+}
+
+//
+// Heap helpers.  Each keeps the entries' HeapIndex up to date, so that an
+// entry can be removed from the middle of its heap.
+//
+inline
+void
+GenFilterSchedHeapSet(PGENFILTER_SCHED       Sched,
+                      ULONG                  Sweep,
+                      ULONG                  Index,
+                      PGENFILTER_SCHED_ENTRY Entry)
+{
+    Sched->Heap[Sweep][Index] = Entry;
+    Entry->Sweep              = Sweep;
+    Entry->HeapIndex          = Index;
+}
+
+inline
+void
+GenFilterSchedSiftUp(PGENFILTER_SCHED Sched,
+                     ULONG            Sweep,
+                     ULONG            Index)
+{
+    PGENFILTER_SCHED_ENTRY entry = Sched->Heap[Sweep][Index];
+
+    while (Index > 0) {
+
+        ULONG                  parentIndex = (Index - 1) / 2;
+        PGENFILTER_SCHED_ENTRY parent      = Sched->Heap[Sweep][parentIndex];
+
+        if (parent->Offset <= entry->Offset) {
+            break;
+        }
+
+        GenFilterSchedHeapSet(Sched,
+                              Sweep,
+                              Index,
+                              parent);
+        Index = parentIndex;
+    }
+
+    GenFilterSchedHeapSet(Sched,
+                          Sweep,
+                          Index,
+                          entry);
+}
+
+inline
+void
+GenFilterSchedSiftDown(PGENFILTER_SCHED Sched,
+                       ULONG            Sweep,
+                       ULONG            Index)
+{
+    PGENFILTER_SCHED_ENTRY entry = Sched->Heap[Sweep][Index];
+    ULONG                  count = Sched->HeapCount[Sweep];
+
+    for (;;) {
+
+        ULONG child = (2 * Index) + 1;
+
+        if (child >= count) {
+            break;
+        }
+
+        if (child + 1 < count &&
+            Sched->Heap[Sweep][child + 1]->Offset < Sched->Heap[Sweep][child]->Offset) {
+            child++;
+        }
+
+        if (entry->Offset <= Sched->Heap[Sweep][child]->Offset) {
+            break;
+        }
+
+        GenFilterSchedHeapSet(Sched,
+                              Sweep,
+                              Index,
+                              Sched->Heap[Sweep][child]);
+        Index = child;
+    }
+
+    GenFilterSchedHeapSet(Sched,
+                          Sweep,
+                          Index,
+                          entry);
+}
+
+//
+// GenFilterSchedInsert
+//
+// Holds Entry.  Returns false (and does nothing) if the scheduler is full.
+// Deadline is only used by GenFilterSchedDeadline, and is in whatever units
+// the caller passes to GenFilterSchedPop as Now.
+//
+inline
+bool
+GenFilterSchedInsert(PGENFILTER_SCHED       Sched,
+                     PGENFILTER_SCHED_ENTRY Entry,
+                     ULONGLONG              Offset,
+                     ULONGLONG              Deadline)
+{
+    if (GenFilterSchedIsFull(Sched)) {
+        return false;
+    }
+
+    Entry->Offset   = Offset;
+    Entry->Deadline = Deadline;
+    Entry->Queued   = TRUE;
+
+    Entry->Older = Sched->Newest;
+    Entry->Newer = nullptr;
+
+    if (Sched->Newest != nullptr) {
+        Sched->Newest->Newer = Entry;
+    } else {
+        Sched->Oldest = Entry;
+    }
+
+    Sched->Newest = Entry;
+    Sched->Count++;
+
+    if (Sched->Policy != GenFilterSchedFifo) {
+
+        ULONG sweep = (Offset >= Sched->Head) ? Sched->CurrentSweep :
+                                                Sched->CurrentSweep ^ 1;
+        ULONG index = Sched->HeapCount[sweep]++;
+
+        GenFilterSchedHeapSet(Sched,
+                              sweep,
+                              index,
+                              Entry);
+
+        GenFilterSchedSiftUp(Sched,
+                             sweep,
+                             index);
+    }
+
+    return true;
+}
+
+//
+// GenFilterSchedRemove
+//
+// Removes a held entry, wherever it is in the order
+//
+inline
+void
+GenFilterSchedRemove(PGENFILTER_SCHED       Sched,
+                     PGENFILTER_SCHED_ENTRY Entry)
+{
+    if (Entry->Older != nullptr) {
+        Entry->Older->Newer = Entry->Newer;
+    } else {
+        Sched->Oldest = Entry->Newer;
+    }
+
+    if (Entry->Newer != nullptr) {
+        Entry->Newer->Older = Entry->Older;
+    } else {
+        Sched->Newest = Entry->Older;
+    }
+
+    Sched->Count--;
+    Entry->Queued = FALSE;
+
+    if (Sched->Policy != GenFilterSchedFifo) {
+
+        ULONG sweep = Entry->Sweep;
+        ULONG index = Entry->HeapIndex;
+        ULONG last  = --Sched->HeapCount[sweep];
+
+        //
+        // Fill the hole with the last entry, which may need to move either
+        // way from there
+        //
+        if (index != last) {
+
+            GenFilterSchedHeapSet(Sched,
+                                  sweep,
+                                  index,
+                                  Sched->Heap[sweep][last]);
+
+            GenFilterSchedSiftDown(Sched,
+                                   sweep,
+                                   index);
+
+            GenFilterSchedSiftUp(Sched,
+                                 sweep,
+                                 index);
+        }
+    }
+}
+
+//
+// GenFilterSchedPop
+//
+// Removes and returns the entry that should go next, or nullptr if nothing
+// is held.
+//
+// A deadline pick doesn't move the elevator: it carries on from where it
+// was, so entries never end up on the wrong side of Head.
+//
+inline
+PGENFILTER_SCHED_ENTRY
+GenFilterSchedPop(PGENFILTER_SCHED Sched,
+                  ULONGLONG        Now)
+{
+    PGENFILTER_SCHED_ENTRY entry;
+
+    if (Sched->Count == 0) {
+        return nullptr;
+    }
+
+    if (Sched->Policy == GenFilterSchedFifo) {
+
+        entry = Sched->Oldest;
+
+    } else if (Sched->Policy == GenFilterSchedDeadline &&
+               Sched->BatchLeft == 0 &&
+               Sched->Oldest->Deadline <= Now) {
+
+        entry            = Sched->Oldest;
+        Sched->BatchLeft = GENFILTER_SCHED_DEADLINE_BATCH;
+
+    } else {
+
+        if (Sched->BatchLeft != 0) {
+            Sched->BatchLeft--;
+        }
+
+        if (Sched->HeapCount[Sched->CurrentSweep] == 0) {
+            Sched->CurrentSweep ^= 1;
+        }
+
+        entry       = Sched->Heap[Sched->CurrentSweep][0];
+        Sched->Head = entry->Offset;
+    }
+
+    GenFilterSchedRemove(Sched,
+                         entry);
+
+    return entry;
+}
@@ -0,0 +1,396 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterSketch.h
+//
+//    ABSTRACT:
+//
+//      Finds the requesters sending the most I/O in fixed memory, however many
+//      requesters there are: a count-min sketch of what each has sent, and a
+//      short list of the heaviest candidates, per processor.  Updates are a
+//      handful of interlocked adds to the current processor's cache lines.
+//      Like GenFilterSlab.h, this file doesn't use WDF, so GenFilterCtl can
+//      check its accuracy and measure its cost with the same code.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include "GenFilterIoctl.h"
+
+//
+// The sketch: GENFILTER_SKETCH_DEPTH rows of GENFILTER_SKETCH_WIDTH
+// counters.  Each requester is counted in one counter of every row, chosen
+// by hashing it, and its estimate is the smallest of those counters.
+// Other requesters that hash to the same counters can only make that too
+// high, and with high probability by no more than e / WIDTH of the total
+// (about 0.5% here).  WIDTH MUST be a power of two no larger than 2^16.
+//
+constexpr ULONG GENFILTER_SKETCH_DEPTH = 4;
+constexpr ULONG GENFILTER_SKETCH_WIDTH = 512;
+
+static_assert((GENFILTER_SKETCH_WIDTH & (GENFILTER_SKETCH_WIDTH - 1)) == 0 &&
+              GENFILTER_SKETCH_WIDTH <= 0x10000,
+              "GENFILTER_SKETCH_WIDTH must be a power of two no larger than 2^16");
+
+//
+// Candidates each processor keeps for the heaviest requesters
+//
+constexpr ULONG GENFILTER_SKETCH_CANDIDATES = GENFILTER_HEAVY_HITTERS_MAX;
+
+typedef struct _GENFILTER_SKETCH_COUNTER {
+    volatile LONG64 Requests;
+    volatile LONG64 Bytes;
+} GENFILTER_SKETCH_COUNTER, *PGENFILTER_SKETCH_COUNTER;
+
+//
+// Cost is the requester's estimated cost (see
+// GENFILTER_ATTRIBUTION_REQUEST_COST) when it was last seen here, and 0 if
+// the slot is empty.  It only decides which candidate is replaced next;
+// what a query returns is estimated again from the sketch.
+//
+typedef struct _GENFILTER_SKETCH_CANDIDATE {
+    volatile LONG64 Requester;
+    volatile LONG64 Cost;
+} GENFILTER_SKETCH_CANDIDATE, *PGENFILTER_SKETCH_CANDIDATE;
+
+//
+// One processor's sketch and candidates.  Cache aligned, so that updates on
+// different processors never touch the same line.
+//
+// A thread can be preempted, or move to another processor, between
+// choosing its processor's slot and updating it, so the counters are
+// updated with interlocked adds, as the statistics are (see
+// GenFilterStatsAdd).  The candidates are only a hint, and are updated
+// with a compare-exchange that can lose a race harmlessly.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_SKETCH_CPU {
+    GENFILTER_SKETCH_CANDIDATE Candidates[GENFILTER_SKETCH_CANDIDATES];
+    GENFILTER_SKETCH_COUNTER   Counters[GENFILTER_SKETCH_DEPTH][GENFILTER_SKETCH_WIDTH];
+} GENFILTER_SKETCH_CPU, *PGENFILTER_SKETCH_CPU;
+
+typedef struct _GENFILTER_SKETCH {
+    ULONG                 CpuCount;
+    PGENFILTER_SKETCH_CPU Cpus;
+} GENFILTER_SKETCH, *PGENFILTER_SKETCH;
+
+//
+// GenFilterSketchReset
+//
+// Starts counting again from zero.  Adds that race with this may or may
+// not survive it.
+//
+inline
+void
+GenFilterSketchReset(PGENFILTER_SKETCH Sketch)
+{
+    for (ULONG cpu = 0; cpu < Sketch->CpuCount; cpu++) {
+
+        PGENFILTER_SKETCH_CPU sketchCpu = &Sketch->Cpus[cpu];
+
+        for (ULONG slot = 0; slot < GENFILTER_SKETCH_CANDIDATES; slot++) {
+            sketchCpu->Candidates[slot].Cost      = 0;
+            sketchCpu->Candidates[slot].Requester = 0;
+        }
+
+        for (ULONG row = 0; row < GENFILTER_SKETCH_DEPTH; row++) {
+            for (ULONG column = 0; column < GENFILTER_SKETCH_WIDTH; column++) {
+                sketchCpu->Counters[row][column].Requests = 0;
+                sketchCpu->Counters[row][column].Bytes    = 0;
+            }
+        }
+    }
+}
+
+inline
+void
+GenFilterSketchInitialize(PGENFILTER_SKETCH     Sketch,
+                          PGENFILTER_SKETCH_CPU Cpus,
+                          ULONG                 CpuCount)
+{
+    Sketch->CpuCount = CpuCount;
+    Sketch->Cpus     = Cpus;
+
+    GenFilterSketchReset(Sketch);
+}
+
+//
+// GenFilterSketchHash
+//
+// Mixes a requester (process IDs and handles are small, and close
+// together) so that every bit of the result depends on every bit of it.
+// Each row takes its column from a different 16 bits.
+//
+inline
+ULONGLONG
+GenFilterSketchHash(ULONGLONG Requester)
+{
+    Requester ^= Requester >> 30;
+    Requester *= 0xBF58476D1CE4E5B9ULL;
+    Requester ^= Requester >> 27;
+    Requester *= 0x94D049BB133111EBULL;
+    Requester ^= Requester >> 31;
+
+    return Requester;
+}
+
+inline
+ULONG
+GenFilterSketchColumn(ULONGLONG Hash,
+                      ULONG     Row)
+{
+    return (ULONG)(Hash >> (Row * 16)) & (GENFILTER_SKETCH_WIDTH - 1);
+}
+
+//
+// GenFilterSketchAdd
+//
+// Counts one Request of Bytes bytes from Requester on processor Cpu
+//
+inline
+void
+GenFilterSketchAdd(PGENFILTER_SKETCH Sketch,
+                   ULONG             Cpu,
+                   ULONGLONG         Requester,
+                   ULONG             Bytes)
+{
+    PGENFILTER_SKETCH_CPU sketchCpu;
+    ULONGLONG             hash;
+    LONG64                cost    = MAXLONG64;
+    ULONG                 minSlot = 0;
+    LONG64                minCost = MAXLONG64;
+
+    if (Cpu >= Sketch->CpuCount) {
+        Cpu %= Sketch->CpuCount;
+    }
+
+    sketchCpu = &Sketch->Cpus[Cpu];
+    hash      = GenFilterSketchHash(Requester);
+
+    for (ULONG row = 0; row < GENFILTER_SKETCH_DEPTH; row++) {
+
+        PGENFILTER_SKETCH_COUNTER counter;
+        LONG64                    rowCost;
+
+        counter = &sketchCpu->Counters[row][GenFilterSketchColumn(hash,
+                                                                  row)];
+
+        rowCost = InterlockedAddNoFence64(&counter->Bytes,
+                                          (LONG64)Bytes) +
+                  InterlockedAddNoFence64(&counter->Requests,
+                                          1) * GENFILTER_ATTRIBUTION_REQUEST_COST;
+
+        if (rowCost < cost) {
+            cost = rowCost;
+        }
+    }
+
+    //
+    // Already a candidate?  Otherwise, replace the lightest one if we're
+    // heavier.
+    //
+    for (ULONG slot = 0; slot < GENFILTER_SKETCH_CANDIDATES; slot++) {
+
+        PGENFILTER_SKETCH_CANDIDATE candidate = &sketchCpu->Candidates[slot];
+        LONG64                      slotCost  = candidate->Cost;
+
+        if (slotCost != 0 && (ULONGLONG)candidate->Requester == Requester) {
+
+            if (slotCost < cost) {
+                candidate->Cost = cost;
+            }
+
+            return;
+        }
+
+        if (slotCost < minCost) {
+            minCost = slotCost;
+            minSlot = slot;
+        }
+    }
+
+    if (cost > minCost) {
+
+        PGENFILTER_SKETCH_CANDIDATE candidate = &sketchCpu->Candidates[minSlot];
+        LONG64                      replaced  = candidate->Requester;
+
+        if (InterlockedCompareExchange64(&candidate->Requester,
+                                         (LONG64)Requester,
+                                         replaced) == replaced) {
+            candidate->Cost = cost;
+        }
+    }
+}
+
+//
+// GenFilterSketchEstimate
+//
+// Estimates everything Requester has sent, on all processors
+//
+inline
+void
+GenFilterSketchEstimate(PGENFILTER_SKETCH       Sketch,
+                        ULONGLONG               Requester,
+                        PGENFILTER_HEAVY_HITTER Hitter)
+{
+    ULONGLONG hash = GenFilterSketchHash(Requester);
+
+    Hitter->Requester = Requester;
+    Hitter->Requests  = ~0ULL;
+    Hitter->Bytes     = ~0ULL;
+
+    for (ULONG row = 0; row < GENFILTER_SKETCH_DEPTH; row++) {
+
+        ULONG     column   = GenFilterSketchColumn(hash,
+                                                   row);
+        ULONGLONG requests = 0;
+        ULONGLONG bytes    = 0;
+
+        for (ULONG cpu = 0; cpu < Sketch->CpuCount; cpu++) {
+            requests += (ULONGLONG)Sketch->Cpus[cpu].Counters[row][column].Requests;
+            bytes    += (ULONGLONG)Sketch->Cpus[cpu].Counters[row][column].Bytes;
+        }
+
+        if (requests < Hitter->Requests) {
+            Hitter->Requests = requests;
+        }
+
+        if (bytes < Hitter->Bytes) {
+            Hitter->Bytes = bytes;
+        }
+    }
+}
+
+inline
+ULONGLONG
+GenFilterSketchHitterCost(const GENFILTER_HEAVY_HITTER* Hitter)
+{
+    return Hitter->Bytes + Hitter->Requests * GENFILTER_ATTRIBUTION_REQUEST_COST;
+}
+
+//
+// GenFilterSketchQuery
+//
+// Fills in HeavyHitters' counts and hitters.  Any requester with more than
+// 1/GENFILTER_SKETCH_CANDIDATES of the cost on some processor is one of
+// that processor's candidates, so we estimate every processor's candidates
+// over all processors, and keep the heaviest.
+//
+inline
+void
+GenFilterSketchQuery(PGENFILTER_SKETCH        Sketch,
+                     PGENFILTER_HEAVY_HITTERS HeavyHitters)
+{
+    ULONG count = 0;
+
+    HeavyHitters->TotalRequests = 0;
+    HeavyHitters->TotalBytes    = 0;
+
+    //
+    // Everything is counted once in every row, so one row's total is exact
+    //
+    for (ULONG cpu = 0; cpu < Sketch->CpuCount; cpu++) {
+        for (ULONG column = 0; column < GENFILTER_SKETCH_WIDTH; column++) {
+            HeavyHitters->TotalRequests += (ULONGLONG)Sketch->Cpus[cpu].Counters[0][column].Requests;
+            HeavyHitters->TotalBytes    += (ULONGLONG)Sketch->Cpus[cpu].Counters[0][column].Bytes;
+        }
+    }
+
+    for (ULONG cpu = 0; cpu < Sketch->CpuCount; cpu++) {
+
+        for (ULONG slot = 0; slot < GENFILTER_SKETCH_CANDIDATES; slot++) {
+
+            GENFILTER_HEAVY_HITTER hitter;
+            ULONGLONG              requester;
+            ULONG                  position;
+            bool                   seen = false;
+
+            if (Sketch->Cpus[cpu].Candidates[slot].Cost == 0) {
+                continue;
+            }
+
+            requester = (ULONGLONG)Sketch->Cpus[cpu].Candidates[slot].Requester;
+
+            for (ULONG index = 0; index < count; index++) {
+
+                if (HeavyHitters->Hitters[index].Requester == requester) {
+                    seen = true;
+                    break;
+                }
+            }
+
+            if (seen) {
+                continue;
+            }
+
+            GenFilterSketchEstimate(Sketch,
+                                    requester,
+                                    &hitter);
+
+            //
+            // Insertion sort, heaviest first, dropping the lightest if
+            // we're full
+            //
+            position = count;
+
+            while (position > 0 &&
+                   GenFilterSketchHitterCost(&HeavyHitters->Hitters[position - 1]) <
+                   GenFilterSketchHitterCost(&hitter)) {
+                position--;
+            }
+
+            if (position == GENFILTER_HEAVY_HITTERS_MAX) {
+                continue;
+            }
+
+            if (count < GENFILTER_HEAVY_HITTERS_MAX) {
+                count++;
+            }
+
+            for (ULONG index = count - 1; index > position; index--) {
+                HeavyHitters->Hitters[index] = HeavyHitters->Hitters[index - 1];
+            }
+
+            HeavyHitters->Hitters[position] = hitter;
+        }
+    }
+
+    HeavyHitters->HitterCount    = count;
+    HeavyHitters->ProcessorCount = Sketch->CpuCount;
+}
@@ -0,0 +1,378 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterSlab.h
+//
+//    ABSTRACT:
+//
+//      Fixed-size element pool ("slab") core.  Elements are handed out from a
+//      small per-processor cache, which is refilled from (and spills back to)
+//      a shared lock-free free list in batches, so that the common case touches
+//      no cache line another processor is using.  Like GenFilterSched.h, this
+//      file deliberately includes nothing and knows nothing about WDF, so that
+//      GenFilterCtl can benchmark the same code the driver runs.  Include it
+//      after <wdm.h> in the driver, or after <windows.h> in user mode.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+//
+// The most free elements one processor keeps for itself.  A pool too small
+// to give every processor a useful cache gets a smaller limit (possibly
+// zero, in which case every allocation goes to the shared free list).
+//
+#define GENFILTER_SLAB_CPU_CACHE    16
+
+//
+// One processor's cache of free elements and its counters.  Cache aligned,
+// and only ever touched by one thread at a time: the caller guarantees
+// that (the driver raises to DISPATCH_LEVEL and uses its processor number).
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_SLAB_CPU {
+    ULONG     Count;
+    ULONG     Free[GENFILTER_SLAB_CPU_CACHE];   // Element indexes
+    ULONGLONG Allocations;
+    ULONGLONG Frees;
+    ULONGLONG Exhausted;                        // Allocations that failed
+} GENFILTER_SLAB_CPU, *PGENFILTER_SLAB_CPU;
+
+//
+// The pool
+//
+// Depot is the top of a Treiber stack of free elements, linked through
+// Next.  Its low 32 bits are the top element's index + 1 (0 when the stack
+// is empty), and its high 32 bits a tag that changes on every push and pop,
+// so that a pop that races with a pop and re-push of the same element
+// fails its compare-exchange instead of corrupting the list.
+//
+// Out counts elements that aren't on the shared list: in use, or sitting
+// in a processor's cache.  It (and HighWater, its maximum) only changes
+// when a batch moves between a cache and the list, so it costs nothing on
+// the common path, and overstates use by at most CacheLimit per processor.
+//
+typedef struct _GENFILTER_SLAB {
+    PUCHAR              Base;
+    SIZE_T              ElementSize;
+    ULONG               ElementCount;
+    ULONG               CpuCount;
+    ULONG               CacheLimit;
+    PGENFILTER_SLAB_CPU Cpus;
+    volatile ULONG*     Next;
+    volatile LONG64     Depot;
+    volatile LONG       Out;
+    volatile LONG       HighWater;
+} GENFILTER_SLAB, *PGENFILTER_SLAB;
+
+//
+// A snapshot of a pool's counters.  Allocations, Frees, and Exhausted are
+// summed over all processors, so they're only exact if the pool is idle.
+//
+typedef struct _GENFILTER_SLAB_COUNTERS {
+    ULONGLONG Allocations;
+    ULONGLONG Frees;
+    ULONGLONG Exhausted;
+    ULONG     InUse;                    // Allocations - Frees
+    ULONG     HighWater;
+} GENFILTER_SLAB_COUNTERS, *PGENFILTER_SLAB_COUNTERS;
+
+//
+// Depot helpers.  Elements are named by index + 1 here, so that 0 can mean
+// "none".
+//
+inline
+ULONG
+GenFilterSlabDepotPop(PGENFILTER_SLAB Slab)
+{
+    LONG64 head = Slab->Depot;
+
+    for (;;) {
+
+        ULONG  top = (ULONG)head;
+        LONG64 newHead;
+        LONG64 seen;
+
+        if (top == 0) {
+            return 0;
+        }
+
+        //
+        // If another processor pops this element first, Next may already
+        // have been reused.  That's harmless: the tag will have moved, and
+        // the compare-exchange below will fail.
+        //
+        newHead = (LONG64)(((((ULONGLONG)head >> 32) + 1) << 32) |
+                           Slab->Next[top - 1]);
+
+        seen = InterlockedCompareExchange64(&Slab->Depot,
+                                            newHead,
+                                            head);
+        if (seen == head) {
+            return top;
+        }
+
+        head = seen;
+    }
+}
+
+//
+// Pushes a chain of elements, already linked First to Last through Next
+//
+inline
+void
+GenFilterSlabDepotPush(PGENFILTER_SLAB Slab,
+                       ULONG           First,
+                       ULONG           Last)
+{
+    LONG64 head = Slab->Depot;
+
+    for (;;) {
+
+        LONG64 newHead;
+        LONG64 seen;
+
+        Slab->Next[Last - 1] = (ULONG)head;
+
+        newHead = (LONG64)(((((ULONGLONG)head >> 32) + 1) << 32) | First);
+
+        seen = InterlockedCompareExchange64(&Slab->Depot,
+                                            newHead,
+                                            head);
+        if (seen == head) {
+            return;
+        }
+
+        head = seen;
+    }
+}
+
+//
+// Accounts for Count elements leaving (positive) or returning to (negative)
+// the shared list
+//
+inline
+void
+GenFilterSlabNoteOut(PGENFILTER_SLAB Slab,
+                     LONG            Count)
+{
+    LONG out  = InterlockedAdd(&Slab->Out,
+                               Count);
+    LONG high = Slab->HighWater;
+
+    while (out > high) {
+
+        LONG seen = InterlockedCompareExchange(&Slab->HighWater,
+                                               out,
+                                               high);
+        if (seen == high) {
+            break;
+        }
+
+        high = seen;
+    }
+}
+
+//
+// GenFilterSlabInitialize
+//
+// Carves ElementCount elements of ElementSize bytes from Elements.  Next
+// must have room for ElementCount ULONGs, and Cpus for CpuCount zeroed
+// (and cache aligned) GENFILTER_SLAB_CPUs.  All three must live as long as
+// the pool does.
+//
+inline
+void
+GenFilterSlabInitialize(PGENFILTER_SLAB     Slab,
+                        void*               Elements,
+                        SIZE_T              ElementSize,
+                        ULONG               ElementCount,
+                        volatile ULONG*     Next,
+                        PGENFILTER_SLAB_CPU Cpus,
+                        ULONG               CpuCount)
+{
+    Slab->Base         = (PUCHAR)Elements;
+    Slab->ElementSize  = ElementSize;
+    Slab->ElementCount = ElementCount;
+    Slab->CpuCount     = CpuCount;
+    Slab->Cpus         = Cpus;
+    Slab->Next         = Next;
+    Slab->Depot        = 0;
+    Slab->Out          = 0;
+    Slab->HighWater    = 0;
+
+    //
+    // Between them, the caches may hold at most half the pool
+    //
+    Slab->CacheLimit = ElementCount / (2 * CpuCount);
+
+    if (Slab->CacheLimit > GENFILTER_SLAB_CPU_CACHE) {
+        Slab->CacheLimit = GENFILTER_SLAB_CPU_CACHE;
+    }
+
+    //
+    // Link every element, lowest index on top
+    //
+    for (ULONG index = 0; index < ElementCount; index++) {
+        Next[index] = (index + 1 < ElementCount) ? index + 2 : 0;
+    }
+
+    Slab->Depot = (ElementCount != 0) ? 1 : 0;
+}
+
+//
+// GenFilterSlabAllocate
+//
+// Returns a free element, or nullptr if there are none.  Cpu is the
+// caller's processor (or thread) number, less than CpuCount.
+//
+// An allocation only looks at its own processor's cache and the shared
+// list, so it can fail while other processors' caches still hold free
+// elements.  Pools should be sized with that in mind.
+//
+inline
+void*
+GenFilterSlabAllocate(PGENFILTER_SLAB Slab,
+                      ULONG           Cpu)
+{
+    PGENFILTER_SLAB_CPU cpu = &Slab->Cpus[Cpu];
+
+    if (cpu->Count == 0) {
+
+        //
+        // Refill half the cache (or just take one, if we have no cache)
+        //
+        ULONG want = (Slab->CacheLimit > 1) ? Slab->CacheLimit / 2 : 1;
+
+        while (cpu->Count < want) {
+
+            ULONG element = GenFilterSlabDepotPop(Slab);
+
+            if (element == 0) {
+                break;
+            }
+
+            cpu->Free[cpu->Count++] = element - 1;
+        }
+
+        if (cpu->Count == 0) {
+            cpu->Exhausted++;
+            return nullptr;
+        }
+
+        GenFilterSlabNoteOut(Slab,
+                             (LONG)cpu->Count);
+    }
+
+    cpu->Allocations++;
+
+    return Slab->Base + (cpu->Free[--cpu->Count] * Slab->ElementSize);
+}
+
+//
+// GenFilterSlabFree
+//
+// Returns an element allocated from this pool (by any processor)
+//
+inline
+void
+GenFilterSlabFree(PGENFILTER_SLAB Slab,
+                  ULONG           Cpu,
+                  void*           Element)
+{
+    PGENFILTER_SLAB_CPU cpu = &Slab->Cpus[Cpu];
+    ULONG               index;
+
+    index = (ULONG)(((PUCHAR)Element - Slab->Base) / Slab->ElementSize);
+
+    cpu->Frees++;
+
+    if (cpu->Count < Slab->CacheLimit) {
+        cpu->Free[cpu->Count++] = index;
+        return;
+    }
+
+    //
+    // The cache is full.  Give this element and half the cache back to the
+    // shared list, in one push.
+    //
+    ULONG first = index + 1;
+    ULONG moved = 1;
+
+    while (cpu->Count > Slab->CacheLimit / 2) {
+
+        ULONG element = cpu->Free[--cpu->Count];
+
+        Slab->Next[element] = first;
+        first               = element + 1;
+        moved++;
+    }
+
+    //
+    // Count them back in before they're visible to anyone else, so that Out
+    // never exceeds the pool
+    //
+    GenFilterSlabNoteOut(Slab,
+                         -(LONG)moved);
+
+    GenFilterSlabDepotPush(Slab,
+                           first,
+                           index + 1);
+}
+
+//
+// GenFilterSlabQuery
+//
+inline
+void
+GenFilterSlabQuery(const GENFILTER_SLAB*    Slab,
+                   PGENFILTER_SLAB_COUNTERS Counters)
+{
+    Counters->Allocations = 0;
+    Counters->Frees       = 0;
+    Counters->Exhausted   = 0;
+
+    for (ULONG cpu = 0; cpu < Slab->CpuCount; cpu++) {
+        Counters->Allocations += Slab->Cpus[cpu].Allocations;
+        Counters->Frees       += Slab->Cpus[cpu].Frees;
+        Counters->Exhausted   += Slab->Cpus[cpu].Exhausted;
+    }
+
+    Counters->InUse     = (ULONG)(Counters->Allocations - Counters->Frees);
+    Counters->HighWater = (ULONG)Slab->HighWater;
+}
@@ -0,0 +1,768 @@
+///
+/// @file GenFilterSplit.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+static
+ULONG
+GenFilterSplitAllocate(_In_ WDFREQUEST Original,
+                       _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                       _Out_writes_(GENFILTER_SPLIT_MAX_DEPTH) PGENFILTER_SPLIT_CHUNK* Chunks);
+
+static
+VOID
+GenFilterSplitSend(_In_ PGENFILTER_SPLIT_CHUNK Chunk);
+
+static
+BOOLEAN
+GenFilterSplitChunkDone(_In_ PGENFILTER_SPLIT_CHUNK Chunk);
+
+static
+VOID
+GenFilterSplitFinish(_In_ WDFREQUEST Original,
+                     _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE GenFilterSplitCompletion;
+
+//
+// GENFILTER_SPLIT_CHUNK.State.  A chunk is Sending from just before
+// WdfRequestSend until just after it returns.  If it completes in that
+// time, the completion routine makes it Completed and leaves the rest to
+// the sender, so that a device that completes chunks as they're sent
+// doesn't have us sending the next one from inside the completion routine
+// of the last, and so on down the stack.
+//
+#define GENFILTER_SPLIT_CHUNK_SENT      0
+#define GENFILTER_SPLIT_CHUNK_SENDING   1
+#define GENFILTER_SPLIT_CHUNK_COMPLETED 2
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterSplitInitialize
+//
+//    Creates the pool of chunk Requests and partial MDLs that large
+//    transfers are split into.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why splitting could
+//                      not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      The configuration MUST already be initialized: whether we start out
+//      splitting is up to its first snapshot.  The pool is created whether
+//      we do or not, since splitting can be turned on later with
+//      IOCTL_GENFILTER_SET_CONFIG.  Each MDL has room for the largest
+//      chunk, wherever in a page it starts.
+//
+//      A chunk carries only an MDL, so we only ever split if the device
+//      below us does direct I/O (as CD-ROMs do).
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterSplitInitialize(WDFDEVICE                 Device,
+                         PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES objectAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    PGENFILTER_SPLIT      split;
+    size_t                mdlSize;
+
+    split = &DevContext->Split;
+
+    RtlZeroMemory(split,
+                  sizeof(GENFILTER_SPLIT));
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &split->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for splitting failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    mdlSize = MmSizeOfMdl((PVOID)(PAGE_SIZE - 1),
+                          GENFILTER_SPLIT_MAX_CHUNK_KB * 1024);
+
+    mdlSize = ALIGN_UP_BY(mdlSize,
+                          MEMORY_ALLOCATION_ALIGNMENT);
+
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'mFnG',
+                             mdlSize * GENFILTER_SPLIT_CHUNKS,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for splitting failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < GENFILTER_SPLIT_CHUNKS; index++) {
+
+        PGENFILTER_SPLIT_CHUNK chunk = &split->Chunks[index];
+
+        status = WdfRequestCreate(&objectAttr,
+                                  WdfDeviceGetIoTarget(Device),
+                                  &chunk->Request);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfRequestCreate for splitting failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        chunk->Mdl = (PMDL)((PUCHAR)buffer + index * mdlSize);
+
+        MmInitializeMdl(chunk->Mdl,
+                        (PVOID)(PAGE_SIZE - 1),
+                        GENFILTER_SPLIT_MAX_CHUNK_KB * 1024);
+
+        chunk->DevContext = DevContext;
+    }
+
+    status = GenFilterPoolCreate(Device,
+                                 &DevContext->Pools[GenFilterPoolSplit],
+                                 split->Chunks,
+                                 sizeof(GENFILTER_SPLIT_CHUNK),
+                                 GENFILTER_SPLIT_CHUNKS);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    split->DirectIo = (WdfDeviceWdmGetAttachedDevice(Device)->Flags & DO_DIRECT_IO) != 0;
+
+    //
+    // Nothing publishes a snapshot until we've been added
+    //
+    split->Splitting = ((PCGENFILTER_CONFIG_SNAPSHOT)DevContext->Config.Rcu.Current)->Split.ChunkKB != 0;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterSplitRequest
+//
+//    Called for every read and write we're about to send.  If it's longer
+//    than the configured chunk size, sends it down as chunks instead, a
+//    few at a time, and completes it when the last one has.
+//
+//  INPUTS:
+//
+//      Request     - The Request we're about to send
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Completion  - Our completion callback, which the Request is handed
+//                    to when its chunks are done
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the Request is being sent in chunks (the caller must not
+//      touch it again), or FALSE if the caller should send it as it is.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Each chunk is a partial MDL of the Request's own (or, for a write
+//      we've inspected, of our copy of its data), so nothing is copied.  The chunks a Request starts with are the only ones it
+//      gets: as each completes, it's reused for the next part of the
+//      Request, so at most Depth are ever in flight.  If the pool can't
+//      spare even one, the Request goes down whole.
+//
+//      Completion sees the Request just as if the device had completed
+//      it, with the status of the first chunk that failed (or came up
+//      short), and the bytes before that.  We stop sending chunks once one
+//      has.
+//
+//      The Request isn't cancelable while its chunks are in flight.  None
+//      of them takes longer than a chunk's worth of I/O.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterSplitRequest(WDFREQUEST                         Request,
+                      PGENFILTER_DEVICE_CONTEXT          DevContext,
+                      PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion)
+{
+    WDF_REQUEST_PARAMETERS      params;
+    PGENFILTER_REQUEST_CONTEXT  reqContext;
+    PCGENFILTER_CONFIG_SNAPSHOT snapshot;
+    PGENFILTER_SPLIT_CHUNK      chunks[GENFILTER_SPLIT_MAX_DEPTH];
+    NTSTATUS                    status;
+    PGENFILTER_INSPECT_COPY     copy;
+    PMDL                        mdl;
+    LONGLONG                    offset;
+    size_t                      length;
+    ULONG                       chunkBytes;
+    ULONG                       depth;
+    ULONG                       phase;
+    ULONG                       count;
+    BOOLEAN                     write;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+
+    WdfRequestGetParameters(Request,
+                            &params);
+
+    switch (params.Type) {
+
+        case WdfRequestTypeRead:
+            length = params.Parameters.Read.Length;
+            offset = params.Parameters.Read.DeviceOffset;
+            write  = FALSE;
+            break;
+
+        case WdfRequestTypeWrite:
+            length = params.Parameters.Write.Length;
+            offset = params.Parameters.Write.DeviceOffset;
+            write  = TRUE;
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    //
+    // A write we've inspected is sent from our copy of (the current part
+    // of) its data
+    //
+    reqContext = GenFilterGetRequestContext(Request);
+    copy       = reqContext->InspectCopy;
+
+    if (copy != nullptr) {
+        length = reqContext->InspectLength;
+        offset = reqContext->InspectOffset;
+    }
+
+    snapshot = GenFilterConfigAcquire(&DevContext->Config,
+                                      &phase);
+
+    chunkBytes = snapshot->Split.ChunkKB * 1024;
+    depth      = snapshot->Split.Depth;
+
+    GenFilterConfigRelease(&DevContext->Config,
+                           phase);
+
+    if (chunkBytes == 0 ||
+        length <= chunkBytes ||
+        length > MAXULONG) {
+        return FALSE;
+    }
+
+    //
+    // We carve the chunks out of the Request's MDL (or our copy's), so it
+    // has to have just the one
+    //
+    if (copy != nullptr) {
+
+        mdl = copy->Mdl;
+
+    } else {
+
+        status = write ? WdfRequestRetrieveInputWdmMdl(Request,
+                                                       &mdl) :
+                         WdfRequestRetrieveOutputWdmMdl(Request,
+                                                        &mdl);
+
+        if (!NT_SUCCESS(status) ||
+            mdl->Next != nullptr) {
+            return FALSE;
+        }
+    }
+
+    reqContext->SplitMdl         = mdl;
+    reqContext->SplitOffset      = offset;
+    reqContext->SplitLength      = (ULONG)length;
+    reqContext->SplitChunkBytes  = chunkBytes;
+    reqContext->SplitDepth       = depth;
+    reqContext->SplitNext        = 0;
+    reqContext->SplitWrite       = write;
+    reqContext->SplitFlags       = IoGetCurrentIrpStackLocation(WdfRequestWdmGetIrp(Request))->Flags;
+    reqContext->SplitResume      = FALSE;
+    reqContext->SplitCompletion  = Completion;
+
+    count = GenFilterSplitAllocate(Request,
+                                   DevContext,
+                                   chunks);
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    GenFilterStatsIncrement(&DevContext->Stats,
+                            GenFilterStatSplitRequests);
+
+    for (ULONG index = 0; index < count; index++) {
+        GenFilterSplitSend(chunks[index]);
+    }
+
+    return TRUE;
+}
+
+//
+// GenFilterSplitRetry
+//
+// The chunks before the one that failed don't need sending again, and
+// neither does the original whole: what's left goes down in chunks, as the
+// original did.  If there are no chunks to be had, the caller sends the
+// original down whole, as it would a Request that couldn't be split.
+//
+_Use_decl_annotations_
+BOOLEAN
+GenFilterSplitRetry(WDFREQUEST                Request,
+                    PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_SPLIT_CHUNK     chunks[GENFILTER_SPLIT_MAX_DEPTH];
+    ULONG                      count;
+
+    reqContext = GenFilterGetRequestContext(Request);
+
+    if (!reqContext->SplitResume) {
+        return FALSE;
+    }
+
+    reqContext->SplitResume = FALSE;
+    reqContext->SplitNext   = reqContext->SplitTransferred;
+
+    count = GenFilterSplitAllocate(Request,
+                                   DevContext,
+                                   chunks);
+
+    if (count == 0) {
+        return FALSE;
+    }
+
+    for (ULONG index = 0; index < count; index++) {
+        GenFilterSplitSend(chunks[index]);
+    }
+
+    return TRUE;
+}
+
+//
+// GenFilterSplitAllocate
+//
+// Takes as many chunks as the original may have in flight (and has left to
+// send from SplitNext on), and gives each its range.  Returns how many it
+// got.
+//
+static
+ULONG
+GenFilterSplitAllocate(WDFREQUEST                Original,
+                       PGENFILTER_DEVICE_CONTEXT DevContext,
+                       PGENFILTER_SPLIT_CHUNK*   Chunks)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    ULONG                      remaining;
+    ULONG                      depth;
+    ULONG                      count = 0;
+
+    reqContext = GenFilterGetRequestContext(Original);
+    remaining  = reqContext->SplitLength - reqContext->SplitNext;
+    depth      = reqContext->SplitDepth;
+
+    if (depth > (remaining + reqContext->SplitChunkBytes - 1) / reqContext->SplitChunkBytes) {
+        depth = (remaining + reqContext->SplitChunkBytes - 1) / reqContext->SplitChunkBytes;
+    }
+
+    while (count < depth) {
+
+        Chunks[count] = (PGENFILTER_SPLIT_CHUNK)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolSplit]);
+
+        if (Chunks[count] == nullptr) {
+            break;
+        }
+
+        count++;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    reqContext->SplitOutstanding = count;
+    reqContext->SplitTransferred = reqContext->SplitLength;
+    reqContext->SplitStatus      = STATUS_SUCCESS;
+
+    //
+    // Give every chunk its range before sending any of them: once we've
+    // sent one, it may complete and take the next range for itself
+    //
+    for (ULONG index = 0; index < count; index++) {
+
+        Chunks[index]->Original = Original;
+        Chunks[index]->Start    = reqContext->SplitNext;
+        Chunks[index]->Length   = min(reqContext->SplitChunkBytes,
+                                      reqContext->SplitLength - reqContext->SplitNext);
+
+        reqContext->SplitNext += Chunks[index]->Length;
+    }
+
+    return count;
+}
+
+//
+// GenFilterSplitSend
+//
+// Sends a chunk, and then, for as long as it completes before WdfRequestSend
+// returns (or can't be sent at all), the next part of its original in it
+//
+static
+VOID
+GenFilterSplitSend(PGENFILTER_SPLIT_CHUNK Chunk)
+{
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    WDF_REQUEST_REUSE_PARAMS   reuseParams;
+    IO_STACK_LOCATION          stack;
+    NTSTATUS                   status;
+
+    reqContext = GenFilterGetRequestContext(Chunk->Original);
+
+    do {
+
+        WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams,
+                                      WDF_REQUEST_REUSE_NO_FLAGS,
+                                      STATUS_SUCCESS);
+
+        status = WdfRequestReuse(Chunk->Request,
+                                 &reuseParams);
+
+        if (!NT_SUCCESS(status)) {
+
+            Chunk->Status      = status;
+            Chunk->Information = 0;
+            continue;
+        }
+
+        IoBuildPartialMdl(reqContext->SplitMdl,
+                          Chunk->Mdl,
+                          (PUCHAR)MmGetMdlVirtualAddress(reqContext->SplitMdl) + Chunk->Start,
+                          Chunk->Length);
+
+        //
+        // The same Request as the original, for less of it.  Flags carries
+        // SL_OVERRIDE_VERIFY_VOLUME, if the original had it.
+        //
+        RtlZeroMemory(&stack,
+                      sizeof(IO_STACK_LOCATION));
+
+        stack.Flags = reqContext->SplitFlags;
+
+        if (reqContext->SplitWrite) {
+
+            stack.MajorFunction                      = IRP_MJ_WRITE;
+            stack.Parameters.Write.Length            = Chunk->Length;
+            stack.Parameters.Write.ByteOffset.QuadPart = reqContext->SplitOffset + Chunk->Start;
+
+        } else {
+
+            stack.MajorFunction                     = IRP_MJ_READ;
+            stack.Parameters.Read.Length            = Chunk->Length;
+            stack.Parameters.Read.ByteOffset.QuadPart = reqContext->SplitOffset + Chunk->Start;
+        }
+
+        WdfRequestWdmFormatUsingStackLocation(Chunk->Request,
+                                              &stack);
+
+        WdfRequestWdmGetIrp(Chunk->Request)->MdlAddress = Chunk->Mdl;
+
+        WdfRequestSetCompletionRoutine(Chunk->Request,
+                                       GenFilterSplitCompletion,
+                                       Chunk);
+
+        GenFilterStatsIncrement(&Chunk->DevContext->Stats,
+                                GenFilterStatSplitChunks);
+
+        Chunk->State = GENFILTER_SPLIT_CHUNK_SENDING;
+
+        if (!WdfRequestSend(Chunk->Request,
+                            WdfDeviceGetIoTarget(Chunk->DevContext->WdfDevice),
+                            WDF_NO_SEND_OPTIONS)) {
+
+            Chunk->Status      = WdfRequestGetStatus(Chunk->Request);
+            Chunk->Information = 0;
+            continue;
+        }
+
+        //
+        // If it hasn't completed yet, its completion routine takes it from
+        // here
+        //
+        if (InterlockedCompareExchange(&Chunk->State,
+                                       GENFILTER_SPLIT_CHUNK_SENT,
+                                       GENFILTER_SPLIT_CHUNK_SENDING) == GENFILTER_SPLIT_CHUNK_SENDING) {
+            return;
+        }
+
+    } while (GenFilterSplitChunkDone(Chunk));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterSplitCompletion
+//
+//    This routine is called by the Framework when the I/O Target has
+//    completed one of our chunks.  Sends the next part of its original in
+//    it, if there is one.
+//
+//  INPUTS:
+//
+//      Request  - The chunk Request
+//
+//      Target   - The I/O target we sent it to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The pool chunk the Request belongs to
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The Request is ours (we created it), so it is not completed here.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterSplitCompletion(WDFREQUEST                     Request,
+                         WDFIOTARGET                    Target,
+                         PWDF_REQUEST_COMPLETION_PARAMS Params,
+                         WDFCONTEXT                     Context)
+{
+    auto* chunk = (PGENFILTER_SPLIT_CHUNK)Context;
+
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(Target);
+
+    chunk->Status      = Params->IoStatus.Status;
+    chunk->Information = Params->IoStatus.Information;
+
+    //
+    // If GenFilterSplitSend is still in WdfRequestSend, it carries on
+    //
+    if (InterlockedCompareExchange(&chunk->State,
+                                   GENFILTER_SPLIT_CHUNK_COMPLETED,
+                                   GENFILTER_SPLIT_CHUNK_SENDING) == GENFILTER_SPLIT_CHUNK_SENDING) {
+        return;
+    }
+
+    if (GenFilterSplitChunkDone(chunk)) {
+        GenFilterSplitSend(chunk);
+    }
+}
+
+//
+// GenFilterSplitChunkDone
+//
+// Notes how a chunk went.  Returns TRUE if it's been given the next part
+// of its original to send; otherwise, returns it to the pool, and if it
+// was the original's last one in flight, finishes the original.
+//
+static
+BOOLEAN
+GenFilterSplitChunkDone(PGENFILTER_SPLIT_CHUNK Chunk)
+{
+    PGENFILTER_DEVICE_CONTEXT  devContext;
+    PGENFILTER_REQUEST_CONTEXT reqContext;
+    PGENFILTER_SPLIT           split;
+    WDFREQUEST                 original;
+    BOOLEAN                    sendNext = FALSE;
+    BOOLEAN                    finished = FALSE;
+
+    devContext = Chunk->DevContext;
+    original   = Chunk->Original;
+    reqContext = GenFilterGetRequestContext(original);
+    split      = &devContext->Split;
+
+    //
+    // The device below may have mapped the partial MDL
+    //
+    WdfRequestWdmGetIrp(Chunk->Request)->MdlAddress = nullptr;
+
+    MmPrepareMdlForReuse(Chunk->Mdl);
+
+    WdfSpinLockAcquire(split->Lock);
+
+    if (!NT_SUCCESS(Chunk->Status) ||
+        Chunk->Information < Chunk->Length) {
+
+        //
+        // Nothing after the first chunk that came up short counts
+        //
+        if (Chunk->Start + Chunk->Information < reqContext->SplitTransferred) {
+
+            reqContext->SplitTransferred = Chunk->Start + (ULONG)Chunk->Information;
+            reqContext->SplitStatus      = Chunk->Status;
+        }
+
+        reqContext->SplitNext = reqContext->SplitLength;
+    }
+
+    if (reqContext->SplitNext < reqContext->SplitLength) {
+
+        Chunk->Start  = reqContext->SplitNext;
+        Chunk->Length = min(reqContext->SplitChunkBytes,
+                            reqContext->SplitLength - reqContext->SplitNext);
+
+        reqContext->SplitNext += Chunk->Length;
+
+        sendNext = TRUE;
+
+    } else {
+
+        finished = --reqContext->SplitOutstanding == 0;
+    }
+
+    WdfSpinLockRelease(split->Lock);
+
+    if (sendNext) {
+        return TRUE;
+    }
+
+    GenFilterPoolFree(&devContext->Pools[GenFilterPoolSplit],
+                      Chunk);
+
+    if (finished) {
+
+        GenFilterSplitFinish(original,
+                             devContext);
+    }
+
+    return FALSE;
+}
+
+//
+// GenFilterSplitFinish
+//
+// Hands an original whose chunks are all done to our completion callback,
+// as though the device had completed it
+//
+static
+VOID
+GenFilterSplitFinish(WDFREQUEST                Original,
+                     PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_REQUEST_CONTEXT    reqContext;
+    WDF_REQUEST_COMPLETION_PARAMS params;
+
+    reqContext = GenFilterGetRequestContext(Original);
+
+    WDF_REQUEST_COMPLETION_PARAMS_INIT(&params);
+
+    params.Type                 = reqContext->SplitWrite ? WdfRequestTypeWrite :
+                                                           WdfRequestTypeRead;
+    params.IoStatus.Status      = reqContext->SplitStatus;
+    params.IoStatus.Information = NT_SUCCESS(reqContext->SplitStatus) ? reqContext->SplitTransferred :
+                                                                        0;
+
+    //
+    // If it's retried, it's from the chunk that failed
+    //
+    reqContext->SplitResume = !NT_SUCCESS(reqContext->SplitStatus);
+
+    //
+    // The original never went to the device, so nothing has set its
+    // Information, and whoever completes it (our callback, or a worker it
+    // defers to) takes the byte count from the Request, not from params
+    //
+    WdfRequestSetInformation(Original,
+                             params.IoStatus.Information);
+
+    reqContext->SplitCompletion(Original,
+                                WdfDeviceGetIoTarget(DevContext->WdfDevice),
+                                &params,
+                                DevContext);
+}
@@ -0,0 +1,141 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterSplit.h
+//
+//    ABSTRACT:
+//
+//      Sends reads and writes that are longer than the configured chunk
+//      size down in chunks, built on partial MDLs of the original's, so
+//      that smaller Requests don't wait behind the whole of a large one.
+//      A few chunks of each are in flight at once.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Chunk Requests (and partial MDLs) in the pool.  A transfer that can't get
+// one is sent down whole.
+//
+constexpr ULONG GENFILTER_SPLIT_CHUNKS = 16;
+
+//
+// How many of a transfer's chunks are in flight at once, unless the
+// "SplitDepth" value in the device's hardware key says otherwise
+//
+#define GENFILTER_SPLIT_DEFAULT_DEPTH   2
+
+//
+// One preallocated chunk Request, and the partial MDL it carries.  The rest
+// is only meaningful while the chunk is in use: the original it's part
+// of, the range of it the chunk is sending, and how that went.  State
+// says whether whoever sent it is still in WdfRequestSend (see
+// GenFilterSplitSend).  Free chunks are kept in
+// DevContext->Pools[GenFilterPoolSplit].
+//
+typedef struct _GENFILTER_SPLIT_CHUNK {
+    WDFREQUEST                Request;
+    PMDL                      Mdl;
+    PGENFILTER_DEVICE_CONTEXT DevContext;
+    WDFREQUEST                Original;
+    ULONG                     Start;        // Bytes into the original
+    ULONG                     Length;
+    volatile LONG             State;
+    NTSTATUS                  Status;
+    ULONG_PTR                 Information;
+} GENFILTER_SPLIT_CHUNK, *PGENFILTER_SPLIT_CHUNK;
+
+//
+// The per-device splitting state that lives in our device context.  How
+// transfers are split is part of the configuration (see
+// GENFILTER_CONFIG_SNAPSHOT); Splitting says whether the current one
+// splits them at all, so that when it doesn't, Requests don't have to
+// look.
+//
+typedef struct _GENFILTER_SPLIT {
+    volatile LONG         Splitting;
+    BOOLEAN               DirectIo;     // Whether we can split at all
+    WDFSPINLOCK           Lock;         // Protects each original's progress
+    GENFILTER_SPLIT_CHUNK Chunks[GENFILTER_SPLIT_CHUNKS];
+} GENFILTER_SPLIT, *PGENFILTER_SPLIT;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterSplitInitialize(_In_ WDFDEVICE Device,
+                         _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Returns TRUE if the Request is being sent down in chunks, in which case
+// the caller must not touch it again
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterSplitRequest(_In_ WDFREQUEST Request,
+                      _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                      _In_ PFN_WDF_REQUEST_COMPLETION_ROUTINE Completion);
+
+//
+// Called to send a Request again after it failed.  Returns TRUE if it was
+// split, and what's left of it from the chunk that failed is being sent
+// down in chunks again, in which case the caller must not touch it again.
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterSplitRetry(_In_ WDFREQUEST Request,
+                    _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// GenFilterSplitIsOn
+//
+// Whether Requests need to be looked at to see if they should be split.
+// Splitting is read without a lock: a Request that races with the
+// configuration changing may be looked at, or not, either way.
+//
+FORCEINLINE
+BOOLEAN
+GenFilterSplitIsOn(_In_ PGENFILTER_SPLIT Split)
+{
+    return Split->DirectIo && Split->Splitting != 0;
+}
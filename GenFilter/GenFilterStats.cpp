@@ -0,0 +1,259 @@
+///
+/// @file GenFilterStats.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterStatsInitialize
+//
+//    Allocates one cache-line aligned GENFILTER_CPU_STATS slot for every
+//    processor that can ever be present in the system.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE.  The slot array is parented to it, so it is
+//                freed automatically when the device is deleted.
+//
+//  OUTPUTS:
+//
+//      Stats   - The statistics block to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the memory could
+//                      not be allocated.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      We size the array with KeQueryMaximumProcessorCountEx (and not the
+//      active count) so that a processor that is hot-added later still gets
+//      a slot of its own.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterStatsInitialize(WDFDEVICE        Device,
+                         PGENFILTER_STATS Stats)
+{
+    NTSTATUS              status;
+    WDF_OBJECT_ATTRIBUTES memoryAttr;
+    WDFMEMORY             memory;
+    PVOID                 buffer;
+    ULONG                 processorCount;
+
+    RtlZeroMemory(Stats,
+                  sizeof(GENFILTER_STATS));
+
+    processorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttr);
+    memoryAttr.ParentObject = Device;
+
+    //
+    // Pool allocations are only guaranteed to be 16 byte aligned, so ask for
+    // an extra cache line and align the array ourselves.
+    //
+    status = WdfMemoryCreate(&memoryAttr,
+                             NonPagedPoolNx,
+                             'sFnG',
+                             (processorCount * sizeof(GENFILTER_CPU_STATS)) +
+                             SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for statistics failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  (processorCount * sizeof(GENFILTER_CPU_STATS)) +
+                  SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    Stats->PerCpu = (PGENFILTER_CPU_STATS)ALIGN_UP_BY(buffer,
+                                                     SYSTEM_CACHE_ALIGNMENT_SIZE);
+    Stats->ProcessorCount = processorCount;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterStatsSnapshot
+//
+//    Merges the per-processor counters into a single snapshot.
+//
+//  INPUTS:
+//
+//      Stats          - The statistics block to read
+//
+//      SnapshotLength - Size in bytes of the caller's snapshot buffer.  Must
+//                       be at least FIELD_OFFSET(GENFILTER_STATISTICS, Counters)
+//
+//  OUTPUTS:
+//
+//      Snapshot       - Filled with as many merged counters as fit
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The slots are read with no lock and no interlocked operation, which
+//      is what keeps the update side cheap.  Each 64-bit counter is read
+//      atomically, so no individual value is ever torn.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterStatsSnapshot(PGENFILTER_STATS      Stats,
+                       PGENFILTER_STATISTICS Snapshot,
+                       size_t                SnapshotLength)
+{
+    ULONG counterCount;
+
+    counterCount = (ULONG)((SnapshotLength -
+                            FIELD_OFFSET(GENFILTER_STATISTICS, Counters)) /
+                           sizeof(ULONGLONG));
+
+    if (counterCount > GenFilterStatCounterCount) {
+        counterCount = GenFilterStatCounterCount;
+    }
+
+    RtlZeroMemory(Snapshot,
+                  FIELD_OFFSET(GENFILTER_STATISTICS, Counters) +
+                  (counterCount * sizeof(ULONGLONG)));
+
+    Snapshot->Size           = FIELD_OFFSET(GENFILTER_STATISTICS, Counters) +
+                               (counterCount * sizeof(ULONGLONG));
+    Snapshot->CounterCount   = counterCount;
+    Snapshot->ProcessorCount = Stats->ProcessorCount;
+
+    for (ULONG cpu = 0; cpu < Stats->ProcessorCount; cpu++) {
+
+        for (ULONG counter = 0; counter < counterCount; counter++) {
+
+            Snapshot->Counters[counter] +=
+                (ULONGLONG)GenFilterAtomicReadNoFence64(&Stats->PerCpu[cpu].Counters[counter]);
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterStatsQuery
+//
+//    Handles IOCTL_GENFILTER_GET_STATISTICS by copying a merged snapshot of
+//    our statistics into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_GET_STATISTICS Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, or STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      even hold the fixed part of GENFILTER_STATISTICS.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterStatsQuery(WDFREQUEST                Request,
+                    PGENFILTER_DEVICE_CONTEXT DevContext,
+                    PULONG_PTR                Information)
+{
+    NTSTATUS              status;
+    PGENFILTER_STATISTICS snapshot;
+    size_t                snapshotLength;
+
+    *Information = 0;
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            FIELD_OFFSET(GENFILTER_STATISTICS, Counters),
+                                            (PVOID*)&snapshot,
+                                            &snapshotLength);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    GenFilterStatsSnapshot(&DevContext->Stats,
+                           snapshot,
+                           snapshotLength);
+
+    *Information = snapshot->Size;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
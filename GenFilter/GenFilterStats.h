@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterStats.h
+//
+//    ABSTRACT:
+//
+//      Per-processor I/O statistics.  Each processor updates only its own
+//      cache-line aligned slot, so counting a request never bounces a cache
+//      line between processors.  Slots are summed only when a snapshot is
+//      requested.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterAtomic.h"
+#include "GenFilterIoctl.h"
+
+//
+// One processor's counters.  Padded (and aligned at allocation time) to a
+// whole number of cache lines so that no two processors ever share a line.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_CPU_STATS {
+    volatile LONG64 Counters[GenFilterStatCounterCount];
+} GENFILTER_CPU_STATS, *PGENFILTER_CPU_STATS;
+
+//
+// The per-device statistics block that lives in our device context
+//
+typedef struct _GENFILTER_STATS {
+    ULONG                ProcessorCount;
+    PGENFILTER_CPU_STATS PerCpu;
+} GENFILTER_STATS, *PGENFILTER_STATS;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterStatsInitialize(_In_ WDFDEVICE Device, _Out_ PGENFILTER_STATS Stats);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterStatsSnapshot(_In_ PGENFILTER_STATS Stats,
+                       _Out_writes_bytes_(SnapshotLength) PGENFILTER_STATISTICS Snapshot,
+                       _In_ size_t SnapshotLength);
+
+//
+// GenFilterStatsAdd
+//
+// Adds Value to one of the calling processor's counters.
+//
+// We can be called at PASSIVE_LEVEL, where we may be rescheduled onto another
+// processor between looking up "our" slot and updating it.  So the update
+// is still interlocked -- but because the line almost always belongs to the
+// current processor the interlocked operation never has to wait for another
+// core, and NoFence avoids paying for a barrier we don't need.
+//
+// Modules count things whether or not our dispatcher keeps statistics.  If
+// it doesn't, the counters were never allocated and the count is dropped.
+//
+FORCEINLINE
+VOID
+GenFilterStatsAdd(_In_ PGENFILTER_STATS      Stats,
+                  _In_ GENFILTER_STAT_COUNTER Counter,
+                  _In_ LONG64                 Value)
+{
+    ULONG cpu;
+
+    if (Stats->ProcessorCount == 0) {
+        return;
+    }
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    if (cpu >= Stats->ProcessorCount) {
+        cpu %= Stats->ProcessorCount;
+    }
+
+    GenFilterAtomicAddNoFence64(&Stats->PerCpu[cpu].Counters[Counter],
+                                Value);
+}
+
+FORCEINLINE
+VOID
+GenFilterStatsIncrement(_In_ PGENFILTER_STATS      Stats,
+                        _In_ GENFILTER_STAT_COUNTER Counter)
+{
+    GenFilterStatsAdd(Stats,
+                      Counter,
+                      1);
+}
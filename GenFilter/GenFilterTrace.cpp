@@ -0,0 +1,370 @@
+///
+/// @file GenFilterTrace.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+
+#include "GenFilter.h"
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterTraceInitialize
+//
+//    Allocates a trace ring for each possible processor, and the lock that
+//    serializes draining them.
+//
+//  INPUTS:
+//
+//      Device  - Our WDFDEVICE.  Everything we allocate is parented to it.
+//
+//  OUTPUTS:
+//
+//      Trace   - The trace log to initialize
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why the trace log could
+//                      not be created.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      Like the statistics, the rings are sized by the *maximum* number of
+//      processors so that a processor that's hot-added later still gets a
+//      ring of its own and the records stay attributed to the right CPU.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterTraceInitialize(WDFDEVICE        Device,
+                         PGENFILTER_TRACE Trace)
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   objectAttr;
+    WDFMEMORY               memory;
+    PVOID                   buffer;
+    size_t                  ringsLength;
+    size_t                  recordsLength;
+    ULONG                   ringCount;
+    PGENFILTER_TRACE_RECORD records;
+    LARGE_INTEGER           frequency;
+
+    RtlZeroMemory(Trace,
+                  sizeof(GENFILTER_TRACE));
+
+    ringCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    ringsLength   = ringCount * sizeof(GENFILTER_TRACE_RING);
+    recordsLength = (size_t)ringCount * GENFILTER_TRACE_RECORDS_PER_RING *
+                    sizeof(GENFILTER_TRACE_RECORD);
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &Trace->DrainLock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for trace failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // One allocation holds the (cache-line aligned) ring headers followed by
+    // all the records.
+    //
+    status = WdfMemoryCreate(&objectAttr,
+                             NonPagedPoolNx,
+                             'tFnG',
+                             ringsLength + recordsLength +
+                             SYSTEM_CACHE_ALIGNMENT_SIZE,
+                             &memory,
+                             &buffer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfMemoryCreate for trace failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    RtlZeroMemory(buffer,
+                  ringsLength + recordsLength + SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    Trace->Rings = (PGENFILTER_TRACE_RING)ALIGN_UP_BY(buffer,
+                                                      SYSTEM_CACHE_ALIGNMENT_SIZE);
+    records = (PGENFILTER_TRACE_RECORD)((PUCHAR)Trace->Rings + ringsLength);
+
+    for (ULONG ring = 0; ring < ringCount; ring++) {
+
+        Trace->Rings[ring].Records = &records[ring * GENFILTER_TRACE_RECORDS_PER_RING];
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    Trace->Frequency = (ULONGLONG)frequency.QuadPart;
+    Trace->RingCount = ringCount;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterTraceDrain
+//
+//    Moves as many records as will fit from the trace rings into the
+//    caller's buffer.
+//
+//  INPUTS:
+//
+//      Trace        - The trace log to drain
+//
+//      BufferLength - Size in bytes of Buffer.  Must be at least
+//                     sizeof(GENFILTER_TRACE_HEADER).
+//
+//  OUTPUTS:
+//
+//      Buffer       - Receives a GENFILTER_TRACE_HEADER followed by the
+//                     drained records
+//
+//  RETURNS:
+//
+//      The number of records drained.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Writers never wait for us, so a ring can wrap while we're copying
+//      it.  We therefore re-read Head after the copy and throw away (and
+//      count as lost) any record whose slot a writer may have started to
+//      reuse in the meantime.
+//
+//      Records come out grouped by ring, not in time order.  The decoder
+//      sorts them by timestamp.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+ULONG
+GenFilterTraceDrain(PGENFILTER_TRACE        Trace,
+                    PGENFILTER_TRACE_HEADER Buffer,
+                    size_t                  BufferLength)
+{
+    PGENFILTER_TRACE_RECORD out;
+    ULONG                   capacity;
+    ULONG                   count;
+    ULONGLONG               lost;
+
+    out      = (PGENFILTER_TRACE_RECORD)(Buffer + 1);
+    capacity = (ULONG)((BufferLength - sizeof(GENFILTER_TRACE_HEADER)) /
+                       sizeof(GENFILTER_TRACE_RECORD));
+    count    = 0;
+    lost     = 0;
+
+    WdfSpinLockAcquire(Trace->DrainLock);
+
+    for (ULONG ringIndex = 0;
+         ringIndex < Trace->RingCount && count < capacity;
+         ringIndex++) {
+
+        PGENFILTER_TRACE_RING ring = &Trace->Rings[ringIndex];
+        ULONG                 head;
+        ULONG                 index;
+        ULONG                 firstOut;
+        ULONG                 overwritten;
+
+        head = (ULONG)ReadAcquire(&ring->Head);
+
+        //
+        // Anything more than a ring's worth behind Head is already gone
+        //
+        if (head - ring->Tail > GENFILTER_TRACE_RECORDS_PER_RING) {
+
+            lost += head - ring->Tail - GENFILTER_TRACE_RECORDS_PER_RING;
+            ring->Tail = head - GENFILTER_TRACE_RECORDS_PER_RING;
+        }
+
+        firstOut = count;
+
+        for (index = ring->Tail; index != head && count < capacity; index++) {
+
+            PGENFILTER_TRACE_RECORD record;
+
+            record = &ring->Records[index & (GENFILTER_TRACE_RECORDS_PER_RING - 1)];
+
+            //
+            // A writer has claimed this slot but hasn't finished filling it
+            // in.  Stop here and pick it up on the next drain.
+            //
+            if ((ULONG)ReadAcquire((volatile LONG*)&record->Sequence) != index + 1) {
+                break;
+            }
+
+            out[count] = *record;
+            count++;
+        }
+
+        //
+        // Make sure all of the copying above is done before we look at Head
+        // again, and then discard anything a writer may have overwritten.
+        //
+        KeMemoryBarrier();
+
+        head = (ULONG)ReadAcquire(&ring->Head);
+
+        overwritten = 0;
+
+        if ((LONG)(head - GENFILTER_TRACE_RECORDS_PER_RING - ring->Tail) > 0) {
+
+            overwritten = head - GENFILTER_TRACE_RECORDS_PER_RING - ring->Tail;
+
+            if (overwritten > count - firstOut) {
+                overwritten = count - firstOut;
+            }
+        }
+
+        if (overwritten != 0) {
+
+            RtlMoveMemory(&out[firstOut],
+                          &out[firstOut + overwritten],
+                          (count - firstOut - overwritten) *
+                          sizeof(GENFILTER_TRACE_RECORD));
+
+            count -= overwritten;
+            lost  += overwritten;
+        }
+
+        ring->Tail = index;
+    }
+
+    WdfSpinLockRelease(Trace->DrainLock);
+
+    Buffer->Size        = sizeof(GENFILTER_TRACE_HEADER);
+    Buffer->RecordSize  = sizeof(GENFILTER_TRACE_RECORD);
+    Buffer->RecordCount = count;
+    Buffer->Reserved    = 0;
+    Buffer->Frequency   = Trace->Frequency;
+    Buffer->LostRecords = lost;
+
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterTraceQuery
+//
+//    Handles IOCTL_GENFILTER_DRAIN_TRACE by draining as much of the trace
+//    log as fits into the Request's output buffer.
+//
+//  INPUTS:
+//
+//      Request     - The IOCTL_GENFILTER_DRAIN_TRACE Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      Information - Number of bytes written to the output buffer
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL if the output buffer cannot
+//      hold a GENFILTER_TRACE_HEADER, or STATUS_INVALID_DEVICE_STATE if our
+//      dispatcher doesn't log.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The caller completes the Request.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterTraceQuery(WDFREQUEST                Request,
+                    PGENFILTER_DEVICE_CONTEXT DevContext,
+                    PULONG_PTR                Information)
+{
+    NTSTATUS                status;
+    PGENFILTER_TRACE_HEADER header;
+    size_t                  bufferLength;
+    ULONG                   count;
+
+    *Information = 0;
+
+    if (DevContext->Trace.RingCount == 0) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto done;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request,
+                                            sizeof(GENFILTER_TRACE_HEADER),
+                                            (PVOID*)&header,
+                                            &bufferLength);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    count = GenFilterTraceDrain(&DevContext->Trace,
+                                header,
+                                bufferLength);
+
+    *Information = sizeof(GENFILTER_TRACE_HEADER) +
+                   ((ULONG_PTR)count * sizeof(GENFILTER_TRACE_RECORD));
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
@@ -0,0 +1,149 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterTrace.h
+//
+//    ABSTRACT:
+//
+//      Binary trace log.  Each processor owns a fixed-size ring of
+//      GENFILTER_TRACE_RECORDs.  Recording an event takes an uncontended
+//      interlocked increment, a timestamp, and a handful of stores -- no string
+//      formatting and no locks.  The rings are drained to user mode with
+//      IOCTL_GENFILTER_DRAIN_TRACE and decoded offline.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+#include "GenFilterIoctl.h"
+
+//
+// Records in each processor's ring.  MUST be a power of two.
+//
+constexpr ULONG GENFILTER_TRACE_RECORDS_PER_RING = 1024;
+
+static_assert((GENFILTER_TRACE_RECORDS_PER_RING &
+               (GENFILTER_TRACE_RECORDS_PER_RING - 1)) == 0,
+              "GENFILTER_TRACE_RECORDS_PER_RING must be a power of two");
+
+//
+// The state of one processor's ring.  Head is only ever incremented by the
+// processor that owns the ring, so it stays in that processor's cache.
+// Tail is only touched while draining, under the DrainLock.
+//
+typedef struct DECLSPEC_CACHEALIGN _GENFILTER_TRACE_RING {
+    volatile LONG           Head;       // Records ever claimed
+    ULONG                   Tail;       // Next record to drain
+    PGENFILTER_TRACE_RECORD Records;
+} GENFILTER_TRACE_RING, *PGENFILTER_TRACE_RING;
+
+//
+// The per-device trace log that lives in our device context
+//
+typedef struct _GENFILTER_TRACE {
+    ULONG                 RingCount;
+    PGENFILTER_TRACE_RING Rings;
+    WDFSPINLOCK           DrainLock;
+    ULONGLONG             Frequency;
+} GENFILTER_TRACE, *PGENFILTER_TRACE;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterTraceInitialize(_In_ WDFDEVICE Device, _Out_ PGENFILTER_TRACE Trace);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+GenFilterTraceDrain(_In_ PGENFILTER_TRACE Trace,
+                    _Out_writes_bytes_(BufferLength) PGENFILTER_TRACE_HEADER Buffer,
+                    _In_ size_t BufferLength);
+
+//
+// GenFilterTrace
+//
+// Records one event in the calling processor's ring.
+//
+// We claim a slot with an interlocked increment of our own ring's Head (a
+// thread running at PASSIVE_LEVEL can migrate between processors, so two
+// processors *can* occasionally share a ring), fill the record in, and
+// then publish it by storing its sequence number with release semantics.
+// The drain side never returns a record whose sequence number doesn't
+// match its slot, so it never sees a half-written record.
+//
+// Without the logging policy there are no rings, and the event is dropped.
+//
+FORCEINLINE
+VOID
+GenFilterTrace(_In_ PGENFILTER_TRACE      Trace,
+               _In_ GENFILTER_TRACE_EVENT Event,
+               _In_opt_ WDFREQUEST        Request,
+               _In_ NTSTATUS              Status,
+               _In_ ULONGLONG             Argument)
+{
+    ULONG                   cpu;
+    ULONG                   index;
+    PGENFILTER_TRACE_RING   ring;
+    PGENFILTER_TRACE_RECORD record;
+
+    if (Trace->RingCount == 0) {
+        return;
+    }
+
+    cpu = KeGetCurrentProcessorNumberEx(nullptr);
+
+    if (cpu >= Trace->RingCount) {
+        cpu %= Trace->RingCount;
+    }
+
+    ring   = &Trace->Rings[cpu];
+    index  = (ULONG)InterlockedIncrementNoFence(&ring->Head) - 1;
+    record = &ring->Records[index & (GENFILTER_TRACE_RECORDS_PER_RING - 1)];
+
+    record->EventId   = (USHORT)Event;
+    record->Processor = (USHORT)cpu;
+    record->Status    = Status;
+    record->Timestamp = (ULONGLONG)KeQueryPerformanceCounter(nullptr).QuadPart;
+    record->Request   = (ULONGLONG)(ULONG_PTR)Request;
+    record->Argument  = Argument;
+
+    WriteRelease((volatile LONG*)&record->Sequence,
+                 (LONG)(index + 1));
+}
@@ -0,0 +1,674 @@
+///
+/// @file GenFilterWriteGather.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+#include "GenFilter.h"
+
+//
+// A write we gather, if we've inspected it, is all in our copy
+//
+static_assert(GENFILTER_WRITE_GATHER_MAX_WRITE <= GENFILTER_INSPECT_COPY_LENGTH,
+              "A gathered write must fit in an inspection copy");
+
+static
+VOID
+GenFilterWriteGatherSend(_In_ PGENFILTER_WRITE_GATHER_SLOT Slot);
+
+static
+VOID
+GenFilterWriteGatherComplete(_In_ PGENFILTER_WRITE_GATHER_SLOT Slot,
+                             _In_ NTSTATUS                     Status,
+                             _In_ ULONG_PTR                    Information);
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE GenFilterWriteGatherCompletion;
+EVT_WDF_TIMER                      GenFilterWriteGatherEvtTimer;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterWriteGatherInitialize
+//
+//    Reads the gathering window from the device's hardware key and, if
+//    gathering is on, creates the lock, the flush timer, and the pool of
+//    Requests and buffers we send gathered writes with.
+//
+//  INPUTS:
+//
+//      Device      - Our WDFDEVICE.  Everything we create is parented to it.
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      STATUS_SUCCESS, otherwise an error indicating why write gathering
+//                      could not be set up.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL == PASSIVE_LEVEL.
+//
+//  NOTES:
+//
+//      A missing (or unreadable) registry value means gathering is off, in
+//      which case nothing is allocated.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+NTSTATUS
+GenFilterWriteGatherInitialize(WDFDEVICE                 Device,
+                               PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   objectAttr;
+    WDF_TIMER_CONFIG        timerConfig;
+    PGENFILTER_WRITE_GATHER gather;
+    WDFKEY                  key;
+    PVOID                   buffer;
+    ULONG                   windowMs = GENFILTER_WRITE_GATHER_DEFAULT_WINDOW_MS;
+
+    DECLARE_CONST_UNICODE_STRING(windowValueName, L"WriteGatherMs");
+
+    gather = &DevContext->WriteGather;
+
+    RtlZeroMemory(gather,
+                  sizeof(GENFILTER_WRITE_GATHER));
+
+    status = WdfDeviceOpenRegistryKey(Device,
+                                      PLUGPLAY_REGKEY_DEVICE,
+                                      KEY_READ,
+                                      WDF_NO_OBJECT_ATTRIBUTES,
+                                      &key);
+
+    if (NT_SUCCESS(status)) {
+
+        if (!NT_SUCCESS(WdfRegistryQueryULong(key,
+                                              &windowValueName,
+                                              &windowMs))) {
+            windowMs = GENFILTER_WRITE_GATHER_DEFAULT_WINDOW_MS;
+        }
+
+        WdfRegistryClose(key);
+    }
+
+    if (windowMs == 0) {
+        status = STATUS_SUCCESS;
+        goto done;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&objectAttr);
+    objectAttr.ParentObject = Device;
+
+    status = WdfSpinLockCreate(&objectAttr,
+                               &gather->Lock);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfSpinLockCreate for write gathering failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    //
+    // We do our own locking, so the timer doesn't need the Framework's
+    //
+    WDF_TIMER_CONFIG_INIT(&timerConfig,
+                          GenFilterWriteGatherEvtTimer);
+
+    timerConfig.AutomaticSerialization = FALSE;
+
+    status = WdfTimerCreate(&timerConfig,
+                            &objectAttr,
+                            &gather->Timer);
+
+    if (!NT_SUCCESS(status)) {
+#if DBG
+        DbgPrint("WdfTimerCreate for write gathering failed - 0x%x\n",
+                 status);
+#endif
+        goto done;
+    }
+
+    for (ULONG index = 0; index < GENFILTER_WRITE_GATHER_SLOTS; index++) {
+
+        PGENFILTER_WRITE_GATHER_SLOT slot = &gather->Slots[index];
+
+        status = WdfRequestCreate(&objectAttr,
+                                  WdfDeviceGetIoTarget(Device),
+                                  &slot->Request);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfRequestCreate for write gathering failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        status = WdfMemoryCreate(&objectAttr,
+                                 NonPagedPoolNx,
+                                 'wFnG',
+                                 GENFILTER_WRITE_GATHER_MAX_LENGTH,
+                                 &slot->Memory,
+                                 &buffer);
+
+        if (!NT_SUCCESS(status)) {
+#if DBG
+            DbgPrint("WdfMemoryCreate for write gathering failed - 0x%x\n",
+                     status);
+#endif
+            goto done;
+        }
+
+        slot->Buffer     = (PUCHAR)buffer;
+        slot->DevContext = DevContext;
+    }
+
+    status = GenFilterPoolCreate(Device,
+                                 &DevContext->Pools[GenFilterPoolWriteGather],
+                                 gather->Slots,
+                                 sizeof(GENFILTER_WRITE_GATHER_SLOT),
+                                 GENFILTER_WRITE_GATHER_SLOTS);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    //
+    // Only now that everything exists do we turn gathering on
+    //
+    gather->WindowMs = windowMs;
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterWriteGatherRequest
+//
+//    Called for every write we see.  If the write continues the open batch
+//    it's added to it; if it could start a batch of its own, it does.
+//    Either way, a batch that the write doesn't continue is sent first.
+//
+//  INPUTS:
+//
+//      Request     - The write Request
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//      Offset      - The device offset of the write
+//
+//      Length      - The length of the write
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      TRUE if the write is now part of a batch.  It will be completed when
+//      the gathered write is, and the caller must not touch it again.
+//
+//      FALSE if the caller should send the write on as usual.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      Sending the open batch before anything it doesn't continue keeps
+//      writes reaching the device in the order we were given them.  A
+//      write that can't be gathered (too big, not whole sectors, or every
+//      pool slot busy) therefore costs at most an early flush.
+//
+//      The write's data is copied while we hold the lock, so that a batch
+//      is never sent with a hole in it.  Writes are at most
+//      GENFILTER_WRITE_GATHER_MAX_WRITE bytes, which bounds the hold time.
+//
+//      Gathered writes are not cancelable.  They're held for at most one
+//      window, plus however long the device takes with the gathered write.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+BOOLEAN
+GenFilterWriteGatherRequest(WDFREQUEST                Request,
+                            PGENFILTER_DEVICE_CONTEXT DevContext,
+                            LONGLONG                  Offset,
+                            size_t                    Length)
+{
+    PGENFILTER_WRITE_GATHER      gather;
+    PGENFILTER_WRITE_GATHER_SLOT open;
+    PGENFILTER_WRITE_GATHER_SLOT send       = nullptr;
+    BOOLEAN                      gatherable = FALSE;
+    BOOLEAN                      taken      = FALSE;
+    BOOLEAN                      startTimer = FALSE;
+    PVOID                        data       = nullptr;
+    PGENFILTER_INSPECT_COPY      copy;
+
+    gather = &DevContext->WriteGather;
+
+    if (gather->WindowMs == 0) {
+        return FALSE;
+    }
+
+    if (Length != 0 &&
+        Length <= GENFILTER_WRITE_GATHER_MAX_WRITE &&
+        (Offset % GENFILTER_WRITE_GATHER_SECTOR) == 0 &&
+        (Length % GENFILTER_WRITE_GATHER_SECTOR) == 0) {
+
+        //
+        // A write we've inspected is gathered from our copy of its data
+        //
+        copy = GenFilterGetRequestContext(Request)->InspectCopy;
+
+        if (copy != nullptr) {
+
+            data       = copy->Buffer;
+            gatherable = TRUE;
+
+        } else {
+
+            gatherable = NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request,
+                                                                  Length,
+                                                                  &data,
+                                                                  nullptr));
+        }
+    }
+
+    WdfSpinLockAcquire(gather->Lock);
+
+    open = gather->Open;
+
+    if (gatherable &&
+        open != nullptr &&
+        Offset == open->Offset + open->Length &&
+        open->Length + Length <= GENFILTER_WRITE_GATHER_MAX_LENGTH &&
+        open->Count < GENFILTER_WRITE_GATHER_MAX_REQUESTS) {
+
+        //
+        // It continues the open batch
+        //
+        taken = TRUE;
+
+        //
+        // If the batch is now as big as it can get, don't wait for the
+        // timer to send it
+        //
+        if (open->Length + Length == GENFILTER_WRITE_GATHER_MAX_LENGTH ||
+            open->Count + 1 == GENFILTER_WRITE_GATHER_MAX_REQUESTS) {
+
+            send         = open;
+            gather->Open = nullptr;
+        }
+
+    } else {
+
+        //
+        // It doesn't, so whatever is open goes first
+        //
+        send         = open;
+        gather->Open = nullptr;
+
+        if (gatherable) {
+
+            open = (PGENFILTER_WRITE_GATHER_SLOT)GenFilterPoolAllocate(&DevContext->Pools[GenFilterPoolWriteGather]);
+
+            if (open != nullptr) {
+
+                open->Offset = Offset;
+                open->Length = 0;
+                open->Count  = 0;
+
+                gather->Open = open;
+                taken        = TRUE;
+                startTimer   = TRUE;
+            }
+        }
+    }
+
+    if (taken) {
+
+        RtlCopyMemory(open->Buffer + open->Length,
+                      data,
+                      Length);
+
+        open->Originals[open->Count]       = Request;
+        open->OriginalLengths[open->Count] = (ULONG)Length;
+        open->Length                      += (ULONG)Length;
+        open->Count++;
+    }
+
+    WdfSpinLockRelease(gather->Lock);
+
+    if (send != nullptr) {
+        GenFilterWriteGatherSend(send);
+    }
+
+    //
+    // If the batch we started here has already been sent by the time the
+    // timer fires, the timer just sends whatever is open then, a little
+    // early
+    //
+    if (startTimer) {
+        WdfTimerStart(gather->Timer,
+                      WDF_REL_TIMEOUT_IN_MS(gather->WindowMs));
+    }
+
+    return taken;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterWriteGatherFlush
+//
+//    Sends the open batch, if there is one.  Called when the window
+//    expires, and before any device control Request that must not overtake
+//    the writes we're holding.
+//
+//  INPUTS:
+//
+//      DevContext  - Pointer to our WDFDEVICE context
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The gathered write is sent before we return, so anything the caller
+//      sends afterwards reaches the device after it.
+//
+//      We don't need to see flush (IRP_MJ_FLUSH_BUFFERS) Requests.  A flush
+//      only covers writes that have completed, and ours don't complete
+//      until the gathered write has.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterWriteGatherFlush(PGENFILTER_DEVICE_CONTEXT DevContext)
+{
+    PGENFILTER_WRITE_GATHER      gather;
+    PGENFILTER_WRITE_GATHER_SLOT send;
+
+    gather = &DevContext->WriteGather;
+
+    if (gather->WindowMs == 0) {
+        return;
+    }
+
+    WdfSpinLockAcquire(gather->Lock);
+
+    send         = gather->Open;
+    gather->Open = nullptr;
+
+    WdfSpinLockRelease(gather->Lock);
+
+    if (send != nullptr) {
+        GenFilterWriteGatherSend(send);
+    }
+}
+
+//
+// GenFilterWriteGatherEvtTimer
+//
+// The window for the open batch has expired
+//
+_Use_decl_annotations_
+VOID
+GenFilterWriteGatherEvtTimer(WDFTIMER Timer)
+{
+    GenFilterWriteGatherFlush(GenFilterGetDeviceContext(WdfTimerGetParentObject(Timer)));
+}
+
+//
+// GenFilterWriteGatherSend
+//
+// Sends the gathered write for a batch that's been closed.  If it can't be
+// sent, the original writes are completed with the reason why.
+//
+static
+VOID
+GenFilterWriteGatherSend(PGENFILTER_WRITE_GATHER_SLOT Slot)
+{
+    NTSTATUS                  status;
+    WDF_REQUEST_REUSE_PARAMS  reuseParams;
+    WDFMEMORY_OFFSET          memoryOffset;
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    WDFIOTARGET               ioTarget;
+
+    devContext = Slot->DevContext;
+    ioTarget   = WdfDeviceGetIoTarget(devContext->WdfDevice);
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams,
+                                  WDF_REQUEST_REUSE_NO_FLAGS,
+                                  STATUS_SUCCESS);
+
+    status = WdfRequestReuse(Slot->Request,
+                             &reuseParams);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    memoryOffset.BufferOffset = 0;
+    memoryOffset.BufferLength = Slot->Length;
+
+    status = WdfIoTargetFormatRequestForWrite(ioTarget,
+                                              Slot->Request,
+                                              Slot->Memory,
+                                              &memoryOffset,
+                                              &Slot->Offset);
+
+    if (!NT_SUCCESS(status)) {
+        goto done;
+    }
+
+    WdfRequestSetCompletionRoutine(Slot->Request,
+                                   GenFilterWriteGatherCompletion,
+                                   Slot);
+
+    GenFilterTrace(&devContext->Trace,
+                   GenFilterTraceWriteGather,
+                   Slot->Request,
+                   STATUS_SUCCESS,
+                   (ULONGLONG)Slot->Offset);
+
+    GenFilterStatsIncrement(&devContext->Stats,
+                            GenFilterStatGatheredWrites);
+    GenFilterStatsAdd(&devContext->Stats,
+                      GenFilterStatGatheredRequests,
+                      (LONG64)Slot->Count);
+
+    if (!WdfRequestSend(Slot->Request,
+                        ioTarget,
+                        WDF_NO_SEND_OPTIONS)) {
+
+        status = WdfRequestGetStatus(Slot->Request);
+
+        GenFilterTrace(&devContext->Trace,
+                       GenFilterTraceSendFailed,
+                       Slot->Request,
+                       status,
+                       0);
+        goto done;
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+
+    if (!NT_SUCCESS(status)) {
+        GenFilterWriteGatherComplete(Slot,
+                                     status,
+                                     0);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GenFilterWriteGatherCompletion
+//
+//    This routine is called by the Framework when one of our gathered
+//    writes has been completed by the I/O Target.  We complete the
+//    original writes it carried and return the slot to the pool.
+//
+//  INPUTS:
+//
+//      Request  - The gathered write Request
+//
+//      Target   - The I/O target we sent it to
+//
+//      Params   - Parameter information from the completed
+//                 request
+//
+//      Context  - The pool slot the Request belongs to
+//
+//  OUTPUTS:
+//
+//      None.
+//
+//  RETURNS:
+//
+//      None.
+//
+//  IRQL:
+//
+//      This routine is called at IRQL <= DISPATCH_LEVEL.
+//
+//  NOTES:
+//
+//      The Request is ours (we created it), so it is not completed here.
+//
+///////////////////////////////////////////////////////////////////////////////
+_Use_decl_annotations_
+VOID
+GenFilterWriteGatherCompletion(WDFREQUEST                     Request,
+                               WDFIOTARGET                    Target,
+                               PWDF_REQUEST_COMPLETION_PARAMS Params,
+                               WDFCONTEXT                     Context)
+{
+    auto* slot = (PGENFILTER_WRITE_GATHER_SLOT)Context;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    GenFilterTrace(&slot->DevContext->Trace,
+                   GenFilterTraceCompletion,
+                   Request,
+                   Params->IoStatus.Status,
+                   Params->IoStatus.Information);
+
+    GenFilterWriteGatherComplete(slot,
+                                 Params->IoStatus.Status,
+                                 Params->IoStatus.Information);
+}
+
+//
+// GenFilterWriteGatherComplete
+//
+// Completes the original writes in a batch, given how the gathered write
+// went, and releases the slot.  Originals are completed in the order they
+// arrived.  Those wholly inside what the device says it wrote succeed; the
+// rest get the gathered write's error, or STATUS_IO_DEVICE_ERROR if the
+// device succeeded but wrote less than we asked it to.
+//
+static
+VOID
+GenFilterWriteGatherComplete(PGENFILTER_WRITE_GATHER_SLOT Slot,
+                             NTSTATUS                     Status,
+                             ULONG_PTR                    Information)
+{
+    PGENFILTER_DEVICE_CONTEXT devContext;
+    ULONG_PTR                 written = 0;
+
+    devContext = Slot->DevContext;
+
+    //
+    // A read that went down while these writes were held may have cached
+    // what was there before them
+    //
+    GenFilterCacheInvalidateRange(&devContext->Cache,
+                                  Slot->Offset,
+                                  Slot->Length);
+
+    for (ULONG index = 0; index < Slot->Count; index++) {
+
+        NTSTATUS  status = Status;
+        ULONG_PTR length = Slot->OriginalLengths[index];
+
+        written += length;
+
+        if (NT_SUCCESS(Status) && written > Information) {
+            status = STATUS_IO_DEVICE_ERROR;
+        }
+
+        if (!NT_SUCCESS(status)) {
+
+            length = 0;
+
+            GenFilterStatsIncrement(&devContext->Stats,
+                                    GenFilterStatFailures);
+        }
+
+        GenFilterCompleting(devContext,
+                            Slot->Originals[index],
+                            status);
+
+        WdfRequestCompleteWithInformation(Slot->Originals[index],
+                                          status,
+                                          length);
+    }
+
+    GenFilterPoolFree(&devContext->Pools[GenFilterPoolWriteGather],
+                      Slot);
+}
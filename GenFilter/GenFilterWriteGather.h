@@ -0,0 +1,135 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+//    (C) Copyright 1995 - 2020 OSR Open Systems Resources, Inc.
+//    All Rights Reserved
+//
+//    This sofware is supplied for instructional purposes only.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MECHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+//    OSR Open Systems Resources, Inc.
+//    105 Route 101A Suite 19
+//    Amherst, NH 03031  (603) 595-6500 FAX: (603) 595-6503
+//    email bugs to: bugs@osr.com
+//
+//
+//    MODULE:
+//
+//      GenFilterWriteGather.h
+//
+//    ABSTRACT:
+//
+//      Write gathering.  Small writes that continue exactly where the previous
+//      one ended, and that arrive within a short window of each other, are
+//      copied into one pooled buffer and sent down as a single larger write.
+//      Each original write is completed when the gathered write finishes.
+//
+//    AUTHOR(S):
+//
+//      OSR Open Systems Resources, Inc.
+//
+//    REVISION:
+//
+//
+///////////////////////////////////////////////////////////////////////////////
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+#include <wdf.h>
+
+typedef struct _GENFILTER_DEVICE_CONTEXT* PGENFILTER_DEVICE_CONTEXT;
+
+//
+// Gathered writes (and buffers) in the pool.  One batch is open at a time;
+// the others are batches that have been sent and are waiting to complete.
+//
+constexpr ULONG GENFILTER_WRITE_GATHER_SLOTS = 4;
+
+//
+// The largest write we gather, and the largest write we build.  Writes
+// must also be whole sectors at a sector aligned offset.
+//
+constexpr ULONG GENFILTER_WRITE_GATHER_MAX_WRITE  = 32 * 1024;
+constexpr ULONG GENFILTER_WRITE_GATHER_MAX_LENGTH = 128 * 1024;
+constexpr ULONG GENFILTER_WRITE_GATHER_SECTOR     = 2048;
+
+//
+// The most original writes one gathered write can carry
+//
+constexpr ULONG GENFILTER_WRITE_GATHER_MAX_REQUESTS = 32;
+
+//
+// How long an open batch waits for the write that continues it, unless the
+// "WriteGatherMs" value in the device's hardware key says otherwise.  Zero
+// (the default) disables gathering.
+//
+constexpr ULONG GENFILTER_WRITE_GATHER_DEFAULT_WINDOW_MS = 0;
+
+//
+// One preallocated gathered write, its buffer, and the original writes it
+// carries.  Offset, Length, and Count are protected by
+// GENFILTER_WRITE_GATHER.Lock while the slot is the open batch; after that
+// the slot belongs to the gathered write until it completes.  Free slots
+// are kept in DevContext->Pools[GenFilterPoolWriteGather].
+//
+typedef struct _GENFILTER_WRITE_GATHER_SLOT {
+    WDFREQUEST                Request;
+    WDFMEMORY                 Memory;
+    PUCHAR                    Buffer;
+    LONGLONG                  Offset;
+    ULONG                     Length;
+    ULONG                     Count;
+    WDFREQUEST                Originals[GENFILTER_WRITE_GATHER_MAX_REQUESTS];
+    ULONG                     OriginalLengths[GENFILTER_WRITE_GATHER_MAX_REQUESTS];
+    PGENFILTER_DEVICE_CONTEXT DevContext;
+} GENFILTER_WRITE_GATHER_SLOT, *PGENFILTER_WRITE_GATHER_SLOT;
+
+//
+// The per-device write gathering state that lives in our device context
+//
+typedef struct _GENFILTER_WRITE_GATHER {
+    ULONG                        WindowMs;      // 0: gathering is off
+    WDFSPINLOCK                  Lock;
+    WDFTIMER                     Timer;         // Flushes the open batch
+    PGENFILTER_WRITE_GATHER_SLOT Open;          // Batch being gathered, or nullptr
+    GENFILTER_WRITE_GATHER_SLOT  Slots[GENFILTER_WRITE_GATHER_SLOTS];
+} GENFILTER_WRITE_GATHER, *PGENFILTER_WRITE_GATHER;
+
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS
+GenFilterWriteGatherInitialize(_In_ WDFDEVICE Device,
+                               _In_ PGENFILTER_DEVICE_CONTEXT DevContext);
+
+//
+// Returns TRUE if the write was taken into a batch, in which case the
+// caller must not touch the Request again
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+GenFilterWriteGatherRequest(_In_ WDFREQUEST Request,
+                            _In_ PGENFILTER_DEVICE_CONTEXT DevContext,
+                            _In_ LONGLONG Offset,
+                            _In_ size_t Length);
+
+//
+// Sends the open batch, if there is one, now
+//
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+GenFilterWriteGatherFlush(_In_ PGENFILTER_DEVICE_CONTEXT DevContext);
@@ -0,0 +1,5612 @@
+///
+/// @file GenFilterCtl.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// User-mode companion to GenFilter.  Talks to the filter's private control
+// interface (see GenFilterIoctl.h) through the device it's filtering, and
+// decodes the binary data the filter hands back.
+//
+// Usage:
+//
+//      GenFilterCtl stats  \\.\CdRom0
+//      GenFilterCtl trace  \\.\CdRom0 trace.bin
+//      GenFilterCtl latency \\.\CdRom0
+//      GenFilterCtl passthrough \\.\CdRom0 on
+//      GenFilterCtl compare \\.\CdRom0 64
+//      GenFilterCtl forward \\.\CdRom0 100000
+//      GenFilterCtl sched
+//      GenFilterCtl pools \\.\CdRom0
+//      GenFilterCtl slab
+//      GenFilterCtl defer \\.\CdRom0
+//      GenFilterCtl ring
+//      GenFilterCtl match
+//      GenFilterCtl crc
+//      GenFilterCtl decode trace.bin
+//      GenFilterCtl capture \\.\CdRom0 capture.bin
+//      GenFilterCtl replay capture.bin 10
+//      GenFilterCtl inspect \\.\CdRom0 block 4D5A9000,7F454C46
+//      GenFilterCtl rcu
+//      GenFilterCtl top \\.\CdRom0 10
+//      GenFilterCtl sketch
+//      GenFilterCtl limit \\.\CdRom0 500,8000000 100,2000000 100 2000
+//      GenFilterCtl bucket
+//      GenFilterCtl split \\.\CdRom0 128 2
+//
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "GenFilterIoctl.h"
+#include "GenFilterBucket.h"
+#include "GenFilterCrc.h"
+#include "GenFilterMatch.h"
+#include "GenFilterRcu.h"
+#include "GenFilterRing.h"
+#include "GenFilterRouteTable.h"
+#include "GenFilterSched.h"
+#include "GenFilterSketch.h"
+#include "GenFilterSlab.h"
+
+//
+// Printable names for the statistics counters and trace events.  These
+// MUST be kept in the same order as the enums in GenFilterIoctl.h.
+//
+static const char* StatCounterNames[] = {
+    "ReadRequests",
+    "WriteRequests",
+    "DeviceControlRequests",
+    "BytesRead",
+    "BytesWritten",
+    "Failures",
+    "CacheHits",
+    "CacheMisses",
+    "CacheInvalidations",
+    "ReadAheads",
+    "ReadAheadBytes",
+    "Coalesced",
+    "QueryCacheHits",
+    "QueryCacheMisses",
+    "SampledCompletions",
+    "SampledFailures",
+    "Scheduled",
+    "GatheredWrites",
+    "GatheredRequests",
+    "InspectedBytes",
+    "SignatureMatches",
+    "SignatureBlocks",
+    "IntegritySectors",
+    "IntegrityMismatches",
+    "IntegrityEvictions",
+    "ConfigPublished",
+    "ConfigReclaimed",
+    "LimitDelayed",
+    "LimitFailed",
+    "RetryAttempts",
+    "RetrySucceeded",
+    "RetryExhausted",
+    "SplitRequests",
+    "SplitChunks",
+    "InspectWaits",
+    "IntegritySkips",
+};
+
+static_assert(ARRAYSIZE(StatCounterNames) == GenFilterStatCounterCount,
+              "StatCounterNames is out of date");
+
+static const char* TraceEventNames[] = {
+    "?",
+    "Read",
+    "Write",
+    "DeviceControl",
+    "IoctlOfInterest",
+    "SendWithCallback",
+    "SendFailed",
+    "Completion",
+    "CacheHit",
+    "ReadAhead",
+    "Coalesced",
+    "QueryCacheHit",
+    "WriteGather",
+    "SignatureMatch",
+    "IntegrityMismatch",
+};
+
+static_assert(ARRAYSIZE(TraceEventNames) == GenFilterTraceEventCount,
+              "TraceEventNames is out of date");
+
+static const char* PoolNames[] = {
+    "ReadAhead",
+    "WriteGather",
+    "Defer",
+    "Split",
+    "Inspect",
+};
+
+static_assert(ARRAYSIZE(PoolNames) == GenFilterPoolCount,
+              "PoolNames is out of date");
+
+static const char* LatencyClassNames[] = {
+    "Read",
+    "Write",
+    "DeviceControl (other)",
+};
+
+static_assert(ARRAYSIZE(LatencyClassNames) == GenFilterLatencyFixedClassCount,
+              "LatencyClassNames is out of date");
+
+//
+// Percentiles reported by DoLatency
+//
+static const double LatencyPercentiles[] = {
+    50.0,
+    90.0,
+    99.0,
+    99.9,
+};
+
+//
+// Big enough for several thousand trace records per IOCTL
+//
+constexpr DWORD DRAIN_BUFFER_SIZE = 1024 * 1024;
+
+//
+// Size of each read DoCompare issues
+//
+constexpr DWORD COMPARE_READ_SIZE = 64 * 1024;
+
+//
+// How many times DoForward times each mode.  The modes take turns, and the
+// fastest run of each is reported, so that a burst of other activity on
+// the machine doesn't land on just one of them.
+//
+constexpr ULONG FORWARD_ROUNDS = 5;
+
+//
+// The latency sampling intervals DoSample times Requests at, from timing
+// none of them to timing every one.  Like DoForward's modes, they take
+// turns for FORWARD_ROUNDS rounds and the fastest run of each is reported.
+//
+static const ULONG SampleIntervals[] = { 0, 256, 64, 16, 4, 1 };
+
+//
+// The simulated drive and workloads DoSched replays.  Each client keeps one
+// 64KB Request outstanding, issuing its next as soon as the last completes.
+// The drive does one Request at a time, so all the others are held by the
+// scheduler (as they would be with "MaxInFlightRead" set to 1).
+//
+constexpr ULONG     SCHED_CLIENTS       = 32;
+constexpr ULONG     SCHED_STREAMS       = 4;        // Sequential workload
+constexpr ULONG     SCHED_REQUESTS      = 20000;
+constexpr ULONG     SCHED_REQUEST_SIZE  = 64 * 1024;
+constexpr ULONGLONG SCHED_SPAN          = 700ULL * 1024 * 1024;
+constexpr double    SCHED_SETTLE_US     = 1000.0;   // Any seek at all
+constexpr double    SCHED_FULL_SEEK_US  = 100000.0; // End to end
+constexpr double    SCHED_BYTES_PER_US  = 7.2;      // About 48x
+constexpr ULONGLONG SCHED_DEADLINE_US   = 500000;
+
+//
+// The filter and drive DoReplay simulates.  Like the driver's, the read
+// cache holds REPLAY_CACHE_SECTORS sectors and only takes whole, aligned,
+// reads of up to REPLAY_CACHE_MAX_READ, and query results are kept for the
+// driver's default TTL.  The drive is DoSched's, doing one Request at a
+// time; device controls take REPLAY_IOCTL_US and go ahead of held reads
+// and writes.
+//
+constexpr ULONG  REPLAY_SECTOR_SIZE    = 2048;
+constexpr ULONG  REPLAY_CACHE_SECTORS  = 2048;
+constexpr ULONG  REPLAY_CACHE_MAX_READ = 64 * 1024;
+constexpr double REPLAY_QUERY_TTL_US   = 5000000.0;
+constexpr double REPLAY_IOCTL_US       = 500.0;
+
+static const char* SchedPolicyNames[] = {
+    "FIFO",
+    "Elevator",
+    "Deadline",
+};
+
+static_assert(ARRAYSIZE(SchedPolicyNames) == GenFilterSchedPolicyCount,
+              "SchedPolicyNames is out of date");
+
+//
+// The churn DoSlab runs.  Each thread keeps up to SLAB_HELD sector sized
+// elements, and on each operation randomly allocates another or frees one
+// of those it holds, as a filter does with per-Request buffers.
+//
+constexpr ULONG SLAB_ELEMENT_SIZE = 2048;
+constexpr ULONG SLAB_HELD         = 64;
+constexpr ULONG SLAB_OPERATIONS   = 4000000;    // Per thread
+
+//
+// One DoSlab thread.  Slab is nullptr to use the process heap instead.
+//
+typedef struct _SLAB_CHURN {
+    PGENFILTER_SLAB Slab;
+    ULONG           Cpu;
+    HANDLE          Start;
+    ULONGLONG       Failed;
+} SLAB_CHURN, *PSLAB_CHURN;
+
+static const char* DeferPolicyNames[] = {
+    "Off",
+    "CompleteAfter",
+    "CompleteBefore",
+};
+
+static_assert(ARRAYSIZE(DeferPolicyNames) == GenFilterDeferPolicyCount,
+              "DeferPolicyNames is out of date");
+
+//
+// The stress test DoRing runs: RING_CONSUMERS threads (the driver's default
+// worker count) popping from a ring the size of the driver's, while more and
+// more producer threads push to it as fast as they can for RING_SECONDS.
+// A producer that finds the ring full gives up its processor, where the
+// driver's completion callback would do the work itself, and moves on.
+//
+constexpr ULONG RING_CAPACITY      = 16;
+constexpr ULONG RING_CONSUMERS     = 2;
+constexpr ULONG RING_SECONDS       = 2;
+constexpr ULONG RING_MAX_PRODUCERS = 32;
+
+static const ULONG RingProducerCounts[] = { 1, 4, 16, RING_MAX_PRODUCERS };
+
+//
+// Items are the producer's number + 1 in the top byte, and the low 24 bits
+// of its count of items pushed so far below that, so they're never nullptr
+// and fit in a pointer on either platform
+//
+constexpr ULONG RING_SEQUENCE_BITS = 24;
+constexpr ULONG RING_SEQUENCE_MASK = (1UL << RING_SEQUENCE_BITS) - 1;
+
+typedef struct _RING_STRESS {
+    GENFILTER_RING      Ring;
+    GENFILTER_RING_CELL Cells[RING_CAPACITY];
+    HANDLE              Start;
+    volatile LONG       Stop;           // Producers stop pushing
+    volatile LONG       Drain;          // Consumers stop once it's empty
+} RING_STRESS, *PRING_STRESS;
+
+typedef struct _RING_PRODUCER {
+    PRING_STRESS Stress;
+    ULONG        Id;
+    ULONGLONG    Pushed;
+    ULONGLONG    Dropped;
+} RING_PRODUCER, *PRING_PRODUCER;
+
+typedef struct _RING_CONSUMER {
+    PRING_STRESS Stress;
+    ULONGLONG    Popped;
+    ULONGLONG    OutOfOrder;            // Items seen before an earlier one
+    bool         Seen[RING_MAX_PRODUCERS];
+    ULONG        Last[RING_MAX_PRODUCERS];
+} RING_CONSUMER, *PRING_CONSUMER;
+
+static const char* MatchKernelNames[] = {
+    "Scalar",
+    "SSE2",
+    "AVX2",
+};
+
+static_assert(ARRAYSIZE(MatchKernelNames) == GenFilterMatchKernelCount,
+              "MatchKernelNames is out of date");
+
+//
+// What DoMatch measures: each kernel the processor has, scanning random
+// data (in which the signatures don't occur) of each buffer size for each
+// number of signatures, until it's scanned MATCH_BYTES
+//
+static const ULONG MatchBufferSizes[]   = { 2048, 64 * 1024, 1024 * 1024 };
+static const ULONG MatchPatternCounts[] = { 1, 4, GENFILTER_MATCH_MAX_PATTERNS };
+
+constexpr ULONG     MATCH_PATTERN_LENGTH = 8;
+constexpr ULONGLONG MATCH_BYTES          = 64ULL * 1024 * 1024;
+
+//
+// Before it measures anything, DoMatch checks that every kernel finds the
+// same thing as the scalar one in MATCH_CHECKS small buffers drawn from a
+// four letter alphabet, so that there's plenty to find
+//
+constexpr ULONG MATCH_CHECKS     = 20000;
+constexpr ULONG MATCH_CHECK_SIZE = 200;
+
+static const char* CrcKernelNames[] = {
+    "Table",
+    "SSE4.2",
+};
+
+static_assert(ARRAYSIZE(CrcKernelNames) == GenFilterCrcKernelCount,
+              "CrcKernelNames is out of date");
+
+//
+// What DoCrc measures: each kernel the processor has, checksumming one
+// sector (what the driver does), a typical read, and a large one, until
+// it's done CRC_BYTES
+//
+constexpr ULONG CRC_SECTOR_SIZE = 2048;
+
+static const ULONG CrcBufferSizes[] = { CRC_SECTOR_SIZE, 64 * 1024, 1024 * 1024 };
+
+constexpr ULONGLONG CRC_BYTES = 256ULL * 1024 * 1024;
+
+//
+// ...and what one sector's checksum costs when reading at full speed from
+// these drives
+//
+typedef struct _CRC_DRIVE_SPEED {
+    const char* Name;
+    double      BytesPerSecond;
+} CRC_DRIVE_SPEED;
+
+static const CRC_DRIVE_SPEED CrcDriveSpeeds[] = {
+    { "52x CD",      52 * 153600.0 },
+    { "16x DVD",     16 * 1385000.0 },
+    { "12x Blu-ray", 12 * 4495000.0 },
+};
+
+//
+// Before it measures anything, DoCrc checks every kernel against the
+// standard check value, and against the table kernel for CRC_CHECKS random
+// buffers of up to CRC_CHECK_SIZE bytes at random alignments
+//
+constexpr ULONG CRC_CHECKS      = 20000;
+constexpr ULONG CRC_CHECK_SIZE  = 300;
+constexpr ULONG CRC_CHECK_VALUE = 0xE3069283;   // CRC32C of "123456789"
+
+static const char* InspectActionNames[] = {
+    "off",
+    "flag",
+    "block",
+};
+
+static_assert(ARRAYSIZE(InspectActionNames) == GenFilterInspectActionCount,
+              "InspectActionNames is out of date");
+
+//
+// The stress test DoRcu runs: a reader thread per processor, less one for
+// the writer, each looking up the current snapshot and reading all of it,
+// for RCU_SECONDS with nobody writing, and then for RCU_SECONDS with a
+// writer publishing new snapshots as fast as it can.  The writer reuses
+// RCU_SNAPSHOTS snapshots and poisons each one as soon as it's reclaimed,
+// so a reader that had one reclaimed from under it sees the poison.
+//
+constexpr ULONG RCU_SECONDS   = 2;
+constexpr ULONG RCU_SNAPSHOTS = 4;
+constexpr ULONG RCU_WORDS     = 30;         // About a cache line's worth
+
+typedef struct _RCU_SNAPSHOT {
+    ULONG Generation;
+    ULONG Words[RCU_WORDS];                 // Generation + the word's index
+    ULONG Check;                            // ~Generation
+} RCU_SNAPSHOT, *PRCU_SNAPSHOT;
+
+typedef struct _RCU_STRESS {
+    GENFILTER_RCU Rcu;
+    RCU_SNAPSHOT  Snapshots[RCU_SNAPSHOTS];
+    HANDLE        Start;
+    volatile LONG Stop;
+} RCU_STRESS, *PRCU_STRESS;
+
+typedef struct _RCU_READER {
+    PRCU_STRESS Stress;
+    ULONG       Cpu;
+    ULONGLONG   Reads;
+    ULONGLONG   Errors;                     // Snapshots that weren't whole
+} RCU_READER, *PRCU_READER;
+
+typedef struct _RCU_WRITER {
+    PRCU_STRESS Stress;
+    ULONGLONG   Updates;
+} RCU_WRITER, *PRCU_WRITER;
+
+static const char* AttributionModeNames[] = {
+    "Off",
+    "Process",
+    "FileObject",
+};
+
+static_assert(ARRAYSIZE(AttributionModeNames) == GenFilterAttributionModeCount,
+              "AttributionModeNames is out of date");
+
+//
+// The workload DoSketch runs: SKETCH_REQUESTS Requests from
+// SKETCH_REQUESTERS requesters, a few of them heavy and most of them
+// light (Zipf distributed, with exponent SKETCH_ZIPF), each of 1 to
+// SKETCH_MAX_SECTORS sectors.  Requesters are numbered like process IDs.
+//
+constexpr ULONG  SKETCH_REQUESTERS  = 100000;
+constexpr ULONG  SKETCH_REQUESTS    = 4000000;
+constexpr double SKETCH_ZIPF        = 1.1;
+constexpr ULONG  SKETCH_MAX_SECTORS = 32;
+
+typedef struct _SKETCH_REQUEST {
+    ULONGLONG Requester;
+    ULONG     Bytes;
+} SKETCH_REQUEST, *PSKETCH_REQUEST;
+
+//
+// One DoSketch thread, adding Requests[First] up to Requests[Last] as
+// processor Cpu
+//
+typedef struct _SKETCH_WORKER {
+    PGENFILTER_SKETCH     Sketch;
+    const SKETCH_REQUEST* Requests;
+    ULONG                 First;
+    ULONG                 Last;
+    ULONG                 Cpu;
+    HANDLE                Start;
+} SKETCH_WORKER, *PSKETCH_WORKER;
+
+static const char* LimitActionNames[] = {
+    "delay",
+    "fail",
+};
+
+static_assert(ARRAYSIZE(LimitActionNames) == GenFilterLimitActionCount,
+              "LimitActionNames is out of date");
+
+//
+// The runs DoBucket makes: every thread takes from the buckets as fast as
+// it can for BUCKET_SECONDS, failing whatever's over the limits, so that
+// the buckets are as contended as they can be.  Each run limits one thing:
+// the device's Requests, the device's bytes (with Requests of 1 to
+// BUCKET_MAX_SECTORS sectors), or each of BUCKET_REQUESTERS requesters'
+// Requests.
+//
+constexpr ULONG BUCKET_SECONDS        = 2;
+constexpr ULONG BUCKET_BURST_MS       = 100;
+constexpr ULONG BUCKET_REQUESTS       = 100000;     // Per second
+constexpr ULONG BUCKET_BYTES          = 64 * 1024 * 1024;
+constexpr ULONG BUCKET_REQUESTERS     = 64;
+constexpr ULONG BUCKET_EACH_REQUESTER = 2000;       // Requests per second
+constexpr ULONG BUCKET_MAX_SECTORS    = 32;
+
+typedef enum _BUCKET_RUN {
+    BucketRunDevice = 0,
+    BucketRunBytes,
+    BucketRunRequester,
+
+    BucketRunCount                          // Must be last
+} BUCKET_RUN;
+
+static const char* BucketRunNames[] = {
+    "device",
+    "bytes",
+    "requester",
+};
+
+static_assert(ARRAYSIZE(BucketRunNames) == BucketRunCount,
+              "BucketRunNames is out of date");
+
+typedef struct _BUCKET_TEST {
+    BUCKET_RUN              Run;
+    GENFILTER_BUCKET_LIMITS Limits;
+    PGENFILTER_BUCKET       Device;
+    PGENFILTER_BUCKET       Requesters;     // GENFILTER_BUCKET_REQUESTERS
+    ULONGLONG               RequesterIds[BUCKET_REQUESTERS];
+    HANDLE                  Start;
+    volatile LONG           Stop;
+} BUCKET_TEST, *PBUCKET_TEST;
+
+//
+// One DoBucket thread.  Admitted counts what each requester was let
+// through.
+//
+typedef struct _BUCKET_WORKER {
+    PBUCKET_TEST Test;
+    ULONGLONG    Random;
+    ULONGLONG    Attempts;
+    ULONGLONG    Bytes;                     // Admitted
+    ULONGLONG    Admitted[BUCKET_REQUESTERS];
+} BUCKET_WORKER, *PBUCKET_WORKER;
+
+//
+// The runs DoSplit makes, SPLIT_SECONDS each: a thread making small reads
+// alone, then with SPLIT_LARGE_THREADS threads making large ones, first
+// with splitting off and then with the settings asked for.  All the reads
+// are at random (sector aligned) offsets, so that the drive's own cache
+// doesn't flatter any of them.
+//
+constexpr ULONG SPLIT_SECONDS       = 10;
+constexpr ULONG SPLIT_SMALL_SIZE    = 2048;
+constexpr ULONG SPLIT_LARGE_SIZE    = 1024 * 1024;
+constexpr ULONG SPLIT_LARGE_THREADS = 2;
+constexpr ULONG SPLIT_SECTOR_SIZE   = 2048;
+
+typedef enum _SPLIT_RUN {
+    SplitRunSmall = 0,
+    SplitRunMixed,
+    SplitRunMixedSplit,
+
+    SplitRunCount                           // Must be last
+} SPLIT_RUN;
+
+static const char* SplitRunNames[] = {
+    "small alone",
+    "mixed",
+    "mixed, split",
+};
+
+static_assert(ARRAYSIZE(SplitRunNames) == SplitRunCount,
+              "SplitRunNames is out of date");
+
+typedef struct _SPLIT_TEST {
+    ULONGLONG     Sectors;                  // On the device
+    HANDLE        Start;
+    volatile LONG Stop;
+} SPLIT_TEST, *PSPLIT_TEST;
+
+//
+// One DoSplit thread, with its own handle to the device.  Latencies are
+// each read's, in microseconds.
+//
+typedef struct _SPLIT_WORKER {
+    PSPLIT_TEST         Test;
+    HANDLE              Device;
+    PVOID               Buffer;
+    ULONG               Size;
+    ULONGLONG           Random;
+    ULONGLONG           Bytes;
+    std::vector<double> Latencies;
+    bool                Failed;
+} SPLIT_WORKER, *PSPLIT_WORKER;
+
+//
+// What DoRoute measures: the routing table's perfect hash against a linear
+// scan of the same routes, for tables of 10, 100 and 1000 codes.  Half
+// of the ROUTE_LOOKUPS codes looked up are in the table and half aren't,
+// as with a filter that routes a few codes and passes the rest down.  Each
+// time is the best of ROUTE_ROUNDS.
+//
+constexpr ULONG ROUTE_LOOKUPS = 1024 * 1024;
+constexpr ULONG ROUTE_ROUNDS  = 5;
+
+//
+// A route is anything with an IoControlCode (see GenFilterRouteTable.h)
+//
+typedef struct _ROUTE_BENCH_ROUTE {
+    ULONG IoControlCode;
+} ROUTE_BENCH_ROUTE;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  OpenFilteredDevice
+//
+//    Opens the device that GenFilter is filtering (for example \\.\CdRom0).
+//    Our private IOCTLs are sent to this handle; the filter sees them on
+//    the way down and completes them itself.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+HANDLE
+OpenFilteredDevice(PCWSTR DevicePath,
+                   DWORD  DesiredAccess,
+                   DWORD  FlagsAndAttributes)
+{
+    HANDLE device;
+
+    device = CreateFileW(DevicePath,
+                         DesiredAccess,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         nullptr,
+                         OPEN_EXISTING,
+                         FlagsAndAttributes,
+                         nullptr);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %ls failed - %lu\n",
+               DevicePath,
+               GetLastError());
+    }
+
+    return device;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoStats
+//
+//    Retrieves and prints the filter's I/O statistics
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoStats(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE               device;
+    GENFILTER_STATISTICS stats;
+    DWORD                bytesReturned;
+    int                  result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_GET_STATISTICS,
+                         nullptr,
+                         0,
+                         &stats,
+                         sizeof(stats),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_GET_STATISTICS failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    printf("%lu processor slot(s)\n",
+           stats.ProcessorCount);
+
+    for (ULONG counter = 0; counter < stats.CounterCount; counter++) {
+
+        printf("    %-32s %llu\n",
+               StatCounterNames[counter],
+               stats.Counters[counter]);
+    }
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoTrace
+//
+//    Drains the filter's trace log and appends it, exactly as returned by
+//    the driver, to a file for later decoding.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoTrace(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE            device;
+    HANDLE            file = INVALID_HANDLE_VALUE;
+    std::vector<BYTE> buffer(DRAIN_BUFFER_SIZE);
+    DWORD             bytesReturned;
+    DWORD             bytesWritten;
+    ULONGLONG         totalRecords = 0;
+    ULONGLONG         totalLost    = 0;
+    int               result       = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    file = CreateFileW(Argv[1],
+                       FILE_APPEND_DATA,
+                       0,
+                       nullptr,
+                       OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %ls failed - %lu\n",
+               Argv[1],
+               GetLastError());
+        goto done;
+    }
+
+    for (;;) {
+
+        auto* header = (PGENFILTER_TRACE_HEADER)buffer.data();
+
+        if (!DeviceIoControl(device,
+                             IOCTL_GENFILTER_DRAIN_TRACE,
+                             nullptr,
+                             0,
+                             buffer.data(),
+                             (DWORD)buffer.size(),
+                             &bytesReturned,
+                             nullptr)) {
+
+            printf("IOCTL_GENFILTER_DRAIN_TRACE failed - %lu\n",
+                   GetLastError());
+            goto done;
+        }
+
+        totalLost += header->LostRecords;
+
+        if (header->RecordCount == 0) {
+            break;
+        }
+
+        totalRecords += header->RecordCount;
+
+        if (!WriteFile(file,
+                       buffer.data(),
+                       bytesReturned,
+                       &bytesWritten,
+                       nullptr)) {
+
+            printf("WriteFile failed - %lu\n",
+                   GetLastError());
+            goto done;
+        }
+    }
+
+    printf("%llu record(s) drained to %ls, %llu lost\n",
+           totalRecords,
+           Argv[1],
+           totalLost);
+
+    result = 0;
+
+done:
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoDecode
+//
+//    Decodes a file written by DoTrace.  The file is a sequence of drained
+//    buffers, each a GENFILTER_TRACE_HEADER followed by its records.  We
+//    merge the records from every buffer, put them in time order, and print
+//    them with timestamps relative to the first record.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoDecode(int      Argc,
+         wchar_t* Argv[])
+{
+    HANDLE                              file;
+    LARGE_INTEGER                       fileSize;
+    std::vector<BYTE>                   contents;
+    std::vector<GENFILTER_TRACE_RECORD> records;
+    DWORD                               bytesRead;
+    size_t                              offset    = 0;
+    ULONGLONG                           frequency = 0;
+    ULONGLONG                           lost      = 0;
+    int                                 result    = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    file = CreateFileW(Argv[0],
+                       GENERIC_READ,
+                       FILE_SHARE_READ,
+                       nullptr,
+                       OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %ls failed - %lu\n",
+               Argv[0],
+               GetLastError());
+        goto done;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.HighPart != 0) {
+        printf("%ls is too large to decode\n",
+               Argv[0]);
+        goto done;
+    }
+
+    contents.resize(fileSize.LowPart);
+
+    if (!ReadFile(file,
+                  contents.data(),
+                  fileSize.LowPart,
+                  &bytesRead,
+                  nullptr) || bytesRead != fileSize.LowPart) {
+
+        printf("ReadFile failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    while (offset + sizeof(GENFILTER_TRACE_HEADER) <= contents.size()) {
+
+        auto*  header = (PGENFILTER_TRACE_HEADER)&contents[offset];
+        size_t chunkLength;
+
+        chunkLength = header->Size +
+                      ((size_t)header->RecordCount * header->RecordSize);
+
+        if (header->Size < sizeof(GENFILTER_TRACE_HEADER) ||
+            header->RecordSize < sizeof(GENFILTER_TRACE_RECORD) ||
+            offset + chunkLength > contents.size()) {
+
+            printf("Malformed trace data at offset %zu\n",
+                   offset);
+            goto done;
+        }
+
+        frequency = header->Frequency;
+        lost     += header->LostRecords;
+
+        for (ULONG index = 0; index < header->RecordCount; index++) {
+
+            records.push_back(*(PGENFILTER_TRACE_RECORD)&contents[offset +
+                                                                  header->Size +
+                                                                  ((size_t)index * header->RecordSize)]);
+        }
+
+        offset += chunkLength;
+    }
+
+    std::stable_sort(records.begin(),
+                     records.end(),
+                     [](const GENFILTER_TRACE_RECORD& Left,
+                        const GENFILTER_TRACE_RECORD& Right) {
+                         return Left.Timestamp < Right.Timestamp;
+                     });
+
+    printf("%zu record(s), %llu lost\n\n",
+           records.size(),
+           lost);
+
+    printf("%14s %4s %-18s %-18s %-10s %s\n",
+           "Time (us)",
+           "CPU",
+           "Event",
+           "Request",
+           "Status",
+           "Argument");
+
+    for (const auto& record : records) {
+
+        double      micros;
+        const char* eventName = "?";
+
+        micros = (double)(record.Timestamp - records.front().Timestamp) *
+                 1000000.0 / (double)frequency;
+
+        if (record.EventId < GenFilterTraceEventCount) {
+            eventName = TraceEventNames[record.EventId];
+        }
+
+        printf("%14.3f %4u %-18s 0x%016llx 0x%08lx 0x%llx\n",
+               micros,
+               record.Processor,
+               eventName,
+               record.Request,
+               (ULONG)record.Status,
+               record.Argument);
+    }
+
+    result = 0;
+
+done:
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  LatencyPercentile
+//
+//    Returns the latency (in microseconds) below which Percentile percent of
+//    the Requests in a histogram completed.  We report the midpoint of the
+//    bucket the percentile falls in, so the answer is within half a bucket
+//    (1/16th) of the truth.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+LatencyPercentile(const GENFILTER_LATENCY_CLASS* LatencyClass,
+                  double                         Percentile,
+                  ULONGLONG                      Frequency)
+{
+    ULONGLONG target;
+    ULONGLONG seen = 0;
+
+    target = (ULONGLONG)((Percentile / 100.0) * (double)LatencyClass->Count);
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (ULONG bucket = 0; bucket < GENFILTER_LATENCY_BUCKETS; bucket++) {
+
+        seen += LatencyClass->Buckets[bucket];
+
+        if (seen >= target) {
+
+            double low  = (double)GenFilterLatencyBucketLowest(bucket);
+            double high = low + 1.0;
+
+            if (bucket + 1 < GENFILTER_LATENCY_BUCKETS) {
+                high = (double)GenFilterLatencyBucketLowest(bucket + 1);
+            }
+
+            return ((low + high) / 2.0) * 1000000.0 / (double)Frequency;
+        }
+    }
+
+    return 0.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoLatency
+//
+//    Retrieves the filter's latency histograms and prints percentiles for
+//    every class that has seen any Requests
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoLatency(int      Argc,
+          wchar_t* Argv[])
+{
+    HANDLE            device;
+    std::vector<BYTE> buffer(DRAIN_BUFFER_SIZE);
+    DWORD             bytesReturned;
+    int               result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_GET_LATENCY,
+                         nullptr,
+                         0,
+                         buffer.data(),
+                         (DWORD)buffer.size(),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_GET_LATENCY failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    {
+        auto* header = (PGENFILTER_LATENCY_HEADER)buffer.data();
+
+        if (header->Size < sizeof(GENFILTER_LATENCY_HEADER) ||
+            header->ClassSize < sizeof(GENFILTER_LATENCY_CLASS)) {
+
+            printf("Malformed latency data\n");
+            goto done;
+        }
+
+        printf("%lu processor slot(s), latencies in microseconds\n\n",
+               header->ProcessorCount);
+
+        printf("%-28s %8s %12s",
+               "Class",
+               "Sampled",
+               "Count");
+
+        for (double percentile : LatencyPercentiles) {
+
+            printf("   p%-8g",
+                   percentile);
+        }
+
+        printf("\n");
+
+        for (ULONG classIndex = 0; classIndex < header->ClassCount; classIndex++) {
+
+            auto* latencyClass = (const GENFILTER_LATENCY_CLASS*)&buffer[header->Size +
+                                                                         ((size_t)classIndex * header->ClassSize)];
+            char  name[32];
+            char  interval[16];
+
+            if (latencyClass->Count == 0) {
+                continue;
+            }
+
+            if (classIndex < GenFilterLatencyFixedClassCount) {
+
+                sprintf_s(name,
+                          "%s",
+                          LatencyClassNames[classIndex]);
+            } else {
+
+                sprintf_s(name,
+                          "IOCTL 0x%08lx",
+                          latencyClass->IoControlCode);
+            }
+
+            sprintf_s(interval,
+                      "1/%lu",
+                      latencyClass->SampleInterval);
+
+            printf("%-28s %8s %12llu",
+                   name,
+                   interval,
+                   latencyClass->Count);
+
+            for (double percentile : LatencyPercentiles) {
+
+                printf(" %11.1f",
+                       LatencyPercentile(latencyClass,
+                                         percentile,
+                                         header->Frequency));
+            }
+
+            printf("\n");
+        }
+    }
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SetPassThrough
+//
+//    Switches the filter's pass-through mode, optionally returning the mode
+//    it was in before
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+BOOL
+SetPassThrough(HANDLE Device,
+               ULONG  Enable,
+               PULONG Previous)
+{
+    ULONG previous;
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_GENFILTER_SET_PASS_THROUGH,
+                         &Enable,
+                         sizeof(Enable),
+                         &previous,
+                         sizeof(previous),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_SET_PASS_THROUGH failed - %lu\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    if (Previous != nullptr) {
+        *Previous = previous;
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoPassThrough
+//
+//    Switches the filter's pass-through mode on or off
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoPassThrough(int      Argc,
+              wchar_t* Argv[])
+{
+    HANDLE device = INVALID_HANDLE_VALUE;
+    ULONG  enable;
+    ULONG  previous;
+    int    result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    if (_wcsicmp(Argv[1], L"on") == 0) {
+        enable = 1;
+    } else if (_wcsicmp(Argv[1], L"off") == 0) {
+        enable = 0;
+    } else {
+        printf("Specify on or off\n");
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!SetPassThrough(device,
+                        enable,
+                        &previous)) {
+        goto done;
+    }
+
+    printf("Pass-through was %s, now %s\n",
+           previous != 0 ? "on" : "off",
+           enable != 0 ? "on" : "off");
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimeReads
+//
+//    Reads the first Length bytes of the device sequentially and returns
+//    how long it took, in seconds.  Returns a negative value if a read
+//    fails.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+TimeReads(HANDLE    Device,
+          PVOID     Buffer,
+          ULONGLONG Length,
+          PULONG    ReadCount)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    LARGE_INTEGER offset;
+    DWORD         bytesRead;
+
+    *ReadCount      = 0;
+    offset.QuadPart = 0;
+
+    if (!SetFilePointerEx(Device,
+                          offset,
+                          nullptr,
+                          FILE_BEGIN)) {
+
+        printf("SetFilePointerEx failed - %lu\n",
+               GetLastError());
+        return -1.0;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (ULONGLONG done = 0; done < Length; done += COMPARE_READ_SIZE) {
+
+        if (!ReadFile(Device,
+                      Buffer,
+                      COMPARE_READ_SIZE,
+                      &bytesRead,
+                      nullptr)) {
+
+            printf("ReadFile at offset %llu failed - %lu\n",
+                   done,
+                   GetLastError());
+            return -1.0;
+        }
+
+        (*ReadCount)++;
+
+        if (bytesRead < COMPARE_READ_SIZE) {
+            break;
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    return (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoCompare
+//
+//    Reports the read throughput of the device with the filter inspecting
+//    Requests, and again with it in pass-through mode.
+//
+//    Reads are unbuffered, so every one reaches the filter.  Both runs read
+//    the same data, after a first untimed pass that warms the drive's own
+//    cache, so the difference between them is (mostly) the filter's cost.
+//    The filter is left in whatever mode it was in when we started.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoCompare(int      Argc,
+          wchar_t* Argv[])
+{
+    static const char* modeNames[] = {
+        "Inspecting",
+        "Pass-through",
+    };
+
+    HANDLE    device = INVALID_HANDLE_VALUE;
+    PVOID     buffer = nullptr;
+    ULONGLONG length;
+    ULONG     previous;
+    ULONG     readCount;
+    BOOL      modeChanged = FALSE;
+    double    seconds;
+    int       result      = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    length = (ULONGLONG)wcstoul(Argv[1],
+                                nullptr,
+                                10) * 1024 * 1024;
+
+    if (length == 0) {
+        printf("Specify the number of megabytes to read\n");
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                FILE_FLAG_NO_BUFFERING);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    //
+    // Unbuffered reads need a sector aligned buffer; VirtualAlloc gives us
+    // a page aligned one
+    //
+    buffer = VirtualAlloc(nullptr,
+                          COMPARE_READ_SIZE,
+                          MEM_COMMIT | MEM_RESERVE,
+                          PAGE_READWRITE);
+
+    if (buffer == nullptr) {
+        printf("VirtualAlloc failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    if (!SetPassThrough(device,
+                        0,
+                        &previous)) {
+        goto done;
+    }
+
+    modeChanged = TRUE;
+
+    if (TimeReads(device,
+                  buffer,
+                  length,
+                  &readCount) < 0.0) {
+        goto done;
+    }
+
+    for (ULONG mode = 0; mode < ARRAYSIZE(modeNames); mode++) {
+
+        if (!SetPassThrough(device,
+                            mode,
+                            nullptr)) {
+            goto done;
+        }
+
+        seconds = TimeReads(device,
+                            buffer,
+                            length,
+                            &readCount);
+
+        if (seconds <= 0.0) {
+            goto done;
+        }
+
+        printf("%-14s %10.1f MB/s %10.0f reads/s\n",
+               modeNames[mode],
+               ((double)readCount * COMPARE_READ_SIZE) / (1024.0 * 1024.0) / seconds,
+               (double)readCount / seconds);
+    }
+
+    result = 0;
+
+done:
+
+    if (modeChanged) {
+        SetPassThrough(device,
+                       previous,
+                       nullptr);
+    }
+
+    if (buffer != nullptr) {
+        VirtualFree(buffer,
+                    0,
+                    MEM_RELEASE);
+    }
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  TimeDeviceControls
+//
+//    Sends Count IOCTL_STORAGE_GET_DEVICE_NUMBER Requests to the device, one
+//    after the other, and returns how long each took on average, in
+//    nanoseconds.  Returns a negative value if one fails.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+TimeDeviceControls(HANDLE Device,
+                   ULONG  Count)
+{
+    LARGE_INTEGER         frequency;
+    LARGE_INTEGER         start;
+    LARGE_INTEGER         end;
+    STORAGE_DEVICE_NUMBER number;
+    DWORD                 bytesReturned;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    for (ULONG index = 0; index < Count; index++) {
+
+        if (!DeviceIoControl(Device,
+                             IOCTL_STORAGE_GET_DEVICE_NUMBER,
+                             nullptr,
+                             0,
+                             &number,
+                             sizeof(number),
+                             &bytesReturned,
+                             nullptr)) {
+
+            printf("IOCTL_STORAGE_GET_DEVICE_NUMBER failed - %lu\n",
+                   GetLastError());
+            return -1.0;
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    return (double)(end.QuadPart - start.QuadPart) * 1e9 /
+           (double)frequency.QuadPart / (double)Count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoForward
+//
+//    Reports what the filter's dispatcher costs per Request, next to
+//    pass-through mode, where the filter's preprocess routine sends the IRP
+//    straight down.
+//
+//    The class driver answers IOCTL_STORAGE_GET_DEVICE_NUMBER without
+//    going near the drive, and the filter has no route for it, so nearly
+//    all of each Request's time is spent getting it through the stack.  The
+//    difference between the two modes is what it costs for the Request to
+//    become a WDFREQUEST, be presented to our Queue and go through the
+//    dispatcher.  Pass-through isn't what hand-written KMDF forwarding
+//    costs, since that pays for the Framework too; GenFilterSimBench
+//    measures the dispatcher with no policies against a hand-written
+//    filter.  The filter is left in whatever mode it was in when we
+//    started.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoForward(int      Argc,
+          wchar_t* Argv[])
+{
+    static const char* modeNames[] = {
+        "Dispatcher",
+        "Pass-through",
+    };
+
+    HANDLE device = INVALID_HANDLE_VALUE;
+    ULONG  count;
+    ULONG  previous;
+    BOOL   modeChanged = FALSE;
+    double best[ARRAYSIZE(modeNames)];
+    double nanoseconds;
+    int    result      = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    count = wcstoul(Argv[1],
+                    nullptr,
+                    10);
+
+    if (count == 0) {
+        printf("Specify the number of Requests to time\n");
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!SetPassThrough(device,
+                        0,
+                        &previous)) {
+        goto done;
+    }
+
+    modeChanged = TRUE;
+
+    for (ULONG mode = 0; mode < ARRAYSIZE(modeNames); mode++) {
+        best[mode] = -1.0;
+    }
+
+    for (ULONG round = 0; round < FORWARD_ROUNDS; round++) {
+
+        for (ULONG mode = 0; mode < ARRAYSIZE(modeNames); mode++) {
+
+            if (!SetPassThrough(device,
+                                mode,
+                                nullptr)) {
+                goto done;
+            }
+
+            nanoseconds = TimeDeviceControls(device,
+                                             count);
+
+            if (nanoseconds < 0.0) {
+                goto done;
+            }
+
+            if (best[mode] < 0.0 || nanoseconds < best[mode]) {
+                best[mode] = nanoseconds;
+            }
+        }
+    }
+
+    for (ULONG mode = 0; mode < ARRAYSIZE(modeNames); mode++) {
+
+        printf("%-14s %10.0f ns/Request\n",
+               modeNames[mode],
+               best[mode]);
+    }
+
+    printf("%-14s %10.0f ns/Request\n",
+           "Difference",
+           best[0] - best[1]);
+
+    result = 0;
+
+done:
+
+    if (modeChanged) {
+        SetPassThrough(device,
+                       previous,
+                       nullptr);
+    }
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SetLatencySampling
+//
+//    Replaces the filter's latency sampling intervals, optionally returning
+//    the ones it had before
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+BOOL
+SetLatencySampling(HANDLE                            Device,
+                   const GENFILTER_LATENCY_SAMPLING* Sampling,
+                   PGENFILTER_LATENCY_SAMPLING       Previous)
+{
+    GENFILTER_LATENCY_SAMPLING previous;
+    DWORD                      bytesReturned;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_GENFILTER_SET_LATENCY_SAMPLING,
+                         (PVOID)Sampling,
+                         sizeof(GENFILTER_LATENCY_SAMPLING),
+                         &previous,
+                         sizeof(previous),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_SET_LATENCY_SAMPLING failed - %lu\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    if (Previous != nullptr) {
+        *Previous = previous;
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoSample
+//
+//    Reports what latency sampling costs per Request at each of
+//    SampleIntervals.  A Request that isn't timed is sent and forgotten;
+//    one that is goes with our completion callback, and comes back through
+//    the filter to be counted.  So the difference from timing none is what
+//    the callback path costs, spread over the Requests that don't pay it.
+//
+//    As in DoForward, the Requests are IOCTL_STORAGE_GET_DEVICE_NUMBER,
+//    which the class driver answers without going near the drive, so the
+//    overhead isn't hidden behind the media.  The filter is taken out of
+//    pass-through mode (where nothing is timed) for the duration, and left
+//    with the mode and intervals it had when we started.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoSample(int      Argc,
+         wchar_t* Argv[])
+{
+    HANDLE                     device = INVALID_HANDLE_VALUE;
+    GENFILTER_LATENCY_SAMPLING previousSampling;
+    GENFILTER_LATENCY_SAMPLING sampling;
+    ULONG                      count;
+    ULONG                      previousMode;
+    BOOL                       modeChanged     = FALSE;
+    BOOL                       samplingChanged = FALSE;
+    double                     best[ARRAYSIZE(SampleIntervals)];
+    double                     nanoseconds;
+    int                        result          = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    count = wcstoul(Argv[1],
+                    nullptr,
+                    10);
+
+    if (count == 0) {
+        printf("Specify the number of Requests to time\n");
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!SetPassThrough(device,
+                        0,
+                        &previousMode)) {
+        goto done;
+    }
+
+    modeChanged = TRUE;
+
+    for (ULONG interval = 0; interval < ARRAYSIZE(SampleIntervals); interval++) {
+        best[interval] = -1.0;
+    }
+
+    for (ULONG round = 0; round < FORWARD_ROUNDS; round++) {
+
+        for (ULONG interval = 0; interval < ARRAYSIZE(SampleIntervals); interval++) {
+
+            for (ULONG& sampleInterval : sampling.SampleInterval) {
+                sampleInterval = SampleIntervals[interval];
+            }
+
+            if (!SetLatencySampling(device,
+                                    &sampling,
+                                    samplingChanged ? nullptr : &previousSampling)) {
+                goto done;
+            }
+
+            samplingChanged = TRUE;
+
+            nanoseconds = TimeDeviceControls(device,
+                                             count);
+
+            if (nanoseconds < 0.0) {
+                goto done;
+            }
+
+            if (best[interval] < 0.0 || nanoseconds < best[interval]) {
+                best[interval] = nanoseconds;
+            }
+        }
+    }
+
+    printf("%8s %8s %12s %12s\n",
+           "1 in N",
+           "Timed",
+           "ns/Request",
+           "Overhead ns");
+
+    for (ULONG interval = 0; interval < ARRAYSIZE(SampleIntervals); interval++) {
+
+        if (SampleIntervals[interval] == 0) {
+            printf("%8s %8s %12.0f %12s\n",
+                   "off",
+                   "-",
+                   best[interval],
+                   "-");
+            continue;
+        }
+
+        printf("%8lu %7.2f%% %12.0f %12.0f\n",
+               SampleIntervals[interval],
+               100.0 / SampleIntervals[interval],
+               best[interval],
+               best[interval] - best[0]);
+    }
+
+    result = 0;
+
+done:
+
+    if (samplingChanged) {
+        SetLatencySampling(device,
+                           &previousSampling,
+                           nullptr);
+    }
+
+    if (modeChanged) {
+        SetPassThrough(device,
+                       previousMode,
+                       nullptr);
+    }
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SchedServiceTime
+//
+//    How long (in microseconds) the simulated drive takes to move from From
+//    and transfer Length bytes at To.  Seek time grows with the square root
+//    of the distance, roughly as an optical drive's does, up to a full
+//    stroke.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+SchedServiceTime(ULONGLONG From,
+                 ULONGLONG To,
+                 ULONG     Length)
+{
+    ULONGLONG distance = (To > From) ? To - From : From - To;
+    double    seek     = 0.0;
+
+    if (distance > SCHED_SPAN) {
+        distance = SCHED_SPAN;
+    }
+
+    if (distance != 0) {
+        seek = SCHED_SETTLE_US +
+               (SCHED_FULL_SEEK_US * sqrt((double)distance / (double)SCHED_SPAN));
+    }
+
+    return seek + (Length / SCHED_BYTES_PER_US);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SchedReplay
+//
+//    Runs one workload through the scheduler with one policy, and prints
+//    the seek distance and latency that result.  The random numbers are
+//    seeded the same way every time, so every policy sees the same
+//    workload.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+SchedReplay(GENFILTER_SCHED_POLICY Policy,
+            bool                   Sequential)
+{
+    GENFILTER_SCHED                     sched;
+    std::vector<PGENFILTER_SCHED_ENTRY> storage(2 * SCHED_CLIENTS);
+    std::vector<GENFILTER_SCHED_ENTRY>  entries(SCHED_CLIENTS);
+    std::vector<double>                 issued(SCHED_CLIENTS);
+    std::vector<double>                 latencies;
+    ULONGLONG                           streamNext[SCHED_STREAMS];
+    ULONGLONG                           random   = 0x9E3779B97F4A7C15ULL;
+    ULONGLONG                           position = 0;
+    ULONGLONG                           seekTotal = 0;
+    double                              now       = 0.0;
+    double                              latencyTotal = 0.0;
+
+    auto nextOffset = [&](ULONG Client) -> ULONGLONG {
+
+        ULONGLONG offset;
+
+        if (Sequential) {
+
+            ULONG stream = Client % SCHED_STREAMS;
+
+            offset = streamNext[stream];
+            streamNext[stream] = (offset + SCHED_REQUEST_SIZE) % SCHED_SPAN;
+
+            return offset;
+        }
+
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+
+        return (random % (SCHED_SPAN / SCHED_REQUEST_SIZE)) * SCHED_REQUEST_SIZE;
+    };
+
+    for (ULONG stream = 0; stream < SCHED_STREAMS; stream++) {
+        streamNext[stream] = (SCHED_SPAN / SCHED_STREAMS) * stream;
+    }
+
+    GenFilterSchedInitialize(&sched,
+                             Policy,
+                             storage.data(),
+                             SCHED_CLIENTS);
+
+    for (ULONG client = 0; client < SCHED_CLIENTS; client++) {
+
+        GenFilterSchedInsert(&sched,
+                             &entries[client],
+                             nextOffset(client),
+                             SCHED_DEADLINE_US);
+    }
+
+    latencies.reserve(SCHED_REQUESTS);
+
+    while (latencies.size() < SCHED_REQUESTS) {
+
+        PGENFILTER_SCHED_ENTRY entry;
+        ULONG                  client;
+        double                 latency;
+
+        entry  = GenFilterSchedPop(&sched,
+                                   (ULONGLONG)now);
+        client = (ULONG)(entry - entries.data());
+
+        now += SchedServiceTime(position,
+                                entry->Offset,
+                                SCHED_REQUEST_SIZE);
+
+        seekTotal += (entry->Offset > position) ? entry->Offset - position :
+                                                   position - entry->Offset;
+        position   = entry->Offset + SCHED_REQUEST_SIZE;
+
+        latency       = now - issued[client];
+        latencyTotal += latency;
+        latencies.push_back(latency);
+
+        issued[client] = now;
+
+        GenFilterSchedInsert(&sched,
+                             entry,
+                             nextOffset(client),
+                             (ULONGLONG)now + SCHED_DEADLINE_US);
+    }
+
+    std::sort(latencies.begin(),
+              latencies.end());
+
+    printf("%-12s %-10s %12.1f %10.1f %10.1f %10.1f %10.1f\n",
+           Sequential ? "Sequential" : "Random",
+           SchedPolicyNames[Policy],
+           (double)seekTotal / latencies.size() / (1024.0 * 1024.0),
+           ((double)latencies.size() * SCHED_REQUEST_SIZE) / (1024.0 * 1024.0) /
+           (now / 1000000.0),
+           latencyTotal / latencies.size() / 1000.0,
+           latencies[(latencies.size() * 99) / 100] / 1000.0,
+           latencies.back() / 1000.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoSched
+//
+//    Replays simulated random and sequential workloads through the same
+//    scheduler core the driver uses, once for each policy.  No device is
+//    involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoSched(int      Argc,
+        wchar_t* Argv[])
+{
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    printf("%lu clients, %lu x %luKB Requests per run, %llums deadline\n\n",
+           SCHED_CLIENTS,
+           SCHED_REQUESTS,
+           SCHED_REQUEST_SIZE / 1024,
+           SCHED_DEADLINE_US / 1000);
+
+    printf("%-12s %-10s %12s %10s %10s %10s %10s\n",
+           "Workload",
+           "Policy",
+           "Seek MB/req",
+           "MB/s",
+           "Mean ms",
+           "p99 ms",
+           "Max ms");
+
+    for (int sequential = 0; sequential < 2; sequential++) {
+
+        for (ULONG policy = 0; policy < GenFilterSchedPolicyCount; policy++) {
+
+            SchedReplay((GENFILTER_SCHED_POLICY)policy,
+                        sequential != 0);
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoPools
+//
+//    Retrieves and prints the state of the filter's element pools
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoPools(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE          device;
+    GENFILTER_POOLS pools;
+    DWORD           bytesReturned;
+    int             result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_GET_POOLS,
+                         nullptr,
+                         0,
+                         &pools,
+                         sizeof(pools),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_GET_POOLS failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    printf("%lu processor cache(s) per pool\n\n",
+           pools.ProcessorCount);
+
+    printf("%-12s %8s %8s %8s %10s %14s %12s\n",
+           "Pool",
+           "Elements",
+           "Size",
+           "InUse",
+           "HighWater",
+           "Allocations",
+           "Exhausted");
+
+    for (ULONG pool = 0; pool < pools.PoolCount; pool++) {
+
+        if (pools.Pools[pool].ElementCount == 0) {
+            printf("%-12s (not in use)\n",
+                   PoolNames[pool]);
+            continue;
+        }
+
+        printf("%-12s %8lu %8lu %8lu %10lu %14llu %12llu\n",
+               PoolNames[pool],
+               pools.Pools[pool].ElementCount,
+               pools.Pools[pool].ElementSize,
+               pools.Pools[pool].InUse,
+               pools.Pools[pool].HighWater,
+               pools.Pools[pool].Allocations,
+               pools.Pools[pool].Exhausted);
+    }
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SlabChurnThread
+//
+//    Runs SLAB_OPERATIONS random allocations and frees, from the pool or
+//    from the process heap, once the Start event is set.  Each element is
+//    written to when it's allocated, as it would be in use.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+SlabChurnThread(LPVOID Context)
+{
+    auto*     churn = (PSLAB_CHURN)Context;
+    HANDLE    heap  = GetProcessHeap();
+    PVOID     held[SLAB_HELD];
+    ULONG     heldCount = 0;
+    ULONGLONG random    = 0x9E3779B97F4A7C15ULL + churn->Cpu;
+
+    WaitForSingleObject(churn->Start,
+                        INFINITE);
+
+    for (ULONG operation = 0; operation < SLAB_OPERATIONS; operation++) {
+
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+
+        if (heldCount == 0 ||
+            (heldCount < SLAB_HELD && (random & 1) != 0)) {
+
+            PVOID element;
+
+            if (churn->Slab != nullptr) {
+                element = GenFilterSlabAllocate(churn->Slab,
+                                                churn->Cpu);
+            } else {
+                element = HeapAlloc(heap,
+                                    0,
+                                    SLAB_ELEMENT_SIZE);
+            }
+
+            if (element == nullptr) {
+                churn->Failed++;
+                continue;
+            }
+
+            *(volatile ULONG*)element = operation;
+
+            held[heldCount++] = element;
+
+        } else {
+
+            ULONG which   = (ULONG)((random >> 1) % heldCount);
+            PVOID element = held[which];
+
+            held[which] = held[--heldCount];
+
+            if (churn->Slab != nullptr) {
+                GenFilterSlabFree(churn->Slab,
+                                  churn->Cpu,
+                                  element);
+            } else {
+                HeapFree(heap,
+                         0,
+                         element);
+            }
+        }
+    }
+
+    while (heldCount != 0) {
+
+        if (churn->Slab != nullptr) {
+            GenFilterSlabFree(churn->Slab,
+                              churn->Cpu,
+                              held[--heldCount]);
+        } else {
+            HeapFree(heap,
+                     0,
+                     held[--heldCount]);
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SlabRun
+//
+//    Runs the churn on ThreadCount threads with one allocator, and prints
+//    the throughput.  Each thread plays the part of one processor, so the
+//    pool has one cache per thread.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+SlabRun(ULONG ThreadCount,
+        bool  UseSlab)
+{
+    GENFILTER_SLAB                  slab;
+    GENFILTER_SLAB_COUNTERS         counters;
+    std::vector<UCHAR>              elements;
+    std::vector<ULONG>              next;
+    std::vector<GENFILTER_SLAB_CPU> cpus(ThreadCount);
+    std::vector<SLAB_CHURN>         churns(ThreadCount);
+    std::vector<HANDLE>             threads;
+    HANDLE                          start;
+    LARGE_INTEGER                   frequency;
+    LARGE_INTEGER                   begin;
+    LARGE_INTEGER                   end;
+    ULONGLONG                       failed = 0;
+    double                          seconds;
+    double                          operations;
+
+    //
+    // Twice what the threads can hold between them, so that the pool only
+    // runs dry if the caches strand elements
+    //
+    if (UseSlab) {
+
+        ULONG elementCount = 2 * SLAB_HELD * ThreadCount;
+
+        elements.resize((size_t)elementCount * SLAB_ELEMENT_SIZE);
+        next.resize(elementCount);
+
+        GenFilterSlabInitialize(&slab,
+                                elements.data(),
+                                SLAB_ELEMENT_SIZE,
+                                elementCount,
+                                next.data(),
+                                cpus.data(),
+                                ThreadCount);
+    }
+
+    start = CreateEventW(nullptr,
+                         TRUE,
+                         FALSE,
+                         nullptr);
+
+    for (ULONG thread = 0; thread < ThreadCount; thread++) {
+
+        churns[thread].Slab   = UseSlab ? &slab : nullptr;
+        churns[thread].Cpu    = thread;
+        churns[thread].Start  = start;
+        churns[thread].Failed = 0;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       SlabChurnThread,
+                                       &churns[thread],
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(start);
+
+    WaitForMultipleObjects(ThreadCount,
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    for (ULONG thread = 0; thread < ThreadCount; thread++) {
+        failed += churns[thread].Failed;
+        CloseHandle(threads[thread]);
+    }
+
+    CloseHandle(start);
+
+    if (UseSlab) {
+        GenFilterSlabQuery(&slab,
+                           &counters);
+    }
+
+    seconds    = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+    operations = (double)ThreadCount * SLAB_OPERATIONS;
+
+    printf("%8lu %-10s %12.1f %10.1f ",
+           ThreadCount,
+           UseSlab ? "Slab" : "Heap",
+           operations / seconds / 1000000.0,
+           seconds * 1000000000.0 * ThreadCount / operations);
+
+    if (UseSlab) {
+        printf("%10lu %10llu\n",
+               counters.HighWater,
+               failed);
+    } else {
+        printf("%10s %10llu\n",
+               "-",
+               failed);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoSlab
+//
+//    Benchmarks the pool core the driver uses against the process heap,
+//    under the same multi-threaded churn, on one thread and then on one
+//    thread per processor.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoSlab(int      Argc,
+       wchar_t* Argv[])
+{
+    ULONG threadCount;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    threadCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    if (threadCount > MAXIMUM_WAIT_OBJECTS) {
+        threadCount = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    printf("%luB elements, up to %lu held and %lu operations per thread\n\n",
+           SLAB_ELEMENT_SIZE,
+           SLAB_HELD,
+           SLAB_OPERATIONS);
+
+    printf("%8s %-10s %12s %10s %10s %10s\n",
+           "Threads",
+           "Allocator",
+           "Mops/s",
+           "ns/op",
+           "HighWater",
+           "Failed");
+
+    for (ULONG threads = 1; ; threads = threadCount) {
+
+        SlabRun(threads,
+                true);
+        SlabRun(threads,
+                false);
+
+        if (threads == threadCount) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoDefer
+//
+//    Retrieves and prints the state of the filter's deferred work queue
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoDefer(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE               device;
+    GENFILTER_DEFER_INFO info;
+    DWORD                bytesReturned;
+    int                  result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_GET_DEFER,
+                         nullptr,
+                         0,
+                         &info,
+                         sizeof(info),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_GET_DEFER failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    if (info.WorkerCount == 0) {
+        printf("Deferral is off\n");
+        result = 0;
+        goto done;
+    }
+
+    printf("Policy:      %s\n",
+           info.Policy < GenFilterDeferPolicyCount ?
+               DeferPolicyNames[info.Policy] : "?");
+    printf("Workers:     %lu\n",
+           info.WorkerCount);
+    printf("Depth:       %lu of %lu (high water %lu)\n",
+           info.Depth,
+           info.Capacity,
+           info.HighWater);
+    printf("Queued:      %llu\n",
+           info.Queued);
+    printf("Processed:   %llu\n",
+           info.Processed);
+    printf("Dropped:     %llu (done in the completion callback instead)\n",
+           info.Dropped);
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RingProducerThread
+//
+//    Pushes numbered items to the ring until told to stop
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+RingProducerThread(LPVOID Context)
+{
+    auto*     producer = (PRING_PRODUCER)Context;
+    ULONG_PTR tag      = (ULONG_PTR)(producer->Id + 1) << RING_SEQUENCE_BITS;
+    ULONG     sequence = 0;
+
+    WaitForSingleObject(producer->Stress->Start,
+                        INFINITE);
+
+    while (producer->Stress->Stop == 0) {
+
+        if (GenFilterRingPush(&producer->Stress->Ring,
+                              (void*)(tag | (sequence & RING_SEQUENCE_MASK)))) {
+            producer->Pushed++;
+            sequence++;
+        } else {
+            producer->Dropped++;
+            SwitchToThread();
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RingConsumerThread
+//
+//    Pops items until the producers have stopped and the ring is empty,
+//    checking that each producer's items arrive in the order they were
+//    pushed
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+RingConsumerThread(LPVOID Context)
+{
+    auto* consumer = (PRING_CONSUMER)Context;
+
+    WaitForSingleObject(consumer->Stress->Start,
+                        INFINITE);
+
+    for (;;) {
+
+        void* item;
+        ULONG id;
+        ULONG sequence;
+        ULONG difference;
+
+        item = GenFilterRingPop(&consumer->Stress->Ring);
+
+        if (item == nullptr) {
+
+            if (consumer->Stress->Drain != 0 &&
+                GenFilterRingDepth(&consumer->Stress->Ring) == 0) {
+                break;
+            }
+
+            //
+            // With more threads than processors, whoever we're waiting for
+            // may need our processor
+            //
+            SwitchToThread();
+            continue;
+        }
+
+        consumer->Popped++;
+
+        id       = (ULONG)((ULONG_PTR)item >> RING_SEQUENCE_BITS) - 1;
+        sequence = (ULONG)((ULONG_PTR)item & RING_SEQUENCE_MASK);
+
+        //
+        // Later items are ahead by less than half the sequence space
+        //
+        difference = (sequence - consumer->Last[id]) & RING_SEQUENCE_MASK;
+
+        if (consumer->Seen[id] &&
+            (difference == 0 || difference > (RING_SEQUENCE_MASK >> 1))) {
+            consumer->OutOfOrder++;
+        }
+
+        consumer->Seen[id] = true;
+        consumer->Last[id] = sequence;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RingRun
+//
+//    Runs the stress test with ProducerCount producers, and prints the
+//    throughput, what was dropped and lost, and how evenly the producers
+//    shared the ring
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+RingRun(ULONG ProducerCount)
+{
+    RING_STRESS                stress;
+    std::vector<RING_PRODUCER> producers(ProducerCount);
+    std::vector<RING_CONSUMER> consumers(RING_CONSUMERS);
+    std::vector<HANDLE>        threads;
+    LARGE_INTEGER              frequency;
+    LARGE_INTEGER              begin;
+    LARGE_INTEGER              end;
+    ULONGLONG                  pushed     = 0;
+    ULONGLONG                  dropped    = 0;
+    ULONGLONG                  popped     = 0;
+    ULONGLONG                  outOfOrder = 0;
+    ULONGLONG                  fewest     = ~0ULL;
+    ULONGLONG                  most       = 0;
+    double                     sumSquares = 0.0;
+    double                     seconds;
+    double                     fairness;
+
+    GenFilterRingInitialize(&stress.Ring,
+                            stress.Cells,
+                            RING_CAPACITY);
+
+    stress.Start = CreateEventW(nullptr,
+                                TRUE,
+                                FALSE,
+                                nullptr);
+    stress.Stop  = 0;
+    stress.Drain = 0;
+
+    for (ULONG consumer = 0; consumer < RING_CONSUMERS; consumer++) {
+
+        consumers[consumer] = RING_CONSUMER{};
+        consumers[consumer].Stress = &stress;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       RingConsumerThread,
+                                       &consumers[consumer],
+                                       0,
+                                       nullptr));
+    }
+
+    for (ULONG producer = 0; producer < ProducerCount; producer++) {
+
+        producers[producer] = RING_PRODUCER{};
+        producers[producer].Stress = &stress;
+        producers[producer].Id     = producer;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       RingProducerThread,
+                                       &producers[producer],
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(stress.Start);
+
+    Sleep(RING_SECONDS * 1000);
+
+    InterlockedExchange(&stress.Stop,
+                        1);
+
+    WaitForMultipleObjects(ProducerCount,
+                           &threads[RING_CONSUMERS],
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    InterlockedExchange(&stress.Drain,
+                        1);
+
+    WaitForMultipleObjects(RING_CONSUMERS,
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    for (HANDLE thread : threads) {
+        CloseHandle(thread);
+    }
+
+    CloseHandle(stress.Start);
+
+    for (const auto& producer : producers) {
+
+        pushed     += producer.Pushed;
+        dropped    += producer.Dropped;
+        sumSquares += (double)producer.Pushed * (double)producer.Pushed;
+
+        fewest = std::min(fewest, producer.Pushed);
+        most   = std::max(most, producer.Pushed);
+    }
+
+    for (const auto& consumer : consumers) {
+        popped     += consumer.Popped;
+        outOfOrder += consumer.OutOfOrder;
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    //
+    // Jain's index: 1.0 when every producer got the same share of the
+    // ring, 1/ProducerCount when one of them got all of it
+    //
+    fairness = (sumSquares == 0.0) ? 0.0 :
+               ((double)pushed * (double)pushed) / (ProducerCount * sumSquares);
+
+    printf("%9lu %10.2f %8.1f%% %9ld %10llu %6lld %12llu %12llu %8.3f\n",
+           ProducerCount,
+           (double)pushed / seconds / 1000000.0,
+           (pushed + dropped == 0) ? 0.0 : 100.0 * (double)dropped / (double)(pushed + dropped),
+           stress.Ring.HighWater,
+           outOfOrder,
+           (long long)(pushed - popped),
+           fewest,
+           most,
+           fairness);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoRing
+//
+//    Stress tests the queue the driver defers work through, with a growing
+//    number of producers.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoRing(int      Argc,
+       wchar_t* Argv[])
+{
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    printf("%lu item ring, %lu consumers, %lu second(s) per run\n\n",
+           RING_CAPACITY,
+           RING_CONSUMERS,
+           RING_SECONDS);
+
+    printf("%9s %10s %9s %9s %10s %6s %12s %12s %8s\n",
+           "Producers",
+           "Mpush/s",
+           "Dropped",
+           "HighWater",
+           "OutOfOrder",
+           "Lost",
+           "Fewest",
+           "Most",
+           "Fairness");
+
+    for (ULONG producers : RingProducerCounts) {
+        RingRun(producers);
+    }
+
+    return 0;
+}
+
+//
+// XorShiftRandom
+//
+// xorshift64: fast, and the same sequence every run
+//
+static
+ULONGLONG
+XorShiftRandom(ULONGLONG* State)
+{
+    *State ^= *State << 13;
+    *State ^= *State >> 7;
+    *State ^= *State << 17;
+
+    return *State;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  MatchCheck
+//
+//    Runs MATCH_CHECKS random searches with each kernel up to BestKernel,
+//    and counts the ones where a kernel's answer differs from the scalar
+//    kernel's
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+ULONG
+MatchCheck(GENFILTER_MATCH_KERNEL BestKernel)
+{
+    GENFILTER_MATCH match;
+    UCHAR           buffer[MATCH_CHECK_SIZE];
+    ULONGLONG       random     = 0x2545F4914F6CDD1DULL;
+    ULONG           mismatches = 0;
+
+    for (ULONG check = 0; check < MATCH_CHECKS; check++) {
+
+        size_t length = (size_t)(XorShiftRandom(&random) % (MATCH_CHECK_SIZE + 1));
+        ULONG  count  = 1 + (ULONG)(XorShiftRandom(&random) % 3);
+        size_t expected;
+        ULONG  expectedPattern = 0;
+
+        for (size_t index = 0; index < length; index++) {
+            buffer[index] = (UCHAR)('a' + XorShiftRandom(&random) % 4);
+        }
+
+        GenFilterMatchInitialize(&match);
+
+        for (ULONG pattern = 0; pattern < count; pattern++) {
+
+            UCHAR bytes[GENFILTER_MATCH_MAX_LENGTH];
+            ULONG patternLength = 1 + (ULONG)(XorShiftRandom(&random) % 8);
+
+            for (ULONG index = 0; index < patternLength; index++) {
+                bytes[index] = (UCHAR)('a' + XorShiftRandom(&random) % 4);
+            }
+
+            GenFilterMatchAddPattern(&match,
+                                     bytes,
+                                     patternLength);
+        }
+
+        expected = GenFilterMatchFind(&match,
+                                      GenFilterMatchScalar,
+                                      buffer,
+                                      length,
+                                      &expectedPattern);
+
+        for (int kernel = GenFilterMatchScalar + 1; kernel <= BestKernel; kernel++) {
+
+            ULONG  foundPattern = 0;
+            size_t found;
+
+            found = GenFilterMatchFind(&match,
+                                       (GENFILTER_MATCH_KERNEL)kernel,
+                                       buffer,
+                                       length,
+                                       &foundPattern);
+
+            if (found != expected ||
+                (found != GENFILTER_MATCH_NONE && foundPattern != expectedPattern)) {
+                mismatches++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  MatchTime
+//
+//    Scans Buffer with Kernel until MATCH_BYTES have been scanned, and
+//    returns the throughput in GB/s
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+MatchTime(PCGENFILTER_MATCH      Match,
+          GENFILTER_MATCH_KERNEL Kernel,
+          const UCHAR*           Buffer,
+          ULONG                  Length)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    ULONGLONG     passes = MATCH_BYTES / Length;
+    size_t        found  = 0;
+    double        seconds;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    for (ULONGLONG pass = 0; pass < passes; pass++) {
+        found += GenFilterMatchFind(Match,
+                                    Kernel,
+                                    Buffer,
+                                    Length,
+                                    nullptr);
+    }
+
+    QueryPerformanceCounter(&end);
+
+    //
+    // Nothing should match.  Using the result also keeps the compiler from
+    // deciding the loop does nothing.
+    //
+    if (found != passes * GENFILTER_MATCH_NONE) {
+        printf("(unexpected match) ");
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    return (double)(passes * Length) / seconds / 1000000000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoMatch
+//
+//    Checks the signature matching kernels the driver uses against each
+//    other, and benchmarks them.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoMatch(int      Argc,
+        wchar_t* Argv[])
+{
+    GENFILTER_MATCH_KERNEL best;
+    GENFILTER_MATCH        match;
+    std::vector<UCHAR>     buffer(MatchBufferSizes[ARRAYSIZE(MatchBufferSizes) - 1]);
+    ULONGLONG              random = 0x9E3779B97F4A7C15ULL;
+    ULONG                  mismatches;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    best = GenFilterMatchBestKernel();
+
+    printf("Best kernel on this processor: %s\n",
+           MatchKernelNames[best]);
+
+    mismatches = MatchCheck(best);
+
+    printf("Kernels checked against the scalar kernel: %lu mismatch(es) in %lu searches\n\n",
+           mismatches,
+           MATCH_CHECKS);
+
+    if (mismatches != 0) {
+        return 1;
+    }
+
+    for (auto& byte : buffer) {
+        byte = (UCHAR)XorShiftRandom(&random);
+    }
+
+    printf("%10s %9s",
+           "Buffer",
+           "Patterns");
+
+    for (int kernel = GenFilterMatchScalar; kernel <= best; kernel++) {
+        printf(" %9s",
+               MatchKernelNames[kernel]);
+    }
+
+    printf("   (GB/s, %lu byte signatures)\n",
+           MATCH_PATTERN_LENGTH);
+
+    for (ULONG size : MatchBufferSizes) {
+
+        for (ULONG count : MatchPatternCounts) {
+
+            GenFilterMatchInitialize(&match);
+
+            //
+            // The signatures are random too, so they don't occur in the
+            // buffer, but their first and last bytes occasionally line up
+            // just as they would in real data
+            //
+            for (ULONG pattern = 0; pattern < count; pattern++) {
+
+                UCHAR bytes[MATCH_PATTERN_LENGTH];
+
+                for (auto& byte : bytes) {
+                    byte = (UCHAR)XorShiftRandom(&random);
+                }
+
+                GenFilterMatchAddPattern(&match,
+                                         bytes,
+                                         MATCH_PATTERN_LENGTH);
+            }
+
+            printf("%10lu %9lu",
+                   size,
+                   count);
+
+            for (int kernel = GenFilterMatchScalar; kernel <= best; kernel++) {
+                printf(" %9.2f",
+                       MatchTime(&match,
+                                 (GENFILTER_MATCH_KERNEL)kernel,
+                                 buffer.data(),
+                                 size));
+            }
+
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CrcCheck
+//
+//    Checks each kernel up to BestKernel against the CRC32C check value
+//    and against the table kernel, and counts the disagreements
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+ULONG
+CrcCheck(GENFILTER_CRC_KERNEL BestKernel)
+{
+    static const char check[] = "123456789";
+    UCHAR             buffer[CRC_CHECK_SIZE + 8];
+    ULONGLONG         random     = 0x2545F4914F6CDD1DULL;
+    ULONG             mismatches = 0;
+
+    for (int kernel = GenFilterCrcTable; kernel <= BestKernel; kernel++) {
+
+        if (GenFilterCrc32c((GENFILTER_CRC_KERNEL)kernel,
+                            (const UCHAR*)check,
+                            sizeof(check) - 1) != CRC_CHECK_VALUE) {
+            mismatches++;
+        }
+    }
+
+    for (ULONG trial = 0; trial < CRC_CHECKS; trial++) {
+
+        size_t start  = (size_t)(XorShiftRandom(&random) % 8);
+        size_t length = (size_t)(XorShiftRandom(&random) % (CRC_CHECK_SIZE + 1));
+        ULONG  expected;
+
+        for (auto& byte : buffer) {
+            byte = (UCHAR)XorShiftRandom(&random);
+        }
+
+        expected = GenFilterCrc32c(GenFilterCrcTable,
+                                   &buffer[start],
+                                   length);
+
+        for (int kernel = GenFilterCrcTable + 1; kernel <= BestKernel; kernel++) {
+
+            if (GenFilterCrc32c((GENFILTER_CRC_KERNEL)kernel,
+                                &buffer[start],
+                                length) != expected) {
+                mismatches++;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  CrcTime
+//
+//    Checksums Buffer with Kernel until CRC_BYTES have been checksummed,
+//    and returns the throughput in GB/s
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+CrcTime(GENFILTER_CRC_KERNEL Kernel,
+        const UCHAR*         Buffer,
+        ULONG                Length)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    ULONGLONG     passes = CRC_BYTES / Length;
+    ULONG         crcs   = 0;
+    double        seconds;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    for (ULONGLONG pass = 0; pass < passes; pass++) {
+        crcs ^= GenFilterCrc32c(Kernel,
+                                Buffer,
+                                Length);
+    }
+
+    QueryPerformanceCounter(&end);
+
+    //
+    // Keep the compiler from deciding the loop does nothing
+    //
+    if (crcs == 0x12345678) {
+        printf("(that's unlikely) ");
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    return (double)(passes * Length) / seconds / 1000000000.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoCrc
+//
+//    Checks the CRC32C kernels the driver's integrity checking uses, and
+//    benchmarks them.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoCrc(int      Argc,
+      wchar_t* Argv[])
+{
+    GENFILTER_CRC_KERNEL best;
+    std::vector<UCHAR>   buffer(CrcBufferSizes[ARRAYSIZE(CrcBufferSizes) - 1]);
+    ULONGLONG            random = 0x9E3779B97F4A7C15ULL;
+    ULONG                mismatches;
+    double               sectorRate = 0.0;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    best = GenFilterCrcBestKernel();
+
+    printf("Best kernel on this processor: %s\n",
+           CrcKernelNames[best]);
+
+    mismatches = CrcCheck(best);
+
+    printf("Kernels checked against each other: %lu mismatch(es) in %lu checksums\n\n",
+           mismatches,
+           CRC_CHECKS);
+
+    if (mismatches != 0) {
+        return 1;
+    }
+
+    for (auto& byte : buffer) {
+        byte = (UCHAR)XorShiftRandom(&random);
+    }
+
+    printf("%10s",
+           "Buffer");
+
+    for (int kernel = GenFilterCrcTable; kernel <= best; kernel++) {
+        printf(" %9s",
+               CrcKernelNames[kernel]);
+    }
+
+    printf("   (GB/s)\n");
+
+    for (ULONG size : CrcBufferSizes) {
+
+        printf("%10lu",
+               size);
+
+        for (int kernel = GenFilterCrcTable; kernel <= best; kernel++) {
+
+            double rate = CrcTime((GENFILTER_CRC_KERNEL)kernel,
+                                  buffer.data(),
+                                  size);
+
+            if (size == CRC_SECTOR_SIZE && kernel == best) {
+                sectorRate = rate;
+            }
+
+            printf(" %9.2f",
+                   rate);
+        }
+
+        printf("\n");
+    }
+
+    //
+    // What the driver actually does is one sector at a time
+    //
+    printf("\nOne %lu byte sector takes %.0f ns with the %s kernel, which at full read speed is\n",
+           CRC_SECTOR_SIZE,
+           CRC_SECTOR_SIZE / sectorRate,
+           CrcKernelNames[best]);
+
+    for (const auto& drive : CrcDriveSpeeds) {
+        printf("    %-12s %.3f%% of one processor\n",
+               drive.Name,
+               100.0 * drive.BytesPerSecond / (sectorRate * 1000000000.0));
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoCapture
+//
+//    Drains the filter's I/O capture and appends it, exactly as returned by
+//    the driver, to a file for later replay.  Run it often enough that the
+//    capture rings don't wrap, or records are lost.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoCapture(int      Argc,
+          wchar_t* Argv[])
+{
+    HANDLE            device;
+    HANDLE            file = INVALID_HANDLE_VALUE;
+    std::vector<BYTE> buffer(DRAIN_BUFFER_SIZE);
+    DWORD             bytesReturned;
+    DWORD             bytesWritten;
+    ULONGLONG         totalRecords = 0;
+    ULONGLONG         totalLost    = 0;
+    int               result       = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    file = CreateFileW(Argv[1],
+                       FILE_APPEND_DATA,
+                       0,
+                       nullptr,
+                       OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %ls failed - %lu\n",
+               Argv[1],
+               GetLastError());
+        goto done;
+    }
+
+    for (;;) {
+
+        auto* header = (PGENFILTER_CAPTURE_HEADER)buffer.data();
+
+        if (!DeviceIoControl(device,
+                             IOCTL_GENFILTER_DRAIN_CAPTURE,
+                             nullptr,
+                             0,
+                             buffer.data(),
+                             (DWORD)buffer.size(),
+                             &bytesReturned,
+                             nullptr)) {
+
+            printf("IOCTL_GENFILTER_DRAIN_CAPTURE failed - %lu\n",
+                   GetLastError());
+            goto done;
+        }
+
+        if (header->Enabled == 0) {
+            printf("Capture is off (set the \"Capture\" value in the device's hardware key to 1)\n");
+            goto done;
+        }
+
+        totalLost += header->LostRecords;
+
+        if (header->RecordCount == 0) {
+            break;
+        }
+
+        totalRecords += header->RecordCount;
+
+        if (!WriteFile(file,
+                       buffer.data(),
+                       bytesReturned,
+                       &bytesWritten,
+                       nullptr)) {
+
+            printf("WriteFile failed - %lu\n",
+                   GetLastError());
+            goto done;
+        }
+    }
+
+    printf("%llu record(s) drained to %ls, %llu lost\n",
+           totalRecords,
+           Argv[1],
+           totalLost);
+
+    result = 0;
+
+done:
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ReplayLoad
+//
+//    Reads a file written by DoCapture: a sequence of drained buffers, each
+//    a GENFILTER_CAPTURE_HEADER followed by its records.  The records from
+//    every buffer are merged and put in the order the filter was given
+//    them.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+bool
+ReplayLoad(const wchar_t*                         Path,
+           std::vector<GENFILTER_CAPTURE_RECORD>& Records,
+           ULONGLONG*                             Frequency,
+           ULONGLONG*                             Lost)
+{
+    HANDLE            file;
+    LARGE_INTEGER     fileSize;
+    std::vector<BYTE> contents;
+    DWORD             bytesRead;
+    size_t            offset = 0;
+    bool              loaded = false;
+
+    *Frequency = 0;
+    *Lost      = 0;
+
+    file = CreateFileW(Path,
+                       GENERIC_READ,
+                       FILE_SHARE_READ,
+                       nullptr,
+                       OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        printf("CreateFile of %ls failed - %lu\n",
+               Path,
+               GetLastError());
+        goto done;
+    }
+
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.HighPart != 0) {
+        printf("%ls is too large to replay\n",
+               Path);
+        goto done;
+    }
+
+    contents.resize(fileSize.LowPart);
+
+    if (!ReadFile(file,
+                  contents.data(),
+                  fileSize.LowPart,
+                  &bytesRead,
+                  nullptr) || bytesRead != fileSize.LowPart) {
+
+        printf("ReadFile failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    while (offset + sizeof(GENFILTER_CAPTURE_HEADER) <= contents.size()) {
+
+        auto*  header = (PGENFILTER_CAPTURE_HEADER)&contents[offset];
+        size_t chunkLength;
+
+        chunkLength = header->Size +
+                      ((size_t)header->RecordCount * header->RecordSize);
+
+        if (header->Size < sizeof(GENFILTER_CAPTURE_HEADER) ||
+            header->RecordSize < sizeof(GENFILTER_CAPTURE_RECORD) ||
+            offset + chunkLength > contents.size()) {
+
+            printf("Malformed capture data at offset %zu\n",
+                   offset);
+            goto done;
+        }
+
+        *Frequency = header->Frequency;
+        *Lost     += header->LostRecords;
+
+        for (ULONG index = 0; index < header->RecordCount; index++) {
+
+            Records.push_back(*(PGENFILTER_CAPTURE_RECORD)&contents[offset +
+                                                                    header->Size +
+                                                                    ((size_t)index * header->RecordSize)]);
+        }
+
+        offset += chunkLength;
+    }
+
+    std::stable_sort(Records.begin(),
+                     Records.end(),
+                     [](const GENFILTER_CAPTURE_RECORD& Left,
+                        const GENFILTER_CAPTURE_RECORD& Right) {
+                         return Left.IssueTime < Right.IssueTime;
+                     });
+
+    loaded = true;
+
+done:
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    return loaded;
+}
+
+//
+// ReplayPrintLatencies
+//
+// Sorts Latencies (in microseconds) and prints their mean, 99th percentile
+// and maximum in milliseconds
+//
+static
+void
+ReplayPrintLatencies(std::vector<double>& Latencies)
+{
+    double total = 0.0;
+
+    if (Latencies.empty()) {
+        printf(" %9s %9s %9s",
+               "-",
+               "-",
+               "-");
+        return;
+    }
+
+    std::sort(Latencies.begin(),
+              Latencies.end());
+
+    for (double latency : Latencies) {
+        total += latency;
+    }
+
+    printf(" %9.2f %9.2f %9.2f",
+           total / Latencies.size() / 1000.0,
+           Latencies[(Latencies.size() * 99) / 100] / 1000.0,
+           Latencies.back() / 1000.0);
+}
+
+//
+// One Request being replayed.  Its scheduler entry is the same index in a
+// separate array, as in DoSched.
+//
+typedef struct _REPLAY_OP {
+    const GENFILTER_CAPTURE_RECORD* Record;
+    double                          Arrival;        // Microseconds
+    double                          Completion;
+    std::vector<struct _REPLAY_OP*> Followers;      // Coalesced behind us
+} REPLAY_OP, *PREPLAY_OP;
+
+typedef std::tuple<ULONG, ULONG, ULONG> REPLAY_QUERY_KEY;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ReplayRun
+//
+//    Replays captured Requests through a simulated filter (read cache,
+//    coalescing, and query cache, all as the driver does them by default)
+//    and drive, with Policy scheduling the held reads and writes, and
+//    prints what happened.  Requests arrive Speed times faster than they
+//    were recorded.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+ReplayRun(const std::vector<GENFILTER_CAPTURE_RECORD>& Records,
+          ULONGLONG                                    Frequency,
+          double                                       Speed,
+          GENFILTER_SCHED_POLICY                       Policy)
+{
+    GENFILTER_SCHED                                       sched;
+    std::vector<PGENFILTER_SCHED_ENTRY>                   storage(2 * Records.size());
+    std::vector<GENFILTER_SCHED_ENTRY>                    entries(Records.size());
+    std::vector<REPLAY_OP>                                ops(Records.size());
+    std::vector<double>                                   latencies;
+    std::list<ULONGLONG>                                  lru;
+    std::unordered_map<ULONGLONG, std::list<ULONGLONG>::iterator> cached;
+    std::map<REPLAY_QUERY_KEY, double>                    queryResults;
+    std::map<REPLAY_QUERY_KEY, PREPLAY_OP>                leaders;
+    std::list<PREPLAY_OP>                                 heldControls;
+    PREPLAY_OP                                            current   = nullptr;
+    ULONGLONG                                             position  = 0;
+    ULONGLONG                                             deviceOps = 0;
+    ULONGLONG                                             cacheHits = 0;
+    ULONGLONG                                             coalesced = 0;
+    ULONGLONG                                             queryHits = 0;
+    double                                                busy      = 0.0;
+    double                                                now       = 0.0;
+    size_t                                                next      = 0;
+
+    auto isCacheable = [](const GENFILTER_CAPTURE_RECORD* Record) -> bool {
+        return Record->Length != 0 &&
+               Record->Length <= REPLAY_CACHE_MAX_READ &&
+               (Record->Offset % REPLAY_SECTOR_SIZE) == 0 &&
+               (Record->Length % REPLAY_SECTOR_SIZE) == 0;
+    };
+
+    auto queryKey = [](const GENFILTER_CAPTURE_RECORD* Record) -> REPLAY_QUERY_KEY {
+        return REPLAY_QUERY_KEY(Record->IoControlCode,
+                                Record->InputLength,
+                                Record->Length);
+    };
+
+    auto finish = [&](PREPLAY_OP Op) {
+        Op->Completion = now;
+        latencies.push_back(now - Op->Arrival);
+    };
+
+    //
+    // Start the next held Request on the drive: device controls first,
+    // then whatever the scheduler picks
+    //
+    auto startNext = [&]() {
+
+        PREPLAY_OP op;
+        double     service;
+
+        if (!heldControls.empty()) {
+
+            op = heldControls.front();
+            heldControls.pop_front();
+
+            service = REPLAY_IOCTL_US;
+
+        } else if (sched.Count != 0) {
+
+            op = &ops[GenFilterSchedPop(&sched,
+                                        (ULONGLONG)now) - entries.data()];
+
+            service  = SchedServiceTime(position,
+                                        op->Record->Offset,
+                                        op->Record->Length);
+            position = op->Record->Offset + op->Record->Length;
+
+        } else {
+            return;
+        }
+
+        deviceOps++;
+        busy          += service;
+        op->Completion = now + service;
+        current        = op;
+    };
+
+    auto arrive = [&](PREPLAY_OP Op) {
+
+        const GENFILTER_CAPTURE_RECORD* record = Op->Record;
+
+        if (record->Type == GenFilterCaptureDeviceControl) {
+
+            REPLAY_QUERY_KEY key = queryKey(record);
+
+            if ((record->Flags & GENFILTER_CAPTURE_FLAG_INVALIDATE_CACHE) != 0) {
+                lru.clear();
+                cached.clear();
+                queryResults.clear();
+            }
+
+            if ((record->Flags & GENFILTER_CAPTURE_FLAG_CACHE_RESULT) != 0) {
+
+                auto result = queryResults.find(key);
+
+                if (result != queryResults.end() && result->second > now) {
+                    queryHits++;
+                    finish(Op);
+                    return;
+                }
+            }
+
+            if ((record->Flags & GENFILTER_CAPTURE_FLAG_COALESCE) != 0) {
+
+                auto leader = leaders.find(key);
+
+                if (leader != leaders.end()) {
+                    coalesced++;
+                    leader->second->Followers.push_back(Op);
+                    return;
+                }
+
+                leaders[key] = Op;
+            }
+
+            heldControls.push_back(Op);
+            return;
+        }
+
+        if (record->Type == GenFilterCaptureRead && isCacheable(record)) {
+
+            bool hit = true;
+
+            for (ULONG index = 0; index < record->Length / REPLAY_SECTOR_SIZE && hit; index++) {
+                hit = (cached.count(record->Offset / REPLAY_SECTOR_SIZE + index) != 0);
+            }
+
+            if (hit) {
+                cacheHits++;
+                finish(Op);
+                return;
+            }
+        }
+
+        if (record->Type == GenFilterCaptureWrite && record->Length != 0) {
+
+            ULONGLONG first = record->Offset / REPLAY_SECTOR_SIZE;
+            ULONGLONG last  = (record->Offset + record->Length - 1) / REPLAY_SECTOR_SIZE;
+
+            for (ULONGLONG sector = first; sector <= last; sector++) {
+
+                auto entry = cached.find(sector);
+
+                if (entry != cached.end()) {
+                    lru.erase(entry->second);
+                    cached.erase(entry);
+                }
+            }
+        }
+
+        GenFilterSchedInsert(&sched,
+                             &entries[Op - ops.data()],
+                             Op->Record->Offset,
+                             (ULONGLONG)now + SCHED_DEADLINE_US);
+    };
+
+    auto complete = [&](PREPLAY_OP Op) {
+
+        const GENFILTER_CAPTURE_RECORD* record = Op->Record;
+
+        finish(Op);
+
+        if (record->Status < 0) {
+            // Nothing is cached from a failed NTSTATUS
+        } else if (record->Type == GenFilterCaptureRead && isCacheable(record)) {
+
+            for (ULONG index = 0; index < record->Length / REPLAY_SECTOR_SIZE; index++) {
+
+                ULONGLONG sector = record->Offset / REPLAY_SECTOR_SIZE + index;
+                auto      entry  = cached.find(sector);
+
+                if (entry != cached.end()) {
+                    lru.erase(entry->second);
+                }
+
+                lru.push_front(sector);
+                cached[sector] = lru.begin();
+
+                if (cached.size() > REPLAY_CACHE_SECTORS) {
+                    cached.erase(lru.back());
+                    lru.pop_back();
+                }
+            }
+
+        } else if (record->Type == GenFilterCaptureDeviceControl &&
+                   (record->Flags & GENFILTER_CAPTURE_FLAG_CACHE_RESULT) != 0) {
+
+            queryResults[queryKey(record)] = now + REPLAY_QUERY_TTL_US;
+        }
+
+        if (record->Type == GenFilterCaptureDeviceControl &&
+            (record->Flags & GENFILTER_CAPTURE_FLAG_COALESCE) != 0) {
+
+            leaders.erase(queryKey(record));
+
+            for (PREPLAY_OP follower : Op->Followers) {
+                finish(follower);
+            }
+        }
+    };
+
+    GenFilterSchedInitialize(&sched,
+                             Policy,
+                             storage.data(),
+                             (ULONG)Records.size());
+
+    for (size_t index = 0; index < Records.size(); index++) {
+
+        ops[index].Record  = &Records[index];
+        ops[index].Arrival = (double)(Records[index].IssueTime - Records.front().IssueTime) *
+                             1000000.0 / (double)Frequency / Speed;
+    }
+
+    latencies.reserve(Records.size());
+
+    //
+    // The next thing to happen is either the drive finishing what it's
+    // doing or the next Request arriving
+    //
+    while (next < ops.size() || current != nullptr) {
+
+        if (current != nullptr &&
+            (next == ops.size() || current->Completion <= ops[next].Arrival)) {
+
+            PREPLAY_OP done = current;
+
+            now     = done->Completion;
+            current = nullptr;
+
+            complete(done);
+            startNext();
+            continue;
+        }
+
+        now = ops[next].Arrival;
+
+        arrive(&ops[next++]);
+
+        if (current == nullptr) {
+            startNext();
+        }
+    }
+
+    printf("%-10s %9llu %9llu %9llu %9llu",
+           SchedPolicyNames[Policy],
+           deviceOps,
+           cacheHits,
+           coalesced,
+           queryHits);
+
+    ReplayPrintLatencies(latencies);
+
+    printf(" %7.1f\n",
+           (now > 0.0) ? 100.0 * busy / now : 0.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoReplay
+//
+//    Replays a file written by DoCapture through a simulated filter and
+//    drive, once for each scheduler policy, next to what was recorded.  A
+//    speed of 1 replays the Requests at the rate they were captured; 10
+//    has them arrive ten times as fast.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoReplay(int      Argc,
+         wchar_t* Argv[])
+{
+    std::vector<GENFILTER_CAPTURE_RECORD> records;
+    std::vector<double>                   recorded;
+    ULONGLONG                             frequency;
+    ULONGLONG                             lost;
+    ULONGLONG                             counts[GenFilterCaptureDeviceControl + 1] = {};
+    double                                speed;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    speed = wcstod(Argv[1],
+                   nullptr);
+
+    if (speed <= 0.0) {
+        printf("The speed must be greater than zero\n");
+        return 1;
+    }
+
+    if (!ReplayLoad(Argv[0],
+                    records,
+                    &frequency,
+                    &lost)) {
+        return 1;
+    }
+
+    if (records.empty() || frequency == 0) {
+        printf("%ls has no records to replay\n",
+               Argv[0]);
+        return 1;
+    }
+
+    for (const auto& record : records) {
+
+        if (record.Type <= GenFilterCaptureDeviceControl) {
+            counts[record.Type]++;
+        }
+
+        recorded.push_back((double)(record.CompletionTime - record.IssueTime) *
+                           1000000.0 / (double)frequency);
+    }
+
+    printf("%zu Request(s) (%llu reads, %llu writes, %llu device controls) over %.1f seconds, %llu lost\n",
+           records.size(),
+           counts[GenFilterCaptureRead],
+           counts[GenFilterCaptureWrite],
+           counts[GenFilterCaptureDeviceControl],
+           (double)(records.back().IssueTime - records.front().IssueTime) / (double)frequency,
+           lost);
+
+    printf("Replaying at %.1fx\n\n",
+           speed);
+
+    printf("%-10s %9s %9s %9s %9s %9s %9s %9s %7s\n",
+           "Policy",
+           "Device",
+           "Cached",
+           "Coalesced",
+           "Query",
+           "Mean ms",
+           "p99 ms",
+           "Max ms",
+           "Busy %");
+
+    printf("%-10s %9s %9s %9s %9s",
+           "Recorded",
+           "-",
+           "-",
+           "-",
+           "-");
+
+    ReplayPrintLatencies(recorded);
+
+    printf(" %7s\n",
+           "-");
+
+    for (ULONG policy = 0; policy < GenFilterSchedPolicyCount; policy++) {
+
+        ReplayRun(records,
+                  frequency,
+                  speed,
+                  (GENFILTER_SCHED_POLICY)policy);
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ParseSignatures
+//
+//    Parses a comma separated list of hex signatures (for example
+//    "4D5A9000,7F454C46") into a configuration.  Returns false, having said
+//    why, if the list isn't valid.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+bool
+ParseSignatures(PCWSTR                   Text,
+                PGENFILTER_CONFIGURATION Configuration)
+{
+    PGENFILTER_CONFIG_SIGNATURE signature = nullptr;
+    ULONG                       digits    = 0;
+
+    for (PCWSTR character = Text; ; character++) {
+
+        ULONG nibble;
+
+        if (*character == L',' || *character == L'\0') {
+
+            if (signature == nullptr || digits != 0) {
+                printf("Signatures must be whole bytes of hex, separated by commas\n");
+                return false;
+            }
+
+            signature = nullptr;
+
+            if (*character == L'\0') {
+                break;
+            }
+
+            continue;
+        }
+
+        if (*character >= L'0' && *character <= L'9') {
+            nibble = *character - L'0';
+        } else if (*character >= L'a' && *character <= L'f') {
+            nibble = *character - L'a' + 10;
+        } else if (*character >= L'A' && *character <= L'F') {
+            nibble = *character - L'A' + 10;
+        } else {
+            printf("'%lc' isn't a hex digit\n",
+                   *character);
+            return false;
+        }
+
+        if (signature == nullptr) {
+
+            if (Configuration->SignatureCount == GENFILTER_CONFIG_MAX_SIGNATURES) {
+                printf("At most %u signatures are allowed\n",
+                       GENFILTER_CONFIG_MAX_SIGNATURES);
+                return false;
+            }
+
+            signature = &Configuration->Signatures[Configuration->SignatureCount++];
+        }
+
+        if (digits == 0) {
+
+            if (signature->Length == GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH) {
+                printf("Signatures can be at most %u bytes long\n",
+                       GENFILTER_CONFIG_MAX_SIGNATURE_LENGTH);
+                return false;
+            }
+
+            signature->Bytes[signature->Length] = 0;
+        }
+
+        signature->Bytes[signature->Length] =
+            (UCHAR)((signature->Bytes[signature->Length] << 4) | nibble);
+
+        if (++digits == 2) {
+            signature->Length++;
+            digits = 0;
+        }
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoInspect
+//
+//    Replaces the filter's inspection action and signatures, without
+//    restarting the device.  A signature list of "-" means none.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoInspect(int      Argc,
+          wchar_t* Argv[])
+{
+    HANDLE                  device        = INVALID_HANDLE_VALUE;
+    GENFILTER_CONFIGURATION configuration = {};
+    ULONG                   generation;
+    ULONG                   action;
+    DWORD                   bytesReturned;
+    int                     result        = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    if (_wcsicmp(Argv[1], L"off") == 0) {
+        action = GenFilterInspectOff;
+    } else if (_wcsicmp(Argv[1], L"flag") == 0) {
+        action = GenFilterInspectFlag;
+    } else if (_wcsicmp(Argv[1], L"block") == 0) {
+        action = GenFilterInspectBlock;
+    } else {
+        printf("Specify off, flag or block\n");
+        goto done;
+    }
+
+    configuration.Size          = sizeof(configuration);
+    configuration.Fields        = GENFILTER_CONFIG_FIELD_INSPECT;
+    configuration.InspectAction = action;
+
+    if (wcscmp(Argv[2], L"-") != 0 &&
+        !ParseSignatures(Argv[2],
+                         &configuration)) {
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_SET_CONFIG,
+                         &configuration,
+                         sizeof(configuration),
+                         &generation,
+                         sizeof(generation),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_SET_CONFIG failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    printf("Configuration %lu: inspection %s, %lu signature(s)\n",
+           generation,
+           configuration.SignatureCount != 0 ? InspectActionNames[action] : "off",
+           configuration.SignatureCount);
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RcuReaderThread
+//
+//    Reads the current snapshot, all of it, until told to stop, and counts
+//    the snapshots that weren't what was published
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+RcuReaderThread(LPVOID Context)
+{
+    auto* reader = (PRCU_READER)Context;
+    auto* stress = reader->Stress;
+
+    WaitForSingleObject(stress->Start,
+                        INFINITE);
+
+    while (stress->Stop == 0) {
+
+        PRCU_SNAPSHOT snapshot;
+        ULONG         phase;
+        ULONG         generation;
+        bool          whole;
+
+        snapshot = (PRCU_SNAPSHOT)GenFilterRcuReadLock(&stress->Rcu,
+                                                       reader->Cpu,
+                                                       &phase);
+
+        generation = *(volatile ULONG*)&snapshot->Generation;
+        whole      = *(volatile ULONG*)&snapshot->Check == ~generation;
+
+        for (ULONG word = 0; word < RCU_WORDS; word++) {
+
+            if (*(volatile ULONG*)&snapshot->Words[word] != generation + word) {
+                whole = false;
+            }
+        }
+
+        GenFilterRcuReadUnlock(&stress->Rcu,
+                               reader->Cpu,
+                               phase);
+
+        reader->Reads++;
+
+        if (!whole) {
+            reader->Errors++;
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RcuWriterThread
+//
+//    Publishes new snapshots until told to stop.  Each one it replaces is
+//    reclaimed, poisoned, and used again.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+RcuWriterThread(LPVOID Context)
+{
+    auto* writer  = (PRCU_WRITER)Context;
+    auto* stress  = writer->Stress;
+    ULONG current = 0;
+
+    WaitForSingleObject(stress->Start,
+                        INFINITE);
+
+    while (stress->Stop == 0) {
+
+        ULONG         next       = (current + 1) % RCU_SNAPSHOTS;
+        PRCU_SNAPSHOT snapshot   = &stress->Snapshots[next];
+        ULONG         generation = stress->Snapshots[current].Generation + 1;
+        PRCU_SNAPSHOT old;
+
+        snapshot->Generation = generation;
+        snapshot->Check      = ~generation;
+
+        for (ULONG word = 0; word < RCU_WORDS; word++) {
+            snapshot->Words[word] = generation + word;
+        }
+
+        old = (PRCU_SNAPSHOT)GenFilterRcuPublish(&stress->Rcu,
+                                                 snapshot);
+
+        //
+        // As the driver's work item does, but without sleeping: we want to
+        // reclaim as often as we can
+        //
+        GenFilterRcuSynchronize(&stress->Rcu,
+                                []() {
+                                    SwitchToThread();
+                                });
+
+        FillMemory(old,
+                   sizeof(RCU_SNAPSHOT),
+                   0xDD);
+
+        current = next;
+
+        writer->Updates++;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RcuRun
+//
+//    Runs the stress test with ReaderCount readers, with or without a
+//    writer, prints what happened, and returns the readers' total reads
+//    per second
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+double
+RcuRun(ULONG ReaderCount,
+       bool  Writer)
+{
+    RCU_STRESS                     stress;
+    std::vector<GENFILTER_RCU_CPU> cpus(ReaderCount);
+    std::vector<RCU_READER>        readers(ReaderCount);
+    RCU_WRITER                     writer;
+    std::vector<HANDLE>            threads;
+    LARGE_INTEGER                  frequency;
+    LARGE_INTEGER                  begin;
+    LARGE_INTEGER                  end;
+    ULONGLONG                      reads  = 0;
+    ULONGLONG                      errors = 0;
+    double                         seconds;
+
+    FillMemory(stress.Snapshots,
+               sizeof(stress.Snapshots),
+               0xDD);
+
+    stress.Snapshots[0].Generation = 1;
+    stress.Snapshots[0].Check      = ~1UL;
+
+    for (ULONG word = 0; word < RCU_WORDS; word++) {
+        stress.Snapshots[0].Words[word] = 1 + word;
+    }
+
+    GenFilterRcuInitialize(&stress.Rcu,
+                           &stress.Snapshots[0],
+                           cpus.data(),
+                           ReaderCount);
+
+    stress.Start = CreateEventW(nullptr,
+                                TRUE,
+                                FALSE,
+                                nullptr);
+    stress.Stop  = 0;
+
+    for (ULONG reader = 0; reader < ReaderCount; reader++) {
+
+        readers[reader].Stress = &stress;
+        readers[reader].Cpu    = reader;
+        readers[reader].Reads  = 0;
+        readers[reader].Errors = 0;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       RcuReaderThread,
+                                       &readers[reader],
+                                       0,
+                                       nullptr));
+    }
+
+    writer.Stress  = &stress;
+    writer.Updates = 0;
+
+    if (Writer) {
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       RcuWriterThread,
+                                       &writer,
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(stress.Start);
+
+    Sleep(RCU_SECONDS * 1000);
+
+    InterlockedExchange(&stress.Stop,
+                        1);
+
+    WaitForMultipleObjects((DWORD)threads.size(),
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    for (HANDLE thread : threads) {
+        CloseHandle(thread);
+    }
+
+    CloseHandle(stress.Start);
+
+    for (ULONG reader = 0; reader < ReaderCount; reader++) {
+        reads  += readers[reader].Reads;
+        errors += readers[reader].Errors;
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    printf("%8lu %-7s %12.1f %10.1f %12.0f %8llu\n",
+           ReaderCount,
+           Writer ? "yes" : "no",
+           (double)reads / seconds / 1000000.0,
+           seconds * 1000000000.0 * ReaderCount / (double)reads,
+           (double)writer.Updates / seconds,
+           errors);
+
+    return (double)reads / seconds;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoRcu
+//
+//    Stress tests the read-copy-update core the driver's configuration
+//    uses, and shows what a writer that never stops costs the readers.  No
+//    device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoRcu(int      Argc,
+      wchar_t* Argv[])
+{
+    ULONG  readerCount;
+    double quiet;
+    double busy;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    readerCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    if (readerCount > 1) {
+        readerCount--;
+    }
+
+    if (readerCount > MAXIMUM_WAIT_OBJECTS - 1) {
+        readerCount = MAXIMUM_WAIT_OBJECTS - 1;
+    }
+
+    printf("%lu byte snapshots, %lu reused, %lu second(s) per run\n\n",
+           (ULONG)sizeof(RCU_SNAPSHOT),
+           RCU_SNAPSHOTS,
+           RCU_SECONDS);
+
+    printf("%8s %-7s %12s %10s %12s %8s\n",
+           "Readers",
+           "Writer",
+           "Mreads/s",
+           "ns/read",
+           "Updates/s",
+           "Errors");
+
+    quiet = RcuRun(readerCount,
+                   false);
+    busy  = RcuRun(readerCount,
+                   true);
+
+    printf("\nWith the writer, readers ran at %.1f%% of their speed without it\n",
+           busy * 100.0 / quiet);
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  GetHeavyHitters
+//
+//    Retrieves the filter's heavy hitters
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+BOOL
+GetHeavyHitters(HANDLE                   Device,
+                PGENFILTER_HEAVY_HITTERS HeavyHitters)
+{
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_GENFILTER_GET_HEAVY_HITTERS,
+                         nullptr,
+                         0,
+                         HeavyHitters,
+                         sizeof(GENFILTER_HEAVY_HITTERS),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_GET_HEAVY_HITTERS failed - %lu\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+//
+// ResetHeavyHitters
+//
+// Starts the filter's heavy hitter counts again from zero.  Device must be
+// open for writing.
+//
+static
+BOOL
+ResetHeavyHitters(HANDLE Device)
+{
+    DWORD bytesReturned;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_GENFILTER_RESET_HEAVY_HITTERS,
+                         nullptr,
+                         0,
+                         nullptr,
+                         0,
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_RESET_HEAVY_HITTERS failed - %lu\n",
+               GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoTop
+//
+//    Shows who has sent the device the most I/O over the next <seconds>
+//    seconds, or since the counts were last started again if <seconds> is
+//    0
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoTop(int      Argc,
+      wchar_t* Argv[])
+{
+    HANDLE                  device = INVALID_HANDLE_VALUE;
+    GENFILTER_HEAVY_HITTERS heavyHitters;
+    ULONG                   seconds;
+    int                     result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    seconds = wcstoul(Argv[1],
+                      nullptr,
+                      10);
+
+    //
+    // Starting the counts again takes write access; just looking doesn't
+    //
+    device = OpenFilteredDevice(Argv[0],
+                                seconds != 0 ? GENERIC_READ | GENERIC_WRITE :
+                                               GENERIC_READ,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (seconds != 0) {
+
+        if (!ResetHeavyHitters(device)) {
+            goto done;
+        }
+
+        Sleep(seconds * 1000);
+    }
+
+    if (!GetHeavyHitters(device,
+                         &heavyHitters)) {
+        goto done;
+    }
+
+    if (heavyHitters.Mode == GenFilterAttributionOff ||
+        heavyHitters.Mode >= GenFilterAttributionModeCount) {
+        printf("Attribution is off (set \"Attribution\" in the device's hardware key)\n");
+        goto done;
+    }
+
+    printf("By %s, %lu processor slot(s): %llu Requests, %.1f MB\n\n",
+           AttributionModeNames[heavyHitters.Mode],
+           heavyHitters.ProcessorCount,
+           heavyHitters.TotalRequests,
+           (double)heavyHitters.TotalBytes / (1024.0 * 1024.0));
+
+    printf("%18s %12s %7s %12s %7s\n",
+           heavyHitters.Mode == GenFilterAttributionProcess ? "Process" : "File object",
+           "Requests",
+           "%",
+           "MB",
+           "%");
+
+    for (ULONG index = 0; index < heavyHitters.HitterCount; index++) {
+
+        const GENFILTER_HEAVY_HITTER* hitter = &heavyHitters.Hitters[index];
+
+        if (heavyHitters.Mode == GenFilterAttributionProcess) {
+            printf("%18llu ",
+                   hitter->Requester);
+        } else {
+            printf("%#18llx ",
+                   hitter->Requester);
+        }
+
+        printf("%12llu %6.1f%% %12.1f %6.1f%%\n",
+               hitter->Requests,
+               heavyHitters.TotalRequests != 0 ?
+                   (double)hitter->Requests * 100.0 / (double)heavyHitters.TotalRequests : 0.0,
+               (double)hitter->Bytes / (1024.0 * 1024.0),
+               heavyHitters.TotalBytes != 0 ?
+                   (double)hitter->Bytes * 100.0 / (double)heavyHitters.TotalBytes : 0.0);
+    }
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SketchWorkerThread
+//
+//    Adds its share of the workload to the sketch once the Start event is
+//    set
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+SketchWorkerThread(LPVOID Context)
+{
+    auto* worker = (PSKETCH_WORKER)Context;
+
+    WaitForSingleObject(worker->Start,
+                        INFINITE);
+
+    for (ULONG index = worker->First; index < worker->Last; index++) {
+
+        GenFilterSketchAdd(worker->Sketch,
+                           worker->Cpu,
+                           worker->Requests[index].Requester,
+                           worker->Requests[index].Bytes);
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SketchRun
+//
+//    Adds the workload to a sketch on ThreadCount threads, each playing the
+//    part of one processor, and prints how fast that was and how well the
+//    sketch's heavy hitters match the Exact ones
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+SketchRun(ULONG                                      ThreadCount,
+          const std::vector<SKETCH_REQUEST>&         Requests,
+          const std::vector<GENFILTER_HEAVY_HITTER>& Exact)
+{
+    GENFILTER_SKETCH                  sketch;
+    std::vector<GENFILTER_SKETCH_CPU> cpus(ThreadCount);
+    std::vector<SKETCH_WORKER>        workers(ThreadCount);
+    std::vector<HANDLE>               threads;
+    GENFILTER_HEAVY_HITTERS           heavyHitters;
+    HANDLE                            start;
+    LARGE_INTEGER                     frequency;
+    LARGE_INTEGER                     begin;
+    LARGE_INTEGER                     end;
+    ULONG                             found    = 0;
+    double                            maxError = 0.0;
+    double                            seconds;
+
+    GenFilterSketchInitialize(&sketch,
+                              cpus.data(),
+                              ThreadCount);
+
+    start = CreateEventW(nullptr,
+                         TRUE,
+                         FALSE,
+                         nullptr);
+
+    for (ULONG thread = 0; thread < ThreadCount; thread++) {
+
+        workers[thread].Sketch   = &sketch;
+        workers[thread].Requests = Requests.data();
+        workers[thread].First    = (ULONG)((ULONGLONG)Requests.size() * thread / ThreadCount);
+        workers[thread].Last     = (ULONG)((ULONGLONG)Requests.size() * (thread + 1) / ThreadCount);
+        workers[thread].Cpu      = thread;
+        workers[thread].Start    = start;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       SketchWorkerThread,
+                                       &workers[thread],
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(start);
+
+    WaitForMultipleObjects(ThreadCount,
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    for (HANDLE thread : threads) {
+        CloseHandle(thread);
+    }
+
+    CloseHandle(start);
+
+    GenFilterSketchQuery(&sketch,
+                         &heavyHitters);
+
+    //
+    // How many of the real heavy hitters did we find, and how far off were
+    // our estimates of the ones we did?
+    //
+    for (ULONG index = 0; index < heavyHitters.HitterCount; index++) {
+
+        for (const GENFILTER_HEAVY_HITTER& exact : Exact) {
+
+            if (exact.Requester != heavyHitters.Hitters[index].Requester) {
+                continue;
+            }
+
+            found++;
+
+            maxError = std::max(maxError,
+                                (double)(heavyHitters.Hitters[index].Bytes - exact.Bytes) * 100.0 /
+                                (double)heavyHitters.TotalBytes);
+        }
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    printf("%8lu %10.1f %10.1f %7lu/%-2lu %9.3f%%\n",
+           ThreadCount,
+           (double)Requests.size() / seconds / 1000000.0,
+           seconds * 1000000000.0 * ThreadCount / (double)Requests.size(),
+           found,
+           (ULONG)Exact.size(),
+           maxError);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoSketch
+//
+//    Checks the heavy hitters the attribution sketch finds against an
+//    exact count, and measures what an update costs, on one thread and
+//    then on one thread per processor.  No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoSketch(int      Argc,
+         wchar_t* Argv[])
+{
+    std::vector<double>                                   cumulative(SKETCH_REQUESTERS);
+    std::vector<SKETCH_REQUEST>                           requests(SKETCH_REQUESTS);
+    std::unordered_map<ULONGLONG, GENFILTER_HEAVY_HITTER> counts;
+    std::vector<GENFILTER_HEAVY_HITTER>                   exact;
+    ULONGLONG                                             random = 0x9E3779B97F4A7C15ULL;
+    double                                                total  = 0.0;
+    ULONG                                                 threadCount;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    for (ULONG requester = 0; requester < SKETCH_REQUESTERS; requester++) {
+        total                += 1.0 / pow(requester + 1.0,
+                                           SKETCH_ZIPF);
+        cumulative[requester] = total;
+    }
+
+    for (SKETCH_REQUEST& request : requests) {
+
+        double point = (double)(XorShiftRandom(&random) >> 11) / 9007199254740992.0 * total;
+        ULONG  rank  = (ULONG)(std::lower_bound(cumulative.begin(),
+                                                cumulative.end(),
+                                                point) - cumulative.begin());
+
+        if (rank == SKETCH_REQUESTERS) {
+            rank--;
+        }
+
+        request.Requester = 4 * (ULONGLONG)(rank + 1);
+        request.Bytes     = (ULONG)(XorShiftRandom(&random) % SKETCH_MAX_SECTORS + 1) *
+                            GENFILTER_ATTRIBUTION_REQUEST_COST;
+
+        GENFILTER_HEAVY_HITTER& count = counts[request.Requester];
+
+        count.Requester = request.Requester;
+        count.Requests++;
+        count.Bytes += request.Bytes;
+    }
+
+    for (const auto& count : counts) {
+        exact.push_back(count.second);
+    }
+
+    std::sort(exact.begin(),
+              exact.end(),
+              [](const GENFILTER_HEAVY_HITTER& Left,
+                 const GENFILTER_HEAVY_HITTER& Right) {
+                  return GenFilterSketchHitterCost(&Left) > GenFilterSketchHitterCost(&Right);
+              });
+
+    exact.resize(std::min<size_t>(exact.size(),
+                                  GENFILTER_HEAVY_HITTERS_MAX));
+
+    threadCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    if (threadCount > MAXIMUM_WAIT_OBJECTS) {
+        threadCount = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    printf("%lu Requests from %lu requesters (%zu seen), Zipf %.1f\n",
+           SKETCH_REQUESTS,
+           SKETCH_REQUESTERS,
+           counts.size(),
+           SKETCH_ZIPF);
+    printf("%lu x %lu sketch and %lu candidates: %lu bytes per processor\n\n",
+           GENFILTER_SKETCH_DEPTH,
+           GENFILTER_SKETCH_WIDTH,
+           GENFILTER_SKETCH_CANDIDATES,
+           (ULONG)sizeof(GENFILTER_SKETCH_CPU));
+
+    printf("%8s %10s %10s %10s %10s\n",
+           "Threads",
+           "Mupd/s",
+           "ns/upd",
+           "Found",
+           "MaxError");
+
+    for (ULONG threads = 1; ; threads = threadCount) {
+
+        SketchRun(threads,
+                  requests,
+                  exact);
+
+        if (threads == threadCount) {
+            break;
+        }
+    }
+
+    printf("\nFound is how many of the real top %lu were reported; MaxError is the\n"
+           "largest overestimate of a requester's bytes, as a share of all bytes\n",
+           (ULONG)exact.size());
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  ParseRateLimit
+//
+//    Parses "<Requests per second>,<bytes per second>" (for example
+//    "500,8000000"; 0 is no limit).  Returns false, having said why, if
+//    that isn't what Text is.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+bool
+ParseRateLimit(PCWSTR                Text,
+               PGENFILTER_RATE_LIMIT Limit)
+{
+    wchar_t* end;
+
+    Limit->RequestsPerSecond = wcstoul(Text,
+                                       &end,
+                                       10);
+
+    if (end == Text || *end != L',') {
+        printf("Limits are <Requests per second>,<bytes per second>\n");
+        return false;
+    }
+
+    Text = end + 1;
+
+    Limit->BytesPerSecond = wcstoul(Text,
+                                    &end,
+                                    10);
+
+    if (end == Text || *end != L'\0') {
+        printf("Limits are <Requests per second>,<bytes per second>\n");
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoLimit
+//
+//    Replaces the filter's I/O limits, without restarting the device:
+//    the device's, each requester's, the burst, and either "fail" or how
+//    long a Request may be held before it is
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoLimit(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE                  device        = INVALID_HANDLE_VALUE;
+    GENFILTER_CONFIGURATION configuration = {};
+    PGENFILTER_LIMITS       limits        = &configuration.Limits;
+    ULONG                   generation;
+    DWORD                   bytesReturned;
+    int                     result        = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    configuration.Size   = sizeof(configuration);
+    configuration.Fields = GENFILTER_CONFIG_FIELD_LIMITS;
+
+    if (!ParseRateLimit(Argv[1],
+                        &limits->Device) ||
+        !ParseRateLimit(Argv[2],
+                        &limits->Requester)) {
+        goto done;
+    }
+
+    limits->BurstMs = wcstoul(Argv[3],
+                              nullptr,
+                              10);
+
+    if (_wcsicmp(Argv[4], L"fail") == 0) {
+        limits->Action = GenFilterLimitFail;
+    } else {
+        limits->Action     = GenFilterLimitDelay;
+        limits->MaxDelayMs = wcstoul(Argv[4],
+                                     nullptr,
+                                     10);
+    }
+
+    if (limits->BurstMs > GENFILTER_LIMITS_MAX_MS ||
+        limits->MaxDelayMs > GENFILTER_LIMITS_MAX_MS) {
+        printf("The burst and the delay can be at most %u ms\n",
+               GENFILTER_LIMITS_MAX_MS);
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_GENFILTER_SET_CONFIG,
+                         &configuration,
+                         sizeof(configuration),
+                         &generation,
+                         sizeof(generation),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_SET_CONFIG failed - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    printf("Configuration %lu: device %lu Requests/s, %lu bytes/s; "
+           "each requester %lu Requests/s, %lu bytes/s\n",
+           generation,
+           limits->Device.RequestsPerSecond,
+           limits->Device.BytesPerSecond,
+           limits->Requester.RequestsPerSecond,
+           limits->Requester.BytesPerSecond);
+
+    printf("%lu ms bursts; over the limits, %s",
+           limits->BurstMs,
+           LimitActionNames[limits->Action]);
+
+    if (limits->Action == GenFilterLimitDelay) {
+        printf(" (up to %lu ms)",
+               limits->MaxDelayMs);
+    }
+
+    printf("\n");
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  BucketWorkerThread
+//
+//    Takes Requests from the buckets until told to stop, and counts what
+//    they let through
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+BucketWorkerThread(LPVOID Context)
+{
+    auto* worker = (PBUCKET_WORKER)Context;
+    auto* test   = worker->Test;
+
+    WaitForSingleObject(test->Start,
+                        INFINITE);
+
+    while (test->Stop == 0) {
+
+        LARGE_INTEGER now;
+        LONG64        delay;
+        ULONG         requester = 0;
+        ULONG         bytes     = GENFILTER_ATTRIBUTION_REQUEST_COST;
+
+        if (test->Run == BucketRunRequester) {
+            requester = (ULONG)(XorShiftRandom(&worker->Random) % BUCKET_REQUESTERS);
+        } else if (test->Run == BucketRunBytes) {
+            bytes = (ULONG)(XorShiftRandom(&worker->Random) % BUCKET_MAX_SECTORS + 1) *
+                    GENFILTER_ATTRIBUTION_REQUEST_COST;
+        }
+
+        QueryPerformanceCounter(&now);
+
+        if (GenFilterBucketAdmit(&test->Limits,
+                                 test->Device,
+                                 GenFilterBucketFind(test->Requesters,
+                                                     test->RequesterIds[requester]),
+                                 now.QuadPart,
+                                 bytes,
+                                 &delay)) {
+
+            worker->Admitted[requester]++;
+            worker->Bytes += bytes;
+        }
+
+        worker->Attempts++;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  BucketRun
+//
+//    Makes one of DoBucket's runs on ThreadCount threads, and prints how
+//    fast the buckets were and how close what they let through was to
+//    the limit
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+void
+BucketRun(BUCKET_RUN Run,
+          ULONG      ThreadCount)
+{
+    BUCKET_TEST                   test;
+    GENFILTER_LIMITS              limits  = {};
+    std::vector<GENFILTER_BUCKET> buckets(1 + GENFILTER_BUCKET_REQUESTERS);
+    std::vector<BUCKET_WORKER>    workers(ThreadCount);
+    std::vector<HANDLE>           threads;
+    LARGE_INTEGER                 frequency;
+    LARGE_INTEGER                 begin;
+    LARGE_INTEGER                 end;
+    ULONGLONG                     attempts = 0;
+    ULONGLONG                     admitted = 0;
+    double                        limit;
+    double                        error    = 0.0;
+    double                        seconds;
+
+    QueryPerformanceFrequency(&frequency);
+
+    limits.BurstMs = BUCKET_BURST_MS;
+    limits.Action  = GenFilterLimitFail;
+
+    switch (Run) {
+    case BucketRunDevice:
+        limits.Device.RequestsPerSecond = BUCKET_REQUESTS;
+        break;
+    case BucketRunBytes:
+        limits.Device.BytesPerSecond = BUCKET_BYTES;
+        break;
+    default:
+        limits.Requester.RequestsPerSecond = BUCKET_EACH_REQUESTER;
+        break;
+    }
+
+    GenFilterBucketLimitsInitialize(&test.Limits,
+                                    &limits,
+                                    frequency.QuadPart);
+
+    FillMemory(buckets.data(),
+               buckets.size() * sizeof(GENFILTER_BUCKET),
+               0);
+
+    test.Run        = Run;
+    test.Device     = &buckets[0];
+    test.Requesters = &buckets[1];
+    test.Start      = CreateEventW(nullptr,
+                                   TRUE,
+                                   FALSE,
+                                   nullptr);
+    test.Stop       = 0;
+
+    //
+    // Requesters are numbered like process IDs, skipping any that would
+    // share a bucket with one before it, so that each is limited on its
+    // own
+    //
+    for (ULONG requester = 0, id = 4; requester < BUCKET_REQUESTERS; id += 4) {
+
+        bool shared = false;
+
+        for (ULONG other = 0; other < requester; other++) {
+
+            if (GenFilterBucketFind(test.Requesters,
+                                    id) == GenFilterBucketFind(test.Requesters,
+                                                               test.RequesterIds[other])) {
+                shared = true;
+            }
+        }
+
+        if (!shared) {
+            test.RequesterIds[requester++] = id;
+        }
+    }
+
+    for (ULONG thread = 0; thread < ThreadCount; thread++) {
+
+        FillMemory(&workers[thread],
+                   sizeof(BUCKET_WORKER),
+                   0);
+
+        workers[thread].Test   = &test;
+        workers[thread].Random = 0x9E3779B97F4A7C15ULL + thread;
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       BucketWorkerThread,
+                                       &workers[thread],
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(test.Start);
+
+    Sleep(BUCKET_SECONDS * 1000);
+
+    InterlockedExchange(&test.Stop,
+                        1);
+
+    WaitForMultipleObjects(ThreadCount,
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    for (HANDLE thread : threads) {
+        CloseHandle(thread);
+    }
+
+    CloseHandle(test.Start);
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    //
+    // What a bucket should let through in that time is its rate, plus the
+    // burst it starts out with.  Error is how far off it was.
+    //
+    for (const BUCKET_WORKER& worker : workers) {
+
+        attempts += worker.Attempts;
+
+        if (Run == BucketRunBytes) {
+            admitted += worker.Bytes;
+        } else if (Run == BucketRunDevice) {
+            admitted += worker.Admitted[0];
+        }
+    }
+
+    if (Run == BucketRunRequester) {
+
+        limit = BUCKET_EACH_REQUESTER;
+
+        for (ULONG requester = 0; requester < BUCKET_REQUESTERS; requester++) {
+
+            ULONGLONG count = 0;
+
+            for (const BUCKET_WORKER& worker : workers) {
+                count += worker.Admitted[requester];
+            }
+
+            admitted += count;
+
+            error = std::max(error,
+                             fabs((double)count /
+                                  (limit * (seconds + BUCKET_BURST_MS / 1000.0)) - 1.0));
+        }
+
+        admitted /= BUCKET_REQUESTERS;
+
+    } else {
+
+        limit = Run == BucketRunBytes ? BUCKET_BYTES : BUCKET_REQUESTS;
+        error = fabs((double)admitted /
+                     (limit * (seconds + BUCKET_BURST_MS / 1000.0)) - 1.0);
+    }
+
+    printf("%-10s %8lu %10.1f %10.1f %12.0f %12.0f %9.2f%%\n",
+           BucketRunNames[Run],
+           ThreadCount,
+           (double)attempts / seconds / 1000000.0,
+           seconds * 1000000000.0 * ThreadCount / (double)attempts,
+           (double)admitted / seconds,
+           limit,
+           error * 100.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoBucket
+//
+//    Checks that the I/O limits' token buckets let through what they
+//    should, and measures what taking from them costs, on one thread and
+//    then on one thread per processor, all taking from the same buckets.
+//    No device is involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoBucket(int      Argc,
+         wchar_t* Argv[])
+{
+    ULONG threadCount;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    threadCount = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+
+    if (threadCount > MAXIMUM_WAIT_OBJECTS) {
+        threadCount = MAXIMUM_WAIT_OBJECTS;
+    }
+
+    printf("%lu second(s) per run, %lu ms bursts, over the limit fails\n",
+           BUCKET_SECONDS,
+           BUCKET_BURST_MS);
+    printf("device: %lu Requests/s; bytes: %lu MB/s; requester: %lu requesters at %lu Requests/s\n\n",
+           BUCKET_REQUESTS,
+           BUCKET_BYTES / (1024 * 1024),
+           BUCKET_REQUESTERS,
+           BUCKET_EACH_REQUESTER);
+
+    printf("%-10s %8s %10s %10s %12s %12s %10s\n",
+           "Limit",
+           "Threads",
+           "Mtakes/s",
+           "ns/take",
+           "Admitted/s",
+           "Limit/s",
+           "Error");
+
+    for (ULONG run = 0; run < BucketRunCount; run++) {
+
+        for (ULONG threads = 1; ; threads = threadCount) {
+
+            BucketRun((BUCKET_RUN)run,
+                      threads);
+
+            if (threads == threadCount) {
+                break;
+            }
+        }
+    }
+
+    printf("\nAdmitted/s is each requester's for the requester runs, whose Error is\n"
+           "the worst of them.  Error is against the limit plus the burst.\n");
+
+    return 0;
+}
+
+//
+// SplitSetConfig
+//
+// Replaces how the filter splits large transfers
+//
+static
+bool
+SplitSetConfig(HANDLE Device,
+               ULONG  ChunkKB,
+               ULONG  Depth)
+{
+    GENFILTER_CONFIGURATION configuration = {};
+    ULONG                   generation;
+    DWORD                   bytesReturned;
+
+    configuration.Size          = sizeof(configuration);
+    configuration.Fields        = GENFILTER_CONFIG_FIELD_SPLIT;
+    configuration.Split.ChunkKB = ChunkKB;
+    configuration.Split.Depth   = Depth;
+
+    if (!DeviceIoControl(Device,
+                         IOCTL_GENFILTER_SET_CONFIG,
+                         &configuration,
+                         sizeof(configuration),
+                         &generation,
+                         sizeof(generation),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_GENFILTER_SET_CONFIG failed - %lu\n",
+               GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SplitWorkerThread
+//
+//    Reads Size bytes at a time from random places on the device until
+//    told to stop, timing each read
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+DWORD
+WINAPI
+SplitWorkerThread(LPVOID Context)
+{
+    auto*         worker = (PSPLIT_WORKER)Context;
+    auto*         test   = worker->Test;
+    LARGE_INTEGER frequency;
+    ULONGLONG     sectors;
+
+    QueryPerformanceFrequency(&frequency);
+
+    sectors = test->Sectors - worker->Size / SPLIT_SECTOR_SIZE;
+
+    WaitForSingleObject(test->Start,
+                        INFINITE);
+
+    while (test->Stop == 0) {
+
+        OVERLAPPED    overlapped = {};
+        LARGE_INTEGER offset;
+        LARGE_INTEGER start;
+        LARGE_INTEGER end;
+        DWORD         bytesRead;
+
+        //
+        // The handle isn't overlapped, so this just says where to read
+        //
+        offset.QuadPart       = (LONGLONG)(XorShiftRandom(&worker->Random) % sectors) *
+                                SPLIT_SECTOR_SIZE;
+        overlapped.Offset     = offset.LowPart;
+        overlapped.OffsetHigh = (DWORD)offset.HighPart;
+
+        QueryPerformanceCounter(&start);
+
+        if (!ReadFile(worker->Device,
+                      worker->Buffer,
+                      worker->Size,
+                      &bytesRead,
+                      &overlapped)) {
+
+            printf("ReadFile at offset %lld failed - %lu\n",
+                   offset.QuadPart,
+                   GetLastError());
+
+            worker->Failed = true;
+            break;
+        }
+
+        QueryPerformanceCounter(&end);
+
+        worker->Bytes += bytesRead;
+        worker->Latencies.push_back((double)(end.QuadPart - start.QuadPart) * 1000000.0 /
+                                    (double)frequency.QuadPart);
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  SplitRun
+//
+//    Makes one of DoSplit's runs, with the filter already set up for it,
+//    and prints the small reads' latency and the large reads' throughput.
+//    Returns false if the device couldn't be read.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+bool
+SplitRun(PCWSTR    DevicePath,
+         SPLIT_RUN Run,
+         ULONGLONG Sectors)
+{
+    SPLIT_TEST                test;
+    std::vector<SPLIT_WORKER> workers(Run == SplitRunSmall ? 1 :
+                                                             1 + SPLIT_LARGE_THREADS);
+    std::vector<HANDLE>       threads;
+    LARGE_INTEGER             frequency;
+    LARGE_INTEGER             begin;
+    LARGE_INTEGER             end;
+    ULONGLONG                 largeBytes = 0;
+    double                    seconds;
+    bool                      result     = false;
+
+    test.Sectors = Sectors;
+    test.Start   = CreateEventW(nullptr,
+                                TRUE,
+                                FALSE,
+                                nullptr);
+    test.Stop    = 0;
+
+    //
+    // The first worker makes the small reads.  Unbuffered reads need a
+    // sector aligned buffer; VirtualAlloc gives us a page aligned one.
+    //
+    for (ULONG index = 0; index < workers.size(); index++) {
+
+        SPLIT_WORKER& worker = workers[index];
+
+        worker.Test   = &test;
+        worker.Size   = index == 0 ? SPLIT_SMALL_SIZE :
+                                     SPLIT_LARGE_SIZE;
+        worker.Random = 0x9E3779B97F4A7C15ULL + index;
+        worker.Bytes  = 0;
+        worker.Failed = false;
+        worker.Buffer = VirtualAlloc(nullptr,
+                                     worker.Size,
+                                     MEM_COMMIT | MEM_RESERVE,
+                                     PAGE_READWRITE);
+        worker.Device = OpenFilteredDevice(DevicePath,
+                                           GENERIC_READ,
+                                           FILE_FLAG_NO_BUFFERING);
+
+        if (worker.Buffer == nullptr ||
+            worker.Device == INVALID_HANDLE_VALUE) {
+            goto done;
+        }
+    }
+
+    for (SPLIT_WORKER& worker : workers) {
+
+        threads.push_back(CreateThread(nullptr,
+                                       0,
+                                       SplitWorkerThread,
+                                       &worker,
+                                       0,
+                                       nullptr));
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&begin);
+
+    SetEvent(test.Start);
+
+    Sleep(SPLIT_SECONDS * 1000);
+
+    InterlockedExchange(&test.Stop,
+                        1);
+
+    WaitForMultipleObjects((DWORD)threads.size(),
+                           threads.data(),
+                           TRUE,
+                           INFINITE);
+
+    QueryPerformanceCounter(&end);
+
+    for (HANDLE thread : threads) {
+        CloseHandle(thread);
+    }
+
+    seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+    for (const SPLIT_WORKER& worker : workers) {
+
+        if (worker.Failed) {
+            goto done;
+        }
+
+        if (worker.Size == SPLIT_LARGE_SIZE) {
+            largeBytes += worker.Bytes;
+        }
+    }
+
+    printf("%-14s %10.0f",
+           SplitRunNames[Run],
+           (double)workers[0].Latencies.size() / seconds);
+
+    ReplayPrintLatencies(workers[0].Latencies);
+
+    if (Run == SplitRunSmall) {
+        printf(" %10s\n",
+               "-");
+    } else {
+        printf(" %10.1f\n",
+               (double)largeBytes / (1024.0 * 1024.0) / seconds);
+    }
+
+    result = true;
+
+done:
+
+    for (SPLIT_WORKER& worker : workers) {
+
+        if (worker.Buffer != nullptr) {
+            VirtualFree(worker.Buffer,
+                        0,
+                        MEM_RELEASE);
+        }
+
+        if (worker.Device != nullptr &&
+            worker.Device != INVALID_HANDLE_VALUE) {
+            CloseHandle(worker.Device);
+        }
+    }
+
+    CloseHandle(test.Start);
+
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoSplit
+//
+//    Shows how splitting large reads changes the latency of small ones
+//    made at the same time: small reads alone, then alongside large ones
+//    with splitting off, then alongside them split into chunks of the
+//    given size, that many at a time.
+//
+//    This reads from the device, so it needs a disc in the drive.  The
+//    settings asked for are left in effect.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoSplit(int      Argc,
+        wchar_t* Argv[])
+{
+    HANDLE                 device = INVALID_HANDLE_VALUE;
+    GET_LENGTH_INFORMATION lengthInfo;
+    ULONGLONG              sectors;
+    ULONG                  chunkKB;
+    ULONG                  depth;
+    DWORD                  bytesReturned;
+    int                    result = 1;
+
+    UNREFERENCED_PARAMETER(Argc);
+
+    chunkKB = wcstoul(Argv[1],
+                      nullptr,
+                      10);
+    depth   = wcstoul(Argv[2],
+                      nullptr,
+                      10);
+
+    if (chunkKB == 0 ||
+        chunkKB >= SPLIT_LARGE_SIZE / 1024 ||
+        (chunkKB % 2) != 0) {
+        printf("The chunk size is a multiple of 2KB, less than %lu KB\n",
+               SPLIT_LARGE_SIZE / 1024);
+        goto done;
+    }
+
+    if (depth == 0 ||
+        depth > GENFILTER_SPLIT_MAX_DEPTH) {
+        printf("The depth is from 1 to %u chunks\n",
+               GENFILTER_SPLIT_MAX_DEPTH);
+        goto done;
+    }
+
+    device = OpenFilteredDevice(Argv[0],
+                                GENERIC_READ | GENERIC_WRITE,
+                                0);
+
+    if (device == INVALID_HANDLE_VALUE) {
+        goto done;
+    }
+
+    if (!DeviceIoControl(device,
+                         IOCTL_DISK_GET_LENGTH_INFO,
+                         nullptr,
+                         0,
+                         &lengthInfo,
+                         sizeof(lengthInfo),
+                         &bytesReturned,
+                         nullptr)) {
+
+        printf("IOCTL_DISK_GET_LENGTH_INFO failed (is there a disc in the drive?) - %lu\n",
+               GetLastError());
+        goto done;
+    }
+
+    sectors = (ULONGLONG)lengthInfo.Length.QuadPart / SPLIT_SECTOR_SIZE;
+
+    if (sectors <= SPLIT_LARGE_SIZE / SPLIT_SECTOR_SIZE) {
+        printf("The disc is too small\n");
+        goto done;
+    }
+
+    printf("%lu second(s) per run, %lu byte small reads; mixed runs add %lu threads of %lu KB reads\n"
+           "split: %lu KB chunks, %lu at a time\n\n",
+           SPLIT_SECONDS,
+           SPLIT_SMALL_SIZE,
+           SPLIT_LARGE_THREADS,
+           SPLIT_LARGE_SIZE / 1024,
+           chunkKB,
+           depth);
+
+    printf("%-14s %10s %9s %9s %9s %10s\n",
+           "Run",
+           "Small/s",
+           "Mean ms",
+           "p99 ms",
+           "Max ms",
+           "Large MB/s");
+
+    for (ULONG run = 0; run < SplitRunCount; run++) {
+
+        if (!SplitSetConfig(device,
+                            run == SplitRunMixedSplit ? chunkKB : 0,
+                            depth)) {
+            goto done;
+        }
+
+        if (!SplitRun(Argv[0],
+                      (SPLIT_RUN)run,
+                      sectors)) {
+            goto done;
+        }
+    }
+
+    result = 0;
+
+done:
+
+    if (device != INVALID_HANDLE_VALUE) {
+        CloseHandle(device);
+    }
+
+    return result;
+}
+
+//
+// RouteCode
+//
+// The Index'th of our made up codes.  They're all ours, all for CD-ROMs,
+// and all different.
+//
+static
+ULONG
+RouteCode(ULONG Index)
+{
+    return CTL_CODE(FILE_DEVICE_CD_ROM,
+                    0x800 + Index,
+                    METHOD_BUFFERED,
+                    FILE_READ_ACCESS);
+}
+
+//
+// RouteScan
+//
+// What the routing table did before it was hashed
+//
+static
+const ROUTE_BENCH_ROUTE*
+RouteScan(const ROUTE_BENCH_ROUTE* Routes,
+          ULONG                    RouteCount,
+          ULONG                    IoControlCode)
+{
+    for (ULONG route = 0; route < RouteCount; route++) {
+
+        if (Routes[route].IoControlCode == IoControlCode) {
+            return &Routes[route];
+        }
+    }
+
+    return nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RouteTime
+//
+//    Looks up each of Codes with Find, ROUTE_ROUNDS times, and returns the
+//    best time per lookup in nanoseconds
+//
+///////////////////////////////////////////////////////////////////////////////
+template <typename Lookup>
+static
+double
+RouteTime(const std::vector<ULONG>& Codes,
+          Lookup                    Find)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER begin;
+    LARGE_INTEGER end;
+    ULONG_PTR     found = 0;
+    double        best  = 0.0;
+
+    QueryPerformanceFrequency(&frequency);
+
+    for (ULONG round = 0; round < ROUTE_ROUNDS; round++) {
+
+        double seconds;
+
+        QueryPerformanceCounter(&begin);
+
+        for (ULONG code : Codes) {
+            found ^= (ULONG_PTR)Find(code);
+        }
+
+        QueryPerformanceCounter(&end);
+
+        seconds = (double)(end.QuadPart - begin.QuadPart) / (double)frequency.QuadPart;
+
+        if (round == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+
+    //
+    // Keep the compiler from deciding the loop does nothing
+    //
+    if (found == 0x12345678) {
+        printf("(that's unlikely) ");
+    }
+
+    return best * 1000000000.0 / (double)Codes.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  RouteRun
+//
+//    Builds a table of RouteCount codes, checks that it finds what a scan
+//    does for every code we'll look up, and prints what each costs.
+//    Returns false if the two ever disagree.
+//
+///////////////////////////////////////////////////////////////////////////////
+template <ULONG RouteCount>
+static
+bool
+RouteRun()
+{
+    typedef GENFILTER_ROUTE_TABLE<ROUTE_BENCH_ROUTE, RouteCount> ROUTE_TABLE;
+
+    static ROUTE_BENCH_ROUTE routes[RouteCount];
+    std::vector<ULONG>       codes(ROUTE_LOOKUPS);
+    ULONGLONG                random     = 0x2545F4914F6CDD1DULL;
+    ULONG                    mismatches = 0;
+    ROUTE_TABLE*             table;
+    double                   hashNs;
+    double                   scanNs;
+
+    for (ULONG route = 0; route < RouteCount; route++) {
+        routes[route].IoControlCode = RouteCode(route);
+    }
+
+    //
+    // The driver's table is built by the compiler; this is the same code
+    // run now instead.  It's too big for the stack at 1000 codes.
+    //
+    table = new ROUTE_TABLE(routes);
+
+    if (!table->Verify()) {
+
+        printf("%8lu  couldn't build the table\n",
+               RouteCount);
+        delete table;
+        return false;
+    }
+
+    //
+    // Codes past the last one in the table are the misses
+    //
+    for (auto& code : codes) {
+        code = RouteCode((ULONG)(XorShiftRandom(&random) % (2 * RouteCount)));
+    }
+
+    for (ULONG code : codes) {
+
+        if (table->Find(code) != RouteScan(routes,
+                                           RouteCount,
+                                           code)) {
+            mismatches++;
+        }
+    }
+
+    hashNs = RouteTime(codes,
+                       [table](ULONG IoControlCode) {
+                           return table->Find(IoControlCode);
+                       });
+
+    scanNs = RouteTime(codes,
+                       [](ULONG IoControlCode) {
+                           return RouteScan(routes,
+                                            RouteCount,
+                                            IoControlCode);
+                       });
+
+    printf("%8lu %10.2f %10.2f %9.1fx %10lu\n",
+           RouteCount,
+           hashNs,
+           scanNs,
+           scanNs / hashNs,
+           mismatches);
+
+    delete table;
+
+    return mismatches == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DoRoute
+//
+//    Benchmarks the perfect hash behind the driver's IOCTL routing table
+//    against a linear scan, at 10, 100 and 1000 codes.  No device is
+//    involved.
+//
+///////////////////////////////////////////////////////////////////////////////
+static
+int
+DoRoute(int      Argc,
+        wchar_t* Argv[])
+{
+    bool agreed = true;
+
+    UNREFERENCED_PARAMETER(Argc);
+    UNREFERENCED_PARAMETER(Argv);
+
+    printf("%lu lookups, half of them hits, best of %lu rounds\n\n",
+           ROUTE_LOOKUPS,
+           ROUTE_ROUNDS);
+
+    printf("%8s %10s %10s %10s %10s\n",
+           "Codes",
+           "Hash ns",
+           "Scan ns",
+           "Speedup",
+           "Mismatches");
+
+    agreed &= RouteRun<10>();
+    agreed &= RouteRun<100>();
+    agreed &= RouteRun<1000>();
+
+    return agreed ? 0 : 1;
+}
+
+//
+// Our commands.  ArgCount is the number of arguments following the command
+// name itself.
+//
+typedef struct _GENFILTERCTL_COMMAND {
+    PCWSTR      Name;
+    int         ArgCount;
+    int         (*Handler)(int Argc, wchar_t* Argv[]);
+    const char* Usage;
+} GENFILTERCTL_COMMAND;
+
+static const GENFILTERCTL_COMMAND Commands[] = {
+    { L"stats",       1, DoStats,       "stats       <device>         Show I/O statistics" },
+    { L"trace",       2, DoTrace,       "trace       <device> <file>  Drain the trace log into <file>" },
+    { L"decode",      1, DoDecode,      "decode      <file>           Decode a drained trace log" },
+    { L"latency",     1, DoLatency,     "latency     <device>         Show latency percentiles" },
+    { L"passthrough", 2, DoPassThrough, "passthrough <device> on|off  Switch pass-through mode" },
+    { L"compare",     2, DoCompare,     "compare     <device> <MB>    Read throughput, inspecting vs. pass-through" },
+    { L"forward",     2, DoForward,     "forward     <device> <count> Per-Request cost, dispatcher vs. pass-through" },
+    { L"sample",      2, DoSample,      "sample      <device> <count> Per-Request cost at each latency sampling interval" },
+    { L"sched",       0, DoSched,       "sched                        Replay workloads through each scheduler policy" },
+    { L"pools",       1, DoPools,       "pools       <device>         Show the filter's element pools" },
+    { L"slab",        0, DoSlab,        "slab                         Benchmark the pool allocator against the heap" },
+    { L"defer",       1, DoDefer,       "defer       <device>         Show the deferred work queue" },
+    { L"ring",        0, DoRing,        "ring                         Stress test the deferred work queue" },
+    { L"match",       0, DoMatch,       "match                        Check and benchmark the signature matcher" },
+    { L"crc",         0, DoCrc,         "crc                          Check and benchmark the sector checksums" },
+    { L"capture",     2, DoCapture,     "capture     <device> <file>  Drain the I/O capture into <file>" },
+    { L"replay",      2, DoReplay,      "replay      <file> <speed>   Replay a capture through a simulated filter" },
+    { L"inspect",     3, DoInspect,     "inspect     <device> <action> <sigs>  Set inspection: off|flag|block, hex,hex...|-" },
+    { L"rcu",         0, DoRcu,         "rcu                          Stress test the configuration snapshots" },
+    { L"top",         2, DoTop,         "top         <device> <secs>  Show who sends the most I/O (0: since last reset)" },
+    { L"sketch",      0, DoSketch,      "sketch                       Check and benchmark the attribution sketch" },
+    { L"limit",       5, DoLimit,       "limit       <device> <dev> <req> <burst> fail|<ms>  Set I/O limits: Requests/s,bytes/s" },
+    { L"bucket",      0, DoBucket,      "bucket                       Check and benchmark the I/O limit token buckets" },
+    { L"split",       3, DoSplit,       "split       <device> <KB> <depth>  Small-read latency beside large reads, unsplit vs. split" },
+    { L"route",       0, DoRoute,       "route                        Benchmark the IOCTL routing table against a linear scan" },
+};
+
+int
+wmain(int      argc,
+      wchar_t* argv[])
+{
+    if (argc >= 2) {
+
+        for (const auto& command : Commands) {
+
+            if (_wcsicmp(argv[1], command.Name) == 0 &&
+                argc - 2 == command.ArgCount) {
+
+                return command.Handler(argc - 2,
+                                       &argv[2]);
+            }
+        }
+    }
+
+    printf("Usage: GenFilterCtl <command> [arguments]\n\n");
+
+    for (const auto& command : Commands) {
+        printf("    %s\n",
+               command.Usage);
+    }
+
+    printf("\n<device> is the device being filtered, for example \\\\.\\CdRom0\n");
+
+    return 1;
+}
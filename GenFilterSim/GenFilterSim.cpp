@@ -0,0 +1,588 @@
+///
+/// @file GenFilterSim.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// GenFilterSim's simulated device, and building and sending IRPs.
+//
+// The simulated device is a DO_DIRECT_IO device whose media is a buffer
+// in memory, filled with a known pattern, in 2048 byte sectors.  It
+// satisfies reads and writes from that buffer, answers the CHECK_VERIFY
+// family of device controls and the geometry and capacity queries, and
+// zero-fills the output of any other.  With no latency it completes every
+// IRP in its dispatch routine; with latency its completion thread
+// completes each one when that much time has passed since it arrived.
+//
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "GenFilterSim.h"
+
+#include <ntddcdrm.h>
+#include <ntdddisk.h>
+#include <ntddstor.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct _GENFILTER_SIM_TARGET {
+    DEVICE_OBJECT                  DeviceObject;
+    PUCHAR                         Media;
+    ULONG                          MediaBytes;
+    ULONG                          LatencyUs;
+    volatile LONG64                Requests[IRP_MJ_MAXIMUM_FUNCTION + 1];
+
+    //
+    // The next FailCount reads or writes that cover FailOffset fail with
+    // FailStatus (see GenFilterSimTargetFailAt)
+    //
+    LONGLONG                       FailOffset;
+    NTSTATUS                       FailStatus;
+    volatile LONG                  FailCount;
+
+    //
+    // IRPs waiting out their latency, by when they're due (interrupt time)
+    //
+    std::mutex                     Lock;
+    std::condition_variable        Changed;
+    std::multimap<ULONGLONG, PIRP> Pending;
+    BOOLEAN                        Stopping;
+    std::thread                    Completer;
+} GENFILTER_SIM_TARGET;
+
+constexpr ULONG GENFILTER_SIM_SECTOR_SIZE = 2048;
+
+//
+// What's at a given offset on the media before anybody writes to it
+//
+#define GENFILTER_SIM_MEDIA_BYTE(_offset) \
+    ((UCHAR)((_offset) ^ ((_offset) >> 8) ^ ((_offset) >> 16)))
+
+static
+VOID
+GenFilterSimTargetComplete(_In_ PGENFILTER_SIM_TARGET Target)
+{
+    std::unique_lock<std::mutex> lock(Target->Lock);
+
+    while (!Target->Stopping || !Target->Pending.empty()) {
+
+        ULONGLONG now;
+        PIRP      irp;
+
+        if (Target->Pending.empty()) {
+            Target->Changed.wait(lock);
+            continue;
+        }
+
+        now = KeQueryInterruptTime();
+
+        if (Target->Pending.begin()->first > now) {
+            Target->Changed.wait_for(lock,
+                                     std::chrono::microseconds((Target->Pending.begin()->first - now + 9) / 10));
+            continue;
+        }
+
+        irp = Target->Pending.begin()->second;
+        Target->Pending.erase(Target->Pending.begin());
+
+        lock.unlock();
+
+        IoCompleteRequest(irp,
+                          IO_NO_INCREMENT);
+
+        lock.lock();
+    }
+}
+
+static
+NTSTATUS
+GenFilterSimTargetDispatch(_In_ PDEVICE_OBJECT DeviceObject,
+                           _Inout_ PIRP        Irp)
+{
+    auto*              target  = (PGENFILTER_SIM_TARGET)DeviceObject->SimContext;
+    PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(Irp);
+    NTSTATUS           status  = STATUS_SUCCESS;
+    ULONG_PTR          information = 0;
+
+    InterlockedIncrement64(&target->Requests[ioStack->MajorFunction]);
+
+    switch (ioStack->MajorFunction) {
+
+        case IRP_MJ_READ:
+        case IRP_MJ_WRITE: {
+
+            LONGLONG offset = ioStack->Parameters.Read.ByteOffset.QuadPart;
+            ULONG    length = ioStack->Parameters.Read.Length;
+            PUCHAR   buffer;
+
+            if (length == 0) {
+                break;
+            }
+
+            if (offset < 0 ||
+                offset >= target->MediaBytes) {
+                status = STATUS_END_OF_FILE;
+                break;
+            }
+
+            if (target->FailOffset >= offset &&
+                target->FailOffset < offset + length) {
+
+                LONG count = ReadAcquire(&target->FailCount);
+
+                while (count > 0 &&
+                       InterlockedCompareExchange(&target->FailCount,
+                                                  count - 1,
+                                                  count) != count) {
+                    count = ReadAcquire(&target->FailCount);
+                }
+
+                if (count > 0) {
+                    status = target->FailStatus;
+                    break;
+                }
+            }
+
+            buffer = (Irp->MdlAddress != nullptr) ? (PUCHAR)MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                                                                        NormalPagePriority) :
+                                                    (PUCHAR)Irp->AssociatedIrp.SystemBuffer;
+
+            information = min(length,
+                              target->MediaBytes - (ULONG)offset);
+
+            if (ioStack->MajorFunction == IRP_MJ_READ) {
+                RtlCopyMemory(buffer,
+                              target->Media + offset,
+                              information);
+            } else {
+                RtlCopyMemory(target->Media + offset,
+                              buffer,
+                              information);
+            }
+
+            break;
+        }
+
+        case IRP_MJ_DEVICE_CONTROL: {
+
+            ULONG outputLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+            switch (ioStack->Parameters.DeviceIoControl.IoControlCode) {
+
+                case IOCTL_CDROM_CHECK_VERIFY:
+                case IOCTL_DISK_CHECK_VERIFY:
+                case IOCTL_STORAGE_CHECK_VERIFY:
+                case IOCTL_STORAGE_CHECK_VERIFY2:
+
+                    //
+                    // The media has never changed
+                    //
+                    if (outputLength >= sizeof(ULONG)) {
+                        *(PULONG)Irp->AssociatedIrp.SystemBuffer = 0;
+                        information                              = sizeof(ULONG);
+                    }
+
+                    break;
+
+                case IOCTL_CDROM_GET_DRIVE_GEOMETRY:
+                case IOCTL_CDROM_GET_DRIVE_GEOMETRY_EX:
+                case IOCTL_DISK_GET_DRIVE_GEOMETRY: {
+
+                    auto* geometry = (PDISK_GEOMETRY)Irp->AssociatedIrp.SystemBuffer;
+
+                    if (outputLength < sizeof(DISK_GEOMETRY)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    RtlZeroMemory(geometry,
+                                  outputLength);
+
+                    geometry->Cylinders.QuadPart = 1;
+                    geometry->MediaType          = RemovableMedia;
+                    geometry->TracksPerCylinder  = 1;
+                    geometry->SectorsPerTrack    = target->MediaBytes / GENFILTER_SIM_SECTOR_SIZE;
+                    geometry->BytesPerSector     = GENFILTER_SIM_SECTOR_SIZE;
+                    information                  = sizeof(DISK_GEOMETRY);
+
+                    if (outputLength >= FIELD_OFFSET(DISK_GEOMETRY_EX, Data)) {
+                        ((PDISK_GEOMETRY_EX)geometry)->DiskSize.QuadPart = target->MediaBytes;
+                        information = FIELD_OFFSET(DISK_GEOMETRY_EX, Data);
+                    }
+
+                    break;
+                }
+
+                case IOCTL_STORAGE_READ_CAPACITY: {
+
+                    auto* capacity = (PSTORAGE_READ_CAPACITY)Irp->AssociatedIrp.SystemBuffer;
+
+                    if (outputLength < sizeof(STORAGE_READ_CAPACITY)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    capacity->Version                 = sizeof(STORAGE_READ_CAPACITY);
+                    capacity->Size                    = sizeof(STORAGE_READ_CAPACITY);
+                    capacity->BlockLength             = GENFILTER_SIM_SECTOR_SIZE;
+                    capacity->NumberOfBlocks.QuadPart = target->MediaBytes / GENFILTER_SIM_SECTOR_SIZE;
+                    capacity->DiskLength.QuadPart     = target->MediaBytes;
+                    information                       = sizeof(STORAGE_READ_CAPACITY);
+                    break;
+                }
+
+                default:
+
+                    if (outputLength != 0) {
+                        RtlZeroMemory(Irp->AssociatedIrp.SystemBuffer,
+                                      outputLength);
+                    }
+
+                    information = outputLength;
+                    break;
+            }
+
+            break;
+        }
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+    }
+
+    Irp->IoStatus.Status      = status;
+    Irp->IoStatus.Information = information;
+
+    if (target->LatencyUs == 0) {
+
+        IoCompleteRequest(Irp,
+                          IO_NO_INCREMENT);
+
+        return status;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(target->Lock);
+
+        target->Pending.emplace(KeQueryInterruptTime() + (ULONGLONG)target->LatencyUs * 10,
+                                Irp);
+        target->Changed.notify_one();
+    }
+
+    return STATUS_PENDING;
+}
+
+NTSTATUS
+GenFilterSimTargetCreate(_In_ ULONG                   MediaBytes,
+                         _In_ ULONG                   LatencyUs,
+                         _Out_ PGENFILTER_SIM_TARGET* Target)
+{
+    PGENFILTER_SIM_TARGET target;
+
+    target = new GENFILTER_SIM_TARGET();
+
+    target->Media = (PUCHAR)malloc(MediaBytes);
+
+    if (target->Media == nullptr) {
+        delete target;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG offset = 0; offset < MediaBytes; offset++) {
+        target->Media[offset] = GENFILTER_SIM_MEDIA_BYTE(offset);
+    }
+
+    target->MediaBytes               = MediaBytes;
+    target->LatencyUs                = LatencyUs;
+    target->DeviceObject.Flags       = DO_DIRECT_IO;
+    target->DeviceObject.SimDispatch = GenFilterSimTargetDispatch;
+    target->DeviceObject.SimContext  = target;
+
+    if (LatencyUs != 0) {
+        target->Completer = std::thread(GenFilterSimTargetComplete,
+                                        target);
+    }
+
+    *Target = target;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+GenFilterSimTargetDelete(_In_ PGENFILTER_SIM_TARGET Target)
+{
+    if (Target->Completer.joinable()) {
+
+        {
+            std::lock_guard<std::mutex> lock(Target->Lock);
+
+            Target->Stopping = TRUE;
+            Target->Changed.notify_one();
+        }
+
+        Target->Completer.join();
+    }
+
+    free(Target->Media);
+
+    delete Target;
+}
+
+PDEVICE_OBJECT
+GenFilterSimTargetGetDevice(_In_ PGENFILTER_SIM_TARGET Target)
+{
+    return &Target->DeviceObject;
+}
+
+PUCHAR
+GenFilterSimTargetGetMedia(_In_ PGENFILTER_SIM_TARGET Target,
+                           _Out_opt_ PULONG           MediaBytes)
+{
+    if (MediaBytes != nullptr) {
+        *MediaBytes = Target->MediaBytes;
+    }
+
+    return Target->Media;
+}
+
+UCHAR
+GenFilterSimTargetGetMediaByte(_In_ ULONG Offset)
+{
+    return GENFILTER_SIM_MEDIA_BYTE(Offset);
+}
+
+ULONGLONG
+GenFilterSimTargetGetRequests(_In_ PGENFILTER_SIM_TARGET Target,
+                              _In_ UCHAR                 MajorFunction)
+{
+    return (ULONGLONG)ReadAcquire64(&Target->Requests[MajorFunction]);
+}
+
+//
+// Fails the next Count reads or writes that cover Offset with Status.  Set
+// it before sending them.
+//
+VOID
+GenFilterSimTargetFailAt(_In_ PGENFILTER_SIM_TARGET Target,
+                         _In_ LONGLONG              Offset,
+                         _In_ NTSTATUS              Status,
+                         _In_ ULONG                 Count)
+{
+    Target->FailOffset = Offset;
+    Target->FailStatus = Status;
+
+    InterlockedExchange(&Target->FailCount,
+                        (LONG)Count);
+}
+
+//
+// Sets or clears DO_VERIFY_VOLUME on the device, as a class driver does
+// when it's told the media may have changed, and once it's been verified
+//
+VOID
+GenFilterSimTargetSetVerify(_In_ PGENFILTER_SIM_TARGET Target,
+                            _In_ BOOLEAN               Verify)
+{
+    if (Verify) {
+        InterlockedOr((volatile LONG*)&Target->DeviceObject.Flags,
+                      (LONG)DO_VERIFY_VOLUME);
+    } else {
+        InterlockedAnd((volatile LONG*)&Target->DeviceObject.Flags,
+                       ~(LONG)DO_VERIFY_VOLUME);
+    }
+}
+
+//
+// IRPs.  We build them the way the I/O manager does for a user-mode
+// caller, with an MDL for reads and writes (the device is DO_DIRECT_IO)
+// and a system buffer for device controls, and the first stack location
+// set up for the device at the top of the stack.
+//
+static
+PIO_STACK_LOCATION
+GenFilterSimBuildIrp(_Out_ PIRP  Irp,
+                     _In_ UCHAR  MajorFunction)
+{
+    PIO_STACK_LOCATION ioStack;
+
+    RtlZeroMemory(Irp,
+                  sizeof(IRP));
+
+    Irp->RequestorMode      = UserMode;
+    Irp->SimProcessId       = (ULONG)getpid();
+    Irp->SimCurrentLocation = &Irp->SimStack[GENFILTER_SIM_IRP_STACK_SIZE];
+
+    ioStack                = IoGetNextIrpStackLocation(Irp);
+    ioStack->MajorFunction = MajorFunction;
+
+    return ioStack;
+}
+
+static
+VOID
+GenFilterSimBuildReadWrite(_Out_ PIRP    Irp,
+                           _Out_ PMDL    Mdl,
+                           _In_ UCHAR    MajorFunction,
+                           _In_ PVOID    Buffer,
+                           _In_ ULONG    Length,
+                           _In_ LONGLONG Offset)
+{
+    PIO_STACK_LOCATION ioStack;
+
+    ioStack = GenFilterSimBuildIrp(Irp,
+                                   MajorFunction);
+
+    ioStack->Parameters.Read.Length              = Length;
+    ioStack->Parameters.Read.ByteOffset.QuadPart = Offset;
+
+    MmInitializeMdl(Mdl,
+                    Buffer,
+                    Length);
+
+    Irp->MdlAddress = Mdl;
+    Irp->UserBuffer = Buffer;
+}
+
+VOID
+GenFilterSimBuildRead(_Out_ PIRP    Irp,
+                      _Out_ PMDL    Mdl,
+                      _In_ PVOID    Buffer,
+                      _In_ ULONG    Length,
+                      _In_ LONGLONG Offset)
+{
+    GenFilterSimBuildReadWrite(Irp,
+                               Mdl,
+                               IRP_MJ_READ,
+                               Buffer,
+                               Length,
+                               Offset);
+}
+
+VOID
+GenFilterSimBuildWrite(_Out_ PIRP    Irp,
+                       _Out_ PMDL    Mdl,
+                       _In_ PVOID    Buffer,
+                       _In_ ULONG    Length,
+                       _In_ LONGLONG Offset)
+{
+    GenFilterSimBuildReadWrite(Irp,
+                               Mdl,
+                               IRP_MJ_WRITE,
+                               Buffer,
+                               Length,
+                               Offset);
+}
+
+VOID
+GenFilterSimBuildDeviceControl(_Out_ PIRP Irp,
+                               _In_ ULONG IoControlCode,
+                               _In_ PVOID SystemBuffer,
+                               _In_ ULONG InputBufferLength,
+                               _In_ ULONG OutputBufferLength)
+{
+    PIO_STACK_LOCATION ioStack;
+
+    ioStack = GenFilterSimBuildIrp(Irp,
+                                   IRP_MJ_DEVICE_CONTROL);
+
+    ioStack->Parameters.DeviceIoControl.IoControlCode      = IoControlCode;
+    ioStack->Parameters.DeviceIoControl.InputBufferLength  = InputBufferLength;
+    ioStack->Parameters.DeviceIoControl.OutputBufferLength = OutputBufferLength;
+
+    Irp->AssociatedIrp.SystemBuffer = SystemBuffer;
+}
+
+NTSTATUS
+GenFilterSimSend(_In_ PDEVICE_OBJECT                DeviceObject,
+                 _Inout_ PIRP                       Irp,
+                 _In_ PGENFILTER_SIM_IRP_COMPLETION Completion,
+                 _In_opt_ PVOID                     Context)
+{
+    Irp->SimCompletion        = Completion;
+    Irp->SimCompletionContext = Context;
+
+    return IoCallDriver(DeviceObject,
+                        Irp);
+}
+
+//
+// Waiting for one IRP
+//
+typedef struct _GENFILTER_SIM_WAIT {
+    std::mutex              Lock;
+    std::condition_variable Done;
+    BOOLEAN                 Completed;
+} GENFILTER_SIM_WAIT, *PGENFILTER_SIM_WAIT;
+
+static
+VOID
+GenFilterSimWaitCompletion(_In_ PIRP       Irp,
+                           _In_opt_ PVOID  Context)
+{
+    auto*                       wait = (PGENFILTER_SIM_WAIT)Context;
+    std::lock_guard<std::mutex> lock(wait->Lock);
+
+    UNREFERENCED_PARAMETER(Irp);
+
+    wait->Completed = TRUE;
+    wait->Done.notify_one();
+}
+
+NTSTATUS
+GenFilterSimSendAndWait(_In_ PDEVICE_OBJECT DeviceObject,
+                        _Inout_ PIRP        Irp)
+{
+    GENFILTER_SIM_WAIT wait;
+
+    wait.Completed = FALSE;
+
+    (VOID)GenFilterSimSend(DeviceObject,
+                           Irp,
+                           GenFilterSimWaitCompletion,
+                           &wait);
+
+    std::unique_lock<std::mutex> lock(wait.Lock);
+
+    wait.Done.wait(lock,
+                   [&wait] { return wait.Completed != FALSE; });
+
+    return Irp->IoStatus.Status;
+}
@@ -0,0 +1,160 @@
+///
+/// @file GenFilterSim.h
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// GenFilterSim: GenFilter running in user mode on top of a shim of the
+// Framework and kernel routines it calls, in front of a simulated device.
+// This is the harness's interface, used by GenFilterSimBench and
+// GenFilterSimTest:
+//
+//  - A simulated device (GenFilterSim.cpp), which keeps its "media" in
+//    memory and completes I/O after a configurable latency.
+//
+//  - The Framework (GenFilterSimWdf.cpp): loading the driver, and adding
+//    and removing a filter device in front of a simulated device, with
+//    the registry values the filter reads its configuration from.
+//
+//  - Building IRPs and sending them to the top of the stack, as the I/O
+//    manager would for a read, write or device control from user mode.
+//
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <ntddk.h>
+#include <wdf.h>
+
+//
+// The values under a simulated device's hardware key, which is what
+// WdfDeviceOpenRegistryKey opens.  REG_DWORDs are in Values and
+// REG_MULTI_SZs in MultiStrings.
+//
+typedef struct _GENFILTER_SIM_REGISTRY {
+    std::map<std::wstring, ULONG>                     Values;
+    std::map<std::wstring, std::vector<std::wstring>> MultiStrings;
+} GENFILTER_SIM_REGISTRY, *PGENFILTER_SIM_REGISTRY;
+
+//
+// The simulated device
+//
+typedef struct _GENFILTER_SIM_TARGET* PGENFILTER_SIM_TARGET;
+
+NTSTATUS
+GenFilterSimTargetCreate(_In_ ULONG                   MediaBytes,
+                         _In_ ULONG                   LatencyUs,
+                         _Out_ PGENFILTER_SIM_TARGET* Target);
+
+VOID
+GenFilterSimTargetDelete(_In_ PGENFILTER_SIM_TARGET Target);
+
+PDEVICE_OBJECT
+GenFilterSimTargetGetDevice(_In_ PGENFILTER_SIM_TARGET Target);
+
+PUCHAR
+GenFilterSimTargetGetMedia(_In_ PGENFILTER_SIM_TARGET Target,
+                           _Out_opt_ PULONG           MediaBytes);
+
+UCHAR
+GenFilterSimTargetGetMediaByte(_In_ ULONG Offset);
+
+ULONGLONG
+GenFilterSimTargetGetRequests(_In_ PGENFILTER_SIM_TARGET Target,
+                              _In_ UCHAR                 MajorFunction);
+
+VOID
+GenFilterSimTargetSetVerify(_In_ PGENFILTER_SIM_TARGET Target,
+                            _In_ BOOLEAN               Verify);
+
+VOID
+GenFilterSimTargetFailAt(_In_ PGENFILTER_SIM_TARGET Target,
+                         _In_ LONGLONG              Offset,
+                         _In_ NTSTATUS              Status,
+                         _In_ ULONG                 Count);
+
+//
+// The Framework
+//
+NTSTATUS
+GenFilterSimDriverLoad();
+
+NTSTATUS
+GenFilterSimDeviceAdd(_In_opt_ PFN_WDF_DRIVER_DEVICE_ADD   EvtDriverDeviceAdd,
+                      _In_ PDEVICE_OBJECT                  LowerDevice,
+                      _In_opt_ const GENFILTER_SIM_REGISTRY* Registry,
+                      _Out_ WDFDEVICE*                     Device);
+
+VOID
+GenFilterSimDeviceRemove(_In_ WDFDEVICE Device);
+
+//
+// IRPs
+//
+VOID
+GenFilterSimBuildRead(_Out_ PIRP     Irp,
+                      _Out_ PMDL     Mdl,
+                      _In_ PVOID     Buffer,
+                      _In_ ULONG     Length,
+                      _In_ LONGLONG  Offset);
+
+VOID
+GenFilterSimBuildWrite(_Out_ PIRP     Irp,
+                       _Out_ PMDL     Mdl,
+                       _In_ PVOID     Buffer,
+                       _In_ ULONG     Length,
+                       _In_ LONGLONG  Offset);
+
+VOID
+GenFilterSimBuildDeviceControl(_Out_ PIRP Irp,
+                               _In_ ULONG IoControlCode,
+                               _In_ PVOID SystemBuffer,
+                               _In_ ULONG InputBufferLength,
+                               _In_ ULONG OutputBufferLength);
+
+NTSTATUS
+GenFilterSimSend(_In_ PDEVICE_OBJECT                 DeviceObject,
+                 _Inout_ PIRP                        Irp,
+                 _In_ PGENFILTER_SIM_IRP_COMPLETION  Completion,
+                 _In_opt_ PVOID                      Context);
+
+NTSTATUS
+GenFilterSimSendAndWait(_In_ PDEVICE_OBJECT DeviceObject,
+                        _Inout_ PIRP        Irp);
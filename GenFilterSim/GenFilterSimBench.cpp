@@ -0,0 +1,1313 @@
+///
+/// @file GenFilterSimBench.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// A benchmark of GenFilter's dispatch path.  Worker threads each keep a
+// fixed number of IRPs outstanding at the top of a stack, resubmitting
+// each one as it completes, and we report throughput and per-type
+// latency.  The same load can be sent:
+//
+//      filter          through GenFilter, configured as it is by default
+//      forwarding      through GenFilter's dispatcher with no policies
+//                      (GENFILTER_FORWARDING_DISPATCH)
+//      handwritten     through a filter written here, whose one Queue sends
+//                      every Request to its local I/O Target with
+//                      send-and-forget: what "forwarding" should cost
+//      passthrough     through GenFilter with PassThrough set, so IRPs go
+//                      from its preprocess routine straight to the device
+//      direct          straight to the simulated device, with no filter;
+//                      the cost of the harness itself
+//
+// With --mode cache, we instead measure GenFilter's read cache: reads only,
+// first from a working set that fits in the cache (so all but the first
+// read of each block hit) and then from the whole media (so nearly all
+// miss), and then the hits again with 1, 2, 4... up to --threads threads,
+// to see how well hits scale.
+//
+// With --latency 0 the simulated device completes everything inline, so
+// what's measured is the CPU cost of the path.
+//
+// With --record, a "filter" run is captured (see GenFilterCapture.h) and
+// written to a file in the same format "GenFilterCtl capture" writes.  With
+// --mode replay, such a file -- captured here, or from a real drive -- is
+// fed through GenFilter in front of the simulated device, each Request at
+// the time it was captured (--speed times faster), with up to --depth of
+// them outstanding.  We report the latencies seen next to those captured,
+// and how many Requests completed differently this time.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "GenFilterSim.h"
+
+#include <ntddcdrm.h>
+#include <ntdddisk.h>
+
+#include "GenFilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GENFILTER_SIM_BENCH_MEDIA_BYTES (64 * 1024 * 1024)
+
+//
+// A replay's media is made big enough for every offset in the capture, up
+// to this.  Offsets past it wrap around.
+//
+#define GENFILTER_SIM_REPLAY_MAX_MEDIA_BYTES (1024 * 1024 * 1024)
+#define GENFILTER_SIM_REPLAY_SECTOR_SIZE     2048    // The simulated device's
+
+#define GENFILTER_SIM_REPLAY_DRAIN_BYTES     (1024 * 1024)
+
+typedef std::chrono::steady_clock GENFILTER_SIM_CLOCK;
+
+//
+// What we were asked to do
+//
+typedef struct _GENFILTER_SIM_BENCH_OPTIONS {
+    std::string Mode;
+    ULONG       Threads;
+    ULONG       Depth;
+    ULONGLONG   Requests;
+    ULONG       Size;
+    ULONG       LatencyUs;
+    ULONG       Mix[3];
+    ULONG       Span;           // Offsets are within the first Span bytes
+    std::string Record;         // Capture file to write
+    std::string Trace;          // Capture file to replay
+    double      Speed;          // Replay this much faster; 0 as fast as we can
+} GENFILTER_SIM_BENCH_OPTIONS, *PGENFILTER_SIM_BENCH_OPTIONS;
+
+enum {
+    GenFilterSimBenchRead = 0,
+    GenFilterSimBenchWrite,
+    GenFilterSimBenchIoctl,
+    GenFilterSimBenchTypes
+};
+
+static const char* GenFilterSimBenchTypeNames[GenFilterSimBenchTypes] = {
+    "read",
+    "write",
+    "ioctl",
+};
+
+struct GENFILTER_SIM_BENCH_WORKER;
+
+//
+// One outstanding IRP
+//
+typedef struct _GENFILTER_SIM_BENCH_SLOT {
+    GENFILTER_SIM_BENCH_WORKER*    Worker;
+    IRP                            Irp;
+    MDL                            Mdl;
+    std::vector<UCHAR>             Buffer;
+    ULONG                          Type;
+    NTSTATUS                       Expected;    // Replay: as captured
+    GENFILTER_SIM_CLOCK::time_point Sent;
+    GENFILTER_SIM_CLOCK::time_point Completed;
+} GENFILTER_SIM_BENCH_SLOT, *PGENFILTER_SIM_BENCH_SLOT;
+
+//
+// One thread's IRPs, and the ones that have come back
+//
+struct GENFILTER_SIM_BENCH_WORKER {
+    std::vector<GENFILTER_SIM_BENCH_SLOT> Slots;
+    std::mutex                            Lock;
+    std::condition_variable               Completed;
+    std::deque<PGENFILTER_SIM_BENCH_SLOT> Done;
+    std::vector<double>                   Latencies[GenFilterSimBenchTypes];
+    ULONGLONG                             Failures;
+    ULONG                                 Seed;
+};
+
+static
+VOID
+BenchCompletion(_In_ PIRP      Irp,
+                _In_opt_ PVOID Context)
+{
+    auto*                       slot = (PGENFILTER_SIM_BENCH_SLOT)Context;
+    GENFILTER_SIM_BENCH_WORKER* worker = slot->Worker;
+
+    UNREFERENCED_PARAMETER(Irp);
+
+    slot->Completed = GENFILTER_SIM_CLOCK::now();
+
+    std::lock_guard<std::mutex> lock(worker->Lock);
+
+    worker->Done.push_back(slot);
+    worker->Completed.notify_one();
+}
+
+//
+// Build and send the slot's next IRP, of a type chosen by the mix
+//
+static
+VOID
+BenchSubmit(_In_ PGENFILTER_SIM_BENCH_OPTIONS Options,
+            _In_ PDEVICE_OBJECT               Top,
+            _In_ PGENFILTER_SIM_BENCH_SLOT    Slot)
+{
+    GENFILTER_SIM_BENCH_WORKER* worker = Slot->Worker;
+    ULONG                       total;
+    ULONG                       pick;
+    LONGLONG                    offset;
+
+    worker->Seed = worker->Seed * 1103515245 + 12345;
+
+    total = Options->Mix[0] + Options->Mix[1] + Options->Mix[2];
+    pick  = (worker->Seed >> 8) % total;
+
+    offset = (LONGLONG)((worker->Seed >> 4) %
+                        (Options->Span / Options->Size)) * Options->Size;
+
+    if (pick < Options->Mix[0]) {
+
+        Slot->Type = GenFilterSimBenchRead;
+
+        GenFilterSimBuildRead(&Slot->Irp,
+                              &Slot->Mdl,
+                              Slot->Buffer.data(),
+                              Options->Size,
+                              offset);
+
+    } else if (pick < Options->Mix[0] + Options->Mix[1]) {
+
+        Slot->Type = GenFilterSimBenchWrite;
+
+        GenFilterSimBuildWrite(&Slot->Irp,
+                               &Slot->Mdl,
+                               Slot->Buffer.data(),
+                               Options->Size,
+                               offset);
+
+    } else {
+
+        Slot->Type = GenFilterSimBenchIoctl;
+
+        GenFilterSimBuildDeviceControl(&Slot->Irp,
+                                       IOCTL_CDROM_CHECK_VERIFY,
+                                       Slot->Buffer.data(),
+                                       0,
+                                       sizeof(ULONG));
+    }
+
+    Slot->Sent = GENFILTER_SIM_CLOCK::now();
+
+    (VOID)GenFilterSimSend(Top,
+                           &Slot->Irp,
+                           BenchCompletion,
+                           Slot);
+}
+
+//
+// Keep Depth IRPs outstanding until we've sent our share
+//
+static
+VOID
+BenchWorker(_In_ PGENFILTER_SIM_BENCH_OPTIONS Options,
+            _In_ PDEVICE_OBJECT               Top,
+            _In_ GENFILTER_SIM_BENCH_WORKER*  Worker,
+            _In_ ULONGLONG                    Requests)
+{
+    ULONGLONG sent        = 0;
+    ULONGLONG outstanding = 0;
+
+    for (auto& slot : Worker->Slots) {
+
+        if (sent == Requests) {
+            break;
+        }
+
+        sent++;
+        outstanding++;
+
+        BenchSubmit(Options,
+                    Top,
+                    &slot);
+    }
+
+    while (outstanding != 0) {
+
+        std::deque<PGENFILTER_SIM_BENCH_SLOT> done;
+
+        {
+            std::unique_lock<std::mutex> lock(Worker->Lock);
+
+            Worker->Completed.wait(lock,
+                                   [Worker] { return !Worker->Done.empty(); });
+
+            done.swap(Worker->Done);
+        }
+
+        for (PGENFILTER_SIM_BENCH_SLOT slot : done) {
+
+            outstanding--;
+
+            if (!NT_SUCCESS(slot->Irp.IoStatus.Status)) {
+                Worker->Failures++;
+            }
+
+            Worker->Latencies[slot->Type].push_back(
+                std::chrono::duration<double, std::micro>(slot->Completed - slot->Sent).count());
+
+            if (sent < Requests) {
+
+                sent++;
+                outstanding++;
+
+                BenchSubmit(Options,
+                            Top,
+                            slot);
+            }
+        }
+    }
+}
+
+//
+// The hand-written filter: a default Queue whose Requests are all sent on
+// with send-and-forget, as the simplest KMDF filter would
+//
+static EVT_WDF_IO_QUEUE_IO_DEFAULT HandwrittenEvtIoDefault;
+
+static
+VOID
+HandwrittenEvtIoDefault(_In_ WDFQUEUE   Queue,
+                        _In_ WDFREQUEST Request)
+{
+    WDF_REQUEST_SEND_OPTIONS sendOpts;
+
+    WDF_REQUEST_SEND_OPTIONS_INIT(&sendOpts,
+                                  WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+
+    if (!WdfRequestSend(Request,
+                        WdfDeviceGetIoTarget(WdfIoQueueGetDevice(Queue)),
+                        &sendOpts)) {
+        WdfRequestComplete(Request,
+                           WdfRequestGetStatus(Request));
+    }
+}
+
+static
+NTSTATUS
+HandwrittenEvtDeviceAdd(_In_ WDFDRIVER          Driver,
+                        _Inout_ PWDFDEVICE_INIT DeviceInit)
+{
+    WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    WDFDEVICE           device;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(Driver);
+
+    WdfFdoInitSetFilter(DeviceInit);
+
+    status = WdfDeviceCreate(&DeviceInit,
+                             WDF_NO_OBJECT_ATTRIBUTES,
+                             &device);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig,
+                                           WdfIoQueueDispatchParallel);
+
+    ioQueueConfig.EvtIoDefault = HandwrittenEvtIoDefault;
+
+    return WdfIoQueueCreate(device,
+                            &ioQueueConfig,
+                            WDF_NO_OBJECT_ATTRIBUTES,
+                            WDF_NO_HANDLE);
+}
+
+//
+// Build a device control whose input and output are both in Buffer.  For
+// METHOD_IN_DIRECT and METHOD_OUT_DIRECT codes the output is described by
+// Mdl, as the I/O manager would.
+//
+static
+VOID
+BenchBuildDeviceControl(_Out_ PIRP Irp,
+                        _Out_ PMDL Mdl,
+                        _In_ ULONG IoControlCode,
+                        _In_ PVOID Buffer,
+                        _In_ ULONG InputLength,
+                        _In_ ULONG OutputLength)
+{
+    GenFilterSimBuildDeviceControl(Irp,
+                                   IoControlCode,
+                                   Buffer,
+                                   InputLength,
+                                   OutputLength);
+
+    if (METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_IN_DIRECT ||
+        METHOD_FROM_CTL_CODE(IoControlCode) == METHOD_OUT_DIRECT) {
+
+        MmInitializeMdl(Mdl,
+                        Buffer,
+                        OutputLength);
+
+        Irp->MdlAddress = Mdl;
+    }
+}
+
+//
+// Send one device control to the top of the stack and wait for it
+//
+static
+NTSTATUS
+BenchDeviceControl(_In_ PDEVICE_OBJECT Top,
+                   _In_ ULONG          IoControlCode,
+                   _In_ PVOID          Buffer,
+                   _In_ ULONG          OutputLength)
+{
+    IRP irp;
+    MDL mdl;
+
+    BenchBuildDeviceControl(&irp,
+                            &mdl,
+                            IoControlCode,
+                            Buffer,
+                            0,
+                            OutputLength);
+
+    return GenFilterSimSendAndWait(Top,
+                                   &irp);
+}
+
+//
+// Print the count, mean, median and 99th percentile of one type's
+// Latencies (in microseconds), if there are any
+//
+static
+VOID
+BenchPrintLatencies(_In_ ULONG                Type,
+                    _Inout_ std::vector<double>& Latencies)
+{
+    double sum = 0;
+
+    if (Latencies.empty()) {
+        return;
+    }
+
+    std::sort(Latencies.begin(),
+              Latencies.end());
+
+    for (double latency : Latencies) {
+        sum += latency;
+    }
+
+    printf("    %-6s %10zu  mean %8.2f us  p50 %8.2f us  p99 %8.2f us\n",
+           GenFilterSimBenchTypeNames[Type],
+           Latencies.size(),
+           sum / Latencies.size(),
+           Latencies[Latencies.size() / 2],
+           Latencies[(Latencies.size() * 99) / 100]);
+}
+
+//
+// As a file system would when it mounts the media.  This is also what
+// tells GenFilter's read cache the sector size.
+//
+static
+VOID
+BenchMount(_In_ PDEVICE_OBJECT Top)
+{
+    DISK_GEOMETRY geometry;
+    NTSTATUS      status;
+
+    status = BenchDeviceControl(Top,
+                                IOCTL_CDROM_GET_DRIVE_GEOMETRY,
+                                &geometry,
+                                sizeof(geometry));
+
+    if (!NT_SUCCESS(status)) {
+        printf("IOCTL_CDROM_GET_DRIVE_GEOMETRY failed - 0x%x\n",
+               status);
+    }
+}
+
+//
+// Drain the filter's capture into Path, as "GenFilterCtl capture" does: a
+// GENFILTER_CAPTURE_HEADER and its records for each buffer drained
+//
+static
+bool
+BenchSaveCapture(_In_ PDEVICE_OBJECT     Top,
+                 _In_ const std::string& Path)
+{
+    std::vector<UCHAR> buffer(GENFILTER_SIM_REPLAY_DRAIN_BYTES);
+    auto*              header  = (PGENFILTER_CAPTURE_HEADER)buffer.data();
+    ULONGLONG          records = 0;
+    ULONGLONG          lost    = 0;
+    FILE*              file;
+    NTSTATUS           status;
+
+    file = fopen(Path.c_str(),
+                 "wb");
+
+    if (file == nullptr) {
+        printf("Can't create %s\n",
+               Path.c_str());
+        return false;
+    }
+
+    for (;;) {
+
+        size_t length;
+
+        status = BenchDeviceControl(Top,
+                                    IOCTL_GENFILTER_DRAIN_CAPTURE,
+                                    buffer.data(),
+                                    (ULONG)buffer.size());
+
+        if (!NT_SUCCESS(status) || header->Enabled == 0) {
+            printf("IOCTL_GENFILTER_DRAIN_CAPTURE failed - 0x%x\n",
+                   status);
+            fclose(file);
+            return false;
+        }
+
+        lost += header->LostRecords;
+
+        if (header->RecordCount == 0) {
+            break;
+        }
+
+        records += header->RecordCount;
+        length   = header->Size + ((size_t)header->RecordCount * header->RecordSize);
+
+        if (fwrite(buffer.data(),
+                   1,
+                   length,
+                   file) != length) {
+            printf("Can't write %s\n",
+                   Path.c_str());
+            fclose(file);
+            return false;
+        }
+    }
+
+    fclose(file);
+
+    printf("    %llu records captured to %s, %llu lost\n",
+           records,
+           Path.c_str(),
+           lost);
+
+    return true;
+}
+
+//
+// Run the load against one stack and print what we saw, under Label if
+// there is one and Mode if not
+//
+static
+bool
+BenchRun(_In_ PGENFILTER_SIM_BENCH_OPTIONS Options,
+         _In_ const std::string&           Mode,
+         _In_opt_ const char*              Label = nullptr,
+         _Out_opt_ double*                 RequestsPerSecond = nullptr,
+         _Out_opt_ PGENFILTER_STATISTICS   Statistics = nullptr)
+{
+    PGENFILTER_SIM_TARGET   target;
+    GENFILTER_SIM_REGISTRY  registry;
+    WDFDEVICE               device = nullptr;
+    PDEVICE_OBJECT          top;
+    NTSTATUS                status;
+    std::vector<std::unique_ptr<GENFILTER_SIM_BENCH_WORKER>> workers;
+    std::vector<std::thread> threads;
+    ULONGLONG               failures = 0;
+
+    status = GenFilterSimTargetCreate(GENFILTER_SIM_BENCH_MEDIA_BYTES,
+                                      Options->LatencyUs,
+                                      &target);
+
+    if (!NT_SUCCESS(status)) {
+        printf("GenFilterSimTargetCreate failed - 0x%x\n",
+               status);
+        return false;
+    }
+
+    if (Mode == "direct") {
+
+        top = GenFilterSimTargetGetDevice(target);
+
+    } else {
+
+        PFN_WDF_DRIVER_DEVICE_ADD deviceAdd = nullptr;
+
+        if (!Options->Record.empty()) {
+            registry.Values[L"Capture"] = 1;
+        }
+
+        if (Mode == "passthrough") {
+            registry.Values[L"PassThrough"] = 1;
+        } else if (Mode == "forwarding") {
+            deviceAdd = GenFilterForwardingEvtDeviceAdd;
+        } else if (Mode == "handwritten") {
+            deviceAdd = HandwrittenEvtDeviceAdd;
+        }
+
+        status = GenFilterSimDeviceAdd(deviceAdd,
+                                       GenFilterSimTargetGetDevice(target),
+                                       &registry,
+                                       &device);
+
+        if (!NT_SUCCESS(status)) {
+            printf("GenFilterSimDeviceAdd failed - 0x%x\n",
+                   status);
+            GenFilterSimTargetDelete(target);
+            return false;
+        }
+
+        top = WdfDeviceWdmGetDeviceObject(device);
+    }
+
+    BenchMount(top);
+
+    for (ULONG index = 0; index < Options->Threads; index++) {
+
+        workers.emplace_back(new GENFILTER_SIM_BENCH_WORKER);
+
+        workers.back()->Slots.resize(Options->Depth);
+        workers.back()->Failures = 0;
+        workers.back()->Seed     = 0x9E3779B9 * (index + 1);
+
+        for (auto& slot : workers.back()->Slots) {
+            slot.Worker = workers.back().get();
+            slot.Buffer.resize((std::max)(Options->Size, (ULONG)sizeof(ULONG)));
+        }
+    }
+
+    auto start = GENFILTER_SIM_CLOCK::now();
+
+    for (ULONG index = 0; index < Options->Threads; index++) {
+
+        ULONGLONG share = Options->Requests / Options->Threads +
+                          ((index < Options->Requests % Options->Threads) ? 1 : 0);
+
+        threads.emplace_back(BenchWorker,
+                             Options,
+                             top,
+                             workers[index].get(),
+                             share);
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(GENFILTER_SIM_CLOCK::now() - start).count();
+
+    printf("%-12s %12.0f requests/s\n",
+           (Label != nullptr) ? Label : Mode.c_str(),
+           Options->Requests / seconds);
+
+    if (RequestsPerSecond != nullptr) {
+        *RequestsPerSecond = Options->Requests / seconds;
+    }
+
+    for (ULONG type = 0; type < GenFilterSimBenchTypes; type++) {
+
+        std::vector<double> latencies;
+
+        for (auto& worker : workers) {
+            latencies.insert(latencies.end(),
+                             worker->Latencies[type].begin(),
+                             worker->Latencies[type].end());
+        }
+
+        BenchPrintLatencies(type,
+                            latencies);
+    }
+
+    for (auto& worker : workers) {
+        failures += worker->Failures;
+    }
+
+    if (failures != 0) {
+        printf("    %llu requests failed\n",
+               failures);
+    }
+
+    if (!Options->Record.empty() &&
+        !BenchSaveCapture(top,
+                          Options->Record)) {
+        failures++;
+    }
+
+    if (Statistics != nullptr &&
+        !NT_SUCCESS(BenchDeviceControl(top,
+                                       IOCTL_GENFILTER_GET_STATISTICS,
+                                       Statistics,
+                                       sizeof(GENFILTER_STATISTICS)))) {
+        RtlZeroMemory(Statistics,
+                      sizeof(GENFILTER_STATISTICS));
+    }
+
+    if (device != nullptr) {
+        GenFilterSimDeviceRemove(device);
+    }
+
+    GenFilterSimTargetDelete(target);
+
+    return (failures == 0);
+}
+
+//
+// The read cache: hits, misses, and how hits scale with threads
+//
+static
+bool
+BenchCache(_In_ PGENFILTER_SIM_BENCH_OPTIONS Options)
+{
+    GENFILTER_SIM_BENCH_OPTIONS run = *Options;
+    GENFILTER_STATISTICS        statistics;
+    bool                        ok = true;
+    double                      single = 0;
+
+    run.Mix[0] = 1;
+    run.Mix[1] = 0;
+    run.Mix[2] = 0;
+
+    static const struct {
+        const char* Label;
+        ULONG       Span;
+    } spans[] = {
+        { "cache-hit",  GENFILTER_CACHE_BLOCK_COUNT * GENFILTER_CACHE_BLOCK_SIZE / 2 },
+        { "cache-miss", GENFILTER_SIM_BENCH_MEDIA_BYTES },
+    };
+
+    for (const auto& span : spans) {
+
+        run.Span = (std::max)(span.Span,
+                              run.Size);
+
+        ok = BenchRun(&run,
+                      "filter",
+                      span.Label,
+                      nullptr,
+                      &statistics) && ok;
+
+        printf("    %llu hits, %llu misses\n",
+               (ULONGLONG)statistics.Counters[GenFilterStatCacheHits],
+               (ULONGLONG)statistics.Counters[GenFilterStatCacheMisses]);
+    }
+
+    run.Span = (std::max)(spans[0].Span,
+                          run.Size);
+
+    for (ULONG threads = 1; threads <= Options->Threads; threads *= 2) {
+
+        char   label[32];
+        double requestsPerSecond = 0;
+
+        snprintf(label,
+                 sizeof(label),
+                 "hit x%u",
+                 threads);
+
+        run.Threads = threads;
+
+        ok = BenchRun(&run,
+                      "filter",
+                      label,
+                      &requestsPerSecond) && ok;
+
+        if (threads == 1) {
+            single = requestsPerSecond;
+        } else if (single != 0) {
+            printf("    %.2fx one thread's throughput\n",
+                   requestsPerSecond / single);
+        }
+    }
+
+    return ok;
+}
+
+//
+// Read a capture file: a sequence of drained buffers, each a
+// GENFILTER_CAPTURE_HEADER followed by its records.  The records from every
+// buffer are merged and put in the order the filter was given them, as
+// "GenFilterCtl replay" does.
+//
+static
+bool
+BenchLoadCapture(_In_ const std::string&                    Path,
+                 _Out_ std::vector<GENFILTER_CAPTURE_RECORD>& Records,
+                 _Out_ ULONGLONG*                            Frequency,
+                 _Out_ ULONGLONG*                            Lost)
+{
+    std::vector<UCHAR> contents;
+    size_t             offset = 0;
+    FILE*              file;
+    long               length;
+
+    Records.clear();
+
+    *Frequency = 0;
+    *Lost      = 0;
+
+    file = fopen(Path.c_str(),
+                 "rb");
+
+    if (file == nullptr) {
+        printf("Can't open %s\n",
+               Path.c_str());
+        return false;
+    }
+
+    if (fseek(file, 0, SEEK_END) != 0 ||
+        (length = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) != 0) {
+        printf("Can't read %s\n",
+               Path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    contents.resize((size_t)length);
+
+    if (fread(contents.data(),
+              1,
+              contents.size(),
+              file) != contents.size()) {
+        printf("Can't read %s\n",
+               Path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    fclose(file);
+
+    while (offset + sizeof(GENFILTER_CAPTURE_HEADER) <= contents.size()) {
+
+        GENFILTER_CAPTURE_HEADER header;
+        size_t                   chunkLength;
+
+        memcpy(&header,
+               &contents[offset],
+               sizeof(header));
+
+        chunkLength = header.Size +
+                      ((size_t)header.RecordCount * header.RecordSize);
+
+        if (header.Size < sizeof(GENFILTER_CAPTURE_HEADER) ||
+            header.RecordSize < sizeof(GENFILTER_CAPTURE_RECORD) ||
+            offset + chunkLength > contents.size()) {
+
+            printf("Malformed capture data at offset %zu\n",
+                   offset);
+            return false;
+        }
+
+        *Frequency = header.Frequency;
+        *Lost     += header.LostRecords;
+
+        for (ULONG index = 0; index < header.RecordCount; index++) {
+
+            GENFILTER_CAPTURE_RECORD record;
+
+            memcpy(&record,
+                   &contents[offset + header.Size + ((size_t)index * header.RecordSize)],
+                   sizeof(record));
+
+            Records.push_back(record);
+        }
+
+        offset += chunkLength;
+    }
+
+    std::stable_sort(Records.begin(),
+                     Records.end(),
+                     [](const GENFILTER_CAPTURE_RECORD& Left,
+                        const GENFILTER_CAPTURE_RECORD& Right) {
+                         return Left.IssueTime < Right.IssueTime;
+                     });
+
+    return (*Frequency != 0 || Records.empty());
+}
+
+//
+// Feed a capture through GenFilter in front of the simulated device, and
+// print what we saw next to what was captured
+//
+static
+bool
+BenchReplay(_In_ PGENFILTER_SIM_BENCH_OPTIONS Options)
+{
+    std::vector<GENFILTER_CAPTURE_RECORD> records;
+    ULONGLONG                             frequency;
+    ULONGLONG                             lost;
+    ULONGLONG                             mediaBytes = GENFILTER_SIM_BENCH_MEDIA_BYTES;
+    ULONG                                 bufferLength = sizeof(ULONG);
+    PGENFILTER_SIM_TARGET                 target;
+    GENFILTER_SIM_REGISTRY                registry;
+    WDFDEVICE                             device;
+    PDEVICE_OBJECT                        top;
+    NTSTATUS                              status;
+    GENFILTER_SIM_BENCH_WORKER            worker;
+    std::vector<PGENFILTER_SIM_BENCH_SLOT> free;
+    std::vector<double>                   captured[GenFilterSimBenchTypes];
+    GENFILTER_STATISTICS                  statistics;
+    ULONGLONG                             sent       = 0;
+    ULONGLONG                             skipped    = 0;
+    ULONGLONG                             wrapped    = 0;
+    ULONGLONG                             mismatched = 0;
+
+    if (!BenchLoadCapture(Options->Trace,
+                          records,
+                          &frequency,
+                          &lost)) {
+        return false;
+    }
+
+    if (records.empty()) {
+        printf("%s has no records\n",
+               Options->Trace.c_str());
+        return false;
+    }
+
+    //
+    // Enough media for everything the capture touched, and buffers for the
+    // largest transfer
+    //
+    for (const auto& record : records) {
+
+        if (record.Type != GenFilterCaptureDeviceControl) {
+            mediaBytes = (std::max)(mediaBytes,
+                                    record.Offset + record.Length);
+        }
+
+        bufferLength = (std::max)(bufferLength,
+                                  (std::max)(record.Length,
+                                             record.InputLength));
+    }
+
+    mediaBytes = (std::min)((ULONGLONG)GENFILTER_SIM_REPLAY_MAX_MEDIA_BYTES,
+                            (mediaBytes + GENFILTER_SIM_REPLAY_SECTOR_SIZE - 1) &
+                            ~(ULONGLONG)(GENFILTER_SIM_REPLAY_SECTOR_SIZE - 1));
+
+    status = GenFilterSimTargetCreate((ULONG)mediaBytes,
+                                      Options->LatencyUs,
+                                      &target);
+
+    if (!NT_SUCCESS(status)) {
+        printf("GenFilterSimTargetCreate failed - 0x%x\n",
+               status);
+        return false;
+    }
+
+    status = GenFilterSimDeviceAdd(nullptr,
+                                   GenFilterSimTargetGetDevice(target),
+                                   &registry,
+                                   &device);
+
+    if (!NT_SUCCESS(status)) {
+        printf("GenFilterSimDeviceAdd failed - 0x%x\n",
+               status);
+        GenFilterSimTargetDelete(target);
+        return false;
+    }
+
+    top = WdfDeviceWdmGetDeviceObject(device);
+
+    BenchMount(top);
+
+    worker.Slots.resize(Options->Depth);
+    worker.Failures = 0;
+    worker.Seed     = 0;
+
+    for (auto& slot : worker.Slots) {
+        slot.Worker = &worker;
+        slot.Buffer.resize(bufferLength);
+        free.push_back(&slot);
+    }
+
+    //
+    // Collect the Requests that have completed, waiting for one if Wait
+    //
+    auto harvest = [&worker, &free, &mismatched](bool Wait) {
+
+        std::deque<PGENFILTER_SIM_BENCH_SLOT> done;
+
+        {
+            std::unique_lock<std::mutex> lock(worker.Lock);
+
+            if (Wait) {
+                worker.Completed.wait(lock,
+                                      [&worker] { return !worker.Done.empty(); });
+            }
+
+            done.swap(worker.Done);
+        }
+
+        for (PGENFILTER_SIM_BENCH_SLOT slot : done) {
+
+            if (slot->Irp.IoStatus.Status != slot->Expected) {
+                mismatched++;
+            }
+
+            worker.Latencies[slot->Type].push_back(
+                std::chrono::duration<double, std::micro>(slot->Completed - slot->Sent).count());
+
+            free.push_back(slot);
+        }
+    };
+
+    auto start = GENFILTER_SIM_CLOCK::now();
+
+    for (const auto& record : records) {
+
+        PGENFILTER_SIM_BENCH_SLOT slot;
+        LONGLONG                  offset = (LONGLONG)record.Offset;
+
+        //
+        // Our own IOCTLs are the tools talking to the filter, not load
+        //
+        if (record.Type < GenFilterCaptureRead ||
+            record.Type > GenFilterCaptureDeviceControl ||
+            (record.Type == GenFilterCaptureDeviceControl &&
+             GenFilterIsPrivateIoctl(record.IoControlCode))) {
+            skipped++;
+            continue;
+        }
+
+        if (Options->Speed > 0) {
+
+            double due = (double)(record.IssueTime - records[0].IssueTime) /
+                         (double)frequency / Options->Speed;
+
+            std::this_thread::sleep_until(start +
+                                          std::chrono::duration_cast<GENFILTER_SIM_CLOCK::duration>(
+                                              std::chrono::duration<double>(due)));
+        }
+
+        harvest(free.empty());
+
+        slot = free.back();
+        free.pop_back();
+
+        slot->Type     = record.Type - GenFilterCaptureRead;
+        slot->Expected = record.Status;
+
+        captured[slot->Type].push_back((double)(record.CompletionTime - record.IssueTime) *
+                                       1000000.0 / (double)frequency);
+
+        if (record.Type != GenFilterCaptureDeviceControl &&
+            record.Offset + record.Length > mediaBytes) {
+
+            offset = (LONGLONG)((record.Offset % mediaBytes) &
+                                ~(ULONGLONG)(GENFILTER_SIM_REPLAY_SECTOR_SIZE - 1));
+            wrapped++;
+        }
+
+        if (record.Type == GenFilterCaptureRead) {
+
+            GenFilterSimBuildRead(&slot->Irp,
+                                  &slot->Mdl,
+                                  slot->Buffer.data(),
+                                  record.Length,
+                                  offset);
+
+        } else if (record.Type == GenFilterCaptureWrite) {
+
+            GenFilterSimBuildWrite(&slot->Irp,
+                                   &slot->Mdl,
+                                   slot->Buffer.data(),
+                                   record.Length,
+                                   offset);
+
+        } else {
+
+            //
+            // We don't have what was in the input buffer, only how big it was
+            //
+            memset(slot->Buffer.data(),
+                   0,
+                   slot->Buffer.size());
+
+            BenchBuildDeviceControl(&slot->Irp,
+                                    &slot->Mdl,
+                                    record.IoControlCode,
+                                    slot->Buffer.data(),
+                                    record.InputLength,
+                                    record.Length);
+        }
+
+        sent++;
+
+        slot->Sent = GENFILTER_SIM_CLOCK::now();
+
+        (VOID)GenFilterSimSend(top,
+                               &slot->Irp,
+                               BenchCompletion,
+                               slot);
+    }
+
+    while (free.size() != worker.Slots.size()) {
+        harvest(true);
+    }
+
+    double seconds = std::chrono::duration<double>(GENFILTER_SIM_CLOCK::now() - start).count();
+
+    printf("%-12s %12.0f requests/s\n",
+           "replay",
+           sent / seconds);
+
+    for (ULONG type = 0; type < GenFilterSimBenchTypes; type++) {
+
+        BenchPrintLatencies(type,
+                            worker.Latencies[type]);
+    }
+
+    printf("  as captured (over %.3f s)\n",
+           (double)(records.back().IssueTime - records[0].IssueTime) / (double)frequency);
+
+    for (ULONG type = 0; type < GenFilterSimBenchTypes; type++) {
+
+        BenchPrintLatencies(type,
+                            captured[type]);
+    }
+
+    printf("    %llu replayed, %llu with a different status than captured\n",
+           sent,
+           mismatched);
+
+    if (skipped != 0 || wrapped != 0 || lost != 0) {
+        printf("    %llu skipped, %llu wrapped onto %llu bytes of media, %llu lost from the capture\n",
+               skipped,
+               wrapped,
+               mediaBytes,
+               lost);
+    }
+
+    if (NT_SUCCESS(BenchDeviceControl(top,
+                                      IOCTL_GENFILTER_GET_STATISTICS,
+                                      &statistics,
+                                      sizeof(statistics)))) {
+        printf("    %llu cache hits, %llu misses; %llu reads, %llu writes and %llu IOCTLs reached the device\n",
+               (ULONGLONG)statistics.Counters[GenFilterStatCacheHits],
+               (ULONGLONG)statistics.Counters[GenFilterStatCacheMisses],
+               GenFilterSimTargetGetRequests(target,
+                                             IRP_MJ_READ),
+               GenFilterSimTargetGetRequests(target,
+                                             IRP_MJ_WRITE),
+               GenFilterSimTargetGetRequests(target,
+                                             IRP_MJ_DEVICE_CONTROL));
+    }
+
+    GenFilterSimDeviceRemove(device);
+    GenFilterSimTargetDelete(target);
+
+    return true;
+}
+
+static
+void
+Usage()
+{
+    printf("Usage: GenFilterSimBench [options]\n"
+           "    --mode filter|forwarding|handwritten|passthrough|direct|all|cache|replay (filter)\n"
+           "    --threads N                             (4)\n"
+           "    --depth N        IRPs outstanding per thread (16)\n"
+           "    --requests N                            (1000000)\n"
+           "    --size N         bytes per read or write (2048)\n"
+           "    --latency N      device latency in microseconds (0)\n"
+           "    --mix R:W:I      read, write and IOCTL weights (70:20:10)\n"
+           "    --record FILE    capture a filter run to FILE\n"
+           "    --trace FILE     the capture --mode replay replays\n"
+           "    --speed X        replay X times faster than captured; 0 as fast as --depth allows (1)\n");
+}
+
+int
+main(int    argc,
+     char** argv)
+{
+    GENFILTER_SIM_BENCH_OPTIONS options;
+    NTSTATUS                    status;
+    bool                        ok = true;
+
+    options.Mode      = "filter";
+    options.Threads   = 4;
+    options.Depth     = 16;
+    options.Requests  = 1000000;
+    options.Size      = 2048;
+    options.LatencyUs = 0;
+    options.Mix[0]    = 70;
+    options.Mix[1]    = 20;
+    options.Mix[2]    = 10;
+    options.Span      = GENFILTER_SIM_BENCH_MEDIA_BYTES;
+    options.Speed     = 1.0;
+
+    for (int index = 1; index < argc; index++) {
+
+        const char* value = (index + 1 < argc) ? argv[index + 1] : nullptr;
+
+        if (strcmp(argv[index], "--help") == 0 ||
+            value == nullptr) {
+            Usage();
+            return (strcmp(argv[index], "--help") == 0) ? 0 : 1;
+        }
+
+        if (strcmp(argv[index], "--mode") == 0) {
+            options.Mode = value;
+        } else if (strcmp(argv[index], "--threads") == 0) {
+            options.Threads = strtoul(value, nullptr, 0);
+        } else if (strcmp(argv[index], "--depth") == 0) {
+            options.Depth = strtoul(value, nullptr, 0);
+        } else if (strcmp(argv[index], "--requests") == 0) {
+            options.Requests = strtoull(value, nullptr, 0);
+        } else if (strcmp(argv[index], "--size") == 0) {
+            options.Size = strtoul(value, nullptr, 0);
+        } else if (strcmp(argv[index], "--latency") == 0) {
+            options.LatencyUs = strtoul(value, nullptr, 0);
+        } else if (strcmp(argv[index], "--record") == 0) {
+            options.Record = value;
+        } else if (strcmp(argv[index], "--trace") == 0) {
+            options.Trace = value;
+        } else if (strcmp(argv[index], "--speed") == 0) {
+            options.Speed = strtod(value, nullptr);
+        } else if (strcmp(argv[index], "--mix") == 0) {
+            if (sscanf(value,
+                       "%u:%u:%u",
+                       &options.Mix[0],
+                       &options.Mix[1],
+                       &options.Mix[2]) != 3) {
+                Usage();
+                return 1;
+            }
+        } else {
+            Usage();
+            return 1;
+        }
+
+        index++;
+    }
+
+    if (options.Threads == 0 ||
+        options.Depth == 0 ||
+        options.Size == 0 ||
+        options.Size > GENFILTER_SIM_BENCH_MEDIA_BYTES ||
+        options.Mix[0] + options.Mix[1] + options.Mix[2] == 0 ||
+        options.Speed < 0 ||
+        (!options.Record.empty() && options.Mode != "filter") ||
+        (options.Mode == "replay") != !options.Trace.empty()) {
+        Usage();
+        return 1;
+    }
+
+    status = GenFilterSimDriverLoad();
+
+    if (!NT_SUCCESS(status)) {
+        printf("DriverEntry failed - 0x%x\n",
+               status);
+        return 1;
+    }
+
+    if (options.Mode == "replay") {
+
+        printf("%s at %gx (0: as fast as it'll go), depth %u, latency %u us\n",
+               options.Trace.c_str(),
+               options.Speed,
+               options.Depth,
+               options.LatencyUs);
+
+        return BenchReplay(&options) ? 0 : 1;
+    }
+
+    printf("%u threads, depth %u, %llu requests of %u bytes, mix %u:%u:%u, latency %u us\n",
+           options.Threads,
+           options.Depth,
+           options.Requests,
+           options.Size,
+           options.Mix[0],
+           options.Mix[1],
+           options.Mix[2],
+           options.LatencyUs);
+
+    if (options.Mode == "all") {
+
+        double handwritten = 0;
+        double forwarding  = 0;
+
+        ok = BenchRun(&options, "direct") && ok;
+        ok = BenchRun(&options, "handwritten", nullptr, &handwritten) && ok;
+        ok = BenchRun(&options, "forwarding", nullptr, &forwarding) && ok;
+        ok = BenchRun(&options, "passthrough") && ok;
+        ok = BenchRun(&options, "filter") && ok;
+
+        //
+        // How the dispatcher with no policies does against the hand-written
+        // filter
+        //
+        if (handwritten != 0) {
+            printf("forwarding runs at %.1f%% of handwritten's throughput\n",
+                   100.0 * forwarding / handwritten);
+        }
+
+    } else if (options.Mode == "cache") {
+
+        ok = BenchCache(&options);
+
+    } else if (options.Mode == "filter" ||
+               options.Mode == "forwarding" ||
+               options.Mode == "handwritten" ||
+               options.Mode == "passthrough" ||
+               options.Mode == "direct") {
+
+        ok = BenchRun(&options,
+                      options.Mode);
+
+    } else {
+        Usage();
+        return 1;
+    }
+
+    return ok ? 0 : 1;
+}
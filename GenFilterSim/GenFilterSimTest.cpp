@@ -0,0 +1,1676 @@
+///
+/// @file GenFilterSimTest.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// Tests of GenFilter running under GenFilterSim.  Each test adds a filter
+// device in front of a simulated device, sends it IRPs, checks what comes
+// back (and what the device below saw), and removes it again.
+//
+// Usage:
+//
+//      GenFilterSimTest            runs every test
+//      GenFilterSimTest <test>     runs one
+//
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "GenFilterSim.h"
+
+#include <ntddcdrm.h>
+#include <ntdddisk.h>
+
+#include "GenFilter.h"
+#include "GenFilterRing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GENFILTER_SIM_TEST_MEDIA_BYTES (16 * 1024 * 1024)
+
+#define CHECK(_condition)                                         \
+    do {                                                          \
+        if (!(_condition)) {                                      \
+            printf("    FAILED: %s (%s:%d)\n",                    \
+                   #_condition,                                   \
+                   __FILE__,                                      \
+                   __LINE__);                                     \
+            return false;                                         \
+        }                                                         \
+    } while (0)
+
+//
+// A filter device in front of a simulated device
+//
+typedef struct _GENFILTER_SIM_STACK {
+    PGENFILTER_SIM_TARGET Target;
+    WDFDEVICE             Device;
+    PDEVICE_OBJECT        Top;
+} GENFILTER_SIM_STACK, *PGENFILTER_SIM_STACK;
+
+static
+bool
+StackCreate(PGENFILTER_SIM_STACK          Stack,
+            const GENFILTER_SIM_REGISTRY* Registry,
+            ULONG                         LatencyUs = 0,
+            PFN_WDF_DRIVER_DEVICE_ADD     DeviceAdd = nullptr)
+{
+    NTSTATUS status;
+
+    status = GenFilterSimTargetCreate(GENFILTER_SIM_TEST_MEDIA_BYTES,
+                                      LatencyUs,
+                                      &Stack->Target);
+
+    if (!NT_SUCCESS(status)) {
+        printf("    GenFilterSimTargetCreate failed - 0x%x\n",
+               status);
+        return false;
+    }
+
+    status = GenFilterSimDeviceAdd(DeviceAdd,
+                                   GenFilterSimTargetGetDevice(Stack->Target),
+                                   Registry,
+                                   &Stack->Device);
+
+    if (!NT_SUCCESS(status)) {
+        printf("    GenFilterSimDeviceAdd failed - 0x%x\n",
+               status);
+        GenFilterSimTargetDelete(Stack->Target);
+        return false;
+    }
+
+    Stack->Top = WdfDeviceWdmGetDeviceObject(Stack->Device);
+
+    return true;
+}
+
+static
+void
+StackDelete(PGENFILTER_SIM_STACK Stack)
+{
+    GenFilterSimDeviceRemove(Stack->Device);
+    GenFilterSimTargetDelete(Stack->Target);
+}
+
+static
+NTSTATUS
+Read(PGENFILTER_SIM_STACK Stack,
+     PVOID                Buffer,
+     ULONG                Length,
+     LONGLONG             Offset,
+     PULONG_PTR           Information)
+{
+    IRP      irp;
+    MDL      mdl;
+    NTSTATUS status;
+
+    GenFilterSimBuildRead(&irp,
+                          &mdl,
+                          Buffer,
+                          Length,
+                          Offset);
+
+    status = GenFilterSimSendAndWait(Stack->Top,
+                                     &irp);
+
+    *Information = irp.IoStatus.Information;
+
+    return status;
+}
+
+static
+NTSTATUS
+Write(PGENFILTER_SIM_STACK Stack,
+      PVOID                Buffer,
+      ULONG                Length,
+      LONGLONG             Offset,
+      PULONG_PTR           Information)
+{
+    IRP      irp;
+    MDL      mdl;
+    NTSTATUS status;
+
+    GenFilterSimBuildWrite(&irp,
+                           &mdl,
+                           Buffer,
+                           Length,
+                           Offset);
+
+    status = GenFilterSimSendAndWait(Stack->Top,
+                                     &irp);
+
+    *Information = irp.IoStatus.Information;
+
+    return status;
+}
+
+static
+NTSTATUS
+DeviceControl(PGENFILTER_SIM_STACK Stack,
+              ULONG                IoControlCode,
+              PVOID                Buffer,
+              ULONG                InputLength,
+              ULONG                OutputLength,
+              PULONG_PTR           Information)
+{
+    IRP      irp;
+    NTSTATUS status;
+
+    GenFilterSimBuildDeviceControl(&irp,
+                                   IoControlCode,
+                                   Buffer,
+                                   InputLength,
+                                   OutputLength);
+
+    status = GenFilterSimSendAndWait(Stack->Top,
+                                     &irp);
+
+    *Information = irp.IoStatus.Information;
+
+    return status;
+}
+
+static
+bool
+GetStatistics(PGENFILTER_SIM_STACK  Stack,
+              PGENFILTER_STATISTICS Statistics)
+{
+    ULONG_PTR information;
+
+    return NT_SUCCESS(DeviceControl(Stack,
+                                    IOCTL_GENFILTER_GET_STATISTICS,
+                                    Statistics,
+                                    0,
+                                    sizeof(GENFILTER_STATISTICS),
+                                    &information));
+}
+
+//
+// Query the geometry, as a file system does when it mounts the media.
+// This is how the read cache learns the sector size.
+//
+static
+bool
+Mount(PGENFILTER_SIM_STACK Stack)
+{
+    DISK_GEOMETRY geometry;
+    ULONG_PTR     information;
+
+    return NT_SUCCESS(DeviceControl(Stack,
+                                    IOCTL_CDROM_GET_DRIVE_GEOMETRY,
+                                    &geometry,
+                                    0,
+                                    sizeof(geometry),
+                                    &information)) &&
+           geometry.BytesPerSector == 2048;
+}
+
+static
+bool
+MediaMatches(const UCHAR* Buffer,
+             ULONG        Length,
+             ULONG        Offset)
+{
+    for (ULONG index = 0; index < Length; index++) {
+
+        if (Buffer[index] != GenFilterSimTargetGetMediaByte(Offset + index)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// A read through the dispatcher returns the device's data and length
+//
+static
+bool
+TestRead()
+{
+    GENFILTER_SIM_STACK  stack;
+    GENFILTER_STATISTICS statistics;
+    std::vector<UCHAR>   buffer(64 * 1024);
+    ULONG_PTR            information;
+
+    if (!StackCreate(&stack,
+                     nullptr)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          8192,
+                          &information)));
+    CHECK(information == buffer.size());
+    CHECK(MediaMatches(buffer.data(),
+                       (ULONG)buffer.size(),
+                       8192));
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatReadRequests] == 1);
+    CHECK(statistics.Counters[GenFilterStatBytesRead] == buffer.size());
+
+    //
+    // Past the end of the media
+    //
+    CHECK(Read(&stack,
+               buffer.data(),
+               2048,
+               GENFILTER_SIM_TEST_MEDIA_BYTES,
+               &information) == STATUS_END_OF_FILE);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// A write through the dispatcher reaches the media
+//
+static
+bool
+TestWrite()
+{
+    GENFILTER_SIM_STACK stack;
+    std::vector<UCHAR>  buffer(32 * 1024, 0xA5);
+    ULONG_PTR           information;
+
+    if (!StackCreate(&stack,
+                     nullptr)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(Write(&stack,
+                           buffer.data(),
+                           (ULONG)buffer.size(),
+                           4096,
+                           &information)));
+    CHECK(information == buffer.size());
+    CHECK(memcmp(GenFilterSimTargetGetMedia(stack.Target, nullptr) + 4096,
+                 buffer.data(),
+                 buffer.size()) == 0);
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_WRITE) == 1);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// A device control is forwarded, and its output comes back
+//
+static
+bool
+TestDeviceControl()
+{
+    GENFILTER_SIM_STACK stack;
+    ULONG               changeCount = 0xFFFFFFFF;
+    ULONG_PTR           information;
+
+    if (!StackCreate(&stack,
+                     nullptr)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                   IOCTL_CDROM_CHECK_VERIFY,
+                                   &changeCount,
+                                   0,
+                                   sizeof(changeCount),
+                                   &information)));
+    CHECK(information == sizeof(ULONG));
+    CHECK(changeCount == 0);
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_DEVICE_CONTROL) == 1);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// In pass-through mode the filter's Queues never see reads, but our
+// private IOCTLs are still answered
+//
+static
+bool
+TestPassThrough()
+{
+    GENFILTER_SIM_REGISTRY registry;
+    GENFILTER_SIM_STACK    stack;
+    GENFILTER_STATISTICS   statistics;
+    std::vector<UCHAR>     buffer(2048);
+    ULONG_PTR              information;
+
+    registry.Values[L"PassThrough"] = 1;
+
+    if (!StackCreate(&stack,
+                     &registry)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          2048,
+                          &information)));
+    CHECK(information == buffer.size());
+    CHECK(MediaMatches(buffer.data(),
+                       (ULONG)buffer.size(),
+                       2048));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == 1);
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatReadRequests] == 0);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// A device added with the dispatcher that has no policies passes I/O
+// through untouched and uncounted, sets up none of the modules its
+// policies would have, but still answers our private IOCTLs
+//
+static
+bool
+TestForwarding()
+{
+    GENFILTER_SIM_STACK        stack;
+    GENFILTER_STATISTICS       statistics;
+    GENFILTER_TRACE_HEADER     trace;
+    GENFILTER_POOLS            pools;
+    GENFILTER_LATENCY_SAMPLING sampling    = {};
+    std::vector<UCHAR>         buffer(64 * 1024);
+    ULONG                      changeCount;
+    ULONG                      passThrough = 1;
+    ULONG_PTR                  information;
+
+    if (!StackCreate(&stack,
+                     nullptr,
+                     0,
+                     GenFilterForwardingEvtDeviceAdd)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          2048,
+                          &information)));
+    CHECK(information == buffer.size());
+    CHECK(MediaMatches(buffer.data(),
+                       (ULONG)buffer.size(),
+                       2048));
+
+    CHECK(NT_SUCCESS(Write(&stack,
+                           buffer.data(),
+                           (ULONG)buffer.size(),
+                           2048,
+                           &information)));
+    CHECK(information == buffer.size());
+
+    CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                   IOCTL_CDROM_CHECK_VERIFY,
+                                   &changeCount,
+                                   0,
+                                   sizeof(changeCount),
+                                   &information)));
+    CHECK(information == sizeof(ULONG));
+
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == 1);
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_WRITE) == 1);
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_DEVICE_CONTROL) == 1);
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatReadRequests] == 0);
+    CHECK(statistics.Counters[GenFilterStatWriteRequests] == 0);
+    CHECK(statistics.Counters[GenFilterStatDeviceControlRequests] == 0);
+    CHECK(statistics.ProcessorCount == 0);
+
+    CHECK(DeviceControl(&stack,
+                        IOCTL_GENFILTER_DRAIN_TRACE,
+                        &trace,
+                        0,
+                        sizeof(trace),
+                        &information) == STATUS_INVALID_DEVICE_STATE);
+
+    CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                   IOCTL_GENFILTER_GET_POOLS,
+                                   &pools,
+                                   0,
+                                   sizeof(pools),
+                                   &information)));
+
+    for (ULONG index = 0; index < GenFilterPoolCount; index++) {
+        CHECK(pools.Pools[index].ElementCount == 0);
+    }
+
+    CHECK(DeviceControl(&stack,
+                        IOCTL_GENFILTER_SET_PASS_THROUGH,
+                        &passThrough,
+                        sizeof(passThrough),
+                        0,
+                        &information) == STATUS_INVALID_DEVICE_STATE);
+
+    CHECK(DeviceControl(&stack,
+                        IOCTL_GENFILTER_SET_LATENCY_SAMPLING,
+                        &sampling,
+                        sizeof(sampling),
+                        0,
+                        &information) == STATUS_INVALID_DEVICE_STATE);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// Many threads with many Requests each outstanding at a device with
+// latency: everything completes, and the filter counted all of it
+//
+static
+bool
+TestConcurrent()
+{
+    const ULONG             threadCount = 4;
+    const ULONG             perThread   = 2000;
+    GENFILTER_SIM_STACK     stack;
+    GENFILTER_STATISTICS    statistics;
+    std::atomic<ULONG>      failures(0);
+    std::vector<std::thread> threads;
+
+    if (!StackCreate(&stack,
+                     nullptr,
+                     50)) {
+        return false;
+    }
+
+    for (ULONG thread = 0; thread < threadCount; thread++) {
+
+        threads.emplace_back([&stack, &failures, thread, perThread] {
+
+            std::vector<UCHAR> buffer(2048);
+            ULONG              changeCount;
+            ULONG_PTR          information;
+
+            for (ULONG index = 0; index < perThread; index++) {
+
+                NTSTATUS status;
+                LONGLONG offset = (LONGLONG)((thread * perThread + index) % 4096) * 2048;
+
+                switch (index % 3) {
+
+                    case 0:
+                        status = Read(&stack,
+                                      buffer.data(),
+                                      2048,
+                                      offset,
+                                      &information);
+                        break;
+
+                    case 1:
+                        status = Write(&stack,
+                                       buffer.data(),
+                                       2048,
+                                       offset,
+                                       &information);
+                        break;
+
+                    default:
+                        status = DeviceControl(&stack,
+                                               IOCTL_CDROM_CHECK_VERIFY,
+                                               &changeCount,
+                                               0,
+                                               sizeof(changeCount),
+                                               &information);
+                        break;
+                }
+
+                if (!NT_SUCCESS(status)) {
+                    failures++;
+                }
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    CHECK(failures == 0);
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatReadRequests] +
+          statistics.Counters[GenFilterStatWriteRequests] +
+          statistics.Counters[GenFilterStatDeviceControlRequests] >= threadCount * perThread);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// Reads are cached once we know the sector size.  A write to a block that
+// a read is still fetching keeps what that read returns out of the cache;
+// a write to some other block doesn't.  Nothing is cached, and what was is
+// thrown away, while a verify is pending or for a read that's part of one.
+//
+static
+bool
+TestCache()
+{
+    const LONGLONG       offset     = 0x40000;
+    const LONGLONG       written    = 0x80000;
+    const LONGLONG       unrelated  = 0x100000;
+    const LONGLONG       elsewhere  = 0x800000;
+    GENFILTER_SIM_STACK  stack;
+    GENFILTER_STATISTICS statistics;
+    std::vector<UCHAR>   buffer(2048);
+    std::vector<UCHAR>   data(2048, 0x5A);
+    ULONGLONG            reads;
+    ULONG_PTR            information;
+    IRP                  irp;
+    MDL                  mdl;
+
+    if (!StackCreate(&stack,
+                     nullptr,
+                     20000)) {
+        return false;
+    }
+
+    auto readInFlight = [&stack](LONGLONG Offset) {
+
+        std::vector<UCHAR> inFlight(2048);
+        ULONG_PTR          inFlightInformation;
+
+        (VOID)Read(&stack,
+                   inFlight.data(),
+                   (ULONG)inFlight.size(),
+                   Offset,
+                   &inFlightInformation);
+    };
+
+    //
+    // Not until we know the sector size
+    //
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              offset,
+                              &information)));
+    }
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatCacheHits] == 0);
+    CHECK(statistics.Counters[GenFilterStatCacheMisses] == 0);
+
+    CHECK(Mount(&stack));
+
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              offset,
+                              &information)));
+        CHECK(MediaMatches(buffer.data(),
+                           (ULONG)buffer.size(),
+                           (ULONG)offset));
+    }
+
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == 3);
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatCacheHits] == 1);
+    CHECK(statistics.Counters[GenFilterStatCacheMisses] == 1);
+
+    //
+    // A write while a read of the same block is at the device.  Whatever
+    // order they reach it in, we must end up reading what was written.
+    //
+    {
+        std::thread reader(readInFlight,
+                           written);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        CHECK(NT_SUCCESS(Write(&stack,
+                               data.data(),
+                               (ULONG)data.size(),
+                               written,
+                               &information)));
+        reader.join();
+    }
+
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              written,
+                              &information)));
+        CHECK(buffer == data);
+    }
+
+    //
+    // A write somewhere else doesn't keep the read out of the cache
+    //
+    {
+        std::thread reader(readInFlight,
+                           unrelated);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        CHECK(NT_SUCCESS(Write(&stack,
+                               data.data(),
+                               (ULONG)data.size(),
+                               elsewhere,
+                               &information)));
+        reader.join();
+    }
+
+    reads = GenFilterSimTargetGetRequests(stack.Target,
+                                          IRP_MJ_READ);
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          unrelated,
+                          &information)));
+    CHECK(MediaMatches(buffer.data(),
+                       (ULONG)buffer.size(),
+                       (ULONG)unrelated));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads);
+
+    //
+    // While the class driver has a verify pending, reads go to the device
+    // and the cache is emptied.  Nothing is cached again until the media
+    // has been mounted again.
+    //
+    GenFilterSimTargetSetVerify(stack.Target,
+                                TRUE);
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          offset,
+                          &information)));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads + 1);
+
+    GenFilterSimTargetSetVerify(stack.Target,
+                                FALSE);
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          offset,
+                          &information)));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads + 2);
+
+    CHECK(Mount(&stack));
+
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              offset,
+                              &information)));
+    }
+
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads + 3);
+
+    //
+    // A read that's part of the file system's verify goes to the device,
+    // and empties the cache too
+    //
+    GenFilterSimBuildRead(&irp,
+                          &mdl,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          offset);
+
+    IoGetNextIrpStackLocation(&irp)->Flags |= SL_OVERRIDE_VERIFY_VOLUME;
+
+    CHECK(NT_SUCCESS(GenFilterSimSendAndWait(stack.Top,
+                                             &irp)));
+    CHECK(MediaMatches(buffer.data(),
+                       (ULONG)buffer.size(),
+                       (ULONG)offset));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads + 4);
+
+    CHECK(Mount(&stack));
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          offset,
+                          &information)));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == reads + 5);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// A read split into chunks completes with the bytes of all of them
+//
+static
+bool
+SplitRead(const GENFILTER_SIM_REGISTRY& Registry,
+          ULONG                         Length,
+          ULONGLONG                     Chunks)
+{
+    GENFILTER_SIM_STACK  stack;
+    GENFILTER_STATISTICS statistics;
+    std::vector<UCHAR>   buffer(Length);
+    ULONG_PTR            information;
+
+    if (!StackCreate(&stack,
+                     &Registry)) {
+        return false;
+    }
+
+    CHECK(Mount(&stack));
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          Length,
+                          65536,
+                          &information)));
+    CHECK(information == Length);
+    CHECK(MediaMatches(buffer.data(),
+                       Length,
+                       65536));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == Chunks);
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatSplitRequests] == 1);
+    CHECK(statistics.Counters[GenFilterStatSplitChunks] == Chunks);
+    CHECK(statistics.Counters[GenFilterStatBytesRead] == Length);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+static
+bool
+TestSplit()
+{
+    GENFILTER_SIM_REGISTRY registry;
+
+    registry.Values[L"SplitChunkKB"] = 64;
+    registry.Values[L"SplitDepth"]   = 2;
+
+    return SplitRead(registry,
+                     256 * 1024,
+                     4);
+}
+
+//
+// The same, for a read small enough to fill the cache, which a worker
+// completes after filling it
+//
+static
+bool
+TestSplitDeferred()
+{
+    GENFILTER_SIM_REGISTRY registry;
+
+    registry.Values[L"SplitChunkKB"] = 16;
+    registry.Values[L"SplitDepth"]   = 2;
+    registry.Values[L"DeferPolicy"]  = 1;
+
+    return SplitRead(registry,
+                     64 * 1024,
+                     4);
+}
+
+//
+// A chunk that fails with a status we retry is sent again, along with the
+// chunks after it, but not the ones before it or the whole read.  (The
+// device completes each chunk as it's sent, so of the read's four, the
+// first and third go down in one chunk Request, and the second in the
+// other, before the read is finished.)
+//
+static
+bool
+TestSplitRetry()
+{
+    const ULONG            length = 256 * 1024;
+    GENFILTER_SIM_REGISTRY registry;
+    GENFILTER_SIM_STACK    stack;
+    GENFILTER_STATISTICS   statistics;
+    std::vector<UCHAR>     buffer(length);
+    ULONG_PTR              information;
+
+    registry.Values[L"SplitChunkKB"]  = 64;
+    registry.Values[L"SplitDepth"]    = 2;
+    registry.Values[L"RetryAttempts"] = 3;
+    registry.Values[L"RetryBaseMs"]   = 1;
+    registry.Values[L"RetryMaxMs"]    = 10;
+
+    if (!StackCreate(&stack,
+                     &registry)) {
+        return false;
+    }
+
+    GenFilterSimTargetFailAt(stack.Target,
+                             128 * 1024 + 4096,
+                             STATUS_DEVICE_BUSY,
+                             1);
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          length,
+                          0,
+                          &information)));
+    CHECK(information == length);
+    CHECK(MediaMatches(buffer.data(),
+                       length,
+                       0));
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_READ) == 3 + 2);
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatSplitRequests] == 1);
+    CHECK(statistics.Counters[GenFilterStatSplitChunks] == 3 + 2);
+    CHECK(statistics.Counters[GenFilterStatRetryAttempts] == 1);
+    CHECK(statistics.Counters[GenFilterStatRetrySucceeded] == 1);
+    CHECK(statistics.Counters[GenFilterStatBytesRead] == length);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// With inspection blocking a signature, a write that carries it is failed
+// and never reaches the media, and a clean write is sent from our copy of
+// its data.  A write too long to copy in one go is scanned whole first (so
+// it's failed before any of it is written) and is then sent a copy at a
+// time.  Flagging lets everything through.
+//
+static
+bool
+InspectWrites(GENFILTER_INSPECT_ACTION Action)
+{
+    GENFILTER_SIM_REGISTRY registry;
+    GENFILTER_SIM_STACK    stack;
+    GENFILTER_STATISTICS   statistics;
+    GENFILTER_POOLS        pools;
+    std::vector<UCHAR>     buffer(32 * 1024, 0x5A);
+    std::vector<UCHAR>     large(GENFILTER_INSPECT_COPY_LENGTH + 2048, 0x3C);
+    std::vector<UCHAR>     parts(3 * GENFILTER_INSPECT_COPY_LENGTH + 2048);
+    const UCHAR            signature[] = { 0x4D, 0x5A, 0x90, 0x00 };
+    BOOLEAN                block       = (Action == GenFilterInspectBlock) ? TRUE : FALSE;
+    ULONG_PTR              information;
+
+    registry.Values[L"InspectAction"]            = (ULONG)Action;
+    registry.MultiStrings[L"InspectSignatures"] = { L"4D5A9000" };
+
+    if (!StackCreate(&stack,
+                     &registry)) {
+        return false;
+    }
+
+    CHECK(NT_SUCCESS(Write(&stack,
+                           buffer.data(),
+                           (ULONG)buffer.size(),
+                           0,
+                           &information)));
+    CHECK(information == buffer.size());
+    CHECK(memcmp(GenFilterSimTargetGetMedia(stack.Target, nullptr),
+                 buffer.data(),
+                 buffer.size()) == 0);
+
+    memcpy(buffer.data() + 1000,
+           signature,
+           sizeof(signature));
+
+    CHECK(Write(&stack,
+                buffer.data(),
+                (ULONG)buffer.size(),
+                65536,
+                &information) == (block ? STATUS_ACCESS_DENIED : STATUS_SUCCESS));
+    CHECK(MediaMatches(GenFilterSimTargetGetMedia(stack.Target, nullptr) + 65536,
+                       (ULONG)buffer.size(),
+                       65536) == (block ? true : false));
+
+    //
+    // The signature is in the second part: none of the write gets there
+    //
+    memcpy(large.data() + GENFILTER_INSPECT_COPY_LENGTH + 1024,
+           signature,
+           sizeof(signature));
+
+    CHECK(Write(&stack,
+                large.data(),
+                (ULONG)large.size(),
+                1024 * 1024,
+                &information) == (block ? STATUS_ACCESS_DENIED : STATUS_SUCCESS));
+    CHECK(MediaMatches(GenFilterSimTargetGetMedia(stack.Target, nullptr) + 1024 * 1024,
+                       (ULONG)large.size(),
+                       1024 * 1024) == (block ? true : false));
+
+    for (size_t index = 0; index < parts.size(); index++) {
+        parts[index] = (UCHAR)(index / 2048);
+    }
+
+    CHECK(NT_SUCCESS(Write(&stack,
+                           parts.data(),
+                           (ULONG)parts.size(),
+                           2 * 1024 * 1024,
+                           &information)));
+    CHECK(information == parts.size());
+    CHECK(memcmp(GenFilterSimTargetGetMedia(stack.Target, nullptr) + 2 * 1024 * 1024,
+                 parts.data(),
+                 parts.size()) == 0);
+
+    CHECK(GenFilterSimTargetGetRequests(stack.Target,
+                                        IRP_MJ_WRITE) == (block ? 1 + 4 : 1 + 1 + 2 + 4));
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatSignatureMatches] == 2);
+    CHECK(statistics.Counters[GenFilterStatSignatureBlocks] == (block ? 2 : 0));
+    CHECK(statistics.Counters[GenFilterStatInspectWaits] == 0);
+
+    CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                   IOCTL_GENFILTER_GET_POOLS,
+                                   &pools,
+                                   0,
+                                   sizeof(pools),
+                                   &information)));
+    CHECK(pools.Pools[GenFilterPoolInspect].ElementCount == GENFILTER_INSPECT_COPIES);
+    CHECK(pools.Pools[GenFilterPoolInspect].Allocations == 4);
+    CHECK(pools.Pools[GenFilterPoolInspect].InUse == 0);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// More writes at once than we have copies, at a device with latency, each
+// long enough to go down in two parts, and each part in chunks (if there
+// are chunks to spare): the ones that find no copy wait for one, and they
+// all get to the media whole
+//
+static
+bool
+InspectWaits()
+{
+    const ULONG              writeCount  = 3 * GENFILTER_INSPECT_COPIES;
+    const ULONG              writeLength = GENFILTER_INSPECT_COPY_LENGTH + 32 * 1024;
+    GENFILTER_SIM_REGISTRY   registry;
+    GENFILTER_SIM_STACK      stack;
+    GENFILTER_STATISTICS     statistics;
+    GENFILTER_POOLS          pools;
+    std::atomic<ULONG>       failures(0);
+    std::vector<std::thread> threads;
+    ULONG_PTR                information;
+
+    registry.Values[L"InspectAction"]            = (ULONG)GenFilterInspectBlock;
+    registry.MultiStrings[L"InspectSignatures"] = { L"4D5A9000" };
+    registry.Values[L"SplitChunkKB"]             = 32;
+    registry.Values[L"SplitDepth"]               = 2;
+
+    if (!StackCreate(&stack,
+                     &registry,
+                     2000)) {
+        return false;
+    }
+
+    for (ULONG write = 0; write < writeCount; write++) {
+
+        threads.emplace_back([&stack, &failures, write, writeLength] {
+
+            std::vector<UCHAR> buffer(writeLength, (UCHAR)(write + 1));
+            ULONG_PTR          written;
+
+            if (!NT_SUCCESS(Write(&stack,
+                                  buffer.data(),
+                                  writeLength,
+                                  (LONGLONG)write * writeLength,
+                                  &written)) ||
+                written != writeLength) {
+                failures++;
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    CHECK(failures == 0);
+
+    for (ULONG write = 0; write < writeCount; write++) {
+
+        const UCHAR* media = GenFilterSimTargetGetMedia(stack.Target, nullptr) + write * writeLength;
+
+        for (ULONG index = 0; index < writeLength; index++) {
+            CHECK(media[index] == (UCHAR)(write + 1));
+        }
+    }
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatInspectWaits] > 0);
+    CHECK(statistics.Counters[GenFilterStatSplitRequests] > 0);
+
+    CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                   IOCTL_GENFILTER_GET_POOLS,
+                                   &pools,
+                                   0,
+                                   sizeof(pools),
+                                   &information)));
+    CHECK(pools.Pools[GenFilterPoolInspect].InUse == 0);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+static
+bool
+TestInspect()
+{
+    return InspectWrites(GenFilterInspectBlock) &&
+           InspectWrites(GenFilterInspectFlag) &&
+           InspectWaits();
+}
+
+//
+// With integrity checking on, a sector that reads back differently is
+// caught.  A read in flight while a write to the same sector goes down
+// isn't checked, but one in flight while a write goes somewhere else is.
+//
+static
+bool
+TestIntegrity()
+{
+    const LONGLONG         sector    = 0x80000;
+    const LONGLONG         unrelated = 0x100000;
+    const LONGLONG         elsewhere = 0x800000;
+    GENFILTER_SIM_REGISTRY registry;
+    GENFILTER_SIM_STACK    stack;
+    GENFILTER_STATISTICS   statistics;
+    std::vector<UCHAR>     buffer(2048);
+    std::vector<UCHAR>     data(2048, 0x5A);
+    ULONG_PTR              information;
+
+    registry.Values[L"IntegrityCheck"] = 1;
+
+    if (!StackCreate(&stack,
+                     &registry,
+                     20000)) {
+        return false;
+    }
+
+    auto readInFlight = [&stack](LONGLONG Offset) {
+
+        std::vector<UCHAR> inFlight(2048);
+        ULONG_PTR          inFlightInformation;
+
+        (VOID)Read(&stack,
+                   inFlight.data(),
+                   (ULONG)inFlight.size(),
+                   Offset,
+                   &inFlightInformation);
+    };
+
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              unrelated,
+                              &information)));
+    }
+
+    {
+        std::thread reader(readInFlight,
+                           unrelated);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        CHECK(NT_SUCCESS(Write(&stack,
+                               data.data(),
+                               (ULONG)data.size(),
+                               elsewhere,
+                               &information)));
+        reader.join();
+    }
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatIntegritySectors] == 3);
+    CHECK(statistics.Counters[GenFilterStatIntegrityMismatches] == 0);
+    CHECK(statistics.Counters[GenFilterStatIntegritySkips] == 0);
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          sector,
+                          &information)));
+
+    {
+        std::thread reader(readInFlight,
+                           sector);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        CHECK(NT_SUCCESS(Write(&stack,
+                               data.data(),
+                               (ULONG)data.size(),
+                               sector,
+                               &information)));
+        reader.join();
+    }
+
+    //
+    // What was written reads back the same each time...
+    //
+    for (ULONG pass = 0; pass < 2; pass++) {
+        CHECK(NT_SUCCESS(Read(&stack,
+                              buffer.data(),
+                              (ULONG)buffer.size(),
+                              sector,
+                              &information)));
+        CHECK(buffer == data);
+    }
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatIntegritySectors] == 6);
+    CHECK(statistics.Counters[GenFilterStatIntegrityMismatches] == 0);
+    CHECK(statistics.Counters[GenFilterStatIntegritySkips] == 1);
+
+    //
+    // ...until the media changes it behind our back
+    //
+    GenFilterSimTargetGetMedia(stack.Target, nullptr)[sector + 100] ^= 0xFF;
+
+    CHECK(NT_SUCCESS(Read(&stack,
+                          buffer.data(),
+                          (ULONG)buffer.size(),
+                          sector,
+                          &information)));
+
+    CHECK(GetStatistics(&stack,
+                        &statistics));
+    CHECK(statistics.Counters[GenFilterStatIntegritySectors] == 7);
+    CHECK(statistics.Counters[GenFilterStatIntegrityMismatches] == 1);
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// The statistics counters, with every thread adding to them at once (and
+// on a machine with fewer processors than threads, to the same slot),
+// while another takes snapshots: no add is lost, and no counter ever
+// goes backwards
+//
+static
+bool
+TestStats()
+{
+    const ULONG              threadCount = 8;
+    const ULONG              perThread   = 200000;
+    GENFILTER_STATS          stats;
+    GENFILTER_STATISTICS     snapshot;
+    std::vector<GENFILTER_CPU_STATS> perCpu(KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    std::vector<std::thread> threads;
+    std::atomic<bool>        adding(true);
+    std::atomic<ULONG>       backwards(0);
+
+    stats.ProcessorCount = (ULONG)perCpu.size();
+    stats.PerCpu         = perCpu.data();
+
+    memset(perCpu.data(),
+           0,
+           perCpu.size() * sizeof(GENFILTER_CPU_STATS));
+
+    std::thread snapshotter([&stats, &adding, &backwards] {
+
+        GENFILTER_STATISTICS current;
+        GENFILTER_STATISTICS last;
+
+        memset(&last,
+               0,
+               sizeof(last));
+
+        while (adding) {
+
+            GenFilterStatsSnapshot(&stats,
+                                   &current,
+                                   sizeof(current));
+
+            for (ULONG counter = 0; counter < GenFilterStatCounterCount; counter++) {
+
+                if (current.Counters[counter] < last.Counters[counter]) {
+                    backwards++;
+                }
+            }
+
+            last = current;
+        }
+    });
+
+    for (ULONG thread = 0; thread < threadCount; thread++) {
+
+        threads.emplace_back([&stats, perThread] {
+
+            for (ULONG index = 0; index < perThread; index++) {
+
+                GenFilterStatsIncrement(&stats,
+                                        GenFilterStatReadRequests);
+                GenFilterStatsAdd(&stats,
+                                  GenFilterStatBytesRead,
+                                  2048);
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    adding = false;
+    snapshotter.join();
+
+    GenFilterStatsSnapshot(&stats,
+                           &snapshot,
+                           sizeof(snapshot));
+
+    CHECK(backwards == 0);
+    CHECK(snapshot.ProcessorCount == perCpu.size());
+    CHECK(snapshot.Counters[GenFilterStatReadRequests] == (ULONGLONG)threadCount * perThread);
+    CHECK(snapshot.Counters[GenFilterStatBytesRead] == (ULONGLONG)threadCount * perThread * 2048);
+    CHECK(snapshot.Counters[GenFilterStatWriteRequests] == 0);
+
+    return true;
+}
+
+//
+// Changing the latency sampling intervals: the old ones come back, and
+// from then on exactly one read in each interval is timed
+//
+static
+bool
+TestSampling()
+{
+    GENFILTER_SIM_STACK        stack;
+    GENFILTER_STATISTICS       before;
+    GENFILTER_STATISTICS       after;
+    GENFILTER_LATENCY_SAMPLING sampling;
+    std::vector<UCHAR>         buffer(2048);
+    ULONG                      lastInterval = GENFILTER_LATENCY_DEFAULT_SAMPLE_INTERVAL;
+    ULONG_PTR                  information;
+
+    if (!StackCreate(&stack,
+                     nullptr)) {
+        return false;
+    }
+
+    for (ULONG readInterval : { 1UL, 4UL, 0UL }) {
+
+        //
+        // Only reads are timed, so our own IOCTLs don't add to the count
+        //
+        sampling.SampleInterval[GenFilterLatencyRead]          = readInterval;
+        sampling.SampleInterval[GenFilterLatencyWrite]         = 0;
+        sampling.SampleInterval[GenFilterLatencyDeviceControl] = 0;
+
+        CHECK(NT_SUCCESS(DeviceControl(&stack,
+                                       IOCTL_GENFILTER_SET_LATENCY_SAMPLING,
+                                       &sampling,
+                                       sizeof(sampling),
+                                       sizeof(sampling),
+                                       &information)));
+        CHECK(information == sizeof(sampling));
+
+        CHECK(sampling.SampleInterval[GenFilterLatencyRead] == lastInterval);
+
+        lastInterval = readInterval;
+
+        CHECK(GetStatistics(&stack,
+                            &before));
+
+        for (ULONG index = 0; index < 16; index++) {
+
+            CHECK(NT_SUCCESS(Read(&stack,
+                                  buffer.data(),
+                                  (ULONG)buffer.size(),
+                                  index * 2048,
+                                  &information)));
+        }
+
+        CHECK(GetStatistics(&stack,
+                            &after));
+        CHECK(after.Counters[GenFilterStatSampledCompletions] -
+              before.Counters[GenFilterStatSampledCompletions] ==
+              (readInterval == 0 ? 0 : 16 / readInterval));
+    }
+
+    StackDelete(&stack);
+
+    return true;
+}
+
+//
+// The signature matcher's and the CRC32C's kernels, each against the
+// scalar one, for every length up to a few vectors and a few offsets of
+// the signature, with GENFILTER_SIM_BASELINE_CPU set (when only the scalar
+// kernels are picked) as well as without
+//
+static
+bool
+TestKernels()
+{
+    GENFILTER_MATCH        match;
+    GENFILTER_MATCH_KERNEL bestMatch = GenFilterMatchBestKernel();
+    GENFILTER_CRC_KERNEL   bestCrc   = GenFilterCrcBestKernel();
+    std::vector<UCHAR>     buffer(4096 + 64);
+    const UCHAR            signature[] = { 0x4D, 0x5A, 0x90, 0x00, 0x03 };
+    const UCHAR            check[]     = "123456789";
+    ULONG                  seed        = 1;
+
+    printf("    match kernel %d, CRC kernel %d\n",
+           (int)bestMatch,
+           (int)bestCrc);
+
+    if (getenv("GENFILTER_SIM_BASELINE_CPU") != nullptr) {
+        CHECK(bestMatch == GenFilterMatchScalar);
+        CHECK(bestCrc == GenFilterCrcTable);
+    }
+
+    for (size_t index = 0; index < buffer.size(); index++) {
+        seed          = seed * 1103515245 + 12345;
+        buffer[index] = (UCHAR)(seed >> 16);
+    }
+
+    GenFilterMatchInitialize(&match);
+    CHECK(GenFilterMatchAddPattern(&match,
+                                   signature,
+                                   sizeof(signature)));
+
+    for (size_t length = 0; length <= 256; length++) {
+
+        for (size_t at = 0; at < length; at += 7) {
+
+            std::vector<UCHAR> data(buffer.begin(),
+                                    buffer.begin() + length);
+            size_t             expected;
+
+            memcpy(data.data() + at,
+                   signature,
+                   min(sizeof(signature), length - at));
+
+            expected = GenFilterMatchFind(&match,
+                                          GenFilterMatchScalar,
+                                          data.data(),
+                                          length,
+                                          nullptr);
+
+            for (int kernel = GenFilterMatchScalar + 1; kernel <= (int)bestMatch; kernel++) {
+                CHECK(GenFilterMatchFind(&match,
+                                         (GENFILTER_MATCH_KERNEL)kernel,
+                                         data.data(),
+                                         length,
+                                         nullptr) == expected);
+            }
+        }
+    }
+
+    CHECK(GenFilterCrc32c(GenFilterCrcTable,
+                          check,
+                          sizeof(check) - 1) == 0xE3069283);
+
+    for (size_t length = 0; length <= buffer.size(); length += (length < 64) ? 1 : 61) {
+        CHECK(GenFilterCrc32c(bestCrc,
+                              buffer.data() + 3,
+                              length - min(length, (size_t)3)) ==
+              GenFilterCrc32c(GenFilterCrcTable,
+                              buffer.data() + 3,
+                              length - min(length, (size_t)3)));
+    }
+
+    return true;
+}
+
+//
+// The deferred work ring, with producers pushing (and retrying when it's
+// full) and consumers popping all at once: every Item comes out exactly
+// once, each consumer sees each producer's Items in the order they were
+// pushed, and the drop count is exactly the pushes that failed
+//
+static
+bool
+TestRing()
+{
+    const ULONG              capacity      = 256;
+    const ULONG              producerCount = 4;
+    const ULONG              consumerCount = 3;
+    const ULONG              perProducer   = 200000;
+    GENFILTER_RING           ring;
+    std::vector<GENFILTER_RING_CELL> cells(capacity);
+    std::vector<std::atomic<ULONG>>  popped(producerCount * perProducer);
+    std::vector<std::thread> threads;
+    std::atomic<ULONG>       producing(producerCount);
+    std::atomic<ULONGLONG>   failedPushes(0);
+    std::atomic<ULONG>       outOfOrder(0);
+
+    GenFilterRingInitialize(&ring,
+                            cells.data(),
+                            capacity);
+
+    for (ULONG producer = 0; producer < producerCount; producer++) {
+
+        threads.emplace_back([&, producer] {
+
+            ULONGLONG failed = 0;
+
+            for (ULONG index = 0; index < perProducer; index++) {
+
+                //
+                // Never nullptr, which is what an empty ring pops
+                //
+                void* item = (void*)(ULONG_PTR)(producer * perProducer + index + 1);
+
+                while (!GenFilterRingPush(&ring,
+                                          item)) {
+                    failed++;
+                    std::this_thread::yield();
+                }
+            }
+
+            failedPushes += failed;
+            producing--;
+        });
+    }
+
+    for (ULONG consumer = 0; consumer < consumerCount; consumer++) {
+
+        threads.emplace_back([&] {
+
+            std::vector<LONG64> last(producerCount, -1);
+
+            for (;;) {
+
+                void* item = GenFilterRingPop(&ring);
+
+                if (item == nullptr) {
+
+                    if (producing == 0 &&
+                        GenFilterRingDepth(&ring) == 0) {
+                        break;
+                    }
+
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                ULONG value    = (ULONG)(ULONG_PTR)item - 1;
+                ULONG producer = value / perProducer;
+
+                if ((LONG64)(value % perProducer) <= last[producer]) {
+                    outOfOrder++;
+                }
+
+                last[producer] = value % perProducer;
+                popped[value]++;
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (ULONG index = 0; index < popped.size(); index++) {
+        CHECK(popped[index] == 1);
+    }
+
+    CHECK(outOfOrder == 0);
+    CHECK(GenFilterRingPop(&ring) == nullptr);
+    CHECK(GenFilterRingDepth(&ring) == 0);
+    CHECK((ULONGLONG)ring.Dropped == failedPushes);
+    CHECK(ring.HighWater > 0 && (ULONG)ring.HighWater <= capacity);
+    CHECK(ring.Tail == (LONG64)producerCount * perProducer);
+
+    return true;
+}
+
+static const struct {
+    const char* Name;
+    bool        (*Run)();
+} GenFilterSimTests[] = {
+    { "read",        TestRead },
+    { "write",       TestWrite },
+    { "ioctl",       TestDeviceControl },
+    { "passthrough", TestPassThrough },
+    { "forwarding",  TestForwarding },
+    { "concurrent",  TestConcurrent },
+    { "cache",       TestCache },
+    { "split",       TestSplit },
+    { "splitdefer",  TestSplitDeferred },
+    { "splitretry",  TestSplitRetry },
+    { "inspect",     TestInspect },
+    { "integrity",   TestIntegrity },
+    { "kernels",     TestKernels },
+    { "stats",       TestStats },
+    { "sampling",    TestSampling },
+    { "ring",        TestRing },
+};
+
+int
+main(int    argc,
+     char** argv)
+{
+    NTSTATUS status;
+    int      failed = 0;
+    int      ran    = 0;
+
+    status = GenFilterSimDriverLoad();
+
+    if (!NT_SUCCESS(status)) {
+        printf("DriverEntry failed - 0x%x\n",
+               status);
+        return 1;
+    }
+
+    for (const auto& test : GenFilterSimTests) {
+
+        if (argc > 1 &&
+            strcmp(argv[1], test.Name) != 0) {
+            continue;
+        }
+
+        printf("%s\n",
+               test.Name);
+
+        ran++;
+
+        if (!test.Run()) {
+            failed++;
+        }
+    }
+
+    if (ran == 0) {
+        printf("No test named %s\n",
+               argv[1]);
+        return 1;
+    }
+
+    printf("%d of %d passed\n",
+           ran - failed,
+           ran);
+
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,2698 @@
+///
+/// @file GenFilterSimWdf.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// The Framework routines GenFilter calls, implemented in user mode for
+// GenFilterSim: objects and their contexts, the device, its Queues and
+// Requests, its local I/O target, registry values, memory, timers, work
+// items and locks.
+//
+// Every object starts with a GENFILTER_SIM_OBJECT, and its context (if it
+// has one) follows it in the same allocation.  Objects are deleted with
+// their parent, children first, the way the Framework does it: cleanup
+// callbacks for the whole tree run before any of it is freed.
+//
+// A Request the Framework creates wraps the IRP it was created for and
+// owns it until it's completed or sent and forgotten.  Requests are
+// presented to a Queue's callbacks in the sending thread when the Queue
+// has room; Requests that had to wait, or were forwarded, are presented
+// by the Framework's presentation thread.  Timers and work items have a
+// thread each, too.
+//
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "GenFilterSim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <new>
+
+//
+// The objects
+//
+typedef enum _GENFILTER_SIM_OBJECT_TYPE {
+    GenFilterSimObjectDriver,
+    GenFilterSimObjectDevice,
+    GenFilterSimObjectQueue,
+    GenFilterSimObjectRequest,
+    GenFilterSimObjectIoTarget,
+    GenFilterSimObjectMemory,
+    GenFilterSimObjectKey,
+    GenFilterSimObjectCollection,
+    GenFilterSimObjectString,
+    GenFilterSimObjectTimer,
+    GenFilterSimObjectWorkItem,
+    GenFilterSimObjectSpinLock,
+    GenFilterSimObjectWaitLock,
+} GENFILTER_SIM_OBJECT_TYPE;
+
+struct GENFILTER_SIM_OBJECT {
+    virtual ~GENFILTER_SIM_OBJECT() = default;
+
+    GENFILTER_SIM_OBJECT_TYPE          Type;
+    volatile LONG                      References;
+    BOOLEAN                            Disposed;
+    GENFILTER_SIM_OBJECT*              Parent;
+    std::vector<GENFILTER_SIM_OBJECT*> Children;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP     EvtCleanupCallback;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY     EvtDestroyCallback;
+    PCWDF_OBJECT_CONTEXT_TYPE_INFO     ContextTypeInfo;
+    PVOID                              Context;
+};
+
+struct GENFILTER_SIM_DEVICE;
+struct GENFILTER_SIM_QUEUE;
+struct GENFILTER_SIM_IOTARGET;
+struct GENFILTER_SIM_REQUEST;
+
+//
+// A Request's links in the list of Requests waiting in a Queue
+//
+typedef struct _GENFILTER_SIM_WAIT_ENTRY {
+    LIST_ENTRY             Links;
+    GENFILTER_SIM_REQUEST* Request;
+} GENFILTER_SIM_WAIT_ENTRY, *PGENFILTER_SIM_WAIT_ENTRY;
+
+#define GENFILTER_SIM_WAITING_REQUEST(_entry) \
+    (CONTAINING_RECORD((_entry), GENFILTER_SIM_WAIT_ENTRY, Links)->Request)
+
+struct GENFILTER_SIM_DRIVER : GENFILTER_SIM_OBJECT {
+    WDF_DRIVER_CONFIG Config;
+};
+
+struct GENFILTER_SIM_IOTARGET : GENFILTER_SIM_OBJECT {
+    GENFILTER_SIM_DEVICE* Device;
+    PDEVICE_OBJECT        TargetDevice;
+};
+
+struct GENFILTER_SIM_DEVICE : GENFILTER_SIM_OBJECT {
+    DEVICE_OBJECT                    DeviceObject;
+    PDEVICE_OBJECT                   LowerDevice;
+    GENFILTER_SIM_IOTARGET*          IoTarget;
+    GENFILTER_SIM_QUEUE*             DefaultQueue;
+    GENFILTER_SIM_QUEUE*             Dispatch[WdfRequestTypeMax];
+    PFN_WDFDEVICE_WDM_IRP_PREPROCESS Preprocess[IRP_MJ_MAXIMUM_FUNCTION + 1];
+    WDF_OBJECT_ATTRIBUTES            RequestAttributes;
+    BOOLEAN                          HasRegistry;
+    GENFILTER_SIM_REGISTRY           Registry;
+    std::vector<GENFILTER_SIM_QUEUE*> Queues;
+
+    //
+    // Requests we've created for IRPs and not yet completed or forgotten
+    //
+    volatile LONG                    Outstanding;
+};
+
+struct GENFILTER_SIM_QUEUE : GENFILTER_SIM_OBJECT {
+    GENFILTER_SIM_DEVICE* Device;
+    WDF_IO_QUEUE_CONFIG   Config;
+    ULONG                 MaxPresented;
+
+    //
+    // Requests waiting in the Queue, and how many have been presented and
+    // not yet completed, forwarded or forgotten.  Scheduled is owned by the
+    // presentation thread's lock.
+    //
+    std::mutex            Lock;
+    LIST_ENTRY            Waiting;
+    ULONG                 Presented;
+    BOOLEAN               Scheduled;
+};
+
+struct GENFILTER_SIM_REQUEST : GENFILTER_SIM_OBJECT {
+    PIRP                               Irp;
+    BOOLEAN                            DriverCreated;
+    GENFILTER_SIM_DEVICE*              Device;
+
+    //
+    // Where the Request is: the Queue WdfRequestGetIoQueue returns, the
+    // Queue that's counting it as presented, and the Queue it's waiting in
+    //
+    GENFILTER_SIM_QUEUE*               Queue;
+    GENFILTER_SIM_QUEUE*               PresentedBy;
+    GENFILTER_SIM_QUEUE*               WaitingIn;
+    GENFILTER_SIM_WAIT_ENTRY           WaitingEntry;
+
+    //
+    // Sending it
+    //
+    BOOLEAN                            Formatted;
+    WDFMEMORY                          FormattedMemory;
+    GENFILTER_SIM_IOTARGET*            SentTo;
+    PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine;
+    WDFCONTEXT                         CompletionContext;
+    WDF_REQUEST_COMPLETION_PARAMS      CompletionParams;
+    volatile NTSTATUS                  Status;
+
+    //
+    // The IRP and MDL of a Request the driver created.  A Request from a
+    // Queue that's formatted with a WDFMEMORY uses OwnMdl too, and gets
+    // back the buffer it came with when it completes, as it does with the
+    // Framework.
+    //
+    IRP                                OwnIrp;
+    MDL                                OwnMdl;
+    PMDL                               CallerMdl;
+    PVOID                              CallerUserBuffer;
+};
+
+struct GENFILTER_SIM_MEMORY : GENFILTER_SIM_OBJECT {
+    ~GENFILTER_SIM_MEMORY() override { free(Buffer); }
+
+    PVOID  Buffer;
+    size_t Size;
+};
+
+struct GENFILTER_SIM_KEY : GENFILTER_SIM_OBJECT {
+    const GENFILTER_SIM_REGISTRY* Registry;
+};
+
+struct GENFILTER_SIM_COLLECTION : GENFILTER_SIM_OBJECT {
+    std::vector<WDFOBJECT> Items;
+};
+
+struct GENFILTER_SIM_STRING : GENFILTER_SIM_OBJECT {
+    std::wstring Value;
+};
+
+struct GENFILTER_SIM_TIMER : GENFILTER_SIM_OBJECT {
+    WDF_TIMER_CONFIG                                      Config;
+    BOOLEAN                                               Queued;
+    BOOLEAN                                               Stopped;
+    std::multimap<ULONGLONG, GENFILTER_SIM_TIMER*>::iterator Entry;
+};
+
+struct GENFILTER_SIM_WORKITEM : GENFILTER_SIM_OBJECT {
+    WDF_WORKITEM_CONFIG Config;
+    BOOLEAN             Queued;
+};
+
+struct GENFILTER_SIM_SPINLOCK : GENFILTER_SIM_OBJECT {
+    KSPIN_LOCK Lock;
+    KIRQL      OldIrql;
+};
+
+struct GENFILTER_SIM_WAITLOCK : GENFILTER_SIM_OBJECT {
+    std::timed_mutex Lock;
+};
+
+//
+// What a driver's EvtDriverDeviceAdd is given
+//
+struct WDFDEVICE_INIT {
+    PDEVICE_OBJECT                   LowerDevice;
+    const GENFILTER_SIM_REGISTRY*    Registry;
+    BOOLEAN                          Filter;
+    WDF_OBJECT_ATTRIBUTES            RequestAttributes;
+    PFN_WDFDEVICE_WDM_IRP_PREPROCESS Preprocess[IRP_MJ_MAXIMUM_FUNCTION + 1];
+    GENFILTER_SIM_DEVICE*            Device;
+};
+
+//
+// The Framework's own threads: one presents Requests that had to wait,
+// one runs timers and one runs work items.  They're started when the
+// driver is loaded and run until the process exits.
+//
+typedef struct _GENFILTER_SIM_FRAMEWORK {
+    GENFILTER_SIM_DRIVER*                          Driver;
+
+    std::mutex                                     PresentLock;
+    std::condition_variable                        PresentReady;
+    std::condition_variable                        PresentIdle;
+    std::deque<GENFILTER_SIM_QUEUE*>               PresentQueues;
+    GENFILTER_SIM_QUEUE*                           Presenting;
+
+    std::mutex                                     TimerLock;
+    std::condition_variable                        TimerChanged;
+    std::condition_variable                        TimerIdle;
+    std::multimap<ULONGLONG, GENFILTER_SIM_TIMER*> Timers;
+    GENFILTER_SIM_TIMER*                           TimerRunning;
+    std::thread::id                                TimerThread;
+
+    std::mutex                                     WorkLock;
+    std::condition_variable                        WorkReady;
+    std::condition_variable                        WorkIdle;
+    std::deque<GENFILTER_SIM_WORKITEM*>            WorkItems;
+    GENFILTER_SIM_WORKITEM*                        WorkRunning;
+    std::thread::id                                WorkThread;
+} GENFILTER_SIM_FRAMEWORK, *PGENFILTER_SIM_FRAMEWORK;
+
+static PGENFILTER_SIM_FRAMEWORK GenFilterSimFramework;
+
+//
+// Parents and children
+//
+static std::mutex GenFilterSimTreeLock;
+
+#define GENFILTER_SIM_HANDLE(_handle) ((GENFILTER_SIM_OBJECT*)(_handle))
+
+template <typename T>
+static
+T*
+GenFilterSimObject(_In_ PVOID Handle)
+{
+    return static_cast<T*>(GENFILTER_SIM_HANDLE(Handle));
+}
+
+static
+VOID
+GenFilterSimFail(_In_ PCSTR What,
+                 _In_ PVOID Handle)
+{
+    fprintf(stderr,
+            "GenFilterSim: %s (object %p)\n",
+            What,
+            Handle);
+    abort();
+}
+
+//
+// Objects: create one with its context, and a parent from its attributes
+// (or the default we're given)
+//
+template <typename T>
+static
+T*
+GenFilterSimObjectCreate(_In_ GENFILTER_SIM_OBJECT_TYPE  Type,
+                         _In_opt_ PWDF_OBJECT_ATTRIBUTES Attributes,
+                         _In_opt_ GENFILTER_SIM_OBJECT*  DefaultParent)
+{
+    PCWDF_OBJECT_CONTEXT_TYPE_INFO contextType = nullptr;
+    size_t                         contextSize = 0;
+    size_t                         headerSize;
+    PUCHAR                         allocation;
+    T*                             object;
+    GENFILTER_SIM_OBJECT*          parent      = DefaultParent;
+
+    if (Attributes != nullptr) {
+
+        contextType = Attributes->ContextTypeInfo;
+
+        if (contextType != nullptr) {
+            contextSize = (Attributes->ContextSizeOverride > contextType->ContextSize) ?
+                              Attributes->ContextSizeOverride : contextType->ContextSize;
+        }
+
+        if (Attributes->ParentObject != nullptr) {
+            parent = GENFILTER_SIM_HANDLE(Attributes->ParentObject);
+        }
+    }
+
+    //
+    // The context is cache aligned and preceded by a pointer back to us,
+    // for WdfObjectContextGetObject
+    //
+    headerSize = ALIGN_UP_BY(sizeof(T) + sizeof(PVOID),
+                             SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    allocation = (PUCHAR)aligned_alloc(SYSTEM_CACHE_ALIGNMENT_SIZE,
+                                       ALIGN_UP_BY(headerSize + contextSize,
+                                                   SYSTEM_CACHE_ALIGNMENT_SIZE));
+
+    if (allocation == nullptr) {
+        return nullptr;
+    }
+
+    object = new (allocation) T();
+
+    object->Type       = Type;
+    object->References = 1;
+
+    if (Attributes != nullptr) {
+        object->EvtCleanupCallback = Attributes->EvtCleanupCallback;
+        object->EvtDestroyCallback = Attributes->EvtDestroyCallback;
+    }
+
+    if (contextType != nullptr) {
+
+        object->ContextTypeInfo = contextType;
+        object->Context         = allocation + headerSize;
+
+        RtlZeroMemory(object->Context,
+                      contextSize);
+
+        ((GENFILTER_SIM_OBJECT**)object->Context)[-1] = object;
+    }
+
+    if (parent != nullptr) {
+
+        std::lock_guard<std::mutex> lock(GenFilterSimTreeLock);
+
+        object->Parent = parent;
+        parent->Children.push_back(object);
+    }
+
+    return object;
+}
+
+static
+VOID
+GenFilterSimObjectRelease(_In_ GENFILTER_SIM_OBJECT* Object)
+{
+    if (InterlockedDecrement(&Object->References) != 0) {
+        return;
+    }
+
+    if (Object->EvtDestroyCallback != nullptr) {
+        Object->EvtDestroyCallback((WDFOBJECT)Object);
+    }
+
+    Object->~GENFILTER_SIM_OBJECT();
+    free(Object);
+}
+
+static VOID GenFilterSimTimerStop(_In_ GENFILTER_SIM_TIMER* Timer, _In_ BOOLEAN Wait);
+static VOID GenFilterSimWorkItemFlush(_In_ GENFILTER_SIM_WORKITEM* WorkItem);
+static VOID GenFilterSimDeviceQuiesce(_In_ GENFILTER_SIM_DEVICE* Device);
+
+//
+// Dispose of an object and its children: nothing of theirs runs after
+// this, and their cleanup callbacks have been called, children first
+//
+static
+VOID
+GenFilterSimObjectDispose(_In_ GENFILTER_SIM_OBJECT* Object)
+{
+    std::vector<GENFILTER_SIM_OBJECT*> children;
+
+    if (Object->Disposed) {
+        return;
+    }
+
+    Object->Disposed = TRUE;
+
+    switch (Object->Type) {
+
+        case GenFilterSimObjectDevice:
+            GenFilterSimDeviceQuiesce(static_cast<GENFILTER_SIM_DEVICE*>(Object));
+            break;
+
+        case GenFilterSimObjectTimer:
+            GenFilterSimTimerStop(static_cast<GENFILTER_SIM_TIMER*>(Object),
+                                  TRUE);
+            break;
+
+        case GenFilterSimObjectWorkItem:
+            GenFilterSimWorkItemFlush(static_cast<GENFILTER_SIM_WORKITEM*>(Object));
+            break;
+
+        default:
+            break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(GenFilterSimTreeLock);
+
+        children = Object->Children;
+    }
+
+    for (GENFILTER_SIM_OBJECT* child : children) {
+        GenFilterSimObjectDispose(child);
+    }
+
+    if (Object->EvtCleanupCallback != nullptr) {
+        Object->EvtCleanupCallback((WDFOBJECT)Object);
+    }
+}
+
+//
+// Drop the references an object and its children hold on themselves
+//
+static
+VOID
+GenFilterSimObjectReleaseTree(_In_ GENFILTER_SIM_OBJECT* Object)
+{
+    std::vector<GENFILTER_SIM_OBJECT*> children;
+
+    {
+        std::lock_guard<std::mutex> lock(GenFilterSimTreeLock);
+
+        children.swap(Object->Children);
+
+        for (GENFILTER_SIM_OBJECT* child : children) {
+            child->Parent = nullptr;
+        }
+    }
+
+    for (GENFILTER_SIM_OBJECT* child : children) {
+        GenFilterSimObjectReleaseTree(child);
+    }
+
+    GenFilterSimObjectRelease(Object);
+}
+
+static
+VOID
+GenFilterSimObjectDelete(_In_ GENFILTER_SIM_OBJECT* Object)
+{
+    GenFilterSimObjectDispose(Object);
+
+    {
+        std::lock_guard<std::mutex> lock(GenFilterSimTreeLock);
+
+        if (Object->Parent != nullptr) {
+
+            std::vector<GENFILTER_SIM_OBJECT*>& siblings = Object->Parent->Children;
+
+            for (auto entry = siblings.begin(); entry != siblings.end(); ++entry) {
+
+                if (*entry == Object) {
+                    siblings.erase(entry);
+                    break;
+                }
+            }
+
+            Object->Parent = nullptr;
+        }
+    }
+
+    GenFilterSimObjectReleaseTree(Object);
+}
+
+PVOID
+WdfObjectGetTypedContextWorker(_In_ WDFOBJECT                      Handle,
+                               _In_ PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo)
+{
+    GENFILTER_SIM_OBJECT* object = GENFILTER_SIM_HANDLE(Handle);
+
+    if (object->ContextTypeInfo != TypeInfo) {
+        return nullptr;
+    }
+
+    return object->Context;
+}
+
+WDFOBJECT
+WdfObjectContextGetObject(_In_ PVOID ContextPointer)
+{
+    return (WDFOBJECT)((GENFILTER_SIM_OBJECT**)ContextPointer)[-1];
+}
+
+VOID
+WdfObjectDelete(_In_ WDFOBJECT Object)
+{
+    GenFilterSimObjectDelete(GENFILTER_SIM_HANDLE(Object));
+}
+
+VOID
+WdfObjectReference(_In_ WDFOBJECT Object)
+{
+    InterlockedIncrement(&GENFILTER_SIM_HANDLE(Object)->References);
+}
+
+VOID
+WdfObjectDereference(_In_ WDFOBJECT Object)
+{
+    GenFilterSimObjectRelease(GENFILTER_SIM_HANDLE(Object));
+}
+
+//
+// The presentation thread
+//
+static VOID GenFilterSimQueuePresentWaiting(_In_ GENFILTER_SIM_QUEUE* Queue);
+
+static
+VOID
+GenFilterSimQueueSchedule(_In_ GENFILTER_SIM_QUEUE* Queue)
+{
+    PGENFILTER_SIM_FRAMEWORK    framework = GenFilterSimFramework;
+    std::lock_guard<std::mutex> lock(framework->PresentLock);
+
+    if (!Queue->Scheduled) {
+
+        Queue->Scheduled = TRUE;
+        framework->PresentQueues.push_back(Queue);
+        framework->PresentReady.notify_one();
+    }
+}
+
+static
+VOID
+GenFilterSimPresentThread(_In_ PGENFILTER_SIM_FRAMEWORK Framework)
+{
+    std::unique_lock<std::mutex> lock(Framework->PresentLock);
+
+    for (;;) {
+
+        GENFILTER_SIM_QUEUE* queue;
+
+        Framework->PresentReady.wait(lock,
+                                     [Framework] { return !Framework->PresentQueues.empty(); });
+
+        queue = Framework->PresentQueues.front();
+        Framework->PresentQueues.pop_front();
+
+        queue->Scheduled       = FALSE;
+        Framework->Presenting  = queue;
+
+        lock.unlock();
+
+        GenFilterSimQueuePresentWaiting(queue);
+
+        lock.lock();
+
+        Framework->Presenting = nullptr;
+        Framework->PresentIdle.notify_all();
+    }
+}
+
+//
+// The timer thread.  Due times are in interrupt time (100ns units).
+//
+static
+VOID
+GenFilterSimTimerThread(_In_ PGENFILTER_SIM_FRAMEWORK Framework)
+{
+    std::unique_lock<std::mutex> lock(Framework->TimerLock);
+
+    for (;;) {
+
+        GENFILTER_SIM_TIMER* timer;
+        ULONGLONG            now;
+        KIRQL                oldIrql;
+
+        if (Framework->Timers.empty()) {
+            Framework->TimerChanged.wait(lock);
+            continue;
+        }
+
+        now = KeQueryInterruptTime();
+
+        if (Framework->Timers.begin()->first > now) {
+
+            Framework->TimerChanged.wait_for(lock,
+                                             std::chrono::microseconds((Framework->Timers.begin()->first - now + 9) / 10));
+            continue;
+        }
+
+        timer = Framework->Timers.begin()->second;
+
+        Framework->Timers.erase(Framework->Timers.begin());
+
+        timer->Queued           = FALSE;
+        Framework->TimerRunning = timer;
+
+        lock.unlock();
+
+        KeRaiseIrql(DISPATCH_LEVEL,
+                    &oldIrql);
+
+        timer->Config.EvtTimerFunc((WDFTIMER)timer);
+
+        KeLowerIrql(oldIrql);
+
+        lock.lock();
+
+        Framework->TimerRunning = nullptr;
+
+        if (timer->Config.Period != 0 &&
+            !timer->Queued &&
+            !timer->Stopped) {
+
+            timer->Entry  = Framework->Timers.emplace(KeQueryInterruptTime() + (ULONGLONG)timer->Config.Period * 10000,
+                                                      timer);
+            timer->Queued = TRUE;
+        }
+
+        Framework->TimerIdle.notify_all();
+    }
+}
+
+//
+// The work item thread
+//
+static
+VOID
+GenFilterSimWorkThread(_In_ PGENFILTER_SIM_FRAMEWORK Framework)
+{
+    std::unique_lock<std::mutex> lock(Framework->WorkLock);
+
+    for (;;) {
+
+        GENFILTER_SIM_WORKITEM* workItem;
+
+        Framework->WorkReady.wait(lock,
+                                  [Framework] { return !Framework->WorkItems.empty(); });
+
+        workItem = Framework->WorkItems.front();
+        Framework->WorkItems.pop_front();
+
+        workItem->Queued       = FALSE;
+        Framework->WorkRunning = workItem;
+
+        lock.unlock();
+
+        workItem->Config.EvtWorkItemFunc((WDFWORKITEM)workItem);
+
+        lock.lock();
+
+        Framework->WorkRunning = nullptr;
+        Framework->WorkIdle.notify_all();
+    }
+}
+
+//
+// The driver
+//
+NTSTATUS
+WdfDriverCreate(_In_ PDRIVER_OBJECT              DriverObject,
+                _In_ PCUNICODE_STRING            RegistryPath,
+                _In_opt_ PWDF_OBJECT_ATTRIBUTES  DriverAttributes,
+                _In_ PWDF_DRIVER_CONFIG          DriverConfig,
+                _Out_opt_ WDFDRIVER*             Driver)
+{
+    PGENFILTER_SIM_FRAMEWORK framework;
+    GENFILTER_SIM_DRIVER*    driver;
+
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    if (GenFilterSimFramework != nullptr) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    driver = GenFilterSimObjectCreate<GENFILTER_SIM_DRIVER>(GenFilterSimObjectDriver,
+                                                            DriverAttributes,
+                                                            nullptr);
+
+    if (driver == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    driver->Config = *DriverConfig;
+
+    //
+    // The Framework lives as long as the process does
+    //
+    framework         = new GENFILTER_SIM_FRAMEWORK();
+    framework->Driver = driver;
+
+    GenFilterSimFramework = framework;
+
+    std::thread(GenFilterSimPresentThread,
+                framework).detach();
+
+    std::thread timerThread(GenFilterSimTimerThread,
+                            framework);
+    framework->TimerThread = timerThread.get_id();
+    timerThread.detach();
+
+    std::thread workThread(GenFilterSimWorkThread,
+                           framework);
+    framework->WorkThread = workThread.get_id();
+    workThread.detach();
+
+    if (Driver != nullptr) {
+        *Driver = (WDFDRIVER)driver;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+WDFDRIVER
+WdfGetDriver()
+{
+    return (WDFDRIVER)GenFilterSimFramework->Driver;
+}
+
+//
+// Devices
+//
+VOID
+WdfFdoInitSetFilter(_In_ PWDFDEVICE_INIT DeviceInit)
+{
+    DeviceInit->Filter = TRUE;
+}
+
+VOID
+WdfDeviceInitSetRequestAttributes(_In_ PWDFDEVICE_INIT        DeviceInit,
+                                  _In_ PWDF_OBJECT_ATTRIBUTES RequestAttributes)
+{
+    DeviceInit->RequestAttributes = *RequestAttributes;
+}
+
+NTSTATUS
+WdfDeviceInitAssignWdmIrpPreprocessCallback(_In_ PWDFDEVICE_INIT                  DeviceInit,
+                                            _In_ PFN_WDFDEVICE_WDM_IRP_PREPROCESS EvtDeviceWdmIrpPreprocess,
+                                            _In_ UCHAR                            MajorFunction,
+                                            _In_opt_ PUCHAR                       MinorFunctions,
+                                            _In_ ULONG                            NumMinorFunctions)
+{
+    UNREFERENCED_PARAMETER(MinorFunctions);
+    UNREFERENCED_PARAMETER(NumMinorFunctions);
+
+    if (MajorFunction > IRP_MJ_MAXIMUM_FUNCTION) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    DeviceInit->Preprocess[MajorFunction] = EvtDeviceWdmIrpPreprocess;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS GenFilterSimDeviceDispatch(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+
+NTSTATUS
+WdfDeviceCreate(_Inout_ PWDFDEVICE_INIT*     DeviceInit,
+                _In_opt_ PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+                _Out_ WDFDEVICE*             Device)
+{
+    PWDFDEVICE_INIT       init = *DeviceInit;
+    GENFILTER_SIM_DEVICE* device;
+
+    device = GenFilterSimObjectCreate<GENFILTER_SIM_DEVICE>(GenFilterSimObjectDevice,
+                                                            DeviceAttributes,
+                                                            GenFilterSimFramework->Driver);
+
+    if (device == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    //
+    // A filter does its I/O the way the device below it does
+    //
+    device->DeviceObject.Flags       = init->LowerDevice->Flags & (DO_DIRECT_IO | DO_BUFFERED_IO);
+    device->DeviceObject.SimDispatch = GenFilterSimDeviceDispatch;
+    device->DeviceObject.SimContext  = device;
+    device->LowerDevice              = init->LowerDevice;
+    device->RequestAttributes        = init->RequestAttributes;
+
+    RtlCopyMemory(device->Preprocess,
+                  init->Preprocess,
+                  sizeof(device->Preprocess));
+
+    if (init->Registry != nullptr) {
+        device->HasRegistry = TRUE;
+        device->Registry    = *init->Registry;
+    }
+
+    device->IoTarget = GenFilterSimObjectCreate<GENFILTER_SIM_IOTARGET>(GenFilterSimObjectIoTarget,
+                                                                        WDF_NO_OBJECT_ATTRIBUTES,
+                                                                        device);
+
+    if (device->IoTarget == nullptr) {
+        GenFilterSimObjectDelete(device);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->IoTarget->Device       = device;
+    device->IoTarget->TargetDevice = init->LowerDevice;
+
+    init->Device = device;
+    *DeviceInit  = nullptr;
+    *Device      = (WDFDEVICE)(GENFILTER_SIM_OBJECT*)device;
+
+    return STATUS_SUCCESS;
+}
+
+PDEVICE_OBJECT
+WdfDeviceWdmGetDeviceObject(_In_ WDFDEVICE Device)
+{
+    return &GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device)->DeviceObject;
+}
+
+PDEVICE_OBJECT
+WdfDeviceWdmGetAttachedDevice(_In_ WDFDEVICE Device)
+{
+    return GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device)->LowerDevice;
+}
+
+WDFIOTARGET
+WdfDeviceGetIoTarget(_In_ WDFDEVICE Device)
+{
+    return (WDFIOTARGET)(GENFILTER_SIM_OBJECT*)GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device)->IoTarget;
+}
+
+NTSTATUS
+WdfDeviceConfigureRequestDispatching(_In_ WDFDEVICE        Device,
+                                     _In_ WDFQUEUE         Queue,
+                                     _In_ WDF_REQUEST_TYPE RequestType)
+{
+    GENFILTER_SIM_DEVICE* device = GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device);
+
+    if (RequestType >= WdfRequestTypeMax ||
+        device->Dispatch[RequestType] != nullptr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    device->Dispatch[RequestType] = GenFilterSimObject<GENFILTER_SIM_QUEUE>(Queue);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Queues
+//
+static
+VOID
+GenFilterSimQueuePresent(_In_ GENFILTER_SIM_QUEUE*   Queue,
+                         _In_ GENFILTER_SIM_REQUEST* Request)
+{
+    WDFQUEUE           queue   = (WDFQUEUE)(GENFILTER_SIM_OBJECT*)Queue;
+    WDFREQUEST         request = (WDFREQUEST)(GENFILTER_SIM_OBJECT*)Request;
+    PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(Request->Irp);
+    PWDF_IO_QUEUE_CONFIG config = &Queue->Config;
+
+    Request->Queue = Queue;
+
+    switch (ioStack->MajorFunction) {
+
+        case IRP_MJ_READ:
+
+            if (ioStack->Parameters.Read.Length == 0 &&
+                !config->AllowZeroLengthRequests) {
+                WdfRequestComplete(request,
+                                   STATUS_SUCCESS);
+                return;
+            }
+
+            if (config->EvtIoRead != nullptr) {
+                config->EvtIoRead(queue,
+                                  request,
+                                  ioStack->Parameters.Read.Length);
+                return;
+            }
+
+            break;
+
+        case IRP_MJ_WRITE:
+
+            if (ioStack->Parameters.Write.Length == 0 &&
+                !config->AllowZeroLengthRequests) {
+                WdfRequestComplete(request,
+                                   STATUS_SUCCESS);
+                return;
+            }
+
+            if (config->EvtIoWrite != nullptr) {
+                config->EvtIoWrite(queue,
+                                   request,
+                                   ioStack->Parameters.Write.Length);
+                return;
+            }
+
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+
+            if (config->EvtIoDeviceControl != nullptr) {
+                config->EvtIoDeviceControl(queue,
+                                           request,
+                                           ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                           ioStack->Parameters.DeviceIoControl.InputBufferLength,
+                                           ioStack->Parameters.DeviceIoControl.IoControlCode);
+                return;
+            }
+
+            break;
+
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+
+            if (config->EvtIoInternalDeviceControl != nullptr) {
+                config->EvtIoInternalDeviceControl(queue,
+                                                   request,
+                                                   ioStack->Parameters.DeviceIoControl.OutputBufferLength,
+                                                   ioStack->Parameters.DeviceIoControl.InputBufferLength,
+                                                   ioStack->Parameters.DeviceIoControl.IoControlCode);
+                return;
+            }
+
+            break;
+
+        default:
+            break;
+    }
+
+    if (config->EvtIoDefault != nullptr) {
+        config->EvtIoDefault(queue,
+                             request);
+        return;
+    }
+
+    WdfRequestComplete(request,
+                       STATUS_INVALID_DEVICE_REQUEST);
+}
+
+//
+// How many Queues are presenting a Request on this thread right now.  Like
+// the Framework, we present a forwarded Request in the forwarder's context
+// rather than handing it to another thread, but not so deep that a driver
+// forwarding from one callback to the next could run us out of stack.
+//
+#define GENFILTER_SIM_MAX_PRESENT_DEPTH 4
+
+static thread_local ULONG GenFilterSimPresentDepth;
+
+//
+// Put a Request in a Queue.  A Request that just arrived, or was just
+// forwarded, is presented right here if the Queue has room and nobody's
+// waiting ahead of it; otherwise it waits for the presentation thread.
+//
+static
+VOID
+GenFilterSimQueueInsert(_In_ GENFILTER_SIM_QUEUE*   Queue,
+                        _In_ GENFILTER_SIM_REQUEST* Request,
+                        _In_ BOOLEAN                PresentNow)
+{
+    std::unique_lock<std::mutex> lock(Queue->Lock);
+
+    Request->Queue = Queue;
+
+    if (PresentNow &&
+        GenFilterSimPresentDepth < GENFILTER_SIM_MAX_PRESENT_DEPTH &&
+        Queue->Config.DispatchType != WdfIoQueueDispatchManual &&
+        IsListEmpty(&Queue->Waiting) &&
+        Queue->Presented < Queue->MaxPresented) {
+
+        Queue->Presented++;
+        Request->PresentedBy = Queue;
+
+        lock.unlock();
+
+        GenFilterSimPresentDepth++;
+
+        GenFilterSimQueuePresent(Queue,
+                                 Request);
+
+        GenFilterSimPresentDepth--;
+        return;
+    }
+
+    Request->WaitingEntry.Request = Request;
+
+    InsertTailList(&Queue->Waiting,
+                   &Request->WaitingEntry.Links);
+    Request->WaitingIn = Queue;
+
+    lock.unlock();
+
+    if (Queue->Config.DispatchType != WdfIoQueueDispatchManual) {
+        GenFilterSimQueueSchedule(Queue);
+    }
+}
+
+//
+// Present what's waiting in a Queue, as long as it has room.  Called by
+// the presentation thread.
+//
+static
+VOID
+GenFilterSimQueuePresentWaiting(_In_ GENFILTER_SIM_QUEUE* Queue)
+{
+    for (;;) {
+
+        GENFILTER_SIM_REQUEST*       request;
+        std::unique_lock<std::mutex> lock(Queue->Lock);
+
+        if (IsListEmpty(&Queue->Waiting) ||
+            Queue->Presented >= Queue->MaxPresented) {
+            return;
+        }
+
+        request = GENFILTER_SIM_WAITING_REQUEST(RemoveHeadList(&Queue->Waiting));
+
+        request->WaitingIn   = nullptr;
+        request->PresentedBy = Queue;
+        Queue->Presented++;
+
+        lock.unlock();
+
+        GenFilterSimQueuePresent(Queue,
+                                 request);
+    }
+}
+
+//
+// A presented Request has been completed, forwarded or forgotten, making
+// room in its Queue
+//
+static
+VOID
+GenFilterSimRequestLeaveQueue(_In_ GENFILTER_SIM_REQUEST* Request)
+{
+    GENFILTER_SIM_QUEUE* queue = Request->PresentedBy;
+    BOOLEAN              waiting;
+
+    if (queue == nullptr) {
+        return;
+    }
+
+    Request->PresentedBy = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(queue->Lock);
+
+        queue->Presented--;
+
+        waiting = !IsListEmpty(&queue->Waiting);
+    }
+
+    if (waiting) {
+        GenFilterSimQueueSchedule(queue);
+    }
+}
+
+NTSTATUS
+WdfIoQueueCreate(_In_ WDFDEVICE                  Device,
+                 _In_ PWDF_IO_QUEUE_CONFIG        Config,
+                 _In_opt_ PWDF_OBJECT_ATTRIBUTES QueueAttributes,
+                 _Out_opt_ WDFQUEUE*             Queue)
+{
+    GENFILTER_SIM_DEVICE* device = GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device);
+    GENFILTER_SIM_QUEUE*  queue;
+
+    if (Config->DefaultQueue &&
+        device->DefaultQueue != nullptr) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    queue = GenFilterSimObjectCreate<GENFILTER_SIM_QUEUE>(GenFilterSimObjectQueue,
+                                                          QueueAttributes,
+                                                          device);
+
+    if (queue == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    queue->Device = device;
+    queue->Config = *Config;
+
+    InitializeListHead(&queue->Waiting);
+
+    switch (Config->DispatchType) {
+
+        case WdfIoQueueDispatchSequential:
+            queue->MaxPresented = 1;
+            break;
+
+        case WdfIoQueueDispatchParallel:
+            queue->MaxPresented = Config->Settings.Parallel.NumberOfPresentedRequests;
+            break;
+
+        default:
+            queue->MaxPresented = 0;
+            break;
+    }
+
+    if (Config->DefaultQueue) {
+        device->DefaultQueue = queue;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(GenFilterSimTreeLock);
+
+        device->Queues.push_back(queue);
+    }
+
+    if (Queue != nullptr) {
+        *Queue = (WDFQUEUE)(GENFILTER_SIM_OBJECT*)queue;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+WDFDEVICE
+WdfIoQueueGetDevice(_In_ WDFQUEUE Queue)
+{
+    return (WDFDEVICE)(GENFILTER_SIM_OBJECT*)GenFilterSimObject<GENFILTER_SIM_QUEUE>(Queue)->Device;
+}
+
+NTSTATUS
+WdfIoQueueRetrieveNextRequest(_In_ WDFQUEUE     Queue,
+                              _Out_ WDFREQUEST* OutRequest)
+{
+    GENFILTER_SIM_QUEUE*        queue = GenFilterSimObject<GENFILTER_SIM_QUEUE>(Queue);
+    GENFILTER_SIM_REQUEST*      request;
+    std::lock_guard<std::mutex> lock(queue->Lock);
+
+    if (IsListEmpty(&queue->Waiting)) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    request = GENFILTER_SIM_WAITING_REQUEST(RemoveHeadList(&queue->Waiting));
+
+    request->WaitingIn = nullptr;
+
+    *OutRequest = (WDFREQUEST)(GENFILTER_SIM_OBJECT*)request;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoQueueFindRequest(_In_ WDFQUEUE                    Queue,
+                      _In_opt_ WDFREQUEST              FoundRequest,
+                      _In_opt_ WDFFILEOBJECT           FileObject,
+                      _Inout_opt_ PWDF_REQUEST_PARAMETERS Parameters,
+                      _Out_ WDFREQUEST*                OutRequest)
+{
+    GENFILTER_SIM_QUEUE*   queue = GenFilterSimObject<GENFILTER_SIM_QUEUE>(Queue);
+    GENFILTER_SIM_REQUEST* request;
+    PLIST_ENTRY            entry;
+
+    UNREFERENCED_PARAMETER(FileObject);
+
+    {
+        std::lock_guard<std::mutex> lock(queue->Lock);
+
+        if (FoundRequest == nullptr) {
+
+            entry = queue->Waiting.Flink;
+
+        } else {
+
+            request = GenFilterSimObject<GENFILTER_SIM_REQUEST>(FoundRequest);
+
+            if (request->WaitingIn != queue) {
+                return STATUS_NOT_FOUND;
+            }
+
+            entry = request->WaitingEntry.Links.Flink;
+        }
+
+        if (entry == &queue->Waiting) {
+            return STATUS_NO_MORE_ENTRIES;
+        }
+
+        request = GENFILTER_SIM_WAITING_REQUEST(entry);
+
+        InterlockedIncrement(&request->References);
+    }
+
+    *OutRequest = (WDFREQUEST)(GENFILTER_SIM_OBJECT*)request;
+
+    if (Parameters != nullptr) {
+        WdfRequestGetParameters(*OutRequest,
+                                Parameters);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoQueueRetrieveFoundRequest(_In_ WDFQUEUE     Queue,
+                               _In_ WDFREQUEST   FoundRequest,
+                               _Out_ WDFREQUEST* OutRequest)
+{
+    GENFILTER_SIM_QUEUE*        queue   = GenFilterSimObject<GENFILTER_SIM_QUEUE>(Queue);
+    GENFILTER_SIM_REQUEST*      request = GenFilterSimObject<GENFILTER_SIM_REQUEST>(FoundRequest);
+    std::lock_guard<std::mutex> lock(queue->Lock);
+
+    if (request->WaitingIn != queue) {
+        return STATUS_NOT_FOUND;
+    }
+
+    RemoveEntryList(&request->WaitingEntry.Links);
+    request->WaitingIn = nullptr;
+
+    *OutRequest = FoundRequest;
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Taking a device away: nothing more is presented from its Queues, what's
+// waiting in them is cancelled, and we wait for everything else the
+// driver has to finish
+//
+static
+VOID
+GenFilterSimDeviceQuiesce(_In_ GENFILTER_SIM_DEVICE* Device)
+{
+    PGENFILTER_SIM_FRAMEWORK framework = GenFilterSimFramework;
+
+    for (;;) {
+
+        std::vector<GENFILTER_SIM_REQUEST*> cancelled;
+
+        for (GENFILTER_SIM_QUEUE* queue : Device->Queues) {
+
+            std::lock_guard<std::mutex> lock(queue->Lock);
+
+            while (!IsListEmpty(&queue->Waiting)) {
+
+                GENFILTER_SIM_REQUEST* request = GENFILTER_SIM_WAITING_REQUEST(RemoveHeadList(&queue->Waiting));
+
+                request->WaitingIn = nullptr;
+                cancelled.push_back(request);
+            }
+        }
+
+        for (GENFILTER_SIM_REQUEST* request : cancelled) {
+            WdfRequestComplete((WDFREQUEST)(GENFILTER_SIM_OBJECT*)request,
+                               STATUS_CANCELLED);
+        }
+
+        if (ReadAcquire(&Device->Outstanding) == 0) {
+            break;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    //
+    // Make sure the presentation thread is done with our Queues
+    //
+    std::unique_lock<std::mutex> lock(framework->PresentLock);
+
+    for (auto entry = framework->PresentQueues.begin(); entry != framework->PresentQueues.end();) {
+
+        if ((*entry)->Device == Device) {
+            (*entry)->Scheduled = FALSE;
+            entry = framework->PresentQueues.erase(entry);
+        } else {
+            ++entry;
+        }
+    }
+
+    framework->PresentIdle.wait(lock,
+                                [framework, Device] {
+                                    return framework->Presenting == nullptr ||
+                                           framework->Presenting->Device != Device;
+                                });
+}
+
+//
+// Our dispatch routine: what the Framework does with every IRP sent to
+// the device
+//
+static
+NTSTATUS
+GenFilterSimDeviceDispatchIrp(_In_ GENFILTER_SIM_DEVICE* Device,
+                              _Inout_ PIRP               Irp)
+{
+    UCHAR                  majorFunction = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+    GENFILTER_SIM_QUEUE*   queue         = nullptr;
+    GENFILTER_SIM_REQUEST* request;
+
+    if (majorFunction < WdfRequestTypeMax) {
+        queue = Device->Dispatch[majorFunction];
+    }
+
+    if (queue == nullptr) {
+        queue = Device->DefaultQueue;
+    }
+
+    //
+    // A filter passes on whatever it has no Queue for
+    //
+    if (queue == nullptr) {
+
+        IoSkipCurrentIrpStackLocation(Irp);
+
+        return IoCallDriver(Device->LowerDevice,
+                            Irp);
+    }
+
+    request = GenFilterSimObjectCreate<GENFILTER_SIM_REQUEST>(GenFilterSimObjectRequest,
+                                                              &Device->RequestAttributes,
+                                                              nullptr);
+
+    if (request == nullptr) {
+
+        Irp->IoStatus.Status      = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Information = 0;
+
+        IoCompleteRequest(Irp,
+                          IO_NO_INCREMENT);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->Irp    = Irp;
+    request->Device = Device;
+    request->Status = STATUS_SUCCESS;
+
+    InterlockedIncrement(&Device->Outstanding);
+
+    GenFilterSimQueueInsert(queue,
+                            request,
+                            TRUE);
+
+    return STATUS_PENDING;
+}
+
+static
+NTSTATUS
+GenFilterSimDeviceDispatch(_In_ PDEVICE_OBJECT DeviceObject,
+                           _Inout_ PIRP        Irp)
+{
+    auto* device        = (GENFILTER_SIM_DEVICE*)DeviceObject->SimContext;
+    UCHAR majorFunction = IoGetCurrentIrpStackLocation(Irp)->MajorFunction;
+
+    if (device->Preprocess[majorFunction] != nullptr) {
+        return device->Preprocess[majorFunction]((WDFDEVICE)(GENFILTER_SIM_OBJECT*)device,
+                                                 Irp);
+    }
+
+    return GenFilterSimDeviceDispatchIrp(device,
+                                         Irp);
+}
+
+NTSTATUS
+WdfDeviceWdmDispatchPreprocessedIrp(_In_ WDFDEVICE Device,
+                                    _In_ PIRP      Irp)
+{
+    //
+    // Just like IoCallDriver, this moves to the next stack location (which
+    // the caller skipped back to ours)
+    //
+    Irp->SimCurrentLocation--;
+
+    return GenFilterSimDeviceDispatchIrp(GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device),
+                                         Irp);
+}
+
+//
+// Requests
+//
+static
+GENFILTER_SIM_REQUEST*
+GenFilterSimRequest(_In_ WDFREQUEST Request)
+{
+    return GenFilterSimObject<GENFILTER_SIM_REQUEST>(Request);
+}
+
+VOID
+WdfRequestComplete(_In_ WDFREQUEST Request,
+                   _In_ NTSTATUS   Status)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+    GENFILTER_SIM_DEVICE*  device  = request->Device;
+    PIRP                   irp     = request->Irp;
+
+    if (request->DriverCreated) {
+        GenFilterSimFail("WdfRequestComplete on a Request the driver created",
+                         Request);
+    }
+
+    irp->IoStatus.Status = Status;
+
+    GenFilterSimRequestLeaveQueue(request);
+    GenFilterSimObjectRelease(request);
+
+    InterlockedDecrement(&device->Outstanding);
+
+    IoCompleteRequest(irp,
+                      IO_NO_INCREMENT);
+}
+
+VOID
+WdfRequestCompleteWithInformation(_In_ WDFREQUEST Request,
+                                  _In_ NTSTATUS   Status,
+                                  _In_ ULONG_PTR  Information)
+{
+    GenFilterSimRequest(Request)->Irp->IoStatus.Information = Information;
+
+    WdfRequestComplete(Request,
+                       Status);
+}
+
+VOID
+WdfRequestSetInformation(_In_ WDFREQUEST Request,
+                         _In_ ULONG_PTR  Information)
+{
+    GenFilterSimRequest(Request)->Irp->IoStatus.Information = Information;
+}
+
+ULONG_PTR
+WdfRequestGetInformation(_In_ WDFREQUEST Request)
+{
+    return GenFilterSimRequest(Request)->Irp->IoStatus.Information;
+}
+
+NTSTATUS
+WdfRequestGetStatus(_In_ WDFREQUEST Request)
+{
+    return GenFilterSimRequest(Request)->Status;
+}
+
+//
+// Called by IoCompleteRequest when the device below us completes a
+// Request we sent it
+//
+static
+NTSTATUS
+GenFilterSimRequestCompletion(_In_ PDEVICE_OBJECT DeviceObject,
+                              _In_ PIRP           Irp,
+                              _In_opt_ PVOID      Context)
+{
+    auto*                          request = (GENFILTER_SIM_REQUEST*)Context;
+    PIO_STACK_LOCATION             sent    = Irp->SimCurrentLocation - 1;
+    PWDF_REQUEST_COMPLETION_PARAMS params  = &request->CompletionParams;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    WDF_REQUEST_COMPLETION_PARAMS_INIT(params);
+
+    params->Type     = (WDF_REQUEST_TYPE)sent->MajorFunction;
+    params->IoStatus = Irp->IoStatus;
+
+    switch (sent->MajorFunction) {
+
+        case IRP_MJ_READ:
+            params->Parameters.Read.Buffer = request->FormattedMemory;
+            params->Parameters.Read.Length = Irp->IoStatus.Information;
+            break;
+
+        case IRP_MJ_WRITE:
+            params->Parameters.Write.Buffer = request->FormattedMemory;
+            params->Parameters.Write.Length = Irp->IoStatus.Information;
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+            params->Parameters.Ioctl.IoControlCode        = sent->Parameters.DeviceIoControl.IoControlCode;
+            params->Parameters.Ioctl.Output.Length        = Irp->IoStatus.Information;
+            break;
+
+        default:
+            break;
+    }
+
+    if (request->FormattedMemory != nullptr) {
+        Irp->MdlAddress = request->CallerMdl;
+        Irp->UserBuffer = request->CallerUserBuffer;
+    }
+
+    request->Formatted       = FALSE;
+    request->FormattedMemory = nullptr;
+    request->Status          = Irp->IoStatus.Status;
+
+    if (request->CompletionRoutine != nullptr) {
+
+        request->CompletionRoutine((WDFREQUEST)(GENFILTER_SIM_OBJECT*)request,
+                                   (WDFIOTARGET)(GENFILTER_SIM_OBJECT*)request->SentTo,
+                                   params,
+                                   request->CompletionContext);
+
+    } else if (!request->DriverCreated) {
+
+        WdfRequestComplete((WDFREQUEST)(GENFILTER_SIM_OBJECT*)request,
+                           Irp->IoStatus.Status);
+    }
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+BOOLEAN
+WdfRequestSend(_In_ WDFREQUEST                    Request,
+               _In_ WDFIOTARGET                   Target,
+               _In_opt_ PWDF_REQUEST_SEND_OPTIONS Options)
+{
+    GENFILTER_SIM_REQUEST*  request = GenFilterSimRequest(Request);
+    GENFILTER_SIM_IOTARGET* target  = GenFilterSimObject<GENFILTER_SIM_IOTARGET>(Target);
+    PIRP                    irp     = request->Irp;
+
+    if (Options != nullptr &&
+        (Options->Flags & ~WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET) != 0) {
+        GenFilterSimFail("WdfRequestSend with options we don't do",
+                         Request);
+    }
+
+    //
+    // Send and forget: the IRP goes down with our stack location skipped,
+    // and the Request is gone as far as the driver is concerned
+    //
+    if (Options != nullptr &&
+        (Options->Flags & WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET) != 0) {
+
+        GENFILTER_SIM_DEVICE* device = request->Device;
+
+        if (request->DriverCreated) {
+            request->Status = STATUS_INVALID_DEVICE_REQUEST;
+            return FALSE;
+        }
+
+        IoSkipCurrentIrpStackLocation(irp);
+
+        GenFilterSimRequestLeaveQueue(request);
+        GenFilterSimObjectRelease(request);
+
+        InterlockedDecrement(&device->Outstanding);
+
+        (VOID)IoCallDriver(target->TargetDevice,
+                           irp);
+
+        return TRUE;
+    }
+
+    if (!request->Formatted) {
+
+        if (request->DriverCreated) {
+            request->Status = STATUS_INVALID_DEVICE_REQUEST;
+            return FALSE;
+        }
+
+        IoCopyCurrentIrpStackLocationToNext(irp);
+    }
+
+    request->SentTo = target;
+    request->Status = STATUS_PENDING;
+
+    IoSetCompletionRoutine(irp,
+                           GenFilterSimRequestCompletion,
+                           request,
+                           TRUE,
+                           TRUE,
+                           TRUE);
+
+    (VOID)IoCallDriver(target->TargetDevice,
+                       irp);
+
+    return TRUE;
+}
+
+VOID
+WdfRequestSetCompletionRoutine(_In_ WDFREQUEST                            Request,
+                               _In_opt_ PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine,
+                               _In_opt_ WDFCONTEXT                         CompletionContext)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+
+    request->CompletionRoutine = CompletionRoutine;
+    request->CompletionContext = CompletionContext;
+}
+
+VOID
+WdfRequestGetCompletionParams(_In_ WDFREQUEST                      Request,
+                              _Out_ PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    *Params = GenFilterSimRequest(Request)->CompletionParams;
+}
+
+VOID
+WdfRequestFormatRequestUsingCurrentType(_In_ WDFREQUEST Request)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+
+    IoCopyCurrentIrpStackLocationToNext(request->Irp);
+
+    request->Formatted = TRUE;
+}
+
+VOID
+WdfRequestWdmFormatUsingStackLocation(_In_ WDFREQUEST         Request,
+                                      _In_ PIO_STACK_LOCATION Stack)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+    PIO_STACK_LOCATION     next    = IoGetNextIrpStackLocation(request->Irp);
+
+    *next                   = *Stack;
+    next->CompletionRoutine = nullptr;
+    next->Context           = nullptr;
+    next->Control           = 0;
+
+    request->Formatted = TRUE;
+}
+
+VOID
+WdfRequestGetParameters(_In_ WDFREQUEST               Request,
+                        _Out_ PWDF_REQUEST_PARAMETERS Parameters)
+{
+    PIRP               irp = GenFilterSimRequest(Request)->Irp;
+    PIO_STACK_LOCATION ioStack;
+
+    WDF_REQUEST_PARAMETERS_INIT(Parameters);
+
+    //
+    // A Request the driver created has no stack location of its own
+    //
+    if (irp->SimCurrentLocation == &irp->SimStack[GENFILTER_SIM_IRP_STACK_SIZE]) {
+        return;
+    }
+
+    ioStack = IoGetCurrentIrpStackLocation(irp);
+
+    Parameters->Type          = (WDF_REQUEST_TYPE)ioStack->MajorFunction;
+    Parameters->MinorFunction = ioStack->MinorFunction;
+
+    switch (ioStack->MajorFunction) {
+
+        case IRP_MJ_READ:
+            Parameters->Parameters.Read.Length       = ioStack->Parameters.Read.Length;
+            Parameters->Parameters.Read.Key          = ioStack->Parameters.Read.Key;
+            Parameters->Parameters.Read.DeviceOffset = ioStack->Parameters.Read.ByteOffset.QuadPart;
+            break;
+
+        case IRP_MJ_WRITE:
+            Parameters->Parameters.Write.Length       = ioStack->Parameters.Write.Length;
+            Parameters->Parameters.Write.Key          = ioStack->Parameters.Write.Key;
+            Parameters->Parameters.Write.DeviceOffset = ioStack->Parameters.Write.ByteOffset.QuadPart;
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+            Parameters->Parameters.DeviceIoControl.OutputBufferLength = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+            Parameters->Parameters.DeviceIoControl.InputBufferLength  = ioStack->Parameters.DeviceIoControl.InputBufferLength;
+            Parameters->Parameters.DeviceIoControl.IoControlCode      = ioStack->Parameters.DeviceIoControl.IoControlCode;
+            Parameters->Parameters.DeviceIoControl.Type3InputBuffer   = ioStack->Parameters.DeviceIoControl.Type3InputBuffer;
+            break;
+
+        default:
+            break;
+    }
+}
+
+NTSTATUS
+WdfRequestForwardToIoQueue(_In_ WDFREQUEST Request,
+                           _In_ WDFQUEUE   DestinationQueue)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+    GENFILTER_SIM_QUEUE*   queue   = GenFilterSimObject<GENFILTER_SIM_QUEUE>(DestinationQueue);
+
+    if (request->DriverCreated ||
+        request->Queue == queue ||
+        queue->Device != request->Device) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    GenFilterSimRequestLeaveQueue(request);
+
+    GenFilterSimQueueInsert(queue,
+                            request,
+                            TRUE);
+
+    return STATUS_SUCCESS;
+}
+
+WDFQUEUE
+WdfRequestGetIoQueue(_In_ WDFREQUEST Request)
+{
+    return (WDFQUEUE)(GENFILTER_SIM_OBJECT*)GenFilterSimRequest(Request)->Queue;
+}
+
+PIRP
+WdfRequestWdmGetIrp(_In_ WDFREQUEST Request)
+{
+    return GenFilterSimRequest(Request)->Irp;
+}
+
+WDFFILEOBJECT
+WdfRequestGetFileObject(_In_ WDFREQUEST Request)
+{
+    UNREFERENCED_PARAMETER(Request);
+
+    return nullptr;
+}
+
+KPROCESSOR_MODE
+WdfRequestGetRequestorMode(_In_ WDFREQUEST Request)
+{
+    return GenFilterSimRequest(Request)->Irp->RequestorMode;
+}
+
+//
+// Nothing is ever cancelled, other than what's waiting in a Queue when
+// its device goes away
+//
+NTSTATUS
+WdfRequestMarkCancelableEx(_In_ WDFREQUEST             Request,
+                           _In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel)
+{
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(EvtRequestCancel);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestUnmarkCancelable(_In_ WDFREQUEST Request)
+{
+    UNREFERENCED_PARAMETER(Request);
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+WdfRequestIsCanceled(_In_ WDFREQUEST Request)
+{
+    UNREFERENCED_PARAMETER(Request);
+
+    return FALSE;
+}
+
+//
+// Buffers.  Reads and writes are direct or buffered as the device below
+// does them; device controls are METHOD_BUFFERED or direct.
+//
+static
+NTSTATUS
+GenFilterSimRequestBuffer(_In_ GENFILTER_SIM_REQUEST* Request,
+                          _In_ BOOLEAN                Output,
+                          _Out_ PVOID*                Buffer,
+                          _Out_ size_t*               Length)
+{
+    PIRP               irp     = Request->Irp;
+    PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(irp);
+    PVOID              buffer;
+    size_t             length;
+
+    switch (ioStack->MajorFunction) {
+
+        case IRP_MJ_READ:
+        case IRP_MJ_WRITE:
+
+            if (Output != (ioStack->MajorFunction == IRP_MJ_READ)) {
+                return STATUS_INVALID_DEVICE_REQUEST;
+            }
+
+            length = ioStack->Parameters.Read.Length;
+            buffer = (irp->MdlAddress != nullptr) ? MmGetSystemAddressForMdlSafe(irp->MdlAddress,
+                                                                                 NormalPagePriority) :
+                                                    irp->AssociatedIrp.SystemBuffer;
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+
+            if (METHOD_FROM_CTL_CODE(ioStack->Parameters.DeviceIoControl.IoControlCode) == METHOD_NEITHER) {
+                return STATUS_INVALID_DEVICE_REQUEST;
+            }
+
+            if (!Output) {
+
+                length = ioStack->Parameters.DeviceIoControl.InputBufferLength;
+                buffer = irp->AssociatedIrp.SystemBuffer;
+
+            } else if (METHOD_FROM_CTL_CODE(ioStack->Parameters.DeviceIoControl.IoControlCode) == METHOD_BUFFERED) {
+
+                length = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+                buffer = irp->AssociatedIrp.SystemBuffer;
+
+            } else {
+
+                length = ioStack->Parameters.DeviceIoControl.OutputBufferLength;
+                buffer = (irp->MdlAddress != nullptr) ? MmGetSystemAddressForMdlSafe(irp->MdlAddress,
+                                                                                     NormalPagePriority) :
+                                                        nullptr;
+            }
+
+            break;
+
+        default:
+            return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (length == 0 ||
+        buffer == nullptr) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Buffer = buffer;
+    *Length = length;
+
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+GenFilterSimRequestRetrieveBuffer(_In_ WDFREQUEST      Request,
+                                  _In_ BOOLEAN         Output,
+                                  _In_ size_t          MinimumLength,
+                                  _Outptr_ PVOID*      Buffer,
+                                  _Out_opt_ size_t*    Length)
+{
+    PVOID    buffer;
+    size_t   length;
+    NTSTATUS status;
+
+    status = GenFilterSimRequestBuffer(GenFilterSimRequest(Request),
+                                       Output,
+                                       &buffer,
+                                       &length);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (length < MinimumLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Buffer = buffer;
+
+    if (Length != nullptr) {
+        *Length = length;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveInputBuffer(_In_ WDFREQUEST   Request,
+                              _In_ size_t       MinimumRequiredLength,
+                              _Outptr_ PVOID*   Buffer,
+                              _Out_opt_ size_t* Length)
+{
+    return GenFilterSimRequestRetrieveBuffer(Request,
+                                             FALSE,
+                                             MinimumRequiredLength,
+                                             Buffer,
+                                             Length);
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(_In_ WDFREQUEST   Request,
+                               _In_ size_t       MinimumRequiredSize,
+                               _Outptr_ PVOID*   Buffer,
+                               _Out_opt_ size_t* Length)
+{
+    return GenFilterSimRequestRetrieveBuffer(Request,
+                                             TRUE,
+                                             MinimumRequiredSize,
+                                             Buffer,
+                                             Length);
+}
+
+static
+NTSTATUS
+GenFilterSimRequestRetrieveMdl(_In_ WDFREQUEST Request,
+                               _In_ BOOLEAN    Output,
+                               _Outptr_ PMDL*  Mdl)
+{
+    PIRP               irp     = GenFilterSimRequest(Request)->Irp;
+    PIO_STACK_LOCATION ioStack = IoGetCurrentIrpStackLocation(irp);
+    BOOLEAN            valid;
+
+    switch (ioStack->MajorFunction) {
+
+        case IRP_MJ_READ:
+            valid = Output;
+            break;
+
+        case IRP_MJ_WRITE:
+            valid = !Output;
+            break;
+
+        case IRP_MJ_DEVICE_CONTROL:
+        case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+            valid = Output &&
+                    METHOD_FROM_CTL_CODE(ioStack->Parameters.DeviceIoControl.IoControlCode) != METHOD_BUFFERED &&
+                    METHOD_FROM_CTL_CODE(ioStack->Parameters.DeviceIoControl.IoControlCode) != METHOD_NEITHER;
+            break;
+
+        default:
+            valid = FALSE;
+            break;
+    }
+
+    if (!valid ||
+        irp->MdlAddress == nullptr) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    *Mdl = irp->MdlAddress;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveInputWdmMdl(_In_ WDFREQUEST Request,
+                              _Outptr_ PMDL*  Mdl)
+{
+    return GenFilterSimRequestRetrieveMdl(Request,
+                                          FALSE,
+                                          Mdl);
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputWdmMdl(_In_ WDFREQUEST Request,
+                               _Outptr_ PMDL*  Mdl)
+{
+    return GenFilterSimRequestRetrieveMdl(Request,
+                                          TRUE,
+                                          Mdl);
+}
+
+//
+// Requests the driver creates.  Their IRP starts out with no current stack
+// location, like one from IoAllocateIrp.
+//
+static
+VOID
+GenFilterSimRequestResetIrp(_Inout_ GENFILTER_SIM_REQUEST* Request,
+                            _In_ NTSTATUS                 Status)
+{
+    PIRP irp = &Request->OwnIrp;
+
+    RtlZeroMemory(irp,
+                  sizeof(IRP));
+
+    irp->IoStatus.Status    = Status;
+    irp->RequestorMode      = KernelMode;
+    irp->SimCurrentLocation = &irp->SimStack[GENFILTER_SIM_IRP_STACK_SIZE];
+
+    Request->Irp               = irp;
+    Request->Formatted         = FALSE;
+    Request->FormattedMemory   = nullptr;
+    Request->CompletionRoutine = nullptr;
+    Request->CompletionContext = nullptr;
+    Request->Status            = Status;
+}
+
+NTSTATUS
+WdfRequestCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES RequestAttributes,
+                 _In_opt_ WDFIOTARGET            IoTarget,
+                 _Out_ WDFREQUEST*               Request)
+{
+    GENFILTER_SIM_REQUEST* request;
+
+    request = GenFilterSimObjectCreate<GENFILTER_SIM_REQUEST>(GenFilterSimObjectRequest,
+                                                              RequestAttributes,
+                                                              nullptr);
+
+    if (request == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->DriverCreated = TRUE;
+
+    if (IoTarget != nullptr) {
+        request->Device = GenFilterSimObject<GENFILTER_SIM_IOTARGET>(IoTarget)->Device;
+    }
+
+    GenFilterSimRequestResetIrp(request,
+                                STATUS_SUCCESS);
+
+    *Request = (WDFREQUEST)(GENFILTER_SIM_OBJECT*)request;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestReuse(_In_ WDFREQUEST                Request,
+                _In_ PWDF_REQUEST_REUSE_PARAMS ReuseParams)
+{
+    GENFILTER_SIM_REQUEST* request = GenFilterSimRequest(Request);
+
+    if (!request->DriverCreated ||
+        (ReuseParams->Flags & WDF_REQUEST_REUSE_SET_NEW_IRP) != 0) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    GenFilterSimRequestResetIrp(request,
+                                ReuseParams->Status);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Formatting a read or write of a WDFMEMORY for the device below, which
+// gets an MDL or a system buffer depending on how it does its I/O
+//
+static
+NTSTATUS
+GenFilterSimFormatReadWrite(_In_ WDFIOTARGET           IoTarget,
+                            _In_ WDFREQUEST            Request,
+                            _In_ UCHAR                 MajorFunction,
+                            _In_opt_ WDFMEMORY         Memory,
+                            _In_opt_ PWDFMEMORY_OFFSET MemoryOffset,
+                            _In_opt_ PLONGLONG         DeviceOffset)
+{
+    GENFILTER_SIM_IOTARGET* target  = GenFilterSimObject<GENFILTER_SIM_IOTARGET>(IoTarget);
+    GENFILTER_SIM_REQUEST*  request = GenFilterSimRequest(Request);
+    GENFILTER_SIM_MEMORY*   memory;
+    PIRP                    irp     = request->Irp;
+    PIO_STACK_LOCATION      next;
+    PUCHAR                  buffer;
+    size_t                  length;
+
+    if (Memory == nullptr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memory = GenFilterSimObject<GENFILTER_SIM_MEMORY>(Memory);
+    buffer = (PUCHAR)memory->Buffer;
+    length = memory->Size;
+
+    if (MemoryOffset != nullptr) {
+
+        if (MemoryOffset->BufferOffset + MemoryOffset->BufferLength > memory->Size) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        buffer += MemoryOffset->BufferOffset;
+        length  = MemoryOffset->BufferLength;
+    }
+
+    if (request->FormattedMemory == nullptr) {
+        request->CallerMdl        = irp->MdlAddress;
+        request->CallerUserBuffer = irp->UserBuffer;
+    }
+
+    next = IoGetNextIrpStackLocation(irp);
+
+    RtlZeroMemory(next,
+                  sizeof(IO_STACK_LOCATION));
+
+    next->MajorFunction                       = MajorFunction;
+    next->Parameters.Read.Length              = (ULONG)length;
+    next->Parameters.Read.ByteOffset.QuadPart = (DeviceOffset != nullptr) ? *DeviceOffset : 0;
+
+    if ((target->TargetDevice->Flags & DO_DIRECT_IO) != 0) {
+
+        MmInitializeMdl(&request->OwnMdl,
+                        buffer,
+                        length);
+
+        irp->MdlAddress = &request->OwnMdl;
+
+    } else {
+
+        irp->AssociatedIrp.SystemBuffer = buffer;
+    }
+
+    irp->UserBuffer = buffer;
+
+    request->Formatted       = TRUE;
+    request->FormattedMemory = Memory;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfIoTargetFormatRequestForRead(_In_ WDFIOTARGET           IoTarget,
+                                _In_ WDFREQUEST            Request,
+                                _In_opt_ WDFMEMORY         OutputBuffer,
+                                _In_opt_ PWDFMEMORY_OFFSET OutputBufferOffset,
+                                _In_opt_ PLONGLONG         DeviceOffset)
+{
+    return GenFilterSimFormatReadWrite(IoTarget,
+                                       Request,
+                                       IRP_MJ_READ,
+                                       OutputBuffer,
+                                       OutputBufferOffset,
+                                       DeviceOffset);
+}
+
+NTSTATUS
+WdfIoTargetFormatRequestForWrite(_In_ WDFIOTARGET           IoTarget,
+                                 _In_ WDFREQUEST            Request,
+                                 _In_opt_ WDFMEMORY         InputBuffer,
+                                 _In_opt_ PWDFMEMORY_OFFSET InputBufferOffset,
+                                 _In_opt_ PLONGLONG         DeviceOffset)
+{
+    return GenFilterSimFormatReadWrite(IoTarget,
+                                       Request,
+                                       IRP_MJ_WRITE,
+                                       InputBuffer,
+                                       InputBufferOffset,
+                                       DeviceOffset);
+}
+
+//
+// Memory
+//
+NTSTATUS
+WdfMemoryCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES Attributes,
+                _In_ POOL_TYPE                  PoolType,
+                _In_opt_ ULONG                  PoolTag,
+                _In_ size_t                     BufferSize,
+                _Out_ WDFMEMORY*                Memory,
+                _Outptr_opt_ PVOID*             Buffer)
+{
+    GENFILTER_SIM_MEMORY* memory;
+
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(PoolTag);
+
+    if (BufferSize == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memory = GenFilterSimObjectCreate<GENFILTER_SIM_MEMORY>(GenFilterSimObjectMemory,
+                                                            Attributes,
+                                                            GenFilterSimFramework->Driver);
+
+    if (memory == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memory->Size   = BufferSize;
+    memory->Buffer = aligned_alloc(SYSTEM_CACHE_ALIGNMENT_SIZE,
+                                   ALIGN_UP_BY(BufferSize,
+                                               SYSTEM_CACHE_ALIGNMENT_SIZE));
+
+    if (memory->Buffer == nullptr) {
+        GenFilterSimObjectDelete(memory);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Memory = (WDFMEMORY)(GENFILTER_SIM_OBJECT*)memory;
+
+    if (Buffer != nullptr) {
+        *Buffer = memory->Buffer;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+PVOID
+WdfMemoryGetBuffer(_In_ WDFMEMORY       Memory,
+                   _Out_opt_ size_t*    BufferSize)
+{
+    GENFILTER_SIM_MEMORY* memory = GenFilterSimObject<GENFILTER_SIM_MEMORY>(Memory);
+
+    if (BufferSize != nullptr) {
+        *BufferSize = memory->Size;
+    }
+
+    return memory->Buffer;
+}
+
+//
+// The registry: the values the harness gave the device
+//
+NTSTATUS
+WdfDeviceOpenRegistryKey(_In_ WDFDEVICE                  Device,
+                         _In_ ULONG                      DeviceInstanceKeyType,
+                         _In_ ACCESS_MASK                DesiredAccess,
+                         _In_opt_ PWDF_OBJECT_ATTRIBUTES KeyAttributes,
+                         _Out_ WDFKEY*                   Key)
+{
+    GENFILTER_SIM_DEVICE* device = GenFilterSimObject<GENFILTER_SIM_DEVICE>(Device);
+    GENFILTER_SIM_KEY*    key;
+
+    UNREFERENCED_PARAMETER(DeviceInstanceKeyType);
+    UNREFERENCED_PARAMETER(DesiredAccess);
+
+    if (!device->HasRegistry) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    key = GenFilterSimObjectCreate<GENFILTER_SIM_KEY>(GenFilterSimObjectKey,
+                                                      KeyAttributes,
+                                                      device);
+
+    if (key == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    key->Registry = &device->Registry;
+
+    *Key = (WDFKEY)(GENFILTER_SIM_OBJECT*)key;
+
+    return STATUS_SUCCESS;
+}
+
+static
+std::wstring
+GenFilterSimValueName(_In_ PCUNICODE_STRING ValueName)
+{
+    return std::wstring(ValueName->Buffer,
+                        ValueName->Length / sizeof(WCHAR));
+}
+
+NTSTATUS
+WdfRegistryQueryULong(_In_ WDFKEY           Key,
+                      _In_ PCUNICODE_STRING ValueName,
+                      _Out_ PULONG          Value)
+{
+    const GENFILTER_SIM_REGISTRY* registry = GenFilterSimObject<GENFILTER_SIM_KEY>(Key)->Registry;
+    auto                          value    = registry->Values.find(GenFilterSimValueName(ValueName));
+
+    if (value == registry->Values.end()) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    *Value = value->second;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryMultiString(_In_ WDFKEY                     Key,
+                            _In_ PCUNICODE_STRING           ValueName,
+                            _In_opt_ PWDF_OBJECT_ATTRIBUTES StringsAttributes,
+                            _In_ WDFCOLLECTION              Collection)
+{
+    const GENFILTER_SIM_REGISTRY* registry   = GenFilterSimObject<GENFILTER_SIM_KEY>(Key)->Registry;
+    GENFILTER_SIM_COLLECTION*     collection = GenFilterSimObject<GENFILTER_SIM_COLLECTION>(Collection);
+    auto                          value      = registry->MultiStrings.find(GenFilterSimValueName(ValueName));
+
+    if (value == registry->MultiStrings.end()) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    for (const std::wstring& string : value->second) {
+
+        GENFILTER_SIM_STRING* item;
+
+        item = GenFilterSimObjectCreate<GENFILTER_SIM_STRING>(GenFilterSimObjectString,
+                                                              StringsAttributes,
+                                                              collection);
+
+        if (item == nullptr) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        item->Value = string;
+
+        collection->Items.push_back((WDFOBJECT)item);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfRegistryClose(_In_ WDFKEY Key)
+{
+    GenFilterSimObjectDelete(GENFILTER_SIM_HANDLE(Key));
+}
+
+NTSTATUS
+WdfCollectionCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES CollectionAttributes,
+                    _Out_ WDFCOLLECTION*            Collection)
+{
+    GENFILTER_SIM_COLLECTION* collection;
+
+    collection = GenFilterSimObjectCreate<GENFILTER_SIM_COLLECTION>(GenFilterSimObjectCollection,
+                                                                    CollectionAttributes,
+                                                                    GenFilterSimFramework->Driver);
+
+    if (collection == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Collection = (WDFCOLLECTION)(GENFILTER_SIM_OBJECT*)collection;
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+WdfCollectionGetCount(_In_ WDFCOLLECTION Collection)
+{
+    return (ULONG)GenFilterSimObject<GENFILTER_SIM_COLLECTION>(Collection)->Items.size();
+}
+
+WDFOBJECT
+WdfCollectionGetItem(_In_ WDFCOLLECTION Collection,
+                     _In_ ULONG         Index)
+{
+    GENFILTER_SIM_COLLECTION* collection = GenFilterSimObject<GENFILTER_SIM_COLLECTION>(Collection);
+
+    if (Index >= collection->Items.size()) {
+        return nullptr;
+    }
+
+    return collection->Items[Index];
+}
+
+VOID
+WdfStringGetUnicodeString(_In_ WDFSTRING         String,
+                          _Out_ PUNICODE_STRING  UnicodeString)
+{
+    GENFILTER_SIM_STRING* string = GenFilterSimObject<GENFILTER_SIM_STRING>(String);
+
+    UnicodeString->Buffer        = (PWCH)string->Value.c_str();
+    UnicodeString->Length        = (USHORT)(string->Value.size() * sizeof(WCHAR));
+    UnicodeString->MaximumLength = (USHORT)(UnicodeString->Length + sizeof(WCHAR));
+}
+
+//
+// Timers.  A due time is relative if it's negative and absolute (system
+// time) if it's positive, in 100ns units.
+//
+NTSTATUS
+WdfTimerCreate(_In_ PWDF_TIMER_CONFIG      Config,
+               _In_ PWDF_OBJECT_ATTRIBUTES Attributes,
+               _Out_ WDFTIMER*             Timer)
+{
+    GENFILTER_SIM_TIMER* timer;
+
+    if (Attributes == nullptr ||
+        Attributes->ParentObject == nullptr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    timer = GenFilterSimObjectCreate<GENFILTER_SIM_TIMER>(GenFilterSimObjectTimer,
+                                                          Attributes,
+                                                          nullptr);
+
+    if (timer == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    timer->Config = *Config;
+
+    *Timer = (WDFTIMER)(GENFILTER_SIM_OBJECT*)timer;
+
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+WdfTimerStart(_In_ WDFTIMER Timer,
+              _In_ LONGLONG DueTime)
+{
+    PGENFILTER_SIM_FRAMEWORK    framework = GenFilterSimFramework;
+    GENFILTER_SIM_TIMER*        timer     = GenFilterSimObject<GENFILTER_SIM_TIMER>(Timer);
+    ULONGLONG                   delay     = 0;
+    BOOLEAN                     wasQueued;
+    std::lock_guard<std::mutex> lock(framework->TimerLock);
+
+    if (DueTime < 0) {
+
+        delay = (ULONGLONG)-DueTime;
+
+    } else if (DueTime > 0) {
+
+        LARGE_INTEGER now;
+
+        KeQuerySystemTime(&now);
+
+        delay = (DueTime > now.QuadPart) ? (ULONGLONG)(DueTime - now.QuadPart) : 0;
+    }
+
+    wasQueued = timer->Queued;
+
+    if (wasQueued) {
+        framework->Timers.erase(timer->Entry);
+    }
+
+    timer->Entry   = framework->Timers.emplace(KeQueryInterruptTime() + delay,
+                                               timer);
+    timer->Queued  = TRUE;
+    timer->Stopped = FALSE;
+
+    framework->TimerChanged.notify_one();
+
+    return wasQueued;
+}
+
+static
+VOID
+GenFilterSimTimerStop(_In_ GENFILTER_SIM_TIMER* Timer,
+                      _In_ BOOLEAN              Wait)
+{
+    (VOID)WdfTimerStop((WDFTIMER)(GENFILTER_SIM_OBJECT*)Timer,
+                       Wait);
+}
+
+BOOLEAN
+WdfTimerStop(_In_ WDFTIMER Timer,
+             _In_ BOOLEAN  Wait)
+{
+    PGENFILTER_SIM_FRAMEWORK     framework = GenFilterSimFramework;
+    GENFILTER_SIM_TIMER*         timer     = GenFilterSimObject<GENFILTER_SIM_TIMER>(Timer);
+    BOOLEAN                      wasQueued;
+    std::unique_lock<std::mutex> lock(framework->TimerLock);
+
+    wasQueued      = timer->Queued;
+    timer->Stopped = TRUE;
+
+    if (wasQueued) {
+        framework->Timers.erase(timer->Entry);
+        timer->Queued = FALSE;
+    }
+
+    if (Wait &&
+        std::this_thread::get_id() != framework->TimerThread) {
+
+        framework->TimerIdle.wait(lock,
+                                  [framework, timer] { return framework->TimerRunning != timer; });
+    }
+
+    return wasQueued;
+}
+
+WDFOBJECT
+WdfTimerGetParentObject(_In_ WDFTIMER Timer)
+{
+    return (WDFOBJECT)GENFILTER_SIM_HANDLE(Timer)->Parent;
+}
+
+//
+// Work items
+//
+NTSTATUS
+WdfWorkItemCreate(_In_ PWDF_WORKITEM_CONFIG   Config,
+                  _In_ PWDF_OBJECT_ATTRIBUTES Attributes,
+                  _Out_ WDFWORKITEM*          WorkItem)
+{
+    GENFILTER_SIM_WORKITEM* workItem;
+
+    if (Attributes == nullptr ||
+        Attributes->ParentObject == nullptr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    workItem = GenFilterSimObjectCreate<GENFILTER_SIM_WORKITEM>(GenFilterSimObjectWorkItem,
+                                                                Attributes,
+                                                                nullptr);
+
+    if (workItem == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    workItem->Config = *Config;
+
+    *WorkItem = (WDFWORKITEM)(GENFILTER_SIM_OBJECT*)workItem;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfWorkItemEnqueue(_In_ WDFWORKITEM WorkItem)
+{
+    PGENFILTER_SIM_FRAMEWORK    framework = GenFilterSimFramework;
+    GENFILTER_SIM_WORKITEM*     workItem  = GenFilterSimObject<GENFILTER_SIM_WORKITEM>(WorkItem);
+    std::lock_guard<std::mutex> lock(framework->WorkLock);
+
+    if (!workItem->Queued) {
+
+        workItem->Queued = TRUE;
+
+        framework->WorkItems.push_back(workItem);
+        framework->WorkReady.notify_one();
+    }
+}
+
+static
+VOID
+GenFilterSimWorkItemFlush(_In_ GENFILTER_SIM_WORKITEM* WorkItem)
+{
+    PGENFILTER_SIM_FRAMEWORK     framework = GenFilterSimFramework;
+    std::unique_lock<std::mutex> lock(framework->WorkLock);
+
+    if (std::this_thread::get_id() == framework->WorkThread) {
+        return;
+    }
+
+    framework->WorkIdle.wait(lock,
+                             [framework, WorkItem] {
+                                 return !WorkItem->Queued &&
+                                        framework->WorkRunning != WorkItem;
+                             });
+}
+
+VOID
+WdfWorkItemFlush(_In_ WDFWORKITEM WorkItem)
+{
+    GenFilterSimWorkItemFlush(GenFilterSimObject<GENFILTER_SIM_WORKITEM>(WorkItem));
+}
+
+WDFOBJECT
+WdfWorkItemGetParentObject(_In_ WDFWORKITEM WorkItem)
+{
+    return (WDFOBJECT)GENFILTER_SIM_HANDLE(WorkItem)->Parent;
+}
+
+//
+// Locks
+//
+NTSTATUS
+WdfSpinLockCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES SpinLockAttributes,
+                  _Out_ WDFSPINLOCK*              SpinLock)
+{
+    GENFILTER_SIM_SPINLOCK* spinLock;
+
+    spinLock = GenFilterSimObjectCreate<GENFILTER_SIM_SPINLOCK>(GenFilterSimObjectSpinLock,
+                                                                SpinLockAttributes,
+                                                                GenFilterSimFramework->Driver);
+
+    if (spinLock == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeInitializeSpinLock(&spinLock->Lock);
+
+    *SpinLock = (WDFSPINLOCK)(GENFILTER_SIM_OBJECT*)spinLock;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfSpinLockAcquire(_In_ WDFSPINLOCK SpinLock)
+{
+    GENFILTER_SIM_SPINLOCK* spinLock = GenFilterSimObject<GENFILTER_SIM_SPINLOCK>(SpinLock);
+    KIRQL                   oldIrql;
+
+    KeAcquireSpinLock(&spinLock->Lock,
+                      &oldIrql);
+
+    spinLock->OldIrql = oldIrql;
+}
+
+VOID
+WdfSpinLockRelease(_In_ WDFSPINLOCK SpinLock)
+{
+    GENFILTER_SIM_SPINLOCK* spinLock = GenFilterSimObject<GENFILTER_SIM_SPINLOCK>(SpinLock);
+
+    KeReleaseSpinLock(&spinLock->Lock,
+                      spinLock->OldIrql);
+}
+
+NTSTATUS
+WdfWaitLockCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES LockAttributes,
+                  _Out_ WDFWAITLOCK*              Lock)
+{
+    GENFILTER_SIM_WAITLOCK* waitLock;
+
+    waitLock = GenFilterSimObjectCreate<GENFILTER_SIM_WAITLOCK>(GenFilterSimObjectWaitLock,
+                                                                LockAttributes,
+                                                                GenFilterSimFramework->Driver);
+
+    if (waitLock == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Lock = (WDFWAITLOCK)(GENFILTER_SIM_OBJECT*)waitLock;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfWaitLockAcquire(_In_ WDFWAITLOCK     Lock,
+                   _In_opt_ PLONGLONG   Timeout)
+{
+    GENFILTER_SIM_WAITLOCK* waitLock = GenFilterSimObject<GENFILTER_SIM_WAITLOCK>(Lock);
+
+    if (Timeout == nullptr) {
+        waitLock->Lock.lock();
+        return STATUS_SUCCESS;
+    }
+
+    if (!waitLock->Lock.try_lock_for(std::chrono::microseconds((*Timeout < 0) ? -*Timeout / 10 : 0))) {
+        return STATUS_TIMEOUT;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfWaitLockRelease(_In_ WDFWAITLOCK Lock)
+{
+    GenFilterSimObject<GENFILTER_SIM_WAITLOCK>(Lock)->Lock.unlock();
+}
+
+//
+// The harness: loading the driver, and adding and removing devices
+//
+extern "C" DRIVER_INITIALIZE DriverEntry;
+
+NTSTATUS
+GenFilterSimDriverLoad()
+{
+    static UNICODE_STRING registryPath = RTL_CONSTANT_STRING(L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\GenFilter");
+    static ULONG_PTR      driverObject[32];
+
+    if (GenFilterSimFramework != nullptr) {
+        return STATUS_SUCCESS;
+    }
+
+    return DriverEntry((PDRIVER_OBJECT)driverObject,
+                       &registryPath);
+}
+
+NTSTATUS
+GenFilterSimDeviceAdd(_In_opt_ PFN_WDF_DRIVER_DEVICE_ADD     EvtDriverDeviceAdd,
+                      _In_ PDEVICE_OBJECT                    LowerDevice,
+                      _In_opt_ const GENFILTER_SIM_REGISTRY* Registry,
+                      _Out_ WDFDEVICE*                       Device)
+{
+    PGENFILTER_SIM_FRAMEWORK framework = GenFilterSimFramework;
+    WDFDEVICE_INIT           init      = {};
+    NTSTATUS                 status;
+
+    if (framework == nullptr) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (EvtDriverDeviceAdd == nullptr) {
+        EvtDriverDeviceAdd = framework->Driver->Config.EvtDriverDeviceAdd;
+    }
+
+    init.LowerDevice = LowerDevice;
+    init.Registry    = Registry;
+
+    status = EvtDriverDeviceAdd((WDFDRIVER)(GENFILTER_SIM_OBJECT*)framework->Driver,
+                                &init);
+
+    if (!NT_SUCCESS(status)) {
+
+        //
+        // The Framework deletes a device whose EvtDriverDeviceAdd failed
+        //
+        if (init.Device != nullptr) {
+            GenFilterSimObjectDelete(init.Device);
+        }
+
+        return status;
+    }
+
+    if (init.Device == nullptr) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    *Device = (WDFDEVICE)(GENFILTER_SIM_OBJECT*)init.Device;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+GenFilterSimDeviceRemove(_In_ WDFDEVICE Device)
+{
+    GenFilterSimObjectDelete(GENFILTER_SIM_HANDLE(Device));
+}
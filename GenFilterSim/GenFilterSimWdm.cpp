@@ -0,0 +1,943 @@
+///
+/// @file GenFilterSimWdm.cpp
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// The kernel routines GenFilter calls, implemented in user mode for
+// GenFilterSim: IRQL and processor numbers, time, spin locks, semaphores,
+// system threads, pool, MDLs, and sending and completing IRPs.
+//
+// IRQL is no more than a per-thread number here.  Nothing stops a "DISPATCH_LEVEL"
+// thread from being preempted, so a spin lock yields the processor when it
+// has spun for a while rather than burning the holder's time slice.
+//
+
+#include <wdm.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+
+#include <new>
+
+//
+// The spins before a spin lock starts yielding
+//
+#define GENFILTER_SIM_SPINS 64
+
+//
+// Dispatcher object types, as they'd be in DISPATCHER_HEADER.Type
+//
+#define GENFILTER_SIM_NOTIFICATION_EVENT    0
+#define GENFILTER_SIM_SYNCHRONIZATION_EVENT 1
+#define GENFILTER_SIM_SEMAPHORE             5
+#define GENFILTER_SIM_THREAD                6
+
+//
+// The lock and condition variable we keep in a KEVENT's or KSEMAPHORE's
+// Sim storage
+//
+typedef struct _GENFILTER_SIM_WAITABLE {
+    pthread_mutex_t Lock;
+    pthread_cond_t  Signalled;
+} GENFILTER_SIM_WAITABLE, *PGENFILTER_SIM_WAITABLE;
+
+static_assert(sizeof(GENFILTER_SIM_WAITABLE) <= sizeof(((KEVENT*)nullptr)->Sim),
+              "KEVENT's Sim storage is too small");
+
+static_assert(sizeof(GENFILTER_SIM_WAITABLE) <= sizeof(((KSEMAPHORE*)nullptr)->Sim),
+              "KSEMAPHORE's Sim storage is too small");
+
+//
+// A system thread.  The handle PsCreateSystemThread returns and the
+// object ObReferenceObjectByHandle returns are the same pointer, with a
+// reference each.
+//
+typedef struct _KTHREAD {
+    DISPATCHER_HEADER Header;
+    volatile LONG     References;
+    BOOLEAN           Joined;
+    pthread_t         Thread;
+    PKSTART_ROUTINE   StartRoutine;
+    PVOID             StartContext;
+} KTHREAD;
+
+static struct _OBJECT_TYPE* GenFilterSimThreadType;
+POBJECT_TYPE*               PsThreadType = &GenFilterSimThreadType;
+
+static thread_local KIRQL GenFilterSimIrql = PASSIVE_LEVEL;
+
+//
+// Processors and IRQL.  glibc reads the processor counts from sysfs every
+// time it's asked, and the driver asks on every Request, so we ask once.
+//
+ULONG
+KeQueryMaximumProcessorCountEx(_In_ USHORT GroupNumber)
+{
+    static const ULONG count = (ULONG)get_nprocs_conf();
+
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return count;
+}
+
+ULONG
+KeQueryActiveProcessorCountEx(_In_ USHORT GroupNumber)
+{
+    static const ULONG count = (ULONG)get_nprocs();
+
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return count;
+}
+
+ULONG
+KeGetCurrentProcessorNumberEx(_Out_opt_ PPROCESSOR_NUMBER ProcNumber)
+{
+    int   cpu   = sched_getcpu();
+    ULONG index = (cpu < 0) ? 0 : (ULONG)cpu % KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    if (ProcNumber != nullptr) {
+        ProcNumber->Group    = 0;
+        ProcNumber->Number   = (UCHAR)index;
+        ProcNumber->Reserved = 0;
+    }
+
+    return index;
+}
+
+KIRQL
+KeGetCurrentIrql()
+{
+    return GenFilterSimIrql;
+}
+
+VOID
+KeRaiseIrql(_In_ KIRQL   NewIrql,
+            _Out_ PKIRQL OldIrql)
+{
+    *OldIrql         = GenFilterSimIrql;
+    GenFilterSimIrql = NewIrql;
+}
+
+VOID
+KeLowerIrql(_In_ KIRQL NewIrql)
+{
+    GenFilterSimIrql = NewIrql;
+}
+
+KIRQL
+KeRaiseIrqlToDpcLevel()
+{
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL,
+                &oldIrql);
+
+    return oldIrql;
+}
+
+//
+// Time.  The performance counter counts nanoseconds; interrupt time is
+// the same clock in 100ns units.
+//
+static
+ULONGLONG
+GenFilterSimNanoseconds(_In_ clockid_t Clock)
+{
+    struct timespec now;
+
+    clock_gettime(Clock,
+                  &now);
+
+    return (ULONGLONG)now.tv_sec * 1000000000ULL + (ULONGLONG)now.tv_nsec;
+}
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(_Out_opt_ PLARGE_INTEGER PerformanceFrequency)
+{
+    LARGE_INTEGER counter;
+
+    if (PerformanceFrequency != nullptr) {
+        PerformanceFrequency->QuadPart = 1000000000LL;
+    }
+
+    counter.QuadPart = (LONGLONG)GenFilterSimNanoseconds(CLOCK_MONOTONIC);
+
+    return counter;
+}
+
+ULONGLONG
+KeQueryInterruptTime()
+{
+    return GenFilterSimNanoseconds(CLOCK_MONOTONIC) / 100;
+}
+
+VOID
+KeQuerySystemTime(_Out_ PLARGE_INTEGER CurrentTime)
+{
+    //
+    // 100ns units since 1601, as the kernel counts them
+    //
+    CurrentTime->QuadPart = (LONGLONG)(GenFilterSimNanoseconds(CLOCK_REALTIME) / 100) +
+                            116444736000000000LL;
+}
+
+NTSTATUS
+KeSaveExtendedProcessorState(_In_ ULONG64       Mask,
+                             _Out_ PXSTATE_SAVE XStateSave)
+{
+    //
+    // User-mode threads' extended state is always saved for them
+    //
+    XStateSave->Mask = Mask;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+KeRestoreExtendedProcessorState(_In_ PXSTATE_SAVE XStateSave)
+{
+    UNREFERENCED_PARAMETER(XStateSave);
+}
+
+//
+// Set GENFILTER_SIM_BASELINE_CPU in the environment and CPUID reports
+// nothing beyond the x86 baseline, so that the filter's scalar kernels are
+// what get run and tested
+//
+BOOLEAN
+GenFilterSimCpuIsBaseline()
+{
+    static const BOOLEAN baseline = (getenv("GENFILTER_SIM_BASELINE_CPU") != nullptr) ? TRUE : FALSE;
+
+    return baseline;
+}
+
+//
+// Spin locks.  An EX_SPIN_LOCK is a count of shared owners, with the top
+// bit set while it's held exclusive.
+//
+#define GENFILTER_SIM_EXCLUSIVE ((LONG)0x80000000)
+
+static
+VOID
+GenFilterSimBackOff(_Inout_ PULONG Spins)
+{
+    if (++*Spins < GENFILTER_SIM_SPINS) {
+        YieldProcessor();
+        return;
+    }
+
+    *Spins = 0;
+    sched_yield();
+}
+
+KIRQL
+ExAcquireSpinLockShared(_Inout_ PEX_SPIN_LOCK SpinLock)
+{
+    KIRQL oldIrql = KeRaiseIrqlToDpcLevel();
+    ULONG spins   = 0;
+
+    for (;;) {
+
+        LONG value = ReadNoFence(SpinLock);
+
+        if ((value & GENFILTER_SIM_EXCLUSIVE) == 0 &&
+            InterlockedCompareExchange(SpinLock,
+                                       value + 1,
+                                       value) == value) {
+            break;
+        }
+
+        GenFilterSimBackOff(&spins);
+    }
+
+    return oldIrql;
+}
+
+VOID
+ExReleaseSpinLockShared(_Inout_ PEX_SPIN_LOCK SpinLock,
+                        _In_ KIRQL            OldIrql)
+{
+    InterlockedDecrement(SpinLock);
+
+    KeLowerIrql(OldIrql);
+}
+
+KIRQL
+ExAcquireSpinLockExclusive(_Inout_ PEX_SPIN_LOCK SpinLock)
+{
+    KIRQL oldIrql = KeRaiseIrqlToDpcLevel();
+    ULONG spins   = 0;
+
+    while (InterlockedCompareExchange(SpinLock,
+                                      GENFILTER_SIM_EXCLUSIVE,
+                                      0) != 0) {
+        GenFilterSimBackOff(&spins);
+    }
+
+    return oldIrql;
+}
+
+VOID
+ExReleaseSpinLockExclusive(_Inout_ PEX_SPIN_LOCK SpinLock,
+                           _In_ KIRQL            OldIrql)
+{
+    WriteRelease(SpinLock,
+                 0);
+
+    KeLowerIrql(OldIrql);
+}
+
+VOID
+KeInitializeSpinLock(_Out_ PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+VOID
+KeAcquireSpinLock(_Inout_ PKSPIN_LOCK SpinLock,
+                  _Out_ PKIRQL        OldIrql)
+{
+    ULONG spins = 0;
+
+    *OldIrql = KeRaiseIrqlToDpcLevel();
+
+    while (__atomic_exchange_n(SpinLock,
+                               1,
+                               __ATOMIC_ACQUIRE) != 0) {
+        GenFilterSimBackOff(&spins);
+    }
+}
+
+VOID
+KeReleaseSpinLock(_Inout_ PKSPIN_LOCK SpinLock,
+                  _In_ KIRQL          NewIrql)
+{
+    __atomic_store_n(SpinLock,
+                     0,
+                     __ATOMIC_RELEASE);
+
+    KeLowerIrql(NewIrql);
+}
+
+//
+// Events and semaphores
+//
+static
+PGENFILTER_SIM_WAITABLE
+GenFilterSimWaitable(_In_ PVOID Object)
+{
+    auto* header = (DISPATCHER_HEADER*)Object;
+
+    if (header->Type == GENFILTER_SIM_SEMAPHORE) {
+        return (PGENFILTER_SIM_WAITABLE)((PKSEMAPHORE)Object)->Sim;
+    }
+
+    return (PGENFILTER_SIM_WAITABLE)((PKEVENT)Object)->Sim;
+}
+
+static
+VOID
+GenFilterSimInitializeWaitable(_Out_ PGENFILTER_SIM_WAITABLE Waitable)
+{
+    new (Waitable) GENFILTER_SIM_WAITABLE;
+
+    pthread_mutex_init(&Waitable->Lock,
+                       nullptr);
+    pthread_cond_init(&Waitable->Signalled,
+                      nullptr);
+}
+
+VOID
+KeInitializeEvent(_Out_ PRKEVENT  Event,
+                  _In_ EVENT_TYPE Type,
+                  _In_ BOOLEAN    State)
+{
+    RtlZeroMemory(Event,
+                  sizeof(KEVENT));
+
+    Event->Header.Type        = (Type == NotificationEvent) ? GENFILTER_SIM_NOTIFICATION_EVENT :
+                                                              GENFILTER_SIM_SYNCHRONIZATION_EVENT;
+    Event->Header.SignalState = State ? 1 : 0;
+
+    GenFilterSimInitializeWaitable(GenFilterSimWaitable(Event));
+}
+
+LONG
+KeSetEvent(_Inout_ PRKEVENT  Event,
+           _In_ KPRIORITY    Increment,
+           _In_ BOOLEAN      Wait)
+{
+    PGENFILTER_SIM_WAITABLE waitable = GenFilterSimWaitable(Event);
+    LONG                    previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&waitable->Lock);
+
+    previous                  = Event->Header.SignalState;
+    Event->Header.SignalState = 1;
+
+    pthread_cond_broadcast(&waitable->Signalled);
+    pthread_mutex_unlock(&waitable->Lock);
+
+    return previous;
+}
+
+VOID
+KeClearEvent(_Inout_ PRKEVENT Event)
+{
+    PGENFILTER_SIM_WAITABLE waitable = GenFilterSimWaitable(Event);
+
+    pthread_mutex_lock(&waitable->Lock);
+
+    Event->Header.SignalState = 0;
+
+    pthread_mutex_unlock(&waitable->Lock);
+}
+
+VOID
+KeInitializeSemaphore(_Out_ PRKSEMAPHORE Semaphore,
+                      _In_ LONG          Count,
+                      _In_ LONG          Limit)
+{
+    RtlZeroMemory(Semaphore,
+                  sizeof(KSEMAPHORE));
+
+    Semaphore->Header.Type        = GENFILTER_SIM_SEMAPHORE;
+    Semaphore->Header.SignalState = Count;
+    Semaphore->Limit              = Limit;
+
+    GenFilterSimInitializeWaitable(GenFilterSimWaitable(Semaphore));
+}
+
+LONG
+KeReleaseSemaphore(_Inout_ PRKSEMAPHORE Semaphore,
+                   _In_ KPRIORITY       Increment,
+                   _In_ LONG            Adjustment,
+                   _In_ BOOLEAN         Wait)
+{
+    PGENFILTER_SIM_WAITABLE waitable = GenFilterSimWaitable(Semaphore);
+    LONG                    previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&waitable->Lock);
+
+    previous                      = Semaphore->Header.SignalState;
+    Semaphore->Header.SignalState = (Adjustment > Semaphore->Limit - previous) ? Semaphore->Limit :
+                                                                                 previous + Adjustment;
+
+    pthread_cond_broadcast(&waitable->Signalled);
+    pthread_mutex_unlock(&waitable->Lock);
+
+    return previous;
+}
+
+//
+// Timeouts are negative (relative) 100ns intervals; we don't do absolute
+// ones
+//
+static
+struct timespec
+GenFilterSimDeadline(_In_ LONGLONG Timeout)
+{
+    struct timespec deadline;
+    ULONGLONG       nanoseconds;
+
+    nanoseconds = GenFilterSimNanoseconds(CLOCK_REALTIME) +
+                  (ULONGLONG)(Timeout < 0 ? -Timeout : Timeout) * 100;
+
+    deadline.tv_sec  = (time_t)(nanoseconds / 1000000000ULL);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+
+    return deadline;
+}
+
+NTSTATUS
+KeWaitForSingleObject(_In_ PVOID             Object,
+                      _In_ KWAIT_REASON      WaitReason,
+                      _In_ KPROCESSOR_MODE   WaitMode,
+                      _In_ BOOLEAN           Alertable,
+                      _In_opt_ PLARGE_INTEGER Timeout)
+{
+    auto*                   header = (DISPATCHER_HEADER*)Object;
+    PGENFILTER_SIM_WAITABLE waitable;
+    struct timespec         deadline;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    //
+    // A thread is signalled when it has exited
+    //
+    if (header->Type == GENFILTER_SIM_THREAD) {
+
+        auto* thread = (PKTHREAD)Object;
+
+        if (!thread->Joined) {
+
+            pthread_join(thread->Thread,
+                         nullptr);
+
+            thread->Joined = TRUE;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    waitable = GenFilterSimWaitable(Object);
+
+    if (Timeout != nullptr) {
+        deadline = GenFilterSimDeadline(Timeout->QuadPart);
+    }
+
+    pthread_mutex_lock(&waitable->Lock);
+
+    while (header->SignalState == 0) {
+
+        if (Timeout == nullptr) {
+
+            pthread_cond_wait(&waitable->Signalled,
+                              &waitable->Lock);
+
+        } else if (pthread_cond_timedwait(&waitable->Signalled,
+                                          &waitable->Lock,
+                                          &deadline) != 0) {
+            status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+
+    if (status == STATUS_SUCCESS &&
+        header->Type != GENFILTER_SIM_NOTIFICATION_EVENT) {
+
+        //
+        // Semaphores count down; synchronization events reset
+        //
+        header->SignalState = (header->Type == GENFILTER_SIM_SEMAPHORE) ? header->SignalState - 1 :
+                                                                          0;
+    }
+
+    pthread_mutex_unlock(&waitable->Lock);
+
+    return status;
+}
+
+NTSTATUS
+KeDelayExecutionThread(_In_ KPROCESSOR_MODE WaitMode,
+                       _In_ BOOLEAN         Alertable,
+                       _In_ PLARGE_INTEGER  Interval)
+{
+    struct timespec delay;
+    ULONGLONG       nanoseconds;
+
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    nanoseconds = (ULONGLONG)(Interval->QuadPart < 0 ? -Interval->QuadPart : Interval->QuadPart) * 100;
+
+    delay.tv_sec  = (time_t)(nanoseconds / 1000000000ULL);
+    delay.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+
+    nanosleep(&delay,
+              nullptr);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// System threads
+//
+static
+PVOID
+GenFilterSimThreadStart(_In_ PVOID Context)
+{
+    auto* thread = (PKTHREAD)Context;
+
+    thread->StartRoutine(thread->StartContext);
+
+    return nullptr;
+}
+
+static
+VOID
+GenFilterSimThreadDereference(_In_ PKTHREAD Thread)
+{
+    if (InterlockedDecrement(&Thread->References) != 0) {
+        return;
+    }
+
+    if (!Thread->Joined) {
+        pthread_detach(Thread->Thread);
+    }
+
+    delete Thread;
+}
+
+NTSTATUS
+PsCreateSystemThread(_Out_ PHANDLE               ThreadHandle,
+                     _In_ ULONG                  DesiredAccess,
+                     _In_opt_ POBJECT_ATTRIBUTES ObjectAttributes,
+                     _In_opt_ HANDLE             ProcessHandle,
+                     _Out_opt_ PCLIENT_ID        ClientId,
+                     _In_ PKSTART_ROUTINE        StartRoutine,
+                     _In_opt_ PVOID              StartContext)
+{
+    PKTHREAD thread;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(ProcessHandle);
+
+    thread = new (std::nothrow) KTHREAD();
+
+    if (thread == nullptr) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    thread->Header.Type  = GENFILTER_SIM_THREAD;
+    thread->References   = 1;
+    thread->StartRoutine = StartRoutine;
+    thread->StartContext = StartContext;
+
+    if (pthread_create(&thread->Thread,
+                       nullptr,
+                       GenFilterSimThreadStart,
+                       thread) != 0) {
+        delete thread;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (ClientId != nullptr) {
+        ClientId->UniqueProcess = nullptr;
+        ClientId->UniqueThread  = thread;
+    }
+
+    *ThreadHandle = thread;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PsTerminateSystemThread(_In_ NTSTATUS ExitStatus)
+{
+    UNREFERENCED_PARAMETER(ExitStatus);
+
+    pthread_exit(nullptr);
+}
+
+NTSTATUS
+ObReferenceObjectByHandle(_In_ HANDLE            Handle,
+                          _In_ ACCESS_MASK       DesiredAccess,
+                          _In_opt_ POBJECT_TYPE  ObjectType,
+                          _In_ KPROCESSOR_MODE   AccessMode,
+                          _Out_ PVOID*           Object,
+                          _Out_opt_ PVOID        HandleInformation)
+{
+    auto* thread = (PKTHREAD)Handle;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+
+    //
+    // Threads are the only objects we have handles to
+    //
+    if (ObjectType != GenFilterSimThreadType ||
+        thread == nullptr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InterlockedIncrement(&thread->References);
+
+    *Object = thread;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+ObDereferenceObject(_In_ PVOID Object)
+{
+    GenFilterSimThreadDereference((PKTHREAD)Object);
+}
+
+NTSTATUS
+ZwClose(_In_ HANDLE Handle)
+{
+    GenFilterSimThreadDereference((PKTHREAD)Handle);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Pool
+//
+PVOID
+ExAllocatePoolWithTag(_In_ POOL_TYPE PoolType,
+                      _In_ SIZE_T    NumberOfBytes,
+                      _In_ ULONG     Tag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    return aligned_alloc(MEMORY_ALLOCATION_ALIGNMENT,
+                         ALIGN_UP_BY(NumberOfBytes == 0 ? 1 : NumberOfBytes,
+                                     MEMORY_ALLOCATION_ALIGNMENT));
+}
+
+VOID
+ExFreePoolWithTag(_In_ PVOID P,
+                  _In_ ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    free(P);
+}
+
+//
+// MDLs
+//
+PMDL
+IoAllocateMdl(_In_opt_ PVOID     VirtualAddress,
+              _In_ ULONG         Length,
+              _In_ BOOLEAN       SecondaryBuffer,
+              _In_ BOOLEAN       ChargeQuota,
+              _Inout_opt_ PIRP   Irp)
+{
+    PMDL mdl;
+
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    mdl = (PMDL)ExAllocatePoolWithTag(NonPagedPoolNx,
+                                      MmSizeOfMdl(VirtualAddress,
+                                                  Length),
+                                      'lMnG');
+
+    if (mdl == nullptr) {
+        return nullptr;
+    }
+
+    MmInitializeMdl(mdl,
+                    VirtualAddress,
+                    Length);
+
+    if (Irp != nullptr) {
+        Irp->MdlAddress = mdl;
+    }
+
+    return mdl;
+}
+
+VOID
+IoFreeMdl(_In_ PMDL Mdl)
+{
+    ExFreePoolWithTag(Mdl,
+                      'lMnG');
+}
+
+//
+// IRPs
+//
+NTSTATUS
+IoCallDriver(_In_ PDEVICE_OBJECT DeviceObject,
+             _Inout_ PIRP        Irp)
+{
+    //
+    // Running out of stack locations is a bug in whoever built the IRP
+    //
+    if (Irp->SimCurrentLocation == &Irp->SimStack[0]) {
+
+        fprintf(stderr,
+                "GenFilterSim: IRP %p has no stack location left for device %p\n",
+                (PVOID)Irp,
+                (PVOID)DeviceObject);
+        abort();
+    }
+
+    Irp->SimCurrentLocation--;
+    Irp->SimCurrentLocation->DeviceObject = DeviceObject;
+
+    return DeviceObject->SimDispatch(DeviceObject,
+                                     Irp);
+}
+
+VOID
+IoCompleteRequest(_In_ PIRP  Irp,
+                  _In_ UCHAR PriorityBoost)
+{
+    PIO_STACK_LOCATION top = &Irp->SimStack[GENFILTER_SIM_IRP_STACK_SIZE];
+
+    UNREFERENCED_PARAMETER(PriorityBoost);
+
+    //
+    // Call the completion routine each driver above set in the location
+    // below its own, from the bottom up, just as the I/O manager does.  A
+    // driver that wants the IRP back returns STATUS_MORE_PROCESSING_REQUIRED.
+    //
+    while (Irp->SimCurrentLocation < top) {
+
+        PIO_STACK_LOCATION     location = Irp->SimCurrentLocation;
+        PIO_COMPLETION_ROUTINE routine  = location->CompletionRoutine;
+        PVOID                  context  = location->Context;
+        UCHAR                  control  = location->Control;
+        BOOLEAN                invoke;
+
+        location->CompletionRoutine = nullptr;
+        location->Control           = 0;
+
+        Irp->SimCurrentLocation++;
+
+        invoke = NT_SUCCESS(Irp->IoStatus.Status) ? (control & SL_INVOKE_ON_SUCCESS) != 0 :
+                                                    (control & SL_INVOKE_ON_ERROR) != 0;
+
+        if (routine != nullptr && invoke) {
+
+            if (routine(Irp->SimCurrentLocation < top ? Irp->SimCurrentLocation->DeviceObject : nullptr,
+                        Irp,
+                        context) == STATUS_MORE_PROCESSING_REQUIRED) {
+                return;
+            }
+        }
+    }
+
+    //
+    // Past the top: tell whoever sent it
+    //
+    if (Irp->SimCompletion != nullptr) {
+        Irp->SimCompletion(Irp,
+                           Irp->SimCompletionContext);
+    }
+}
+
+ULONG
+IoGetRequestorProcessId(_In_ PIRP Irp)
+{
+    return Irp->SimProcessId;
+}
+
+//
+// Strings and debug output
+//
+NTSTATUS
+RtlUnicodeStringToInteger(_In_ PCUNICODE_STRING String,
+                          _In_opt_ ULONG        Base,
+                          _Out_ PULONG          Value)
+{
+    ULONG  length = String->Length / sizeof(WCHAR);
+    ULONG  index  = 0;
+    ULONG  result = 0;
+    BOOLEAN any   = FALSE;
+
+    while (index < length && String->Buffer[index] == L' ') {
+        index++;
+    }
+
+    if (Base == 0) {
+
+        Base = 10;
+
+        if (index + 1 < length &&
+            String->Buffer[index] == L'0' &&
+            (String->Buffer[index + 1] == L'x' || String->Buffer[index + 1] == L'X')) {
+
+            Base   = 16;
+            index += 2;
+        }
+    }
+
+    for (; index < length; index++) {
+
+        WCHAR c = String->Buffer[index];
+        ULONG digit;
+
+        if (c >= L'0' && c <= L'9') {
+            digit = (ULONG)(c - L'0');
+        } else if (c >= L'a' && c <= L'f') {
+            digit = (ULONG)(c - L'a' + 10);
+        } else if (c >= L'A' && c <= L'F') {
+            digit = (ULONG)(c - L'A' + 10);
+        } else {
+            break;
+        }
+
+        if (digit >= Base) {
+            break;
+        }
+
+        result = result * Base + digit;
+        any    = TRUE;
+    }
+
+    if (!any) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *Value = result;
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+DbgPrint(_In_ PCSTR Format,
+         ...)
+{
+    va_list arguments;
+
+    va_start(arguments,
+             Format);
+
+    vfprintf(stderr,
+             Format,
+             arguments);
+
+    va_end(arguments);
+
+    return 0;
+}
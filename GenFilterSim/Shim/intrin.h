@@ -0,0 +1,116 @@
+///
+/// @file intrin.h
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// The MSVC intrinsics GenFilter uses that GCC spells differently.  The
+// SSE and AVX intrinsics themselves come from <immintrin.h>.
+
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+
+#include <immintrin.h>
+#include <cpuid.h>
+
+//
+// TRUE if GenFilterSim was asked to pretend the processor has nothing
+// beyond the x86 baseline (see GenFilterSimWdm.cpp), so that GenFilter
+// picks its scalar kernels
+//
+BOOLEAN
+GenFilterSimCpuIsBaseline();
+
+//
+// GCC's <cpuid.h> may have its own __cpuidex, with a different meaning for
+// the arguments, so ours is a macro that replaces it
+//
+FORCEINLINE
+VOID
+GenFilterSimCpuidex(_Out_ int CpuInfo[4],
+                    _In_ int  Function,
+                    _In_ int  SubFunction)
+{
+    __cpuid_count(Function,
+                  SubFunction,
+                  CpuInfo[0],
+                  CpuInfo[1],
+                  CpuInfo[2],
+                  CpuInfo[3]);
+
+    if (GenFilterSimCpuIsBaseline()) {
+
+        if (Function == 0) {
+            CpuInfo[0] = 0;
+        } else {
+            CpuInfo[1] = 0;
+            CpuInfo[2] = 0;
+            CpuInfo[3] = 0;
+        }
+    }
+}
+
+#undef __cpuidex
+#define __cpuidex GenFilterSimCpuidex
+
+#undef __cpuid
+
+FORCEINLINE
+VOID
+__cpuid(_Out_ int CpuInfo[4],
+        _In_ int  Function)
+{
+    __cpuidex(CpuInfo,
+              Function,
+              0);
+}
+
+FORCEINLINE
+UCHAR
+_BitScanForward(_Out_ unsigned long* Index,
+                _In_ unsigned long   Mask)
+{
+    if (Mask == 0) {
+        return 0;
+    }
+
+    *Index = (unsigned long)__builtin_ctzl(Mask);
+    return 1;
+}
@@ -0,0 +1,577 @@
+///
+/// @file wdf.h
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// Just enough of KMDF's <wdf.h> for GenFilter to build as part of GenFilterSim,
+// the user-mode harness.  The structures and their _INIT routines are here;
+// the objects and the DDIs are implemented in GenFilterSimWdf.cpp.
+
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <wdm.h>
+
+//
+// Handles.  Every handle is a pointer to one of the shim's objects.
+//
+#define WDF_DECLARE_HANDLE(h) typedef struct h##__* h
+
+WDF_DECLARE_HANDLE(WDFDRIVER);
+WDF_DECLARE_HANDLE(WDFDEVICE);
+WDF_DECLARE_HANDLE(WDFQUEUE);
+WDF_DECLARE_HANDLE(WDFREQUEST);
+WDF_DECLARE_HANDLE(WDFIOTARGET);
+WDF_DECLARE_HANDLE(WDFMEMORY);
+WDF_DECLARE_HANDLE(WDFKEY);
+WDF_DECLARE_HANDLE(WDFTIMER);
+WDF_DECLARE_HANDLE(WDFWORKITEM);
+WDF_DECLARE_HANDLE(WDFSPINLOCK);
+WDF_DECLARE_HANDLE(WDFWAITLOCK);
+WDF_DECLARE_HANDLE(WDFFILEOBJECT);
+WDF_DECLARE_HANDLE(WDFCOLLECTION);
+WDF_DECLARE_HANDLE(WDFSTRING);
+
+typedef struct WDFDEVICE_INIT* PWDFDEVICE_INIT;
+typedef PVOID                  WDFCONTEXT;
+typedef PVOID                  WDFOBJECT;
+
+#define WDF_NO_OBJECT_ATTRIBUTES    ((PWDF_OBJECT_ATTRIBUTES)nullptr)
+#define WDF_NO_HANDLE               nullptr
+#define WDF_NO_SEND_OPTIONS         ((PWDF_REQUEST_SEND_OPTIONS)nullptr)
+#define WDF_NO_CONTEXT              ((PVOID)nullptr)
+
+#define WDF_REL_TIMEOUT_IN_MS(ms)   (-(LONGLONG)(ms) * 10000)
+#define WDF_REL_TIMEOUT_IN_US(us)   (-(LONGLONG)(us) * 10)
+
+#define PLUGPLAY_REGKEY_DEVICE      1
+#define KEY_READ                    0x20019
+#define REG_BINARY                  3
+#define REG_DWORD                   4
+#define REG_MULTI_SZ                7
+
+typedef enum _WDF_TRI_STATE {
+    WdfFalse,
+    WdfTrue,
+    WdfUseDefault,
+} WDF_TRI_STATE;
+
+//
+// Objects and their contexts
+//
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO {
+    ULONG  Size;
+    PCSTR  ContextName;
+    size_t ContextSize;
+    size_t ContextAlignment;
+} WDF_OBJECT_CONTEXT_TYPE_INFO, *PWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef const WDF_OBJECT_CONTEXT_TYPE_INFO* PCWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(_In_ WDFOBJECT Object);
+typedef VOID EVT_WDF_OBJECT_CONTEXT_DESTROY(_In_ WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_CLEANUP* PFN_WDF_OBJECT_CONTEXT_CLEANUP;
+typedef EVT_WDF_OBJECT_CONTEXT_DESTROY* PFN_WDF_OBJECT_CONTEXT_DESTROY;
+
+typedef enum _WDF_EXECUTION_LEVEL {
+    WdfExecutionLevelInvalid,
+    WdfExecutionLevelInheritFromParent,
+    WdfExecutionLevelPassive,
+    WdfExecutionLevelDispatch,
+} WDF_EXECUTION_LEVEL;
+
+typedef enum _WDF_SYNCHRONIZATION_SCOPE {
+    WdfSynchronizationScopeInvalid,
+    WdfSynchronizationScopeInheritFromParent,
+    WdfSynchronizationScopeDevice,
+    WdfSynchronizationScopeQueue,
+    WdfSynchronizationScopeNone,
+} WDF_SYNCHRONIZATION_SCOPE;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES {
+    ULONG                          Size;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP EvtCleanupCallback;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY EvtDestroyCallback;
+    WDF_EXECUTION_LEVEL            ExecutionLevel;
+    WDF_SYNCHRONIZATION_SCOPE      SynchronizationScope;
+    WDFOBJECT                      ParentObject;
+    size_t                         ContextSizeOverride;
+    PCWDF_OBJECT_CONTEXT_TYPE_INFO ContextTypeInfo;
+} WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+FORCEINLINE
+VOID
+WDF_OBJECT_ATTRIBUTES_INIT(_Out_ PWDF_OBJECT_ATTRIBUTES Attributes)
+{
+    RtlZeroMemory(Attributes,
+                  sizeof(WDF_OBJECT_ATTRIBUTES));
+
+    Attributes->Size                 = sizeof(WDF_OBJECT_ATTRIBUTES);
+    Attributes->ExecutionLevel       = WdfExecutionLevelInheritFromParent;
+    Attributes->SynchronizationScope = WdfSynchronizationScopeInheritFromParent;
+}
+
+PVOID     WdfObjectGetTypedContextWorker(_In_ WDFOBJECT Handle, _In_ PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo);
+WDFOBJECT WdfObjectContextGetObject(_In_ PVOID ContextPointer);
+VOID      WdfObjectDelete(_In_ WDFOBJECT Object);
+VOID      WdfObjectReference(_In_ WDFOBJECT Object);
+VOID      WdfObjectDereference(_In_ WDFOBJECT Object);
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, _castingfunction)       \
+    inline const WDF_OBJECT_CONTEXT_TYPE_INFO WDF_##_contexttype##_TYPE_INFO = {  \
+        sizeof(WDF_OBJECT_CONTEXT_TYPE_INFO),                                     \
+        #_contexttype,                                                            \
+        sizeof(_contexttype),                                                     \
+        alignof(_contexttype),                                                    \
+    };                                                                            \
+                                                                                  \
+    FORCEINLINE                                                                   \
+    _contexttype*                                                                 \
+    _castingfunction(_In_ WDFOBJECT Handle)                                       \
+    {                                                                             \
+        return (_contexttype*)WdfObjectGetTypedContextWorker(                     \
+            Handle,                                                               \
+            &WDF_##_contexttype##_TYPE_INFO);                                     \
+    }
+
+#define WDF_DECLARE_CONTEXT_TYPE(_contexttype) \
+    WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, WdfObjectGet_##_contexttype)
+
+#define WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(_attributes, _contexttype) \
+    ((_attributes)->ContextTypeInfo = &WDF_##_contexttype##_TYPE_INFO)
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(_attributes, _contexttype) \
+    do {                                                                   \
+        WDF_OBJECT_ATTRIBUTES_INIT(_attributes);                           \
+        WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(_attributes, _contexttype); \
+    } while (0)
+
+//
+// The driver
+//
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit);
+typedef EVT_WDF_DRIVER_DEVICE_ADD* PFN_WDF_DRIVER_DEVICE_ADD;
+
+typedef struct _WDF_DRIVER_CONFIG {
+    ULONG                     Size;
+    PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
+    ULONG                     DriverInitFlags;
+    ULONG                     DriverPoolTag;
+} WDF_DRIVER_CONFIG, *PWDF_DRIVER_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_DRIVER_CONFIG_INIT(_Out_ PWDF_DRIVER_CONFIG        Config,
+                       _In_opt_ PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd)
+{
+    RtlZeroMemory(Config,
+                  sizeof(WDF_DRIVER_CONFIG));
+
+    Config->Size               = sizeof(WDF_DRIVER_CONFIG);
+    Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+NTSTATUS WdfDriverCreate(_In_ PDRIVER_OBJECT DriverObject, _In_ PCUNICODE_STRING RegistryPath, _In_opt_ PWDF_OBJECT_ATTRIBUTES DriverAttributes, _In_ PWDF_DRIVER_CONFIG DriverConfig, _Out_opt_ WDFDRIVER* Driver);
+WDFDRIVER WdfGetDriver();
+
+//
+// Devices
+//
+typedef NTSTATUS EVT_WDFDEVICE_WDM_IRP_PREPROCESS(_In_ WDFDEVICE Device, _Inout_ PIRP Irp);
+typedef EVT_WDFDEVICE_WDM_IRP_PREPROCESS* PFN_WDFDEVICE_WDM_IRP_PREPROCESS;
+
+typedef enum _WDF_REQUEST_TYPE {
+    WdfRequestTypeCreate                = IRP_MJ_CREATE,
+    WdfRequestTypeClose                 = IRP_MJ_CLOSE,
+    WdfRequestTypeRead                  = IRP_MJ_READ,
+    WdfRequestTypeWrite                 = IRP_MJ_WRITE,
+    WdfRequestTypeDeviceControl         = IRP_MJ_DEVICE_CONTROL,
+    WdfRequestTypeDeviceControlInternal = IRP_MJ_INTERNAL_DEVICE_CONTROL,
+    WdfRequestTypeMax                   = IRP_MJ_MAXIMUM_FUNCTION + 1,
+} WDF_REQUEST_TYPE;
+
+VOID     WdfFdoInitSetFilter(_In_ PWDFDEVICE_INIT DeviceInit);
+VOID     WdfDeviceInitSetRequestAttributes(_In_ PWDFDEVICE_INIT DeviceInit, _In_ PWDF_OBJECT_ATTRIBUTES RequestAttributes);
+NTSTATUS WdfDeviceInitAssignWdmIrpPreprocessCallback(_In_ PWDFDEVICE_INIT DeviceInit, _In_ PFN_WDFDEVICE_WDM_IRP_PREPROCESS EvtDeviceWdmIrpPreprocess, _In_ UCHAR MajorFunction, _In_opt_ PUCHAR MinorFunctions, _In_ ULONG NumMinorFunctions);
+NTSTATUS WdfDeviceCreate(_Inout_ PWDFDEVICE_INIT* DeviceInit, _In_opt_ PWDF_OBJECT_ATTRIBUTES DeviceAttributes, _Out_ WDFDEVICE* Device);
+NTSTATUS WdfDeviceWdmDispatchPreprocessedIrp(_In_ WDFDEVICE Device, _In_ PIRP Irp);
+NTSTATUS WdfDeviceConfigureRequestDispatching(_In_ WDFDEVICE Device, _In_ WDFQUEUE Queue, _In_ WDF_REQUEST_TYPE RequestType);
+
+PDEVICE_OBJECT WdfDeviceWdmGetDeviceObject(_In_ WDFDEVICE Device);
+PDEVICE_OBJECT WdfDeviceWdmGetAttachedDevice(_In_ WDFDEVICE Device);
+WDFIOTARGET    WdfDeviceGetIoTarget(_In_ WDFDEVICE Device);
+
+//
+// The registry
+//
+NTSTATUS WdfDeviceOpenRegistryKey(_In_ WDFDEVICE Device, _In_ ULONG DeviceInstanceKeyType, _In_ ACCESS_MASK DesiredAccess, _In_opt_ PWDF_OBJECT_ATTRIBUTES KeyAttributes, _Out_ WDFKEY* Key);
+NTSTATUS WdfRegistryQueryULong(_In_ WDFKEY Key, _In_ PCUNICODE_STRING ValueName, _Out_ PULONG Value);
+NTSTATUS WdfRegistryQueryMultiString(_In_ WDFKEY Key, _In_ PCUNICODE_STRING ValueName, _In_opt_ PWDF_OBJECT_ATTRIBUTES StringsAttributes, _In_ WDFCOLLECTION Collection);
+VOID     WdfRegistryClose(_In_ WDFKEY Key);
+
+NTSTATUS  WdfCollectionCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES CollectionAttributes, _Out_ WDFCOLLECTION* Collection);
+ULONG     WdfCollectionGetCount(_In_ WDFCOLLECTION Collection);
+WDFOBJECT WdfCollectionGetItem(_In_ WDFCOLLECTION Collection, _In_ ULONG Index);
+VOID      WdfStringGetUnicodeString(_In_ WDFSTRING String, _Out_ PUNICODE_STRING UnicodeString);
+
+//
+// Queues
+//
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEFAULT(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request);
+typedef VOID EVT_WDF_IO_QUEUE_IO_READ(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request, _In_ size_t Length);
+typedef VOID EVT_WDF_IO_QUEUE_IO_WRITE(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request, _In_ size_t Length);
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request, _In_ size_t OutputBufferLength, _In_ size_t InputBufferLength, _In_ ULONG IoControlCode);
+typedef VOID EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL(_In_ WDFQUEUE Queue, _In_ WDFREQUEST Request, _In_ size_t OutputBufferLength, _In_ size_t InputBufferLength, _In_ ULONG IoControlCode);
+
+typedef EVT_WDF_IO_QUEUE_IO_DEFAULT*                 PFN_WDF_IO_QUEUE_IO_DEFAULT;
+typedef EVT_WDF_IO_QUEUE_IO_READ*                    PFN_WDF_IO_QUEUE_IO_READ;
+typedef EVT_WDF_IO_QUEUE_IO_WRITE*                   PFN_WDF_IO_QUEUE_IO_WRITE;
+typedef EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL*          PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL;
+typedef EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL* PFN_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL;
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE {
+    WdfIoQueueDispatchInvalid,
+    WdfIoQueueDispatchSequential,
+    WdfIoQueueDispatchParallel,
+    WdfIoQueueDispatchManual,
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef struct _WDF_IO_QUEUE_CONFIG {
+    ULONG                                       Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE                  DispatchType;
+    WDF_TRI_STATE                               PowerManaged;
+    BOOLEAN                                     AllowZeroLengthRequests;
+    BOOLEAN                                     DefaultQueue;
+    PFN_WDF_IO_QUEUE_IO_DEFAULT                 EvtIoDefault;
+    PFN_WDF_IO_QUEUE_IO_READ                    EvtIoRead;
+    PFN_WDF_IO_QUEUE_IO_WRITE                   EvtIoWrite;
+    PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL          EvtIoDeviceControl;
+    PFN_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL EvtIoInternalDeviceControl;
+
+    union {
+        struct {
+            ULONG NumberOfPresentedRequests;
+        } Parallel;
+    } Settings;
+} WDF_IO_QUEUE_CONFIG, *PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_IO_QUEUE_CONFIG_INIT(_Out_ PWDF_IO_QUEUE_CONFIG      Config,
+                         _In_ WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+    RtlZeroMemory(Config,
+                  sizeof(WDF_IO_QUEUE_CONFIG));
+
+    Config->Size                                        = sizeof(WDF_IO_QUEUE_CONFIG);
+    Config->PowerManaged                                = WdfUseDefault;
+    Config->DispatchType                                = DispatchType;
+    Config->Settings.Parallel.NumberOfPresentedRequests = (ULONG)-1;
+}
+
+FORCEINLINE
+VOID
+WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(_Out_ PWDF_IO_QUEUE_CONFIG      Config,
+                                       _In_ WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+    WDF_IO_QUEUE_CONFIG_INIT(Config,
+                             DispatchType);
+
+    Config->DefaultQueue = TRUE;
+}
+
+NTSTATUS  WdfIoQueueCreate(_In_ WDFDEVICE Device, _In_ PWDF_IO_QUEUE_CONFIG Config, _In_opt_ PWDF_OBJECT_ATTRIBUTES QueueAttributes, _Out_opt_ WDFQUEUE* Queue);
+WDFDEVICE WdfIoQueueGetDevice(_In_ WDFQUEUE Queue);
+NTSTATUS  WdfIoQueueRetrieveNextRequest(_In_ WDFQUEUE Queue, _Out_ WDFREQUEST* OutRequest);
+
+//
+// Requests
+//
+typedef struct _WDF_REQUEST_PARAMETERS {
+    USHORT           Size;
+    UCHAR            MinorFunction;
+    WDF_REQUEST_TYPE Type;
+
+    union {
+        struct {
+            size_t   Length;
+            ULONG    Key;
+            LONGLONG DeviceOffset;
+        } Read;
+
+        struct {
+            size_t   Length;
+            ULONG    Key;
+            LONGLONG DeviceOffset;
+        } Write;
+
+        struct {
+            size_t OutputBufferLength;
+            size_t InputBufferLength;
+            ULONG  IoControlCode;
+            PVOID  Type3InputBuffer;
+        } DeviceIoControl;
+    } Parameters;
+} WDF_REQUEST_PARAMETERS, *PWDF_REQUEST_PARAMETERS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_PARAMETERS_INIT(_Out_ PWDF_REQUEST_PARAMETERS Parameters)
+{
+    RtlZeroMemory(Parameters,
+                  sizeof(WDF_REQUEST_PARAMETERS));
+
+    Parameters->Size = sizeof(WDF_REQUEST_PARAMETERS);
+}
+
+typedef struct _WDF_REQUEST_COMPLETION_PARAMS {
+    ULONG            Size;
+    WDF_REQUEST_TYPE Type;
+    IO_STATUS_BLOCK  IoStatus;
+
+    union {
+        struct {
+            WDFMEMORY Buffer;
+            size_t    Length;
+            size_t    Offset;
+        } Read;
+
+        struct {
+            WDFMEMORY Buffer;
+            size_t    Length;
+            size_t    Offset;
+        } Write;
+
+        struct {
+            ULONG IoControlCode;
+
+            struct {
+                WDFMEMORY Buffer;
+                size_t    Offset;
+            } Input;
+
+            struct {
+                WDFMEMORY Buffer;
+                size_t    Offset;
+                size_t    Length;
+            } Output;
+        } Ioctl;
+    } Parameters;
+} WDF_REQUEST_COMPLETION_PARAMS, *PWDF_REQUEST_COMPLETION_PARAMS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_COMPLETION_PARAMS_INIT(_Out_ PWDF_REQUEST_COMPLETION_PARAMS Params)
+{
+    RtlZeroMemory(Params,
+                  sizeof(WDF_REQUEST_COMPLETION_PARAMS));
+
+    Params->Size = sizeof(WDF_REQUEST_COMPLETION_PARAMS);
+    Params->Type = WdfRequestTypeMax;
+}
+
+typedef VOID EVT_WDF_REQUEST_COMPLETION_ROUTINE(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target, _In_ PWDF_REQUEST_COMPLETION_PARAMS Params, _In_ WDFCONTEXT Context);
+typedef VOID EVT_WDF_REQUEST_CANCEL(_In_ WDFREQUEST Request);
+typedef EVT_WDF_REQUEST_COMPLETION_ROUTINE* PFN_WDF_REQUEST_COMPLETION_ROUTINE;
+typedef EVT_WDF_REQUEST_CANCEL*             PFN_WDF_REQUEST_CANCEL;
+
+typedef enum _WDF_REQUEST_SEND_OPTIONS_FLAGS {
+    WDF_REQUEST_SEND_OPTION_TIMEOUT                = 0x00000001,
+    WDF_REQUEST_SEND_OPTION_SYNCHRONOUS            = 0x00000002,
+    WDF_REQUEST_SEND_OPTION_IGNORE_TARGET_STATE    = 0x00000004,
+    WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET        = 0x00000008,
+} WDF_REQUEST_SEND_OPTIONS_FLAGS;
+
+typedef struct _WDF_REQUEST_SEND_OPTIONS {
+    ULONG    Size;
+    ULONG    Flags;
+    LONGLONG Timeout;
+} WDF_REQUEST_SEND_OPTIONS, *PWDF_REQUEST_SEND_OPTIONS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_SEND_OPTIONS_INIT(_Out_ PWDF_REQUEST_SEND_OPTIONS Options,
+                              _In_ ULONG                      Flags)
+{
+    RtlZeroMemory(Options,
+                  sizeof(WDF_REQUEST_SEND_OPTIONS));
+
+    Options->Size  = sizeof(WDF_REQUEST_SEND_OPTIONS);
+    Options->Flags = Flags;
+}
+
+typedef enum _WDF_REQUEST_REUSE_FLAGS {
+    WDF_REQUEST_REUSE_NO_FLAGS    = 0x00000000,
+    WDF_REQUEST_REUSE_SET_NEW_IRP = 0x00000001,
+} WDF_REQUEST_REUSE_FLAGS;
+
+typedef struct _WDF_REQUEST_REUSE_PARAMS {
+    ULONG    Size;
+    ULONG    Flags;
+    NTSTATUS Status;
+    PIRP     NewIrp;
+} WDF_REQUEST_REUSE_PARAMS, *PWDF_REQUEST_REUSE_PARAMS;
+
+FORCEINLINE
+VOID
+WDF_REQUEST_REUSE_PARAMS_INIT(_Out_ PWDF_REQUEST_REUSE_PARAMS Params,
+                              _In_ ULONG                      Flags,
+                              _In_ NTSTATUS                   Status)
+{
+    RtlZeroMemory(Params,
+                  sizeof(WDF_REQUEST_REUSE_PARAMS));
+
+    Params->Size   = sizeof(WDF_REQUEST_REUSE_PARAMS);
+    Params->Flags  = Flags;
+    Params->Status = Status;
+}
+
+NTSTATUS        WdfRequestCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES RequestAttributes, _In_opt_ WDFIOTARGET IoTarget, _Out_ WDFREQUEST* Request);
+NTSTATUS        WdfRequestReuse(_In_ WDFREQUEST Request, _In_ PWDF_REQUEST_REUSE_PARAMS ReuseParams);
+BOOLEAN         WdfRequestSend(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target, _In_opt_ PWDF_REQUEST_SEND_OPTIONS Options);
+NTSTATUS        WdfRequestGetStatus(_In_ WDFREQUEST Request);
+VOID            WdfRequestComplete(_In_ WDFREQUEST Request, _In_ NTSTATUS Status);
+VOID            WdfRequestCompleteWithInformation(_In_ WDFREQUEST Request, _In_ NTSTATUS Status, _In_ ULONG_PTR Information);
+VOID            WdfRequestSetInformation(_In_ WDFREQUEST Request, _In_ ULONG_PTR Information);
+ULONG_PTR       WdfRequestGetInformation(_In_ WDFREQUEST Request);
+VOID            WdfRequestGetParameters(_In_ WDFREQUEST Request, _Out_ PWDF_REQUEST_PARAMETERS Parameters);
+VOID            WdfRequestGetCompletionParams(_In_ WDFREQUEST Request, _Out_ PWDF_REQUEST_COMPLETION_PARAMS Params);
+VOID            WdfRequestFormatRequestUsingCurrentType(_In_ WDFREQUEST Request);
+VOID            WdfRequestWdmFormatUsingStackLocation(_In_ WDFREQUEST Request, _In_ PIO_STACK_LOCATION Stack);
+VOID            WdfRequestSetCompletionRoutine(_In_ WDFREQUEST Request, _In_opt_ PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine, _In_opt_ WDFCONTEXT CompletionContext);
+NTSTATUS        WdfRequestForwardToIoQueue(_In_ WDFREQUEST Request, _In_ WDFQUEUE DestinationQueue);
+WDFQUEUE        WdfRequestGetIoQueue(_In_ WDFREQUEST Request);
+PIRP            WdfRequestWdmGetIrp(_In_ WDFREQUEST Request);
+WDFFILEOBJECT   WdfRequestGetFileObject(_In_ WDFREQUEST Request);
+KPROCESSOR_MODE WdfRequestGetRequestorMode(_In_ WDFREQUEST Request);
+NTSTATUS        WdfRequestMarkCancelableEx(_In_ WDFREQUEST Request, _In_ PFN_WDF_REQUEST_CANCEL EvtRequestCancel);
+NTSTATUS        WdfRequestUnmarkCancelable(_In_ WDFREQUEST Request);
+BOOLEAN         WdfRequestIsCanceled(_In_ WDFREQUEST Request);
+
+NTSTATUS WdfRequestRetrieveInputBuffer(_In_ WDFREQUEST Request, _In_ size_t MinimumRequiredLength, _Outptr_ PVOID* Buffer, _Out_opt_ size_t* Length);
+NTSTATUS WdfRequestRetrieveOutputBuffer(_In_ WDFREQUEST Request, _In_ size_t MinimumRequiredSize, _Outptr_ PVOID* Buffer, _Out_opt_ size_t* Length);
+NTSTATUS WdfRequestRetrieveInputWdmMdl(_In_ WDFREQUEST Request, _Outptr_ PMDL* Mdl);
+NTSTATUS WdfRequestRetrieveOutputWdmMdl(_In_ WDFREQUEST Request, _Outptr_ PMDL* Mdl);
+
+NTSTATUS WdfIoQueueFindRequest(_In_ WDFQUEUE Queue, _In_opt_ WDFREQUEST FoundRequest, _In_opt_ WDFFILEOBJECT FileObject, _Inout_opt_ PWDF_REQUEST_PARAMETERS Parameters, _Out_ WDFREQUEST* OutRequest);
+NTSTATUS WdfIoQueueRetrieveFoundRequest(_In_ WDFQUEUE Queue, _In_ WDFREQUEST FoundRequest, _Out_ WDFREQUEST* OutRequest);
+
+//
+// I/O targets and memory
+//
+typedef struct _WDFMEMORY_OFFSET {
+    size_t BufferOffset;
+    size_t BufferLength;
+} WDFMEMORY_OFFSET, *PWDFMEMORY_OFFSET;
+
+NTSTATUS WdfIoTargetFormatRequestForRead(_In_ WDFIOTARGET IoTarget, _In_ WDFREQUEST Request, _In_opt_ WDFMEMORY OutputBuffer, _In_opt_ PWDFMEMORY_OFFSET OutputBufferOffset, _In_opt_ PLONGLONG DeviceOffset);
+NTSTATUS WdfIoTargetFormatRequestForWrite(_In_ WDFIOTARGET IoTarget, _In_ WDFREQUEST Request, _In_opt_ WDFMEMORY InputBuffer, _In_opt_ PWDFMEMORY_OFFSET InputBufferOffset, _In_opt_ PLONGLONG DeviceOffset);
+
+NTSTATUS WdfMemoryCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES Attributes, _In_ POOL_TYPE PoolType, _In_opt_ ULONG PoolTag, _In_ size_t BufferSize, _Out_ WDFMEMORY* Memory, _Outptr_opt_ PVOID* Buffer);
+PVOID    WdfMemoryGetBuffer(_In_ WDFMEMORY Memory, _Out_opt_ size_t* BufferSize);
+
+//
+// Timers and work items
+//
+typedef VOID EVT_WDF_TIMER(_In_ WDFTIMER Timer);
+typedef EVT_WDF_TIMER* PFN_WDF_TIMER;
+
+typedef struct _WDF_TIMER_CONFIG {
+    ULONG         Size;
+    PFN_WDF_TIMER EvtTimerFunc;
+    ULONG         Period;
+    BOOLEAN       AutomaticSerialization;
+    ULONG         TolerableDelay;
+} WDF_TIMER_CONFIG, *PWDF_TIMER_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_TIMER_CONFIG_INIT(_Out_ PWDF_TIMER_CONFIG Config,
+                      _In_ PFN_WDF_TIMER      EvtTimerFunc)
+{
+    RtlZeroMemory(Config,
+                  sizeof(WDF_TIMER_CONFIG));
+
+    Config->Size                   = sizeof(WDF_TIMER_CONFIG);
+    Config->EvtTimerFunc           = EvtTimerFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS  WdfTimerCreate(_In_ PWDF_TIMER_CONFIG Config, _In_ PWDF_OBJECT_ATTRIBUTES Attributes, _Out_ WDFTIMER* Timer);
+BOOLEAN   WdfTimerStart(_In_ WDFTIMER Timer, _In_ LONGLONG DueTime);
+BOOLEAN   WdfTimerStop(_In_ WDFTIMER Timer, _In_ BOOLEAN Wait);
+WDFOBJECT WdfTimerGetParentObject(_In_ WDFTIMER Timer);
+
+typedef VOID EVT_WDF_WORKITEM(_In_ WDFWORKITEM WorkItem);
+typedef EVT_WDF_WORKITEM* PFN_WDF_WORKITEM;
+
+typedef struct _WDF_WORKITEM_CONFIG {
+    ULONG            Size;
+    PFN_WDF_WORKITEM EvtWorkItemFunc;
+    BOOLEAN          AutomaticSerialization;
+} WDF_WORKITEM_CONFIG, *PWDF_WORKITEM_CONFIG;
+
+FORCEINLINE
+VOID
+WDF_WORKITEM_CONFIG_INIT(_Out_ PWDF_WORKITEM_CONFIG Config,
+                         _In_ PFN_WDF_WORKITEM      EvtWorkItemFunc)
+{
+    RtlZeroMemory(Config,
+                  sizeof(WDF_WORKITEM_CONFIG));
+
+    Config->Size                   = sizeof(WDF_WORKITEM_CONFIG);
+    Config->EvtWorkItemFunc        = EvtWorkItemFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS  WdfWorkItemCreate(_In_ PWDF_WORKITEM_CONFIG Config, _In_ PWDF_OBJECT_ATTRIBUTES Attributes, _Out_ WDFWORKITEM* WorkItem);
+VOID      WdfWorkItemEnqueue(_In_ WDFWORKITEM WorkItem);
+VOID      WdfWorkItemFlush(_In_ WDFWORKITEM WorkItem);
+WDFOBJECT WdfWorkItemGetParentObject(_In_ WDFWORKITEM WorkItem);
+
+//
+// Locks
+//
+NTSTATUS WdfSpinLockCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES SpinLockAttributes, _Out_ WDFSPINLOCK* SpinLock);
+VOID     WdfSpinLockAcquire(_In_ WDFSPINLOCK SpinLock);
+VOID     WdfSpinLockRelease(_In_ WDFSPINLOCK SpinLock);
+
+NTSTATUS WdfWaitLockCreate(_In_opt_ PWDF_OBJECT_ATTRIBUTES LockAttributes, _Out_ WDFWAITLOCK* Lock);
+NTSTATUS WdfWaitLockAcquire(_In_ WDFWAITLOCK Lock, _In_opt_ PLONGLONG Timeout);
+VOID     WdfWaitLockRelease(_In_ WDFWAITLOCK Lock);
@@ -0,0 +1,898 @@
+///
+/// @file wdm.h
+///
+//
+// Copyright 2004-2020 OSR Open Systems Resources, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from this
+//    software without specific prior written permission.
+// 
+//    This software is supplied for instructional purposes only.  It is not
+//    complete, and it is not suitable for use in any production environment.
+//
+//    OSR Open Systems Resources, Inc. (OSR) expressly disclaims any warranty
+//    for this software.  THIS SOFTWARE IS PROVIDED  "AS IS" WITHOUT WARRANTY
+//    OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING, WITHOUT LIMITATION,
+//    THE IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR
+//    PURPOSE.  THE ENTIRE RISK ARISING FROM THE USE OF THIS SOFTWARE REMAINS
+//    WITH YOU.  OSR's entire liability and your exclusive remedy shall not
+//    exceed the price paid for this material.  In no event shall OSR or its
+//    suppliers be liable for any damages whatsoever (including, without
+//    limitation, damages for loss of business profit, business interruption,
+//    loss of business information, or any other pecuniary loss) arising out
+//    of the use or inability to use this software, even if OSR has been
+//    advised of the possibility of such damages.  Because some states/
+//    jurisdictions do not allow the exclusion or limitation of liability for
+//    consequential or incidental damages, the above limitation may not apply
+//    to you.
+//
+// Just enough of the kernel's <wdm.h> for GenFilter to build as part of
+// GenFilterSim, the user-mode harness.  The types have the fields GenFilter
+// uses (and a few Sim fields the shim needs), the inline routines are
+// implemented here with GCC builtins, and everything else is implemented in
+// GenFilterSimWdm.cpp.  This is NOT the WDK: only what GenFilter calls is
+// here, and only as faithfully as running it in user mode needs.
+
+#pragma once
+
+// ReSharper disable CppInconsistentNaming
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+//
+// <immintrin.h> (which <intrin.h> includes) brings in the C++ library,
+// which undefines min and max, so it has to come before we define them
+//
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//
+// The compiler's names for the architecture, as MSVC spells them, so that
+// GenFilter builds its SIMD kernels here too
+//
+#if defined(__x86_64__) && !defined(_M_X64)
+#define _M_X64                      100
+#define _M_AMD64                    100
+#elif defined(__i386__) && !defined(_M_IX86)
+#define _M_IX86                     600
+#endif
+
+//
+// SAL annotations, and the Microsoft extensions GenFilter uses
+//
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_to_(x,y)
+#define _Inout_updates_bytes_(x)
+#define _Outptr_
+#define _Outptr_opt_
+#define _Must_inspect_result_
+#define _Use_decl_annotations_
+#define _IRQL_requires_(x)
+#define _IRQL_requires_max_(x)
+#define _IRQL_raises_(x)
+#define _IRQL_saves_
+#define _IRQL_restores_
+#define _Requires_lock_held_(x)
+#define _Acquires_lock_(x)
+#define _Releases_lock_(x)
+#define _Function_class_(x)
+#define _Success_(x)
+#define _When_(a,b)
+#define _Ret_maybenull_
+#define _Post_writable_byte_size_(x)
+#define __drv_allocatesMem(x)
+#define __declspec(x)
+
+#define DECLSPEC_ALIGN(x)           alignas(x)
+#define DECLSPEC_CACHEALIGN         alignas(64)
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define PAGE_SIZE                   0x1000
+#define FORCEINLINE                 inline
+#define NTAPI
+#define UNALIGNED
+#define CONST                       const
+#define VOID                        void
+#define TRUE                        1
+#define FALSE                       0
+
+#define UNREFERENCED_PARAMETER(x)   ((void)(x))
+#define ARRAYSIZE(a)                (sizeof(a) / sizeof((a)[0]))
+#define RTL_NUMBER_OF(a)            ARRAYSIZE(a)
+#define FIELD_OFFSET(t, f)          offsetof(t, f)
+#define RTL_FIELD_SIZE(t, f)        (sizeof(((t*)0)->f))
+#define RTL_SIZEOF_THROUGH_FIELD(t, f) (FIELD_OFFSET(t, f) + RTL_FIELD_SIZE(t, f))
+#define CONTAINING_RECORD(a, t, f)  ((t*)((char*)(a) - offsetof(t, f)))
+#define ALIGN_UP_BY(l, a)           (((uintptr_t)(l) + (a) - 1) & ~((uintptr_t)(a) - 1))
+#define ALIGN_DOWN_BY(l, a)         ((uintptr_t)(l) & ~((uintptr_t)(a) - 1))
+#define C_ASSERT(e)                 static_assert(e, #e)
+#define NT_ASSERT(e)                ((void)0)
+#define ASSERT(e)                   ((void)0)
+
+#ifndef min
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+#endif
+
+#define MAXUCHAR                    0xff
+#define MAXUSHORT                   0xffff
+#define MAXULONG                    0xffffffffU
+#define MAXLONG                     0x7fffffffL
+#define MAXLONG64                   0x7fffffffffffffffLL
+#define MAXLONGLONG                 0x7fffffffffffffffLL
+#define MAXULONG64                  0xffffffffffffffffULL
+#define MAXULONGLONG                0xffffffffffffffffULL
+#define MAXSIZE_T                   SIZE_MAX
+
+//
+// Basic types.  LONG and ULONG are 32 bits, as they are on Windows.
+//
+typedef unsigned char      UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, BYTE;
+typedef char               CHAR, *PCHAR;
+typedef const char*        PCSTR;
+typedef short              SHORT;
+typedef unsigned short     USHORT, *PUSHORT;
+typedef wchar_t            WCHAR, *PWCHAR, *PWCH, *PWSTR;
+typedef const WCHAR*       PCWSTR;
+typedef const WCHAR*       PCWCH;
+typedef int                LONG, *PLONG, NTSTATUS, INT32, KPRIORITY;
+typedef unsigned int       ULONG, *PULONG, DWORD, UINT32;
+typedef long long          LONG64, *PLONG64, LONGLONG, *PLONGLONG, INT64;
+typedef unsigned long long ULONG64, *PULONG64, ULONGLONG, *PULONGLONG, UINT64, DWORD64;
+typedef intptr_t           LONG_PTR;
+typedef uintptr_t          ULONG_PTR, *PULONG_PTR, UINT_PTR, SIZE_T, *PSIZE_T, KAFFINITY;
+typedef void*              PVOID, **PPVOID, *HANDLE, **PHANDLE;
+typedef const void*        PCVOID;
+typedef UCHAR              KIRQL, *PKIRQL;
+typedef ULONG              LOGICAL;
+typedef ULONG              ACCESS_MASK;
+typedef ULONG              PFN_NUMBER;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG  HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;              // In bytes, not including any terminator
+    USHORT MaximumLength;
+    PWSTR  Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING* PCUNICODE_STRING;
+
+#define RTL_CONSTANT_STRING(s)  { sizeof(s) - sizeof((s)[0]), sizeof(s), (PWSTR)(s) }
+
+#define DECLARE_CONST_UNICODE_STRING(n, s) \
+    const UNICODE_STRING n = RTL_CONSTANT_STRING(s)
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _SLIST_ENTRY {
+    struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+//
+// Status codes
+//
+#define NT_SUCCESS(s)                       (((NTSTATUS)(s)) >= 0)
+
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                      ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                      ((NTSTATUS)0x00000103L)
+#define STATUS_CONTINUE_COMPLETION          STATUS_SUCCESS
+#define STATUS_BUFFER_OVERFLOW              ((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY                  ((NTSTATUS)0x80000011L)
+#define STATUS_VERIFY_REQUIRED              ((NTSTATUS)0x80000016L)
+#define STATUS_NO_MORE_ENTRIES              ((NTSTATUS)0x8000001AL)
+#define STATUS_MEDIA_CHANGED                ((NTSTATUS)0x8000001CL)
+#define STATUS_BUS_RESET                    ((NTSTATUS)0x8000001DL)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED              ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE               ((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST       ((NTSTATUS)0xC0000010L)
+#define STATUS_END_OF_FILE                  ((NTSTATUS)0xC0000011L)
+#define STATUS_NO_MEDIA_IN_DEVICE           ((NTSTATUS)0xC0000013L)
+#define STATUS_MORE_PROCESSING_REQUIRED     ((NTSTATUS)0xC0000016L)
+#define STATUS_ACCESS_DENIED                ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND        ((NTSTATUS)0xC0000034L)
+#define STATUS_CRC_ERROR                    ((NTSTATUS)0xC000003FL)
+#define STATUS_QUOTA_EXCEEDED               ((NTSTATUS)0xC0000044L)
+#define STATUS_DELETE_PENDING               ((NTSTATUS)0xC0000056L)
+#define STATUS_REVISION_MISMATCH            ((NTSTATUS)0xC0000059L)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_DATA_ERROR            ((NTSTATUS)0xC000009CL)
+#define STATUS_DEVICE_NOT_CONNECTED         ((NTSTATUS)0xC000009DL)
+#define STATUS_DEVICE_NOT_READY             ((NTSTATUS)0xC00000A3L)
+#define STATUS_IO_TIMEOUT                   ((NTSTATUS)0xC00000B5L)
+#define STATUS_CANCELLED                    ((NTSTATUS)0xC0000120L)
+#define STATUS_IO_DEVICE_ERROR              ((NTSTATUS)0xC0000185L)
+#define STATUS_INVALID_DEVICE_STATE         ((NTSTATUS)0xC0000184L)
+#define STATUS_NOT_FOUND                    ((NTSTATUS)0xC0000225L)
+#define STATUS_RETRY                        ((NTSTATUS)0xC000022DL)
+#define STATUS_CONTENT_BLOCKED              ((NTSTATUS)0xC000048AL)
+
+//
+// IRQLs, processor groups, and the odd constant
+//
+#define PASSIVE_LEVEL               0
+#define APC_LEVEL                   1
+#define DISPATCH_LEVEL              2
+#define HIGH_LEVEL                  15
+
+#define ALL_PROCESSOR_GROUPS        0xffff
+#define IO_NO_INCREMENT             0
+#define LOW_REALTIME_PRIORITY       16
+#define THREAD_ALL_ACCESS           0x001fffffUL
+#define OBJ_KERNEL_HANDLE           0x00000200UL
+#define XSTATE_MASK_LEGACY          0x3ULL
+#define XSTATE_MASK_AVX             0x4ULL
+#define DO_VERIFY_VOLUME            0x00000002UL
+#define DO_DIRECT_IO                0x00000010UL
+#define DO_BUFFERED_IO              0x00000004UL
+
+typedef enum _POOL_TYPE {
+    NonPagedPool    = 0,
+    PagedPool       = 1,
+    NonPagedPoolNx  = 512,
+} POOL_TYPE;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode,
+} KPROCESSOR_MODE, MODE;
+
+typedef enum _KWAIT_REASON {
+    Executive,
+} KWAIT_REASON;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent,
+} EVENT_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority     = 0,
+    NormalPagePriority  = 16,
+    HighPagePriority    = 32,
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoWrite   0x80000000
+#define MdlMappingNoExecute 0x40000000
+
+//
+// Dispatcher objects.  Sim is where GenFilterSimWdm.cpp keeps the lock and
+// condition variable a wait is built on.
+//
+typedef struct _DISPATCHER_HEADER {
+    UCHAR         Type;
+    UCHAR         Reserved[3];
+    volatile LONG SignalState;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT {
+    DISPATCHER_HEADER Header;
+    ULONG_PTR         Sim[16];
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KSEMAPHORE {
+    DISPATCHER_HEADER Header;
+    LONG              Limit;
+    ULONG_PTR         Sim[16];
+} KSEMAPHORE, *PKSEMAPHORE, *PRKSEMAPHORE;
+
+typedef ULONG_PTR     KSPIN_LOCK, *PKSPIN_LOCK;
+typedef volatile LONG EX_SPIN_LOCK, *PEX_SPIN_LOCK;
+
+typedef struct _KTHREAD*       PKTHREAD;
+typedef struct _KTHREAD*       PETHREAD;
+typedef struct _EPROCESS*      PEPROCESS;
+typedef struct _OBJECT_TYPE*   POBJECT_TYPE;
+typedef struct _DRIVER_OBJECT* PDRIVER_OBJECT;
+typedef struct _FILE_OBJECT*   PFILE_OBJECT;
+
+extern POBJECT_TYPE* PsThreadType;
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG           Length;
+    HANDLE          RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG           Attributes;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(p, n, a, r, s) \
+    ((p)->Length = sizeof(OBJECT_ATTRIBUTES),     \
+     (p)->RootDirectory = (r),                    \
+     (p)->ObjectName = (n),                       \
+     (p)->Attributes = (a))
+
+typedef struct _CLIENT_ID {
+    HANDLE UniqueProcess;
+    HANDLE UniqueThread;
+} CLIENT_ID, *PCLIENT_ID;
+
+typedef VOID KSTART_ROUTINE(_In_ PVOID StartContext);
+typedef KSTART_ROUTINE* PKSTART_ROUTINE;
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+typedef struct _XSTATE_SAVE {
+    ULONG64 Mask;
+} XSTATE_SAVE, *PXSTATE_SAVE;
+
+//
+// MDLs.  There is only one address space, so an MDL is just the address
+// and length of the buffer it describes.
+//
+typedef struct _MDL {
+    struct _MDL* Next;
+    SHORT        Size;
+    SHORT        MdlFlags;
+    PVOID        MappedSystemVa;
+    PVOID        StartVa;
+    ULONG        ByteCount;
+    ULONG        ByteOffset;
+} MDL, *PMDL;
+
+//
+// IRPs.  An IRP has GENFILTER_SIM_IRP_STACK_SIZE stack locations (enough for
+// whoever sends it, our filter, and the device below), used from the top
+// down as they are in the kernel.  The Sim fields are the shim's.
+//
+typedef struct _DEVICE_OBJECT* PDEVICE_OBJECT;
+typedef struct _IRP*           PIRP;
+
+typedef NTSTATUS IO_COMPLETION_ROUTINE(_In_ PDEVICE_OBJECT DeviceObject,
+                                       _In_ PIRP           Irp,
+                                       _In_opt_ PVOID      Context);
+typedef IO_COMPLETION_ROUTINE* PIO_COMPLETION_ROUTINE;
+
+typedef NTSTATUS DRIVER_DISPATCH(_In_ PDEVICE_OBJECT DeviceObject,
+                                 _Inout_ PIRP        Irp);
+typedef DRIVER_DISPATCH* PDRIVER_DISPATCH;
+
+typedef NTSTATUS DRIVER_INITIALIZE(_In_ PDRIVER_OBJECT  DriverObject,
+                                   _In_ PUNICODE_STRING RegistryPath);
+
+typedef struct _DEVICE_OBJECT {
+    ULONG            Flags;
+    ULONG            Characteristics;
+    PDRIVER_DISPATCH SimDispatch;
+    PVOID            SimContext;
+} DEVICE_OBJECT;
+
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS  Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+#define IRP_MJ_CREATE                   0x00
+#define IRP_MJ_CLOSE                    0x02
+#define IRP_MJ_READ                     0x03
+#define IRP_MJ_WRITE                    0x04
+#define IRP_MJ_DEVICE_CONTROL           0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL  0x0f
+#define IRP_MJ_MAXIMUM_FUNCTION         0x1b
+
+#define SL_OVERRIDE_VERIFY_VOLUME       0x02
+
+#define SL_INVOKE_ON_CANCEL             0x20
+#define SL_INVOKE_ON_SUCCESS            0x40
+#define SL_INVOKE_ON_ERROR              0x80
+
+typedef struct _IO_STACK_LOCATION {
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR Flags;
+    UCHAR Control;
+
+    union {
+        struct {
+            ULONG         Length;
+            ULONG         Key;
+            LARGE_INTEGER ByteOffset;
+        } Read;
+
+        struct {
+            ULONG         Length;
+            ULONG         Key;
+            LARGE_INTEGER ByteOffset;
+        } Write;
+
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+            PVOID Type3InputBuffer;
+        } DeviceIoControl;
+
+        struct {
+            PVOID Argument1;
+            PVOID Argument2;
+            PVOID Argument3;
+            PVOID Argument4;
+        } Others;
+    } Parameters;
+
+    PDEVICE_OBJECT         DeviceObject;
+    PFILE_OBJECT           FileObject;
+    PIO_COMPLETION_ROUTINE CompletionRoutine;
+    PVOID                  Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+#define GENFILTER_SIM_IRP_STACK_SIZE 4
+
+typedef VOID GENFILTER_SIM_IRP_COMPLETION(_In_ PIRP Irp, _In_opt_ PVOID Context);
+typedef GENFILTER_SIM_IRP_COMPLETION* PGENFILTER_SIM_IRP_COMPLETION;
+
+typedef struct _IRP {
+    PMDL            MdlAddress;
+    IO_STATUS_BLOCK IoStatus;
+    KPROCESSOR_MODE RequestorMode;
+    BOOLEAN         PendingReturned;
+    PVOID           UserBuffer;
+
+    union {
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+
+    //
+    // The shim's: the current stack location, the stack, and who to tell
+    // when the IRP has been completed all the way up (what the I/O manager
+    // does for a real one)
+    //
+    PIO_STACK_LOCATION            SimCurrentLocation;
+    IO_STACK_LOCATION             SimStack[GENFILTER_SIM_IRP_STACK_SIZE];
+    ULONG                         SimProcessId;
+    PGENFILTER_SIM_IRP_COMPLETION SimCompletion;
+    PVOID                         SimCompletionContext;
+} IRP;
+
+//
+// Control codes
+//
+#define FILE_DEVICE_CD_ROM          0x00000002
+#define FILE_DEVICE_CONTROLLER      0x00000004
+#define FILE_DEVICE_DISK            0x00000007
+#define FILE_DEVICE_UNKNOWN         0x00000022
+#define FILE_DEVICE_MASS_STORAGE    0x0000002d
+
+#define METHOD_BUFFERED             0
+#define METHOD_IN_DIRECT            1
+#define METHOD_OUT_DIRECT           2
+#define METHOD_NEITHER              3
+
+#define FILE_ANY_ACCESS             0
+#define FILE_READ_ACCESS            0x0001
+#define FILE_WRITE_ACCESS           0x0002
+
+#define CTL_CODE(t, f, m, a)            (((t) << 16) | ((a) << 14) | ((f) << 2) | (m))
+#define DEVICE_TYPE_FROM_CTL_CODE(c)    (((ULONG)(c) & 0xffff0000) >> 16)
+#define METHOD_FROM_CTL_CODE(c)         ((ULONG)((c) & 3))
+
+//
+// Memory and strings
+//
+#define RtlCopyMemory(d, s, l)      memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)      memmove((d), (s), (l))
+#define RtlZeroMemory(d, l)         memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)      memset((d), (f), (l))
+#define RtlEqualMemory(a, b, l)     (memcmp((a), (b), (l)) == 0)
+
+FORCEINLINE
+SIZE_T
+RtlCompareMemory(_In_ const VOID* Source1,
+                 _In_ const VOID* Source2,
+                 _In_ SIZE_T      Length)
+{
+    SIZE_T index = 0;
+
+    while (index < Length &&
+           ((const UCHAR*)Source1)[index] == ((const UCHAR*)Source2)[index]) {
+        index++;
+    }
+
+    return index;
+}
+
+FORCEINLINE
+VOID
+RtlInitUnicodeString(_Out_ PUNICODE_STRING DestinationString,
+                     _In_opt_ PCWSTR       SourceString)
+{
+    SIZE_T length = SourceString != nullptr ? wcslen(SourceString) * sizeof(WCHAR) : 0;
+
+    DestinationString->Length        = (USHORT)length;
+    DestinationString->MaximumLength = (USHORT)(SourceString != nullptr ? length + sizeof(WCHAR) : 0);
+    DestinationString->Buffer        = (PWSTR)SourceString;
+}
+
+NTSTATUS
+RtlUnicodeStringToInteger(_In_ PCUNICODE_STRING String,
+                          _In_opt_ ULONG        Base,
+                          _Out_ PULONG          Value);
+
+//
+// Doubly linked lists
+//
+FORCEINLINE
+VOID
+InitializeListHead(_Out_ PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE
+BOOLEAN
+IsListEmpty(_In_ const LIST_ENTRY* ListHead)
+{
+    return ListHead->Flink == ListHead;
+}
+
+FORCEINLINE
+BOOLEAN
+RemoveEntryList(_In_ PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY flink = Entry->Flink;
+    PLIST_ENTRY blink = Entry->Blink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+
+    return flink == blink;
+}
+
+FORCEINLINE
+PLIST_ENTRY
+RemoveHeadList(_Inout_ PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY entry = ListHead->Flink;
+
+    RemoveEntryList(entry);
+
+    return entry;
+}
+
+FORCEINLINE
+VOID
+InsertTailList(_Inout_ PLIST_ENTRY ListHead,
+               _Out_ PLIST_ENTRY   Entry)
+{
+    PLIST_ENTRY blink = ListHead->Blink;
+
+    Entry->Flink    = ListHead;
+    Entry->Blink    = blink;
+    blink->Flink    = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE
+VOID
+InsertHeadList(_Inout_ PLIST_ENTRY ListHead,
+               _Out_ PLIST_ENTRY   Entry)
+{
+    PLIST_ENTRY flink = ListHead->Flink;
+
+    Entry->Flink    = flink;
+    Entry->Blink    = ListHead;
+    flink->Blink    = Entry;
+    ListHead->Flink = Entry;
+}
+
+//
+// Interlocked operations and ordered reads and writes.  Interlocked
+// operations are full barriers, as they are on x64.
+//
+FORCEINLINE LONG InterlockedIncrement(_Inout_ volatile LONG* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedDecrement(_Inout_ volatile LONG* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedAdd(_Inout_ volatile LONG* Addend, _In_ LONG Value) { return __atomic_add_fetch(Addend, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchangeAdd(_Inout_ volatile LONG* Addend, _In_ LONG Value) { return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedExchange(_Inout_ volatile LONG* Target, _In_ LONG Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedOr(_Inout_ volatile LONG* Target, _In_ LONG Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedAnd(_Inout_ volatile LONG* Target, _In_ LONG Value) { return __atomic_fetch_and(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG InterlockedIncrementNoFence(_Inout_ volatile LONG* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONG InterlockedDecrementNoFence(_Inout_ volatile LONG* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONG InterlockedAddNoFence(_Inout_ volatile LONG* Addend, _In_ LONG Value) { return __atomic_add_fetch(Addend, Value, __ATOMIC_RELAXED); }
+
+FORCEINLINE LONG64 InterlockedIncrement64(_Inout_ volatile LONG64* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedDecrement64(_Inout_ volatile LONG64* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedAdd64(_Inout_ volatile LONG64* Addend, _In_ LONG64 Value) { return __atomic_add_fetch(Addend, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchangeAdd64(_Inout_ volatile LONG64* Addend, _In_ LONG64 Value) { return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedExchange64(_Inout_ volatile LONG64* Target, _In_ LONG64 Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedOr64(_Inout_ volatile LONG64* Target, _In_ LONG64 Value) { return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST); }
+FORCEINLINE LONG64 InterlockedIncrementNoFence64(_Inout_ volatile LONG64* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 InterlockedAddNoFence64(_Inout_ volatile LONG64* Addend, _In_ LONG64 Value) { return __atomic_add_fetch(Addend, Value, __ATOMIC_RELAXED); }
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange(_Inout_ volatile LONG* Destination,
+                           _In_ LONG              Exchange,
+                           _In_ LONG              Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE
+LONG64
+InterlockedCompareExchange64(_Inout_ volatile LONG64* Destination,
+                             _In_ LONG64              Exchange,
+                             _In_ LONG64              Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedCompareExchangePointer(_Inout_ PVOID volatile* Destination,
+                                  _In_opt_ PVOID          Exchange,
+                                  _In_opt_ PVOID          Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedExchangePointer(_Inout_ PVOID volatile* Target,
+                           _In_opt_ PVOID          Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG ReadNoFence(_In_ const volatile LONG* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG ReadAcquire(_In_ const volatile LONG* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WriteNoFence(_Out_ volatile LONG* Destination, _In_ LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease(_Out_ volatile LONG* Destination, _In_ LONG Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE LONG64 ReadNoFence64(_In_ const volatile LONG64* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE LONG64 ReadAcquire64(_In_ const volatile LONG64* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WriteNoFence64(_Out_ volatile LONG64* Destination, _In_ LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WriteRelease64(_Out_ volatile LONG64* Destination, _In_ LONG64 Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+FORCEINLINE PVOID ReadPointerNoFence(_In_ PVOID const volatile* Source) { return __atomic_load_n(Source, __ATOMIC_RELAXED); }
+FORCEINLINE PVOID ReadPointerAcquire(_In_ PVOID const volatile* Source) { return __atomic_load_n(Source, __ATOMIC_ACQUIRE); }
+FORCEINLINE VOID WritePointerNoFence(_Out_ PVOID volatile* Destination, _In_opt_ PVOID Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELAXED); }
+FORCEINLINE VOID WritePointerRelease(_Out_ PVOID volatile* Destination, _In_opt_ PVOID Value) { __atomic_store_n(Destination, Value, __ATOMIC_RELEASE); }
+
+FORCEINLINE VOID KeMemoryBarrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+FORCEINLINE VOID MemoryBarrier() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+FORCEINLINE VOID _ReadWriteBarrier() { __atomic_signal_fence(__ATOMIC_SEQ_CST); }
+FORCEINLINE VOID YieldProcessor() { __builtin_ia32_pause(); }
+
+FORCEINLINE
+BOOLEAN
+BitScanReverse(_Out_ PULONG Index,
+               _In_ ULONG   Mask)
+{
+    if (Mask == 0) {
+        return FALSE;
+    }
+
+    *Index = 31 - (ULONG)__builtin_clz(Mask);
+    return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+BitScanReverse64(_Out_ PULONG Index,
+                 _In_ ULONG64 Mask)
+{
+    if (Mask == 0) {
+        return FALSE;
+    }
+
+    *Index = 63 - (ULONG)__builtin_clzll(Mask);
+    return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+BitScanForward(_Out_ PULONG Index,
+               _In_ ULONG   Mask)
+{
+    if (Mask == 0) {
+        return FALSE;
+    }
+
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return TRUE;
+}
+
+FORCEINLINE ULONG64 ReadTimeStampCounter() { return __builtin_ia32_rdtsc(); }
+
+//
+// Processors, IRQL and time (GenFilterSimWdm.cpp).  The "processor" is the
+// CPU the calling thread is on right now, and IRQL is a per-thread value
+// that nothing enforces.
+//
+ULONG KeQueryMaximumProcessorCountEx(_In_ USHORT GroupNumber);
+ULONG KeQueryActiveProcessorCountEx(_In_ USHORT GroupNumber);
+ULONG KeGetCurrentProcessorNumberEx(_Out_opt_ PPROCESSOR_NUMBER ProcNumber);
+
+KIRQL KeGetCurrentIrql();
+VOID  KeRaiseIrql(_In_ KIRQL NewIrql, _Out_ PKIRQL OldIrql);
+VOID  KeLowerIrql(_In_ KIRQL NewIrql);
+KIRQL KeRaiseIrqlToDpcLevel();
+
+LARGE_INTEGER KeQueryPerformanceCounter(_Out_opt_ PLARGE_INTEGER PerformanceFrequency);
+ULONGLONG     KeQueryInterruptTime();
+VOID          KeQuerySystemTime(_Out_ PLARGE_INTEGER CurrentTime);
+
+NTSTATUS KeSaveExtendedProcessorState(_In_ ULONG64 Mask, _Out_ PXSTATE_SAVE XStateSave);
+VOID     KeRestoreExtendedProcessorState(_In_ PXSTATE_SAVE XStateSave);
+
+//
+// Spin locks
+//
+KIRQL ExAcquireSpinLockShared(_Inout_ PEX_SPIN_LOCK SpinLock);
+VOID  ExReleaseSpinLockShared(_Inout_ PEX_SPIN_LOCK SpinLock, _In_ KIRQL OldIrql);
+KIRQL ExAcquireSpinLockExclusive(_Inout_ PEX_SPIN_LOCK SpinLock);
+VOID  ExReleaseSpinLockExclusive(_Inout_ PEX_SPIN_LOCK SpinLock, _In_ KIRQL OldIrql);
+
+VOID KeInitializeSpinLock(_Out_ PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(_Inout_ PKSPIN_LOCK SpinLock, _Out_ PKIRQL OldIrql);
+VOID KeReleaseSpinLock(_Inout_ PKSPIN_LOCK SpinLock, _In_ KIRQL NewIrql);
+
+//
+// Waiting, and system threads
+//
+VOID     KeInitializeEvent(_Out_ PRKEVENT Event, _In_ EVENT_TYPE Type, _In_ BOOLEAN State);
+LONG     KeSetEvent(_Inout_ PRKEVENT Event, _In_ KPRIORITY Increment, _In_ BOOLEAN Wait);
+VOID     KeClearEvent(_Inout_ PRKEVENT Event);
+VOID     KeInitializeSemaphore(_Out_ PRKSEMAPHORE Semaphore, _In_ LONG Count, _In_ LONG Limit);
+LONG     KeReleaseSemaphore(_Inout_ PRKSEMAPHORE Semaphore, _In_ KPRIORITY Increment, _In_ LONG Adjustment, _In_ BOOLEAN Wait);
+NTSTATUS KeWaitForSingleObject(_In_ PVOID Object, _In_ KWAIT_REASON WaitReason, _In_ KPROCESSOR_MODE WaitMode, _In_ BOOLEAN Alertable, _In_opt_ PLARGE_INTEGER Timeout);
+NTSTATUS KeDelayExecutionThread(_In_ KPROCESSOR_MODE WaitMode, _In_ BOOLEAN Alertable, _In_ PLARGE_INTEGER Interval);
+
+NTSTATUS PsCreateSystemThread(_Out_ PHANDLE ThreadHandle, _In_ ULONG DesiredAccess, _In_opt_ POBJECT_ATTRIBUTES ObjectAttributes, _In_opt_ HANDLE ProcessHandle, _Out_opt_ PCLIENT_ID ClientId, _In_ PKSTART_ROUTINE StartRoutine, _In_opt_ PVOID StartContext);
+NTSTATUS PsTerminateSystemThread(_In_ NTSTATUS ExitStatus);
+NTSTATUS ObReferenceObjectByHandle(_In_ HANDLE Handle, _In_ ACCESS_MASK DesiredAccess, _In_opt_ POBJECT_TYPE ObjectType, _In_ KPROCESSOR_MODE AccessMode, _Out_ PVOID* Object, _Out_opt_ PVOID HandleInformation);
+VOID     ObDereferenceObject(_In_ PVOID Object);
+NTSTATUS ZwClose(_In_ HANDLE Handle);
+
+//
+// Pool
+//
+PVOID ExAllocatePoolWithTag(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _In_ ULONG Tag);
+VOID  ExFreePoolWithTag(_In_ PVOID P, _In_ ULONG Tag);
+
+//
+// MDLs
+//
+#define BYTE_OFFSET(va)                 ((ULONG)((ULONG_PTR)(va) & (PAGE_SIZE - 1)))
+#define PAGE_ALIGN(va)                  ((PVOID)((ULONG_PTR)(va) & ~((ULONG_PTR)PAGE_SIZE - 1)))
+#define ADDRESS_AND_SIZE_TO_SPAN_PAGES(va, size) \
+    ((ULONG)((((ULONG_PTR)(va) & (PAGE_SIZE - 1)) + (size) + (PAGE_SIZE - 1)) / PAGE_SIZE))
+
+FORCEINLINE
+SIZE_T
+MmSizeOfMdl(_In_opt_ PVOID Base,
+            _In_ SIZE_T    Length)
+{
+    return sizeof(MDL) + ADDRESS_AND_SIZE_TO_SPAN_PAGES(Base, Length) * sizeof(PFN_NUMBER);
+}
+
+FORCEINLINE
+VOID
+MmInitializeMdl(_Out_ PMDL    Mdl,
+                _In_opt_ PVOID BaseVa,
+                _In_ SIZE_T    Length)
+{
+    Mdl->Next           = nullptr;
+    Mdl->Size           = (SHORT)MmSizeOfMdl(BaseVa, Length);
+    Mdl->MdlFlags       = 0;
+    Mdl->MappedSystemVa = nullptr;
+    Mdl->StartVa        = PAGE_ALIGN(BaseVa);
+    Mdl->ByteOffset     = BYTE_OFFSET(BaseVa);
+    Mdl->ByteCount      = (ULONG)Length;
+}
+
+FORCEINLINE PVOID MmGetMdlVirtualAddress(_In_ PMDL Mdl) { return (PUCHAR)Mdl->StartVa + Mdl->ByteOffset; }
+FORCEINLINE ULONG MmGetMdlByteCount(_In_ PMDL Mdl) { return Mdl->ByteCount; }
+FORCEINLINE ULONG MmGetMdlByteOffset(_In_ PMDL Mdl) { return Mdl->ByteOffset; }
+FORCEINLINE PVOID MmGetSystemAddressForMdlSafe(_In_ PMDL Mdl, _In_ ULONG Priority) { UNREFERENCED_PARAMETER(Priority); return MmGetMdlVirtualAddress(Mdl); }
+FORCEINLINE VOID  MmPrepareMdlForReuse(_Inout_ PMDL Mdl) { Mdl->MappedSystemVa = nullptr; }
+FORCEINLINE VOID  MmBuildMdlForNonPagedPool(_Inout_ PMDL Mdl) { Mdl->MappedSystemVa = MmGetMdlVirtualAddress(Mdl); }
+
+FORCEINLINE
+VOID
+IoBuildPartialMdl(_In_ PMDL     SourceMdl,
+                  _Inout_ PMDL  TargetMdl,
+                  _In_ PVOID    VirtualAddress,
+                  _In_ ULONG    Length)
+{
+    if (Length == 0) {
+        Length = SourceMdl->ByteCount -
+                 (ULONG)((PUCHAR)VirtualAddress - (PUCHAR)MmGetMdlVirtualAddress(SourceMdl));
+    }
+
+    TargetMdl->StartVa    = PAGE_ALIGN(VirtualAddress);
+    TargetMdl->ByteOffset = BYTE_OFFSET(VirtualAddress);
+    TargetMdl->ByteCount  = Length;
+}
+
+PMDL IoAllocateMdl(_In_opt_ PVOID VirtualAddress, _In_ ULONG Length, _In_ BOOLEAN SecondaryBuffer, _In_ BOOLEAN ChargeQuota, _Inout_opt_ PIRP Irp);
+VOID IoFreeMdl(_In_ PMDL Mdl);
+
+//
+// IRPs
+//
+FORCEINLINE PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(_In_ PIRP Irp) { return Irp->SimCurrentLocation; }
+FORCEINLINE PIO_STACK_LOCATION IoGetNextIrpStackLocation(_In_ PIRP Irp) { return Irp->SimCurrentLocation - 1; }
+FORCEINLINE VOID IoSkipCurrentIrpStackLocation(_Inout_ PIRP Irp) { Irp->SimCurrentLocation++; }
+
+FORCEINLINE
+VOID
+IoCopyCurrentIrpStackLocationToNext(_Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION next = IoGetNextIrpStackLocation(Irp);
+
+    *next                   = *IoGetCurrentIrpStackLocation(Irp);
+    next->CompletionRoutine = nullptr;
+    next->Context           = nullptr;
+    next->Control           = 0;
+}
+
+FORCEINLINE
+VOID
+IoSetCompletionRoutine(_In_ PIRP                   Irp,
+                       _In_ PIO_COMPLETION_ROUTINE CompletionRoutine,
+                       _In_opt_ PVOID              Context,
+                       _In_ BOOLEAN                InvokeOnSuccess,
+                       _In_ BOOLEAN                InvokeOnError,
+                       _In_ BOOLEAN                InvokeOnCancel)
+{
+    PIO_STACK_LOCATION next = IoGetNextIrpStackLocation(Irp);
+
+    next->CompletionRoutine = CompletionRoutine;
+    next->Context           = Context;
+    next->Control           = (UCHAR)((InvokeOnSuccess ? SL_INVOKE_ON_SUCCESS : 0) |
+                                      (InvokeOnError ? SL_INVOKE_ON_ERROR : 0) |
+                                      (InvokeOnCancel ? SL_INVOKE_ON_CANCEL : 0));
+}
+
+NTSTATUS IoCallDriver(_In_ PDEVICE_OBJECT DeviceObject, _Inout_ PIRP Irp);
+VOID     IoCompleteRequest(_In_ PIRP Irp, _In_ UCHAR PriorityBoost);
+ULONG    IoGetRequestorProcessId(_In_ PIRP Irp);
+
+//
+// Debug output
+//
+ULONG DbgPrint(_In_ PCSTR Format, ...);